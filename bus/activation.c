@@ -28,6 +28,7 @@
 #include "activation-exit-codes.h"
 #include "desktop-file.h"
 #include "dispatch.h"
+#include "expirelist.h"
 #include "services.h"
 #include "test.h"
 #include "utils.h"
@@ -36,7 +37,6 @@
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-shell.h>
 #include <dbus/dbus-spawn.h>
-#include <dbus/dbus-timeout.h>
 #include <dbus/dbus-sysdeps.h>
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
@@ -47,6 +47,9 @@ struct BusActivation
   int refcount;
   DBusHashTable *entries;
   DBusHashTable *pending_activations;
+  BusExpireList *pending_expire; /**< Deadlines of all pending activations,
+                                  * under a single timeout
+                                  */
   char *server_address;
   BusContext *context;
   int n_pending_activations; /**< This is in fact the number of BusPendingActivationEntry,
@@ -55,13 +58,37 @@ struct BusActivation
                               */
   DBusHashTable *directories;
   DBusHashTable *environment;
+  DBusHashTable *negative_cache; /**< Names that no .service file provided
+                                  * when the service directories were last
+                                  * scanned
+                                  */
+  char *cache_file;            /**< Where to keep parsed .service files, or NULL */
+  DBusMessage *cache;          /**< Contents of cache_file while (re)loading */
+  DBusHashTable *cached_files; /**< Full path => BusCachedServiceFile
+                                * pointing into cache, while (re)loading
+                                */
+  int n_cache_hits;            /**< Entries of cached_files that were valid */
+  DBusList *recent_services;   /**< Names of services recently started on
+                                * request, most recent first
+                                */
+  unsigned int cache_stale : 1; /**< TRUE if cache_file must be rewritten */
+  unsigned int recent_services_changed : 1; /**< TRUE if recent_services
+                                             * has not been saved yet
+                                             */
 };
 
+/* Upper bound on the number of remembered activation misses, so that a
+ * client asking for random names cannot make the cache grow forever.
+ */
+#define MAX_NEGATIVE_CACHE_ENTRIES 1024
+
 typedef struct
 {
   int refcount;
   char *dir_c;
   DBusHashTable *entries;
+  unsigned long mtime; /**< mtime of the directory when it was last scanned */
+  unsigned int mtime_valid : 1; /**< TRUE if mtime can be trusted */
 } BusServiceDirectory;
 
 typedef struct
@@ -72,21 +99,53 @@ typedef struct
   char *user;
   char *systemd_service;
   unsigned long mtime;
+  unsigned long inode;
+  unsigned long size;
   BusServiceDirectory *s_dir;
   char *filename;
+  unsigned int prestart : 1; /**< TRUE if started along with the bus */
 } BusActivationEntry;
 
+/* One .service file as stored in the service cache. The strings point
+ * into the demarshalled cache message.
+ */
+typedef struct
+{
+  dbus_uint64_t mtime;
+  dbus_uint64_t inode;
+  dbus_uint64_t size;
+  const char *name;
+  const char *exec;
+  const char *user;            /**< NULL if not set */
+  const char *systemd_service; /**< NULL if not set */
+  dbus_bool_t prestart;
+} BusCachedServiceFile;
+
+/* The service cache is a D-Bus message, so that dbus_message_demarshal()
+ * validates it for us. Its body is the format version followed by one
+ * struct per .service file: full path, mtime, inode number, size, flags,
+ * Name, Exec, User, SystemdService. Unset optional keys are stored as ""
+ * with their flag cleared. Last comes the list of recently started
+ * services, most recent first. Bump the version if any of this changes.
+ */
+#define SERVICE_CACHE_VERSION "2 " DBUS_VERSION_STRING
+#define SERVICE_CACHE_SIGNATURE "sa(stttyssss)as"
+#define SERVICE_CACHE_HAS_USER (1 << 0)
+#define SERVICE_CACHE_HAS_SYSTEMD_SERVICE (1 << 1)
+#define SERVICE_CACHE_PRESTART (1 << 2)
+
 typedef struct BusPendingActivationEntry BusPendingActivationEntry;
 
 struct BusPendingActivationEntry
 {
   /* Normally a method call, but if connection is NULL, this is a signal
-   * instead.
+   * instead, or NULL if the service is being started ahead of time.
    */
   DBusMessage *activation_message;
   /* NULL if this activation entry is for the dbus-daemon itself,
-   * waiting for systemd to start. In this case, auto_activation is always
-   * TRUE.
+   * waiting for systemd to start, or starting a service ahead of time.
+   * In the former case, auto_activation is always TRUE, in the latter
+   * always FALSE.
    */
   DBusConnection *connection;
 
@@ -95,6 +154,7 @@ struct BusPendingActivationEntry
 
 typedef struct
 {
+  BusExpireItem expire_item;
   int refcount;
   BusActivation *activation;
   char *service_name;
@@ -103,8 +163,7 @@ typedef struct
   DBusList *entries;
   int n_entries;
   DBusBabysitter *babysitter;
-  DBusTimeout *timeout;
-  unsigned int timeout_added : 1;
+  DBusList *expire_link; /**< Our link in activation->pending_expire, or NULL */
 } BusPendingActivation;
 
 #if 0
@@ -173,16 +232,13 @@ bus_pending_activation_unref (BusPendingActivation *pending_activation)
   if (pending_activation->refcount > 0)
     return;
 
-  if (pending_activation->timeout_added)
+  if (pending_activation->expire_link != NULL)
     {
-      _dbus_loop_remove_timeout (bus_context_get_loop (pending_activation->activation->context),
-                                 pending_activation->timeout);
-      pending_activation->timeout_added = FALSE;
+      bus_expire_list_remove_link (pending_activation->activation->pending_expire,
+                                   pending_activation->expire_link);
+      pending_activation->expire_link = NULL;
     }
 
-  if (pending_activation->timeout)
-    _dbus_timeout_unref (pending_activation->timeout);
-
   if (pending_activation->babysitter)
     {
       if (!_dbus_babysitter_set_watch_functions (pending_activation->babysitter,
@@ -248,116 +304,27 @@ bus_activation_entry_unref (BusActivationEntry *entry)
   dbus_free (entry);
 }
 
+/* Adds or updates the entry for one service file. Takes ownership of
+ * name, exec, user and systemd_service, even on failure.
+ */
 static dbus_bool_t
-update_desktop_file_entry (BusActivation       *activation,
-                           BusServiceDirectory *s_dir,
-                           DBusString          *filename,
-                           BusDesktopFile      *desktop_file,
-                           DBusError           *error)
+update_entry (BusActivation       *activation,
+              BusServiceDirectory *s_dir,
+              const DBusString    *filename,
+              const DBusStat      *stat_buf,
+              char                *name,
+              char                *exec,
+              char                *user,
+              char                *systemd_service,
+              dbus_bool_t          prestart,
+              DBusError           *error)
 {
-  char *name, *exec, *user, *exec_tmp, *systemd_service;
   BusActivationEntry *entry;
-  DBusStat stat_buf;
-  DBusString file_path;
-  DBusError tmp_error;
   dbus_bool_t retval;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
   retval = FALSE;
-  name = NULL;
-  exec = NULL;
-  user = NULL;
-  exec_tmp = NULL;
-  entry = NULL;
-  systemd_service = NULL;
-
-  dbus_error_init (&tmp_error);
-
-  if (!_dbus_string_init (&file_path))
-    {
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-
-  if (!_dbus_string_append (&file_path, s_dir->dir_c) ||
-      !_dbus_concat_dir_and_file (&file_path, filename))
-    {
-      BUS_SET_OOM (error);
-      goto out;
-    }
-
-  if (!_dbus_stat (&file_path, &stat_buf, NULL))
-    {
-      dbus_set_error (error, DBUS_ERROR_FAILED,
-                      "Can't stat the service file\n");
-      goto out;
-    }
-
-  if (!bus_desktop_file_get_string (desktop_file,
-                                    DBUS_SERVICE_SECTION,
-                                    DBUS_SERVICE_NAME,
-                                    &name,
-                                    error))
-    goto out;
-
-  if (!bus_desktop_file_get_string (desktop_file,
-                                    DBUS_SERVICE_SECTION,
-                                    DBUS_SERVICE_EXEC,
-                                    &exec_tmp,
-                                    error))
-    goto out;
-
-  exec = _dbus_strdup (_dbus_replace_install_prefix (exec_tmp));
-  dbus_free (exec_tmp);
-  exec_tmp = NULL;
-
-  /* user is not _required_ unless we are using system activation */
-  if (!bus_desktop_file_get_string (desktop_file,
-                                    DBUS_SERVICE_SECTION,
-                                    DBUS_SERVICE_USER,
-                                    &user, &tmp_error))
-    {
-      _DBUS_ASSERT_ERROR_IS_SET (&tmp_error);
-      /* if we got OOM, then exit */
-      if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
-        {
-          dbus_move_error (&tmp_error, error);
-          goto out;
-        }
-      else
-        {
-          /* if we have error because we didn't find anything then continue */
-          dbus_error_free (&tmp_error);
-          dbus_free (user);
-          user = NULL;
-        }
-    }
-  _DBUS_ASSERT_ERROR_IS_CLEAR (&tmp_error);
-
-  /* systemd service is never required */
-  if (!bus_desktop_file_get_string (desktop_file,
-                                    DBUS_SERVICE_SECTION,
-                                    DBUS_SERVICE_SYSTEMD_SERVICE,
-                                    &systemd_service, &tmp_error))
-    {
-      _DBUS_ASSERT_ERROR_IS_SET (&tmp_error);
-      /* if we got OOM, then exit */
-      if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
-        {
-          dbus_move_error (&tmp_error, error);
-          goto out;
-        }
-      else
-        {
-          /* if we have error because we didn't find anything then continue */
-          dbus_error_free (&tmp_error);
-          dbus_free (systemd_service);
-          systemd_service = NULL;
-        }
-    }
-
-  _DBUS_ASSERT_ERROR_IS_CLEAR (&tmp_error);
 
   entry = _dbus_hash_table_lookup_string (s_dir->entries,
                                           _dbus_string_get_const_data (filename));
@@ -407,6 +374,8 @@ update_desktop_file_entry (BusActivation       *activation,
           goto out;
         }
 
+      _dbus_hash_table_remove_string (activation->negative_cache, entry->name);
+
       if (!_dbus_hash_table_insert_string (s_dir->entries, entry->filename, bus_activation_entry_ref (entry)))
         {
           /* Revert the insertion in the entries table */
@@ -425,10 +394,10 @@ update_desktop_file_entry (BusActivation       *activation,
       if (_dbus_hash_table_lookup_string (activation->entries, name))
         {
           _dbus_verbose ("The new service name \"%s\" of service file \"%s\" is already in cache, ignoring\n",
-                         name, _dbus_string_get_const_data (&file_path));
+                         name, _dbus_string_get_const_data (filename));
           dbus_set_error (error, DBUS_ERROR_FAILED,
                           "The new service name \"%s\" of service file \"%s\" is already in cache, ignoring\n",
-                          name, _dbus_string_get_const_data (&file_path));
+                          name, _dbus_string_get_const_data (filename));
           goto out;
         }
 
@@ -459,9 +428,14 @@ update_desktop_file_entry (BusActivation       *activation,
                                           entry->filename);
           goto out;
         }
+
+      _dbus_hash_table_remove_string (activation->negative_cache, entry->name);
     }
 
-  entry->mtime = stat_buf.mtime;
+  entry->mtime = stat_buf->mtime;
+  entry->inode = stat_buf->inode;
+  entry->size = stat_buf->size;
+  entry->prestart = (prestart != FALSE);
   retval = TRUE;
 
 out:
@@ -470,7 +444,6 @@ out:
   dbus_free (exec);
   dbus_free (user);
   dbus_free (systemd_service);
-  _dbus_string_free (&file_path);
 
   if (entry)
     bus_activation_entry_unref (entry);
@@ -478,6 +451,144 @@ out:
   return retval;
 }
 
+static dbus_bool_t
+update_desktop_file_entry (BusActivation       *activation,
+                           BusServiceDirectory *s_dir,
+                           DBusString          *filename,
+                           BusDesktopFile      *desktop_file,
+                           DBusError           *error)
+{
+  char *name, *exec, *user, *exec_tmp, *systemd_service;
+  const char *prestart;
+  DBusStat stat_buf;
+  DBusString file_path;
+  DBusError tmp_error;
+  dbus_bool_t retval;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  retval = FALSE;
+  name = NULL;
+  exec = NULL;
+  user = NULL;
+  exec_tmp = NULL;
+  systemd_service = NULL;
+
+  dbus_error_init (&tmp_error);
+
+  if (!_dbus_string_init (&file_path))
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (!_dbus_string_append (&file_path, s_dir->dir_c) ||
+      !_dbus_concat_dir_and_file (&file_path, filename))
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  if (!_dbus_stat (&file_path, &stat_buf, NULL))
+    {
+      dbus_set_error (error, DBUS_ERROR_FAILED,
+                      "Can't stat the service file\n");
+      goto out;
+    }
+
+  if (!bus_desktop_file_get_string (desktop_file,
+                                    DBUS_SERVICE_SECTION,
+                                    DBUS_SERVICE_NAME,
+                                    &name,
+                                    error))
+    goto out;
+
+  if (!bus_desktop_file_get_string (desktop_file,
+                                    DBUS_SERVICE_SECTION,
+                                    DBUS_SERVICE_EXEC,
+                                    &exec_tmp,
+                                    error))
+    goto out;
+
+  exec = _dbus_strdup (_dbus_replace_install_prefix (exec_tmp));
+  dbus_free (exec_tmp);
+  exec_tmp = NULL;
+
+  /* user is not _required_ unless we are using system activation */
+  if (!bus_desktop_file_get_string (desktop_file,
+                                    DBUS_SERVICE_SECTION,
+                                    DBUS_SERVICE_USER,
+                                    &user, &tmp_error))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (&tmp_error);
+      /* if we got OOM, then exit */
+      if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
+        {
+          dbus_move_error (&tmp_error, error);
+          goto out;
+        }
+      else
+        {
+          /* if we have error because we didn't find anything then continue */
+          dbus_error_free (&tmp_error);
+          dbus_free (user);
+          user = NULL;
+        }
+    }
+  _DBUS_ASSERT_ERROR_IS_CLEAR (&tmp_error);
+
+  /* systemd service is never required */
+  if (!bus_desktop_file_get_string (desktop_file,
+                                    DBUS_SERVICE_SECTION,
+                                    DBUS_SERVICE_SYSTEMD_SERVICE,
+                                    &systemd_service, &tmp_error))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (&tmp_error);
+      /* if we got OOM, then exit */
+      if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
+        {
+          dbus_move_error (&tmp_error, error);
+          goto out;
+        }
+      else
+        {
+          /* if we have error because we didn't find anything then continue */
+          dbus_error_free (&tmp_error);
+          dbus_free (systemd_service);
+          systemd_service = NULL;
+        }
+    }
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (&tmp_error);
+
+  /* Prestart is a boolean, and false unless given */
+  if (!bus_desktop_file_get_raw (desktop_file,
+                                 DBUS_SERVICE_SECTION,
+                                 DBUS_SERVICE_PRESTART,
+                                 &prestart))
+    prestart = NULL;
+
+  retval = update_entry (activation, s_dir, filename, &stat_buf,
+                         name, exec, user, systemd_service,
+                         prestart != NULL && strcmp (prestart, "true") == 0,
+                         error);
+
+  /* ownership has been transferred to update_entry() */
+  name = NULL;
+  exec = NULL;
+  user = NULL;
+  systemd_service = NULL;
+
+out:
+  dbus_free (name);
+  dbus_free (exec);
+  dbus_free (user);
+  dbus_free (systemd_service);
+  _dbus_string_free (&file_path);
+
+  return retval;
+}
+
 static dbus_bool_t
 check_service_file (BusActivation       *activation,
                     BusActivationEntry  *entry,
@@ -578,9 +689,455 @@ out:
 }
 
 
+static void
+service_cache_clear (BusActivation *activation)
+{
+  if (activation->cached_files != NULL)
+    {
+      _dbus_hash_table_unref (activation->cached_files);
+      activation->cached_files = NULL;
+    }
+
+  if (activation->cache != NULL)
+    {
+      dbus_message_unref (activation->cache);
+      activation->cache = NULL;
+    }
+
+  activation->n_cache_hits = 0;
+}
+
+/* Loads activation->cache_file into activation->cached_files. Any
+ * problem just means we parse every .service file, as if there was no
+ * cache, and write a new one afterwards.
+ */
+static void
+service_cache_load (BusActivation *activation)
+{
+  DBusString filename;
+  DBusString contents;
+  DBusError error = DBUS_ERROR_INIT;
+  DBusMessageIter iter, array_iter;
+  const char *version;
+
+  _dbus_assert (activation->cache == NULL);
+  _dbus_assert (activation->cached_files == NULL);
+
+  activation->cache_stale = TRUE;
+
+  if (activation->cache_file == NULL)
+    return;
+
+  if (!_dbus_string_init (&contents))
+    return;
+
+  _dbus_string_init_const (&filename, activation->cache_file);
+
+  if (!_dbus_file_get_contents (&contents, &filename, &error))
+    {
+      _dbus_verbose ("Not using service cache: %s\n", error.message);
+      goto out;
+    }
+
+  activation->cache = dbus_message_demarshal (_dbus_string_get_const_data (&contents),
+                                              _dbus_string_get_length (&contents),
+                                              &error);
+  if (activation->cache == NULL)
+    {
+      _dbus_verbose ("Not using service cache: %s\n", error.message);
+      goto out;
+    }
+
+  if (!dbus_message_has_signature (activation->cache, SERVICE_CACHE_SIGNATURE))
+    {
+      _dbus_verbose ("Not using service cache: unexpected signature\n");
+      goto out;
+    }
+
+  dbus_message_iter_init (activation->cache, &iter);
+  dbus_message_iter_get_basic (&iter, &version);
+
+  if (strcmp (version, SERVICE_CACHE_VERSION) != 0)
+    {
+      _dbus_verbose ("Not using service cache: version \"%s\"\n", version);
+      goto out;
+    }
+
+  activation->cached_files = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
+                                                   dbus_free);
+  if (activation->cached_files == NULL)
+    goto out;
+
+  dbus_message_iter_next (&iter);
+  dbus_message_iter_recurse (&iter, &array_iter);
+
+  while (dbus_message_iter_get_arg_type (&array_iter) == DBUS_TYPE_STRUCT)
+    {
+      BusCachedServiceFile *cached;
+      DBusMessageIter struct_iter;
+      const char *path;
+      unsigned char flags;
+
+      cached = dbus_new0 (BusCachedServiceFile, 1);
+      if (cached == NULL)
+        goto out;
+
+      dbus_message_iter_recurse (&array_iter, &struct_iter);
+      dbus_message_iter_get_basic (&struct_iter, &path);
+      dbus_message_iter_next (&struct_iter);
+      dbus_message_iter_get_basic (&struct_iter, &cached->mtime);
+      dbus_message_iter_next (&struct_iter);
+      dbus_message_iter_get_basic (&struct_iter, &cached->inode);
+      dbus_message_iter_next (&struct_iter);
+      dbus_message_iter_get_basic (&struct_iter, &cached->size);
+      dbus_message_iter_next (&struct_iter);
+      dbus_message_iter_get_basic (&struct_iter, &flags);
+      dbus_message_iter_next (&struct_iter);
+      dbus_message_iter_get_basic (&struct_iter, &cached->name);
+      dbus_message_iter_next (&struct_iter);
+      dbus_message_iter_get_basic (&struct_iter, &cached->exec);
+      dbus_message_iter_next (&struct_iter);
+      dbus_message_iter_get_basic (&struct_iter, &cached->user);
+      dbus_message_iter_next (&struct_iter);
+      dbus_message_iter_get_basic (&struct_iter, &cached->systemd_service);
+
+      if (!(flags & SERVICE_CACHE_HAS_USER))
+        cached->user = NULL;
+
+      if (!(flags & SERVICE_CACHE_HAS_SYSTEMD_SERVICE))
+        cached->systemd_service = NULL;
+
+      cached->prestart = (flags & SERVICE_CACHE_PRESTART) != 0;
+
+      if (!_dbus_hash_table_insert_string (activation->cached_files,
+                                           (char *) path, cached))
+        {
+          dbus_free (cached);
+          goto out;
+        }
+
+      dbus_message_iter_next (&array_iter);
+    }
+
+  /* On reload, what we have in memory is more recent than the file */
+  if (activation->recent_services == NULL)
+    {
+      dbus_message_iter_next (&iter);
+      dbus_message_iter_recurse (&iter, &array_iter);
+
+      while (dbus_message_iter_get_arg_type (&array_iter) == DBUS_TYPE_STRING)
+        {
+          const char *recent;
+          char *copy;
+
+          dbus_message_iter_get_basic (&array_iter, &recent);
+          copy = _dbus_strdup (recent);
+
+          if (copy == NULL ||
+              !_dbus_list_append (&activation->recent_services, copy))
+            {
+              dbus_free (copy);
+              goto out;
+            }
+
+          dbus_message_iter_next (&array_iter);
+        }
+    }
+
+  _dbus_verbose ("Loaded %d entries from service cache %s\n",
+                 _dbus_hash_table_get_n_entries (activation->cached_files),
+                 activation->cache_file);
+  activation->cache_stale = FALSE;
+
+ out:
+  if (activation->cache_stale)
+    service_cache_clear (activation);
+
+  dbus_error_free (&error);
+  _dbus_string_free (&contents);
+}
+
+/* Creates the entry for a .service file from the cache, if the cache
+ * has it and the file has not changed since. Only fails on OOM.
+ */
+static dbus_bool_t
+update_entry_from_cache (BusActivation       *activation,
+                         BusServiceDirectory *s_dir,
+                         const DBusString    *filename,
+                         const DBusString    *full_path,
+                         dbus_bool_t         *found,
+                         DBusError           *error)
+{
+  BusCachedServiceFile *cached;
+  DBusStat stat_buf;
+  DBusError tmp_error;
+  char *name, *exec, *user, *systemd_service;
+
+  *found = FALSE;
+
+  if (activation->cached_files == NULL)
+    return TRUE;
+
+  cached = _dbus_hash_table_lookup_string (activation->cached_files,
+                                           _dbus_string_get_const_data (full_path));
+  if (cached == NULL)
+    return TRUE;
+
+  if (!_dbus_stat (full_path, &stat_buf, NULL) ||
+      stat_buf.mtime != cached->mtime ||
+      stat_buf.inode != cached->inode ||
+      stat_buf.size != cached->size)
+    return TRUE;
+
+  name = _dbus_strdup (cached->name);
+  exec = _dbus_strdup (cached->exec);
+  user = _dbus_strdup (cached->user);
+  systemd_service = _dbus_strdup (cached->systemd_service);
+
+  if (name == NULL || exec == NULL ||
+      (user == NULL && cached->user != NULL) ||
+      (systemd_service == NULL && cached->systemd_service != NULL))
+    {
+      dbus_free (name);
+      dbus_free (exec);
+      dbus_free (user);
+      dbus_free (systemd_service);
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  dbus_error_init (&tmp_error);
+
+  if (!update_entry (activation, s_dir, filename, &stat_buf,
+                     name, exec, user, systemd_service, cached->prestart,
+                     &tmp_error))
+    {
+      if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
+        {
+          dbus_move_error (&tmp_error, error);
+          return FALSE;
+        }
+
+      _dbus_verbose ("Could not add cached %s to activation entry list: %s\n",
+                     _dbus_string_get_const_data (full_path), tmp_error.message);
+      dbus_error_free (&tmp_error);
+    }
+
+  activation->n_cache_hits++;
+  *found = TRUE;
+  return TRUE;
+}
+
+static dbus_bool_t
+append_cached_entry (DBusMessageIter    *array_iter,
+                     BusActivationEntry *entry)
+{
+  DBusMessageIter struct_iter;
+  DBusString full_path;
+  DBusString filename;
+  const char *path, *user, *systemd_service;
+  dbus_uint64_t mtime, inode, size;
+  unsigned char flags;
+  dbus_bool_t retval;
+
+  if (!_dbus_string_init (&full_path))
+    return FALSE;
+
+  _dbus_string_init_const (&filename, entry->filename);
+
+  retval = FALSE;
+  flags = 0;
+  user = "";
+  systemd_service = "";
+
+  if (entry->user != NULL)
+    {
+      flags |= SERVICE_CACHE_HAS_USER;
+      user = entry->user;
+    }
+
+  if (entry->systemd_service != NULL)
+    {
+      flags |= SERVICE_CACHE_HAS_SYSTEMD_SERVICE;
+      systemd_service = entry->systemd_service;
+    }
+
+  if (entry->prestart)
+    flags |= SERVICE_CACHE_PRESTART;
+
+  mtime = entry->mtime;
+  inode = entry->inode;
+  size = entry->size;
+
+  if (!_dbus_string_append (&full_path, entry->s_dir->dir_c) ||
+      !_dbus_concat_dir_and_file (&full_path, &filename))
+    goto out;
+
+  path = _dbus_string_get_const_data (&full_path);
+
+  if (!dbus_message_iter_open_container (array_iter, DBUS_TYPE_STRUCT, NULL,
+                                         &struct_iter))
+    goto out;
+
+  if (!dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING, &path) ||
+      !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT64, &mtime) ||
+      !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT64, &inode) ||
+      !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT64, &size) ||
+      !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_BYTE, &flags) ||
+      !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING, &entry->name) ||
+      !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING, &entry->exec) ||
+      !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING, &user) ||
+      !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING, &systemd_service))
+    {
+      dbus_message_iter_abandon_container (array_iter, &struct_iter);
+      goto out;
+    }
+
+  if (!dbus_message_iter_close_container (array_iter, &struct_iter))
+    goto out;
+
+  retval = TRUE;
+
+ out:
+  _dbus_string_free (&full_path);
+  return retval;
+}
+
+/* Writes every entry whose file was last modified before scan_start to
+ * activation->cache_file. Files modified during the scan are left out:
+ * mtime has a granularity of a second, so a second change within that
+ * second would go unnoticed.
+ */
+static void
+service_cache_save (BusActivation *activation,
+                    long           scan_start)
+{
+  DBusMessage *message;
+  DBusMessageIter iter, array_iter;
+  DBusHashIter dir_iter;
+  DBusList *link;
+  DBusString filename;
+  DBusString contents;
+  DBusError error = DBUS_ERROR_INIT;
+  const char *version = SERVICE_CACHE_VERSION;
+  char *data;
+  int len;
+
+  /* This is never sent anywhere; it's only a container */
+  message = dbus_message_new_signal (DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS,
+                                     "ServiceCache");
+  if (message == NULL)
+    return;
+
+  /* dbus_message_demarshal() insists on a valid serial */
+  dbus_message_set_serial (message, 1);
+
+  data = NULL;
+  dbus_message_iter_init_append (message, &iter);
+
+  if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &version) ||
+      !dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                         "(stttyssss)", &array_iter))
+    goto out;
+
+  _dbus_hash_iter_init (activation->directories, &dir_iter);
+  while (_dbus_hash_iter_next (&dir_iter))
+    {
+      BusServiceDirectory *s_dir = _dbus_hash_iter_get_value (&dir_iter);
+      DBusHashIter entry_iter;
+
+      _dbus_hash_iter_init (s_dir->entries, &entry_iter);
+      while (_dbus_hash_iter_next (&entry_iter))
+        {
+          BusActivationEntry *entry = _dbus_hash_iter_get_value (&entry_iter);
+
+          if (entry->mtime >= (unsigned long) scan_start)
+            continue;
+
+          if (!append_cached_entry (&array_iter, entry))
+            {
+              dbus_message_iter_abandon_container (&iter, &array_iter);
+              goto out;
+            }
+        }
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &array_iter) ||
+      !dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                         DBUS_TYPE_STRING_AS_STRING,
+                                         &array_iter))
+    goto out;
+
+  for (link = _dbus_list_get_first_link (&activation->recent_services);
+       link != NULL;
+       link = _dbus_list_get_next_link (&activation->recent_services, link))
+    {
+      if (!dbus_message_iter_append_basic (&array_iter, DBUS_TYPE_STRING,
+                                           &link->data))
+        {
+          dbus_message_iter_abandon_container (&iter, &array_iter);
+          goto out;
+        }
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &array_iter) ||
+      !dbus_message_marshal (message, &data, &len))
+    goto out;
+
+  _dbus_string_init_const_len (&contents, data, len);
+  _dbus_string_init_const (&filename, activation->cache_file);
+
+  if (_dbus_string_save_to_file (&contents, &filename, TRUE, &error))
+    {
+      _dbus_verbose ("Wrote service cache %s\n", activation->cache_file);
+      activation->recent_services_changed = FALSE;
+    }
+  else
+    {
+      if (activation->context != NULL)
+        bus_context_log (activation->context, DBUS_SYSTEM_LOG_INFO,
+                         "Unable to write service cache: %s", error.message);
+      dbus_error_free (&error);
+    }
+
+ out:
+  dbus_free (data);
+  dbus_message_unref (message);
+}
+
 /* warning: this doesn't fully "undo" itself on failure, i.e. doesn't strip
  * hash entries it already added.
  */
+/* mtime only has one-second granularity, and the file system may stamp
+ * it from a clock slightly behind ours. Something modified in the
+ * second we looked at it, or the one before, could be modified again
+ * without its mtime moving, so only older mtimes can be relied on.
+ */
+static dbus_bool_t
+mtime_is_settled (unsigned long mtime,
+                  long          now)
+{
+  return mtime + 1 < (unsigned long) now;
+}
+
+static dbus_bool_t
+service_directory_is_settled (BusServiceDirectory *s_dir,
+                              long                 now)
+{
+  DBusHashIter iter;
+
+  _dbus_hash_iter_init (s_dir->entries, &iter);
+  while (_dbus_hash_iter_next (&iter))
+    {
+      BusActivationEntry *entry = _dbus_hash_iter_get_value (&iter);
+
+      if (!mtime_is_settled (entry->mtime, now))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 static dbus_bool_t
 update_directory (BusActivation       *activation,
                   BusServiceDirectory *s_dir,
@@ -593,6 +1150,11 @@ update_directory (BusActivation       *activation,
   dbus_bool_t retval;
   BusActivationEntry *entry;
   DBusString full_path;
+  DBusStat stat_buf;
+  dbus_bool_t have_stat;
+  dbus_bool_t found;
+  dbus_bool_t untracked;
+  long now;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
@@ -601,6 +1163,14 @@ update_directory (BusActivation       *activation,
 
   _dbus_string_init_const (&dir, s_dir->dir_c);
 
+  /* Remember what the directory looked like before we read it, so that
+   * later misses can tell whether anything was added or removed since.
+   */
+  s_dir->mtime_valid = FALSE;
+  have_stat = _dbus_stat (&dir, &stat_buf, NULL);
+  _dbus_get_real_time (&now, NULL);
+  untracked = FALSE;
+
   if (!_dbus_string_init (&filename))
     {
       BUS_SET_OOM (error);
@@ -658,7 +1228,15 @@ update_directory (BusActivation       *activation,
           goto out;
         }
 
+      if (!update_entry_from_cache (activation, s_dir, &filename, &full_path,
+                                    &found, error))
+        goto out;
+
+      if (found)
+        continue;
+
       /* New file */
+      activation->cache_stale = TRUE;
       desktop_file = bus_desktop_file_load (&full_path, &tmp_error);
       if (desktop_file == NULL)
         {
@@ -673,6 +1251,7 @@ update_directory (BusActivation       *activation,
             }
 
           dbus_error_free (&tmp_error);
+          untracked = TRUE;
           continue;
         }
 
@@ -694,6 +1273,7 @@ update_directory (BusActivation       *activation,
             }
 
           dbus_error_free (&tmp_error);
+          untracked = TRUE;
           continue;
         }
       else
@@ -710,6 +1290,17 @@ update_directory (BusActivation       *activation,
       goto out;
     }
 
+  /* A file we could not load has no entry whose mtime would tell us
+   * when it is fixed, so leave the directory to be rescanned.
+   */
+  if (have_stat && !untracked &&
+      mtime_is_settled (stat_buf.mtime, now) &&
+      service_directory_is_settled (s_dir, now))
+    {
+      s_dir->mtime = stat_buf.mtime;
+      s_dir->mtime_valid = TRUE;
+    }
+
   retval = TRUE;
 
  out:
@@ -793,10 +1384,17 @@ dbus_bool_t
 bus_activation_reload (BusActivation     *activation,
                        const DBusString  *address,
                        DBusList         **directories,
+                       const char        *cache_file,
                        DBusError         *error)
 {
   DBusList      *link;
   char          *dir;
+  long           scan_start;
+
+  /* Pending activations survive a reload, but pick up the new timeout */
+  if (activation->pending_expire != NULL)
+    bus_expire_list_set_expire_after (activation->pending_expire,
+                                      bus_context_get_activation_timeout (activation->context));
 
   if (activation->server_address != NULL)
     dbus_free (activation->server_address);
@@ -806,6 +1404,18 @@ bus_activation_reload (BusActivation     *activation,
       goto failed;
     }
 
+  dbus_free (activation->cache_file);
+  activation->cache_file = NULL;
+  if (cache_file != NULL)
+    {
+      activation->cache_file = _dbus_strdup (cache_file);
+      if (activation->cache_file == NULL)
+        {
+          BUS_SET_OOM (error);
+          goto failed;
+        }
+    }
+
   if (activation->entries != NULL)
     _dbus_hash_table_unref (activation->entries);
   activation->entries = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
@@ -827,6 +1437,21 @@ bus_activation_reload (BusActivation     *activation,
       goto failed;
     }
 
+  if (activation->negative_cache != NULL)
+    _dbus_hash_table_unref (activation->negative_cache);
+  activation->negative_cache = _dbus_hash_table_new (DBUS_HASH_STRING,
+                                                     (DBusFreeFunction) dbus_free,
+                                                     NULL);
+
+  if (activation->negative_cache == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  _dbus_get_real_time (&scan_start, NULL);
+  service_cache_load (activation);
+
   link = _dbus_list_get_first_link (directories);
   while (link != NULL)
     {
@@ -879,8 +1504,19 @@ bus_activation_reload (BusActivation     *activation,
       link = _dbus_list_get_next_link (directories, link);
     }
 
+  /* Rewrite the cache if we had to parse anything, or if some of the
+   * files it describes have gone away */
+  if (activation->cache_file != NULL &&
+      (activation->cache_stale ||
+       activation->recent_services_changed ||
+       activation->n_cache_hits !=
+         _dbus_hash_table_get_n_entries (activation->cached_files)))
+    service_cache_save (activation, scan_start);
+
+  service_cache_clear (activation);
   return TRUE;
  failed:
+  service_cache_clear (activation);
   return FALSE;
 }
 
@@ -888,6 +1524,7 @@ BusActivation*
 bus_activation_new (BusContext        *context,
                     const DBusString  *address,
                     DBusList         **directories,
+                    const char        *cache_file,
                     DBusError         *error)
 {
   BusActivation *activation;
@@ -905,7 +1542,8 @@ bus_activation_new (BusContext        *context,
   activation->context = context;
   activation->n_pending_activations = 0;
 
-  if (!bus_activation_reload (activation, address, directories, error))
+  if (!bus_activation_reload (activation, address, directories, cache_file,
+                              error))
     goto failed;
 
    /* Initialize this hash table once, we don't want to lose pending
@@ -967,10 +1605,18 @@ bus_activation_unref (BusActivation *activation)
     _dbus_hash_table_unref (activation->entries);
   if (activation->pending_activations)
     _dbus_hash_table_unref (activation->pending_activations);
+  if (activation->pending_expire)
+    bus_expire_list_free (activation->pending_expire);
   if (activation->directories)
     _dbus_hash_table_unref (activation->directories);
   if (activation->environment)
     _dbus_hash_table_unref (activation->environment);
+  if (activation->negative_cache)
+    _dbus_hash_table_unref (activation->negative_cache);
+  dbus_free (activation->cache_file);
+  _dbus_list_foreach (&activation->recent_services, (DBusForeachFunction) dbus_free,
+                      NULL);
+  _dbus_list_clear (&activation->recent_services);
 
   dbus_free (activation);
 }
@@ -1032,7 +1678,7 @@ restore_pending (void *data)
 
   _dbus_verbose ("Restoring pending activation for service %s, has timeout = %d\n",
                  d->pending_activation->service_name,
-                 d->pending_activation->timeout_added);
+                 d->pending_activation->expire_link != NULL);
 
   _dbus_hash_table_insert_string_preallocated (d->pending_activation->activation->pending_activations,
                                                d->hash_entry,
@@ -1063,26 +1709,78 @@ add_restore_pending_to_transaction (BusTransaction       *transaction,
 {
   RestorePendingData *d;
 
-  d = dbus_new (RestorePendingData, 1);
-  if (d == NULL)
-    return FALSE;
+  d = dbus_new (RestorePendingData, 1);
+  if (d == NULL)
+    return FALSE;
+
+  d->pending_activation = pending_activation;
+  d->hash_entry = _dbus_hash_table_preallocate_entry (d->pending_activation->activation->pending_activations);
+
+  bus_pending_activation_ref (d->pending_activation);
+
+  if (d->hash_entry == NULL ||
+      !bus_transaction_add_cancel_hook (transaction, restore_pending, d,
+                                        free_restore_pending_data))
+    {
+      free_restore_pending_data (d);
+      return FALSE;
+    }
+
+  _dbus_verbose ("Saved pending activation to be restored if the transaction fails\n");
+
+  return TRUE;
+}
+
+/* Moves service_name to the front of the recently started services,
+ * to be started ahead of time when the bus next starts up. Failing
+ * to do so is not an error.
+ */
+static void
+remember_recent_service (BusActivation *activation,
+                         const char    *service_name)
+{
+  DBusList *link;
+  char *name;
+  int max_recent;
+
+  max_recent = bus_context_get_prestart_recent_services (activation->context);
+
+  /* Without a cache file there is nowhere to remember them */
+  if (max_recent <= 0 || activation->cache_file == NULL)
+    return;
+
+  link = _dbus_list_get_first_link (&activation->recent_services);
 
-  d->pending_activation = pending_activation;
-  d->hash_entry = _dbus_hash_table_preallocate_entry (d->pending_activation->activation->pending_activations);
+  if (link != NULL && strcmp (link->data, service_name) == 0)
+    return;
 
-  bus_pending_activation_ref (d->pending_activation);
+  while (link != NULL)
+    {
+      if (strcmp (link->data, service_name) == 0)
+        {
+          _dbus_list_unlink (&activation->recent_services, link);
+          _dbus_list_prepend_link (&activation->recent_services, link);
+          activation->recent_services_changed = TRUE;
+          return;
+        }
 
-  if (d->hash_entry == NULL ||
-      !bus_transaction_add_cancel_hook (transaction, restore_pending, d,
-                                        free_restore_pending_data))
+      link = _dbus_list_get_next_link (&activation->recent_services, link);
+    }
+
+  name = _dbus_strdup (service_name);
+  if (name == NULL)
+    return;
+
+  if (!_dbus_list_prepend (&activation->recent_services, name))
     {
-      free_restore_pending_data (d);
-      return FALSE;
+      dbus_free (name);
+      return;
     }
 
-  _dbus_verbose ("Saved pending activation to be restored if the transaction fails\n");
+  while (_dbus_list_get_length (&activation->recent_services) > max_recent)
+    dbus_free (_dbus_list_pop_last (&activation->recent_services));
 
-  return TRUE;
+  activation->recent_services_changed = TRUE;
 }
 
 dbus_bool_t
@@ -1107,13 +1805,28 @@ bus_activation_service_created (BusActivation  *activation,
                    DBUS_SYSTEM_LOG_INFO, "Successfully activated service '%s'",
                    service_name);
 
+  link = _dbus_list_get_first_link (&pending_activation->entries);
+  while (link != NULL)
+    {
+      BusPendingActivationEntry *entry = link->data;
+
+      if (entry->connection != NULL)
+        {
+          remember_recent_service (activation, service_name);
+          break;
+        }
+
+      link = _dbus_list_get_next_link (&pending_activation->entries, link);
+    }
+
   link = _dbus_list_get_first_link (&pending_activation->entries);
   while (link != NULL)
     {
       BusPendingActivationEntry *entry = link->data;
       DBusList *next = _dbus_list_get_next_link (&pending_activation->entries, link);
 
-      /* entry->connection is NULL for activating systemd */
+      /* entry->connection is NULL for activating systemd, or for
+       * starting a service ahead of time */
       if (entry->connection && dbus_connection_get_is_connected (entry->connection))
         {
           /* Only send activation replies to regular activation requests. */
@@ -1464,11 +2177,18 @@ toggle_babysitter_watch (DBusWatch      *watch,
 }
 
 static dbus_bool_t
-pending_activation_timed_out (void *data)
+pending_activation_timed_out (BusExpireList *list,
+                              DBusList      *link,
+                              void          *data)
 {
-  BusPendingActivation *pending_activation = data;
+  BusPendingActivation *pending_activation = link->data;
   DBusError error;
 
+  /* Even if we still have references after failing below, we must
+   * not time out twice */
+  bus_expire_list_remove_link (list, link);
+  pending_activation->expire_link = NULL;
+
   /* Kill the spawned process, since it sucks
    * (not sure this is what we want to do, but
    * may as well try it for now)
@@ -1559,6 +2279,236 @@ update_service_cache (BusActivation *activation, DBusError *error)
   return TRUE;
 }
 
+/* Re-reads one .service file that the directory watch reported as changed,
+ * without rescanning the rest of its directory. Only fails on OOM.
+ */
+static dbus_bool_t
+reload_service_file (BusActivation       *activation,
+                     BusServiceDirectory *s_dir,
+                     DBusString          *filename,
+                     DBusError           *error)
+{
+  BusActivationEntry *entry;
+  BusDesktopFile *desktop_file;
+  DBusString full_path;
+  DBusStat stat_buf;
+  DBusError tmp_error;
+  dbus_bool_t retval;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  retval = FALSE;
+  desktop_file = NULL;
+  dbus_error_init (&tmp_error);
+
+  if (!_dbus_string_init (&full_path))
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (!_dbus_string_append (&full_path, s_dir->dir_c) ||
+      !_dbus_concat_dir_and_file (&full_path, filename))
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  if (_dbus_stat (&full_path, &stat_buf, NULL))
+    {
+      desktop_file = bus_desktop_file_load (&full_path, &tmp_error);
+      if (desktop_file == NULL)
+        {
+          _dbus_verbose ("Could not load %s: %s\n",
+                         _dbus_string_get_const_data (&full_path),
+                         tmp_error.message);
+
+          if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
+            {
+              dbus_move_error (&tmp_error, error);
+              goto out;
+            }
+
+          dbus_error_free (&tmp_error);
+        }
+      else if (update_desktop_file_entry (activation, s_dir, filename,
+                                          desktop_file, &tmp_error))
+        {
+          retval = TRUE;
+          goto out;
+        }
+      else
+        {
+          _dbus_verbose ("Could not update %s in activation entry list: %s\n",
+                         _dbus_string_get_const_data (&full_path),
+                         tmp_error.message);
+
+          if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
+            {
+              dbus_move_error (&tmp_error, error);
+              goto out;
+            }
+
+          dbus_error_free (&tmp_error);
+        }
+    }
+
+  /* The file is gone or no longer valid: forget what it used to provide */
+  entry = _dbus_hash_table_lookup_string (s_dir->entries,
+                                          _dbus_string_get_const_data (filename));
+  if (entry != NULL)
+    {
+      _dbus_verbose ("Removing \"%s\" from list of services\n", entry->name);
+
+      if (_dbus_hash_table_lookup_string (activation->entries,
+                                          entry->name) == entry)
+        _dbus_hash_table_remove_string (activation->entries, entry->name);
+
+      _dbus_hash_table_remove_string (s_dir->entries, entry->filename);
+    }
+
+  retval = TRUE;
+
+ out:
+  if (desktop_file != NULL)
+    bus_desktop_file_free (desktop_file);
+  _dbus_string_free (&full_path);
+
+  return retval;
+}
+
+/**
+ * Applies a change to a single file in a service directory, as reported
+ * by the directory watch, instead of reloading the whole configuration.
+ *
+ * @param activation the activation subsystem
+ * @param dir the directory containing the file
+ * @param filename the base name of the file that was created, changed
+ *  or removed
+ * @param handled set to #FALSE if the change is not to a .service file
+ *  in one of our service directories, so it was not dealt with here
+ * @param error return location for the error, which can only be OOM
+ * @returns #FALSE on OOM
+ */
+dbus_bool_t
+bus_activation_update_service_file (BusActivation *activation,
+                                    const char    *dir,
+                                    const char    *filename,
+                                    dbus_bool_t   *handled,
+                                    DBusError     *error)
+{
+  BusServiceDirectory *s_dir;
+  DBusString filename_str;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  *handled = FALSE;
+
+  _dbus_string_init_const (&filename_str, filename);
+
+  s_dir = _dbus_hash_table_lookup_string (activation->directories, dir);
+  if (s_dir == NULL ||
+      !_dbus_string_ends_with_c_str (&filename_str, ".service"))
+    return TRUE;
+
+  _dbus_verbose ("Updating service file \"%s\" in \"%s\"\n", filename, dir);
+
+  if (!reload_service_file (activation, s_dir, &filename_str, error))
+    return FALSE;
+
+  *handled = TRUE;
+  return TRUE;
+}
+
+/* Returns TRUE if no service directory has had files added, removed,
+ * renamed or edited since it was last scanned. Adding, removing or
+ * renaming a file changes the directory's mtime, but editing one in
+ * place only changes the file's own, so every known .service file is
+ * checked too. Any doubt, including running out of memory, counts as
+ * a change.
+ */
+static dbus_bool_t
+service_directories_unchanged (BusActivation *activation)
+{
+  DBusHashIter iter;
+  DBusString path;
+  dbus_bool_t unchanged;
+
+  if (!_dbus_string_init (&path))
+    return FALSE;
+
+  unchanged = TRUE;
+
+  _dbus_hash_iter_init (activation->directories, &iter);
+  while (unchanged && _dbus_hash_iter_next (&iter))
+    {
+      BusServiceDirectory *s_dir;
+      DBusHashIter entry_iter;
+      DBusStat stat_buf;
+
+      s_dir = _dbus_hash_iter_get_value (&iter);
+
+      if (!s_dir->mtime_valid)
+        {
+          unchanged = FALSE;
+          break;
+        }
+
+      _dbus_string_set_length (&path, 0);
+
+      if (!_dbus_string_append (&path, s_dir->dir_c) ||
+          !_dbus_stat (&path, &stat_buf, NULL) ||
+          stat_buf.mtime != s_dir->mtime)
+        {
+          unchanged = FALSE;
+          break;
+        }
+
+      _dbus_hash_iter_init (s_dir->entries, &entry_iter);
+      while (_dbus_hash_iter_next (&entry_iter))
+        {
+          BusActivationEntry *entry;
+          DBusString filename;
+
+          entry = _dbus_hash_iter_get_value (&entry_iter);
+          _dbus_string_init_const (&filename, entry->filename);
+          _dbus_string_set_length (&path, 0);
+
+          if (!_dbus_string_append (&path, s_dir->dir_c) ||
+              !_dbus_concat_dir_and_file (&path, &filename) ||
+              !_dbus_stat (&path, &stat_buf, NULL) ||
+              stat_buf.mtime != entry->mtime)
+            {
+              unchanged = FALSE;
+              break;
+            }
+        }
+    }
+
+  _dbus_string_free (&path);
+
+  return unchanged;
+}
+
+static void
+remember_activation_miss (BusActivation *activation,
+                          const char    *service_name)
+{
+  char *key;
+
+  if (_dbus_hash_table_get_n_entries (activation->negative_cache) >=
+      MAX_NEGATIVE_CACHE_ENTRIES)
+    _dbus_hash_table_remove_all (activation->negative_cache);
+
+  /* This is only an optimization, so silently give up on OOM */
+  key = _dbus_strdup (service_name);
+  if (key == NULL)
+    return;
+
+  if (!_dbus_hash_table_insert_string (activation->negative_cache, key, key))
+    dbus_free (key);
+}
+
 static BusActivationEntry *
 activation_find_entry (BusActivation *activation,
                        const char    *service_name,
@@ -1569,11 +2519,24 @@ activation_find_entry (BusActivation *activation,
   entry = _dbus_hash_table_lookup_string (activation->entries, service_name);
   if (!entry)
     {
-      if (!update_service_cache (activation, error))
-        return NULL;
+      if (_dbus_hash_table_lookup_string (activation->negative_cache,
+                                          service_name) != NULL &&
+          service_directories_unchanged (activation))
+        {
+          _dbus_verbose ("\"%s\" is still not provided by any .service file\n",
+                         service_name);
+        }
+      else
+        {
+          if (!update_service_cache (activation, error))
+            return NULL;
 
-      entry = _dbus_hash_table_lookup_string (activation->entries,
-                                              service_name);
+          entry = _dbus_hash_table_lookup_string (activation->entries,
+                                                  service_name);
+
+          if (!entry)
+            remember_activation_miss (activation, service_name);
+        }
     }
   else
     {
@@ -1761,6 +2724,10 @@ bus_activation_activate_service (BusActivation  *activation,
 
           _dbus_verbose ("Service \"%s\" is already active\n", service_name);
 
+          /* Nobody to tell if we're starting it ahead of time */
+          if (activation_message == NULL)
+            return TRUE;
+
           message = dbus_message_new_method_return (activation_message);
 
           if (!message)
@@ -1805,7 +2772,8 @@ bus_activation_activate_service (BusActivation  *activation,
   pending_activation_entry->auto_activation = auto_activation;
 
   pending_activation_entry->activation_message = activation_message;
-  dbus_message_ref (activation_message);
+  if (activation_message)
+    dbus_message_ref (activation_message);
   pending_activation_entry->connection = connection;
   if (connection)
     dbus_connection_ref (connection);
@@ -1876,25 +2844,32 @@ bus_activation_activate_service (BusActivation  *activation,
             }
         }
 
-      pending_activation->timeout =
-        _dbus_timeout_new (bus_context_get_activation_timeout (activation->context),
-                           pending_activation_timed_out,
-                           pending_activation,
-                           NULL);
-      if (!pending_activation->timeout)
+      /* All pending activations share the same timeout, so they expire
+       * in the order they were started and a single DBusTimeout covers
+       * them. */
+      if (activation->pending_expire == NULL)
         {
-          _dbus_verbose ("Failed to create timeout for pending activation\n");
+          activation->pending_expire =
+            bus_expire_list_new (bus_context_get_loop (activation->context),
+                                 bus_context_get_activation_timeout (activation->context),
+                                 pending_activation_timed_out,
+                                 activation);
 
-          BUS_SET_OOM (error);
-          bus_pending_activation_unref (pending_activation);
-          bus_pending_activation_entry_free (pending_activation_entry);
-          return FALSE;
+          if (activation->pending_expire == NULL)
+            {
+              _dbus_verbose ("Failed to create timeout for pending activations\n");
+
+              BUS_SET_OOM (error);
+              bus_pending_activation_unref (pending_activation);
+              bus_pending_activation_entry_free (pending_activation_entry);
+              return FALSE;
+            }
         }
 
-      if (!_dbus_loop_add_timeout (bus_context_get_loop (activation->context),
-                                   pending_activation->timeout))
+      pending_activation->expire_link = _dbus_list_alloc_link (pending_activation);
+      if (!pending_activation->expire_link)
         {
-          _dbus_verbose ("Failed to add timeout for pending activation\n");
+          _dbus_verbose ("Failed to create timeout for pending activation\n");
 
           BUS_SET_OOM (error);
           bus_pending_activation_unref (pending_activation);
@@ -1902,7 +2877,10 @@ bus_activation_activate_service (BusActivation  *activation,
           return FALSE;
         }
 
-      pending_activation->timeout_added = TRUE;
+      _dbus_get_monotonic_time (&pending_activation->expire_item.added_tv_sec,
+                                &pending_activation->expire_item.added_tv_usec);
+      bus_expire_list_add_link (activation->pending_expire,
+                                pending_activation->expire_link);
 
       if (!_dbus_list_append (&pending_activation->entries, pending_activation_entry))
         {
@@ -2000,7 +2978,7 @@ bus_activation_activate_service (BusActivation  *activation,
             }
 
           /* Check whether systemd is already connected */
-          registry = bus_connection_get_registry (connection);
+          registry = bus_context_get_registry (activation->context);
           _dbus_string_init_const (&service_string, "org.freedesktop.systemd1");
           service = bus_registry_lookup (registry, &service_string);
 
@@ -2180,19 +3158,159 @@ bus_activation_activate_service (BusActivation  *activation,
                                         pending_activation_finished_cb,
                                         pending_activation);
 
-  if (!_dbus_babysitter_set_watch_functions (pending_activation->babysitter,
-                                             add_babysitter_watch,
-                                             remove_babysitter_watch,
-                                             toggle_babysitter_watch,
-                                             pending_activation,
-                                             NULL))
+  if (!_dbus_babysitter_set_watch_functions (pending_activation->babysitter,
+                                             add_babysitter_watch,
+                                             remove_babysitter_watch,
+                                             toggle_babysitter_watch,
+                                             pending_activation,
+                                             NULL))
+    {
+      BUS_SET_OOM (error);
+      _dbus_verbose ("Failed to set babysitter watch functions\n");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+prestart_service (BusActivation *activation,
+                  const char    *service_name)
+{
+  BusTransaction *transaction;
+  DBusString service_str;
+  DBusError error;
+
+  _dbus_string_init_const (&service_str, service_name);
+
+  if (bus_registry_lookup (bus_context_get_registry (activation->context),
+                           &service_str) != NULL ||
+      _dbus_hash_table_lookup_string (activation->pending_activations,
+                                      service_name) != NULL)
+    return;
+
+  dbus_error_init (&error);
+
+  transaction = bus_transaction_new (activation->context);
+  if (transaction == NULL)
+    {
+      BUS_SET_OOM (&error);
+    }
+  else if (bus_activation_activate_service (activation, NULL, transaction,
+                                            FALSE, NULL, service_name,
+                                            &error))
+    {
+      bus_transaction_execute_and_free (transaction);
+      return;
+    }
+  else
+    {
+      bus_transaction_cancel_and_free (transaction);
+    }
+
+  bus_context_log (activation->context, DBUS_SYSTEM_LOG_INFO,
+                   "Failed to start service '%s' ahead of time: %s",
+                   service_name, error.message);
+  dbus_error_free (&error);
+}
+
+/**
+ * Starts the services whose .service file asks for it with Prestart=true,
+ * and the services most recently started on request as remembered in the
+ * service cache, unless they are already running. Nobody is waiting for
+ * these, so failures are only logged.
+ *
+ * @param activation the activation
+ */
+void
+bus_activation_prestart_services (BusActivation *activation)
+{
+  DBusList *names;
+  DBusList *link;
+  DBusHashIter iter;
+  int max_recent;
+
+  names = NULL;
+
+  /* Starting services may rescan the service directories, so don't
+   * iterate over the entries while doing it */
+  _dbus_hash_iter_init (activation->entries, &iter);
+  while (_dbus_hash_iter_next (&iter))
+    {
+      BusActivationEntry *entry = _dbus_hash_iter_get_value (&iter);
+      char *name;
+
+      if (!entry->prestart)
+        continue;
+
+      name = _dbus_strdup (entry->name);
+      if (name == NULL || !_dbus_list_append (&names, name))
+        {
+          dbus_free (name);
+          break;
+        }
+    }
+
+  max_recent = bus_context_get_prestart_recent_services (activation->context);
+
+  for (link = _dbus_list_get_first_link (&activation->recent_services);
+       link != NULL && max_recent > 0;
+       link = _dbus_list_get_next_link (&activation->recent_services, link))
+    {
+      char *name;
+
+      max_recent--;
+
+      /* Don't try to start services that have since gone away */
+      if (_dbus_hash_table_lookup_string (activation->entries,
+                                          link->data) == NULL)
+        continue;
+
+      name = _dbus_strdup (link->data);
+      if (name == NULL || !_dbus_list_append (&names, name))
+        {
+          dbus_free (name);
+          break;
+        }
+    }
+
+  while ((link = _dbus_list_pop_first_link (&names)) != NULL)
     {
-      BUS_SET_OOM (error);
-      _dbus_verbose ("Failed to set babysitter watch functions\n");
-      return FALSE;
+      prestart_service (activation, link->data);
+      dbus_free (link->data);
+      _dbus_list_free_link (link);
     }
+}
 
-  return TRUE;
+/**
+ * Gets how many messages are waiting for a service to be activated.
+ *
+ * @param activation the activation
+ * @returns zero if no activation is in progress
+ */
+int
+bus_activation_get_n_pending_activations (BusActivation *activation)
+{
+  return activation->n_pending_activations;
+}
+
+/**
+ * Writes the service cache if the list of recently started services
+ * has changed since it was last written.
+ *
+ * @param activation the activation
+ */
+void
+bus_activation_save_recent_services (BusActivation *activation)
+{
+  long now;
+
+  if (activation->cache_file == NULL ||
+      !activation->recent_services_changed)
+    return;
+
+  _dbus_get_real_time (&now, NULL);
+  service_cache_save (activation, now);
 }
 
 dbus_bool_t
@@ -2289,6 +3407,7 @@ dbus_activation_systemd_failure (BusActivation *activation,
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
 
 #include <stdio.h>
+#include <dbus/dbus-file.h>
 
 #define SERVICE_NAME_1 "MyService1"
 #define SERVICE_NAME_2 "MyService2"
@@ -2525,7 +3644,7 @@ do_service_reload_test (DBusString *dir, dbus_bool_t oom_test)
   if (!_dbus_list_append (&directories, _dbus_string_get_data (dir)))
     return FALSE;
 
-  activation = bus_activation_new (NULL, &address, &directories, NULL);
+  activation = bus_activation_new (NULL, &address, &directories, NULL, NULL);
   if (!activation)
     return FALSE;
 
@@ -2545,6 +3664,10 @@ do_service_reload_test (DBusString *dir, dbus_bool_t oom_test)
   if (!do_test ("Nonexisting service file", oom_test, &d))
     return FALSE;
 
+  /* The second miss is answered from the negative cache */
+  if (!do_test ("Nonexisting service file, again", oom_test, &d))
+    return FALSE;
+
   /* Check for added service file */
   if (!test_create_service_file (dir, SERVICE_FILE_2, SERVICE_NAME_2, "exec-2"))
     return FALSE;
@@ -2584,8 +3707,492 @@ do_service_reload_test (DBusString *dir, dbus_bool_t oom_test)
   if (!do_test ("Updated service file, part 2", oom_test, &d))
     return FALSE;
 
+  if (!oom_test)
+    {
+      const char *dir_c = _dbus_string_get_const_data (dir);
+      dbus_bool_t handled;
+
+      /* Changes reported by the directory watch are applied to the cache
+       * without a rescan */
+      if (!test_create_service_file (dir, SERVICE_FILE_2, SERVICE_NAME_2, "exec-2"))
+        return FALSE;
+
+      if (!bus_activation_update_service_file (activation, dir_c,
+                                               SERVICE_FILE_2, &handled, NULL))
+        return FALSE;
+
+      if (!handled ||
+          _dbus_hash_table_lookup_string (activation->entries,
+                                          SERVICE_NAME_2) == NULL)
+        _dbus_assert_not_reached ("changed service file was not loaded");
+
+      if (!test_remove_service_file (dir, SERVICE_FILE_2))
+        return FALSE;
+
+      if (!bus_activation_update_service_file (activation, dir_c,
+                                               SERVICE_FILE_2, &handled, NULL))
+        return FALSE;
+
+      if (!handled ||
+          _dbus_hash_table_lookup_string (activation->entries,
+                                          SERVICE_NAME_2) != NULL)
+        _dbus_assert_not_reached ("removed service file was not dropped");
+
+      /* Other files are not our business */
+      if (!bus_activation_update_service_file (activation, dir_c,
+                                               "README", &handled, NULL))
+        return FALSE;
+
+      if (handled)
+        _dbus_assert_not_reached ("non-.service file was handled");
+    }
+
+  bus_activation_unref (activation);
+  _dbus_list_clear (&directories);
+
+  return TRUE;
+}
+
+static dbus_bool_t
+s_dir_mtime_valid (BusActivation *activation,
+                   DBusString    *dir)
+{
+  BusServiceDirectory *s_dir;
+
+  s_dir = _dbus_hash_table_lookup_string (activation->directories,
+                                          _dbus_string_get_const_data (dir));
+  _dbus_assert (s_dir != NULL);
+
+  return s_dir->mtime_valid;
+}
+
+/* A miss is only answered from the negative cache while nothing in the
+ * service directories has changed, including files edited in place */
+static dbus_bool_t
+do_negative_cache_test (DBusString *dir)
+{
+  BusActivation *activation;
+  DBusList      *directories;
+  DBusString     address;
+  DBusError      error = DBUS_ERROR_INIT;
+
+  directories = NULL;
+  _dbus_string_init_const (&address, "");
+
+  if (!_dbus_list_append (&directories, _dbus_string_get_data (dir)))
+    return FALSE;
+
+  /* Let the directory and its file settle, so that their mtimes can
+   * be relied on once scanned */
+  _dbus_sleep_milliseconds (2100);
+
+  activation = bus_activation_new (NULL, &address, &directories, NULL, NULL);
+  if (activation == NULL)
+    return FALSE;
+
+  if (!s_dir_mtime_valid (activation, dir))
+    _dbus_assert_not_reached ("settled directory mtime was not trusted");
+
+  if (activation_find_entry (activation, SERVICE_NAME_3, &error) != NULL)
+    _dbus_assert_not_reached ("found a service that has no file");
+  dbus_error_free (&error);
+
+  if (_dbus_hash_table_lookup_string (activation->negative_cache,
+                                      SERVICE_NAME_3) == NULL ||
+      !service_directories_unchanged (activation))
+    _dbus_assert_not_reached ("miss was not cached");
+
+  /* Rewriting the file in place leaves the directory mtime alone */
+  if (!test_create_service_file (dir, SERVICE_FILE_1, SERVICE_NAME_3, "exec-3"))
+    return FALSE;
+
+  if (service_directories_unchanged (activation))
+    _dbus_assert_not_reached ("file edited in place was not noticed");
+
+  if (activation_find_entry (activation, SERVICE_NAME_3, &error) == NULL)
+    _dbus_assert_not_reached ("negative cache hid a file edited in place");
+
+  /* A directory modified in the second it was scanned can't be trusted */
+  if (!test_create_service_file (dir, SERVICE_FILE_2, SERVICE_NAME_2, "exec-2"))
+    return FALSE;
+
+  bus_activation_unref (activation);
+  activation = bus_activation_new (NULL, &address, &directories, NULL, NULL);
+  if (activation == NULL)
+    return FALSE;
+
+  if (s_dir_mtime_valid (activation, dir))
+    _dbus_assert_not_reached ("fresh directory mtime was trusted");
+
+  bus_activation_unref (activation);
+  _dbus_list_clear (&directories);
+
+  return TRUE;
+}
+
+static BusActivation *
+new_cached_activation (DBusList   **directories,
+                       const char  *cache_file)
+{
+  BusActivation *activation;
+  DBusString     address;
+
+  _dbus_string_init_const (&address, "");
+
+  activation = bus_activation_new (NULL, &address, directories, cache_file,
+                                   NULL);
+  if (activation == NULL)
+    _dbus_assert_not_reached ("could not create activation");
+
+  return activation;
+}
+
+static const char *
+cached_exec (BusActivation *activation,
+             const char    *service_name)
+{
+  BusActivationEntry *entry;
+
+  entry = _dbus_hash_table_lookup_string (activation->entries, service_name);
+  if (entry == NULL)
+    _dbus_assert_not_reached ("service missing after loading service cache");
+
+  return entry->exec;
+}
+
+static dbus_bool_t
+do_service_cache_test (DBusString *dir)
+{
+  BusActivation *activation;
+  BusActivationEntry *entry;
+  DBusList      *directories;
+  DBusString     cache_file;
+  DBusStat       stat_buf;
+  const char    *cache_file_c;
+  char          *recent;
+
+  directories = NULL;
+
+  if (!_dbus_string_init (&cache_file))
+    return FALSE;
+
+  if (!_dbus_string_copy (dir, 0, &cache_file, 0) ||
+      !_dbus_string_append (&cache_file, "/service.cache"))
+    return FALSE;
+
+  cache_file_c = _dbus_string_get_const_data (&cache_file);
+
+  if (!_dbus_list_append (&directories, _dbus_string_get_data (dir)))
+    return FALSE;
+
+  /* A cache is written on first use */
+  activation = new_cached_activation (&directories, cache_file_c);
+  bus_activation_unref (activation);
+
+  if (!_dbus_stat (&cache_file, &stat_buf, NULL))
+    _dbus_assert_not_reached ("service cache was not written");
+
+  /* Entries for unchanged files are taken from the cache rather than
+   * the file: plant a different Exec in the cache to tell them apart */
+  activation = new_cached_activation (&directories, cache_file_c);
+  entry = _dbus_hash_table_lookup_string (activation->entries, SERVICE_NAME_1);
+  if (entry == NULL)
+    _dbus_assert_not_reached ("service missing after loading service cache");
+  dbus_free (entry->exec);
+  entry->exec = _dbus_strdup ("exec-cached");
+  if (entry->exec == NULL)
+    return FALSE;
+  entry->prestart = TRUE;
+  recent = _dbus_strdup (SERVICE_NAME_1);
+  if (recent == NULL ||
+      !_dbus_list_append (&activation->recent_services, recent))
+    return FALSE;
+  service_cache_save (activation, entry->mtime + 1);
+  bus_activation_unref (activation);
+
+  activation = new_cached_activation (&directories, cache_file_c);
+  if (strcmp (cached_exec (activation, SERVICE_NAME_1), "exec-cached") != 0)
+    _dbus_assert_not_reached ("service cache was not used");
+  entry = _dbus_hash_table_lookup_string (activation->entries, SERVICE_NAME_1);
+  if (!entry->prestart)
+    _dbus_assert_not_reached ("Prestart was not cached");
+  if (_dbus_list_get_length (&activation->recent_services) != 1 ||
+      strcmp (activation->recent_services->data, SERVICE_NAME_1) != 0)
+    _dbus_assert_not_reached ("recently started services were not cached");
+  bus_activation_unref (activation);
+
+  /* A file rewritten in place invalidates its cache entry. It may be
+   * within the same second, so make the size change */
+  if (!test_create_service_file (dir, SERVICE_FILE_1, SERVICE_NAME_1, "exec-1-new"))
+    return FALSE;
+
+  activation = new_cached_activation (&directories, cache_file_c);
+  if (strcmp (cached_exec (activation, SERVICE_NAME_1), "exec-1-new") != 0)
+    _dbus_assert_not_reached ("stale service cache entry was used");
+  bus_activation_unref (activation);
+
+  /* A corrupt cache is ignored */
+  if (!_dbus_string_set_length (&cache_file, 0) ||
+      !_dbus_string_append (&cache_file, "not a cache"))
+    return FALSE;
+
+  {
+    DBusString path;
+
+    if (!_dbus_string_init (&path) ||
+        !_dbus_string_copy (dir, 0, &path, 0) ||
+        !_dbus_string_append (&path, "/service.cache") ||
+        !_dbus_string_save_to_file (&cache_file, &path, TRUE, NULL))
+      return FALSE;
+
+    activation = new_cached_activation (&directories,
+                                        _dbus_string_get_const_data (&path));
+    if (strcmp (cached_exec (activation, SERVICE_NAME_1), "exec-1-new") != 0)
+      _dbus_assert_not_reached ("corrupt service cache was used");
+    bus_activation_unref (activation);
+
+    _dbus_string_free (&path);
+  }
+
+  _dbus_list_clear (&directories);
+  _dbus_string_free (&cache_file);
+
+  return TRUE;
+}
+
+/* Whether the cache file has a record for the given service file */
+static dbus_bool_t
+service_cache_mentions (const DBusString *cache_file,
+                        const char       *filename)
+{
+  DBusString contents;
+  dbus_bool_t found;
+
+  if (!_dbus_string_init (&contents))
+    _dbus_assert_not_reached ("no memory");
+
+  if (!_dbus_file_get_contents (&contents, cache_file, NULL))
+    _dbus_assert_not_reached ("could not read service cache");
+
+  found = _dbus_string_find (&contents, 0, filename, NULL);
+  _dbus_string_free (&contents);
+
+  return found;
+}
+
+/* Adding, removing or renaming a file in a service directory must make
+ * the daemon parse what changed instead of trusting the cache, and
+ * rewrite the cache to match */
+static dbus_bool_t
+do_service_cache_stale_test (DBusString *dir)
+{
+  BusActivation *activation;
+  BusActivationEntry *entry;
+  DBusList      *directories;
+  DBusString     cache_file;
+  DBusString     old_path, new_path;
+  const char    *cache_file_c;
+
+  directories = NULL;
+
+  if (!_dbus_string_init (&cache_file) ||
+      !_dbus_string_copy (dir, 0, &cache_file, 0) ||
+      !_dbus_string_append (&cache_file, "/service.cache"))
+    return FALSE;
+
+  cache_file_c = _dbus_string_get_const_data (&cache_file);
+
+  if (!_dbus_list_append (&directories, _dbus_string_get_data (dir)))
+    return FALSE;
+
+  /* Files changed in the second the cache is written are left out of
+   * it, so let each change age before scanning */
+  _dbus_sleep_milliseconds (1100);
+
+  /* Mark the one entry as coming from the cache, as in
+   * do_service_cache_test() */
+  activation = new_cached_activation (&directories, cache_file_c);
+  entry = _dbus_hash_table_lookup_string (activation->entries, SERVICE_NAME_1);
+  if (entry == NULL)
+    _dbus_assert_not_reached ("service missing after scan");
+  dbus_free (entry->exec);
+  entry->exec = _dbus_strdup ("exec-cached");
+  if (entry->exec == NULL)
+    return FALSE;
+  service_cache_save (activation, entry->mtime + 1);
+  bus_activation_unref (activation);
+
+  if (!service_cache_mentions (&cache_file, SERVICE_FILE_1) ||
+      service_cache_mentions (&cache_file, SERVICE_FILE_2))
+    _dbus_assert_not_reached ("service cache has the wrong files");
+
+  /* Added: the new file is parsed, the unchanged one still cached */
+  if (!test_create_service_file (dir, SERVICE_FILE_2, SERVICE_NAME_2, "exec-2"))
+    return FALSE;
+
+  _dbus_sleep_milliseconds (1100);
+
+  activation = new_cached_activation (&directories, cache_file_c);
+  if (strcmp (cached_exec (activation, SERVICE_NAME_1), "exec-cached") != 0)
+    _dbus_assert_not_reached ("unchanged file was not taken from the cache");
+  if (strcmp (cached_exec (activation, SERVICE_NAME_2), "exec-2") != 0)
+    _dbus_assert_not_reached ("added file was not parsed");
+  bus_activation_unref (activation);
+
+  if (!service_cache_mentions (&cache_file, SERVICE_FILE_2))
+    _dbus_assert_not_reached ("cache was not rewritten after adding a file");
+
+  /* Removed: the cache's record for it must not bring it back */
+  if (!test_remove_service_file (dir, SERVICE_FILE_2))
+    return FALSE;
+
+  activation = new_cached_activation (&directories, cache_file_c);
+  if (_dbus_hash_table_lookup_string (activation->entries,
+                                      SERVICE_NAME_2) != NULL)
+    _dbus_assert_not_reached ("removed file was taken from the cache");
+  if (strcmp (cached_exec (activation, SERVICE_NAME_1), "exec-cached") != 0)
+    _dbus_assert_not_reached ("unchanged file was not taken from the cache");
+  bus_activation_unref (activation);
+
+  if (service_cache_mentions (&cache_file, SERVICE_FILE_2))
+    _dbus_assert_not_reached ("cache was not rewritten after removing a file");
+
+  /* Renamed: same inode, size and mtime, but the record is for the old
+   * name, so the file has to be parsed again under the new one */
+  if (!_dbus_string_init (&old_path) ||
+      !_dbus_string_copy (dir, 0, &old_path, 0) ||
+      !_dbus_string_append (&old_path, "/" SERVICE_FILE_1) ||
+      !_dbus_string_init (&new_path) ||
+      !_dbus_string_copy (dir, 0, &new_path, 0) ||
+      !_dbus_string_append (&new_path, "/" SERVICE_FILE_3))
+    return FALSE;
+
+  if (rename (_dbus_string_get_const_data (&old_path),
+              _dbus_string_get_const_data (&new_path)) != 0)
+    _dbus_assert_not_reached ("could not rename service file");
+
+  activation = new_cached_activation (&directories, cache_file_c);
+  if (strcmp (cached_exec (activation, SERVICE_NAME_1), "exec-1") != 0)
+    _dbus_assert_not_reached ("renamed file was taken from the cache");
+  entry = _dbus_hash_table_lookup_string (activation->entries, SERVICE_NAME_1);
+  if (strcmp (entry->filename, SERVICE_FILE_3) != 0)
+    _dbus_assert_not_reached ("renamed file has the old name");
   bus_activation_unref (activation);
+
+  if (service_cache_mentions (&cache_file, SERVICE_FILE_1) ||
+      !service_cache_mentions (&cache_file, SERVICE_FILE_3))
+    _dbus_assert_not_reached ("cache was not rewritten after renaming a file");
+
+  _dbus_string_free (&old_path);
+  _dbus_string_free (&new_path);
   _dbus_list_clear (&directories);
+  _dbus_string_free (&cache_file);
+
+  return TRUE;
+}
+
+#define PRESTART_TEST_CONFIG \
+  "<busconfig>\n" \
+  "  <listen>debug-pipe:name=prestart-test</listen>\n" \
+  "  <servicedir>%s</servicedir>\n" \
+  "  <servicecache>%s/service.cache</servicecache>\n" \
+  "  <limit name=\"prestart_recent_services\">2</limit>\n" \
+  "</busconfig>\n"
+
+static BusContext *
+new_prestart_context (const DBusString *config_file)
+{
+  BusContext *context;
+  DBusError error = DBUS_ERROR_INIT;
+
+  context = bus_context_new (config_file, BUS_CONTEXT_FLAG_NONE,
+                             NULL, NULL, NULL, NULL, &error);
+  if (context == NULL)
+    {
+      _dbus_warn ("Failed to create prestart test bus: %s\n", error.message);
+      _dbus_assert_not_reached ("could not create bus context");
+    }
+
+  return context;
+}
+
+/* The services the bus started most recently on request are started
+ * with it next time, but no more of them than the limit allows */
+static dbus_bool_t
+do_prestart_test (DBusString *dir)
+{
+  BusContext    *context;
+  BusActivation *activation;
+  DBusString     config;
+  DBusString     config_file;
+  const char    *dir_c;
+  const char    *recent[] = { SERVICE_NAME_3, SERVICE_NAME_1, SERVICE_NAME_2 };
+  int            i;
+
+  dir_c = _dbus_string_get_const_data (dir);
+
+  /* Nothing is started, so it doesn't matter that these don't exist */
+  if (!test_create_service_file (dir, SERVICE_FILE_2, SERVICE_NAME_2,
+                                 "/nonexistent/exec-2") ||
+      !test_create_service_file (dir, SERVICE_FILE_3, SERVICE_NAME_3,
+                                 "/nonexistent/exec-3"))
+    return FALSE;
+
+  if (!_dbus_string_init (&config) ||
+      !_dbus_string_append_printf (&config, PRESTART_TEST_CONFIG,
+                                   dir_c, dir_c) ||
+      !_dbus_string_init (&config_file) ||
+      !_dbus_string_copy (dir, 0, &config_file, 0) ||
+      !_dbus_string_append (&config_file, "/prestart.conf"))
+    return FALSE;
+
+  if (!_dbus_string_save_to_file (&config, &config_file, FALSE, NULL))
+    _dbus_assert_not_reached ("could not write prestart test config");
+
+  /* With nothing remembered yet, nothing is started */
+  context = new_prestart_context (&config_file);
+  activation = bus_context_get_activation (context);
+
+  if (_dbus_hash_table_get_n_entries (activation->pending_activations) != 0)
+    _dbus_assert_not_reached ("services were started without being recorded");
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (recent); i++)
+    {
+      char *name = _dbus_strdup (recent[i]);
+
+      if (name == NULL ||
+          !_dbus_list_append (&activation->recent_services, name))
+        return FALSE;
+    }
+
+  activation->recent_services_changed = TRUE;
+  bus_context_shutdown (context);
+  bus_context_unref (context);
+
+  /* The recorded list comes back from the service cache, and the two
+   * most recent are started straight away */
+  context = new_prestart_context (&config_file);
+  activation = bus_context_get_activation (context);
+
+  if (_dbus_list_get_length (&activation->recent_services) !=
+      _DBUS_N_ELEMENTS (recent))
+    _dbus_assert_not_reached ("recently started services were not saved");
+
+  if (_dbus_hash_table_lookup_string (activation->pending_activations,
+                                      SERVICE_NAME_3) == NULL ||
+      _dbus_hash_table_lookup_string (activation->pending_activations,
+                                      SERVICE_NAME_1) == NULL)
+    _dbus_assert_not_reached ("recently started service was not prestarted");
+
+  if (_dbus_hash_table_lookup_string (activation->pending_activations,
+                                      SERVICE_NAME_2) != NULL ||
+      _dbus_hash_table_get_n_entries (activation->pending_activations) != 2)
+    _dbus_assert_not_reached ("more services prestarted than the limit allows");
+
+  bus_context_unref (context);
+
+  _dbus_string_free (&config);
+  _dbus_string_free (&config_file);
 
   return TRUE;
 }
@@ -2622,6 +4229,30 @@ bus_activation_service_reload_test (const DBusString *test_data_dir)
       /* Do nothing? */
     }
 
+  if (!init_service_reload_test (&directory))
+    _dbus_assert_not_reached ("could not initiate service reload test");
+
+  if (!do_service_cache_test (&directory))
+    _dbus_assert_not_reached ("service cache test failed");
+
+  if (!init_service_reload_test (&directory))
+    _dbus_assert_not_reached ("could not initiate service reload test");
+
+  if (!do_negative_cache_test (&directory))
+    _dbus_assert_not_reached ("negative cache test failed");
+
+  if (!init_service_reload_test (&directory))
+    _dbus_assert_not_reached ("could not initiate service reload test");
+
+  if (!do_service_cache_stale_test (&directory))
+    _dbus_assert_not_reached ("stale service cache test failed");
+
+  if (!init_service_reload_test (&directory))
+    _dbus_assert_not_reached ("could not initiate service reload test");
+
+  if (!do_prestart_test (&directory))
+    _dbus_assert_not_reached ("prestart test failed");
+
   /* Do OOM tests */
   if (!init_service_reload_test (&directory))
     _dbus_assert_not_reached ("could not initiate service reload test");
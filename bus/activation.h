@@ -31,14 +31,22 @@
 BusActivation* bus_activation_new              (BusContext        *context,
 						const DBusString  *address,
 						DBusList         **directories,
+						const char        *cache_file,
 						DBusError         *error);
 dbus_bool_t bus_activation_reload           (BusActivation     *activation,
 						const DBusString  *address,
 						DBusList         **directories,
+						const char        *cache_file,
 						DBusError         *error);
 BusActivation* bus_activation_ref              (BusActivation     *activation);
 void           bus_activation_unref            (BusActivation     *activation);
 
+dbus_bool_t    bus_activation_update_service_file (BusActivation     *activation,
+						const char        *dir,
+						const char        *filename,
+						dbus_bool_t       *handled,
+						DBusError         *error);
+
 dbus_bool_t   bus_activation_set_environment_variable (BusActivation     *activation,
 						const char        *key,
 						const char        *value,
@@ -54,6 +62,9 @@ dbus_bool_t    bus_activation_service_created  (BusActivation     *activation,
 						const char        *service_name,
 						BusTransaction    *transaction,
 						DBusError         *error);
+void           bus_activation_prestart_services    (BusActivation     *activation);
+void           bus_activation_save_recent_services (BusActivation     *activation);
+int            bus_activation_get_n_pending_activations (BusActivation *activation);
 dbus_bool_t    bus_activation_list_services    (BusActivation     *registry,
 						char            ***listp,
 						int               *array_len);
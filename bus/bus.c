@@ -37,6 +37,8 @@
 #include "apparmor.h"
 #include "audit.h"
 #include "dir-watch.h"
+#include "usercache.h"
+#include "handoff.h"
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-hash.h>
 #include <dbus/dbus-credentials.h>
@@ -47,6 +49,11 @@
 #include <signal.h>
 #endif
 
+/* How long answers from the user database (NSS) are trusted before
+ * they are looked up again in the background
+ */
+#define BUS_USER_CACHE_TTL_SECONDS 60
+
 struct BusContext
 {
   int refcount;
@@ -65,6 +72,7 @@ struct BusContext
   BusRegistry *registry;
   BusPolicy *policy;
   BusMatchmaker *matchmaker;
+  BusUserCache *user_cache;
   BusLimits limits;
   DBusRLimit *initial_fd_limit;
   unsigned int fork : 1;
@@ -73,6 +81,7 @@ struct BusContext
   unsigned int allow_anonymous : 1;
   unsigned int systemd_activation : 1;
   dbus_bool_t watches_enabled;
+  dbus_bool_t accepting;
 };
 
 static dbus_int32_t server_data_slot = -1;
@@ -167,14 +176,24 @@ remove_server_timeout (DBusTimeout *timeout,
   _dbus_loop_remove_timeout (context->loop, timeout);
 }
 
-static void
-new_connection_callback (DBusServer     *server,
-                         DBusConnection *new_connection,
-                         void           *data)
+/**
+ * Takes on a connection to the bus, applying the configured limits.
+ * This is what happens to every connection a server accepts, and to
+ * connections handed over by a previous instance of the bus.
+ *
+ * @param context the bus context
+ * @param new_connection the connection
+ * @returns #FALSE if no memory, in which case the connection is closed
+ */
+dbus_bool_t
+bus_context_add_connection (BusContext     *context,
+                            DBusConnection *new_connection)
 {
-  BusContext *context = data;
+  dbus_bool_t retval;
 
-  if (!bus_connections_setup_connection (context->connections, new_connection))
+  retval = bus_connections_setup_connection (context->connections,
+                                             new_connection);
+  if (!retval)
     {
       _dbus_verbose ("No memory to setup new connection\n");
 
@@ -201,7 +220,18 @@ new_connection_callback (DBusServer     *server,
   dbus_connection_set_allow_anonymous (new_connection,
                                        context->allow_anonymous);
 
+  return retval;
+}
+
+static void
+new_connection_callback (DBusServer     *server,
+                         DBusConnection *new_connection,
+                         void           *data)
+{
+  BusContext *context = data;
+
   /* on OOM, we won't have ref'd the connection so it will die. */
+  bus_context_add_connection (context, new_connection);
 }
 
 static void
@@ -275,6 +305,7 @@ process_config_first_time_only (BusContext       *context,
 				BusConfigParser  *parser,
                                 const DBusString *address,
                                 BusContextFlags   flags,
+                                BusHandoff       *handoff,
 				DBusError        *error)
 {
   DBusString log_prefix;
@@ -303,12 +334,15 @@ process_config_first_time_only (BusContext       *context,
    * we'd have to use fcntl() locks on the pid file to
    * avoid that. But we want to check for the pid file
    * before overwriting any existing sockets, etc.
+   *
+   * When taking over from a previous instance the pid file is
+   * that instance's, and the sockets are the ones we were given.
    */
 
   if (flags & BUS_CONTEXT_FLAG_WRITE_PID_FILE)
     pidfile = bus_config_parser_get_pidfile (parser);
 
-  if (pidfile != NULL)
+  if (pidfile != NULL && handoff == NULL)
     {
       DBusString u;
       DBusStat stbuf;
@@ -426,7 +460,27 @@ process_config_first_time_only (BusContext       *context,
 
   /* Listen on our addresses */
 
-  if (address)
+  if (handoff != NULL)
+    {
+      DBusServer *server;
+
+      while ((server = bus_handoff_take_server (handoff)) != NULL)
+        {
+          if (!_dbus_list_append (&context->servers, server))
+            {
+              dbus_server_disconnect (server);
+              dbus_server_unref (server);
+              goto oom;
+            }
+
+          if (!setup_server (context, server, auth_mechanisms, error))
+            {
+              _DBUS_ASSERT_ERROR_IS_SET (error);
+              goto failed;
+            }
+        }
+    }
+  else if (address)
     {
       DBusServer *server;
 
@@ -607,12 +661,16 @@ process_config_every_time (BusContext      *context,
   /* Create activation subsystem */
   if (context->activation)
     {
-      if (!bus_activation_reload (context->activation, &full_address, dirs, error))
+      if (!bus_activation_reload (context->activation, &full_address, dirs,
+                                  bus_config_parser_get_service_cache (parser),
+                                  error))
         goto failed;
     }
   else
     {
-      context->activation = bus_activation_new (context, &full_address, dirs, error);
+      context->activation = bus_activation_new (context, &full_address, dirs,
+                                                bus_config_parser_get_service_cache (parser),
+                                                error);
     }
 
   if (context->activation == NULL)
@@ -740,6 +798,7 @@ bus_context_new (const DBusString *config_file,
                  DBusPipe         *print_addr_pipe,
                  DBusPipe         *print_pid_pipe,
                  const DBusString *address,
+                 BusHandoff       *handoff,
                  DBusError        *error)
 {
   BusContext *context;
@@ -767,7 +826,10 @@ bus_context_new (const DBusString *config_file,
     }
   context->refcount = 1;
 
-  if (!_dbus_generate_uuid (&context->uuid, error))
+  /* clients may have seen the old bus's id, so it must not change */
+  if (handoff != NULL)
+    context->uuid = *bus_handoff_get_uuid (handoff);
+  else if (!_dbus_generate_uuid (&context->uuid, error))
     goto failed;
 
   if (!_dbus_string_copy_data (config_file, &context->config_file))
@@ -784,6 +846,7 @@ bus_context_new (const DBusString *config_file,
     }
 
   context->watches_enabled = TRUE;
+  context->accepting = TRUE;
 
   context->registry = bus_registry_new (context);
   if (context->registry == NULL)
@@ -799,7 +862,8 @@ bus_context_new (const DBusString *config_file,
       goto failed;
     }
 
-  if (!process_config_first_time_only (context, parser, address, flags, error))
+  if (!process_config_first_time_only (context, parser, address, flags,
+                                       handoff, error))
     {
       _DBUS_ASSERT_ERROR_IS_SET (error);
       goto failed;
@@ -875,6 +939,13 @@ bus_context_new (const DBusString *config_file,
       goto failed;
     }
 
+  context->user_cache = bus_user_cache_new (BUS_USER_CACHE_TTL_SECONDS);
+  if (context->user_cache == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
   /* check user before we fork */
   if (context->user != NULL)
     {
@@ -914,9 +985,12 @@ bus_context_new (const DBusString *config_file,
 
         /* Need to write PID file and to PID pipe for ourselves,
          * not for the child process. This is a no-op if the pidfile
-         * is NULL and print_pid_pipe is NULL.
+         * is NULL and print_pid_pipe is NULL. When taking over, the
+         * pid file still belongs to the previous instance until it
+         * has let go, see bus_context_take_over_pid_file().
          */
-        if (!_dbus_write_pid_to_file_and_pipe (context->pidfile ? &u : NULL,
+        if (handoff == NULL &&
+            !_dbus_write_pid_to_file_and_pipe (context->pidfile ? &u : NULL,
                                                print_pid_pipe,
                                                _dbus_getpid (),
                                                error))
@@ -963,9 +1037,10 @@ bus_context_new (const DBusString *config_file,
     }
 
   /* Here we change our credentials if required,
-   * as soon as we've set up our sockets and pidfile
+   * as soon as we've set up our sockets and pidfile.
+   * A previous instance handing over to us already did.
    */
-  if (context->user != NULL)
+  if (context->user != NULL && handoff == NULL)
     {
       if (!_dbus_change_to_daemon_user (context->user, error))
 	{
@@ -978,6 +1053,23 @@ bus_context_new (const DBusString *config_file,
 
   dbus_server_free_data_slot (&server_data_slot);
 
+  /* The connections handed over to us are set up first, see
+   * bus_handoff_finish(), and the services were already started */
+  if (handoff != NULL)
+    return context;
+
+  /* Only now are we running as the right user in the right process */
+  if (context->limits.io_threads > 0 &&
+      !bus_connections_start_io_workers (context->connections,
+                                         context->limits.io_threads,
+                                         error))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      goto failed;
+    }
+
+  bus_activation_prestart_services (context->activation);
+
   return context;
 
  failed:
@@ -1009,6 +1101,7 @@ bus_context_reload_config (BusContext *context,
 
   /* Flush the user database cache */
   _dbus_flush_caches ();
+  bus_user_cache_flush (context->user_cache);
 
   ret = FALSE;
   _dbus_string_init_const (&config_file, context->config_file);
@@ -1024,11 +1117,13 @@ bus_context_reload_config (BusContext *context,
       _DBUS_ASSERT_ERROR_IS_SET (error);
       goto failed;
     }
+  bus_connections_update_idle_trim (context->connections);
   if (!process_config_postinit (context, parser, error))
     {
       _DBUS_ASSERT_ERROR_IS_SET (error);
       goto failed;
     }
+  bus_connections_check_direct_channels (context->connections);
   ret = TRUE;
 
   bus_context_log (context, DBUS_SYSTEM_LOG_INFO, "Reloaded configuration");
@@ -1040,6 +1135,47 @@ bus_context_reload_config (BusContext *context,
   return ret;
 }
 
+/**
+ * Called by the directory watch for each file that was created, changed
+ * or removed in a watched directory. Changes to .service files are
+ * applied to the activation cache directly; files that the configuration
+ * parser would not read are ignored.
+ *
+ * @param context the bus context
+ * @param dir the watched directory
+ * @param filename base name of the file that changed
+ * @returns #TRUE if the change was dealt with, #FALSE if the whole
+ *  configuration needs to be reloaded
+ */
+dbus_bool_t
+bus_context_handle_file_changed (BusContext *context,
+                                 const char *dir,
+                                 const char *filename)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  DBusString str;
+  dbus_bool_t handled;
+
+  if (context->activation == NULL)
+    return FALSE;
+
+  if (!bus_activation_update_service_file (context->activation, dir,
+                                           filename, &handled, &error))
+    {
+      dbus_error_free (&error);
+      return FALSE;
+    }
+
+  if (handled)
+    return TRUE;
+
+  /* <includedir> only reads *.conf, so editor backups and package
+   * manager temporary files can't change the configuration.
+   */
+  _dbus_string_init_const (&str, filename);
+  return !_dbus_string_ends_with_c_str (&str, ".conf");
+}
+
 static void
 shutdown_server (BusContext *context,
                  DBusServer *server)
@@ -1063,6 +1199,33 @@ shutdown_server (BusContext *context,
   dbus_server_disconnect (server);
 }
 
+/**
+ * Replaces the pid in the pid file with ours, after taking over from
+ * a previous instance. We might no longer have the privileges to,
+ * but that is not worth undoing the restart for.
+ *
+ * @param context the bus context
+ */
+void
+bus_context_take_over_pid_file (BusContext *context)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  DBusString u;
+
+  if (context->pidfile == NULL)
+    return;
+
+  _dbus_string_init_const (&u, context->pidfile);
+  _dbus_delete_file (&u, NULL);
+
+  if (!_dbus_write_pid_to_file_and_pipe (&u, NULL, _dbus_getpid (), &error))
+    {
+      bus_context_log (context, DBUS_SYSTEM_LOG_WARNING,
+                       "Unable to update pid file: %s", error.message);
+      dbus_error_free (&error);
+    }
+}
+
 void
 bus_context_shutdown (BusContext  *context)
 {
@@ -1075,6 +1238,9 @@ bus_context_shutdown (BusContext  *context)
 
       link = _dbus_list_get_next_link (&context->servers, link);
     }
+
+  if (context->activation != NULL)
+    bus_activation_save_recent_services (context->activation);
 }
 
 BusContext *
@@ -1145,6 +1311,12 @@ bus_context_unref (BusContext *context)
           context->matchmaker = NULL;
         }
 
+      if (context->user_cache)
+        {
+          bus_user_cache_free (context->user_cache);
+          context->user_cache = NULL;
+        }
+
       dbus_free (context->config_file);
       dbus_free (context->log_prefix);
       dbus_free (context->type);
@@ -1229,11 +1401,18 @@ bus_context_get_loop (BusContext *context)
   return context->loop;
 }
 
+BusUserCache*
+bus_context_get_user_cache (BusContext *context)
+{
+  return context->user_cache;
+}
+
 dbus_bool_t
 bus_context_allow_unix_user (BusContext   *context,
                              unsigned long uid)
 {
   return bus_policy_allow_unix_user (context->policy,
+                                     context->user_cache,
                                      uid);
 }
 
@@ -1308,6 +1487,18 @@ bus_context_get_max_pending_activations (BusContext *context)
   return context->limits.max_pending_activations;
 }
 
+int
+bus_context_get_prestart_recent_services (BusContext *context)
+{
+  return context->limits.prestart_recent_services;
+}
+
+int
+bus_context_get_max_queued_messages_per_monitor (BusContext *context)
+{
+  return context->limits.max_queued_messages_per_monitor;
+}
+
 int
 bus_context_get_max_services_per_connection (BusContext *context)
 {
@@ -1332,6 +1523,18 @@ bus_context_get_reply_timeout (BusContext *context)
   return context->limits.reply_timeout;
 }
 
+int
+bus_context_get_idle_trim_timeout (BusContext *context)
+{
+  return context->limits.idle_trim_timeout;
+}
+
+int
+bus_context_get_io_threads (BusContext *context)
+{
+  return context->limits.io_threads;
+}
+
 DBusRLimit *
 bus_context_get_initial_fd_limit (BusContext *context)
 {
@@ -1779,11 +1982,83 @@ bus_context_check_security_policy (BusContext     *context,
   return TRUE;
 }
 
+static dbus_bool_t
+check_direct_channel_one_way (BusContext     *context,
+                              DBusConnection *sender,
+                              DBusConnection *recipient,
+                              DBusError      *error)
+{
+  DBusMessage *probe;
+  dbus_bool_t allowed;
+
+  probe = dbus_message_new_method_call (bus_connection_get_name (recipient),
+                                        "/", NULL, "DirectChannel");
+  if (probe == NULL ||
+      !dbus_message_set_sender (probe, bus_connection_get_name (sender)))
+    {
+      if (probe != NULL)
+        dbus_message_unref (probe);
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  dbus_message_set_no_reply (probe, TRUE);
+
+  allowed = bus_context_check_security_policy (context, NULL, sender,
+                                               recipient, recipient,
+                                               probe, error);
+  dbus_message_unref (probe);
+
+  if (!allowed)
+    return FALSE;
+
+  /* The probe says nothing about rules that look inside the message,
+   * and those could not be enforced on the channel anyway.
+   */
+  if (bus_client_policy_depends_on_message (bus_connection_get_policy (sender),
+                                            context->registry,
+                                            BUS_POLICY_RULE_SEND,
+                                            recipient) ||
+      bus_client_policy_depends_on_message (bus_connection_get_policy (recipient),
+                                            context->registry,
+                                            BUS_POLICY_RULE_RECEIVE,
+                                            sender))
+    {
+      dbus_set_error (error, DBUS_ERROR_ACCESS_DENIED,
+                      "Security policy restricts which messages %s may send "
+                      "to %s, so they cannot have a direct channel",
+                      bus_connection_get_name (sender),
+                      bus_connection_get_name (recipient));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * Checks whether two connections may be given a direct channel to
+ * each other. Once they have one the bus no longer sees what they
+ * send, so each has to be allowed to send method calls to the other
+ * and to receive them from it. Rules that look at the message type,
+ * path, interface, member or error name cannot be enforced on the
+ * channel, so the channel is refused if any such rule could apply
+ * between the two.
+ */
+dbus_bool_t
+bus_context_check_direct_channel (BusContext     *context,
+                                  DBusConnection *connection,
+                                  DBusConnection *peer,
+                                  DBusError      *error)
+{
+  return check_direct_channel_one_way (context, connection, peer, error) &&
+    check_direct_channel_one_way (context, peer, connection, error);
+}
+
 void
 bus_context_check_all_watches (BusContext *context)
 {
   DBusList *link;
-  dbus_bool_t enabled = TRUE;
+  dbus_bool_t enabled = context->accepting;
 
   if (bus_connections_get_n_incomplete (context->connections) >=
       bus_context_get_max_incomplete_connections (context))
@@ -1811,3 +2086,25 @@ bus_context_check_all_watches (BusContext *context)
       _dbus_server_toggle_all_watches (server, enabled);
     }
 }
+
+/**
+ * Stops or resumes accepting new connections on all the servers,
+ * while leaving the connections we already have alone. New clients
+ * queue up in the listen backlog in the meantime.
+ *
+ * @param context the bus context
+ * @param accepting whether to accept connections
+ */
+void
+bus_context_set_accepting (BusContext  *context,
+                           dbus_bool_t  accepting)
+{
+  context->accepting = accepting;
+  bus_context_check_all_watches (context);
+}
+
+DBusList **
+bus_context_get_servers (BusContext *context)
+{
+  return &context->servers;
+}
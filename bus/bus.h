@@ -25,6 +25,7 @@
 #define BUS_BUS_H
 
 #include <dbus/dbus.h>
+#include <dbus/dbus-list.h>
 #include <dbus/dbus-string.h>
 #include <dbus/dbus-mainloop.h>
 #include <dbus/dbus-pipe.h>
@@ -44,6 +45,9 @@ typedef struct BusOwner		BusOwner;
 typedef struct BusTransaction   BusTransaction;
 typedef struct BusMatchmaker    BusMatchmaker;
 typedef struct BusMatchRule     BusMatchRule;
+typedef struct BusUserCache     BusUserCache;
+typedef struct BusIOWorkers     BusIOWorkers;
+typedef struct BusHandoff       BusHandoff;
 
 typedef struct
 {
@@ -64,6 +68,10 @@ typedef struct
   int max_match_rules_per_connection; /**< Max number of match rules for a single connection */
   int max_replies_per_connection;     /**< Max number of replies that can be pending for each connection */
   int reply_timeout;                  /**< How long to wait before timing out a reply */
+  int prestart_recent_services;       /**< How many recently activated services to start with the bus */
+  int max_queued_messages_per_monitor; /**< Max number of captured messages waiting to be sent to a monitor */
+  int idle_trim_timeout;              /**< How long a connection must be idle before its buffers are trimmed; 0 to never trim */
+  int io_threads;                     /**< Number of threads doing connection I/O; 0 to do it in the main loop */
 } BusLimits;
 
 typedef enum
@@ -80,10 +88,20 @@ BusContext*       bus_context_new                                (const DBusStri
                                                                   DBusPipe         *print_addr_pipe,
                                                                   DBusPipe         *print_pid_pipe,
                                                                   const DBusString *address,
+                                                                  BusHandoff       *handoff,
                                                                   DBusError        *error);
 dbus_bool_t       bus_context_reload_config                      (BusContext       *context,
 								  DBusError        *error);
+dbus_bool_t       bus_context_handle_file_changed                (BusContext       *context,
+                                                                  const char       *dir,
+                                                                  const char       *filename);
 void              bus_context_shutdown                           (BusContext       *context);
+dbus_bool_t       bus_context_add_connection                     (BusContext       *context,
+                                                                  DBusConnection   *new_connection);
+void              bus_context_take_over_pid_file                 (BusContext       *context);
+void              bus_context_set_accepting                      (BusContext       *context,
+                                                                  dbus_bool_t       accepting);
+DBusList **       bus_context_get_servers                        (BusContext       *context);
 BusContext*       bus_context_ref                                (BusContext       *context);
 void              bus_context_unref                              (BusContext       *context);
 dbus_bool_t       bus_context_get_id                             (BusContext       *context,
@@ -97,6 +115,7 @@ BusConnections*   bus_context_get_connections                    (BusContext
 BusActivation*    bus_context_get_activation                     (BusContext       *context);
 BusMatchmaker*    bus_context_get_matchmaker                     (BusContext       *context);
 DBusLoop*         bus_context_get_loop                           (BusContext       *context);
+BusUserCache*     bus_context_get_user_cache                     (BusContext       *context);
 dbus_bool_t       bus_context_allow_unix_user                    (BusContext       *context,
                                                                   unsigned long     uid);
 dbus_bool_t       bus_context_allow_windows_user                 (BusContext       *context,
@@ -113,10 +132,14 @@ int               bus_context_get_max_completed_connections      (BusContext
 int               bus_context_get_max_incomplete_connections     (BusContext       *context);
 int               bus_context_get_max_connections_per_user       (BusContext       *context);
 int               bus_context_get_max_pending_activations        (BusContext       *context);
+int               bus_context_get_prestart_recent_services       (BusContext       *context);
+int               bus_context_get_max_queued_messages_per_monitor (BusContext      *context);
 int               bus_context_get_max_services_per_connection    (BusContext       *context);
 int               bus_context_get_max_match_rules_per_connection (BusContext       *context);
 int               bus_context_get_max_replies_per_connection     (BusContext       *context);
 int               bus_context_get_reply_timeout                  (BusContext       *context);
+int               bus_context_get_idle_trim_timeout              (BusContext       *context);
+int               bus_context_get_io_threads                     (BusContext       *context);
 DBusRLimit *      bus_context_get_initial_fd_limit               (BusContext       *context);
 void              bus_context_log                                (BusContext       *context,
                                                                   DBusSystemLogSeverity severity,
@@ -138,6 +161,10 @@ dbus_bool_t       bus_context_check_security_policy              (BusContext
                                                                   DBusConnection   *proposed_recipient,
                                                                   DBusMessage      *message,
                                                                   DBusError        *error);
+dbus_bool_t       bus_context_check_direct_channel               (BusContext       *context,
+                                                                  DBusConnection   *connection,
+                                                                  DBusConnection   *peer,
+                                                                  DBusError        *error);
 void              bus_context_check_all_watches                  (BusContext       *context);
 
 #endif /* BUS_BUS_H */
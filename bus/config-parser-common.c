@@ -79,6 +79,10 @@ bus_config_parser_element_name_to_type (const char *name)
     {
       return ELEMENT_SERVICEHELPER;
     }
+  else if (strcmp (name, "servicecache") == 0)
+    {
+      return ELEMENT_SERVICECACHE;
+    }
   else if (strcmp (name, "includedir") == 0)
     {
       return ELEMENT_INCLUDEDIR;
@@ -171,6 +175,8 @@ bus_config_parser_element_type_to_name (ElementType type)
       return "servicedir";
     case ELEMENT_SERVICEHELPER:
       return "servicehelper";
+    case ELEMENT_SERVICECACHE:
+      return "servicecache";
     case ELEMENT_INCLUDEDIR:
       return "includedir";
     case ELEMENT_CONFIGTYPE:
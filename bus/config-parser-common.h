@@ -50,7 +50,8 @@ typedef enum
   ELEMENT_KEEP_UMASK,
   ELEMENT_SYSLOG,
   ELEMENT_ALLOW_ANONYMOUS,
-  ELEMENT_APPARMOR
+  ELEMENT_APPARMOR,
+  ELEMENT_SERVICECACHE
 } ElementType;
 
 ElementType bus_config_parser_element_name_to_type (const char *element_name);
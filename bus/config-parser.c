@@ -94,6 +94,8 @@ struct BusConfigParser
 
   char *servicehelper; /**< location of the setuid helper */
 
+  char *service_cache; /**< location of the parsed .service file cache */
+
   char *bus_type;          /**< Message bus type */
   
   DBusList *listen_on; /**< List of addresses to listen to */
@@ -200,6 +202,11 @@ merge_service_context_hash (DBusHashTable *dest,
   service_copy = NULL;
   context_copy = NULL;
 
+  if (!_dbus_hash_table_set_size_hint (dest,
+                                       _dbus_hash_table_get_n_entries (dest) +
+                                       _dbus_hash_table_get_n_entries (from)))
+    return FALSE;
+
   _dbus_hash_iter_init (from, &iter);
   while (_dbus_hash_iter_next (&iter))
     {
@@ -336,6 +343,13 @@ merge_included (BusConfigParser *parser,
       included->servicehelper = NULL;
     }
 
+  if (included->service_cache != NULL)
+    {
+      dbus_free (parser->service_cache);
+      parser->service_cache = included->service_cache;
+      included->service_cache = NULL;
+    }
+
   while ((link = _dbus_list_pop_first_link (&included->listen_on)))
     _dbus_list_append_link (&parser->listen_on, link);
 
@@ -470,6 +484,20 @@ bus_config_parser_new (const DBusString      *basedir,
       
       parser->limits.reply_timeout = -1; /* never */
 
+      /* Services are only started ahead of time if asked for */
+      parser->limits.prestart_recent_services = 0;
+
+      /* Beyond this, a monitor that can't keep up loses messages
+       * instead of making the bus buffer them */
+      parser->limits.max_queued_messages_per_monitor = 4096;
+
+      /* Connections that have been quiet this long give back the
+       * memory their buffers grew into */
+      parser->limits.idle_trim_timeout = 30000; /* 30 seconds */
+
+      /* Connection I/O is done in the main loop unless asked otherwise */
+      parser->limits.io_threads = 0;
+
       /* this is effectively a limit on message queue size for messages
        * that require a reply
        */
@@ -505,6 +533,7 @@ bus_config_parser_unref (BusConfigParser *parser)
 
       dbus_free (parser->user);
       dbus_free (parser->servicehelper);
+      dbus_free (parser->service_cache);
       dbus_free (parser->bus_type);
       dbus_free (parser->pidfile);
       
@@ -815,6 +844,19 @@ start_busconfig_child (BusConfigParser   *parser,
           return FALSE;
         }
 
+      return TRUE;
+    }
+  else if (element_type == ELEMENT_SERVICECACHE)
+    {
+      if (!check_no_attributes (parser, "servicecache", attribute_names, attribute_values, error))
+        return FALSE;
+
+      if (push_element (parser, ELEMENT_SERVICECACHE) == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
       return TRUE;
     }
   else if (element_type == ELEMENT_INCLUDEDIR)
@@ -1983,6 +2025,30 @@ set_limit (BusConfigParser *parser,
       must_be_int = TRUE;
       parser->limits.max_replies_per_connection = value;
     }
+  else if (strcmp (name, "prestart_recent_services") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.prestart_recent_services = value;
+    }
+  else if (strcmp (name, "max_queued_messages_per_monitor") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.max_queued_messages_per_monitor = value;
+    }
+  else if (strcmp (name, "idle_trim_timeout") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.idle_trim_timeout = value;
+    }
+  else if (strcmp (name, "io_threads") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.io_threads = value;
+    }
   else
     {
       dbus_set_error (error, DBUS_ERROR_FAILED,
@@ -2066,6 +2132,7 @@ bus_config_parser_end_element (BusConfigParser   *parser,
     case ELEMENT_AUTH:
     case ELEMENT_SERVICEDIR:
     case ELEMENT_SERVICEHELPER:
+    case ELEMENT_SERVICECACHE:
     case ELEMENT_INCLUDEDIR:
     case ELEMENT_LIMIT:
       if (!e->had_content)
@@ -2501,6 +2568,30 @@ bus_config_parser_content (BusConfigParser   *parser,
         _dbus_string_free (&full_path);
       }
       break;
+
+    case ELEMENT_SERVICECACHE:
+      {
+        DBusString full_path;
+        char *s;
+
+        e->had_content = TRUE;
+
+        if (!_dbus_string_init (&full_path))
+          goto nomem;
+
+        if (!make_full_path (&parser->basedir, content, &full_path) ||
+            !_dbus_string_steal_data (&full_path, &s))
+          {
+            _dbus_string_free (&full_path);
+            goto nomem;
+          }
+
+        _dbus_string_free (&full_path);
+
+        dbus_free (parser->service_cache);
+        parser->service_cache = s;
+      }
+      break;
       
     case ELEMENT_INCLUDEDIR:
       {
@@ -2754,6 +2845,12 @@ bus_config_parser_get_servicehelper (BusConfigParser   *parser)
   return parser->servicehelper;
 }
 
+const char *
+bus_config_parser_get_service_cache (BusConfigParser   *parser)
+{
+  return parser->service_cache;
+}
+
 BusPolicy*
 bus_config_parser_steal_policy (BusConfigParser *parser)
 {
@@ -3160,7 +3257,11 @@ limits_equal (const BusLimits *a,
      || a->max_services_per_connection == b->max_services_per_connection
      || a->max_match_rules_per_connection == b->max_match_rules_per_connection
      || a->max_replies_per_connection == b->max_replies_per_connection
-     || a->reply_timeout == b->reply_timeout);
+     || a->reply_timeout == b->reply_timeout
+     || a->prestart_recent_services == b->prestart_recent_services
+     || a->max_queued_messages_per_monitor == b->max_queued_messages_per_monitor
+     || a->idle_trim_timeout == b->idle_trim_timeout
+     || a->io_threads == b->io_threads);
 }
 
 static dbus_bool_t
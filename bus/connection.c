@@ -31,17 +31,35 @@
 #include "expirelist.h"
 #include "selinux.h"
 #include "apparmor.h"
+#include "usercache.h"
+#include "ioworkers.h"
+#include "driver.h"
+#include "test.h"
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-hash.h>
 #include <dbus/dbus-timeout.h>
 #include <dbus/dbus-connection-internal.h>
 #include <dbus/dbus-internals.h>
+#include <dbus/dbus-message-internal.h>
+#include <dbus/dbus-mempool.h>
+#include <string.h>
 
 /* Trim executed commands to this length; we want to keep logs readable */
 #define MAX_LOG_COMMAND_LEN 50
 
 static void bus_connection_remove_transactions (DBusConnection *connection);
 
+/* A block of memory for a BusTransaction's records, see
+ * transaction_alloc() */
+typedef struct TransactionChunk TransactionChunk;
+
+struct TransactionChunk
+{
+  TransactionChunk *next; /**< Next chunk of the transaction or spare list */
+  size_t size;            /**< Bytes available after the header */
+  size_t used;            /**< Bytes handed out so far */
+};
+
 typedef struct
 {
   BusExpireItem expire_item;
@@ -63,6 +81,7 @@ struct BusConnections
   BusContext *context;
   DBusHashTable *completed_by_user; /**< Number of completed connections for each UID */
   DBusTimeout *expire_timeout; /**< Timeout for expiring incomplete connections. */
+  DBusTimeout *trim_timeout;   /**< Timeout for trimming idle connections. */
   int stamp;                   /**< Incrementing number */
   BusExpireList *pending_replies; /**< List of pending replies */
 
@@ -71,6 +90,11 @@ struct BusConnections
   DBusList *monitors;
   BusMatchmaker *monitor_matchmaker;
 
+  TransactionChunk *spare_chunks; /**< Transaction memory kept for reuse */
+  int n_spare_chunks;             /**< Length of spare_chunks */
+  dbus_uint32_t last_transaction_id; /**< Id given to the newest transaction */
+  BusIOWorkers *io_workers;          /**< NULL unless io_threads is set */
+
 #ifdef DBUS_ENABLE_STATS
   int total_match_rules;
   int peak_match_rules;
@@ -95,6 +119,8 @@ typedef struct
   int n_match_rules;
   char *name;
   DBusList *transaction_messages; /**< Stuff we need to send as part of a transaction */
+  dbus_uint32_t transaction_id; /**< Id of the transaction that last queued to us, or 0 */
+  int n_transactions;           /**< Number of transactions with messages for us */
   DBusMessage *oom_message;
   DBusPreallocatedSend *oom_preallocated;
   BusClientPolicy *policy;
@@ -106,6 +132,11 @@ typedef struct
   long connection_tv_sec;  /**< Time when we connected (seconds component) */
   long connection_tv_usec; /**< Time when we connected (microsec component) */
   int stamp;               /**< connections->stamp last time we were traversed */
+  dbus_bool_t active;      /**< Dispatched a message since the last idle sweep */
+  dbus_bool_t trimmed;     /**< Buffers were trimmed and have not been used since */
+  dbus_bool_t on_io_worker; /**< Watches are serviced by connections->io_workers */
+  dbus_bool_t accepts_direct_channels; /**< Called AcceptDirectChannels */
+  DBusList *direct_channels; /**< Connections we share a direct channel with */
 
 #ifdef DBUS_ENABLE_STATS
   int peak_match_rules;
@@ -116,6 +147,18 @@ typedef struct
 
   /** non-NULL if and only if this is a monitor */
   DBusList *link_in_monitors;
+
+  /** For monitors: ring of captured messages waiting for room in the
+   * outgoing queue. monitor_queue_len of the monitor_queue_size slots
+   * are in use, starting from monitor_queue_start. */
+  DBusMessage **monitor_queue;
+  int monitor_queue_size;
+  int monitor_queue_start;
+  int monitor_queue_len;
+  dbus_bool_t monitor_drop_oldest;
+  int monitor_max_body_bytes; /**< Bodies are truncated to this; -1 if not */
+  dbus_uint32_t monitor_dropped; /**< Lost since the last MessagesDropped signal */
+  DBusTimeout *monitor_flush_timeout;
 } BusConnectionData;
 
 static dbus_bool_t bus_pending_reply_expired (BusExpireList *list,
@@ -126,6 +169,14 @@ static void bus_connection_drop_pending_replies (BusConnections  *connections,
                                                  DBusConnection  *connection);
 
 static dbus_bool_t expire_incomplete_timeout (void *data);
+static dbus_bool_t trim_idle_timeout (void *data);
+
+static void monitor_queue_free (DBusConnection    *connection,
+                                BusConnectionData *d);
+
+static void notify_direct_channel_closed (BusContext     *context,
+                                          DBusConnection *connection,
+                                          DBusConnection *peer);
 
 #define BUS_CONNECTION_DATA(connection) (dbus_connection_get_data ((connection), connection_data_slot))
 
@@ -205,6 +256,7 @@ bus_connection_disconnected (DBusConnection *connection)
   BusConnectionData *d;
   BusService *service;
   BusMatchmaker *matchmaker;
+  DBusConnection *peer;
   
   d = BUS_CONNECTION_DATA (connection);
   _dbus_assert (d != NULL);
@@ -261,6 +313,16 @@ bus_connection_disconnected (DBusConnection *connection)
       bus_transaction_execute_and_free (transaction);
     }
 
+  /* Tell the other end of each direct channel that nobody is there
+   * any more; its own end of the socket may well stay open, since
+   * the process on this end does not have to exit */
+  while ((peer = _dbus_list_get_last (&d->direct_channels)))
+    {
+      notify_direct_channel_closed (d->connections->context, peer,
+                                    connection);
+      bus_connection_remove_direct_channel (connection, peer);
+    }
+
   bus_dispatch_remove_connection (connection);
   
   /* no more watching */
@@ -304,6 +366,8 @@ bus_connection_disconnected (DBusConnection *connection)
 
       _dbus_list_remove_link (&d->connections->monitors, d->link_in_monitors);
       d->link_in_monitors = NULL;
+
+      monitor_queue_free (connection, d);
     }
 
   if (d->link_in_connection_list != NULL)
@@ -421,6 +485,53 @@ allow_unix_user_function (DBusConnection *connection,
   return bus_context_allow_unix_user (d->connections->context, uid);
 }
 
+/* BusConnectionData comes from a pool, so that a storm of new
+ * connections costs a fraction of the malloc() calls. Like the
+ * DBusList pool, it goes away when its last block is returned.
+ *
+ * It has no lock: only the main thread touches it. Connections are
+ * created there, and with io_threads set, the I/O workers hand their
+ * references back to the main loop rather than dropping them, so
+ * free_connection_data() runs there too.
+ */
+static DBusMemPool *connection_data_pool = NULL;
+
+static BusConnectionData *
+connection_data_new (void)
+{
+  BusConnectionData *d;
+
+  if (connection_data_pool == NULL)
+    {
+      connection_data_pool = _dbus_mem_pool_new_tagged (sizeof (BusConnectionData),
+                                                        TRUE,
+                                                        DBUS_MEM_TAG_CONNECTION);
+      if (connection_data_pool == NULL)
+        return NULL;
+
+      d = _dbus_mem_pool_alloc (connection_data_pool);
+      if (d == NULL)
+        {
+          _dbus_mem_pool_free (connection_data_pool);
+          connection_data_pool = NULL;
+        }
+
+      return d;
+    }
+
+  return _dbus_mem_pool_alloc (connection_data_pool);
+}
+
+static void
+connection_data_dealloc (BusConnectionData *d)
+{
+  if (_dbus_mem_pool_dealloc (connection_data_pool, d))
+    {
+      _dbus_mem_pool_free (connection_data_pool);
+      connection_data_pool = NULL;
+    }
+}
+
 static void
 free_connection_data (void *data)
 {
@@ -431,6 +542,7 @@ free_connection_data (void *data)
   _dbus_assert (d->n_services_owned == 0);
   /* similarly */
   _dbus_assert (d->transaction_messages == NULL);
+  _dbus_assert (d->direct_channels == NULL);
 
   if (d->oom_preallocated)
     dbus_connection_free_preallocated_send (d->connection, d->oom_preallocated);
@@ -451,7 +563,7 @@ free_connection_data (void *data)
   
   dbus_free (d->name);
   
-  dbus_free (d);
+  connection_data_dealloc (d);
 }
 
 BusConnections*
@@ -479,24 +591,41 @@ bus_connections_new (BusContext *context)
 
   _dbus_timeout_set_enabled (connections->expire_timeout, FALSE);
 
+  connections->trim_timeout = _dbus_timeout_new (100, /* irrelevant */
+                                                 trim_idle_timeout,
+                                                 connections, NULL);
+  if (connections->trim_timeout == NULL)
+    goto failed_4;
+
+  connections->context = context;
+  bus_connections_update_idle_trim (connections);
+
   connections->pending_replies = bus_expire_list_new (bus_context_get_loop (context),
                                                       bus_context_get_reply_timeout (context),
                                                       bus_pending_reply_expired,
                                                       connections);
   if (connections->pending_replies == NULL)
-    goto failed_4;
+    goto failed_5;
   
   if (!_dbus_loop_add_timeout (bus_context_get_loop (context),
                                connections->expire_timeout))
-    goto failed_5;
+    goto failed_6;
+
+  if (!_dbus_loop_add_timeout (bus_context_get_loop (context),
+                               connections->trim_timeout))
+    goto failed_7;
   
   connections->refcount = 1;
-  connections->context = context;
   
   return connections;
 
- failed_5:
+ failed_7:
+  _dbus_loop_remove_timeout (bus_context_get_loop (context),
+                             connections->expire_timeout);
+ failed_6:
   bus_expire_list_free (connections->pending_replies);
+ failed_5:
+  _dbus_timeout_unref (connections->trim_timeout);
  failed_4:
   _dbus_timeout_unref (connections->expire_timeout);
  failed_3:
@@ -558,18 +687,34 @@ bus_connections_unref (BusConnections *connections)
 
       _dbus_assert (connections->n_completed == 0);
 
+      if (connections->io_workers != NULL)
+        bus_io_workers_free (connections->io_workers);
+
       bus_expire_list_free (connections->pending_replies);
       
       _dbus_loop_remove_timeout (bus_context_get_loop (connections->context),
                                  connections->expire_timeout);
       
       _dbus_timeout_unref (connections->expire_timeout);
+
+      _dbus_loop_remove_timeout (bus_context_get_loop (connections->context),
+                                 connections->trim_timeout);
+
+      _dbus_timeout_unref (connections->trim_timeout);
       
       _dbus_hash_table_unref (connections->completed_by_user);
 
       if (connections->monitor_matchmaker != NULL)
         bus_matchmaker_unref (connections->monitor_matchmaker);
 
+      while (connections->spare_chunks != NULL)
+        {
+          TransactionChunk *chunk = connections->spare_chunks;
+
+          connections->spare_chunks = chunk->next;
+          dbus_free (chunk);
+        }
+
       dbus_free (connections);
 
       dbus_connection_free_data_slot (&connection_data_slot);
@@ -637,16 +782,15 @@ oom:
 }
 
 static void
-check_pending_fds_cb (DBusConnection *connection)
+pending_fds_changed (DBusConnection *connection,
+                     int             n_pending_unix_fds_new)
 {
   BusConnectionData *d = BUS_CONNECTION_DATA (connection);
   int n_pending_unix_fds_old;
-  int n_pending_unix_fds_new;
 
   _dbus_assert(d != NULL);
 
   n_pending_unix_fds_old = d->n_pending_unix_fds;
-  n_pending_unix_fds_new = _dbus_connection_get_pending_fds_count (connection);
 
   _dbus_verbose ("Pending fds count changed on connection %p: %d -> %d\n",
                  connection, n_pending_unix_fds_old, n_pending_unix_fds_new);
@@ -667,6 +811,189 @@ check_pending_fds_cb (DBusConnection *connection)
   d->n_pending_unix_fds = n_pending_unix_fds_new;
 }
 
+static void
+check_pending_fds_cb (DBusConnection *connection)
+{
+  pending_fds_changed (connection,
+                       _dbus_connection_get_pending_fds_count (connection));
+}
+
+/* Called in the main thread when a connection on an I/O worker has
+ * messages for us to dispatch, or its count of pending fds changed */
+static void
+connection_ready_from_worker (DBusConnection *connection,
+                              void           *data)
+{
+  BusConnectionData *d = BUS_CONNECTION_DATA (connection);
+
+  /* disconnected since the worker handed it over */
+  if (d == NULL || !d->on_io_worker)
+    return;
+
+  /* the worker may be reading more of them right now */
+  pending_fds_changed (connection,
+                       _dbus_connection_count_pending_fds (connection));
+
+  if (dbus_connection_get_dispatch_status (connection) != DBUS_DISPATCH_COMPLETE)
+    {
+      while (!_dbus_loop_queue_dispatch (bus_context_get_loop (d->connections->context),
+                                         connection))
+        _dbus_wait_for_memory ();
+    }
+}
+
+static void
+worker_dispatch_status_function (DBusConnection    *connection,
+                                 DBusDispatchStatus new_status,
+                                 void              *data)
+{
+  BusIOWorkers *workers = data;
+
+  if (new_status != DBUS_DISPATCH_COMPLETE)
+    bus_io_workers_hand_over (workers, connection);
+}
+
+static void
+worker_pending_fds_cb (DBusConnection *connection)
+{
+  BusConnectionData *d = BUS_CONNECTION_DATA (connection);
+
+  /* the data can't go away while a worker is reading, since it is
+   * only freed after the watches have been removed */
+  bus_io_workers_hand_over (d->connections->io_workers, connection);
+}
+
+/* Puts the connection's watches back in the main loop */
+static void
+connection_move_to_main_loop (DBusConnection    *connection,
+                              BusConnectionData *d)
+{
+  DBusLoop *loop = bus_context_get_loop (d->connections->context);
+
+  while (!dbus_connection_set_watch_functions (connection,
+                                               add_connection_watch,
+                                               remove_connection_watch,
+                                               toggle_connection_watch,
+                                               connection,
+                                               NULL))
+    _dbus_wait_for_memory ();
+
+  _dbus_connection_set_writes_deferred (connection, FALSE);
+  _dbus_connection_set_pending_fds_function (connection,
+          (DBusPendingFdsChangeFunction) check_pending_fds_cb,
+          connection);
+  dbus_connection_set_dispatch_status_function (connection,
+                                                dispatch_status_function,
+                                                loop, NULL);
+  d->on_io_worker = FALSE;
+
+  /* anything a worker read before the switch still needs dispatching */
+  if (dbus_connection_get_dispatch_status (connection) != DBUS_DISPATCH_COMPLETE)
+    {
+      while (!_dbus_loop_queue_dispatch (loop, connection))
+        _dbus_wait_for_memory ();
+    }
+}
+
+/* Hands reading and writing for the connection to an I/O worker. The
+ * callbacks that a worker can trigger are switched first, so that
+ * they only ever run bus code on the main thread. */
+static dbus_bool_t
+connection_move_to_io_worker (DBusConnection    *connection,
+                              BusConnectionData *d)
+{
+  BusIOWorkers *workers = d->connections->io_workers;
+
+  dbus_connection_set_dispatch_status_function (connection,
+                                                worker_dispatch_status_function,
+                                                workers, NULL);
+  _dbus_connection_set_pending_fds_function (connection,
+          (DBusPendingFdsChangeFunction) worker_pending_fds_cb,
+          connection);
+  _dbus_connection_set_writes_deferred (connection, TRUE);
+  d->on_io_worker = TRUE;
+
+  if (!bus_io_workers_adopt (workers, connection))
+    {
+      connection_move_to_main_loop (connection, d);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+dbus_bool_t
+bus_connections_start_io_workers (BusConnections *connections,
+                                  int             n_threads,
+                                  DBusError      *error)
+{
+  DBusList *link;
+
+  _dbus_assert (connections->io_workers == NULL);
+
+  connections->io_workers =
+    bus_io_workers_new (bus_context_get_loop (connections->context),
+                        n_threads, connection_ready_from_worker, NULL,
+                        error);
+
+  if (connections->io_workers == NULL)
+    return FALSE;
+
+  /* only has an effect after a restart, when connections were
+   * completed before there were any workers */
+  for (link = _dbus_list_get_first_link (&connections->completed);
+       link != NULL;
+       link = _dbus_list_get_next_link (&connections->completed, link))
+    {
+      DBusConnection *connection = link->data;
+      BusConnectionData *d = BUS_CONNECTION_DATA (connection);
+
+      if (d->on_io_worker || bus_connection_is_monitor (connection))
+        continue;
+
+      /* it just stays in the main loop, which works too */
+      if (!connection_move_to_io_worker (connection, d))
+        _dbus_verbose ("No memory to move connection %p to an I/O worker\n",
+                       connection);
+    }
+
+  return TRUE;
+}
+
+/**
+ * Puts every connection back in the main loop and stops the I/O
+ * workers, so that the main thread is the only one touching the
+ * connections until bus_connections_start_io_workers() is called
+ * again.
+ *
+ * @param connections the connections object
+ */
+void
+bus_connections_stop_io_workers (BusConnections *connections)
+{
+  DBusList *link;
+
+  if (connections->io_workers == NULL)
+    return;
+
+  for (link = _dbus_list_get_first_link (&connections->completed);
+       link != NULL;
+       link = _dbus_list_get_next_link (&connections->completed, link))
+    {
+      DBusConnection *connection = link->data;
+      BusConnectionData *d = BUS_CONNECTION_DATA (connection);
+
+      if (d->on_io_worker)
+        {
+          connection_move_to_main_loop (connection, d);
+          check_pending_fds_cb (connection);
+        }
+    }
+
+  bus_io_workers_free (connections->io_workers);
+  connections->io_workers = NULL;
+}
+
 static dbus_bool_t
 pending_unix_fds_timeout_cb (void *data)
 {
@@ -685,7 +1012,7 @@ bus_connections_setup_connection (BusConnections *connections,
   DBusError error;
 
   
-  d = dbus_new0 (BusConnectionData, 1);
+  d = connection_data_new ();
   
   if (d == NULL)
     return FALSE;
@@ -702,7 +1029,7 @@ bus_connections_setup_connection (BusConnections *connections,
                                  connection_data_slot,
                                  d, free_connection_data))
     {
-      dbus_free (d);
+      connection_data_dealloc (d);
       return FALSE;
     }
 
@@ -954,6 +1281,112 @@ expire_incomplete_timeout (void *data)
   return TRUE;
 }
 
+/**
+ * Picks up a changed idle_trim_timeout limit.
+ *
+ * @param connections the connections
+ */
+void
+bus_connections_update_idle_trim (BusConnections *connections)
+{
+  int interval;
+
+  interval = bus_context_get_idle_trim_timeout (connections->context);
+
+  /* 0 means never trim */
+  bus_expire_timeout_set_interval (connections->trim_timeout,
+                                   interval > 0 ? interval : -1);
+}
+
+/**
+ * Records that a message from this connection was dispatched, so
+ * that its buffers are left alone by the next idle sweep.
+ *
+ * @param connection the connection
+ */
+void
+bus_connection_note_activity (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  d->active = TRUE;
+  d->trimmed = FALSE;
+}
+
+/* A connection is trimmed once it has gone a whole sweep interval
+ * without dispatching anything, so it has been idle for between one
+ * and two intervals. If nothing at all happened on the bus, the
+ * message cache and the free lists of the memory pools are not going
+ * to be reused soon either. */
+static dbus_bool_t
+trim_idle_timeout (void *data)
+{
+  BusConnections *connections = data;
+  dbus_bool_t any_active;
+  int n_trimmed;
+  size_t released;
+  DBusList *link;
+
+  any_active = FALSE;
+  n_trimmed = 0;
+  released = 0;
+
+  for (link = _dbus_list_get_first_link (&connections->completed);
+       link != NULL;
+       link = _dbus_list_get_next_link (&connections->completed, link))
+    {
+      DBusConnection *connection = link->data;
+      BusConnectionData *d;
+
+      d = BUS_CONNECTION_DATA (connection);
+      _dbus_assert (d != NULL);
+
+      if (d->active)
+        {
+          any_active = TRUE;
+          d->active = FALSE;
+        }
+      else if (!d->trimmed)
+        {
+          _dbus_connection_trim_memory (connection);
+          d->trimmed = TRUE;
+          n_trimmed += 1;
+        }
+    }
+
+  if (!any_active)
+    {
+      _dbus_message_trim_cache ();
+
+      released += _dbus_slabs_trim ();
+      released += bus_registry_trim (bus_context_get_registry (connections->context));
+
+      if (connection_data_pool != NULL)
+        released += _dbus_mem_pool_trim (connection_data_pool);
+    }
+
+  _dbus_verbose ("Trimmed %d idle connections and %lu bytes of pools\n",
+                 n_trimmed, (unsigned long) released);
+
+  return TRUE;
+}
+
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+/**
+ * Runs the idle sweep straight away, as if its timeout had fired.
+ *
+ * @param connections the connections
+ */
+void
+bus_connections_trim_idle_now (BusConnections *connections)
+{
+  trim_idle_timeout (connections);
+}
+#endif
+
 dbus_bool_t
 bus_connection_get_unix_groups  (DBusConnection   *connection,
                                  unsigned long   **groups,
@@ -967,7 +1400,10 @@ bus_connection_get_unix_groups  (DBusConnection   *connection,
 
   if (dbus_connection_get_unix_user (connection, &uid))
     {
-      if (!_dbus_unix_groups_from_uid (uid, groups, n_groups))
+      BusContext *context = bus_connection_get_context (connection);
+
+      if (!bus_user_cache_get_groups (bus_context_get_user_cache (context),
+                                      uid, groups, n_groups))
         {
           _dbus_verbose ("Did not get any groups for UID %lu\n",
                          uid);
@@ -1421,6 +1857,34 @@ bus_connection_get_n_match_rules (DBusConnection *connection)
   return d->n_match_rules;
 }
 
+/**
+ * Calls function on each match rule the connection added, oldest
+ * first; if the function returns #FALSE, stops iterating.
+ *
+ * @returns #FALSE if the function returned #FALSE
+ */
+dbus_bool_t
+bus_connection_foreach_match_rule (DBusConnection              *connection,
+                                   BusMatchRuleForeachFunction  function,
+                                   void                        *data)
+{
+  BusConnectionData *d;
+  DBusList *link;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  for (link = _dbus_list_get_first_link (&d->match_rules);
+       link != NULL;
+       link = _dbus_list_get_next_link (&d->match_rules, link))
+    {
+      if (!(* function) (link->data, data))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 void
 bus_connection_add_owned_service_link (DBusConnection *connection,
                                        DBusList       *link)
@@ -1491,34 +1955,249 @@ bus_connection_get_n_services_owned (DBusConnection *connection)
   return d->n_services_owned;
 }
 
-dbus_bool_t
-bus_connection_complete (DBusConnection   *connection,
-			 const DBusString *name,
-                         DBusError        *error)
+void
+bus_connection_set_accepts_direct_channels (DBusConnection *connection)
 {
   BusConnectionData *d;
-  unsigned long uid;
-  
+
   d = BUS_CONNECTION_DATA (connection);
   _dbus_assert (d != NULL);
-  _dbus_assert (d->name == NULL);
-  _dbus_assert (d->policy == NULL);
 
-  _dbus_assert (!bus_connection_is_active (connection));
-  
-  if (!_dbus_string_copy_data (name, &d->name))
-    {
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
+  d->accepts_direct_channels = TRUE;
+}
 
-  _dbus_assert (d->name != NULL);
-  
-  _dbus_verbose ("Name %s assigned to %p\n", d->name, connection);
+dbus_bool_t
+bus_connection_get_accepts_direct_channels (DBusConnection *connection)
+{
+  BusConnectionData *d;
 
-  d->policy = bus_context_create_client_policy (d->connections->context,
-                                                connection,
-                                                error);
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  return d->accepts_direct_channels;
+}
+
+dbus_bool_t
+bus_connection_has_direct_channel (DBusConnection *connection,
+                                   DBusConnection *peer)
+{
+  BusConnectionData *d;
+  DBusList *link;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  for (link = _dbus_list_get_first_link (&d->direct_channels);
+       link != NULL;
+       link = _dbus_list_get_next_link (&d->direct_channels, link))
+    {
+      if (link->data == peer)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/**
+ * Records that the bus handed connection and peer the two ends of a
+ * direct channel. The bus is not involved in what goes through it;
+ * it only needs to know who to tell when one of them goes away or
+ * is no longer allowed to talk to the other.
+ *
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+bus_connection_add_direct_channel (DBusConnection *connection,
+                                   DBusConnection *peer)
+{
+  BusConnectionData *d, *peer_d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  peer_d = BUS_CONNECTION_DATA (peer);
+  _dbus_assert (d != NULL);
+  _dbus_assert (peer_d != NULL);
+  _dbus_assert (connection != peer);
+  _dbus_assert (!bus_connection_has_direct_channel (connection, peer));
+
+  if (!_dbus_list_append (&d->direct_channels, peer))
+    return FALSE;
+
+  if (!_dbus_list_append (&peer_d->direct_channels, connection))
+    {
+      _dbus_list_remove_last (&d->direct_channels, peer);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+void
+bus_connection_remove_direct_channel (DBusConnection *connection,
+                                      DBusConnection *peer)
+{
+  BusConnectionData *d, *peer_d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  peer_d = BUS_CONNECTION_DATA (peer);
+  _dbus_assert (d != NULL);
+  _dbus_assert (peer_d != NULL);
+
+  _dbus_list_remove_last (&d->direct_channels, peer);
+  _dbus_list_remove_last (&peer_d->direct_channels, connection);
+}
+
+/**
+ * Calls function on each pair of connections that share a direct
+ * channel, once per pair; if the function returns #FALSE, stops
+ * iterating.
+ *
+ * @returns #FALSE if the function returned #FALSE
+ */
+dbus_bool_t
+bus_connections_foreach_direct_channel (BusConnections                 *connections,
+                                        BusDirectChannelForeachFunction function,
+                                        void                           *data)
+{
+  DBusList *link, *peer_link;
+
+  for (link = _dbus_list_get_first_link (&connections->completed);
+       link != NULL;
+       link = _dbus_list_get_next_link (&connections->completed, link))
+    {
+      DBusConnection *connection = link->data;
+      BusConnectionData *d = BUS_CONNECTION_DATA (connection);
+
+      for (peer_link = _dbus_list_get_first_link (&d->direct_channels);
+           peer_link != NULL;
+           peer_link = _dbus_list_get_next_link (&d->direct_channels, peer_link))
+        {
+          DBusConnection *peer = peer_link->data;
+
+          /* each pair is on both lists */
+          if (strcmp (d->name, bus_connection_get_name (peer)) > 0)
+            continue;
+
+          if (!(* function) (connection, peer, data))
+            return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+/* Like the names a connection owns, the other ends have to hear about
+ * it even if that means waiting for memory */
+static void
+notify_direct_channel_closed (BusContext     *context,
+                              DBusConnection *connection,
+                              DBusConnection *peer)
+{
+  BusTransaction *transaction;
+  DBusError error;
+
+ retry:
+  dbus_error_init (&error);
+
+  while ((transaction = bus_transaction_new (context)) == NULL)
+    _dbus_wait_for_memory ();
+
+  if (!bus_driver_send_direct_channel_closed (connection,
+                                              bus_connection_get_name (peer),
+                                              transaction, &error))
+    {
+      _dbus_assert (dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY));
+      dbus_error_free (&error);
+      bus_transaction_cancel_and_free (transaction);
+      _dbus_wait_for_memory ();
+      goto retry;
+    }
+
+  bus_transaction_execute_and_free (transaction);
+}
+
+/**
+ * Closes the direct channels whose ends may no longer talk to each
+ * other, for instance after the policy was reloaded. Both ends are
+ * told with a DirectChannelClosed signal and are expected to close
+ * their end; the bus cannot do that for them.
+ */
+void
+bus_connections_check_direct_channels (BusConnections *connections)
+{
+  DBusList *link, *peer_link, *next;
+
+  for (link = _dbus_list_get_first_link (&connections->completed);
+       link != NULL;
+       link = _dbus_list_get_next_link (&connections->completed, link))
+    {
+      DBusConnection *connection = link->data;
+      BusConnectionData *d = BUS_CONNECTION_DATA (connection);
+
+      peer_link = _dbus_list_get_first_link (&d->direct_channels);
+      while (peer_link != NULL)
+        {
+          DBusConnection *peer = peer_link->data;
+          DBusError error = DBUS_ERROR_INIT;
+
+          next = _dbus_list_get_next_link (&d->direct_channels, peer_link);
+
+          if (bus_context_check_direct_channel (connections->context,
+                                                connection, peer, &error))
+            {
+              peer_link = next;
+              continue;
+            }
+
+          if (dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
+            {
+              dbus_error_free (&error);
+              _dbus_wait_for_memory ();
+              continue;
+            }
+
+          bus_context_log (connections->context, DBUS_SYSTEM_LOG_INFO,
+                           "Closing direct channel between %s and %s: %s",
+                           bus_connection_get_loginfo (connection),
+                           bus_connection_get_loginfo (peer),
+                           error.message);
+          dbus_error_free (&error);
+
+          notify_direct_channel_closed (connections->context, connection, peer);
+          notify_direct_channel_closed (connections->context, peer, connection);
+          bus_connection_remove_direct_channel (connection, peer);
+          peer_link = next;
+        }
+    }
+}
+
+dbus_bool_t
+bus_connection_complete (DBusConnection   *connection,
+			 const DBusString *name,
+                         DBusError        *error)
+{
+  BusConnectionData *d;
+  unsigned long uid;
+  
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+  _dbus_assert (d->name == NULL);
+  _dbus_assert (d->policy == NULL);
+
+  _dbus_assert (!bus_connection_is_active (connection));
+  
+  if (!_dbus_string_copy_data (name, &d->name))
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  _dbus_assert (d->name != NULL);
+  
+  _dbus_verbose ("Name %s assigned to %p\n", d->name, connection);
+
+  d->policy = bus_context_create_client_policy (d->connections->context,
+                                                connection,
+                                                error);
 
   /* we may have a NULL policy on OOM or error getting list of
    * groups for a user. In the latter case we don't handle it so
@@ -1534,7 +2213,11 @@ bus_connection_complete (DBusConnection   *connection,
       d->name = NULL;
       return FALSE;
     }
-  
+
+  if (d->connections->io_workers != NULL &&
+      !connection_move_to_io_worker (connection, d))
+    goto fail;
+
   if (dbus_connection_get_unix_user (connection, &uid))
     {
       if (!adjust_connections_for_uid (d->connections,
@@ -1571,6 +2254,8 @@ bus_connection_complete (DBusConnection   *connection,
   return TRUE;
 fail:
   BUS_SET_OOM (error);
+  if (d->on_io_worker)
+    connection_move_to_main_loop (connection, d);
   dbus_free (d->name);
   d->name = NULL;
   if (d->policy)
@@ -1807,10 +2492,8 @@ bus_connection_drop_pending_replies (BusConnections  *connections,
                          pending->reply_serial);
           
           pending->will_send_reply = NULL;
-          pending->expire_item.added_tv_sec = 0;
-          pending->expire_item.added_tv_usec = 0;
-
-          bus_expire_list_recheck_immediately (connections->pending_replies);
+          bus_expire_list_expire_link_now (connections->pending_replies,
+                                           link);
         }
       
       link = next;
@@ -1915,12 +2598,6 @@ bus_connections_expect_reply (BusConnections  *connections,
       return FALSE;
     }
 
-#ifdef DBUS_ENABLE_VERBOSE_MODE
-  /* so we can see a not-yet-added pending reply */
-  pending->expire_item.added_tv_sec = 1;
-  pending->expire_item.added_tv_usec = 1;
-#endif
-
   pending->will_get_reply = will_get_reply;
   pending->will_send_reply = will_send_reply;
   pending->reply_serial = reply_serial;
@@ -1933,6 +2610,9 @@ bus_connections_expect_reply (BusConnections  *connections,
       return FALSE;
     }
   
+  _dbus_get_monotonic_time (&pending->expire_item.added_tv_sec,
+                            &pending->expire_item.added_tv_usec);
+
   if (!bus_expire_list_add (connections->pending_replies,
                             &pending->expire_item))
     {
@@ -1956,9 +2636,6 @@ bus_connections_expect_reply (BusConnections  *connections,
                                         
   cprd->pending = pending;
   cprd->connections = connections;
-  
-  _dbus_get_monotonic_time (&pending->expire_item.added_tv_sec,
-                            &pending->expire_item.added_tv_usec);
 
   _dbus_verbose ("Added pending reply %p, replier %p receiver %p serial %u\n",
                  pending,
@@ -2081,90 +2758,496 @@ bus_connections_check_reply (BusConnections *connections,
   return TRUE;
 }
 
-/*
- * Transactions
+/**
+ * Calls function on each reply the bus is currently expecting, with
+ * the time the call was seen in the same monotonic clock as
+ * _dbus_get_monotonic_time(). The replier is #NULL if it has
+ * disconnected and the caller is about to get an error instead. If
+ * the function returns #FALSE, stops iterating.
  *
- * Note that this is fairly fragile; in particular, don't try to use
- * one transaction across any main loop iterations.
+ * @param connections the connections object
+ * @param function the function
+ * @param data data to pass to it as the last arg
+ * @returns #FALSE if the function returned #FALSE
  */
-
-typedef struct
+dbus_bool_t
+bus_connections_foreach_pending_reply (BusConnections                *connections,
+                                       BusPendingReplyForeachFunction function,
+                                       void                          *data)
 {
-  BusTransaction *transaction;
-  DBusMessage    *message;
-  DBusPreallocatedSend *preallocated;
-} MessageToSend;
+  DBusList *link;
 
-typedef struct
-{
-  BusTransactionCancelFunction cancel_function;
-  DBusFreeFunction free_data_function;
-  void *data;
-} CancelHook;
+  for (link = bus_expire_list_get_first_link (connections->pending_replies);
+       link != NULL;
+       link = bus_expire_list_get_next_link (connections->pending_replies,
+                                             link))
+    {
+      BusPendingReply *pending = link->data;
 
-struct BusTransaction
-{
-  DBusList *connections;
-  BusContext *context;
-  DBusList *cancel_hooks;
-};
+      if (!(* function) (pending->will_get_reply,
+                         pending->will_send_reply,
+                         pending->reply_serial,
+                         pending->expire_item.added_tv_sec,
+                         pending->expire_item.added_tv_usec,
+                         data))
+        return FALSE;
+    }
 
-static void
-message_to_send_free (DBusConnection *connection,
-                      MessageToSend  *to_send)
+  return TRUE;
+}
+
+/**
+ * Records a reply that a previous instance of the bus was expecting,
+ * as seen by bus_connections_foreach_pending_reply(). Unlike
+ * bus_connections_expect_reply() there is no transaction and no
+ * limit, since the call was already allowed.
+ *
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+bus_connections_restore_pending_reply (BusConnections *connections,
+                                       DBusConnection *will_get_reply,
+                                       DBusConnection *will_send_reply,
+                                       dbus_uint32_t   reply_serial,
+                                       long            added_tv_sec,
+                                       long            added_tv_usec)
 {
-  if (to_send->message)
-    dbus_message_unref (to_send->message);
+  BusPendingReply *pending;
 
-  if (to_send->preallocated)
-    dbus_connection_free_preallocated_send (connection, to_send->preallocated);
+  _dbus_assert (will_get_reply != NULL);
 
-  dbus_free (to_send);
-}
+  pending = dbus_new0 (BusPendingReply, 1);
+  if (pending == NULL)
+    return FALSE;
 
-static void
-cancel_hook_cancel (void *element,
-                    void *data)
-{
-  CancelHook *ch = element;
+  pending->will_get_reply = will_get_reply;
+  pending->will_send_reply = will_send_reply;
+  pending->reply_serial = reply_serial;
+  pending->expire_item.added_tv_sec = added_tv_sec;
+  pending->expire_item.added_tv_usec = added_tv_usec;
 
-  _dbus_verbose ("Running transaction cancel hook\n");
-  
-  if (ch->cancel_function)
-    (* ch->cancel_function) (ch->data);  
+  if (!bus_expire_list_add (connections->pending_replies,
+                            &pending->expire_item))
+    {
+      bus_pending_reply_free (pending);
+      return FALSE;
+    }
+
+  _dbus_verbose ("Restored pending reply %p, replier %p receiver %p serial %u\n",
+                 pending,
+                 pending->will_send_reply,
+                 pending->will_get_reply,
+                 pending->reply_serial);
+
+  return TRUE;
 }
 
-static void
-cancel_hook_free (void *element,
-                  void *data)
+/*
+ * Monitor queues
+ *
+ * Captured messages are not put straight into a monitor's outgoing
+ * queue, which has no limit, but into a fixed-size ring in front of it.
+ * The ring is moved into the outgoing queue while that holds less than
+ * MONITOR_OUTGOING_HIGH_WATER bytes. When the ring is full, captured
+ * messages are discarded according to the monitor's policy, and the
+ * monitor is told how many it missed with a MessagesDropped signal.
+ */
+
+#define MONITOR_OUTGOING_HIGH_WATER _DBUS_ONE_MEGABYTE
+
+static dbus_bool_t
+monitor_send_dropped (DBusConnection    *connection,
+                      BusConnectionData *d)
 {
-  CancelHook *ch = element;
+  DBusMessage *message;
+  dbus_bool_t ret;
 
-  if (ch->free_data_function)
-    (* ch->free_data_function) (ch->data);
+  message = dbus_message_new_signal (DBUS_PATH_DBUS,
+                                     DBUS_INTERFACE_MONITORING,
+                                     "MessagesDropped");
 
-  dbus_free (ch);
+  if (message == NULL)
+    return FALSE;
+
+  ret = (dbus_message_set_sender (message, DBUS_SERVICE_DBUS) &&
+         dbus_message_append_args (message,
+                                   DBUS_TYPE_UINT32, &d->monitor_dropped,
+                                   DBUS_TYPE_INVALID) &&
+         dbus_connection_send (connection, message, NULL));
+
+  dbus_message_unref (message);
+
+  if (ret)
+    d->monitor_dropped = 0;
+
+  return ret;
 }
 
 static void
-free_cancel_hooks (BusTransaction *transaction)
+monitor_queue_flush (DBusConnection    *connection,
+                     BusConnectionData *d)
 {
-  _dbus_list_foreach (&transaction->cancel_hooks,
-                      cancel_hook_free, NULL);
-  
-  _dbus_list_clear (&transaction->cancel_hooks);
-}
+  while (d->monitor_queue_len > 0 || d->monitor_dropped > 0)
+    {
+      DBusMessage *message;
 
-BusTransaction*
-bus_transaction_new (BusContext *context)
-{
-  BusTransaction *transaction;
+      if (dbus_connection_get_outgoing_size (connection) >=
+          MONITOR_OUTGOING_HIGH_WATER)
+        {
+          /* wait for monitor_outgoing_size_cb() */
+          _dbus_timeout_set_enabled (d->monitor_flush_timeout, FALSE);
+          return;
+        }
 
-  transaction = dbus_new0 (BusTransaction, 1);
-  if (transaction == NULL)
-    return NULL;
+      /* Tell the monitor about the gap before what comes after it */
+      if (d->monitor_dropped > 0)
+        {
+          if (!monitor_send_dropped (connection, d))
+            return; /* OOM: try again from the timeout */
 
+          continue;
+        }
+
+      message = d->monitor_queue[d->monitor_queue_start];
+
+      if (!dbus_connection_send (connection, message, NULL))
+        return; /* OOM: try again from the timeout */
+
+      d->monitor_queue[d->monitor_queue_start] = NULL;
+      d->monitor_queue_start = (d->monitor_queue_start + 1) %
+        d->monitor_queue_size;
+      d->monitor_queue_len -= 1;
+      dbus_message_unref (message);
+    }
+
+  _dbus_timeout_set_enabled (d->monitor_flush_timeout, FALSE);
+}
+
+static void
+monitor_queue_push (BusConnectionData *d,
+                    DBusMessage       *message)
+{
+  if (d->monitor_queue_len == d->monitor_queue_size)
+    {
+      d->monitor_dropped += 1;
+
+      if (!d->monitor_drop_oldest)
+        return;
+
+      dbus_message_unref (d->monitor_queue[d->monitor_queue_start]);
+      d->monitor_queue[d->monitor_queue_start] = NULL;
+      d->monitor_queue_start = (d->monitor_queue_start + 1) %
+        d->monitor_queue_size;
+      d->monitor_queue_len -= 1;
+    }
+
+  d->monitor_queue[(d->monitor_queue_start + d->monitor_queue_len) %
+                   d->monitor_queue_size] = dbus_message_ref (message);
+  d->monitor_queue_len += 1;
+}
+
+static dbus_bool_t
+monitor_flush_timeout_cb (void *data)
+{
+  DBusConnection *connection = data;
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  monitor_queue_flush (connection, d);
+  return TRUE;
+}
+
+/* Called with the monitor's connection lock held, so all we can do is
+ * arrange to look at the queue again from the main loop. */
+static void
+monitor_outgoing_size_cb (DBusCounter *counter,
+                          void        *data)
+{
+  DBusTimeout *flush_timeout = data;
+
+  _dbus_timeout_set_enabled (flush_timeout, TRUE);
+}
+
+static dbus_bool_t
+monitor_queue_init (DBusConnection    *connection,
+                    BusConnectionData *d,
+                    dbus_uint32_t      flags,
+                    int                max_body_bytes)
+{
+  int size;
+
+  _dbus_assert (d->monitor_queue == NULL);
+
+  size = bus_context_get_max_queued_messages_per_monitor (d->connections->context);
+  d->monitor_queue_size = MAX (size, 1);
+  d->monitor_queue = dbus_new0 (DBusMessage *, d->monitor_queue_size);
+
+  if (d->monitor_queue == NULL)
+    goto nomem;
+
+  d->monitor_flush_timeout = _dbus_timeout_new (0, monitor_flush_timeout_cb,
+                                                connection, NULL);
+
+  if (d->monitor_flush_timeout == NULL)
+    goto nomem;
+
+  _dbus_timeout_set_enabled (d->monitor_flush_timeout, FALSE);
+
+  if (!_dbus_loop_add_timeout (bus_context_get_loop (d->connections->context),
+                               d->monitor_flush_timeout))
+    goto nomem;
+
+  d->monitor_queue_start = 0;
+  d->monitor_queue_len = 0;
+  d->monitor_dropped = 0;
+  d->monitor_drop_oldest = (flags & DBUS_MONITOR_FLAG_DROP_OLDEST) != 0;
+  d->monitor_max_body_bytes = max_body_bytes;
+
+  /* the callback below touches the main loop, so it has to be called
+   * from the main thread */
+  if (d->on_io_worker)
+    connection_move_to_main_loop (connection, d);
+
+  _dbus_connection_set_outgoing_size_function (connection,
+                                               MONITOR_OUTGOING_HIGH_WATER,
+                                               monitor_outgoing_size_cb,
+                                               d->monitor_flush_timeout);
+  return TRUE;
+
+ nomem:
+  if (d->monitor_flush_timeout != NULL)
+    _dbus_timeout_unref (d->monitor_flush_timeout);
+
+  d->monitor_flush_timeout = NULL;
+  dbus_free (d->monitor_queue);
+  d->monitor_queue = NULL;
+  return FALSE;
+}
+
+static void
+monitor_queue_free (DBusConnection    *connection,
+                    BusConnectionData *d)
+{
+  if (d->monitor_queue == NULL)
+    return;
+
+  _dbus_connection_set_outgoing_size_function (connection, 0, NULL, NULL);
+
+  _dbus_loop_remove_timeout (bus_context_get_loop (d->connections->context),
+                             d->monitor_flush_timeout);
+  _dbus_timeout_unref (d->monitor_flush_timeout);
+  d->monitor_flush_timeout = NULL;
+
+  while (d->monitor_queue_len > 0)
+    {
+      dbus_message_unref (d->monitor_queue[d->monitor_queue_start]);
+      d->monitor_queue_start = (d->monitor_queue_start + 1) %
+        d->monitor_queue_size;
+      d->monitor_queue_len -= 1;
+    }
+
+  dbus_free (d->monitor_queue);
+  d->monitor_queue = NULL;
+}
+
+/*
+ * Transactions
+ *
+ * Note that this is fairly fragile; in particular, don't try to use
+ * one transaction across any main loop iterations.
+ */
+
+typedef struct
+{
+  BusTransaction *transaction;
+  DBusMessage    *message;
+  DBusPreallocatedSend *preallocated;
+} MessageToSend;
+
+typedef struct
+{
+  BusTransactionCancelFunction cancel_function;
+  DBusFreeFunction free_data_function;
+  void *data;
+} CancelHook;
+
+/*
+ * The transaction itself, its MessageToSend and its CancelHook records
+ * all die with the transaction, so rather than malloc each of them they
+ * are carved out of chunks owned by the transaction, and the chunks are
+ * handed to the next transaction when this one is freed. In the steady
+ * state routing a message then mallocs nothing here.
+ */
+
+/** Usable size of a chunk; enough for a transaction with a few dozen
+ * recipients, more are served by further chunks */
+#define TRANSACTION_CHUNK_SIZE 1024
+
+/** How many free chunks BusConnections keeps for later transactions */
+#define MAX_SPARE_TRANSACTION_CHUNKS 8
+
+#define TRANSACTION_CHUNK_HEADER_SIZE \
+  _DBUS_ALIGN_VALUE (sizeof (TransactionChunk), sizeof (void *))
+
+#define TRANSACTION_CHUNK_DATA(chunk) \
+  ((char *) (chunk) + TRANSACTION_CHUNK_HEADER_SIZE)
+
+struct BusTransaction
+{
+  DBusList *connections;
+  BusContext *context;
+  DBusList *cancel_hooks;
+  BusConnections *chunk_owner; /**< Where our chunks go when we're freed */
+  TransactionChunk *chunks;    /**< Newest first; the last one holds the
+                                * transaction itself */
+  dbus_uint32_t id;            /**< Nonzero, unique among live transactions */
+};
+
+static TransactionChunk *
+transaction_chunk_new (BusConnections *connections,
+                       size_t          min_size)
+{
+  TransactionChunk *chunk;
+  size_t size;
+
+  if (min_size <= TRANSACTION_CHUNK_SIZE && connections->spare_chunks != NULL)
+    {
+      chunk = connections->spare_chunks;
+      connections->spare_chunks = chunk->next;
+      connections->n_spare_chunks -= 1;
+    }
+  else
+    {
+      size = MAX (min_size, TRANSACTION_CHUNK_SIZE);
+
+      chunk = _dbus_malloc_tagged (DBUS_MEM_TAG_CONNECTION,
+                                   TRANSACTION_CHUNK_HEADER_SIZE + size);
+      if (chunk == NULL)
+        return NULL;
+
+      chunk->size = size;
+    }
+
+  chunk->next = NULL;
+  chunk->used = 0;
+
+  return chunk;
+}
+
+static void
+transaction_chunk_free (BusConnections   *connections,
+                        TransactionChunk *chunk)
+{
+  if (chunk->size == TRANSACTION_CHUNK_SIZE &&
+      connections->n_spare_chunks < MAX_SPARE_TRANSACTION_CHUNKS)
+    {
+      chunk->next = connections->spare_chunks;
+      connections->spare_chunks = chunk;
+      connections->n_spare_chunks += 1;
+    }
+  else
+    {
+      dbus_free (chunk);
+    }
+}
+
+/* Allocates size bytes that live until the transaction is freed */
+static void *
+transaction_alloc (BusTransaction *transaction,
+                   size_t          size)
+{
+  TransactionChunk *chunk;
+  void *p;
+
+  size = _DBUS_ALIGN_VALUE (size, sizeof (void *));
+
+  chunk = transaction->chunks;
+  if (chunk->used + size > chunk->size)
+    {
+      chunk = transaction_chunk_new (transaction->chunk_owner, size);
+      if (chunk == NULL)
+        return NULL;
+
+      chunk->next = transaction->chunks;
+      transaction->chunks = chunk;
+    }
+
+  p = TRANSACTION_CHUNK_DATA (chunk) + chunk->used;
+  chunk->used += size;
+
+  return p;
+}
+
+/* The record itself is part of the transaction's memory */
+static void
+message_to_send_free (DBusConnection *connection,
+                      MessageToSend  *to_send)
+{
+  if (to_send->message)
+    dbus_message_unref (to_send->message);
+
+  if (to_send->preallocated)
+    dbus_connection_free_preallocated_send (connection, to_send->preallocated);
+}
+
+static void
+cancel_hook_cancel (void *element,
+                    void *data)
+{
+  CancelHook *ch = element;
+
+  _dbus_verbose ("Running transaction cancel hook\n");
+  
+  if (ch->cancel_function)
+    (* ch->cancel_function) (ch->data);  
+}
+
+static void
+cancel_hook_free (void *element,
+                  void *data)
+{
+  CancelHook *ch = element;
+
+  if (ch->free_data_function)
+    (* ch->free_data_function) (ch->data);
+}
+
+static void
+free_cancel_hooks (BusTransaction *transaction)
+{
+  _dbus_list_foreach (&transaction->cancel_hooks,
+                      cancel_hook_free, NULL);
+  
+  _dbus_list_clear (&transaction->cancel_hooks);
+}
+
+BusTransaction*
+bus_transaction_new (BusContext *context)
+{
+  BusConnections *connections;
+  TransactionChunk *chunk;
+  BusTransaction *transaction;
+
+  connections = bus_context_get_connections (context);
+
+  chunk = transaction_chunk_new (connections, sizeof (BusTransaction));
+  if (chunk == NULL)
+    return NULL;
+
+  transaction = (BusTransaction *) TRANSACTION_CHUNK_DATA (chunk);
+  chunk->used = _DBUS_ALIGN_VALUE (sizeof (BusTransaction), sizeof (void *));
+
+  memset (transaction, '\0', sizeof (BusTransaction));
   transaction->context = context;
+  transaction->chunk_owner = connections;
+  transaction->chunks = chunk;
+
+  connections->last_transaction_id += 1;
+  if (connections->last_transaction_id == 0)
+    connections->last_transaction_id = 1;
+  transaction->id = connections->last_transaction_id;
   
   return transaction;
 }
@@ -2175,9 +3258,64 @@ bus_transaction_get_context (BusTransaction  *transaction)
   return transaction->context;
 }
 
+static dbus_bool_t transaction_queue_message (BusTransaction *transaction,
+                                              DBusConnection *connection,
+                                              MessageToSend  *to_send);
+
+/* Like bus_transaction_send(), but the message goes into the monitor's
+ * queue, and if there isn't enough memory it is counted as dropped
+ * rather than failing the transaction. */
+static void
+transaction_capture_for_monitor (BusTransaction *transaction,
+                                 DBusConnection *connection,
+                                 DBusMessage    *message)
+{
+  MessageToSend *to_send;
+  BusConnectionData *d;
+  DBusMessage *captured;
+
+  if (!dbus_connection_get_is_connected (connection))
+    return;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+  _dbus_assert (d->monitor_queue != NULL);
+
+  if (d->monitor_max_body_bytes >= 0)
+    captured = _dbus_message_copy_truncated (message,
+                                             d->monitor_max_body_bytes);
+  else
+    captured = dbus_message_ref (message);
+
+  if (captured == NULL)
+    {
+      d->monitor_dropped += 1;
+      return;
+    }
+
+  to_send = transaction_alloc (transaction, sizeof (MessageToSend));
+
+  if (to_send == NULL)
+    {
+      dbus_message_unref (captured);
+      d->monitor_dropped += 1;
+      return;
+    }
+
+  /* no preallocated send: this one is for the monitor queue */
+  to_send->preallocated = NULL;
+  to_send->message = captured;
+  to_send->transaction = transaction;
+
+  if (!transaction_queue_message (transaction, connection, to_send))
+    d->monitor_dropped += 1;
+}
+
 /**
- * Reserve enough memory to capture the given message if the
- * transaction goes through.
+ * Arrange for the given message to be captured by any monitors that
+ * want it if the transaction goes through. This never fails: if there
+ * isn't enough memory, the monitors are told they missed a message
+ * instead, since monitoring must not make ordinary traffic fail.
  */
 dbus_bool_t
 bus_transaction_capture (BusTransaction *transaction,
@@ -2188,7 +3326,6 @@ bus_transaction_capture (BusTransaction *transaction,
   BusMatchmaker *mm;
   DBusList *link;
   DBusList *recipients = NULL;
-  dbus_bool_t ret = FALSE;
 
   connections = bus_context_get_connections (transaction->context);
 
@@ -2203,23 +3340,28 @@ bus_transaction_capture (BusTransaction *transaction,
 
   if (!bus_matchmaker_get_recipients (mm, connections, sender, NULL, message,
         &recipients))
-    goto out;
-
-  for (link = _dbus_list_get_first_link (&recipients);
-      link != NULL;
-      link = _dbus_list_get_next_link (&recipients, link))
     {
-      DBusConnection *recipient = link->data;
+      /* We can't tell who wanted it, so any of them might have */
+      for (link = _dbus_list_get_first_link (&connections->monitors);
+          link != NULL;
+          link = _dbus_list_get_next_link (&connections->monitors, link))
+        {
+          BusConnectionData *d = BUS_CONNECTION_DATA (link->data);
 
-      if (!bus_transaction_send (transaction, recipient, message))
-        goto out;
+          d->monitor_dropped += 1;
+        }
+
+      _dbus_list_clear (&recipients);
+      return TRUE;
     }
 
-  ret = TRUE;
+  for (link = _dbus_list_get_first_link (&recipients);
+      link != NULL;
+      link = _dbus_list_get_next_link (&recipients, link))
+    transaction_capture_for_monitor (transaction, link->data, message);
 
-out:
   _dbus_list_clear (&recipients);
-  return ret;
+  return TRUE;
 }
 
 dbus_bool_t
@@ -2326,8 +3468,6 @@ bus_transaction_send (BusTransaction *transaction,
                       DBusMessage    *message)
 {
   MessageToSend *to_send;
-  BusConnectionData *d;
-  DBusList *link;
 
   _dbus_verbose ("  trying to add %s interface=%s member=%s error=%s to transaction%s\n",
                  dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR ? "error" :
@@ -2347,10 +3487,7 @@ bus_transaction_send (BusTransaction *transaction,
   if (!dbus_connection_get_is_connected (connection))
     return TRUE; /* silently ignore disconnected connections */
   
-  d = BUS_CONNECTION_DATA (connection);
-  _dbus_assert (d != NULL);
-  
-  to_send = dbus_new (MessageToSend, 1);
+  to_send = transaction_alloc (transaction, sizeof (MessageToSend));
   if (to_send == NULL)
     {
       return FALSE;
@@ -2358,64 +3495,152 @@ bus_transaction_send (BusTransaction *transaction,
 
   to_send->preallocated = dbus_connection_preallocate_send (connection);
   if (to_send->preallocated == NULL)
-    {
-      dbus_free (to_send);
-      return FALSE;
-    }  
+    return FALSE;
   
   dbus_message_ref (message);
   to_send->message = message;
   to_send->transaction = transaction;
 
-  _dbus_verbose ("about to prepend message\n");
-  
-  if (!_dbus_list_prepend (&d->transaction_messages, to_send))
-    {
-      message_to_send_free (connection, to_send);
-      return FALSE;
-    }
+  return transaction_queue_message (transaction, connection, to_send);
+}
+
+/* Takes ownership of to_send, freeing it on failure */
+static dbus_bool_t
+transaction_queue_message (BusTransaction *transaction,
+                           DBusConnection *connection,
+                           MessageToSend  *to_send)
+{
+  BusConnectionData *d;
+  DBusList *link;
+  dbus_bool_t already_member;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
 
-  _dbus_verbose ("prepended message\n");
-  
   /* See if we already had this connection in the list
    * for this transaction. If we have a pending message,
-   * then we should already be in transaction->connections
+   * then we should already be in transaction->connections.
+   * The id stamp answers this without looking at the queue
+   * unless several transactions are interleaving messages
+   * to this connection.
    */
-  link = _dbus_list_get_first_link (&d->transaction_messages);
-  _dbus_assert (link->data == to_send);
-  link = _dbus_list_get_next_link (&d->transaction_messages, link);
-  while (link != NULL)
+  if (d->transaction_id == transaction->id)
+    already_member = TRUE;
+  else if (d->n_transactions == 0)
+    already_member = FALSE;
+  else
+    {
+      already_member = FALSE;
+
+      link = _dbus_list_get_first_link (&d->transaction_messages);
+      while (link != NULL)
+        {
+          MessageToSend *m = link->data;
+
+          if (m->transaction == transaction)
+            {
+              already_member = TRUE;
+              break;
+            }
+
+          link = _dbus_list_get_next_link (&d->transaction_messages, link);
+        }
+    }
+
+  _dbus_verbose ("about to prepend message\n");
+  
+  if (!_dbus_list_prepend (&d->transaction_messages, to_send))
     {
-      MessageToSend *m = link->data;
-      DBusList *next = _dbus_list_get_next_link (&d->transaction_messages, link);
-      
-      if (m->transaction == transaction)
-        break;
-        
-      link = next;
+      message_to_send_free (connection, to_send);
+      return FALSE;
     }
 
-  if (link == NULL)
+  _dbus_verbose ("prepended message\n");
+
+  if (!already_member)
     {
       if (!_dbus_list_prepend (&transaction->connections, connection))
         {
-          _dbus_list_remove (&d->transaction_messages, to_send);
+          _dbus_list_remove_link (&d->transaction_messages,
+                                  _dbus_list_get_first_link (&d->transaction_messages));
           message_to_send_free (connection, to_send);
           return FALSE;
         }
+
+      d->n_transactions += 1;
     }
 
+  d->transaction_id = transaction->id;
+
   return TRUE;
 }
 
 static void
 transaction_free (BusTransaction *transaction)
 {
+  BusConnections *connections;
+  TransactionChunk *chunk;
+
   _dbus_assert (transaction->connections == NULL);
 
   free_cancel_hooks (transaction);
 
-  dbus_free (transaction);
+  /* The transaction lives in its last chunk, so read it all first */
+  connections = transaction->chunk_owner;
+  chunk = transaction->chunks;
+
+  while (chunk != NULL)
+    {
+      TransactionChunk *next = chunk->next;
+
+      transaction_chunk_free (connections, chunk);
+      chunk = next;
+    }
+}
+
+/* Detaches the messages this transaction queued for the connection
+ * and returns them, newest first. When it is the only transaction
+ * with messages pending, which is the usual case, the whole queue
+ * is taken at once.
+ */
+static DBusList *
+connection_take_transaction_messages (BusConnectionData *d,
+                                      BusTransaction    *transaction)
+{
+  DBusList *batch;
+  DBusList *link;
+
+  _dbus_assert (d->n_transactions > 0);
+
+  d->n_transactions -= 1;
+  if (d->transaction_id == transaction->id)
+    d->transaction_id = 0;
+
+  if (d->n_transactions == 0)
+    {
+      batch = d->transaction_messages;
+      d->transaction_messages = NULL;
+      d->transaction_id = 0;
+      return batch;
+    }
+
+  batch = NULL;
+  link = _dbus_list_get_last_link (&d->transaction_messages);
+  while (link != NULL)
+    {
+      MessageToSend *m = link->data;
+      DBusList *prev = _dbus_list_get_prev_link (&d->transaction_messages, link);
+
+      if (m->transaction == transaction)
+        {
+          _dbus_list_unlink (&d->transaction_messages, link);
+          _dbus_list_prepend_link (&batch, link);
+        }
+
+      link = prev;
+    }
+
+  return batch;
 }
 
 static void
@@ -2427,22 +3652,14 @@ connection_cancel_transaction (DBusConnection *connection,
   
   d = BUS_CONNECTION_DATA (connection);
   _dbus_assert (d != NULL);
-  
-  link = _dbus_list_get_first_link (&d->transaction_messages);
+
+  link = connection_take_transaction_messages (d, transaction);
   while (link != NULL)
     {
       MessageToSend *m = link->data;
-      DBusList *next = _dbus_list_get_next_link (&d->transaction_messages, link);
-      
-      if (m->transaction == transaction)
-        {
-          _dbus_list_remove_link (&d->transaction_messages,
-                                  link);
-          
-          message_to_send_free (connection, m);
-        }
-        
-      link = next;
+
+      _dbus_list_remove_link (&link, link);
+      message_to_send_free (connection, m);
     }
 }
 
@@ -2466,38 +3683,40 @@ static void
 connection_execute_transaction (DBusConnection *connection,
                                 BusTransaction *transaction)
 {
-  DBusList *link;
+  DBusList *batch;
+  MessageToSend *m;
   BusConnectionData *d;
   
   d = BUS_CONNECTION_DATA (connection);
   _dbus_assert (d != NULL);
 
+  batch = connection_take_transaction_messages (d, transaction);
+
   /* Send the queue in order (FIFO) */
-  link = _dbus_list_get_last_link (&d->transaction_messages);
-  while (link != NULL)
+  while ((m = _dbus_list_pop_last (&batch)))
     {
-      MessageToSend *m = link->data;
-      DBusList *prev = _dbus_list_get_prev_link (&d->transaction_messages, link);
-      
-      if (m->transaction == transaction)
-        {
-          _dbus_list_remove_link (&d->transaction_messages,
-                                  link);
+      _dbus_assert (dbus_message_get_sender (m->message) != NULL);
 
-          _dbus_assert (dbus_message_get_sender (m->message) != NULL);
-          
+      if (m->preallocated == NULL)
+        {
+          /* captured for a monitor */
+          monitor_queue_push (d, m->message);
+        }
+      else
+        {
           dbus_connection_send_preallocated (connection,
                                              m->preallocated,
                                              m->message,
                                              NULL);
 
           m->preallocated = NULL; /* so we don't double-free it */
-          
-          message_to_send_free (connection, m);
         }
-        
-      link = prev;
+
+      message_to_send_free (connection, m);
     }
+
+  if (d->monitor_queue != NULL)
+    monitor_queue_flush (connection, d);
 }
 
 void
@@ -2516,6 +3735,28 @@ bus_transaction_execute_and_free (BusTransaction *transaction)
   transaction_free (transaction);
 }
 
+/**
+ * Frees a transaction whose changes are to be kept without telling
+ * anyone about them: the messages it queued are dropped, but unlike
+ * bus_transaction_cancel_and_free() nothing is undone. This is for
+ * state that connections already know about, such as names restored
+ * from a previous instance of the bus.
+ *
+ * @param transaction the transaction
+ */
+void
+bus_transaction_discard_and_free (BusTransaction *transaction)
+{
+  DBusConnection *connection;
+
+  _dbus_verbose ("TRANSACTION: discarding messages\n");
+
+  while ((connection = _dbus_list_pop_first (&transaction->connections)))
+    connection_cancel_transaction (connection, transaction);
+
+  transaction_free (transaction);
+}
+
 static void
 bus_connection_remove_transactions (DBusConnection *connection)
 {
@@ -2534,6 +3775,9 @@ bus_connection_remove_transactions (DBusConnection *connection)
       _dbus_list_remove (&d->transaction_messages, to_send);
       message_to_send_free (connection, to_send);
     }
+
+  d->n_transactions = 0;
+  d->transaction_id = 0;
 }
 
 /**
@@ -2578,7 +3822,7 @@ bus_transaction_add_cancel_hook (BusTransaction               *transaction,
 {
   CancelHook *ch;
 
-  ch = dbus_new (CancelHook, 1);
+  ch = transaction_alloc (transaction, sizeof (CancelHook));
   if (ch == NULL)
     return FALSE;
 
@@ -2593,10 +3837,7 @@ bus_transaction_add_cancel_hook (BusTransaction               *transaction,
    * were added
    */
   if (!_dbus_list_prepend (&transaction->cancel_hooks, ch))
-    {
-      dbus_free (ch);
-      return FALSE;
-    }
+    return FALSE;
 
   return TRUE;
 }
@@ -2671,6 +3912,17 @@ bus_connection_get_peak_bus_names (DBusConnection *connection)
 
   return d->peak_bus_names;
 }
+
+dbus_uint32_t
+bus_connection_get_memory_footprint (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert(d != NULL);
+
+  return _dbus_connection_get_footprint (connection) + sizeof (BusConnectionData);
+}
 #endif /* DBUS_ENABLE_STATS */
 
 dbus_bool_t
@@ -2730,6 +3982,8 @@ dbus_bool_t
 bus_connection_be_monitor (DBusConnection  *connection,
                            BusTransaction  *transaction,
                            DBusList       **rules,
+                           dbus_uint32_t    flags,
+                           int              max_body_bytes,
                            DBusError       *error)
 {
   BusConnectionData *d;
@@ -2748,8 +4002,16 @@ bus_connection_be_monitor (DBusConnection  *connection,
       return FALSE;
     }
 
+  if (!monitor_queue_init (connection, d, flags, max_body_bytes))
+    {
+      _dbus_list_free_link (link);
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
   if (!bcd_add_monitor_rules (d, connection, rules))
     {
+      monitor_queue_free (connection, d);
       _dbus_list_free_link (link);
       BUS_SET_OOM (error);
       return FALSE;
@@ -2759,6 +4021,7 @@ bus_connection_be_monitor (DBusConnection  *connection,
   if (!_dbus_list_copy (&d->services_owned, &tmp))
     {
       bcd_drop_monitor_rules (d, connection);
+      monitor_queue_free (connection, d);
       _dbus_list_free_link (link);
       BUS_SET_OOM (error);
       return FALSE;
@@ -2776,6 +4039,7 @@ bus_connection_be_monitor (DBusConnection  *connection,
       if (!bus_service_remove_owner (service, connection, transaction, error))
         {
           bcd_drop_monitor_rules (d, connection);
+          monitor_queue_free (connection, d);
           _dbus_list_free_link (link);
           _dbus_list_clear (&tmp);
           return FALSE;
@@ -2809,3 +4073,339 @@ bus_connection_be_monitor (DBusConnection  *connection,
 
   return TRUE;
 }
+
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+static TransactionChunk *
+transaction_first_chunk (BusTransaction *transaction)
+{
+  TransactionChunk *chunk;
+
+  for (chunk = transaction->chunks; chunk->next != NULL; chunk = chunk->next)
+    ;
+
+  return chunk;
+}
+
+/* Checks that transactions carve their records out of chunks that
+ * later transactions reuse, that only a bounded number of chunks is
+ * kept, and that oversized chunks are not kept at all.
+ */
+static dbus_bool_t
+check_transaction_chunks (BusConnections *connections)
+{
+  BusTransaction *transactions[MAX_SPARE_TRANSACTION_CHUNKS + 4];
+  BusTransaction *transaction;
+  TransactionChunk *chunk;
+  int n_spare;
+  int i;
+
+  /* A freed transaction's chunk is handed to the next transaction */
+  transaction = bus_transaction_new (connections->context);
+  if (transaction == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  chunk = transaction_first_chunk (transaction);
+  bus_transaction_cancel_and_free (transaction);
+
+  n_spare = connections->n_spare_chunks;
+  if (connections->spare_chunks != chunk)
+    {
+      _dbus_warn ("Freed transaction chunk was not kept for reuse\n");
+      return FALSE;
+    }
+
+  transaction = bus_transaction_new (connections->context);
+  if (transaction == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  if (transaction_first_chunk (transaction) != chunk ||
+      connections->n_spare_chunks != n_spare - 1)
+    {
+      _dbus_warn ("New transaction did not reuse a spare chunk\n");
+      return FALSE;
+    }
+
+  /* Small records fill the chunk before another is taken, and all of
+   * those chunks come back when the transaction is freed */
+  while (transaction->chunks->next == NULL)
+    {
+      if (transaction_alloc (transaction, sizeof (MessageToSend)) == NULL)
+        _dbus_assert_not_reached ("no memory");
+    }
+
+  if (transaction->chunks->size != TRANSACTION_CHUNK_SIZE)
+    {
+      _dbus_warn ("Overflowing a chunk took an oddly sized chunk\n");
+      return FALSE;
+    }
+
+  n_spare = connections->n_spare_chunks;
+  bus_transaction_cancel_and_free (transaction);
+
+  if (connections->n_spare_chunks != MIN (n_spare + 2,
+                                          MAX_SPARE_TRANSACTION_CHUNKS))
+    {
+      _dbus_warn ("Expected %d spare transaction chunks, got %d\n",
+                  MIN (n_spare + 2, MAX_SPARE_TRANSACTION_CHUNKS),
+                  connections->n_spare_chunks);
+      return FALSE;
+    }
+
+  /* No more than MAX_SPARE_TRANSACTION_CHUNKS are kept however many
+   * transactions were alive at once */
+  for (i = 0; i < _DBUS_N_ELEMENTS (transactions); i++)
+    {
+      transactions[i] = bus_transaction_new (connections->context);
+      if (transactions[i] == NULL)
+        _dbus_assert_not_reached ("no memory");
+    }
+
+  if (connections->n_spare_chunks != 0)
+    {
+      _dbus_warn ("Spare chunks left while more transactions were alive\n");
+      return FALSE;
+    }
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (transactions); i++)
+    bus_transaction_cancel_and_free (transactions[i]);
+
+  if (connections->n_spare_chunks != MAX_SPARE_TRANSACTION_CHUNKS)
+    {
+      _dbus_warn ("Expected %d spare transaction chunks, got %d\n",
+                  MAX_SPARE_TRANSACTION_CHUNKS, connections->n_spare_chunks);
+      return FALSE;
+    }
+
+  /* A record too big for a normal chunk gets its own, which is freed
+   * rather than kept */
+  for (i = 0; i < 3; i++)
+    {
+      transactions[i] = bus_transaction_new (connections->context);
+      if (transactions[i] == NULL)
+        _dbus_assert_not_reached ("no memory");
+    }
+
+  if (transaction_alloc (transactions[0], TRANSACTION_CHUNK_SIZE + 1) == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  if (transactions[0]->chunks->size <= TRANSACTION_CHUNK_SIZE)
+    {
+      _dbus_warn ("Oversized record did not get its own chunk\n");
+      return FALSE;
+    }
+
+  n_spare = connections->n_spare_chunks;
+  bus_transaction_cancel_and_free (transactions[0]);
+
+  if (connections->n_spare_chunks != n_spare + 1)
+    {
+      _dbus_warn ("Oversized transaction chunk was kept for reuse\n");
+      return FALSE;
+    }
+
+  for (chunk = connections->spare_chunks; chunk != NULL; chunk = chunk->next)
+    _dbus_assert (chunk->size == TRANSACTION_CHUNK_SIZE);
+
+  bus_transaction_cancel_and_free (transactions[1]);
+  bus_transaction_cancel_and_free (transactions[2]);
+
+  return TRUE;
+}
+
+static dbus_bool_t
+check_transaction_queue (DBusConnection  *connection,
+                         DBusMessage    **expected,
+                         int              n_expected)
+{
+  BusConnectionData *d;
+  DBusList *link;
+  int i;
+
+  d = BUS_CONNECTION_DATA (connection);
+
+  /* The queue is newest first */
+  i = n_expected;
+  for (link = _dbus_list_get_first_link (&d->transaction_messages);
+       link != NULL;
+       link = _dbus_list_get_next_link (&d->transaction_messages, link))
+    {
+      MessageToSend *m = link->data;
+
+      i -= 1;
+      if (i < 0 || m->message != expected[i])
+        return FALSE;
+    }
+
+  return i == 0;
+}
+
+/* Checks that a connection joins a transaction once however many
+ * messages the transaction queues for it, also while another
+ * transaction is queueing messages for the same connection, and that
+ * finishing one transaction leaves the other's messages queued in
+ * order. a and b are the bus's ends of two connections.
+ */
+static dbus_bool_t
+check_transaction_membership (BusConnections *connections,
+                              DBusConnection *a,
+                              DBusConnection *b)
+{
+  DBusMessage *messages[5];
+  BusConnectionData *da;
+  BusConnectionData *db;
+  BusTransaction *first;
+  BusTransaction *second;
+  DBusMessage *expected[4];
+  int i;
+
+  _dbus_assert (a != b);
+  _dbus_assert (dbus_connection_get_is_connected (a));
+  _dbus_assert (dbus_connection_get_is_connected (b));
+
+  da = BUS_CONNECTION_DATA (a);
+  db = BUS_CONNECTION_DATA (b);
+  _dbus_assert (da->transaction_messages == NULL);
+  _dbus_assert (da->n_transactions == 0);
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (messages); i++)
+    {
+      messages[i] = dbus_message_new_signal ("/org/freedesktop/DBus",
+                                             DBUS_INTERFACE_DBUS,
+                                             "TransactionTest");
+      if (messages[i] == NULL ||
+          !dbus_message_set_sender (messages[i], DBUS_SERVICE_DBUS))
+        _dbus_assert_not_reached ("no memory");
+    }
+
+  first = bus_transaction_new (connections->context);
+  second = bus_transaction_new (connections->context);
+  if (first == NULL || second == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  /* Several messages to one connection make it a member once */
+  if (!bus_transaction_send (first, a, messages[0]) ||
+      !bus_transaction_send (first, a, messages[1]) ||
+      !bus_transaction_send (first, b, messages[0]) ||
+      !bus_transaction_send (first, a, messages[2]))
+    _dbus_assert_not_reached ("no memory");
+
+  if (_dbus_list_get_length (&first->connections) != 2 ||
+      da->n_transactions != 1 ||
+      da->transaction_id != first->id)
+    {
+      _dbus_warn ("Connection joined a transaction more than once\n");
+      return FALSE;
+    }
+
+  /* Interleaving a second transaction makes the first look at the
+   * queue, where it must still find its own messages */
+  if (!bus_transaction_send (second, a, messages[3]) ||
+      !bus_transaction_send (first, a, messages[4]))
+    _dbus_assert_not_reached ("no memory");
+
+  if (_dbus_list_get_length (&first->connections) != 2 ||
+      _dbus_list_get_length (&second->connections) != 1 ||
+      da->n_transactions != 2)
+    {
+      _dbus_warn ("Interleaved transactions have the wrong members\n");
+      return FALSE;
+    }
+
+  /* Cancelling the second picks out only its own message */
+  bus_transaction_cancel_and_free (second);
+
+  expected[0] = messages[0];
+  expected[1] = messages[1];
+  expected[2] = messages[2];
+  expected[3] = messages[4];
+
+  if (da->n_transactions != 1 ||
+      !check_transaction_queue (a, expected, _DBUS_N_ELEMENTS (expected)))
+    {
+      _dbus_warn ("Cancelling a transaction disturbed another's messages\n");
+      return FALSE;
+    }
+
+  /* The last transaction takes the whole queue */
+  bus_transaction_cancel_and_free (first);
+
+  if (da->transaction_messages != NULL ||
+      da->n_transactions != 0 ||
+      da->transaction_id != 0 ||
+      db->transaction_messages != NULL ||
+      db->n_transactions != 0)
+    {
+      _dbus_warn ("Finished transactions left messages queued\n");
+      return FALSE;
+    }
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (messages); i++)
+    dbus_message_unref (messages[i]);
+
+  return TRUE;
+}
+
+/**
+ * Unit test for transactions.
+ *
+ * @param test_data_dir the test data directory
+ * @returns #TRUE on success
+ */
+dbus_bool_t
+bus_transaction_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  BusConnections *connections;
+  DBusConnection *clients[2];
+  int i;
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-allow-all.conf");
+  if (context == NULL)
+    return FALSE;
+
+  connections = bus_context_get_connections (context);
+
+  if (!check_transaction_chunks (connections))
+    _dbus_assert_not_reached ("transaction chunks were not recycled");
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (clients); i++)
+    {
+      clients[i] = dbus_connection_open_private ("debug-pipe:name=test-server",
+                                                 NULL);
+      if (clients[i] == NULL)
+        _dbus_assert_not_reached ("could not alloc connection");
+
+      if (!bus_setup_debug_client (clients[i]))
+        _dbus_assert_not_reached ("could not set up connection");
+
+      while (!dbus_connection_get_is_authenticated (clients[i]))
+        {
+          _dbus_assert (dbus_connection_get_is_connected (clients[i]));
+          bus_test_run_bus_loop (context, FALSE);
+          bus_test_run_clients_loop (FALSE);
+        }
+    }
+
+  /* Without a Hello, the bus's ends are still incomplete */
+  _dbus_assert (connections->n_incomplete == 2);
+
+  if (!check_transaction_membership (connections,
+                                     _dbus_list_get_first (&connections->incomplete),
+                                     _dbus_list_get_last (&connections->incomplete)))
+    _dbus_assert_not_reached ("transaction membership was wrong");
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (clients); i++)
+    {
+      /* the disconnect handler drops the client's last reference */
+      dbus_connection_ref (clients[i]);
+      dbus_connection_close (clients[i]);
+      bus_connection_dispatch_one_message (clients[i]);
+      dbus_connection_unref (clients[i]);
+    }
+
+  bus_context_unref (context);
+
+  return TRUE;
+}
+#endif /* DBUS_ENABLE_EMBEDDED_TESTS */
@@ -30,6 +30,17 @@
 
 typedef dbus_bool_t (* BusConnectionForeachFunction) (DBusConnection *connection, 
                                                       void           *data);
+typedef dbus_bool_t (* BusMatchRuleForeachFunction) (BusMatchRule   *rule,
+                                                     void           *data);
+typedef dbus_bool_t (* BusPendingReplyForeachFunction) (DBusConnection *will_get_reply,
+                                                        DBusConnection *will_send_reply,
+                                                        dbus_uint32_t   reply_serial,
+                                                        long            added_tv_sec,
+                                                        long            added_tv_usec,
+                                                        void           *data);
+typedef dbus_bool_t (* BusDirectChannelForeachFunction) (DBusConnection *connection,
+                                                         DBusConnection *peer,
+                                                         void           *data);
 
 
 BusConnections* bus_connections_new               (BusContext                   *context);
@@ -37,6 +48,10 @@ BusConnections* bus_connections_ref               (BusConnections
 void            bus_connections_unref             (BusConnections               *connections);
 dbus_bool_t     bus_connections_setup_connection  (BusConnections               *connections,
                                                    DBusConnection               *connection);
+dbus_bool_t     bus_connections_start_io_workers  (BusConnections               *connections,
+                                                   int                           n_threads,
+                                                   DBusError                    *error);
+void            bus_connections_stop_io_workers   (BusConnections               *connections);
 void            bus_connections_foreach           (BusConnections               *connections,
                                                    BusConnectionForeachFunction  function,
                                                    void                         *data);
@@ -59,6 +74,10 @@ dbus_bool_t     bus_connections_check_limits      (BusConnections
                                                    DBusConnection               *requesting_completion,
                                                    DBusError                    *error);
 void            bus_connections_expire_incomplete (BusConnections               *connections);
+void            bus_connections_update_idle_trim  (BusConnections               *connections);
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+void            bus_connections_trim_idle_now     (BusConnections               *connections);
+#endif
 
 dbus_bool_t     bus_connections_expect_reply      (BusConnections               *connections,
                                                    BusTransaction               *transaction,
@@ -72,8 +91,18 @@ dbus_bool_t     bus_connections_check_reply       (BusConnections
                                                    DBusConnection               *receiving_reply,
                                                    DBusMessage                  *reply,
                                                    DBusError                    *error);
+dbus_bool_t     bus_connections_foreach_pending_reply (BusConnections                *connections,
+                                                       BusPendingReplyForeachFunction function,
+                                                       void                          *data);
+dbus_bool_t     bus_connections_restore_pending_reply (BusConnections                *connections,
+                                                       DBusConnection                *will_get_reply,
+                                                       DBusConnection                *will_send_reply,
+                                                       dbus_uint32_t                  reply_serial,
+                                                       long                           added_tv_sec,
+                                                       long                           added_tv_usec);
 
 dbus_bool_t     bus_connection_mark_stamp         (DBusConnection               *connection);
+void            bus_connection_note_activity      (DBusConnection               *connection);
 
 dbus_bool_t bus_connection_is_active (DBusConnection *connection);
 const char *bus_connection_get_name  (DBusConnection *connection);
@@ -90,6 +119,9 @@ void        bus_connection_add_match_rule_link (DBusConnection *connection,
 void        bus_connection_remove_match_rule   (DBusConnection *connection,
                                                 BusMatchRule   *rule);
 int         bus_connection_get_n_match_rules   (DBusConnection *connection);
+dbus_bool_t bus_connection_foreach_match_rule  (DBusConnection              *connection,
+                                                BusMatchRuleForeachFunction  function,
+                                                void                        *data);
 
 
 /* called by services.c */
@@ -101,6 +133,20 @@ void        bus_connection_add_owned_service_link (DBusConnection *connection,
                                                    DBusList       *link);
 int         bus_connection_get_n_services_owned   (DBusConnection *connection);
 
+/* called by driver.c for direct channels between two clients */
+void        bus_connection_set_accepts_direct_channels (DBusConnection *connection);
+dbus_bool_t bus_connection_get_accepts_direct_channels (DBusConnection *connection);
+dbus_bool_t bus_connection_has_direct_channel          (DBusConnection *connection,
+                                                        DBusConnection *peer);
+dbus_bool_t bus_connection_add_direct_channel          (DBusConnection *connection,
+                                                        DBusConnection *peer);
+void        bus_connection_remove_direct_channel       (DBusConnection *connection,
+                                                        DBusConnection *peer);
+dbus_bool_t bus_connections_foreach_direct_channel     (BusConnections                  *connections,
+                                                        BusDirectChannelForeachFunction  function,
+                                                        void                            *data);
+void        bus_connections_check_direct_channels      (BusConnections *connections);
+
 /* called by driver.c */
 dbus_bool_t bus_connection_complete (DBusConnection               *connection,
 				     const DBusString             *name,
@@ -121,6 +167,8 @@ dbus_bool_t bus_connection_is_monitor (DBusConnection  *connection);
 dbus_bool_t bus_connection_be_monitor (DBusConnection  *connection,
                                        BusTransaction  *transaction,
                                        DBusList       **rules,
+                                       dbus_uint32_t    flags,
+                                       int              max_body_bytes,
                                        DBusError       *error);
 
 /* transaction API so we can send or not send a block of messages as a whole */
@@ -147,6 +195,7 @@ dbus_bool_t     bus_transaction_send_error_reply (BusTransaction               *
                                                   DBusMessage                  *in_reply_to);
 void            bus_transaction_cancel_and_free  (BusTransaction               *transaction);
 void            bus_transaction_execute_and_free (BusTransaction               *transaction);
+void            bus_transaction_discard_and_free (BusTransaction               *transaction);
 dbus_bool_t     bus_transaction_add_cancel_hook  (BusTransaction               *transaction,
                                                   BusTransactionCancelFunction  cancel_function,
                                                   void                         *data,
@@ -165,5 +214,6 @@ int bus_connections_get_peak_bus_names_per_conn   (BusConnections *connections);
 
 int bus_connection_get_peak_match_rules           (DBusConnection *connection);
 int bus_connection_get_peak_bus_names             (DBusConnection *connection);
+dbus_uint32_t bus_connection_get_memory_footprint (DBusConnection *connection);
 
 #endif /* BUS_CONNECTION_H */
@@ -54,25 +54,61 @@ static int inotify_fd = -1;
 static DBusWatch *watch = NULL;
 static DBusLoop *loop = NULL;
 
+static const char *
+_dir_for_wd (int wd)
+{
+  int i;
+
+  for (i = 0; i < num_wds; i++)
+    {
+      if (wds[i] == wd)
+        return dirs[i];
+    }
+
+  return NULL;
+}
+
+/* Whether an event can't be applied on its own, so the whole
+ * configuration has to be reloaded. name is NULL if the event has
+ * none. */
+static dbus_bool_t
+_event_needs_reload (BusContext *context,
+                     int         wd,
+                     uint32_t    mask,
+                     const char *name)
+{
+  const char *dir;
+
+  /* after an overflow we don't know what we missed */
+  if (mask & IN_Q_OVERFLOW)
+    return TRUE;
+
+  dir = _dir_for_wd (wd);
+
+  if (dir == NULL || name == NULL)
+    return TRUE;
+
+  return !bus_context_handle_file_changed (context, dir, name);
+}
+
 static dbus_bool_t
 _handle_inotify_watch (DBusWatch *passed_watch, unsigned int flags, void *data)
 {
+  BusContext *context = data;
   char buffer[INOTIFY_BUF_LEN];
   ssize_t ret = 0;
   int i = 0;
+  dbus_bool_t need_reload = FALSE;
 
   ret = read (inotify_fd, buffer, INOTIFY_BUF_LEN);
   if (ret < 0)
     _dbus_verbose ("Error reading inotify event: '%s'\n", _dbus_strerror(errno));
   else if (!ret)
     _dbus_verbose ("Error reading inotify event: buffer too small\n");
-  else
-    {
-      _dbus_verbose ("Sending SIGHUP signal on reception of %ld inotify event(s)\n", (long) ret);
-      (void) kill (_dbus_getpid (), SIGHUP);
-    }
 
-#ifdef DBUS_ENABLE_VERBOSE_MODE
+  /* Apply what we can file by file; only fall back to reloading the
+   * whole configuration if some event can't be handled that way.
+   */
   while (i < ret)
     {
       struct inotify_event *ev;
@@ -82,8 +118,19 @@ _handle_inotify_watch (DBusWatch *passed_watch, unsigned int flags, void *data)
       if (ev->len)
         _dbus_verbose ("event name: '%s'\n", ev->name);
       _dbus_verbose ("inotify event: wd=%d mask=%u cookie=%u len=%u\n", ev->wd, ev->mask, ev->cookie, ev->len);
+
+      if (need_reload)
+        continue;
+
+      need_reload = _event_needs_reload (context, ev->wd, ev->mask,
+                                         ev->len ? ev->name : NULL);
+    }
+
+  if (need_reload)
+    {
+      _dbus_verbose ("Sending SIGHUP signal on reception of %ld inotify event(s)\n", (long) ret);
+      (void) kill (_dbus_getpid (), SIGHUP);
     }
-#endif
 
   return TRUE;
 }
@@ -246,7 +293,7 @@ _init_inotify (BusContext *context)
       _dbus_loop_ref (loop);
 
       watch = _dbus_watch_new (inotify_fd, DBUS_WATCH_READABLE, TRUE,
-                               _handle_inotify_watch, NULL, NULL);
+                               _handle_inotify_watch, context, NULL);
 
       if (watch == NULL)
         {
@@ -285,3 +332,84 @@ bus_set_watched_dirs (BusContext *context, DBusList **directories)
 
   _set_watched_dirs_internal (directories);
 }
+
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+#include "test.h"
+
+static int
+_wd_for_dir_ending (const char *suffix)
+{
+  int i;
+
+  for (i = 0; i < num_wds; i++)
+    {
+      DBusString dir;
+
+      if (dirs[i] == NULL)
+        continue;
+
+      _dbus_string_init_const (&dir, dirs[i]);
+
+      if (_dbus_string_ends_with_c_str (&dir, suffix))
+        return wds[i];
+    }
+
+  return -1;
+}
+
+dbus_bool_t
+bus_dir_watch_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  int wd;
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-allow-all.conf");
+  if (context == NULL)
+    return FALSE;
+
+  wd = _wd_for_dir_ending ("/valid-service-files");
+  if (wd < 0)
+    _dbus_assert_not_reached ("service directory is not watched");
+
+  /* A service file is re-read on its own, whether it is there or not */
+  if (_event_needs_reload (context, wd, IN_CLOSE_WRITE,
+                           "org.freedesktop.DBus.TestSuiteEchoService.service"))
+    _dbus_assert_not_reached ("changed .service file caused a reload");
+
+  if (_event_needs_reload (context, wd, IN_DELETE,
+                           "com.example.NoSuchService.service"))
+    _dbus_assert_not_reached ("removed .service file caused a reload");
+
+  /* Files <includedir> would not read can't change anything */
+  if (_event_needs_reload (context, wd, IN_CLOSE_WRITE,
+                           "org.freedesktop.DBus.TestSuiteEchoService.service~"))
+    _dbus_assert_not_reached ("editor backup caused a reload");
+
+  if (_event_needs_reload (context, wd, IN_MOVED_FROM, ".#session.tmp"))
+    _dbus_assert_not_reached ("temporary file caused a reload");
+
+  /* Configuration fragments are only merged by a full reload */
+  if (!_event_needs_reload (context, wd, IN_CLOSE_WRITE, "local.conf"))
+    _dbus_assert_not_reached ("changed .conf file did not cause a reload");
+
+  /* So is anything we can't tell the file for */
+  if (!_event_needs_reload (context, -1, IN_Q_OVERFLOW, NULL))
+    _dbus_assert_not_reached ("queue overflow did not cause a reload");
+
+  if (!_event_needs_reload (context, wd, IN_CLOSE_WRITE | IN_Q_OVERFLOW,
+                            "org.freedesktop.DBus.TestSuiteEchoService.service"))
+    _dbus_assert_not_reached ("queue overflow did not cause a reload");
+
+  if (!_event_needs_reload (context, wd + 1000, IN_CLOSE_WRITE,
+                            "org.freedesktop.DBus.TestSuiteEchoService.service"))
+    _dbus_assert_not_reached ("event for unknown watch did not cause a reload");
+
+  if (!_event_needs_reload (context, wd, IN_CLOSE_WRITE, NULL))
+    _dbus_assert_not_reached ("event without a name did not cause a reload");
+
+  bus_context_unref (context);
+
+  return TRUE;
+}
+#endif /* DBUS_ENABLE_EMBEDDED_TESTS */
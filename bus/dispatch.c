@@ -237,6 +237,8 @@ bus_dispatch (DBusConnection *connection,
   /* Ref connection in case we disconnect it at some point in here */
   dbus_connection_ref (connection);
 
+  bus_connection_note_activity (connection);
+
   /* Monitors aren't meant to send messages to us. */
   if (bus_connection_is_monitor (connection))
     {
@@ -1632,6 +1634,177 @@ check_add_match (BusContext     *context,
   return retval;
 }
 
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_match_batch (BusContext     *context,
+                   DBusConnection *connection,
+                   const char     *method,
+                   const char    **rules,
+                   const char    **expected,
+                   int             n_rules)
+{
+  /* expected may be NULL if the results can't be predicted */
+  DBusMessage *message;
+  dbus_bool_t retval;
+  dbus_uint32_t serial;
+  DBusError error;
+  char **results;
+  int n_results;
+  int i;
+
+  retval = FALSE;
+  dbus_error_init (&error);
+  message = NULL;
+  results = NULL;
+
+  _dbus_verbose ("check_match_batch %s for connection %p\n",
+                 method, connection);
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          method);
+
+  if (message == NULL)
+    return TRUE;
+
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+                                 &rules, n_rules,
+                                 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  if (!dbus_connection_send (connection, message, &serial))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  dbus_connection_ref (connection); /* because we may get disconnected */
+
+  /* send our message */
+  bus_test_run_clients_loop (SEND_PENDING (connection));
+
+  if (!dbus_connection_get_is_connected (connection))
+    {
+      _dbus_verbose ("connection was disconnected\n");
+
+      dbus_connection_unref (connection);
+
+      return TRUE;
+    }
+
+  block_connection_until_message_from_bus (context, connection, method);
+
+  if (!dbus_connection_get_is_connected (connection))
+    {
+      _dbus_verbose ("connection was disconnected\n");
+
+      dbus_connection_unref (connection);
+
+      return TRUE;
+    }
+
+  dbus_connection_unref (connection);
+
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    {
+      _dbus_warn ("Did not receive a reply to %s %d on %p\n",
+                  method, serial, connection);
+      goto out;
+    }
+
+  verbose_message_received (connection, message);
+
+  if (!dbus_message_has_sender (message, DBUS_SERVICE_DBUS))
+    {
+      _dbus_warn ("Message has wrong sender %s\n",
+                  dbus_message_get_sender (message) ?
+                  dbus_message_get_sender (message) : "(none)");
+      goto out;
+    }
+
+  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
+    {
+      if (dbus_message_is_error (message,
+                                 DBUS_ERROR_NO_MEMORY))
+        {
+          ; /* good, this is a valid response */
+        }
+      else
+        {
+          warn_unexpected (connection, message, "not this error");
+
+          goto out;
+        }
+    }
+  else if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_METHOD_RETURN)
+    {
+      _dbus_assert (dbus_message_get_reply_serial (message) == serial);
+
+      if (!dbus_message_get_args (message, &error,
+                                  DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+                                  &results, &n_results,
+                                  DBUS_TYPE_INVALID))
+        {
+          if (dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
+            {
+              retval = TRUE; /* OOM while demarshalling is fine */
+              goto out;
+            }
+
+          _dbus_warn ("Bad reply to %s: %s\n", method, error.message);
+          goto out;
+        }
+
+      if (n_results != n_rules)
+        {
+          _dbus_warn ("%s returned %d results for %d rules\n",
+                      method, n_results, n_rules);
+          goto out;
+        }
+
+      for (i = 0; expected != NULL && i < n_rules; i++)
+        {
+          if (strcmp (results[i], expected[i]) != 0)
+            {
+              _dbus_warn ("%s result %d was \"%s\", expected \"%s\"\n",
+                          method, i, results[i], expected[i]);
+              goto out;
+            }
+        }
+    }
+  else
+    {
+      warn_unexpected (connection, message, "method return for match batch");
+
+      goto out;
+    }
+
+  if (!check_no_leftovers (context))
+    goto out;
+
+  retval = TRUE;
+
+ out:
+  dbus_error_free (&error);
+  dbus_free_string_array (results);
+
+  if (message)
+    dbus_message_unref (message);
+
+  return retval;
+}
+
 #ifdef DBUS_ENABLE_STATS
 /* returns TRUE if the correct thing happens,
  * but the correct thing may include OOM errors.
@@ -1756,6 +1929,172 @@ check_get_all_match_rules (BusContext     *context,
 
   return retval;
 }
+
+/* Sends a method call to the bus and waits for the reply, discarding
+ * anything else that arrives in the meantime */
+static DBusMessage *
+idle_trim_call (BusContext     *context,
+                DBusConnection *connection,
+                DBusMessage    *call)
+{
+  dbus_uint32_t serial;
+
+  if (!dbus_connection_send (connection, call, &serial))
+    _dbus_assert_not_reached ("no memory");
+
+  /* a large message doesn't fit in the socket, so the bus has to
+   * read some before the rest can be written */
+  while (SEND_PENDING (connection) &&
+         dbus_connection_get_is_connected (connection))
+    {
+      bus_test_run_clients_loop (FALSE);
+      bus_test_run_bus_loop (context, FALSE);
+    }
+
+  while (dbus_connection_get_is_connected (connection))
+    {
+      DBusMessage *message;
+
+      block_connection_until_message_from_bus (context, connection,
+                                               "reply from the bus");
+
+      while ((message = pop_message_waiting_for_memory (connection)) != NULL)
+        {
+          verbose_message_received (connection, message);
+
+          if (dbus_message_get_reply_serial (message) == serial)
+            return message;
+
+          dbus_message_unref (message);
+        }
+    }
+
+  return NULL;
+}
+
+/* Returns the MemoryFootprint the bus reports for the connection */
+static dbus_uint32_t
+get_memory_footprint (BusContext     *context,
+                      DBusConnection *connection)
+{
+  DBusMessage *message;
+  DBusMessage *reply;
+  DBusMessageIter iter, arr_iter;
+  const char *name;
+  dbus_uint32_t footprint = 0;
+  dbus_bool_t found = FALSE;
+
+  name = dbus_bus_get_unique_name (connection);
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          BUS_INTERFACE_STATS,
+                                          "GetConnectionStats");
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &name,
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("no memory");
+
+  reply = idle_trim_call (context, connection, message);
+  dbus_message_unref (message);
+
+  if (reply == NULL ||
+      dbus_message_get_type (reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+      !dbus_message_has_signature (reply, "a{sv}"))
+    _dbus_assert_not_reached ("GetConnectionStats failed");
+
+  dbus_message_iter_init (reply, &iter);
+  dbus_message_iter_recurse (&iter, &arr_iter);
+
+  while (dbus_message_iter_get_arg_type (&arr_iter) == DBUS_TYPE_DICT_ENTRY)
+    {
+      DBusMessageIter entry_iter, var_iter;
+      const char *key;
+
+      dbus_message_iter_recurse (&arr_iter, &entry_iter);
+      dbus_message_iter_get_basic (&entry_iter, &key);
+      dbus_message_iter_next (&entry_iter);
+      dbus_message_iter_recurse (&entry_iter, &var_iter);
+
+      if (strcmp (key, "MemoryFootprint") == 0 &&
+          dbus_message_iter_get_arg_type (&var_iter) == DBUS_TYPE_UINT32)
+        {
+          dbus_message_iter_get_basic (&var_iter, &footprint);
+          found = TRUE;
+        }
+
+      dbus_message_iter_next (&arr_iter);
+    }
+
+  dbus_message_unref (reply);
+
+  if (!found)
+    _dbus_assert_not_reached ("no MemoryFootprint in connection stats");
+
+  return footprint;
+}
+
+#define IDLE_TRIM_PAYLOAD (256 * 1024)
+
+/* After reading a large message the bus keeps some slack in the
+ * connection's buffers; once the connection has been idle for a whole
+ * sweep that must be given back, and show in the footprint the bus
+ * reports for it */
+static dbus_bool_t
+check_idle_trim (BusContext     *context,
+                 DBusConnection *connection)
+{
+  DBusMessage *message;
+  DBusMessage *reply;
+  unsigned char *payload;
+  int payload_len = IDLE_TRIM_PAYLOAD;
+  dbus_uint32_t busy, idle;
+
+  payload = dbus_malloc0 (IDLE_TRIM_PAYLOAD);
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_PEER,
+                                          "Ping");
+  if (payload == NULL || message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE,
+                                 &payload, payload_len,
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("no memory");
+
+  dbus_free (payload);
+
+  /* whether the bus minds the argument doesn't matter, only that it
+   * had to read it */
+  reply = idle_trim_call (context, connection, message);
+  dbus_message_unref (message);
+
+  if (reply == NULL)
+    _dbus_assert_not_reached ("no reply to large Ping");
+
+  dbus_message_unref (reply);
+
+  busy = get_memory_footprint (context, connection);
+
+
+  /* The first sweep only notices the connection was busy; it is idle
+   * by the second */
+  bus_connections_trim_idle_now (bus_context_get_connections (context));
+  bus_connections_trim_idle_now (bus_context_get_connections (context));
+
+  idle = get_memory_footprint (context, connection);
+
+  _dbus_verbose ("Footprint %u when busy, %u when idle\n", busy, idle);
+
+  if (idle >= busy)
+    {
+      _dbus_warn ("Footprint only went from %u to %u after trimming\n",
+                  busy, idle);
+      return FALSE;
+    }
+
+  return TRUE;
+}
 #endif
 
 /* returns TRUE if the correct thing happens,
@@ -1798,9 +2137,31 @@ check_hello_connection (BusContext *context)
     }
   else
     {
+      const char *batch[] = { "type='signal'", "type='nonsense'",
+                              "type='signal'" };
+      const char *added[] = { "", DBUS_ERROR_MATCH_RULE_INVALID, "" };
+      const char *unknown[] = { "type='error'", "type='nonsense'" };
+      const char *not_removed[] = { DBUS_ERROR_MATCH_RULE_NOT_FOUND,
+                                    DBUS_ERROR_MATCH_RULE_INVALID };
+
       if (!check_add_match (context, connection, ""))
         return FALSE;
 
+      if (!check_match_batch (context, connection, "AddMatches",
+                              batch, added, _DBUS_N_ELEMENTS (batch)))
+        return FALSE;
+
+      /* AddMatches might have failed with OOM, in which case nothing
+       * was added, so we can't know what removing the batch returns */
+      if (!check_match_batch (context, connection, "RemoveMatches",
+                              batch, NULL, _DBUS_N_ELEMENTS (batch)))
+        return FALSE;
+
+      if (!check_match_batch (context, connection, "RemoveMatches",
+                              unknown, not_removed,
+                              _DBUS_N_ELEMENTS (unknown)))
+        return FALSE;
+
       kill_client_connection (context, connection);
     }
 
@@ -4792,6 +5153,9 @@ bus_dispatch_test_conf (const DBusString *test_data_dir,
 #ifdef DBUS_ENABLE_STATS
   if (!check_get_all_match_rules (context, baz))
     _dbus_assert_not_reached ("GetAllMatchRules message failed");
+
+  if (!check_idle_trim (context, foo))
+    _dbus_assert_not_reached ("idle connection was not trimmed");
 #endif
 
 #ifdef DBUS_WIN_FIXME
@@ -4934,27 +5298,799 @@ bus_dispatch_test_conf_fail (const DBusString *test_data_dir,
   return TRUE;
 }
 
-dbus_bool_t
-bus_dispatch_test (const DBusString *test_data_dir)
+/* Enough 64 KiB messages to fill the socket buffer, the monitor's
+ * outgoing queue up to its high water mark and then its ring several
+ * times over */
+#define MONITOR_FLOOD_MESSAGES 96
+#define MONITOR_FLOOD_PAYLOAD (64 * 1024)
+/* max_queued_messages_per_monitor in debug-monitor-limit.conf */
+#define MONITOR_FLOOD_QUEUE 4
+
+/* The monitors in these tests are not on the clients' main loop, so
+ * they only read when we say so; this sends a method call from one
+ * and waits for the reply, discarding anything else */
+static DBusMessage *
+monitor_call (BusContext     *context,
+              DBusConnection *monitor,
+              DBusMessage    *call)
 {
-  /* run normal activation tests */
-  _dbus_verbose ("Normal activation tests\n");
-  if (!bus_dispatch_test_conf (test_data_dir,
-  			       "valid-config-files/debug-allow-all.conf", FALSE))
-    return FALSE;
+  dbus_uint32_t serial;
 
-#ifdef DBUS_WIN
-  _dbus_warn("Info: Launch helper activation tests skipped because launch-helper is not supported yet\n");
-#else
-  /* run launch-helper activation tests */
-  _dbus_verbose ("Launch helper activation tests\n");
-  if (!bus_dispatch_test_conf (test_data_dir,
-  			       "valid-config-files-system/debug-allow-all-pass.conf", TRUE))
-    return FALSE;
+  if (!dbus_connection_send (monitor, call, &serial))
+    _dbus_assert_not_reached ("no memory");
 
-  /* run select launch-helper activation tests on broken service files */
-  if (!bus_dispatch_test_conf_fail (test_data_dir,
-  			            "valid-config-files-system/debug-allow-all-fail.conf"))
+  while (dbus_connection_get_is_connected (monitor))
+    {
+      DBusMessage *message;
+
+      dbus_connection_read_write (monitor, 0);
+      bus_test_run_bus_loop (context, FALSE);
+
+      while ((message = pop_message_waiting_for_memory (monitor)) != NULL)
+        {
+          verbose_message_received (monitor, message);
+
+          if (dbus_message_get_reply_serial (message) == serial)
+            return message;
+
+          dbus_message_unref (message);
+        }
+    }
+
+  return NULL;
+}
+
+static DBusConnection *
+open_monitor (BusContext    *context,
+              dbus_uint32_t  flags)
+{
+  DBusConnection *monitor;
+  DBusMessage *message;
+  DBusMessage *reply;
+  DBusError error = DBUS_ERROR_INIT;
+  const char **rules = NULL;
+
+  monitor = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
+  if (monitor == NULL)
+    _dbus_assert_not_reached ("could not alloc connection");
+
+  while (!dbus_connection_get_is_authenticated (monitor) &&
+         dbus_connection_get_is_connected (monitor))
+    {
+      dbus_connection_read_write (monitor, 0);
+      bus_test_run_bus_loop (context, FALSE);
+    }
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "Hello");
+  if (message == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  reply = monitor_call (context, monitor, message);
+  dbus_message_unref (message);
+
+  if (reply == NULL ||
+      dbus_message_get_type (reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
+    _dbus_assert_not_reached ("Hello from monitor failed");
+
+  dbus_message_unref (reply);
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_MONITORING,
+                                          "BecomeMonitor");
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &rules, 0,
+                                 DBUS_TYPE_UINT32, &flags,
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("no memory");
+
+  reply = monitor_call (context, monitor, message);
+  dbus_message_unref (message);
+
+  if (reply == NULL ||
+      dbus_message_get_type (reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
+    _dbus_assert_not_reached ("BecomeMonitor failed");
+
+  dbus_message_unref (reply);
+
+  return monitor;
+}
+
+/* A monitor that doesn't read while many large messages go past must
+ * be told how many it missed, and get the ones its policy keeps */
+static dbus_bool_t
+check_monitor_flood (BusContext     *context,
+                     DBusConnection *sender,
+                     dbus_bool_t     drop_oldest)
+{
+  DBusConnection *monitor;
+  DBusMessage *message;
+  unsigned char *payload;
+  dbus_uint32_t i;
+  dbus_uint32_t before = 0;
+  dbus_uint32_t after = 0;
+  dbus_uint32_t dropped = 0;
+  dbus_uint32_t first_after = 0;
+  int n_dropped_signals = 0;
+  int idle = 0;
+  dbus_bool_t retval = FALSE;
+
+  monitor = open_monitor (context,
+                          drop_oldest ? DBUS_MONITOR_FLAG_DROP_OLDEST : 0);
+
+  payload = dbus_malloc0 (MONITOR_FLOOD_PAYLOAD);
+  if (payload == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  for (i = 0; i < MONITOR_FLOOD_MESSAGES; i++)
+    {
+      message = dbus_message_new_signal ("/", "com.example.Flood", "Ping");
+
+      if (message == NULL ||
+          !dbus_message_append_args (message,
+                                     DBUS_TYPE_UINT32, &i,
+                                     DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE,
+                                     &payload, MONITOR_FLOOD_PAYLOAD,
+                                     DBUS_TYPE_INVALID) ||
+          !dbus_connection_send (sender, message, NULL))
+        _dbus_assert_not_reached ("no memory");
+
+      dbus_message_unref (message);
+
+      while (SEND_PENDING (sender))
+        {
+          bus_test_run_clients_loop (FALSE);
+          bus_test_run_bus_loop (context, FALSE);
+        }
+    }
+
+  dbus_free (payload);
+  bus_test_run_everything (context);
+
+  /* Now catch up */
+  while (before + dropped + after < MONITOR_FLOOD_MESSAGES)
+    {
+      dbus_bool_t progress = FALSE;
+
+      dbus_connection_read_write (monitor, 0);
+      bus_test_run_bus_loop (context, FALSE);
+
+      while ((message = pop_message_waiting_for_memory (monitor)) != NULL)
+        {
+          progress = TRUE;
+
+          if (dbus_message_is_signal (message, DBUS_INTERFACE_MONITORING,
+                                      "MessagesDropped"))
+            {
+              if (!dbus_message_get_args (message, NULL,
+                                          DBUS_TYPE_UINT32, &dropped,
+                                          DBUS_TYPE_INVALID))
+                {
+                  warn_unexpected (monitor, message, "a count of messages");
+                  goto out;
+                }
+
+              n_dropped_signals++;
+            }
+          else if (dbus_message_is_signal (message, "com.example.Flood",
+                                           "Ping"))
+            {
+              if (!dbus_message_get_args (message, NULL,
+                                          DBUS_TYPE_UINT32, &i,
+                                          DBUS_TYPE_INVALID))
+                {
+                  warn_unexpected (monitor, message, "a sequence number");
+                  goto out;
+                }
+
+              if (n_dropped_signals == 0)
+                {
+                  /* everything up to the gap arrives in order */
+                  if (i != before)
+                    {
+                      _dbus_warn ("Expected message %u before the gap, "
+                                  "got %u\n", before, i);
+                      goto out;
+                    }
+
+                  before++;
+                }
+              else
+                {
+                  if (after == 0)
+                    first_after = i;
+                  else if (i != first_after + after)
+                    {
+                      _dbus_warn ("Expected message %u after the gap, "
+                                  "got %u\n", first_after + after, i);
+                      goto out;
+                    }
+
+                  after++;
+                }
+            }
+          else
+            {
+              /* e.g. NameLost from becoming a monitor */
+              verbose_message_received (monitor, message);
+            }
+
+          dbus_message_unref (message);
+        }
+
+      if (progress)
+        idle = 0;
+      else if (++idle > 1000)
+        {
+          _dbus_warn ("Monitor stopped receiving after %u messages, %u "
+                      "dropped\n", before + after, dropped);
+          goto out;
+        }
+    }
+
+  _dbus_verbose ("Monitor got %u, lost %u, then got %u from %u\n",
+                 before, dropped, after, first_after);
+
+  if (n_dropped_signals != 1 || dropped == 0)
+    {
+      _dbus_warn ("Expected one MessagesDropped signal, got %d\n",
+                  n_dropped_signals);
+      goto out;
+    }
+
+  if (after != MONITOR_FLOOD_QUEUE)
+    {
+      _dbus_warn ("Expected %d messages after the gap, got %u\n",
+                  MONITOR_FLOOD_QUEUE, after);
+      goto out;
+    }
+
+  /* Either the newest messages or the ones straight after the gap */
+  if (drop_oldest)
+    i = MONITOR_FLOOD_MESSAGES - MONITOR_FLOOD_QUEUE;
+  else
+    i = before;
+
+  if (first_after != i)
+    {
+      _dbus_warn ("Expected messages from %u after the gap, got from %u\n",
+                  i, first_after);
+      goto out;
+    }
+
+  retval = TRUE;
+
+ out:
+  dbus_connection_close (monitor);
+  dbus_connection_unref (monitor);
+  bus_test_run_everything (context);
+
+  return retval;
+}
+
+static dbus_bool_t
+bus_dispatch_monitor_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *foo;
+  DBusError error;
+
+  dbus_error_init (&error);
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-monitor-limit.conf");
+  if (context == NULL)
+    return FALSE;
+
+  foo = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
+  if (foo == NULL)
+    _dbus_assert_not_reached ("could not alloc connection");
+
+  if (!bus_setup_debug_client (foo))
+    _dbus_assert_not_reached ("could not set up connection");
+
+  spin_connection_until_authenticated (context, foo);
+
+  if (!check_hello_message (context, foo))
+    _dbus_assert_not_reached ("hello message failed");
+
+  if (!check_monitor_flood (context, foo, FALSE))
+    _dbus_assert_not_reached ("flooded monitor did not drop the newest messages");
+
+  if (!check_monitor_flood (context, foo, TRUE))
+    _dbus_assert_not_reached ("flooded monitor did not drop the oldest messages");
+
+  kill_client_connection_unchecked (foo);
+
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
+#ifdef DBUS_UNIX
+/* A client connecting to the bus's unix: address, which carries the
+ * bus's guid, sends its Hello right behind BEGIN, before the bus has
+ * even read the handshake */
+static dbus_bool_t
+bus_dispatch_pipelined_auth_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *foo;
+  DBusMessage *message;
+  DBusError error;
+  dbus_uint32_t serial;
+  dbus_bool_t retval;
+  int i;
+
+  dbus_error_init (&error);
+  retval = FALSE;
+
+  if (!dbus_setenv ("DBUS_PIPELINE_AUTH", NULL))
+    _dbus_assert_not_reached ("could not unset DBUS_PIPELINE_AUTH");
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-allow-all.conf");
+  if (context == NULL)
+    return FALSE;
+
+  /* the unix: server comes first in the bus's address */
+  foo = dbus_connection_open_private (bus_context_get_address (context),
+                                      &error);
+  if (foo == NULL)
+    {
+      _dbus_warn ("could not connect to %s: %s\n",
+                  bus_context_get_address (context), error.message);
+      _dbus_assert_not_reached ("could not alloc connection");
+    }
+
+  if (!bus_setup_debug_client (foo))
+    _dbus_assert_not_reached ("could not set up connection");
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "Hello");
+  if (message == NULL ||
+      !dbus_connection_send (foo, message, &serial))
+    _dbus_assert_not_reached ("could not send Hello");
+
+  dbus_message_unref (message);
+
+  /* Only the client runs, so nothing can be authenticated yet */
+  for (i = 0; i < 100 && dbus_connection_has_messages_to_send (foo); i++)
+    bus_test_run_clients_loop (FALSE);
+
+  if (dbus_connection_get_is_authenticated (foo) ||
+      dbus_connection_has_messages_to_send (foo))
+    {
+      _dbus_warn ("Hello was not sent before the handshake was answered\n");
+      goto out;
+    }
+
+  spin_connection_until_authenticated (context, foo);
+  block_connection_until_message_from_bus (context, foo, "reply to Hello");
+
+  message = pop_message_waiting_for_memory (foo);
+  if (message == NULL ||
+      dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+      dbus_message_get_reply_serial (message) != serial)
+    {
+      _dbus_warn ("Pipelined Hello was not answered\n");
+
+      if (message != NULL)
+        dbus_message_unref (message);
+
+      goto out;
+    }
+
+  dbus_message_unref (message);
+  retval = TRUE;
+
+ out:
+  /* NameAcquired */
+  while ((message = dbus_connection_pop_message (foo)) != NULL)
+    dbus_message_unref (message);
+
+  kill_client_connection_unchecked (foo);
+  bus_context_unref (context);
+
+  return retval;
+}
+
+#define IO_WORKERS_N_MESSAGES 200
+#define IO_WORKERS_N_FLOOD 20
+#define IO_WORKERS_FLOOD_SIZE (32 * 1024)
+
+/* The helpers above block in the bus loop while waiting for a reply,
+ * but nothing wakes the main loop when a worker writes that reply, so
+ * with io_threads set we spin both loops instead, for up to a minute.
+ */
+static void
+io_workers_spin (BusContext     *context,
+                 DBusConnection *connection)
+{
+  long start, now, usec;
+
+  _dbus_get_monotonic_time (&start, &usec);
+
+  while (dbus_connection_get_dispatch_status (connection) ==
+         DBUS_DISPATCH_COMPLETE &&
+         dbus_connection_get_is_connected (connection))
+    {
+      bus_test_run_bus_loop (context, FALSE);
+      bus_test_run_clients_loop (FALSE);
+
+      _dbus_get_monotonic_time (&now, &usec);
+      if (now - start > 60)
+        _dbus_assert_not_reached ("nothing arrived from the I/O workers");
+    }
+}
+
+static DBusMessage *
+io_workers_pop (BusContext     *context,
+                DBusConnection *connection)
+{
+  DBusMessage *message;
+
+  io_workers_spin (context, connection);
+
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    _dbus_assert_not_reached ("connection to the bus was lost");
+
+  return message;
+}
+
+static DBusMessage *
+io_workers_call (BusContext     *context,
+                 DBusConnection *connection,
+                 DBusMessage    *message)
+{
+  DBusMessage *reply;
+  dbus_uint32_t serial;
+
+  if (!dbus_connection_send (connection, message, &serial))
+    _dbus_assert_not_reached ("no memory to send a method call");
+
+  dbus_message_unref (message);
+
+  reply = io_workers_pop (context, connection);
+  if (dbus_message_get_type (reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+      dbus_message_get_reply_serial (reply) != serial)
+    {
+      warn_unexpected (connection, reply, "method return");
+      _dbus_assert_not_reached ("bad reply from the bus");
+    }
+
+  return reply;
+}
+
+/* The Hello moves the bus's end of the connection to a worker, which
+ * then writes the reply */
+static DBusConnection *
+io_workers_open_client (BusContext *context)
+{
+  DBusConnection *connection;
+  DBusMessage *message;
+  DBusError error;
+  const char *name;
+
+  dbus_error_init (&error);
+
+  connection = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
+  if (connection == NULL)
+    _dbus_assert_not_reached ("could not alloc connection");
+
+  if (!bus_setup_debug_client (connection))
+    _dbus_assert_not_reached ("could not set up connection");
+
+  spin_connection_until_authenticated (context, connection);
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "Hello");
+  if (message == NULL)
+    _dbus_assert_not_reached ("no memory for Hello");
+
+  message = io_workers_call (context, connection, message);
+
+  if (!dbus_message_get_args (message, &error,
+                              DBUS_TYPE_STRING, &name,
+                              DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("bad reply to Hello");
+
+  while (!dbus_bus_set_unique_name (connection, name))
+    _dbus_wait_for_memory ();
+
+  dbus_message_unref (message);
+
+  message = io_workers_pop (context, connection);
+  if (!dbus_message_is_signal (message, DBUS_INTERFACE_DBUS, "NameAcquired"))
+    {
+      warn_unexpected (connection, message, "NameAcquired");
+      _dbus_assert_not_reached ("no NameAcquired after Hello");
+    }
+
+  dbus_message_unref (message);
+
+  return connection;
+}
+
+static void
+io_workers_send_signal (DBusConnection *from,
+                        DBusConnection *to,
+                        const char     *member,
+                        dbus_uint32_t   seq,
+                        int             n_bytes)
+{
+  DBusMessage *message;
+  unsigned char *bytes;
+
+  bytes = dbus_malloc0 (n_bytes + 1);
+  message = dbus_message_new_signal ("/org/freedesktop/TestSuite",
+                                     "org.freedesktop.TestSuite",
+                                     member);
+  if (bytes == NULL || message == NULL ||
+      !dbus_message_set_destination (message, dbus_bus_get_unique_name (to)) ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_UINT32, &seq,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &bytes, n_bytes,
+                                 DBUS_TYPE_INVALID) ||
+      !dbus_connection_send (from, message, NULL))
+    _dbus_assert_not_reached ("no memory to send a signal");
+
+  dbus_message_unref (message);
+  dbus_free (bytes);
+}
+
+/* Pops the next signal and returns its sequence number, checking that
+ * its payload arrived whole */
+static dbus_uint32_t
+io_workers_pop_signal (BusContext     *context,
+                       DBusConnection *connection,
+                       const char     *member,
+                       int             n_bytes)
+{
+  DBusMessage *message;
+  DBusError error;
+  dbus_uint32_t seq;
+  unsigned char *bytes;
+  int len;
+
+  dbus_error_init (&error);
+
+  message = io_workers_pop (context, connection);
+  if (!dbus_message_is_signal (message, "org.freedesktop.TestSuite", member) ||
+      !dbus_message_get_args (message, &error,
+                              DBUS_TYPE_UINT32, &seq,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &bytes, &len,
+                              DBUS_TYPE_INVALID) ||
+      len != n_bytes)
+    {
+      warn_unexpected (connection, message, member);
+      _dbus_assert_not_reached ("unexpected message relayed by the I/O workers");
+    }
+
+  dbus_message_unref (message);
+
+  return seq;
+}
+
+static dbus_bool_t
+io_workers_name_has_owner (BusContext     *context,
+                           DBusConnection *connection,
+                           const char     *name)
+{
+  DBusMessage *message;
+  DBusError error;
+  dbus_bool_t has_owner;
+
+  dbus_error_init (&error);
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "NameHasOwner");
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &name,
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("no memory for NameHasOwner");
+
+  message = io_workers_call (context, connection, message);
+
+  if (!dbus_message_get_args (message, &error,
+                              DBUS_TYPE_BOOLEAN, &has_owner,
+                              DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("bad reply to NameHasOwner");
+
+  dbus_message_unref (message);
+
+  return has_owner;
+}
+
+/* Real traffic through two I/O worker threads, including clients that
+ * hang up while their worker still has a backlog of their messages to
+ * read; the worker can then be left holding the last reference to the
+ * bus's end of the connection. */
+dbus_bool_t
+bus_dispatch_io_workers_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *foo, *bar, *baz;
+  DBusMessage *message;
+  dbus_uint32_t serials[IO_WORKERS_N_MESSAGES];
+  int i, round;
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/io-threads.conf");
+  if (context == NULL)
+    return FALSE;
+
+  _dbus_assert (bus_context_get_io_threads (context) == 2);
+
+  /* connections are spread over the workers in turn */
+  foo = io_workers_open_client (context);
+  bar = io_workers_open_client (context);
+
+  /* both ways at once: signals from foo to bar, and calls from foo to
+   * the bus, each of which must come out in order */
+  for (i = 0; i < IO_WORKERS_N_MESSAGES; i++)
+    {
+      io_workers_send_signal (foo, bar, "Seq", i, i);
+
+      message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                              DBUS_PATH_DBUS,
+                                              DBUS_INTERFACE_DBUS,
+                                              "GetId");
+      if (message == NULL ||
+          !dbus_connection_send (foo, message, &serials[i]))
+        _dbus_assert_not_reached ("no memory for GetId");
+
+      dbus_message_unref (message);
+    }
+
+  for (i = 0; i < IO_WORKERS_N_MESSAGES; i++)
+    {
+      if (io_workers_pop_signal (context, bar, "Seq", i) != (dbus_uint32_t) i)
+        _dbus_assert_not_reached ("signals were reordered");
+    }
+
+  for (i = 0; i < IO_WORKERS_N_MESSAGES; i++)
+    {
+      message = io_workers_pop (context, foo);
+
+      if (dbus_message_get_reply_serial (message) != serials[i])
+        {
+          warn_unexpected (foo, message, "reply to GetId");
+          _dbus_assert_not_reached ("replies were reordered");
+        }
+
+      dbus_message_unref (message);
+    }
+
+  for (round = 0; round < 3; round++)
+    {
+      char *name;
+      dbus_uint32_t expected;
+
+      baz = io_workers_open_client (context);
+
+      while ((name = _dbus_strdup (dbus_bus_get_unique_name (baz))) == NULL)
+        _dbus_wait_for_memory ();
+
+      for (i = 0; i < IO_WORKERS_N_FLOOD; i++)
+        io_workers_send_signal (baz, bar, "Flood", i, IO_WORKERS_FLOOD_SIZE);
+
+      /* the worker reads while we write, then sees the hangup with
+       * most of the backlog still to go */
+      dbus_connection_flush (baz);
+      kill_client_connection_unchecked (baz);
+
+      while (io_workers_name_has_owner (context, foo, name))
+        ;
+
+      dbus_free (name);
+
+      /* Everything the bus read from baz went out to bar before foo's
+       * signal, so bar has seen whatever is going to arrive once it
+       * gets that */
+      io_workers_send_signal (foo, bar, "Sync", round, 0);
+
+      expected = 0;
+
+      while (TRUE)
+        {
+          dbus_bool_t is_sync;
+
+          io_workers_spin (context, bar);
+
+          message = borrow_message_waiting_for_memory (bar);
+          if (message == NULL)
+            _dbus_assert_not_reached ("connection to the bus was lost");
+
+          is_sync = dbus_message_is_signal (message,
+                                            "org.freedesktop.TestSuite",
+                                            "Sync");
+          dbus_connection_return_message (bar, message);
+
+          if (is_sync)
+            break;
+
+          if (io_workers_pop_signal (context, bar, "Flood",
+                                     IO_WORKERS_FLOOD_SIZE) != expected++ ||
+              expected > IO_WORKERS_N_FLOOD)
+            _dbus_assert_not_reached ("flood was reordered or duplicated");
+        }
+
+      if (io_workers_pop_signal (context, bar, "Sync", 0) != (dbus_uint32_t) round)
+        _dbus_assert_not_reached ("lost the Sync signal");
+    }
+
+  /* Finally the bus closes every connection on its own, from the main
+   * thread, while a worker is still busy reading */
+  baz = io_workers_open_client (context);
+
+  for (i = 0; i < IO_WORKERS_N_FLOOD; i++)
+    {
+      io_workers_send_signal (baz, bar, "Flood", i, IO_WORKERS_FLOOD_SIZE);
+      bus_test_run_clients_loop (FALSE);
+    }
+
+  bus_context_unref (context);
+
+  kill_client_connection_unchecked (baz);
+  kill_client_connection_unchecked (foo);
+  kill_client_connection_unchecked (bar);
+
+  return TRUE;
+}
+#endif
+
+dbus_bool_t
+bus_dispatch_test (const DBusString *test_data_dir)
+{
+  /* When an activation fails for lack of memory, the service it
+   * spawned is killed, and the tests expect it never to have got a
+   * name. A pipelined Hello may already be waiting in the bus's socket
+   * by then and would still be answered, so have activated services,
+   * which inherit our environment, authenticate one step at a time. */
+  if (!dbus_setenv ("DBUS_PIPELINE_AUTH", "0"))
+    _dbus_assert_not_reached ("could not set DBUS_PIPELINE_AUTH");
+
+  /* run normal activation tests */
+  _dbus_verbose ("Normal activation tests\n");
+  if (!bus_dispatch_test_conf (test_data_dir,
+  			       "valid-config-files/debug-allow-all.conf", FALSE))
+    return FALSE;
+
+#ifdef DBUS_WIN
+  _dbus_warn("Info: Launch helper activation tests skipped because launch-helper is not supported yet\n");
+#else
+  /* run launch-helper activation tests */
+  _dbus_verbose ("Launch helper activation tests\n");
+  if (!bus_dispatch_test_conf (test_data_dir,
+  			       "valid-config-files-system/debug-allow-all-pass.conf", TRUE))
+    return FALSE;
+
+  /* run select launch-helper activation tests on broken service files */
+  if (!bus_dispatch_test_conf_fail (test_data_dir,
+  			            "valid-config-files-system/debug-allow-all-fail.conf"))
+    return FALSE;
+#endif
+
+  _dbus_verbose ("Monitor queue tests\n");
+  if (!bus_dispatch_monitor_test (test_data_dir))
+    return FALSE;
+
+#ifdef DBUS_UNIX
+  _dbus_verbose ("Pipelined authentication tests\n");
+  if (!bus_dispatch_pipelined_auth_test (test_data_dir))
     return FALSE;
 #endif
 
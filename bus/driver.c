@@ -343,19 +343,44 @@ bus_driver_send_service_acquired (DBusConnection *connection,
     }
 }
 
+/* We never want to use the same unique client name twice, because
+ * we want to guarantee that if you send a message to a given unique
+ * name, you always get the same application. So we use two numbers
+ * for INT_MAX * INT_MAX combinations, should be pretty safe against
+ * wraparound.
+ */
+/* FIXME these should be in BusRegistry rather than static vars */
+static int next_major_number = 0;
+static int next_minor_number = 0;
+
+/**
+ * Gets where unique names are up to, so that a bus taking over from
+ * this one can carry on without reusing any of them.
+ */
+void
+bus_driver_get_unique_name_counter (int *major,
+                                    int *minor)
+{
+  *major = next_major_number;
+  *minor = next_minor_number;
+}
+
+/**
+ * Continues unique names from where another instance of the bus got
+ * to with bus_driver_get_unique_name_counter().
+ */
+void
+bus_driver_set_unique_name_counter (int major,
+                                    int minor)
+{
+  next_major_number = major;
+  next_minor_number = minor;
+}
+
 static dbus_bool_t
 create_unique_client_name (BusRegistry *registry,
                            DBusString  *str)
 {
-  /* We never want to use the same unique client name twice, because
-   * we want to guarantee that if you send a message to a given unique
-   * name, you always get the same application. So we use two numbers
-   * for INT_MAX * INT_MAX combinations, should be pretty safe against
-   * wraparound.
-   */
-  /* FIXME these should be in BusRegistry rather than static vars */
-  static int next_major_number = 0;
-  static int next_minor_number = 0;
   int len;
 
   len = _dbus_string_get_length (str);
@@ -1117,6 +1142,20 @@ bus_driver_handle_update_activation_environment (DBusConnection *connection,
   return retval;
 }
 
+/* Sampling only makes sense for monitors, which see messages whether
+ * or not they are delivered; ordinary clients must see all matches. */
+static dbus_bool_t
+check_rule_is_not_sampled (BusMatchRule *rule,
+                           DBusError    *error)
+{
+  if (bus_match_rule_get_sample_interval (rule) == 1)
+    return TRUE;
+
+  dbus_set_error (error, DBUS_ERROR_MATCH_RULE_INVALID,
+                  "The \"sample\" key is only valid for monitors");
+  return FALSE;
+}
+
 static dbus_bool_t
 bus_driver_handle_add_match (DBusConnection *connection,
                              BusTransaction *transaction,
@@ -1160,6 +1199,9 @@ bus_driver_handle_add_match (DBusConnection *connection,
   if (rule == NULL)
     goto failed;
 
+  if (!check_rule_is_not_sampled (rule, error))
+    goto failed;
+
   context = bus_transaction_get_context (transaction);
   bustype = context ? bus_context_get_type (context) : NULL;
   if (bus_match_rule_get_client_is_eavesdropping (rule) &&
@@ -1245,6 +1287,321 @@ bus_driver_handle_remove_match (DBusConnection *connection,
   return FALSE;
 }
 
+/* Reply to AddMatches or RemoveMatches with one error name per rule,
+ * or "" for each rule that was applied.
+ */
+static dbus_bool_t
+send_match_results_reply (DBusConnection *connection,
+                          BusTransaction *transaction,
+                          DBusMessage    *message,
+                          const char    **results,
+                          int             n_results,
+                          DBusError      *error)
+{
+  DBusMessage *reply;
+
+  if (dbus_message_get_no_reply (message))
+    return TRUE;
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (!dbus_message_append_args (reply,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+                                 &results, n_results,
+                                 DBUS_TYPE_INVALID) ||
+      !bus_transaction_send_from_driver (transaction, connection, reply))
+    {
+      BUS_SET_OOM (error);
+      dbus_message_unref (reply);
+      return FALSE;
+    }
+
+  dbus_message_unref (reply);
+  return TRUE;
+}
+
+static void
+free_rule_errors (DBusError *rule_errors,
+                  int        n_rule_errors)
+{
+  int i;
+
+  if (rule_errors == NULL)
+    return;
+
+  for (i = 0; i < n_rule_errors; i++)
+    dbus_error_free (&rule_errors[i]);
+
+  dbus_free (rule_errors);
+}
+
+static dbus_bool_t
+bus_driver_handle_add_matches (DBusConnection *connection,
+                               BusTransaction *transaction,
+                               DBusMessage    *message,
+                               DBusError      *error)
+{
+  char **texts;
+  int n_texts;
+  const char **results;
+  DBusError *rule_errors;
+  BusMatchRule **added;
+  int n_added;
+  const char *bustype;
+  BusMatchmaker *matchmaker;
+  BusContext *context;
+  int max_rules;
+  int i;
+  dbus_bool_t retval;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  texts = NULL;
+  n_texts = 0;
+  results = NULL;
+  rule_errors = NULL;
+  added = NULL;
+  n_added = 0;
+  matchmaker = NULL;
+  retval = FALSE;
+
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+                              &texts, &n_texts,
+                              DBUS_TYPE_INVALID))
+    {
+      _dbus_verbose ("No memory to get arguments to AddMatches\n");
+      goto out;
+    }
+
+  /* + 1 so that an empty batch still gets non-NULL allocations */
+  results = dbus_new0 (const char *, n_texts + 1);
+  added = dbus_new0 (BusMatchRule *, n_texts + 1);
+  rule_errors = dbus_new0 (DBusError, n_texts + 1);
+
+  if (results == NULL || added == NULL || rule_errors == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  for (i = 0; i < n_texts; i++)
+    dbus_error_init (&rule_errors[i]);
+
+  context = bus_transaction_get_context (transaction);
+  bustype = context ? bus_context_get_type (context) : NULL;
+  max_rules = bus_context_get_max_match_rules_per_connection (context);
+  matchmaker = bus_connection_get_matchmaker (connection);
+
+  for (i = 0; i < n_texts; i++)
+    {
+      DBusError *rule_error = &rule_errors[i];
+      BusMatchRule *rule;
+      DBusString str;
+
+      /* Rules added earlier in this batch count towards the limit */
+      if (bus_connection_get_n_match_rules (connection) >= max_rules)
+        {
+          results[i] = DBUS_ERROR_LIMITS_EXCEEDED;
+          continue;
+        }
+
+      _dbus_string_init_const (&str, texts[i]);
+
+      rule = bus_match_rule_parse (connection, &str, rule_error);
+
+      if (rule != NULL &&
+          (!check_rule_is_not_sampled (rule, rule_error) ||
+           (bus_match_rule_get_client_is_eavesdropping (rule) &&
+            !bus_apparmor_allows_eavesdropping (connection, bustype,
+                                                rule_error))))
+        {
+          bus_match_rule_unref (rule);
+          rule = NULL;
+        }
+
+      if (rule == NULL)
+        {
+          if (dbus_error_has_name (rule_error, DBUS_ERROR_NO_MEMORY))
+            {
+              dbus_move_error (rule_error, error);
+              goto out;
+            }
+
+          _dbus_verbose ("AddMatches: rule %d rejected: %s\n",
+                         i, rule_error->message);
+          /* rule_errors outlive the reply, so no need to copy */
+          results[i] = rule_error->name;
+          continue;
+        }
+
+      if (!bus_matchmaker_add_rule (matchmaker, rule))
+        {
+          bus_match_rule_unref (rule);
+          BUS_SET_OOM (error);
+          goto out;
+        }
+
+      /* the matchmaker holds a ref now; we keep ours until we're done */
+      added[n_added++] = rule;
+      results[i] = "";
+    }
+
+  if (!send_match_results_reply (connection, transaction, message,
+                                 results, n_texts, error))
+    goto out;
+
+  retval = TRUE;
+
+ out:
+  if (added != NULL)
+    {
+      /* Either everything in the batch is applied, or nothing is */
+      while (n_added > 0)
+        {
+          BusMatchRule *rule = added[--n_added];
+
+          if (!retval)
+            bus_matchmaker_remove_rule (matchmaker, rule);
+
+          bus_match_rule_unref (rule);
+        }
+    }
+
+  if (retval)
+    _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+  else
+    _DBUS_ASSERT_ERROR_IS_SET (error);
+
+  dbus_free (added);
+  free_rule_errors (rule_errors, n_texts);
+  dbus_free (results);
+  dbus_free_string_array (texts);
+  return retval;
+}
+
+static dbus_bool_t
+bus_driver_handle_remove_matches (DBusConnection *connection,
+                                  BusTransaction *transaction,
+                                  DBusMessage    *message,
+                                  DBusError      *error)
+{
+  char **texts;
+  int n_texts;
+  const char **results;
+  DBusError *rule_errors;
+  BusMatchRule **found;
+  int n_found;
+  BusMatchmaker *matchmaker;
+  int i;
+  dbus_bool_t retval;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  texts = NULL;
+  n_texts = 0;
+  results = NULL;
+  rule_errors = NULL;
+  found = NULL;
+  n_found = 0;
+  retval = FALSE;
+
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+                              &texts, &n_texts,
+                              DBUS_TYPE_INVALID))
+    {
+      _dbus_verbose ("No memory to get arguments to RemoveMatches\n");
+      goto out;
+    }
+
+  results = dbus_new0 (const char *, n_texts + 1);
+  found = dbus_new0 (BusMatchRule *, n_texts + 1);
+  rule_errors = dbus_new0 (DBusError, n_texts + 1);
+
+  if (results == NULL || found == NULL || rule_errors == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  for (i = 0; i < n_texts; i++)
+    dbus_error_init (&rule_errors[i]);
+
+  matchmaker = bus_connection_get_matchmaker (connection);
+
+  /* Look up every rule before removing any, so that an OOM part-way
+   * through leaves the matchmaker untouched.
+   */
+  for (i = 0; i < n_texts; i++)
+    {
+      DBusError *rule_error = &rule_errors[i];
+      BusMatchRule *value;
+      BusMatchRule *rule;
+      DBusString str;
+
+      _dbus_string_init_const (&str, texts[i]);
+
+      value = bus_match_rule_parse (connection, &str, rule_error);
+
+      if (value == NULL)
+        {
+          if (dbus_error_has_name (rule_error, DBUS_ERROR_NO_MEMORY))
+            {
+              dbus_move_error (rule_error, error);
+              goto out;
+            }
+
+          /* rule_errors outlive the reply, so no need to copy */
+          results[i] = rule_error->name;
+          continue;
+        }
+
+      /* Each rule in the batch removes one instance, as RemoveMatch would */
+      rule = bus_matchmaker_lookup_rule_by_value (matchmaker, value,
+                                                  found, n_found);
+      bus_match_rule_unref (value);
+
+      if (rule == NULL)
+        {
+          results[i] = DBUS_ERROR_MATCH_RULE_NOT_FOUND;
+          continue;
+        }
+
+      found[n_found++] = rule;
+      results[i] = "";
+    }
+
+  /* Send the reply before we remove the rules, since the reply is undone
+   * on transaction cancel, but rule removal isn't.
+   */
+  if (!send_match_results_reply (connection, transaction, message,
+                                 results, n_texts, error))
+    goto out;
+
+  for (i = 0; i < n_found; i++)
+    bus_matchmaker_remove_rule (matchmaker, found[i]);
+
+  retval = TRUE;
+
+ out:
+  if (retval)
+    _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+  else
+    _DBUS_ASSERT_ERROR_IS_SET (error);
+
+  dbus_free (found);
+  free_rule_errors (rule_errors, n_texts);
+  dbus_free (results);
+  dbus_free_string_array (texts);
+  return retval;
+}
+
 static dbus_bool_t
 bus_driver_handle_get_service_owner (DBusConnection *connection,
 				     BusTransaction *transaction,
@@ -1877,6 +2234,226 @@ bus_driver_handle_disable_verbose (DBusConnection *connection,
 }
 #endif
 
+/* The messages that carry an end of a direct channel are sent to that
+ * end alone: unlike the driver's other messages they are not captured,
+ * so that no monitor ever gets hold of a file descriptor it could use
+ * to listen in on, or take part in, the conversation. */
+static dbus_bool_t
+send_direct_channel_end (BusTransaction *transaction,
+                         DBusConnection *connection,
+                         DBusMessage    *message)
+{
+  if (!dbus_message_set_sender (message, DBUS_SERVICE_DBUS) ||
+      !dbus_message_set_destination (message,
+                                     bus_connection_get_name (connection)))
+    return FALSE;
+
+  dbus_message_set_no_reply (message, TRUE);
+
+  return bus_transaction_send (transaction, connection, message);
+}
+
+dbus_bool_t
+bus_driver_send_direct_channel_closed (DBusConnection *connection,
+                                       const char     *peer_name,
+                                       BusTransaction *transaction,
+                                       DBusError      *error)
+{
+  DBusMessage *message;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  message = dbus_message_new_signal (DBUS_PATH_DBUS,
+                                     DBUS_INTERFACE_DBUS,
+                                     "DirectChannelClosed");
+
+  if (message == NULL)
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (!dbus_message_set_destination (message, bus_connection_get_name (connection)) ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &peer_name,
+                                 DBUS_TYPE_INVALID) ||
+      !bus_transaction_send_from_driver (transaction, connection, message))
+    {
+      dbus_message_unref (message);
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  dbus_message_unref (message);
+  return TRUE;
+}
+
+static dbus_bool_t
+check_can_pass_fds (DBusConnection *connection,
+                    DBusError      *error)
+{
+  if (!dbus_connection_can_send_type (connection, DBUS_TYPE_UNIX_FD))
+    {
+      dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                      "Direct channels are passed as file descriptors, "
+                      "which connection %s cannot receive",
+                      nonnull (bus_connection_get_name (connection), "(inactive)"));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+bus_driver_handle_accept_direct_channels (DBusConnection *connection,
+                                          BusTransaction *transaction,
+                                          DBusMessage    *message,
+                                          DBusError      *error)
+{
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!check_can_pass_fds (connection, error))
+    return FALSE;
+
+  if (!send_ack_reply (connection, transaction, message, error))
+    return FALSE;
+
+  bus_connection_set_accepts_direct_channels (connection);
+  return TRUE;
+}
+
+typedef struct
+{
+  DBusConnection *connection;
+  DBusConnection *peer;
+} DirectChannelCancelData;
+
+static void
+cancel_direct_channel (void *data)
+{
+  DirectChannelCancelData *d = data;
+
+  bus_connection_remove_direct_channel (d->connection, d->peer);
+}
+
+static dbus_bool_t
+bus_driver_handle_request_direct_channel (DBusConnection *connection,
+                                          BusTransaction *transaction,
+                                          DBusMessage    *message,
+                                          DBusError      *error)
+{
+  DBusConnection *peer;
+  DBusMessage *reply = NULL;
+  DBusMessage *opened = NULL;
+  DirectChannelCancelData *cancel_data;
+  DBusSocket ends[2];
+  const char *name, *peer_name, *our_name;
+  int fd;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  peer = bus_driver_get_conn_helper (connection, message, "direct channel",
+                                     &name, error);
+  if (peer == NULL)
+    return FALSE;
+
+  if (peer == connection)
+    {
+      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                      "A direct channel to %s would lead back to the caller",
+                      name);
+      return FALSE;
+    }
+
+  if (!check_can_pass_fds (connection, error))
+    return FALSE;
+
+  if (!bus_connection_get_accepts_direct_channels (peer))
+    {
+      dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                      "The owner of %s does not accept direct channels",
+                      name);
+      return FALSE;
+    }
+
+  if (!bus_context_check_direct_channel (bus_transaction_get_context (transaction),
+                                         connection, peer, error))
+    return FALSE;
+
+  /* Nothing must go wrong for any reason other than lack of memory
+   * once the socket pair exists, since the transaction would still
+   * go ahead with an error reply */
+  if (!_dbus_socketpair (&ends[0], &ends[1], FALSE, error))
+    return FALSE;
+
+  our_name = bus_connection_get_name (connection);
+  peer_name = bus_connection_get_name (peer);
+
+  /* A new channel replaces the old one on both ends without being
+   * told; a DirectChannelClosed could overtake the new channel's end
+   * and close that instead */
+  if (!bus_connection_has_direct_channel (connection, peer))
+    {
+      if (!bus_connection_add_direct_channel (connection, peer))
+        goto oom;
+
+      cancel_data = dbus_new (DirectChannelCancelData, 1);
+      if (cancel_data == NULL ||
+          !bus_transaction_add_cancel_hook (transaction, cancel_direct_channel,
+                                            cancel_data, dbus_free))
+        {
+          dbus_free (cancel_data);
+          bus_connection_remove_direct_channel (connection, peer);
+          goto oom;
+        }
+
+      cancel_data->connection = connection;
+      cancel_data->peer = peer;
+    }
+
+  opened = dbus_message_new_signal (DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS,
+                                    "DirectChannelOpened");
+  reply = dbus_message_new_method_return (message);
+  if (opened == NULL || reply == NULL)
+    goto oom;
+
+  fd = _dbus_socket_get_int (ends[1]);
+  if (!dbus_message_append_args (opened,
+                                 DBUS_TYPE_STRING, &our_name,
+                                 DBUS_TYPE_UNIX_FD, &fd,
+                                 DBUS_TYPE_INVALID))
+    goto oom;
+
+  fd = _dbus_socket_get_int (ends[0]);
+  if (!dbus_message_append_args (reply,
+                                 DBUS_TYPE_STRING, &peer_name,
+                                 DBUS_TYPE_UNIX_FD, &fd,
+                                 DBUS_TYPE_INVALID))
+    goto oom;
+
+  _dbus_assert (dbus_message_has_signature (reply, "sh"));
+
+  if (!send_direct_channel_end (transaction, peer, opened) ||
+      !send_direct_channel_end (transaction, connection, reply))
+    goto oom;
+
+  dbus_message_unref (opened);
+  dbus_message_unref (reply);
+  _dbus_close_socket (ends[0], NULL);
+  _dbus_close_socket (ends[1], NULL);
+  return TRUE;
+
+ oom:
+  BUS_SET_OOM (error);
+  if (opened != NULL)
+    dbus_message_unref (opened);
+  if (reply != NULL)
+    dbus_message_unref (reply);
+  _dbus_close_socket (ends[0], NULL);
+  _dbus_close_socket (ends[1], NULL);
+  return FALSE;
+}
+
 static dbus_bool_t
 bus_driver_handle_get_id (DBusConnection *connection,
                           BusTransaction *transaction,
@@ -1932,71 +2509,56 @@ bus_driver_handle_get_id (DBusConnection *connection,
   return FALSE;
 }
 
+/* Checks shared by BecomeMonitor and BecomeMonitorWithOptions */
 static dbus_bool_t
-bus_driver_handle_become_monitor (DBusConnection *connection,
-                                  BusTransaction *transaction,
-                                  DBusMessage    *message,
-                                  DBusError      *error)
+check_caller_may_become_monitor (DBusConnection *connection,
+                                 BusTransaction *transaction,
+                                 DBusMessage    *message,
+                                 DBusError      *error)
 {
-  char **match_rules = NULL;
   const char *bustype;
   BusContext *context;
-  BusMatchRule *rule;
-  DBusList *rules = NULL;
-  DBusList *iter;
-  DBusString str;
-  int i;
-  int n_match_rules;
-  dbus_uint32_t flags;
-  dbus_bool_t ret = FALSE;
-
-  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
   if (!bus_driver_check_message_is_for_us (message, error))
-    goto out;
+    return FALSE;
 
   context = bus_transaction_get_context (transaction);
   bustype = context ? bus_context_get_type (context) : NULL;
   if (!bus_apparmor_allows_eavesdropping (connection, bustype, error))
-    goto out;
-
-  if (!bus_driver_check_caller_is_privileged (connection, transaction,
-                                              message, error))
-    goto out;
-
-  if (!dbus_message_get_args (message, error,
-        DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &match_rules, &n_match_rules,
-        DBUS_TYPE_UINT32, &flags,
-        DBUS_TYPE_INVALID))
-    goto out;
+    return FALSE;
 
-  if (flags != 0)
-    {
-      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
-          "BecomeMonitor does not support any flags yet");
-      goto out;
-    }
+  return bus_driver_check_caller_is_privileged (connection, transaction,
+                                                message, error);
+}
 
+/*
+ * Turn the caller into a monitor for the given rules. Rules that do not
+ * set their own sample interval get sample_interval; max_body_bytes is
+ * -1 to capture messages whole.
+ */
+static dbus_bool_t
+become_monitor (DBusConnection *connection,
+                BusTransaction *transaction,
+                DBusMessage    *message,
+                const char    **match_rules,
+                int             n_match_rules,
+                dbus_uint32_t   flags,
+                dbus_uint32_t   sample_interval,
+                int             max_body_bytes,
+                DBusError      *error)
+{
   /* Special case: a zero-length array becomes [""] */
+  static const char *match_everything[] = { "" };
+  BusMatchRule *rule;
+  DBusList *rules = NULL;
+  DBusList *iter;
+  DBusString str;
+  int i;
+  dbus_bool_t ret = FALSE;
+
   if (n_match_rules == 0)
     {
-      match_rules = dbus_malloc (2 * sizeof (char *));
-
-      if (match_rules == NULL)
-        {
-          BUS_SET_OOM (error);
-          goto out;
-        }
-
-      match_rules[0] = _dbus_strdup ("");
-
-      if (match_rules[0] == NULL)
-        {
-          BUS_SET_OOM (error);
-          goto out;
-        }
-
-      match_rules[1] = NULL;
+      match_rules = match_everything;
       n_match_rules = 1;
     }
 
@@ -2006,14 +2568,14 @@ bus_driver_handle_become_monitor (DBusConnection *connection,
       rule = bus_match_rule_parse (connection, &str, error);
 
       if (rule == NULL)
-        {
-          BUS_SET_OOM (error);
-          goto out;
-        }
+        goto out;
 
       /* monitors always eavesdrop */
       bus_match_rule_set_client_is_eavesdropping (rule, TRUE);
 
+      if (bus_match_rule_get_sample_interval (rule) == 1)
+        bus_match_rule_set_sample_interval (rule, sample_interval);
+
       if (!_dbus_list_append (&rules, rule))
         {
           BUS_SET_OOM (error);
@@ -2028,7 +2590,8 @@ bus_driver_handle_become_monitor (DBusConnection *connection,
   if (!send_ack_reply (connection, transaction, message, error))
     goto out;
 
-  if (!bus_connection_be_monitor (connection, transaction, &rules, error))
+  if (!bus_connection_be_monitor (connection, transaction, &rules, flags,
+                                  max_body_bytes, error))
     goto out;
 
   ret = TRUE;
@@ -2046,6 +2609,155 @@ out:
 
   _dbus_list_clear (&rules);
 
+  return ret;
+}
+
+static dbus_bool_t
+bus_driver_handle_become_monitor (DBusConnection *connection,
+                                  BusTransaction *transaction,
+                                  DBusMessage    *message,
+                                  DBusError      *error)
+{
+  char **match_rules = NULL;
+  int n_match_rules;
+  dbus_uint32_t flags;
+  dbus_uint32_t supported_flags;
+  dbus_bool_t ret = FALSE;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!check_caller_may_become_monitor (connection, transaction, message,
+                                        error))
+    goto out;
+
+  if (!dbus_message_get_args (message, error,
+        DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &match_rules, &n_match_rules,
+        DBUS_TYPE_UINT32, &flags,
+        DBUS_TYPE_INVALID))
+    goto out;
+
+  supported_flags = DBUS_MONITOR_FLAG_DROP_OLDEST |
+    DBUS_MONITOR_FLAG_HEADERS_ONLY;
+
+  if ((flags & ~supported_flags) != 0)
+    {
+      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+          "BecomeMonitor does not support flags 0x%x",
+          flags & ~supported_flags);
+      goto out;
+    }
+
+  ret = become_monitor (connection, transaction, message,
+                        (const char **) match_rules, n_match_rules,
+                        flags & DBUS_MONITOR_FLAG_DROP_OLDEST, 1,
+                        (flags & DBUS_MONITOR_FLAG_HEADERS_ONLY) ? 0 : -1,
+                        error);
+
+out:
+  dbus_free_string_array (match_rules);
+  return ret;
+}
+
+static dbus_bool_t
+bus_driver_handle_become_monitor_with_options (DBusConnection *connection,
+                                               BusTransaction *transaction,
+                                               DBusMessage    *message,
+                                               DBusError      *error)
+{
+  char **match_rules = NULL;
+  int n_match_rules;
+  DBusMessageIter iter;
+  DBusMessageIter dict_iter;
+  dbus_uint32_t flags = 0;
+  dbus_uint32_t sample_interval = 1;
+  int max_body_bytes = -1;
+  dbus_bool_t ret = FALSE;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!check_caller_may_become_monitor (connection, transaction, message,
+                                        error))
+    goto out;
+
+  if (!dbus_message_get_args (message, error,
+        DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &match_rules, &n_match_rules,
+        DBUS_TYPE_INVALID))
+    goto out;
+
+  dbus_message_iter_init (message, &iter);
+  dbus_message_iter_next (&iter);
+
+  /* The message signature has already been checked for us,
+   * so let's just assert it's right.
+   */
+  _dbus_assert (dbus_message_iter_get_arg_type (&iter) == DBUS_TYPE_ARRAY);
+
+  dbus_message_iter_recurse (&iter, &dict_iter);
+
+  while (dbus_message_iter_get_arg_type (&dict_iter) == DBUS_TYPE_DICT_ENTRY)
+    {
+      DBusMessageIter entry_iter;
+      DBusMessageIter variant_iter;
+      const char *key;
+      int value_type;
+
+      dbus_message_iter_recurse (&dict_iter, &entry_iter);
+      dbus_message_iter_get_basic (&entry_iter, &key);
+      dbus_message_iter_next (&entry_iter);
+      dbus_message_iter_recurse (&entry_iter, &variant_iter);
+      value_type = dbus_message_iter_get_arg_type (&variant_iter);
+
+      if (strcmp (key, "DropOldest") == 0 &&
+          value_type == DBUS_TYPE_BOOLEAN)
+        {
+          dbus_bool_t drop_oldest;
+
+          dbus_message_iter_get_basic (&variant_iter, &drop_oldest);
+
+          if (drop_oldest)
+            flags |= DBUS_MONITOR_FLAG_DROP_OLDEST;
+          else
+            flags &= ~DBUS_MONITOR_FLAG_DROP_OLDEST;
+        }
+      else if (strcmp (key, "SampleInterval") == 0 &&
+               value_type == DBUS_TYPE_UINT32)
+        {
+          dbus_message_iter_get_basic (&variant_iter, &sample_interval);
+
+          if (sample_interval == 0)
+            {
+              dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                              "SampleInterval must be at least 1");
+              goto out;
+            }
+        }
+      else if (strcmp (key, "MaxBodyBytes") == 0 &&
+               value_type == DBUS_TYPE_UINT32)
+        {
+          dbus_uint32_t max;
+
+          dbus_message_iter_get_basic (&variant_iter, &max);
+
+          /* No message body can be longer than this anyway */
+          max_body_bytes = (int) MIN (max,
+                                      (dbus_uint32_t) DBUS_MAXIMUM_MESSAGE_LENGTH);
+        }
+      else
+        {
+          dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                          "Unsupported BecomeMonitorWithOptions option "
+                          "\"%s\" of type '%c'", key, value_type);
+          goto out;
+        }
+
+      dbus_message_iter_next (&dict_iter);
+    }
+
+  ret = become_monitor (connection, transaction, message,
+                        (const char **) match_rules, n_match_rules,
+                        flags, sample_interval, max_body_bytes, error);
+
+out:
   dbus_free_string_array (match_rules);
   return ret;
 }
@@ -2106,6 +2818,14 @@ static const MessageHandler dbus_message_handlers[] = {
     DBUS_TYPE_STRING_AS_STRING,
     "",
     bus_driver_handle_remove_match },
+  { "AddMatches",
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
+    bus_driver_handle_add_matches },
+  { "RemoveMatches",
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
+    bus_driver_handle_remove_matches },
   { "GetNameOwner",
     DBUS_TYPE_STRING_AS_STRING,
     DBUS_TYPE_STRING_AS_STRING,
@@ -2140,6 +2860,10 @@ static const MessageHandler dbus_message_handlers[] = {
     bus_driver_handle_get_id },
   { "GetConnectionCredentials", "s", "a{sv}",
     bus_driver_handle_get_connection_credentials },
+  { "AcceptDirectChannels", "", "",
+    bus_driver_handle_accept_direct_channels },
+  { "RequestDirectChannel", "s", "sh",
+    bus_driver_handle_request_direct_channel },
   { NULL, NULL, NULL, NULL }
 };
 
@@ -2153,6 +2877,8 @@ static const MessageHandler introspectable_message_handlers[] = {
 
 static const MessageHandler monitoring_message_handlers[] = {
   { "BecomeMonitor", "asu", "", bus_driver_handle_become_monitor },
+  { "BecomeMonitorWithOptions", "asa{sv}", "",
+    bus_driver_handle_become_monitor_with_options },
   { NULL, NULL, NULL, NULL }
 };
 
@@ -2193,6 +2919,13 @@ static InterfaceHandler interface_handlers[] = {
     "    </signal>\n"
     "    <signal name=\"NameAcquired\">\n"
     "      <arg type=\"s\"/>\n"
+    "    </signal>\n"
+    "    <signal name=\"DirectChannelOpened\">\n"
+    "      <arg type=\"s\"/>\n"
+    "      <arg type=\"h\"/>\n"
+    "    </signal>\n"
+    "    <signal name=\"DirectChannelClosed\">\n"
+    "      <arg type=\"s\"/>\n"
     "    </signal>\n" },
   { DBUS_INTERFACE_INTROSPECTABLE, introspectable_message_handlers, NULL },
   { DBUS_INTERFACE_MONITORING, monitoring_message_handlers, NULL },
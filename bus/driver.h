@@ -40,6 +40,10 @@ dbus_bool_t bus_driver_send_service_acquired (DBusConnection *connection,
                                               const char     *service_name,
                                               BusTransaction *transaction,
                                               DBusError      *error);
+dbus_bool_t bus_driver_send_direct_channel_closed (DBusConnection *connection,
+                                                   const char     *peer_name,
+                                                   BusTransaction *transaction,
+                                                   DBusError      *error);
 dbus_bool_t bus_driver_send_service_owner_changed  (const char     *service_name,
 						    const char     *old_owner,
 						    const char     *new_owner,
@@ -48,5 +52,9 @@ dbus_bool_t bus_driver_send_service_owner_changed  (const char     *service_name
 dbus_bool_t bus_driver_generate_introspect_string  (DBusString *xml);
 dbus_bool_t bus_driver_check_message_is_for_us     (DBusMessage *message,
                                                     DBusError   *error);
+void        bus_driver_get_unique_name_counter     (int         *major,
+                                                    int         *minor);
+void        bus_driver_set_unique_name_counter     (int          major,
+                                                    int          minor);
 
 #endif /* BUS_DRIVER_H */
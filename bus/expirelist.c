@@ -114,6 +114,16 @@ bus_expire_timeout_set_interval (DBusTimeout   *timeout,
     _dbus_verbose ("No need to disable this expire timeout\n");
 }
 
+void
+bus_expire_list_set_expire_after (BusExpireList *list,
+                                  int            expire_after)
+{
+  list->expire_after = expire_after;
+
+  if (list->items != NULL)
+    bus_expire_list_recheck_immediately (list);
+}
+
 void
 bus_expire_list_recheck_immediately (BusExpireList *list)
 {
@@ -128,12 +138,14 @@ do_expiration_with_monotonic_time (BusExpireList *list,
                                    long           tv_usec)
 {
   DBusList *link;
-  int next_interval, min_wait_time, items_to_expire;
+  int next_interval;
 
   next_interval = -1;
-  min_wait_time = 3600 * 1000; /* this is reset anyway if used */
-  items_to_expire = 0;
-  
+
+  /* The list is sorted by the time items were added, and every item
+   * expires the same time after that, so we can stop at the first
+   * item that has not expired yet.
+   */
   link = _dbus_list_get_first_link (&list->items);
   while (link != NULL)
     {
@@ -164,22 +176,17 @@ do_expiration_with_monotonic_time (BusExpireList *list,
               break;
             }
         }
-      else if (list->expire_after > 0)
+      else
         {
-          double to_wait;
+          if (list->expire_after > 0)
+            next_interval = (double) list->expire_after - elapsed;
 
-          items_to_expire = 1;
-          to_wait = (double) list->expire_after - elapsed;
-          if (min_wait_time > to_wait)
-            min_wait_time = to_wait;
+          break;
         }
 
       link = next;
     }
 
-  if (next_interval < 0 && items_to_expire)
-    next_interval = min_wait_time;
-
   return next_interval;
 }
 
@@ -236,17 +243,53 @@ bus_expire_list_unlink (BusExpireList *list,
   _dbus_list_unlink (&list->items, link);
 }
 
+/* Returns TRUE if a was added before b */
+static dbus_bool_t
+item_added_before (BusExpireItem *a,
+                   BusExpireItem *b)
+{
+  if (a->added_tv_sec != b->added_tv_sec)
+    return a->added_tv_sec < b->added_tv_sec;
+
+  return a->added_tv_usec < b->added_tv_usec;
+}
+
+/* Keeps the list sorted by the time items were added. Items are
+ * usually added just now, so search from the end.
+ */
+static void
+insert_link_sorted (BusExpireList *list,
+                    DBusList      *link)
+{
+  DBusList *before;
+
+  before = _dbus_list_get_last_link (&list->items);
+  while (before != NULL && item_added_before (link->data, before->data))
+    before = _dbus_list_get_prev_link (&list->items, before);
+
+  if (before == NULL)
+    _dbus_list_prepend_link (&list->items, link);
+  else
+    _dbus_list_insert_after_link (&list->items, before, link);
+}
+
+/* The item's added_tv_sec and added_tv_usec must already be set, and
+ * must not change while it is in the list; use
+ * bus_expire_list_expire_link_now() to expire it early.
+ */
 dbus_bool_t
 bus_expire_list_add (BusExpireList *list,
                      BusExpireItem *item)
 {
-  dbus_bool_t ret;
+  DBusList *link;
 
-  ret = _dbus_list_prepend (&list->items, item);
-  if (ret && !dbus_timeout_get_enabled (list->timeout))
-    bus_expire_timeout_set_interval (list->timeout, 0);
+  link = _dbus_list_alloc_link (item);
+  if (link == NULL)
+    return FALSE;
+
+  bus_expire_list_add_link (list, link);
 
-  return ret;
+  return TRUE;
 }
 
 void
@@ -255,12 +298,32 @@ bus_expire_list_add_link (BusExpireList *list,
 {
   _dbus_assert (link->data != NULL);
   
-  _dbus_list_prepend_link (&list->items, link);
+  insert_link_sorted (list, link);
 
-  if (!dbus_timeout_get_enabled (list->timeout))
+  /* An item restored with an old added time may be due before the
+   * timeout we had armed */
+  if (!dbus_timeout_get_enabled (list->timeout) || list->items == link)
     bus_expire_timeout_set_interval (list->timeout, 0);
 }
 
+/* Makes an item in the list expire the next time the list is checked,
+ * which will be soon.
+ */
+void
+bus_expire_list_expire_link_now (BusExpireList *list,
+                                 DBusList      *link)
+{
+  BusExpireItem *item = link->data;
+
+  item->added_tv_sec = 0;
+  item->added_tv_usec = 0;
+
+  _dbus_list_unlink (&list->items, link);
+  _dbus_list_prepend_link (&list->items, link);
+
+  bus_expire_list_recheck_immediately (list);
+}
+
 DBusList*
 bus_expire_list_get_first_link (BusExpireList *list)
 {
@@ -317,6 +380,66 @@ time_add_milliseconds (long *tv_sec,
     }
 }
 
+/* Items added out of order are kept sorted, so that expiry can stop at
+ * the first item that is still live */
+static dbus_bool_t
+check_sorted_expiry (BusExpireList *list,
+                     long           tv_sec,
+                     long           tv_usec)
+{
+  TestExpireItem items[4];
+  DBusList *link;
+  long tv_sec_now, tv_usec_now;
+  int next_interval;
+  int i;
+
+  _DBUS_ZERO (items);
+
+  /* items[i] was added i * 10ms before tv_sec, tv_usec; add them
+   * oldest last */
+  for (i = 0; i < 4; i++)
+    {
+      items[i].item.added_tv_sec = tv_sec - 1;
+      items[i].item.added_tv_usec = tv_usec;
+      time_add_milliseconds (&items[i].item.added_tv_sec,
+                             &items[i].item.added_tv_usec, 1000 - i * 10);
+
+      if (!bus_expire_list_add (list, &items[i].item))
+        return FALSE;
+    }
+
+  link = bus_expire_list_get_first_link (list);
+  for (i = 3; i >= 0; i--)
+    {
+      _dbus_assert (link->data == &items[i].item);
+      link = bus_expire_list_get_next_link (list, link);
+    }
+  _dbus_assert (link == NULL);
+
+  /* The youngest goes to the front once it is to expire straight away */
+  link = _dbus_list_find_last (&list->items, &items[0].item);
+  bus_expire_list_expire_link_now (list, link);
+  _dbus_assert (bus_expire_list_get_first_link (list) == link);
+
+  /* items[3] has been due for 5ms and items[2] is due in 5ms; items[1]
+   * is not looked at */
+  tv_sec_now = tv_sec;
+  tv_usec_now = tv_usec;
+  time_add_milliseconds (&tv_sec_now, &tv_usec_now, list->expire_after - 25);
+  next_interval = do_expiration_with_monotonic_time (list, tv_sec_now,
+                                                     tv_usec_now);
+  _dbus_assert (items[0].expire_count == 1);
+  _dbus_assert (items[3].expire_count == 1);
+  _dbus_assert (items[2].expire_count == 0);
+  _dbus_assert (items[1].expire_count == 0);
+  _dbus_assert (next_interval == 5);
+
+  for (i = 0; i < 4; i++)
+    bus_expire_list_remove (list, &items[i].item);
+
+  return TRUE;
+}
+
 dbus_bool_t
 bus_expire_list_test (const DBusString *test_data_dir)
 {
@@ -389,6 +512,9 @@ bus_expire_list_test (const DBusString *test_data_dir)
 
   bus_expire_list_remove (list, &item->item);
   dbus_free (item);
+
+  if (!check_sorted_expiry (list, tv_sec, tv_usec))
+    goto oom;
   
   bus_expire_list_free (list);
   _dbus_loop_unref (loop);
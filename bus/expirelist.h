@@ -48,6 +48,8 @@ BusExpireList* bus_expire_list_new                 (DBusLoop      *loop,
                                                     BusExpireFunc  expire_func,
                                                     void          *data);
 void           bus_expire_list_free                (BusExpireList *list);
+void           bus_expire_list_set_expire_after    (BusExpireList *list,
+                                                    int            expire_after);
 void           bus_expire_list_recheck_immediately (BusExpireList *list);
 void           bus_expire_list_remove_link         (BusExpireList *list,
                                                     DBusList      *link);
@@ -60,6 +62,8 @@ dbus_bool_t    bus_expire_list_add                 (BusExpireList *list,
                                                     BusExpireItem *item);
 void           bus_expire_list_add_link            (BusExpireList *list,
                                                     DBusList      *link);
+void           bus_expire_list_expire_link_now     (BusExpireList *list,
+                                                    DBusList      *link);
 dbus_bool_t    bus_expire_list_contains_item       (BusExpireList *list,
                                                     BusExpireItem *item);
 void           bus_expire_list_unlink              (BusExpireList *list,
@@ -0,0 +1,2759 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* handoff.c  Handing a running bus over to a new instance of the daemon
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "handoff.h"
+
+#include "activation.h"
+#include "connection.h"
+#include "driver.h"
+#include "expirelist.h"
+#include "services.h"
+#include "signals.h"
+#include "test.h"
+#include "utils.h"
+
+#include <dbus/dbus-connection-internal.h>
+#include <dbus/dbus-credentials.h>
+#include <dbus/dbus-list.h>
+#include <dbus/dbus-server-socket.h>
+#include <dbus/dbus-sysdeps.h>
+
+#ifdef DBUS_UNIX
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <dbus/dbus-sysdeps-unix.h>
+#endif
+
+/* On SIGUSR2 the daemon re-executes itself without its clients
+ * noticing. The running instance stops accepting, waits for clients
+ * that are still authenticating and for activations to finish, then
+ * dispatches everything it has read and writes out everything it has
+ * queued. What is left is state: for each connection the identity
+ * it authenticated as, its unique name, match rules and any partial
+ * message that has been read, plus the name owners and the replies
+ * the bus is expecting. It starts a new instance with the same
+ * arguments and a socket to it, writes that state as a series of
+ * marshalled messages, and passes the listening and client sockets
+ * along with them. Once the new instance has set everything up it
+ * answers with a single byte, and the old one exits without closing
+ * or unlinking anything. If anything goes wrong before that, the new
+ * instance is killed and the old one carries on.
+ *
+ * Under systemd the old instance is the main process of the service,
+ * and systemd stops the service, new instance included, when the main
+ * process exits. So before exiting it tells systemd about the new one
+ * with MAINPID= on $NOTIFY_SOCKET, which needs NotifyAccess=main or
+ * similar in the unit. Without a notification socket we refuse to
+ * start.
+ *
+ * Both ends are the same binary, or at least one that speaks the same
+ * HANDOFF_VERSION, so the records are not meant to be stable.
+ */
+
+#ifdef DBUS_UNIX
+
+#define HANDOFF_PATH "/org/freedesktop/DBus/Handoff"
+#define HANDOFF_INTERFACE "org.freedesktop.DBus.Handoff"
+#define HANDOFF_VERSION 2
+
+/* How often to check whether the bus has settled */
+#define HANDOFF_POLL_INTERVAL 50
+/* How long to wait for clients to authenticate and activations to
+ * finish, and then for queued messages to be written */
+#define HANDOFF_SETTLE_TIMEOUT 5000
+#define HANDOFF_FLUSH_TIMEOUT 2000
+/* How long the new instance may take to load its configuration and
+ * take over */
+#define HANDOFF_ACK_TIMEOUT 30000
+
+/* SCM_MAX_FD on Linux; a record with more fds than this is written in
+ * several pieces */
+#define HANDOFF_MAX_FDS_PER_WRITE 253
+
+#define HANDOFF_ACK 'k'
+
+struct BusHandoff
+{
+  DBusSocket socket;
+  pid_t previous_pid;
+  DBusGUID uuid;
+  int next_major;
+  int next_minor;
+  DBusList *servers;   /**< DBusServer waiting for bus_context_new() */
+  DBusList *records;   /**< DBusMessage waiting for bus_handoff_finish() */
+  int *fds;            /**< Every fd received, in order */
+  int n_fds;
+  int n_fds_allocated;
+  int n_fds_taken;     /**< fds before this one belong to someone else */
+};
+
+typedef struct
+{
+  BusContext *context;
+  DBusTimeout *timeout;
+  DBusSocket notify;   /**< service manager's notification socket */
+  long start_tv_sec;
+  long start_tv_usec;
+} HandoffAttempt;
+
+/* Our own command line, to run the new instance with */
+static char **saved_argv = NULL;
+static HandoffAttempt *current_attempt = NULL;
+
+static dbus_bool_t
+is_handoff_fd_arg (const char *arg)
+{
+  return strncmp (arg, "--handoff-fd=", strlen ("--handoff-fd=")) == 0;
+}
+
+/**
+ * Remembers the command line the daemon was started with, so that a
+ * restart can run the same one. Must be called before anything
+ * changes the working directory.
+ *
+ * @param argc the number of arguments
+ * @param argv the arguments
+ */
+void
+bus_handoff_save_argv (int    argc,
+                       char **argv)
+{
+  DBusString path;
+  char **copy;
+  int i, j;
+
+  /* room for --handoff-fd and the terminating NULL */
+  copy = dbus_new0 (char *, argc + 2);
+  if (copy == NULL)
+    return;
+
+  if (!_dbus_string_init (&path))
+    {
+      dbus_free (copy);
+      return;
+    }
+
+  /* a relative path to the binary would break once we chdir("/") */
+  if (strchr (argv[0], '/') != NULL && argv[0][0] != '/')
+    {
+      char cwd[4096];
+
+      if (getcwd (cwd, sizeof (cwd)) == NULL ||
+          !_dbus_string_append (&path, cwd) ||
+          !_dbus_string_append (&path, "/"))
+        goto failed;
+    }
+
+  if (!_dbus_string_append (&path, argv[0]) ||
+      !_dbus_string_steal_data (&path, &copy[0]))
+    goto failed;
+
+  for (i = 1, j = 1; i < argc; i++)
+    {
+      /* we were started by a restart ourselves */
+      if (is_handoff_fd_arg (argv[i]))
+        continue;
+
+      copy[j] = _dbus_strdup (argv[i]);
+      if (copy[j] == NULL)
+        goto failed;
+
+      j++;
+    }
+
+  _dbus_string_free (&path);
+  dbus_free_string_array (saved_argv);
+  saved_argv = copy;
+  return;
+
+ failed:
+  _dbus_string_free (&path);
+  dbus_free_string_array (copy);
+}
+
+static int
+elapsed_milliseconds (HandoffAttempt *attempt)
+{
+  long tv_sec, tv_usec;
+
+  _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+
+  return (int) ELAPSED_MILLISECONDS_SINCE (attempt->start_tv_sec,
+                                           attempt->start_tv_usec,
+                                           tv_sec, tv_usec);
+}
+
+/* Writes a record, with at most HANDOFF_MAX_FDS_PER_WRITE fds per
+ * write: every batch but the last goes with a single byte. */
+static dbus_bool_t
+write_record (DBusSocket   sock,
+              DBusMessage *record,
+              const int   *fds,
+              int          n_fds,
+              DBusError   *error)
+{
+  DBusString str;
+  char *data;
+  int len, pos;
+
+  if (!dbus_message_marshal (record, &data, &len))
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  _dbus_string_init_const_len (&str, data, len);
+
+  if ((n_fds + HANDOFF_MAX_FDS_PER_WRITE - 1) / HANDOFF_MAX_FDS_PER_WRITE > len)
+    {
+      dbus_set_error (error, DBUS_ERROR_LIMITS_EXCEEDED,
+                      "Too many file descriptors to hand over");
+      dbus_free (data);
+      return FALSE;
+    }
+
+  pos = 0;
+  while (pos < len)
+    {
+      int n, count, written;
+
+      n = MIN (n_fds, HANDOFF_MAX_FDS_PER_WRITE);
+      count = n < n_fds ? 1 : len - pos;
+
+      if (n > 0)
+        written = _dbus_write_socket_with_unix_fds (sock, &str, pos, count,
+                                                    fds, n);
+      else
+        written = _dbus_write_socket (sock, &str, pos, count);
+
+      if (written < 0)
+        {
+          dbus_set_error (error, _dbus_error_from_errno (errno),
+                          "Failed to write to the new instance: %s",
+                          _dbus_strerror (errno));
+          dbus_free (data);
+          return FALSE;
+        }
+
+      /* the fds went with the first byte */
+      pos += written;
+      fds += n;
+      n_fds -= n;
+    }
+
+  dbus_free (data);
+  return TRUE;
+}
+
+static DBusMessage *
+record_new (const char *member)
+{
+  DBusMessage *record;
+
+  record = dbus_message_new_signal (HANDOFF_PATH, HANDOFF_INTERFACE, member);
+
+  /* a message without a serial does not pass validation */
+  if (record != NULL)
+    dbus_message_set_serial (record, 1);
+
+  return record;
+}
+
+static dbus_bool_t
+write_bus_record (BusContext *context,
+                  DBusSocket  sock,
+                  DBusError  *error)
+{
+  DBusMessage *record;
+  DBusString uuid;
+  const char *uuid_str;
+  dbus_uint32_t version = HANDOFF_VERSION;
+  dbus_int32_t major, minor;
+  dbus_bool_t retval = FALSE;
+  int next_major, next_minor;
+
+  if (!_dbus_string_init (&uuid))
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  bus_driver_get_unique_name_counter (&next_major, &next_minor);
+  major = next_major;
+  minor = next_minor;
+
+  record = record_new ("Bus");
+  if (record == NULL ||
+      !bus_context_get_id (context, &uuid))
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  uuid_str = _dbus_string_get_const_data (&uuid);
+
+  if (!dbus_message_append_args (record,
+                                 DBUS_TYPE_UINT32, &version,
+                                 DBUS_TYPE_STRING, &uuid_str,
+                                 DBUS_TYPE_INT32, &major,
+                                 DBUS_TYPE_INT32, &minor,
+                                 DBUS_TYPE_INVALID))
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  retval = write_record (sock, record, NULL, 0, error);
+
+ out:
+  if (record != NULL)
+    dbus_message_unref (record);
+  _dbus_string_free (&uuid);
+  return retval;
+}
+
+static dbus_bool_t
+write_listener_record (DBusServer *server,
+                       DBusSocket  sock,
+                       DBusError  *error)
+{
+  DBusMessage *record = NULL;
+  const DBusSocket *sockets;
+  char *address, *guid;
+  const char *suffix;
+  int *fds = NULL;
+  int n_fds, i;
+  size_t len;
+  dbus_bool_t retval = FALSE;
+
+  address = dbus_server_get_address (server);
+  guid = dbus_server_get_id (server);
+
+  if (address == NULL || guid == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  if (!_dbus_server_socket_get_fds (server, &sockets, &n_fds))
+    {
+      dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                      "Listening on \"%s\" cannot be handed over", address);
+      goto out;
+    }
+
+  /* the new server appends the guid again when it is given it */
+  len = strlen (address) - strlen (guid) - strlen (",guid=");
+  _dbus_assert (strlen (address) > len);
+  _dbus_assert (strcmp (address + len + strlen (",guid="), guid) == 0);
+  address[len] = '\0';
+
+  fds = dbus_new (int, n_fds);
+  record = record_new ("Listener");
+  if (fds == NULL || record == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  for (i = 0; i < n_fds; i++)
+    fds[i] = sockets[i].fd;
+
+  suffix = address;
+  if (!dbus_message_append_args (record,
+                                 DBUS_TYPE_STRING, &suffix,
+                                 DBUS_TYPE_STRING, &guid,
+                                 DBUS_TYPE_UINT32, &n_fds,
+                                 DBUS_TYPE_INVALID))
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  retval = write_record (sock, record, fds, n_fds, error);
+
+ out:
+  if (record != NULL)
+    dbus_message_unref (record);
+  dbus_free (fds);
+  dbus_free (address);
+  dbus_free (guid);
+  return retval;
+}
+
+static dbus_bool_t
+append_match_rule (BusMatchRule *rule,
+                   void         *data)
+{
+  DBusMessageIter *iter = data;
+  char *text;
+  dbus_bool_t ok;
+
+  text = bus_match_rule_to_string (rule);
+  if (text == NULL)
+    return FALSE;
+
+  ok = dbus_message_iter_append_basic (iter, DBUS_TYPE_STRING, &text);
+  dbus_free (text);
+  return ok;
+}
+
+static dbus_bool_t
+write_connection_record (DBusConnection *connection,
+                         DBusSocket      sock,
+                         DBusError      *error)
+{
+  DBusMessage *record = NULL;
+  DBusMessageIter iter, sub;
+  DBusCredentials *identity = NULL;
+  DBusString incoming;
+  const int *pending_fds;
+  unsigned int n_pending_fds;
+  int *fds = NULL;
+  const char *name, *label;
+  const unsigned char *bytes;
+  dbus_int64_t uid, pid;
+  dbus_bool_t unix_fd, accepts_direct_channels;
+  int n_bytes, fd;
+  unsigned int i;
+  dbus_int32_t adt_size;
+  void *adt;
+  dbus_bool_t retval = FALSE;
+
+  if (!_dbus_string_init (&incoming))
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (!dbus_connection_get_socket (connection, &fd))
+    {
+      dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                      "Connection %s has no socket to hand over",
+                      bus_connection_get_loginfo (connection));
+      goto out;
+    }
+
+  identity = _dbus_connection_copy_identity (connection);
+  if (identity == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  if (!_dbus_connection_get_unparsed_incoming (connection, &incoming,
+                                               &pending_fds, &n_pending_fds))
+    {
+      dbus_set_error (error, DBUS_ERROR_FAILED,
+                      "What was read from connection %s cannot be handed over",
+                      bus_connection_get_loginfo (connection));
+      goto out;
+    }
+
+  fds = dbus_new (int, n_pending_fds + 1);
+  record = record_new ("Connection");
+  if (fds == NULL || record == NULL)
+    goto oom;
+
+  fds[0] = fd;
+  for (i = 0; i < n_pending_fds; i++)
+    fds[i + 1] = pending_fds[i];
+
+  /* not said Hello yet */
+  name = bus_connection_get_name (connection);
+  if (name == NULL)
+    name = "";
+
+  if (_dbus_credentials_include (identity, DBUS_CREDENTIAL_UNIX_USER_ID))
+    uid = _dbus_credentials_get_unix_uid (identity);
+  else
+    uid = -1;
+
+  if (_dbus_credentials_include (identity, DBUS_CREDENTIAL_UNIX_PROCESS_ID))
+    pid = _dbus_credentials_get_pid (identity);
+  else
+    pid = -1;
+
+  label = _dbus_credentials_get_linux_security_label (identity);
+  if (label == NULL)
+    label = "";
+
+  adt = _dbus_credentials_get_adt_audit_data (identity);
+  adt_size = adt != NULL ? _dbus_credentials_get_adt_audit_data_size (identity) : 0;
+
+  unix_fd = dbus_connection_can_send_type (connection, DBUS_TYPE_UNIX_FD);
+  accepts_direct_channels = bus_connection_get_name (connection) != NULL &&
+    bus_connection_get_accepts_direct_channels (connection);
+
+  bytes = (const unsigned char *) _dbus_string_get_const_data (&incoming);
+  n_bytes = _dbus_string_get_length (&incoming);
+
+  if (!dbus_message_append_args (record,
+                                 DBUS_TYPE_UINT32, &n_pending_fds,
+                                 DBUS_TYPE_STRING, &name,
+                                 DBUS_TYPE_INT64, &uid,
+                                 DBUS_TYPE_INT64, &pid,
+                                 DBUS_TYPE_STRING, &label,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &adt, adt_size,
+                                 DBUS_TYPE_BOOLEAN, &unix_fd,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &bytes, n_bytes,
+                                 DBUS_TYPE_BOOLEAN, &accepts_direct_channels,
+                                 DBUS_TYPE_INVALID))
+    goto oom;
+
+  dbus_message_iter_init_append (record, &iter);
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                         DBUS_TYPE_STRING_AS_STRING, &sub))
+    goto oom;
+
+  if (!bus_connection_foreach_match_rule (connection, append_match_rule, &sub))
+    {
+      dbus_message_iter_abandon_container (&iter, &sub);
+      goto oom;
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &sub))
+    goto oom;
+
+  retval = write_record (sock, record, fds, n_pending_fds + 1, error);
+  goto out;
+
+ oom:
+  BUS_SET_OOM (error);
+
+ out:
+  if (record != NULL)
+    dbus_message_unref (record);
+  if (identity != NULL)
+    _dbus_credentials_unref (identity);
+  dbus_free (fds);
+  _dbus_string_free (&incoming);
+  return retval;
+}
+
+static void
+collect_service (BusService *service,
+                 void       *data)
+{
+  DBusList **services = data;
+
+  /* a connection's unique name comes with the connection */
+  if (bus_service_get_name (service)[0] == ':')
+    return;
+
+  /* on failure the list is cleared and we stop collecting */
+  if (*services == (DBusList *) services)
+    return;
+
+  if (!_dbus_list_append (services, bus_service_ref (service)))
+    {
+      bus_service_unref (service);
+      while ((service = _dbus_list_pop_first (services)) != NULL)
+        bus_service_unref (service);
+      *services = (DBusList *) services;
+    }
+}
+
+static dbus_bool_t
+append_service_owners (BusRegistry     *registry,
+                       BusService      *service,
+                       DBusMessageIter *array)
+{
+  DBusMessageIter entry, owners, owner;
+  DBusList *names = NULL;
+  DBusList *link;
+  DBusError error = DBUS_ERROR_INIT;
+  const char *name;
+
+  if (!bus_service_list_queued_owners (service, &names, &error))
+    {
+      dbus_error_free (&error);
+      return FALSE;
+    }
+
+  name = bus_service_get_name (service);
+
+  if (!dbus_message_iter_open_container (array, DBUS_TYPE_STRUCT, NULL,
+                                         &entry))
+    goto failed;
+
+  if (!dbus_message_iter_append_basic (&entry, DBUS_TYPE_STRING, &name) ||
+      !dbus_message_iter_open_container (&entry, DBUS_TYPE_ARRAY, "(su)",
+                                         &owners))
+    {
+      dbus_message_iter_abandon_container (array, &entry);
+      goto failed;
+    }
+
+  for (link = _dbus_list_get_first_link (&names);
+       link != NULL;
+       link = _dbus_list_get_next_link (&names, link))
+    {
+      DBusString str;
+      BusService *unique;
+      dbus_uint32_t flags;
+      const char *owner_name = link->data;
+
+      _dbus_string_init_const (&str, owner_name);
+      unique = bus_registry_lookup (registry, &str);
+      _dbus_assert (unique != NULL);
+
+      if (!bus_service_get_owner_flags (service,
+                                        bus_service_get_primary_owners_connection (unique),
+                                        &flags))
+        _dbus_assert_not_reached ("queued owner is not in the queue");
+
+      if (!dbus_message_iter_open_container (&owners, DBUS_TYPE_STRUCT, NULL,
+                                             &owner))
+        goto failed_owners;
+
+      if (!dbus_message_iter_append_basic (&owner, DBUS_TYPE_STRING,
+                                           &owner_name) ||
+          !dbus_message_iter_append_basic (&owner, DBUS_TYPE_UINT32, &flags))
+        {
+          dbus_message_iter_abandon_container (&owners, &owner);
+          goto failed_owners;
+        }
+
+      if (!dbus_message_iter_close_container (&owners, &owner))
+        goto failed_owners;
+    }
+
+  if (!dbus_message_iter_close_container (&entry, &owners))
+    {
+      dbus_message_iter_abandon_container (array, &entry);
+      goto failed;
+    }
+
+  if (!dbus_message_iter_close_container (array, &entry))
+    goto failed;
+
+  _dbus_list_clear (&names);
+  return TRUE;
+
+ failed_owners:
+  dbus_message_iter_abandon_container (&entry, &owners);
+  dbus_message_iter_abandon_container (array, &entry);
+ failed:
+  _dbus_list_clear (&names);
+  return FALSE;
+}
+
+static dbus_bool_t
+write_names_record (BusContext *context,
+                    DBusSocket  sock,
+                    DBusError  *error)
+{
+  BusRegistry *registry = bus_context_get_registry (context);
+  DBusMessage *record = NULL;
+  DBusMessageIter iter, array;
+  DBusList *services = NULL;
+  BusService *service;
+  dbus_bool_t retval = FALSE;
+
+  bus_registry_foreach (registry, collect_service, &services);
+
+  if (services == (DBusList *) &services)
+    {
+      services = NULL;
+      goto oom;
+    }
+
+  record = record_new ("Names");
+  if (record == NULL)
+    goto oom;
+
+  dbus_message_iter_init_append (record, &iter);
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(sa(su))",
+                                         &array))
+    goto oom;
+
+  while ((service = _dbus_list_pop_first (&services)) != NULL)
+    {
+      dbus_bool_t ok = append_service_owners (registry, service, &array);
+
+      bus_service_unref (service);
+
+      if (!ok)
+        {
+          dbus_message_iter_abandon_container (&iter, &array);
+          goto oom;
+        }
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &array))
+    goto oom;
+
+  retval = write_record (sock, record, NULL, 0, error);
+  goto out;
+
+ oom:
+  BUS_SET_OOM (error);
+
+ out:
+  while ((service = _dbus_list_pop_first (&services)) != NULL)
+    bus_service_unref (service);
+  if (record != NULL)
+    dbus_message_unref (record);
+  return retval;
+}
+
+static dbus_bool_t
+append_pending_reply (DBusConnection *will_get_reply,
+                      DBusConnection *will_send_reply,
+                      dbus_uint32_t   reply_serial,
+                      long            added_tv_sec,
+                      long            added_tv_usec,
+                      void           *data)
+{
+  DBusMessageIter *array = data;
+  DBusMessageIter entry;
+  const char *receiver, *replier;
+  dbus_int64_t tv_sec = added_tv_sec;
+  dbus_int64_t tv_usec = added_tv_usec;
+
+  receiver = bus_connection_get_name (will_get_reply);
+  replier = will_send_reply != NULL ?
+    bus_connection_get_name (will_send_reply) : "";
+
+  _dbus_assert (receiver != NULL);
+  _dbus_assert (replier != NULL);
+
+  if (!dbus_message_iter_open_container (array, DBUS_TYPE_STRUCT, NULL,
+                                         &entry))
+    return FALSE;
+
+  if (!dbus_message_iter_append_basic (&entry, DBUS_TYPE_STRING, &receiver) ||
+      !dbus_message_iter_append_basic (&entry, DBUS_TYPE_STRING, &replier) ||
+      !dbus_message_iter_append_basic (&entry, DBUS_TYPE_UINT32,
+                                       &reply_serial) ||
+      !dbus_message_iter_append_basic (&entry, DBUS_TYPE_INT64, &tv_sec) ||
+      !dbus_message_iter_append_basic (&entry, DBUS_TYPE_INT64, &tv_usec))
+    {
+      dbus_message_iter_abandon_container (array, &entry);
+      return FALSE;
+    }
+
+  return dbus_message_iter_close_container (array, &entry);
+}
+
+static dbus_bool_t
+write_replies_record (BusContext *context,
+                      DBusSocket  sock,
+                      DBusError  *error)
+{
+  DBusMessage *record;
+  DBusMessageIter iter, array;
+  dbus_bool_t retval = FALSE;
+
+  record = record_new ("Replies");
+  if (record == NULL)
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  dbus_message_iter_init_append (record, &iter);
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(ssuxx)",
+                                         &array))
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  if (!bus_connections_foreach_pending_reply (bus_context_get_connections (context),
+                                              append_pending_reply, &array))
+    {
+      dbus_message_iter_abandon_container (&iter, &array);
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &array))
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  retval = write_record (sock, record, NULL, 0, error);
+
+ out:
+  dbus_message_unref (record);
+  return retval;
+}
+
+static dbus_bool_t
+append_direct_channel (DBusConnection *connection,
+                       DBusConnection *peer,
+                       void           *data)
+{
+  DBusMessageIter *array = data;
+  DBusMessageIter entry;
+  const char *name, *peer_name;
+
+  name = bus_connection_get_name (connection);
+  peer_name = bus_connection_get_name (peer);
+
+  if (!dbus_message_iter_open_container (array, DBUS_TYPE_STRUCT, NULL,
+                                         &entry))
+    return FALSE;
+
+  if (!dbus_message_iter_append_basic (&entry, DBUS_TYPE_STRING, &name) ||
+      !dbus_message_iter_append_basic (&entry, DBUS_TYPE_STRING, &peer_name))
+    {
+      dbus_message_iter_abandon_container (array, &entry);
+      return FALSE;
+    }
+
+  return dbus_message_iter_close_container (array, &entry);
+}
+
+/* The channels themselves are sockets the clients hold; all we know
+ * is which pairs have one */
+static dbus_bool_t
+write_channels_record (BusContext *context,
+                       DBusSocket  sock,
+                       DBusError  *error)
+{
+  DBusMessage *record;
+  DBusMessageIter iter, array;
+  dbus_bool_t retval = FALSE;
+
+  record = record_new ("Channels");
+  if (record == NULL)
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  dbus_message_iter_init_append (record, &iter);
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(ss)",
+                                         &array))
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  if (!bus_connections_foreach_direct_channel (bus_context_get_connections (context),
+                                               append_direct_channel, &array))
+    {
+      dbus_message_iter_abandon_container (&iter, &array);
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &array))
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  retval = write_record (sock, record, NULL, 0, error);
+
+ out:
+  dbus_message_unref (record);
+  return retval;
+}
+
+static dbus_bool_t
+write_done_record (DBusSocket  sock,
+                   DBusError  *error)
+{
+  DBusMessage *record;
+  dbus_bool_t retval;
+
+  record = record_new ("Done");
+  if (record == NULL)
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  retval = write_record (sock, record, NULL, 0, error);
+  dbus_message_unref (record);
+  return retval;
+}
+
+/* Monitors are not handed over: they go away with us, like they
+ * would if the bus was restarted the usual way. So do clients that
+ * have not finished authenticating. */
+static dbus_bool_t
+connection_is_handed_over (DBusConnection *connection)
+{
+  return dbus_connection_get_is_connected (connection) &&
+    dbus_connection_get_is_authenticated (connection) &&
+    !bus_connection_is_monitor (connection);
+}
+
+static dbus_bool_t
+write_state (BusContext *context,
+             DBusList  **connections,
+             DBusSocket  sock,
+             DBusError  *error)
+{
+  DBusList **servers;
+  DBusList *link;
+
+  if (!write_bus_record (context, sock, error))
+    return FALSE;
+
+  servers = bus_context_get_servers (context);
+  for (link = _dbus_list_get_first_link (servers);
+       link != NULL;
+       link = _dbus_list_get_next_link (servers, link))
+    {
+      if (!write_listener_record (link->data, sock, error))
+        return FALSE;
+    }
+
+  for (link = _dbus_list_get_first_link (connections);
+       link != NULL;
+       link = _dbus_list_get_next_link (connections, link))
+    {
+      DBusConnection *connection = link->data;
+
+      if (!connection_is_handed_over (connection))
+        {
+          _dbus_verbose ("Not handing over connection %p\n", connection);
+          continue;
+        }
+
+      if (!write_connection_record (connection, sock, error))
+        return FALSE;
+    }
+
+  return write_names_record (context, sock, error) &&
+    write_replies_record (context, sock, error) &&
+    write_channels_record (context, sock, error) &&
+    write_done_record (sock, error);
+}
+
+static dbus_bool_t
+collect_connection (DBusConnection *connection,
+                    void           *data)
+{
+  DBusList **connections = data;
+
+  if (!_dbus_list_append (connections, connection))
+    return FALSE;
+
+  dbus_connection_ref (connection);
+  return TRUE;
+}
+
+static void
+unref_connections (DBusList **connections)
+{
+  DBusConnection *connection;
+
+  while ((connection = _dbus_list_pop_first (connections)) != NULL)
+    dbus_connection_unref (connection);
+}
+
+/* Gets everything that has been read routed, and everything that was
+ * routed written, so that what is left is only state. Nothing is read
+ * from here on, so that stays true. */
+static dbus_bool_t
+quiesce (BusContext *context,
+         DBusList  **connections,
+         DBusError  *error)
+{
+  BusActivation *activation = bus_context_get_activation (context);
+  DBusList *link;
+  long start_tv_sec, start_tv_usec, tv_sec, tv_usec;
+  int remaining;
+
+  for (link = _dbus_list_get_first_link (connections);
+       link != NULL;
+       link = _dbus_list_get_next_link (connections, link))
+    {
+      DBusConnection *connection = link->data;
+      DBusDispatchStatus status;
+
+      while ((status = dbus_connection_dispatch (connection)) !=
+             DBUS_DISPATCH_COMPLETE)
+        {
+          if (status == DBUS_DISPATCH_NEED_MEMORY)
+            _dbus_wait_for_memory ();
+        }
+    }
+
+  if (bus_activation_get_n_pending_activations (activation) > 0)
+    {
+      dbus_set_error (error, DBUS_ERROR_FAILED,
+                      "A service is being activated");
+      return FALSE;
+    }
+
+  _dbus_get_monotonic_time (&start_tv_sec, &start_tv_usec);
+
+  for (link = _dbus_list_get_first_link (connections);
+       link != NULL;
+       link = _dbus_list_get_next_link (connections, link))
+    {
+      DBusConnection *connection = link->data;
+
+      if (!connection_is_handed_over (connection))
+        continue;
+
+      _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+      remaining = HANDOFF_FLUSH_TIMEOUT -
+        (int) ELAPSED_MILLISECONDS_SINCE (start_tv_sec, start_tv_usec,
+                                          tv_sec, tv_usec);
+
+      if (!_dbus_connection_flush_outgoing (connection, MAX (remaining, 0)))
+        {
+          dbus_set_error (error, DBUS_ERROR_TIMEOUT,
+                          "Connection %s is not reading its messages",
+                          bus_connection_get_loginfo (connection));
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+static pid_t
+spawn_new_instance (DBusSocket  child_end,
+                    DBusError  *error)
+{
+  char **argv;
+  char fd_arg[64];
+  int argc, i;
+  pid_t pid;
+
+  for (argc = 0; saved_argv[argc] != NULL; argc++)
+    ;
+
+  /* built before forking, since the child may only exec */
+  argv = dbus_new0 (char *, argc + 2);
+  if (argv == NULL)
+    {
+      BUS_SET_OOM (error);
+      return -1;
+    }
+
+  for (i = 0; i < argc; i++)
+    argv[i] = saved_argv[i];
+
+  snprintf (fd_arg, sizeof (fd_arg), "--handoff-fd=%d", child_end.fd);
+  argv[argc] = fd_arg;
+
+  pid = fork ();
+
+  if (pid < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to fork: %s", _dbus_strerror (errno));
+      dbus_free (argv);
+      return -1;
+    }
+
+  if (pid == 0)
+    {
+      static const char message[] = "Unable to run the new instance\n";
+
+      if (fcntl (child_end.fd, F_SETFD, 0) == 0)
+        execvp (argv[0], argv);
+
+      if (write (STDERR_FILENO, message, strlen (message)) < 0)
+        {
+          /* ignore failure to write out a warning */
+        }
+
+      _exit (1);
+    }
+
+  dbus_free (argv);
+  return pid;
+}
+
+static dbus_bool_t
+wait_for_ack (DBusSocket  sock,
+              DBusError  *error)
+{
+  DBusPollFD poll_fd;
+  DBusString ack;
+  int n;
+
+  poll_fd.fd = _dbus_socket_get_pollable (sock);
+  poll_fd.events = _DBUS_POLLIN;
+  poll_fd.revents = 0;
+
+  do
+    n = _dbus_poll (&poll_fd, 1, HANDOFF_ACK_TIMEOUT);
+  while (n < 0 && errno == EINTR);
+
+  if (n == 0)
+    {
+      dbus_set_error (error, DBUS_ERROR_TIMEOUT,
+                      "The new instance did not take over in time");
+      return FALSE;
+    }
+
+  if (!_dbus_string_init (&ack))
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  n = _dbus_read_socket (sock, &ack, 1);
+
+  if (n != 1 || _dbus_string_get_byte (&ack, 0) != HANDOFF_ACK)
+    {
+      dbus_set_error (error, DBUS_ERROR_FAILED,
+                      "The new instance failed to take over");
+      _dbus_string_free (&ack);
+      return FALSE;
+    }
+
+  _dbus_string_free (&ack);
+  return TRUE;
+}
+
+/* Connects to the service manager's notification socket, if there
+ * is one. Returns #FALSE if we are run by systemd but can't tell it
+ * that the main process is about to change. */
+static dbus_bool_t
+open_notify_socket (DBusSocket *sock_p,
+                    DBusError  *error)
+{
+  const char *path = _dbus_getenv ("NOTIFY_SOCKET");
+  struct sockaddr_un addr;
+  size_t path_len;
+  DBusSocket sock = DBUS_SOCKET_INIT;
+
+  if (path == NULL)
+    {
+      /* systemd sets INVOCATION_ID for everything it runs */
+      if (_dbus_getenv ("INVOCATION_ID") != NULL)
+        {
+          dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                          "Run by systemd without a notification socket, "
+                          "so it would stop the service when this process "
+                          "exits; set NotifyAccess=main in the unit");
+          return FALSE;
+        }
+
+      *sock_p = sock;
+      return TRUE;
+    }
+
+  path_len = strlen (path);
+
+  if ((path[0] != '/' && path[0] != '@') || path_len < 2 ||
+      path_len >= sizeof (addr.sun_path))
+    {
+      dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                      "Unsupported NOTIFY_SOCKET \"%s\"", path);
+      return FALSE;
+    }
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  memcpy (addr.sun_path, path, path_len);
+
+  /* abstract socket */
+  if (path[0] == '@')
+    addr.sun_path[0] = '\0';
+
+  sock.fd = socket (AF_UNIX, SOCK_DGRAM, 0);
+
+  if (sock.fd < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to create notification socket: %s",
+                      _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  _dbus_fd_set_close_on_exec (sock.fd);
+
+  if (connect (sock.fd, (struct sockaddr *) &addr,
+               offsetof (struct sockaddr_un, sun_path) + path_len) < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to connect to NOTIFY_SOCKET \"%s\": %s",
+                      path, _dbus_strerror (errno));
+      _dbus_close_socket (sock, NULL);
+      return FALSE;
+    }
+
+  *sock_p = sock;
+  return TRUE;
+}
+
+static dbus_bool_t
+notify_main_pid (DBusSocket  sock,
+                 pid_t       pid,
+                 DBusError  *error)
+{
+  char buf[64];
+  ssize_t n;
+
+  snprintf (buf, sizeof (buf), "MAINPID=%lu\n", (unsigned long) pid);
+
+  do
+    n = send (sock.fd, buf, strlen (buf), MSG_NOSIGNAL);
+  while (n < 0 && errno == EINTR);
+
+  if (n < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to notify the service manager: %s",
+                      _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Only returns on failure. Takes ownership of notify. */
+static void
+hand_over (BusContext *context,
+           DBusSocket  notify,
+           DBusError  *error)
+{
+  DBusList *connections = NULL;
+  DBusSocket fds[2] = { DBUS_SOCKET_INIT, DBUS_SOCKET_INIT };
+  pid_t pid = -1;
+
+  bus_connections_foreach (bus_context_get_connections (context),
+                           collect_connection, &connections);
+
+  if (!quiesce (context, &connections, error))
+    goto failed;
+
+  if (!_dbus_socketpair (&fds[0], &fds[1], TRUE, error))
+    goto failed;
+
+  pid = spawn_new_instance (fds[1], error);
+  if (pid < 0)
+    goto failed;
+
+  _dbus_close_socket (fds[1], NULL);
+  _dbus_socket_invalidate (&fds[1]);
+
+  if (!write_state (context, &connections, fds[0], error) ||
+      !wait_for_ack (fds[0], error))
+    goto failed;
+
+  if (_dbus_socket_is_valid (notify))
+    {
+      DBusError notify_error = DBUS_ERROR_INIT;
+
+      /* Too late to go back: the new instance has taken over */
+      if (!notify_main_pid (notify, pid, &notify_error))
+        {
+          bus_context_log (context, DBUS_SYSTEM_LOG_WARNING,
+                           "%s", notify_error.message);
+          dbus_error_free (&notify_error);
+        }
+    }
+
+  bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
+                   "Handed over to new instance, pid %ld", (long) pid);
+
+  /* Leave without closing or unlinking anything: the sockets and the
+   * pid file are the new instance's now */
+  _exit (0);
+
+ failed:
+  if (pid > 0)
+    {
+      kill (pid, SIGKILL);
+      while (waitpid (pid, NULL, 0) < 0 && errno == EINTR)
+        ;
+    }
+
+  if (_dbus_socket_is_valid (fds[0]))
+    _dbus_close_socket (fds[0], NULL);
+  if (_dbus_socket_is_valid (fds[1]))
+    _dbus_close_socket (fds[1], NULL);
+  if (_dbus_socket_is_valid (notify))
+    _dbus_close_socket (notify, NULL);
+
+  unref_connections (&connections);
+}
+
+static dbus_bool_t
+incomplete_connection_is_authenticating (DBusConnection *connection,
+                                         void           *data)
+{
+  dbus_bool_t *authenticating = data;
+
+  if (!bus_connection_is_active (connection) &&
+      dbus_connection_get_is_connected (connection) &&
+      !dbus_connection_get_is_authenticated (connection))
+    {
+      *authenticating = TRUE;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+attempt_free (HandoffAttempt *attempt)
+{
+  _dbus_loop_remove_timeout (bus_context_get_loop (attempt->context),
+                             attempt->timeout);
+  _dbus_timeout_unref (attempt->timeout);
+  bus_context_unref (attempt->context);
+
+  if (_dbus_socket_is_valid (attempt->notify))
+    _dbus_close_socket (attempt->notify, NULL);
+
+  dbus_free (attempt);
+}
+
+static void
+resume (BusContext *context)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  int io_threads = bus_context_get_io_threads (context);
+
+  if (io_threads > 0 &&
+      !bus_connections_start_io_workers (bus_context_get_connections (context),
+                                         io_threads, &error))
+    {
+      bus_context_log (context, DBUS_SYSTEM_LOG_WARNING,
+                       "Unable to restart I/O threads: %s", error.message);
+      dbus_error_free (&error);
+    }
+
+  bus_context_set_accepting (context, TRUE);
+}
+
+static dbus_bool_t
+attempt_timeout_cb (void *data)
+{
+  HandoffAttempt *attempt = data;
+  BusContext *context = attempt->context;
+  DBusError error = DBUS_ERROR_INIT;
+  DBusSocket notify;
+  dbus_bool_t authenticating = FALSE;
+  dbus_bool_t activating;
+
+  bus_connections_foreach (bus_context_get_connections (context),
+                           incomplete_connection_is_authenticating,
+                           &authenticating);
+  activating =
+    bus_activation_get_n_pending_activations (bus_context_get_activation (context)) > 0;
+
+  if ((authenticating || activating) &&
+      elapsed_milliseconds (attempt) < HANDOFF_SETTLE_TIMEOUT)
+    return TRUE;
+
+  bus_context_ref (context);
+  notify = attempt->notify;
+  _dbus_socket_invalidate (&attempt->notify);
+  attempt_free (attempt);
+  current_attempt = NULL;
+
+  /* clients still authenticating will have to connect again, but an
+   * activation can't be picked up where it was */
+  if (activating)
+    {
+      dbus_set_error (&error, DBUS_ERROR_TIMEOUT,
+                      "A service is still being activated");
+
+      if (_dbus_socket_is_valid (notify))
+        _dbus_close_socket (notify, NULL);
+    }
+  else
+    {
+      hand_over (context, notify, &error);
+    }
+
+  _DBUS_ASSERT_ERROR_IS_SET (&error);
+  bus_context_log (context, DBUS_SYSTEM_LOG_WARNING,
+                   "Unable to restart: %s", error.message);
+  dbus_error_free (&error);
+
+  resume (context);
+  bus_context_unref (context);
+  return TRUE;
+}
+
+/**
+ * Starts handing the bus over to a new instance of the daemon, run
+ * with the command line saved by bus_handoff_save_argv(). This
+ * returns straight away; if all goes well the process exits soon
+ * after, and otherwise the bus carries on as before.
+ *
+ * @param context the bus context
+ */
+void
+bus_handoff_start (BusContext *context)
+{
+  HandoffAttempt *attempt;
+  DBusSocket notify;
+  DBusError error = DBUS_ERROR_INIT;
+
+  if (current_attempt != NULL)
+    return;
+
+  if (saved_argv == NULL)
+    {
+      bus_context_log (context, DBUS_SYSTEM_LOG_WARNING,
+                       "Unable to restart: command line unknown");
+      return;
+    }
+
+  if (!open_notify_socket (&notify, &error))
+    {
+      bus_context_log (context, DBUS_SYSTEM_LOG_WARNING,
+                       "Unable to restart: %s", error.message);
+      dbus_error_free (&error);
+      return;
+    }
+
+  attempt = dbus_new0 (HandoffAttempt, 1);
+  if (attempt == NULL)
+    goto oom;
+
+  attempt->timeout = _dbus_timeout_new (HANDOFF_POLL_INTERVAL,
+                                        attempt_timeout_cb, attempt, NULL);
+  if (attempt->timeout == NULL)
+    {
+      dbus_free (attempt);
+      goto oom;
+    }
+
+  if (!_dbus_loop_add_timeout (bus_context_get_loop (context),
+                               attempt->timeout))
+    {
+      _dbus_timeout_unref (attempt->timeout);
+      dbus_free (attempt);
+      goto oom;
+    }
+
+  attempt->context = bus_context_ref (context);
+  attempt->notify = notify;
+  _dbus_get_monotonic_time (&attempt->start_tv_sec, &attempt->start_tv_usec);
+  current_attempt = attempt;
+
+  bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
+                   "Restarting, no longer accepting connections");
+
+  /* new clients wait in the listen backlog for the new instance, and
+   * the state we hand over must not change under us */
+  bus_context_set_accepting (context, FALSE);
+  bus_connections_stop_io_workers (bus_context_get_connections (context));
+  return;
+
+ oom:
+  if (_dbus_socket_is_valid (notify))
+    _dbus_close_socket (notify, NULL);
+
+  bus_context_log (context, DBUS_SYSTEM_LOG_WARNING,
+                   "Unable to restart: out of memory");
+}
+
+/* The instance taking over */
+
+static dbus_bool_t
+take_fds (BusHandoff  *handoff,
+          int          n_fds,
+          int        **fds_p,
+          DBusError   *error)
+{
+  if (n_fds < 0 || handoff->n_fds - handoff->n_fds_taken < n_fds)
+    {
+      dbus_set_error (error, DBUS_ERROR_INCONSISTENT_MESSAGE,
+                      "Handed over state refers to missing sockets");
+      return FALSE;
+    }
+
+  *fds_p = handoff->fds + handoff->n_fds_taken;
+  handoff->n_fds_taken += n_fds;
+  return TRUE;
+}
+
+static dbus_bool_t
+read_bus_record (BusHandoff  *handoff,
+                 DBusMessage *record,
+                 DBusError   *error)
+{
+  dbus_uint32_t version;
+  const char *uuid;
+  dbus_int32_t major, minor;
+  DBusString str;
+
+  if (!dbus_message_get_args (record, error,
+                              DBUS_TYPE_UINT32, &version,
+                              DBUS_TYPE_STRING, &uuid,
+                              DBUS_TYPE_INT32, &major,
+                              DBUS_TYPE_INT32, &minor,
+                              DBUS_TYPE_INVALID))
+    return FALSE;
+
+  if (version != HANDOFF_VERSION)
+    {
+      dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                      "Cannot take over from version %u of the hand-off",
+                      version);
+      return FALSE;
+    }
+
+  _dbus_string_init_const (&str, uuid);
+  if (!_dbus_uuid_decode (&str, &handoff->uuid))
+    {
+      dbus_set_error (error, DBUS_ERROR_INCONSISTENT_MESSAGE,
+                      "Invalid bus id \"%s\"", uuid);
+      return FALSE;
+    }
+
+  handoff->next_major = major;
+  handoff->next_minor = minor;
+  return TRUE;
+}
+
+static dbus_bool_t
+read_listener_record (BusHandoff  *handoff,
+                      DBusMessage *record,
+                      DBusError   *error)
+{
+  const char *address, *guid;
+  dbus_uint32_t n_fds;
+  DBusSocket *sockets;
+  DBusServer *server;
+  DBusString str;
+  int *fds;
+  unsigned int i;
+
+  if (!dbus_message_get_args (record, error,
+                              DBUS_TYPE_STRING, &address,
+                              DBUS_TYPE_STRING, &guid,
+                              DBUS_TYPE_UINT32, &n_fds,
+                              DBUS_TYPE_INVALID))
+    return FALSE;
+
+  if (n_fds == 0 || !take_fds (handoff, n_fds, &fds, error))
+    {
+      if (!dbus_error_is_set (error))
+        dbus_set_error (error, DBUS_ERROR_INCONSISTENT_MESSAGE,
+                        "No sockets handed over for \"%s\"", address);
+      return FALSE;
+    }
+
+  sockets = dbus_new (DBusSocket, n_fds);
+  if (sockets == NULL)
+    {
+      BUS_SET_OOM (error);
+      handoff->n_fds_taken -= n_fds;
+      return FALSE;
+    }
+
+  for (i = 0; i < n_fds; i++)
+    sockets[i].fd = fds[i];
+
+  _dbus_string_init_const (&str, address);
+  server = _dbus_server_new_for_socket (sockets, n_fds, &str, NULL, error);
+  dbus_free (sockets);
+
+  if (server == NULL)
+    {
+      /* the fds are still ours to close */
+      handoff->n_fds_taken -= n_fds;
+      return FALSE;
+    }
+
+  _dbus_string_init_const (&str, guid);
+  if (!_dbus_server_set_guid (server, &str) ||
+      !_dbus_list_append (&handoff->servers, server))
+    {
+      BUS_SET_OOM (error);
+      dbus_server_disconnect (server);
+      dbus_server_unref (server);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Reads a whole record and any fds that came with it */
+static DBusMessage *
+read_record (BusHandoff  *handoff,
+             DBusString  *buffer,
+             DBusError   *error)
+{
+  DBusMessage *record;
+
+  while (TRUE)
+    {
+      int needed, n_fds, n;
+
+      needed = dbus_message_demarshal_bytes_needed (_dbus_string_get_const_data (buffer),
+                                                    _dbus_string_get_length (buffer));
+      if (needed < 0)
+        {
+          dbus_set_error (error, DBUS_ERROR_INCONSISTENT_MESSAGE,
+                          "Invalid record from the previous instance");
+          return NULL;
+        }
+
+      if (needed > 0 && _dbus_string_get_length (buffer) >= needed)
+        {
+          record = dbus_message_demarshal (_dbus_string_get_const_data (buffer),
+                                           needed, error);
+          if (record == NULL)
+            return NULL;
+
+          _dbus_string_delete (buffer, 0, needed);
+
+          if (!dbus_message_has_interface (record, HANDOFF_INTERFACE))
+            {
+              dbus_set_error (error, DBUS_ERROR_INCONSISTENT_MESSAGE,
+                              "Invalid record from the previous instance");
+              dbus_message_unref (record);
+              return NULL;
+            }
+
+          return record;
+        }
+
+      if (handoff->n_fds_allocated - handoff->n_fds < HANDOFF_MAX_FDS_PER_WRITE)
+        {
+          int *fds;
+
+          fds = dbus_realloc (handoff->fds,
+                              sizeof (int) * (handoff->n_fds_allocated +
+                                              HANDOFF_MAX_FDS_PER_WRITE));
+          if (fds == NULL)
+            {
+              BUS_SET_OOM (error);
+              return NULL;
+            }
+
+          handoff->fds = fds;
+          handoff->n_fds_allocated += HANDOFF_MAX_FDS_PER_WRITE;
+        }
+
+      n_fds = HANDOFF_MAX_FDS_PER_WRITE;
+      n = _dbus_read_socket_with_unix_fds (handoff->socket, buffer, 4096,
+                                           handoff->fds + handoff->n_fds,
+                                           &n_fds);
+      if (n < 0)
+        {
+          dbus_set_error (error, _dbus_error_from_errno (errno),
+                          "Failed to read from the previous instance: %s",
+                          _dbus_strerror (errno));
+          return NULL;
+        }
+
+      if (n == 0)
+        {
+          dbus_set_error (error, DBUS_ERROR_NO_REPLY,
+                          "The previous instance went away");
+          return NULL;
+        }
+
+      handoff->n_fds += n_fds;
+    }
+}
+
+/**
+ * Reads the state a previous instance of the daemon hands over. The
+ * listening sockets are picked up by bus_context_new(), and the
+ * rest by bus_handoff_finish() once the bus is set up.
+ *
+ * @param fd the socket to the previous instance
+ * @param error set on failure
+ * @returns the state, or #NULL on failure
+ */
+BusHandoff *
+bus_handoff_receive (int        fd,
+                     DBusError *error)
+{
+  BusHandoff *handoff;
+  DBusString buffer;
+  DBusMessage *record;
+  dbus_bool_t seen_bus = FALSE;
+
+  handoff = dbus_new0 (BusHandoff, 1);
+  if (handoff == NULL)
+    {
+      BUS_SET_OOM (error);
+      return NULL;
+    }
+
+  /* so that activated services don't inherit it */
+  _dbus_fd_set_close_on_exec (fd);
+  handoff->socket.fd = fd;
+  handoff->previous_pid = getppid ();
+
+  if (!_dbus_string_init (&buffer))
+    {
+      BUS_SET_OOM (error);
+      bus_handoff_free (handoff);
+      return NULL;
+    }
+
+  while ((record = read_record (handoff, &buffer, error)) != NULL)
+    {
+      const char *member = dbus_message_get_member (record);
+      dbus_bool_t ok = TRUE;
+
+      if (!seen_bus)
+        {
+          ok = strcmp (member, "Bus") == 0 &&
+            read_bus_record (handoff, record, error);
+          seen_bus = TRUE;
+        }
+      else if (strcmp (member, "Listener") == 0)
+        {
+          ok = read_listener_record (handoff, record, error);
+        }
+      else if (strcmp (member, "Done") == 0)
+        {
+          dbus_message_unref (record);
+          break;
+        }
+      else if (!_dbus_list_append (&handoff->records, record))
+        {
+          BUS_SET_OOM (error);
+          ok = FALSE;
+        }
+      else
+        {
+          /* kept for bus_handoff_finish() */
+          record = NULL;
+        }
+
+      if (record != NULL)
+        dbus_message_unref (record);
+
+      if (!ok)
+        {
+          if (!dbus_error_is_set (error))
+            dbus_set_error (error, DBUS_ERROR_INCONSISTENT_MESSAGE,
+                            "Hand-off did not start with the bus");
+          break;
+        }
+    }
+
+  _dbus_string_free (&buffer);
+
+  if (dbus_error_is_set (error))
+    {
+      bus_handoff_free (handoff);
+      return NULL;
+    }
+
+  return handoff;
+}
+
+void
+bus_handoff_free (BusHandoff *handoff)
+{
+  DBusServer *server;
+  DBusMessage *record;
+  int i;
+
+  while ((server = _dbus_list_pop_first (&handoff->servers)) != NULL)
+    {
+      dbus_server_disconnect (server);
+      dbus_server_unref (server);
+    }
+
+  while ((record = _dbus_list_pop_first (&handoff->records)) != NULL)
+    dbus_message_unref (record);
+
+  for (i = handoff->n_fds_taken; i < handoff->n_fds; i++)
+    _dbus_close (handoff->fds[i], NULL);
+
+  dbus_free (handoff->fds);
+
+  if (_dbus_socket_is_valid (handoff->socket))
+    _dbus_close_socket (handoff->socket, NULL);
+
+  dbus_free (handoff);
+}
+
+const DBusGUID *
+bus_handoff_get_uuid (BusHandoff *handoff)
+{
+  return &handoff->uuid;
+}
+
+/**
+ * Takes the next of the servers the previous instance was listening
+ * on, in the order it listened on them.
+ *
+ * @returns the server, or #NULL when there are no more
+ */
+DBusServer *
+bus_handoff_take_server (BusHandoff *handoff)
+{
+  return _dbus_list_pop_first (&handoff->servers);
+}
+
+static dbus_bool_t
+restore_match_rules (DBusConnection  *connection,
+                     char           **rules,
+                     int              n_rules,
+                     DBusError       *error)
+{
+  BusMatchmaker *matchmaker = bus_connection_get_matchmaker (connection);
+  int i;
+
+  for (i = 0; i < n_rules; i++)
+    {
+      BusMatchRule *rule;
+      DBusString str;
+
+      _dbus_string_init_const (&str, rules[i]);
+      rule = bus_match_rule_parse (connection, &str, error);
+      if (rule == NULL)
+        {
+          if (dbus_error_has_name (error, DBUS_ERROR_NO_MEMORY))
+            return FALSE;
+
+          _dbus_verbose ("Dropping match rule \"%s\": %s\n", rules[i],
+                         error->message);
+          dbus_error_free (error);
+          continue;
+        }
+
+      /* this adds it to the connection's list too */
+      if (!bus_matchmaker_add_rule (matchmaker, rule))
+        {
+          bus_match_rule_unref (rule);
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      bus_match_rule_unref (rule);
+    }
+
+  return TRUE;
+}
+
+static DBusCredentials *
+identity_new (dbus_int64_t         uid,
+              dbus_int64_t         pid,
+              const char          *label,
+              const unsigned char *adt,
+              int                  adt_size)
+{
+  DBusCredentials *identity;
+
+  identity = _dbus_credentials_new ();
+  if (identity == NULL)
+    return NULL;
+
+  if ((uid >= 0 && !_dbus_credentials_add_unix_uid (identity, uid)) ||
+      (pid >= 0 && !_dbus_credentials_add_pid (identity, pid)) ||
+      (label[0] != '\0' &&
+       !_dbus_credentials_add_linux_security_label (identity, label)) ||
+      (adt_size > 0 &&
+       !_dbus_credentials_add_adt_audit_data (identity, (void *) adt,
+                                              adt_size)))
+    {
+      _dbus_credentials_unref (identity);
+      return NULL;
+    }
+
+  return identity;
+}
+
+static dbus_bool_t
+restore_connection (BusHandoff       *handoff,
+                    BusContext       *context,
+                    DBusMessage      *record,
+                    const DBusString *guid,
+                    BusTransaction   *transaction,
+                    DBusError        *error)
+{
+  DBusConnection *connection = NULL;
+  DBusCredentials *identity;
+  DBusSocket sock;
+  DBusString str;
+  dbus_uint32_t n_pending_fds;
+  const char *name, *label;
+  const unsigned char *adt, *bytes;
+  dbus_int64_t uid, pid;
+  dbus_bool_t unix_fd, accepts_direct_channels;
+  int adt_size, n_bytes, n_rules;
+  char **rules = NULL;
+  int *fds;
+  unsigned int i;
+  dbus_bool_t retval = FALSE;
+
+  if (!dbus_message_get_args (record, error,
+                              DBUS_TYPE_UINT32, &n_pending_fds,
+                              DBUS_TYPE_STRING, &name,
+                              DBUS_TYPE_INT64, &uid,
+                              DBUS_TYPE_INT64, &pid,
+                              DBUS_TYPE_STRING, &label,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &adt, &adt_size,
+                              DBUS_TYPE_BOOLEAN, &unix_fd,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &bytes, &n_bytes,
+                              DBUS_TYPE_BOOLEAN, &accepts_direct_channels,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &rules, &n_rules,
+                              DBUS_TYPE_INVALID))
+    return FALSE;
+
+  if (!take_fds (handoff, n_pending_fds + 1, &fds, error))
+    goto out;
+
+  identity = identity_new (uid, pid, label, adt, adt_size);
+  if (identity == NULL)
+    {
+      /* pending fds are closed by bus_handoff_free() */
+      handoff->n_fds_taken -= n_pending_fds;
+      _dbus_close (fds[0], NULL);
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  sock.fd = fds[0];
+  connection = _dbus_connection_new_for_resumed_socket (sock, guid, identity,
+                                                        unix_fd);
+  _dbus_credentials_unref (identity);
+
+  if (connection == NULL ||
+      !bus_context_add_connection (context, connection))
+    {
+      handoff->n_fds_taken -= n_pending_fds;
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  _dbus_string_init_const_len (&str, (const char *) bytes, n_bytes);
+
+  /* If the new configuration won't have these clients, they have to
+   * go, but that is no reason to keep the old configuration for the
+   * others */
+  if (!_dbus_connection_inject_incoming (connection, &str, fds + 1,
+                                         n_pending_fds))
+    {
+      bus_context_log (context, DBUS_SYSTEM_LOG_WARNING,
+                       "Dropping client %s: could not restore partly read "
+                       "message", name[0] != '\0' ? name : "without a name");
+      for (i = 0; i < n_pending_fds; i++)
+        _dbus_close (fds[i + 1], NULL);
+      dbus_connection_close (connection);
+      retval = TRUE;
+      goto out;
+    }
+
+  if (!dbus_connection_get_is_authenticated (connection))
+    {
+      bus_context_log (context, DBUS_SYSTEM_LOG_WARNING,
+                       "Dropping client %s: no longer allowed to connect",
+                       name[0] != '\0' ? name : "without a name");
+      dbus_connection_close (connection);
+      retval = TRUE;
+      goto out;
+    }
+
+  /* it has not sent Hello yet, which it will to us */
+  if (name[0] == '\0')
+    {
+      retval = TRUE;
+      goto out;
+    }
+
+  _dbus_string_init_const (&str, name);
+
+  if (!bus_connection_complete (connection, &str, error))
+    goto out;
+
+  if (bus_registry_ensure (bus_context_get_registry (context), &str,
+                           connection, 0, transaction, error) == NULL)
+    goto out;
+
+  if (accepts_direct_channels)
+    bus_connection_set_accepts_direct_channels (connection);
+
+  retval = restore_match_rules (connection, rules, n_rules, error);
+
+ out:
+  if (!retval && connection != NULL)
+    dbus_connection_close (connection);
+  if (connection != NULL)
+    dbus_connection_unref (connection);
+  dbus_free_string_array (rules);
+  return retval;
+}
+
+static DBusConnection *
+lookup_connection (BusRegistry *registry,
+                   const char  *name)
+{
+  BusService *service;
+  DBusString str;
+
+  _dbus_string_init_const (&str, name);
+  service = bus_registry_lookup (registry, &str);
+
+  if (service == NULL)
+    return NULL;
+
+  return bus_service_get_primary_owners_connection (service);
+}
+
+static dbus_bool_t
+restore_names (BusContext     *context,
+               DBusMessage    *record,
+               BusTransaction *transaction,
+               DBusError      *error)
+{
+  BusRegistry *registry = bus_context_get_registry (context);
+  DBusMessageIter iter, array, entry, owners, owner;
+
+  if (!dbus_message_iter_init (record, &iter) ||
+      dbus_message_iter_get_arg_type (&iter) != DBUS_TYPE_ARRAY)
+    goto invalid;
+
+  dbus_message_iter_recurse (&iter, &array);
+
+  while (dbus_message_iter_get_arg_type (&array) == DBUS_TYPE_STRUCT)
+    {
+      BusService *service = NULL;
+      const char *name;
+      DBusString str;
+
+      dbus_message_iter_recurse (&array, &entry);
+      dbus_message_iter_get_basic (&entry, &name);
+      dbus_message_iter_next (&entry);
+      dbus_message_iter_recurse (&entry, &owners);
+
+      _dbus_string_init_const (&str, name);
+
+      while (dbus_message_iter_get_arg_type (&owners) == DBUS_TYPE_STRUCT)
+        {
+          DBusConnection *connection;
+          const char *owner_name;
+          dbus_uint32_t flags;
+
+          dbus_message_iter_recurse (&owners, &owner);
+          dbus_message_iter_get_basic (&owner, &owner_name);
+          dbus_message_iter_next (&owner);
+          dbus_message_iter_get_basic (&owner, &flags);
+
+          connection = lookup_connection (registry, owner_name);
+
+          /* dropped when it was restored */
+          if (connection == NULL)
+            {
+              dbus_message_iter_next (&owners);
+              continue;
+            }
+
+          if (service == NULL)
+            {
+              service = bus_registry_ensure (registry, &str, connection,
+                                             flags, transaction, error);
+              if (service == NULL)
+                return FALSE;
+            }
+          else if (!bus_service_add_owner (service, connection, flags,
+                                           transaction, error))
+            {
+              return FALSE;
+            }
+
+          dbus_message_iter_next (&owners);
+        }
+
+      dbus_message_iter_next (&array);
+    }
+
+  return TRUE;
+
+ invalid:
+  dbus_set_error (error, DBUS_ERROR_INCONSISTENT_MESSAGE,
+                  "Invalid names from the previous instance");
+  return FALSE;
+}
+
+static dbus_bool_t
+restore_replies (BusContext  *context,
+                 DBusMessage *record,
+                 DBusError   *error)
+{
+  BusRegistry *registry = bus_context_get_registry (context);
+  DBusMessageIter iter, array, entry;
+
+  if (!dbus_message_iter_init (record, &iter) ||
+      dbus_message_iter_get_arg_type (&iter) != DBUS_TYPE_ARRAY)
+    {
+      dbus_set_error (error, DBUS_ERROR_INCONSISTENT_MESSAGE,
+                      "Invalid replies from the previous instance");
+      return FALSE;
+    }
+
+  dbus_message_iter_recurse (&iter, &array);
+
+  while (dbus_message_iter_get_arg_type (&array) == DBUS_TYPE_STRUCT)
+    {
+      DBusConnection *will_get_reply, *will_send_reply;
+      const char *receiver, *replier;
+      dbus_uint32_t serial;
+      dbus_int64_t tv_sec, tv_usec;
+
+      dbus_message_iter_recurse (&array, &entry);
+      dbus_message_iter_get_basic (&entry, &receiver);
+      dbus_message_iter_next (&entry);
+      dbus_message_iter_get_basic (&entry, &replier);
+      dbus_message_iter_next (&entry);
+      dbus_message_iter_get_basic (&entry, &serial);
+      dbus_message_iter_next (&entry);
+      dbus_message_iter_get_basic (&entry, &tv_sec);
+      dbus_message_iter_next (&entry);
+      dbus_message_iter_get_basic (&entry, &tv_usec);
+
+      will_get_reply = lookup_connection (registry, receiver);
+      will_send_reply = replier[0] != '\0' ?
+        lookup_connection (registry, replier) : NULL;
+
+      /* A replier that was dropped is not going to reply, which is
+       * what a zero time stands for, see
+       * bus_connection_drop_pending_replies() */
+      if (will_send_reply == NULL)
+        tv_sec = tv_usec = 0;
+
+      if (will_get_reply != NULL &&
+          !bus_connections_restore_pending_reply (bus_context_get_connections (context),
+                                                  will_get_reply,
+                                                  will_send_reply,
+                                                  serial, tv_sec, tv_usec))
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      dbus_message_iter_next (&array);
+    }
+
+  return TRUE;
+}
+
+/* A client that was dropped closes its ends of its channels when its
+ * bus connection goes, so the other ends find out without our help */
+static dbus_bool_t
+restore_channels (BusContext  *context,
+                  DBusMessage *record,
+                  DBusError   *error)
+{
+  BusRegistry *registry = bus_context_get_registry (context);
+  DBusMessageIter iter, array, entry;
+
+  if (!dbus_message_iter_init (record, &iter) ||
+      dbus_message_iter_get_arg_type (&iter) != DBUS_TYPE_ARRAY)
+    {
+      dbus_set_error (error, DBUS_ERROR_INCONSISTENT_MESSAGE,
+                      "Invalid direct channels from the previous instance");
+      return FALSE;
+    }
+
+  dbus_message_iter_recurse (&iter, &array);
+
+  while (dbus_message_iter_get_arg_type (&array) == DBUS_TYPE_STRUCT)
+    {
+      DBusConnection *connection, *peer;
+      const char *name, *peer_name;
+
+      dbus_message_iter_recurse (&array, &entry);
+      dbus_message_iter_get_basic (&entry, &name);
+      dbus_message_iter_next (&entry);
+      dbus_message_iter_get_basic (&entry, &peer_name);
+
+      connection = lookup_connection (registry, name);
+      peer = lookup_connection (registry, peer_name);
+
+      if (connection != NULL && peer != NULL && connection != peer &&
+          !bus_connection_has_direct_channel (connection, peer) &&
+          !bus_connection_add_direct_channel (connection, peer))
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      dbus_message_iter_next (&array);
+    }
+
+  return TRUE;
+}
+
+static void
+own_socket_filenames (BusContext *context)
+{
+  DBusList **servers = bus_context_get_servers (context);
+  DBusList *link;
+
+  for (link = _dbus_list_get_first_link (servers);
+       link != NULL;
+       link = _dbus_list_get_next_link (servers, link))
+    {
+      DBusAddressEntry **entries;
+      const char *path;
+      char *address, *filename;
+      int n_entries;
+
+      address = dbus_server_get_address (link->data);
+      if (address == NULL)
+        continue;
+
+      if (dbus_parse_address (address, &entries, &n_entries, NULL))
+        {
+          if (n_entries == 1 &&
+              strcmp (dbus_address_entry_get_method (entries[0]), "unix") == 0 &&
+              (path = dbus_address_entry_get_value (entries[0], "path")) != NULL &&
+              (filename = _dbus_strdup (path)) != NULL)
+            _dbus_server_socket_own_filename (link->data, filename);
+
+          dbus_address_entries_free (entries);
+        }
+
+      dbus_free (address);
+    }
+}
+
+/**
+ * Takes over the clients of the previous instance, restoring what
+ * it knew about them, then tells it to go away. On failure, the
+ * previous instance carries on and we should just exit.
+ *
+ * @param handoff the state read by bus_handoff_receive()
+ * @param context the bus context created with it
+ * @param error set on failure
+ * @returns #FALSE on failure
+ */
+dbus_bool_t
+bus_handoff_finish (BusHandoff *handoff,
+                    BusContext *context,
+                    DBusError  *error)
+{
+  BusTransaction *transaction;
+  DBusMessage *record;
+  DBusString guid, ack;
+  DBusError io_error = DBUS_ERROR_INIT;
+  char ack_byte[2] = { HANDOFF_ACK, '\0' };
+  dbus_bool_t ok = TRUE;
+  int io_threads;
+
+  /* The guid a server sends its clients is only used during the auth
+   * conversation, which these clients are past */
+  if (!_dbus_string_init (&guid))
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  transaction = bus_transaction_new (context);
+  if (transaction == NULL ||
+      !bus_context_get_id (context, &guid))
+    {
+      if (transaction != NULL)
+        bus_transaction_cancel_and_free (transaction);
+      _dbus_string_free (&guid);
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  while (ok && (record = _dbus_list_pop_first (&handoff->records)) != NULL)
+    {
+      const char *member = dbus_message_get_member (record);
+
+      if (strcmp (member, "Connection") == 0)
+        ok = restore_connection (handoff, context, record, &guid,
+                                 transaction, error);
+      else if (strcmp (member, "Names") == 0)
+        ok = restore_names (context, record, transaction, error);
+      else if (strcmp (member, "Replies") == 0)
+        ok = restore_replies (context, record, error);
+      else if (strcmp (member, "Channels") == 0)
+        ok = restore_channels (context, record, error);
+      else
+        _dbus_verbose ("Ignoring hand-off record %s\n", member);
+
+      dbus_message_unref (record);
+    }
+
+  _dbus_string_free (&guid);
+
+  if (!ok)
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      bus_transaction_cancel_and_free (transaction);
+      return FALSE;
+    }
+
+  /* the clients already know all of this */
+  bus_transaction_discard_and_free (transaction);
+
+  bus_driver_set_unique_name_counter (handoff->next_major,
+                                      handoff->next_minor);
+
+  _dbus_string_init_const (&ack, ack_byte);
+  if (_dbus_write_socket (handoff->socket, &ack, 0, 1) != 1)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to tell the previous instance to exit: %s",
+                      _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  /* Everything from here on is ours */
+  _dbus_close_socket (handoff->socket, NULL);
+  _dbus_socket_invalidate (&handoff->socket);
+
+  own_socket_filenames (context);
+  bus_context_take_over_pid_file (context);
+
+  /* the configuration we were started with may be a different one */
+  bus_connections_check_direct_channels (bus_context_get_connections (context));
+
+  io_threads = bus_context_get_io_threads (context);
+  if (io_threads > 0 &&
+      !bus_connections_start_io_workers (bus_context_get_connections (context),
+                                         io_threads, &io_error))
+    {
+      bus_context_log (context, DBUS_SYSTEM_LOG_WARNING,
+                       "Unable to start I/O threads: %s", io_error.message);
+      dbus_error_free (&io_error);
+    }
+
+  bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
+                   "Took over from previous instance, pid %ld",
+                   (long) handoff->previous_pid);
+  return TRUE;
+}
+
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+
+#define HANDOFF_TEST_NAME "org.freedesktop.DBus.TestSuite.Handoff"
+#define HANDOFF_TEST_INTERFACE "org.freedesktop.TestSuite.Handoff"
+
+/* Runs both loops until the connection has a message, for up to a
+ * minute */
+static DBusMessage *
+handoff_test_pop (BusContext     *context,
+                  DBusConnection *connection)
+{
+  DBusMessage *message;
+  long start, now, usec;
+
+  _dbus_get_monotonic_time (&start, &usec);
+
+  while ((message = dbus_connection_pop_message (connection)) == NULL)
+    {
+      if (!dbus_connection_get_is_connected (connection))
+        _dbus_assert_not_reached ("client was disconnected");
+
+      bus_test_run_bus_loop (context, FALSE);
+      bus_test_run_clients_loop (FALSE);
+
+      _dbus_get_monotonic_time (&now, &usec);
+      if (now - start > 60)
+        _dbus_assert_not_reached ("nothing arrived from the bus");
+    }
+
+  return message;
+}
+
+static DBusMessage *
+handoff_test_call (BusContext     *context,
+                   DBusConnection *connection,
+                   const char     *method,
+                   int             first_arg_type,
+                   ...)
+{
+  DBusMessage *message;
+  dbus_uint32_t serial;
+  va_list args;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          method);
+  if (message == NULL)
+    _dbus_assert_not_reached ("no memory for a method call");
+
+  va_start (args, first_arg_type);
+  if (!dbus_message_append_args_valist (message, first_arg_type, args))
+    _dbus_assert_not_reached ("no memory for a method call");
+  va_end (args);
+
+  if (!dbus_connection_send (connection, message, &serial))
+    _dbus_assert_not_reached ("no memory to send a method call");
+
+  dbus_message_unref (message);
+
+  /* RequestName's NameAcquired comes before the reply */
+  while (dbus_message_is_signal ((message = handoff_test_pop (context,
+                                                              connection)),
+                                 DBUS_INTERFACE_DBUS, "NameAcquired"))
+    dbus_message_unref (message);
+
+  if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+      dbus_message_get_reply_serial (message) != serial)
+    {
+      _dbus_warn ("Unexpected reply to %s: %s\n", method,
+                  dbus_message_get_error_name (message) != NULL ?
+                  dbus_message_get_error_name (message) : "(not an error)");
+      _dbus_assert_not_reached ("bad reply from the bus");
+    }
+
+  return message;
+}
+
+static DBusConnection *
+handoff_test_connect (BusContext *context)
+{
+  DBusConnection *connection;
+  DBusMessage *message;
+  DBusError error = DBUS_ERROR_INIT;
+  const char *name;
+
+  connection = dbus_connection_open_private (bus_context_get_address (context),
+                                             &error);
+  if (connection == NULL)
+    {
+      _dbus_warn ("Could not connect to %s: %s\n",
+                  bus_context_get_address (context), error.message);
+      _dbus_assert_not_reached ("could not connect");
+    }
+
+  if (!bus_setup_debug_client (connection))
+    _dbus_assert_not_reached ("could not set up connection");
+
+  message = handoff_test_call (context, connection, "Hello",
+                               DBUS_TYPE_INVALID);
+
+  if (!dbus_message_get_args (message, &error,
+                              DBUS_TYPE_STRING, &name,
+                              DBUS_TYPE_INVALID) ||
+      !dbus_bus_set_unique_name (connection, name))
+    _dbus_assert_not_reached ("bad reply to Hello");
+
+  dbus_message_unref (message);
+
+  message = handoff_test_pop (context, connection);
+  if (!dbus_message_is_signal (message, DBUS_INTERFACE_DBUS, "NameAcquired"))
+    _dbus_assert_not_reached ("no NameAcquired after Hello");
+
+  dbus_message_unref (message);
+
+  return connection;
+}
+
+static void
+handoff_test_disconnect (DBusConnection *connection)
+{
+  dbus_connection_ref (connection);
+  dbus_connection_close (connection);
+
+  /* the Disconnected message runs the filter that forgets it */
+  while (dbus_connection_dispatch (connection) != DBUS_DISPATCH_COMPLETE)
+    ;
+
+  _dbus_assert (!bus_test_client_listed (connection));
+  dbus_connection_unref (connection);
+}
+
+static dbus_bool_t
+count_pending_reply (DBusConnection *will_get_reply,
+                     DBusConnection *will_send_reply,
+                     dbus_uint32_t   reply_serial,
+                     long            added_tv_sec,
+                     long            added_tv_usec,
+                     void           *data)
+{
+  int *n = data;
+
+  *n += 1;
+  return TRUE;
+}
+
+static int
+handoff_test_count_pending_replies (BusContext *context)
+{
+  int n = 0;
+
+  bus_connections_foreach_pending_reply (bus_context_get_connections (context),
+                                         count_pending_reply, &n);
+  return n;
+}
+
+/* The old instance leaves by _exit(), so its copies of the client
+ * sockets are never written to again. This one has to be freed, so
+ * point them somewhere harmless first. */
+static void
+handoff_test_forget_sockets (DBusList **connections,
+                             DBusSocket sink)
+{
+  DBusList *link;
+
+  for (link = _dbus_list_get_first_link (connections);
+       link != NULL;
+       link = _dbus_list_get_next_link (connections, link))
+    {
+      int fd;
+
+      if (dbus_connection_get_socket (link->data, &fd) &&
+          dup2 (sink.fd, fd) < 0)
+        _dbus_assert_not_reached ("could not replace a client socket");
+    }
+}
+
+/* Hands a bus with clients over to a second bus context in the same
+ * process, the way bus_handoff_start() and main() would across an
+ * exec, and checks that the clients carry on where they left off */
+dbus_bool_t
+bus_handoff_test (const DBusString *test_data_dir)
+{
+  BusContext *old_context, *context;
+  BusHandoff *handoff;
+  BusService *service;
+  DBusConnection *foo, *bar, *baz;
+  DBusList *connections = NULL;
+  DBusMessage *message, *call;
+  DBusSocket fds[2] = { DBUS_SOCKET_INIT, DBUS_SOCKET_INIT };
+  DBusSocket sink[2] = { DBUS_SOCKET_INIT, DBUS_SOCKET_INIT };
+  DBusString config_file, relative;
+  DBusError error = DBUS_ERROR_INIT;
+  const char *name = HANDOFF_TEST_NAME;
+  const char *rule = "type='signal',interface='" HANDOFF_TEST_INTERFACE "'";
+  const char *owner;
+  dbus_uint32_t flags = 0, result, uid;
+
+  if (!_dbus_string_init (&config_file) ||
+      !_dbus_string_copy (test_data_dir, 0, &config_file, 0))
+    _dbus_assert_not_reached ("no memory");
+
+  _dbus_string_init_const (&relative, "valid-config-files/handoff.conf");
+
+  if (!_dbus_concat_dir_and_file (&config_file, &relative))
+    _dbus_assert_not_reached ("no memory");
+
+  old_context = bus_context_new (&config_file, BUS_CONTEXT_FLAG_NONE,
+                                 NULL, NULL, NULL, NULL, &error);
+  if (old_context == NULL)
+    {
+      _dbus_warn ("Could not create bus: %s\n", error.message);
+      _dbus_assert_not_reached ("could not create bus");
+    }
+
+  /* foo owns a name, bar has a match rule, and foo is waiting for a
+   * reply from bar */
+  foo = handoff_test_connect (old_context);
+  bar = handoff_test_connect (old_context);
+
+  message = handoff_test_call (old_context, foo, "RequestName",
+                               DBUS_TYPE_STRING, &name,
+                               DBUS_TYPE_UINT32, &flags,
+                               DBUS_TYPE_INVALID);
+  if (!dbus_message_get_args (message, &error,
+                              DBUS_TYPE_UINT32, &result,
+                              DBUS_TYPE_INVALID) ||
+      result != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+    _dbus_assert_not_reached ("could not own the test name");
+  dbus_message_unref (message);
+
+  message = handoff_test_call (old_context, bar, "AddMatch",
+                               DBUS_TYPE_STRING, &rule,
+                               DBUS_TYPE_INVALID);
+  dbus_message_unref (message);
+
+  message = dbus_message_new_method_call (dbus_bus_get_unique_name (bar),
+                                          "/", HANDOFF_TEST_INTERFACE,
+                                          "Ping");
+  if (message == NULL || !dbus_connection_send (foo, message, NULL))
+    _dbus_assert_not_reached ("no memory for Ping");
+  dbus_message_unref (message);
+
+  call = handoff_test_pop (old_context, bar);
+  if (!dbus_message_is_method_call (call, HANDOFF_TEST_INTERFACE, "Ping"))
+    _dbus_assert_not_reached ("Ping did not arrive");
+
+  _dbus_assert (handoff_test_count_pending_replies (old_context) == 1);
+
+  /* what bus_handoff_start() and hand_over() do, minus the exec */
+  bus_context_set_accepting (old_context, FALSE);
+  bus_connections_foreach (bus_context_get_connections (old_context),
+                           collect_connection, &connections);
+
+  if (!quiesce (old_context, &connections, &error) ||
+      !_dbus_socketpair (&fds[0], &fds[1], TRUE, &error) ||
+      !_dbus_socketpair (&sink[0], &sink[1], TRUE, &error) ||
+      !write_state (old_context, &connections, fds[0], &error))
+    {
+      _dbus_warn ("Could not hand over: %s\n", error.message);
+      _dbus_assert_not_reached ("could not hand over");
+    }
+
+  /* neither instance has read this yet */
+  message = dbus_message_new_signal ("/", HANDOFF_TEST_INTERFACE, "InFlight");
+  if (message == NULL || !dbus_connection_send (foo, message, NULL))
+    _dbus_assert_not_reached ("no memory for InFlight");
+  dbus_message_unref (message);
+  dbus_connection_flush (foo);
+
+  /* what main() does in the new instance */
+  handoff = bus_handoff_receive (fds[1].fd, &error);
+  _dbus_socket_invalidate (&fds[1]);
+
+  if (handoff == NULL)
+    {
+      _dbus_warn ("Could not receive hand-off: %s\n", error.message);
+      _dbus_assert_not_reached ("could not receive hand-off");
+    }
+
+  context = bus_context_new (&config_file, BUS_CONTEXT_FLAG_NONE,
+                             NULL, NULL, NULL, handoff, &error);
+
+  if (context == NULL ||
+      !bus_handoff_finish (handoff, context, &error) ||
+      !wait_for_ack (fds[0], &error))
+    {
+      _dbus_warn ("Could not take over: %s\n", error.message);
+      _dbus_assert_not_reached ("could not take over");
+    }
+
+  bus_handoff_free (handoff);
+  _dbus_close_socket (fds[0], NULL);
+  _dbus_string_free (&config_file);
+
+  handoff_test_forget_sockets (&connections, sink[0]);
+  unref_connections (&connections);
+
+  /* the match rule, once, and the bytes nobody had read yet */
+  _dbus_string_init_const (&relative, dbus_bus_get_unique_name (bar));
+  service = bus_registry_lookup (bus_context_get_registry (context),
+                                 &relative);
+  _dbus_assert (service != NULL);
+  _dbus_assert (bus_connection_get_n_match_rules (
+      bus_service_get_primary_owners_connection (service)) == 1);
+
+  message = handoff_test_pop (context, bar);
+  if (!dbus_message_is_signal (message, HANDOFF_TEST_INTERFACE, "InFlight"))
+    _dbus_assert_not_reached ("in-flight signal was lost");
+  dbus_message_unref (message);
+
+  /* the name owner */
+  message = handoff_test_call (context, bar, "GetNameOwner",
+                               DBUS_TYPE_STRING, &name,
+                               DBUS_TYPE_INVALID);
+  if (!dbus_message_get_args (message, &error,
+                              DBUS_TYPE_STRING, &owner,
+                              DBUS_TYPE_INVALID) ||
+      strcmp (owner, dbus_bus_get_unique_name (foo)) != 0)
+    _dbus_assert_not_reached ("name owner was not handed over");
+  dbus_message_unref (message);
+
+  /* the identity */
+  owner = dbus_bus_get_unique_name (foo);
+  message = handoff_test_call (context, bar, "GetConnectionUnixUser",
+                               DBUS_TYPE_STRING, &owner,
+                               DBUS_TYPE_INVALID);
+  if (!dbus_message_get_args (message, &error,
+                              DBUS_TYPE_UINT32, &uid,
+                              DBUS_TYPE_INVALID) ||
+      uid != _dbus_getuid ())
+    _dbus_assert_not_reached ("identity was not handed over");
+  dbus_message_unref (message);
+
+  /* the expected reply */
+  _dbus_assert (handoff_test_count_pending_replies (context) == 1);
+
+  message = dbus_message_new_method_return (call);
+  if (message == NULL || !dbus_connection_send (bar, message, NULL))
+    _dbus_assert_not_reached ("no memory for the reply to Ping");
+  dbus_message_unref (message);
+
+  message = handoff_test_pop (context, foo);
+  if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+      dbus_message_get_reply_serial (message) != dbus_message_get_serial (call))
+    _dbus_assert_not_reached ("reply to Ping was not delivered");
+  dbus_message_unref (message);
+  dbus_message_unref (call);
+
+  _dbus_assert (handoff_test_count_pending_replies (context) == 0);
+
+  /* and new clients get unique names nobody has had */
+  baz = handoff_test_connect (context);
+  if (strcmp (dbus_bus_get_unique_name (baz),
+              dbus_bus_get_unique_name (foo)) == 0 ||
+      strcmp (dbus_bus_get_unique_name (baz),
+              dbus_bus_get_unique_name (bar)) == 0)
+    _dbus_assert_not_reached ("unique name was reused");
+
+  message = handoff_test_call (context, baz, "RequestName",
+                               DBUS_TYPE_STRING, &name,
+                               DBUS_TYPE_UINT32, &flags,
+                               DBUS_TYPE_INVALID);
+  if (!dbus_message_get_args (message, &error,
+                              DBUS_TYPE_UINT32, &result,
+                              DBUS_TYPE_INVALID) ||
+      result != DBUS_REQUEST_NAME_REPLY_IN_QUEUE)
+    _dbus_assert_not_reached ("name was not owned after the hand-off");
+  dbus_message_unref (message);
+
+  handoff_test_disconnect (baz);
+  handoff_test_disconnect (bar);
+  handoff_test_disconnect (foo);
+
+  bus_context_unref (old_context);
+  bus_context_unref (context);
+
+  _dbus_close_socket (sink[0], NULL);
+  _dbus_close_socket (sink[1], NULL);
+
+  return TRUE;
+}
+
+#endif /* DBUS_ENABLE_EMBEDDED_TESTS */
+
+#else /* !DBUS_UNIX */
+
+/* Handing over sockets needs SCM_RIGHTS, so there is nothing to take
+ * over from here */
+
+const DBusGUID *
+bus_handoff_get_uuid (BusHandoff *handoff)
+{
+  _dbus_assert_not_reached ("there is no hand-off on this platform");
+  return NULL;
+}
+
+DBusServer *
+bus_handoff_take_server (BusHandoff *handoff)
+{
+  return NULL;
+}
+
+#endif /* !DBUS_UNIX */
@@ -0,0 +1,44 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* handoff.h  Handing a running bus over to a new instance of the daemon
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef BUS_HANDOFF_H
+#define BUS_HANDOFF_H
+
+#include <dbus/dbus.h>
+#include <dbus/dbus-internals.h>
+#include "bus.h"
+
+/* The instance being replaced */
+void            bus_handoff_save_argv   (int          argc,
+                                         char       **argv);
+void            bus_handoff_start       (BusContext  *context);
+
+/* The instance taking over */
+BusHandoff*     bus_handoff_receive     (int          fd,
+                                         DBusError   *error);
+void            bus_handoff_free        (BusHandoff  *handoff);
+const DBusGUID* bus_handoff_get_uuid    (BusHandoff  *handoff);
+DBusServer*     bus_handoff_take_server (BusHandoff  *handoff);
+dbus_bool_t     bus_handoff_finish      (BusHandoff  *handoff,
+                                         BusContext  *context,
+                                         DBusError   *error);
+
+#endif /* BUS_HANDOFF_H */
@@ -0,0 +1,867 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* ioworkers.c  Threads that do connection I/O for the main loop
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "ioworkers.h"
+#include "utils.h"
+
+#include <dbus/dbus-connection-internal.h>
+#include <dbus/dbus-hash.h>
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-list.h>
+#include <dbus/dbus-sysdeps.h>
+#include <dbus/dbus-watch.h>
+
+#ifdef DBUS_UNIX
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dbus/dbus-threads-internal.h>
+#endif
+
+/* Reading and writing the sockets of a busy bus is most of what the
+ * daemon does, and it all happens on the one thread that also routes
+ * messages. With io_threads set, each completed connection is moved
+ * onto one of a few worker threads, which poll its socket and read and
+ * write messages with the connection lock held, as any multi-threaded
+ * libdbus application would. Routing stays on the main thread: when a
+ * worker has queued incoming messages, it hands the connection over
+ * and the main loop dispatches it. Messages the main thread sends only
+ * enable the write watch, so the worker does the writing too.
+ *
+ * Lock order is connection, then worker, then hand-over. Watches are
+ * added, removed and toggled with the connection lock held, by
+ * whichever thread changed them.
+ *
+ * A worker takes a reference to a connection while it handles one of
+ * its watches. The main thread may drop every other reference in the
+ * meantime, so the worker's can be the last one; finalizing there
+ * would run the bus's data slot free functions off the main thread.
+ * Instead the worker hands its references back through the hand-over
+ * list and the main loop drops them.
+ */
+
+#ifdef DBUS_UNIX
+
+typedef struct BusIOWorker BusIOWorker;
+
+typedef struct
+{
+  BusIOWorker *worker;
+  DBusConnection *connection;
+} BusIOBinding;
+
+typedef struct
+{
+  DBusWatch *watch;
+  unsigned int flags;
+  unsigned int enabled : 1;
+} BusIOWatch;
+
+/* A connection has a read and a write watch, both on the same fd */
+#define MAX_WATCHES_PER_SOCKET 2
+
+typedef struct
+{
+  int fd;
+  BusIOBinding *binding;
+  int n_watches;
+  BusIOWatch watches[MAX_WATCHES_PER_SOCKET];
+} BusIOSocket;
+
+typedef struct
+{
+  DBusConnection *connection;
+  DBusWatch *watch;
+  BusIOBinding *binding;
+  unsigned int condition;
+} BusIOEvent;
+
+struct BusIOWorker
+{
+  BusIOWorkers *workers;    /**< set before the thread starts */
+  DBusCMutex *lock;         /**< protects everything below */
+  DBusHashTable *sockets;   /**< fd -> BusIOSocket */
+  DBusSocket wakeup[2];     /**< written to interrupt poll() */
+  DBusPollFD *fds;          /**< wakeup[0], then sockets with enabled watches */
+  int n_fds;
+  int fds_allocated;
+  BusIOEvent *events;
+  int events_allocated;
+  pthread_t thread;
+  dbus_bool_t have_thread;  /**< only touched by the main thread */
+  unsigned int fds_dirty : 1;
+  unsigned int wakeup_pending : 1;
+  unsigned int shutdown : 1;
+};
+
+struct BusIOWorkers
+{
+  DBusLoop *loop;
+  BusIOWorkersReadyFunction ready_function;
+  void *ready_data;
+  pthread_t main_thread;
+  BusIOWorker *workers;
+  int n_workers;
+  int next_worker;
+  DBusCMutex *handover_lock;
+  DBusList *handed_over;    /**< connections, one reference each */
+  DBusList *released;       /**< worker references to drop, one each */
+  DBusSocket wakeup[2];     /**< written when either list stops being empty */
+  DBusWatch *wakeup_watch;
+};
+
+#define LOCK(worker)   _dbus_cmutex_lock ((worker)->lock)
+#define UNLOCK(worker) _dbus_cmutex_unlock ((worker)->lock)
+
+static void
+wake (DBusSocket fd)
+{
+  char byte = 0;
+
+  /* if the pipe is full a wakeup is pending anyway */
+  while (write (fd.fd, &byte, 1) < 0 && errno == EINTR)
+    ;
+}
+
+static void
+drain (DBusSocket fd)
+{
+  char buf[64];
+
+  while (TRUE)
+    {
+      ssize_t n = read (fd.fd, buf, sizeof (buf));
+
+      if (n < 0 && errno == EINTR)
+        continue;
+
+      if (n < (ssize_t) sizeof (buf))
+        break;
+    }
+}
+
+/* Called with the lock held */
+static void
+worker_changed (BusIOWorker *worker)
+{
+  worker->fds_dirty = TRUE;
+
+  if (!worker->wakeup_pending)
+    {
+      worker->wakeup_pending = TRUE;
+      wake (worker->wakeup[1]);
+    }
+}
+
+static BusIOWatch *
+socket_find_watch (BusIOSocket *sock,
+                   DBusWatch   *watch)
+{
+  int i;
+
+  for (i = 0; i < sock->n_watches; i++)
+    {
+      if (sock->watches[i].watch == watch)
+        return &sock->watches[i];
+    }
+
+  return NULL;
+}
+
+static dbus_bool_t
+add_worker_watch (DBusWatch *watch,
+                  void      *data)
+{
+  BusIOBinding *binding = data;
+  BusIOWorker *worker = binding->worker;
+  BusIOSocket *sock;
+  BusIOWatch *w;
+  int fd;
+  dbus_bool_t retval = FALSE;
+
+  fd = dbus_watch_get_unix_fd (watch);
+
+  LOCK (worker);
+
+  sock = _dbus_hash_table_lookup_int (worker->sockets, fd);
+
+  if (sock == NULL)
+    {
+      sock = dbus_new0 (BusIOSocket, 1);
+      if (sock == NULL)
+        goto out;
+
+      sock->fd = fd;
+      sock->binding = binding;
+
+      if (!_dbus_hash_table_insert_int (worker->sockets, fd, sock))
+        {
+          dbus_free (sock);
+          goto out;
+        }
+    }
+
+  /* two connections can't share an fd, and one has at most two watches */
+  _dbus_assert (sock->binding == binding);
+
+  if (sock->n_watches == MAX_WATCHES_PER_SOCKET)
+    {
+      _dbus_verbose ("Too many watches on fd %d for an I/O worker\n", fd);
+      goto out;
+    }
+
+  w = &sock->watches[sock->n_watches++];
+  w->watch = watch;
+  w->flags = dbus_watch_get_flags (watch);
+  w->enabled = dbus_watch_get_enabled (watch);
+
+  worker_changed (worker);
+  retval = TRUE;
+
+ out:
+  UNLOCK (worker);
+  return retval;
+}
+
+static void
+remove_worker_watch (DBusWatch *watch,
+                     void      *data)
+{
+  BusIOBinding *binding = data;
+  BusIOWorker *worker = binding->worker;
+  BusIOSocket *sock;
+  BusIOWatch *w;
+
+  LOCK (worker);
+
+  sock = _dbus_hash_table_lookup_int (worker->sockets,
+                                      dbus_watch_get_unix_fd (watch));
+
+  if (sock != NULL && (w = socket_find_watch (sock, watch)) != NULL)
+    {
+      *w = sock->watches[--sock->n_watches];
+
+      if (sock->n_watches == 0)
+        _dbus_hash_table_remove_int (worker->sockets, sock->fd);
+
+      worker_changed (worker);
+    }
+
+  UNLOCK (worker);
+}
+
+static void
+toggle_worker_watch (DBusWatch *watch,
+                     void      *data)
+{
+  BusIOBinding *binding = data;
+  BusIOWorker *worker = binding->worker;
+  BusIOSocket *sock;
+  BusIOWatch *w;
+
+  LOCK (worker);
+
+  sock = _dbus_hash_table_lookup_int (worker->sockets,
+                                      dbus_watch_get_unix_fd (watch));
+
+  if (sock != NULL && (w = socket_find_watch (sock, watch)) != NULL)
+    {
+      w->flags = dbus_watch_get_flags (watch);
+      w->enabled = dbus_watch_get_enabled (watch);
+      worker_changed (worker);
+    }
+
+  UNLOCK (worker);
+}
+
+/* Called with the lock held. Returns FALSE on OOM, leaving the old
+ * poll set in place.
+ */
+static dbus_bool_t
+rebuild_fds (BusIOWorker *worker)
+{
+  DBusHashIter iter;
+  int n;
+
+  n = 1 + _dbus_hash_table_get_n_entries (worker->sockets);
+
+  if (n > worker->fds_allocated)
+    {
+      DBusPollFD *fds;
+
+      fds = dbus_realloc (worker->fds, sizeof (DBusPollFD) * n);
+      if (fds == NULL)
+        return FALSE;
+      worker->fds = fds;
+      worker->fds_allocated = n;
+    }
+
+  if (n * MAX_WATCHES_PER_SOCKET > worker->events_allocated)
+    {
+      BusIOEvent *events;
+
+      events = dbus_realloc (worker->events,
+                             sizeof (BusIOEvent) * n * MAX_WATCHES_PER_SOCKET);
+      if (events == NULL)
+        return FALSE;
+      worker->events = events;
+      worker->events_allocated = n * MAX_WATCHES_PER_SOCKET;
+    }
+
+  worker->fds[0].fd = worker->wakeup[0].fd;
+  worker->fds[0].events = _DBUS_POLLIN;
+  worker->fds[0].revents = 0;
+  n = 1;
+
+  _dbus_hash_iter_init (worker->sockets, &iter);
+  while (_dbus_hash_iter_next (&iter))
+    {
+      BusIOSocket *sock = _dbus_hash_iter_get_value (&iter);
+      short events = 0;
+      int i;
+
+      for (i = 0; i < sock->n_watches; i++)
+        {
+          if (!sock->watches[i].enabled)
+            continue;
+
+          if (sock->watches[i].flags & DBUS_WATCH_READABLE)
+            events |= _DBUS_POLLIN;
+          if (sock->watches[i].flags & DBUS_WATCH_WRITABLE)
+            events |= _DBUS_POLLOUT;
+        }
+
+      if (events == 0)
+        continue;
+
+      worker->fds[n].fd = sock->fd;
+      worker->fds[n].events = events;
+      worker->fds[n].revents = 0;
+      n++;
+    }
+
+  worker->n_fds = n;
+  worker->fds_dirty = FALSE;
+  return TRUE;
+}
+
+/* Called with the lock held; returns the number of events collected */
+static int
+collect_events (BusIOWorker *worker)
+{
+  int n_events = 0;
+  int i;
+
+  if (worker->fds[0].revents != 0)
+    {
+      drain (worker->wakeup[0]);
+      worker->wakeup_pending = FALSE;
+      worker->fds[0].revents = 0;
+    }
+
+  for (i = 1; i < worker->n_fds; i++)
+    {
+      DBusPollFD *pfd = &worker->fds[i];
+      short revents = pfd->revents;
+      BusIOSocket *sock;
+      unsigned int condition = 0;
+      int j;
+
+      if (revents == 0)
+        continue;
+
+      /* poll() leaves revents alone if it is interrupted */
+      pfd->revents = 0;
+
+      sock = _dbus_hash_table_lookup_int (worker->sockets, pfd->fd);
+
+      if (sock == NULL || (revents & _DBUS_POLLNVAL))
+        {
+          /* removed (and maybe closed) while we were polling */
+          worker->fds_dirty = TRUE;
+          continue;
+        }
+
+      if (revents & _DBUS_POLLIN)
+        condition |= DBUS_WATCH_READABLE;
+      if (revents & _DBUS_POLLOUT)
+        condition |= DBUS_WATCH_WRITABLE;
+      if (revents & _DBUS_POLLHUP)
+        condition |= DBUS_WATCH_HANGUP;
+      if (revents & _DBUS_POLLERR)
+        condition |= DBUS_WATCH_ERROR;
+
+      for (j = 0; j < sock->n_watches; j++)
+        {
+          BusIOWatch *w = &sock->watches[j];
+          unsigned int wanted;
+          BusIOEvent *event;
+
+          if (!w->enabled)
+            continue;
+
+          wanted = condition &
+            (w->flags | DBUS_WATCH_HANGUP | DBUS_WATCH_ERROR);
+
+          if (wanted == 0)
+            continue;
+
+          _dbus_assert (n_events < worker->events_allocated);
+          event = &worker->events[n_events++];
+          event->connection = dbus_connection_ref (sock->binding->connection);
+          event->watch = w->watch;
+          event->binding = sock->binding;
+          event->condition = wanted;
+        }
+    }
+
+  return n_events;
+}
+
+/* Queues a reference for the main loop to drop; the caller must not
+ * use it afterwards.
+ */
+static void
+release_on_main_thread (BusIOWorkers   *workers,
+                        DBusConnection *connection)
+{
+  dbus_bool_t was_empty;
+
+  _dbus_cmutex_lock (workers->handover_lock);
+
+  was_empty = (workers->handed_over == NULL && workers->released == NULL);
+
+  while (!_dbus_list_append (&workers->released, connection))
+    {
+      _dbus_cmutex_unlock (workers->handover_lock);
+      _dbus_wait_for_memory ();
+      _dbus_cmutex_lock (workers->handover_lock);
+      was_empty = (workers->handed_over == NULL && workers->released == NULL);
+    }
+
+  if (was_empty)
+    wake (workers->wakeup[1]);
+
+  _dbus_cmutex_unlock (workers->handover_lock);
+}
+
+static void *
+worker_thread_main (void *data)
+{
+  BusIOWorker *worker = data;
+
+  LOCK (worker);
+
+  while (!worker->shutdown)
+    {
+      int n_events;
+      int i;
+
+      if (worker->fds_dirty)
+        {
+          while (!rebuild_fds (worker))
+            {
+              UNLOCK (worker);
+              _dbus_wait_for_memory ();
+              LOCK (worker);
+            }
+        }
+
+      UNLOCK (worker);
+
+      if (_dbus_poll (worker->fds, worker->n_fds, -1) < 0 &&
+          errno != EINTR)
+        _dbus_warn ("I/O worker poll() failed: %s", _dbus_strerror (errno));
+
+      LOCK (worker);
+
+      n_events = collect_events (worker);
+
+      UNLOCK (worker);
+
+      for (i = 0; i < n_events; i++)
+        {
+          BusIOEvent *event = &worker->events[i];
+
+          while (!_dbus_connection_handle_watch_if_current (event->connection,
+                                                            event->watch,
+                                                            event->condition,
+                                                            event->binding))
+            _dbus_wait_for_memory ();
+
+          release_on_main_thread (worker->workers, event->connection);
+        }
+
+      LOCK (worker);
+    }
+
+  UNLOCK (worker);
+  return NULL;
+}
+
+static dbus_bool_t
+worker_init (BusIOWorker *worker,
+             DBusError   *error)
+{
+  sigset_t all, old;
+  int result;
+
+  _dbus_socket_invalidate (&worker->wakeup[0]);
+  _dbus_socket_invalidate (&worker->wakeup[1]);
+
+  _dbus_cmutex_new_at_location (&worker->lock);
+  if (worker->lock == NULL)
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  worker->sockets = _dbus_hash_table_new (DBUS_HASH_INT, NULL, dbus_free);
+  if (worker->sockets == NULL)
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (!_dbus_socketpair (&worker->wakeup[0], &worker->wakeup[1],
+                         FALSE, error))
+    return FALSE;
+
+  worker->fds_dirty = TRUE;
+
+  /* signals are for the main loop; don't let the worker take them */
+  sigfillset (&all);
+  pthread_sigmask (SIG_SETMASK, &all, &old);
+  result = pthread_create (&worker->thread, NULL, worker_thread_main, worker);
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+
+  if (result != 0)
+    {
+      dbus_set_error (error, DBUS_ERROR_FAILED,
+                      "Could not start I/O worker thread: %s",
+                      _dbus_strerror (result));
+      return FALSE;
+    }
+
+  worker->have_thread = TRUE;
+  return TRUE;
+}
+
+static void
+worker_free_resources (BusIOWorker *worker)
+{
+  if (worker->have_thread)
+    {
+      LOCK (worker);
+      worker->shutdown = TRUE;
+      wake (worker->wakeup[1]);
+      UNLOCK (worker);
+
+      pthread_join (worker->thread, NULL);
+      worker->have_thread = FALSE;
+    }
+
+  /* all connections should have been disconnected by now */
+  if (worker->sockets)
+    {
+      _dbus_assert (_dbus_hash_table_get_n_entries (worker->sockets) == 0);
+      _dbus_hash_table_unref (worker->sockets);
+    }
+
+  if (_dbus_socket_is_valid (worker->wakeup[0]))
+    _dbus_close_socket (worker->wakeup[0], NULL);
+  if (_dbus_socket_is_valid (worker->wakeup[1]))
+    _dbus_close_socket (worker->wakeup[1], NULL);
+
+  dbus_free (worker->fds);
+  dbus_free (worker->events);
+
+  _dbus_cmutex_free_at_location (&worker->lock);
+}
+
+static dbus_bool_t
+handle_handed_over (DBusWatch    *watch,
+                    unsigned int  condition,
+                    void         *data)
+{
+  BusIOWorkers *workers = data;
+  DBusList *ready;
+  DBusList *released;
+  DBusConnection *connection;
+
+  drain (workers->wakeup[0]);
+
+  _dbus_cmutex_lock (workers->handover_lock);
+  ready = workers->handed_over;
+  workers->handed_over = NULL;
+  released = workers->released;
+  workers->released = NULL;
+  _dbus_cmutex_unlock (workers->handover_lock);
+
+  while ((connection = _dbus_list_pop_first (&ready)) != NULL)
+    {
+      (* workers->ready_function) (connection, workers->ready_data);
+      dbus_connection_unref (connection);
+    }
+
+  while ((connection = _dbus_list_pop_first (&released)) != NULL)
+    dbus_connection_unref (connection);
+
+  return TRUE;
+}
+
+BusIOWorkers*
+bus_io_workers_new (DBusLoop                  *loop,
+                    int                        n_threads,
+                    BusIOWorkersReadyFunction  ready_function,
+                    void                      *data,
+                    DBusError                 *error)
+{
+  BusIOWorkers *workers;
+  int i;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+  _dbus_assert (n_threads > 0);
+
+  workers = dbus_new0 (BusIOWorkers, 1);
+  if (workers == NULL)
+    {
+      BUS_SET_OOM (error);
+      return NULL;
+    }
+
+  workers->loop = _dbus_loop_ref (loop);
+  workers->ready_function = ready_function;
+  workers->ready_data = data;
+  workers->main_thread = pthread_self ();
+  _dbus_socket_invalidate (&workers->wakeup[0]);
+  _dbus_socket_invalidate (&workers->wakeup[1]);
+
+  _dbus_cmutex_new_at_location (&workers->handover_lock);
+  if (workers->handover_lock == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  if (!_dbus_socketpair (&workers->wakeup[0], &workers->wakeup[1],
+                         FALSE, error))
+    goto failed;
+
+  workers->wakeup_watch = _dbus_watch_new (workers->wakeup[0].fd,
+                                           DBUS_WATCH_READABLE, TRUE,
+                                           handle_handed_over, workers,
+                                           NULL);
+  if (workers->wakeup_watch == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  if (!_dbus_loop_add_watch (loop, workers->wakeup_watch))
+    {
+      _dbus_watch_unref (workers->wakeup_watch);
+      workers->wakeup_watch = NULL;
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  workers->workers = dbus_new0 (BusIOWorker, n_threads);
+  if (workers->workers == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  for (i = 0; i < n_threads; i++)
+    {
+      /* count it first, so that a half-made worker is freed too */
+      workers->n_workers++;
+
+      workers->workers[i].workers = workers;
+
+      if (!worker_init (&workers->workers[i], error))
+        goto failed;
+    }
+
+  return workers;
+
+ failed:
+  _DBUS_ASSERT_ERROR_IS_SET (error);
+  bus_io_workers_free (workers);
+  return NULL;
+}
+
+void
+bus_io_workers_free (BusIOWorkers *workers)
+{
+  DBusConnection *connection;
+  int i;
+
+  for (i = 0; i < workers->n_workers; i++)
+    worker_free_resources (&workers->workers[i]);
+
+  dbus_free (workers->workers);
+
+  if (workers->wakeup_watch)
+    {
+      _dbus_loop_remove_watch (workers->loop, workers->wakeup_watch);
+      _dbus_watch_invalidate (workers->wakeup_watch);
+      _dbus_watch_unref (workers->wakeup_watch);
+    }
+
+  if (_dbus_socket_is_valid (workers->wakeup[0]))
+    _dbus_close_socket (workers->wakeup[0], NULL);
+  if (_dbus_socket_is_valid (workers->wakeup[1]))
+    _dbus_close_socket (workers->wakeup[1], NULL);
+
+  /* the workers are gone, so nobody else can be touching this */
+  while ((connection = _dbus_list_pop_first (&workers->handed_over)) != NULL)
+    dbus_connection_unref (connection);
+  while ((connection = _dbus_list_pop_first (&workers->released)) != NULL)
+    dbus_connection_unref (connection);
+
+  _dbus_cmutex_free_at_location (&workers->handover_lock);
+
+  _dbus_loop_unref (workers->loop);
+  dbus_free (workers);
+}
+
+/**
+ * Moves a connection's watches onto one of the worker threads. The
+ * caller must already have arranged for everything that the
+ * connection calls back into from its watch handlers (dispatch status
+ * and pending fds) to hand the connection over to the main thread.
+ *
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+bus_io_workers_adopt (BusIOWorkers   *workers,
+                      DBusConnection *connection)
+{
+  BusIOBinding *binding;
+
+  binding = dbus_new0 (BusIOBinding, 1);
+  if (binding == NULL)
+    return FALSE;
+
+  binding->worker = &workers->workers[workers->next_worker];
+  binding->connection = connection;
+
+  if (!dbus_connection_set_watch_functions (connection,
+                                            add_worker_watch,
+                                            remove_worker_watch,
+                                            toggle_worker_watch,
+                                            binding, dbus_free))
+    {
+      dbus_free (binding);
+      return FALSE;
+    }
+
+  workers->next_worker = (workers->next_worker + 1) % workers->n_workers;
+  return TRUE;
+}
+
+/**
+ * Arranges for the ready function to be called for the connection
+ * from the main loop. Called on the main thread, it is called
+ * straight away.
+ */
+void
+bus_io_workers_hand_over (BusIOWorkers   *workers,
+                          DBusConnection *connection)
+{
+  dbus_bool_t was_empty;
+
+  if (bus_io_workers_in_main_thread (workers))
+    {
+      (* workers->ready_function) (connection, workers->ready_data);
+      return;
+    }
+
+  dbus_connection_ref (connection);
+
+  _dbus_cmutex_lock (workers->handover_lock);
+
+  was_empty = (workers->handed_over == NULL && workers->released == NULL);
+
+  while (!_dbus_list_append (&workers->handed_over, connection))
+    {
+      _dbus_cmutex_unlock (workers->handover_lock);
+      _dbus_wait_for_memory ();
+      _dbus_cmutex_lock (workers->handover_lock);
+      was_empty = (workers->handed_over == NULL && workers->released == NULL);
+    }
+
+  if (was_empty)
+    wake (workers->wakeup[1]);
+
+  _dbus_cmutex_unlock (workers->handover_lock);
+}
+
+dbus_bool_t
+bus_io_workers_in_main_thread (BusIOWorkers *workers)
+{
+  return pthread_equal (pthread_self (), workers->main_thread);
+}
+
+#else /* !DBUS_UNIX */
+
+BusIOWorkers*
+bus_io_workers_new (DBusLoop                  *loop,
+                    int                        n_threads,
+                    BusIOWorkersReadyFunction  ready_function,
+                    void                      *data,
+                    DBusError                 *error)
+{
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "I/O worker threads are not supported on this platform");
+  return NULL;
+}
+
+void
+bus_io_workers_free (BusIOWorkers *workers)
+{
+}
+
+dbus_bool_t
+bus_io_workers_adopt (BusIOWorkers   *workers,
+                      DBusConnection *connection)
+{
+  return FALSE;
+}
+
+void
+bus_io_workers_hand_over (BusIOWorkers   *workers,
+                          DBusConnection *connection)
+{
+  _dbus_assert_not_reached ("there are no I/O workers to hand over from");
+}
+
+dbus_bool_t
+bus_io_workers_in_main_thread (BusIOWorkers *workers)
+{
+  return TRUE;
+}
+
+#endif /* !DBUS_UNIX */
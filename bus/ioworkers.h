@@ -0,0 +1,45 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* ioworkers.h  Threads that do connection I/O for the main loop
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef BUS_IO_WORKERS_H
+#define BUS_IO_WORKERS_H
+
+#include <dbus/dbus.h>
+#include <dbus/dbus-mainloop.h>
+#include "bus.h"
+
+/* Called in the main thread for each connection a worker handed over */
+typedef void (* BusIOWorkersReadyFunction) (DBusConnection *connection,
+                                            void           *data);
+
+BusIOWorkers* bus_io_workers_new            (DBusLoop                  *loop,
+                                             int                        n_threads,
+                                             BusIOWorkersReadyFunction  ready_function,
+                                             void                      *data,
+                                             DBusError                 *error);
+void          bus_io_workers_free           (BusIOWorkers              *workers);
+dbus_bool_t   bus_io_workers_adopt          (BusIOWorkers              *workers,
+                                             DBusConnection            *connection);
+void          bus_io_workers_hand_over      (BusIOWorkers              *workers,
+                                             DBusConnection            *connection);
+dbus_bool_t   bus_io_workers_in_main_thread (BusIOWorkers              *workers);
+
+#endif /* BUS_IO_WORKERS_H */
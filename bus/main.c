@@ -24,7 +24,9 @@
 #include <config.h>
 #include "bus.h"
 #include "driver.h"
+#include "handoff.h"
 #include <dbus/dbus-internals.h>
+#include <dbus/dbus-spawn.h>
 #include <dbus/dbus-watch.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -57,7 +59,8 @@ static void close_reload_pipe (DBusWatch **);
 typedef enum
  {
    ACTION_RELOAD = 'r',
-   ACTION_QUIT = 'q'
+   ACTION_QUIT = 'q',
+   ACTION_RESTART = 'e'
  } SignalAction;
 
 static void
@@ -124,6 +127,28 @@ signal_handler (int sig)
           }
       }
       break;
+
+    case SIGUSR2:
+      {
+        DBusString str;
+        char action[2] = { ACTION_RESTART, '\0' };
+
+        _dbus_string_init_const (&str, action);
+        if ((reload_pipe[RELOAD_WRITE_END].fd > 0) &&
+            !_dbus_write_socket (reload_pipe[RELOAD_WRITE_END], &str, 0, 1))
+          {
+            /* As for SIGHUP, a restart is already on its way */
+            static const char message[] =
+              "Unable to write to reload pipe - buffer full?\n";
+
+            if (write (STDERR_FILENO, message, strlen (message)) !=
+                (ssize_t) strlen (message))
+              {
+                /* ignore failure to write out a warning */
+              }
+          }
+      }
+      break;
     }
 }
 #endif /* DBUS_UNIX */
@@ -284,6 +309,10 @@ handle_reload_watch (DBusWatch    *watch,
         }
       break;
 
+    case ACTION_RESTART:
+      bus_handoff_start (context);
+      break;
+
     case ACTION_QUIT:
       {
         DBusLoop *loop;
@@ -363,6 +392,27 @@ close_reload_pipe (DBusWatch **watch)
 }
 #endif /* DBUS_UNIX */
 
+static dbus_bool_t
+add_orphan_watch (DBusWatch *watch,
+                  void      *data)
+{
+  return _dbus_loop_add_watch (data, watch);
+}
+
+static void
+remove_orphan_watch (DBusWatch *watch,
+                     void      *data)
+{
+  _dbus_loop_remove_watch (data, watch);
+}
+
+static void
+toggle_orphan_watch (DBusWatch *watch,
+                     void      *data)
+{
+  _dbus_loop_toggle_watch (data, watch);
+}
+
 int
 main (int argc, char **argv)
 {
@@ -378,6 +428,12 @@ main (int argc, char **argv)
   dbus_bool_t print_address;
   dbus_bool_t print_pid;
   BusContextFlags flags;
+  BusHandoff *handoff;
+  long handoff_fd;
+
+#ifdef DBUS_UNIX
+  bus_handoff_save_argv (argc, argv);
+#endif
 
   if (!_dbus_string_init (&config_file))
     return 1;
@@ -393,6 +449,8 @@ main (int argc, char **argv)
 
   print_address = FALSE;
   print_pid = FALSE;
+  handoff = NULL;
+  handoff_fd = -1;
 
   flags = BUS_CONTEXT_FLAG_WRITE_PID_FILE;
 
@@ -431,6 +489,22 @@ main (int argc, char **argv)
         {
           flags |= BUS_CONTEXT_FLAG_SYSTEMD_ACTIVATION;
         }
+      else if (strstr (arg, "--handoff-fd=") == arg)
+        {
+          /* only passed by a running instance restarting itself */
+          DBusString str;
+          int end;
+
+          _dbus_string_init_const (&str, strchr (arg, '=') + 1);
+          if (!_dbus_string_parse_int (&str, 0, &handoff_fd, &end) ||
+              end != _dbus_string_get_length (&str) ||
+              handoff_fd < 0 || handoff_fd > _DBUS_INT_MAX)
+            {
+              fprintf (stderr, "Invalid file descriptor: \"%s\"\n",
+                       _dbus_string_get_const_data (&str));
+              exit (1);
+            }
+        }
 #endif
       else if (strcmp (arg, "--nopidfile") == 0)
         {
@@ -570,6 +644,16 @@ main (int argc, char **argv)
       usage ();
     }
 
+  if (handoff_fd >= 0)
+    {
+      /* The previous instance already forked and printed its address,
+       * and we must stay its child until it has gone away */
+      flags &= ~BUS_CONTEXT_FLAG_FORK_ALWAYS;
+      flags |= BUS_CONTEXT_FLAG_FORK_NEVER;
+      print_address = FALSE;
+      print_pid = FALSE;
+    }
+
   _dbus_pipe_invalidate (&print_addr_pipe);
   if (print_address)
     {
@@ -627,10 +711,25 @@ main (int argc, char **argv)
     }
 
   dbus_error_init (&error);
+
+#ifdef DBUS_UNIX
+  if (handoff_fd >= 0)
+    {
+      handoff = bus_handoff_receive (handoff_fd, &error);
+      if (handoff == NULL)
+        {
+          _dbus_warn ("Failed to take over message bus: %s\n",
+                      error.message);
+          dbus_error_free (&error);
+          exit (1);
+        }
+    }
+#endif
+
   context = bus_context_new (&config_file, flags,
                              &print_addr_pipe, &print_pid_pipe,
                              _dbus_string_get_length(&address) > 0 ? &address : NULL,
-                             &error);
+                             handoff, &error);
   _dbus_string_free (&config_file);
   if (context == NULL)
     {
@@ -640,6 +739,21 @@ main (int argc, char **argv)
       exit (1);
     }
 
+#ifdef DBUS_UNIX
+  if (handoff != NULL)
+    {
+      if (!bus_handoff_finish (handoff, context, &error))
+        {
+          _dbus_warn ("Failed to take over message bus: %s\n",
+                      error.message);
+          dbus_error_free (&error);
+          exit (1);
+        }
+
+      bus_handoff_free (handoff);
+    }
+#endif
+
   /* bus_context_new() closes the print_addr_pipe and
    * print_pid_pipe
    */
@@ -653,11 +767,25 @@ main (int argc, char **argv)
 
   _dbus_set_signal_handler (SIGTERM, signal_handler);
   _dbus_set_signal_handler (SIGHUP, signal_handler);
+  _dbus_set_signal_handler (SIGUSR2, signal_handler);
 #endif /* DBUS_UNIX */
 
+  /* Activated services that outlive their activation are our own
+   * children; reap them from the main loop as soon as they exit */
+  if (!_dbus_spawn_set_orphan_watch_functions (add_orphan_watch,
+                                               remove_orphan_watch,
+                                               toggle_orphan_watch,
+                                               bus_context_get_loop (context),
+                                               NULL))
+    {
+      _dbus_warn ("Unable to watch activated services: no memory\n");
+      exit (1);
+    }
+
   _dbus_verbose ("We are on D-Bus...\n");
   _dbus_loop_run (bus_context_get_loop (context));
 
+  _dbus_spawn_set_orphan_watch_functions (NULL, NULL, NULL, NULL, NULL);
   bus_context_shutdown (context);
   bus_context_unref (context);
   bus_selinux_shutdown ();
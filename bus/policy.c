@@ -26,6 +26,7 @@
 #include "services.h"
 #include "test.h"
 #include "utils.h"
+#include "usercache.h"
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-hash.h>
 #include <dbus/dbus-internals.h>
@@ -36,7 +37,7 @@ bus_policy_rule_new (BusPolicyRuleType type,
 {
   BusPolicyRule *rule;
 
-  rule = dbus_new0 (BusPolicyRule, 1);
+  rule = _dbus_new0_tagged (DBUS_MEM_TAG_POLICY, BusPolicyRule, 1);
   if (rule == NULL)
     return NULL;
 
@@ -163,7 +164,7 @@ bus_policy_new (void)
 {
   BusPolicy *policy;
 
-  policy = dbus_new0 (BusPolicy, 1);
+  policy = _dbus_new0_tagged (DBUS_MEM_TAG_POLICY, BusPolicy, 1);
   if (policy == NULL)
     return NULL;
 
@@ -435,6 +436,7 @@ list_allows_user (dbus_bool_t           def,
 
 dbus_bool_t
 bus_policy_allow_unix_user (BusPolicy        *policy,
+                            BusUserCache     *user_cache,
                             unsigned long     uid)
 {
   dbus_bool_t allowed;
@@ -442,7 +444,8 @@ bus_policy_allow_unix_user (BusPolicy        *policy,
   int n_group_ids;
 
   /* On OOM or error we always reject the user */
-  if (!_dbus_unix_groups_from_uid (uid, &group_ids, &n_group_ids))
+  if (!bus_user_cache_get_groups (user_cache, uid,
+                                  &group_ids, &n_group_ids))
     {
       _dbus_verbose ("Did not get any groups for UID %lu\n",
                      uid);
@@ -522,7 +525,7 @@ get_list (DBusHashTable *hash,
 
   if (list == NULL)
     {
-      list = dbus_new0 (DBusList*, 1);
+      list = _dbus_new0_tagged (DBUS_MEM_TAG_POLICY, DBusList*, 1);
       if (list == NULL)
         return NULL;
 
@@ -635,6 +638,12 @@ merge_id_hash (DBusHashTable *dest,
                DBusHashTable *to_absorb)
 {
   DBusHashIter iter;
+
+  /* Size the table for the union once rather than growing it per id */
+  if (!_dbus_hash_table_set_size_hint (dest,
+                                       _dbus_hash_table_get_n_entries (dest) +
+                                       _dbus_hash_table_get_n_entries (to_absorb)))
+    return FALSE;
   
   _dbus_hash_iter_init (to_absorb, &iter);
   while (_dbus_hash_iter_next (&iter))
@@ -700,7 +709,7 @@ bus_client_policy_new (void)
 {
   BusClientPolicy *policy;
 
-  policy = dbus_new0 (BusClientPolicy, 1);
+  policy = _dbus_new0_tagged (DBUS_MEM_TAG_POLICY, BusClientPolicy, 1);
   if (policy == NULL)
     return NULL;
 
@@ -1302,6 +1311,101 @@ bus_client_policy_check_can_own (BusClientPolicy  *policy,
   return bus_rules_check_can_own (policy->rules, service_name);
 }
 
+/* Whether a send_destination or receive_sender of name can refer to
+ * peer, now or after it acquires more names.
+ */
+static dbus_bool_t
+rule_name_may_be_peer (const char     *name,
+                       BusRegistry    *registry,
+                       DBusConnection *peer)
+{
+  DBusString str;
+  BusService *service;
+  BusClientPolicy *peer_policy;
+
+  if (name == NULL)
+    return TRUE;
+
+  /* Nobody but the bus owns this one */
+  if (strcmp (name, DBUS_SERVICE_DBUS) == 0)
+    return FALSE;
+
+  _dbus_string_init_const (&str, name);
+
+  service = bus_registry_lookup (registry, &str);
+  if (service != NULL && bus_service_has_owner (service, peer))
+    return TRUE;
+
+  peer_policy = bus_connection_get_policy (peer);
+  return peer_policy != NULL &&
+    bus_client_policy_check_can_own (peer_policy, &str);
+}
+
+/**
+ * Checks whether any send rule (for #BUS_POLICY_RULE_SEND) or receive
+ * rule (for #BUS_POLICY_RULE_RECEIVE) in the policy that can apply to
+ * messages exchanged with peer looks at the message itself: its type,
+ * path, interface, member or error name. Such rules cannot be enforced
+ * once the bus stops seeing the messages. A rule naming a destination
+ * or sender counts if peer owns that name or is allowed to own it.
+ *
+ * @param policy the policy of one end
+ * @param registry the registry used to look up names
+ * @param type which rules to look at
+ * @param peer the other end
+ * @returns #TRUE if some rule depends on the message
+ */
+dbus_bool_t
+bus_client_policy_depends_on_message (BusClientPolicy   *policy,
+                                      BusRegistry       *registry,
+                                      BusPolicyRuleType  type,
+                                      DBusConnection    *peer)
+{
+  DBusList *link;
+
+  _dbus_assert (type == BUS_POLICY_RULE_SEND ||
+                type == BUS_POLICY_RULE_RECEIVE);
+
+  for (link = _dbus_list_get_first_link (&policy->rules);
+       link != NULL;
+       link = _dbus_list_get_next_link (&policy->rules, link))
+    {
+      BusPolicyRule *rule = link->data;
+
+      if (rule->type != type)
+        continue;
+
+      if (type == BUS_POLICY_RULE_SEND)
+        {
+          if (rule->d.send.message_type == DBUS_MESSAGE_TYPE_INVALID &&
+              rule->d.send.path == NULL &&
+              rule->d.send.interface == NULL &&
+              rule->d.send.member == NULL &&
+              rule->d.send.error == NULL)
+            continue;
+
+          if (rule_name_may_be_peer (rule->d.send.destination,
+                                     registry, peer))
+            return TRUE;
+        }
+      else
+        {
+          if (rule->d.receive.message_type == DBUS_MESSAGE_TYPE_INVALID &&
+              rule->d.receive.path == NULL &&
+              rule->d.receive.interface == NULL &&
+              rule->d.receive.member == NULL &&
+              rule->d.receive.error == NULL)
+            continue;
+
+          if (rule_name_may_be_peer (rule->d.receive.origin,
+                                     registry, peer))
+            return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
 dbus_bool_t
 bus_policy_check_can_own (BusPolicy  *policy,
@@ -117,6 +117,7 @@ BusClientPolicy* bus_policy_create_client_policy  (BusPolicy        *policy,
                                                    DBusConnection   *connection,
                                                    DBusError        *error);
 dbus_bool_t      bus_policy_allow_unix_user       (BusPolicy        *policy,
+                                                   BusUserCache     *user_cache,
                                                    unsigned long     uid);
 dbus_bool_t      bus_policy_allow_windows_user    (BusPolicy        *policy,
                                                    const char       *windows_sid);
@@ -157,6 +158,10 @@ dbus_bool_t      bus_client_policy_check_can_receive (BusClientPolicy  *policy,
                                                       dbus_int32_t     *toggles);
 dbus_bool_t      bus_client_policy_check_can_own     (BusClientPolicy  *policy,
                                                       const DBusString *service_name);
+dbus_bool_t      bus_client_policy_depends_on_message (BusClientPolicy  *policy,
+                                                       BusRegistry      *registry,
+                                                       BusPolicyRuleType type,
+                                                       DBusConnection   *peer);
 dbus_bool_t      bus_client_policy_append_rule       (BusClientPolicy  *policy,
                                                       BusPolicyRule    *rule);
 void             bus_client_policy_optimize          (BusClientPolicy  *policy);
@@ -140,6 +140,20 @@ bus_registry_unref  (BusRegistry *registry)
     }
 }
 
+/**
+ * Frees the blocks of the registry's pools that no service or owner
+ * is using any more, as after a burst of short-lived names.
+ *
+ * @param registry the registry
+ * @returns the number of bytes given back
+ */
+size_t
+bus_registry_trim (BusRegistry *registry)
+{
+  return _dbus_mem_pool_trim (registry->service_pool) +
+    _dbus_mem_pool_trim (registry->owner_pool);
+}
+
 BusService*
 bus_registry_lookup (BusRegistry      *registry,
                      const DBusString *service_name)
@@ -1277,6 +1291,37 @@ bus_service_has_owner (BusService     *service,
     return TRUE;
 }
 
+/**
+ * Gets the flags of a connection's place in the queue for the
+ * service, as far as they are remembered: only
+ * #DBUS_NAME_FLAG_ALLOW_REPLACEMENT and #DBUS_NAME_FLAG_DO_NOT_QUEUE.
+ *
+ * @returns #FALSE if the connection is not in the queue
+ */
+dbus_bool_t
+bus_service_get_owner_flags (BusService     *service,
+                             DBusConnection *connection,
+                             dbus_uint32_t  *flags)
+{
+  DBusList *link;
+  BusOwner *owner;
+
+  link = _bus_service_find_owner_link (service, connection);
+  if (link == NULL)
+    return FALSE;
+
+  owner = link->data;
+  *flags = 0;
+
+  if (owner->allow_replacement)
+    *flags |= DBUS_NAME_FLAG_ALLOW_REPLACEMENT;
+
+  if (owner->do_not_queue)
+    *flags |= DBUS_NAME_FLAG_DO_NOT_QUEUE;
+
+  return TRUE;
+}
+
 dbus_bool_t 
 bus_service_list_queued_owners (BusService *service,
                                 DBusList  **return_list,
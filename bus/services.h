@@ -36,6 +36,7 @@ typedef void (* BusServiceForeachFunction) (BusService       *service,
 BusRegistry* bus_registry_new             (BusContext                  *context);
 BusRegistry* bus_registry_ref             (BusRegistry                 *registry);
 void         bus_registry_unref           (BusRegistry                 *registry);
+size_t       bus_registry_trim            (BusRegistry                 *registry);
 BusService*  bus_registry_lookup          (BusRegistry                 *registry,
                                            const DBusString            *service_name);
 BusService*  bus_registry_ensure          (BusRegistry                 *registry,
@@ -86,6 +87,9 @@ dbus_bool_t     bus_service_has_owner                 (BusService     *service,
 BusOwner*       bus_service_get_primary_owner         (BusService     *service);
 dbus_bool_t     bus_service_get_allow_replacement     (BusService     *service);
 const char*     bus_service_get_name                  (BusService     *service);
+dbus_bool_t     bus_service_get_owner_flags           (BusService     *service,
+                                                       DBusConnection *connection,
+                                                       dbus_uint32_t  *flags);
 dbus_bool_t     bus_service_list_queued_owners        (BusService *service,
                                                        DBusList  **return_list,
                                                        DBusError  *error);
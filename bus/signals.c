@@ -48,6 +48,14 @@ struct BusMatchRule
   unsigned int *arg_lens;
   char **args;
   int args_len;
+
+  dbus_uint32_t sample_interval; /**< deliver one match in this many */
+  dbus_uint32_t sample_count;    /**< matches seen since the last delivery */
+
+  /* If non-NULL, the strings and args above belong to this cached
+   * rule and must not be modified or freed by this one.
+   */
+  BusMatchRule *template;
 };
 
 #define BUS_MATCH_ARG_NAMESPACE   0x4000000u
@@ -55,25 +63,63 @@ struct BusMatchRule
 
 #define BUS_MATCH_ARG_FLAGS (BUS_MATCH_ARG_NAMESPACE | BUS_MATCH_ARG_IS_PATH)
 
-BusMatchRule*
-bus_match_rule_new (DBusConnection *matches_go_to)
+/* Maximum number of parsed rules kept by each matchmaker's rule cache */
+#define BUS_MATCH_RULE_CACHE_SIZE 256
+
+static BusMatchRule*
+match_rule_alloc (DBusConnection *matches_go_to)
 {
   BusMatchRule *rule;
 
-  rule = dbus_new0 (BusMatchRule, 1);
+  rule = _dbus_new0_tagged (DBUS_MEM_TAG_MATCH_RULE, BusMatchRule, 1);
   if (rule == NULL)
     return NULL;
 
   rule->refcount = 1;
   rule->matches_go_to = matches_go_to;
 
+  return rule;
+}
+
+BusMatchRule*
+bus_match_rule_new (DBusConnection *matches_go_to)
+{
+  BusMatchRule *rule;
+
+  rule = match_rule_alloc (matches_go_to);
+
 #ifndef DBUS_ENABLE_EMBEDDED_TESTS
-  _dbus_assert (rule->matches_go_to != NULL);
+  _dbus_assert (rule == NULL || rule->matches_go_to != NULL);
 #endif
   
   return rule;
 }
 
+/* Create a rule for matches_go_to which shares everything but the
+ * owner and refcount with a cached, connection-less template.
+ */
+static BusMatchRule*
+match_rule_new_from_template (DBusConnection *matches_go_to,
+                              BusMatchRule   *template)
+{
+  BusMatchRule *rule;
+
+  _dbus_assert (template->matches_go_to == NULL);
+  _dbus_assert (template->template == NULL);
+
+  rule = _dbus_new_tagged (DBUS_MEM_TAG_MATCH_RULE, BusMatchRule, 1);
+  if (rule == NULL)
+    return NULL;
+
+  *rule = *template;
+  rule->refcount = 1;
+  rule->sample_count = 0;
+  rule->matches_go_to = matches_go_to;
+  rule->template = bus_match_rule_ref (template);
+
+  return rule;
+}
+
 BusMatchRule *
 bus_match_rule_ref (BusMatchRule *rule)
 {
@@ -90,7 +136,12 @@ bus_match_rule_unref (BusMatchRule *rule)
   _dbus_assert (rule->refcount > 0);
 
   rule->refcount -= 1;
-  if (rule->refcount == 0)
+  if (rule->refcount == 0 && rule->template != NULL)
+    {
+      bus_match_rule_unref (rule->template);
+      dbus_free (rule);
+    }
+  else if (rule->refcount == 0)
     {
       dbus_free (rule->interface);
       dbus_free (rule->member);
@@ -121,7 +172,6 @@ bus_match_rule_unref (BusMatchRule *rule)
     }
 }
 
-#if defined(DBUS_ENABLE_VERBOSE_MODE) || defined(DBUS_ENABLE_STATS)
 static dbus_bool_t
 append_key_and_escaped_value (DBusString *str, const char *token, const char *value)
 {
@@ -160,9 +210,14 @@ append_key_and_escaped_value (DBusString *str, const char *token, const char *va
   return TRUE;
 }
 
-/* returns NULL if no memory */
-static char*
-match_rule_to_string (BusMatchRule *rule)
+/**
+ * Formats the rule the way bus_match_rule_parse() reads it, so that
+ * parsing the result for the same connection gives an equal rule.
+ *
+ * @returns the string, or #NULL if no memory
+ */
+char*
+bus_match_rule_to_string (BusMatchRule *rule)
 {
   DBusString str;
   char *ret;
@@ -265,6 +320,19 @@ match_rule_to_string (BusMatchRule *rule)
         goto nomem;
     }
 
+  if (rule->flags & BUS_MATCH_SAMPLE)
+    {
+      if (_dbus_string_get_length (&str) > 0)
+        {
+          if (!_dbus_string_append (&str, ","))
+            goto nomem;
+        }
+
+      if (!_dbus_string_append_printf (&str, "sample='%u'",
+                                       rule->sample_interval))
+        goto nomem;
+    }
+
   if (rule->flags & BUS_MATCH_ARGS)
     {
       int i;
@@ -311,7 +379,6 @@ match_rule_to_string (BusMatchRule *rule)
   _dbus_string_free (&str);
   return NULL;
 }
-#endif /* defined(DBUS_ENABLE_VERBOSE_MODE) || defined(DBUS_ENABLE_STATS) */
 
 dbus_bool_t
 bus_match_rule_set_message_type (BusMatchRule *rule,
@@ -330,6 +397,7 @@ bus_match_rule_set_interface (BusMatchRule *rule,
 {
   char *new;
 
+  _dbus_assert (rule->template == NULL);
   _dbus_assert (interface != NULL);
 
   new = _dbus_strdup (interface);
@@ -349,6 +417,7 @@ bus_match_rule_set_member (BusMatchRule *rule,
 {
   char *new;
 
+  _dbus_assert (rule->template == NULL);
   _dbus_assert (member != NULL);
 
   new = _dbus_strdup (member);
@@ -368,6 +437,7 @@ bus_match_rule_set_sender (BusMatchRule *rule,
 {
   char *new;
 
+  _dbus_assert (rule->template == NULL);
   _dbus_assert (sender != NULL);
 
   new = _dbus_strdup (sender);
@@ -387,6 +457,7 @@ bus_match_rule_set_destination (BusMatchRule *rule,
 {
   char *new;
 
+  _dbus_assert (rule->template == NULL);
   _dbus_assert (destination != NULL);
 
   new = _dbus_strdup (destination);
@@ -419,6 +490,30 @@ bus_match_rule_get_client_is_eavesdropping (BusMatchRule *rule)
     return FALSE;
 }
 
+void
+bus_match_rule_set_sample_interval (BusMatchRule  *rule,
+                                    dbus_uint32_t  interval)
+{
+  _dbus_assert (interval > 0);
+
+  rule->sample_interval = interval;
+  rule->sample_count = 0;
+
+  if (interval > 1)
+    rule->flags |= BUS_MATCH_SAMPLE;
+  else
+    rule->flags &= ~(BUS_MATCH_SAMPLE);
+}
+
+dbus_uint32_t
+bus_match_rule_get_sample_interval (BusMatchRule *rule)
+{
+  if (rule->flags & BUS_MATCH_SAMPLE)
+    return rule->sample_interval;
+  else
+    return 1;
+}
+
 dbus_bool_t
 bus_match_rule_set_path (BusMatchRule *rule,
                          const char   *path,
@@ -426,6 +521,7 @@ bus_match_rule_set_path (BusMatchRule *rule,
 {
   char *new;
 
+  _dbus_assert (rule->template == NULL);
   _dbus_assert (path != NULL);
 
   new = _dbus_strdup (path);
@@ -455,6 +551,7 @@ bus_match_rule_set_arg (BusMatchRule     *rule,
   int length;
   char *new;
 
+  _dbus_assert (rule->template == NULL);
   _dbus_assert (value != NULL);
 
   /* args_len is the number of args not including null termination
@@ -470,8 +567,8 @@ bus_match_rule_set_arg (BusMatchRule     *rule,
       new_args_len = arg + 1;
 
       /* add another + 1 here for null termination */
-      new_args = dbus_realloc (rule->args,
-                               sizeof (char *) * (new_args_len + 1));
+      new_args = _dbus_realloc_tagged (DBUS_MEM_TAG_MATCH_RULE, rule->args,
+                                       sizeof (char *) * (new_args_len + 1));
       if (new_args == NULL)
         return FALSE;
 
@@ -486,8 +583,9 @@ bus_match_rule_set_arg (BusMatchRule     *rule,
       rule->args = new_args;
 
       /* and now add to the lengths */
-      new_arg_lens = dbus_realloc (rule->arg_lens,
-                                   sizeof (int) * (new_args_len + 1));
+      new_arg_lens = _dbus_realloc_tagged (DBUS_MEM_TAG_MATCH_RULE,
+                                           rule->arg_lens,
+                                           sizeof (int) * (new_args_len + 1));
 
       if (new_arg_lens == NULL)
         return FALSE;
@@ -914,10 +1012,10 @@ bus_match_rule_parse_arg_match (BusMatchRule     *rule,
  * path='/bar/foo',destination=':452345.34'
  *
  */
-BusMatchRule*
-bus_match_rule_parse (DBusConnection   *matches_go_to,
-                      const DBusString *rule_text,
-                      DBusError        *error)
+static BusMatchRule*
+match_rule_parse_uncached (DBusConnection   *matches_go_to,
+                           const DBusString *rule_text,
+                           DBusError        *error)
 {
   BusMatchRule *rule;
   RuleToken tokens[MAX_RULE_TOKENS+1]; /* NULL termination + 1 */
@@ -936,7 +1034,7 @@ bus_match_rule_parse (DBusConnection   *matches_go_to,
   
   memset (tokens, '\0', sizeof (tokens));
   
-  rule = bus_match_rule_new (matches_go_to);
+  rule = match_rule_alloc (matches_go_to);
   if (rule == NULL)
     {
       BUS_SET_OOM (error);
@@ -1121,6 +1219,31 @@ bus_match_rule_parse (DBusConnection   *matches_go_to,
               goto failed;
             }
         }
+      else if (strcmp (key, "sample") == 0)
+        {
+          unsigned long interval;
+          int end;
+
+          if (rule->flags & BUS_MATCH_SAMPLE)
+            {
+              dbus_set_error (error, DBUS_ERROR_MATCH_RULE_INVALID,
+                              "Key %s specified twice in match rule\n", key);
+              goto failed;
+            }
+
+          if (!_dbus_string_parse_uint (&tmp_str, 0, &interval, &end) ||
+              end != _dbus_string_get_length (&tmp_str) ||
+              interval < 1 || interval > _DBUS_UINT32_MAX)
+            {
+              dbus_set_error (error, DBUS_ERROR_MATCH_RULE_INVALID,
+                              "sample='%s' is invalid, "
+                              "it should be a positive integer\n",
+                              value);
+              goto failed;
+            }
+
+          bus_match_rule_set_sample_interval (rule, interval);
+        }
       else if (strncmp (key, "arg", 3) == 0)
         {
           if (!bus_match_rule_parse_arg_match (rule, key, &tmp_str, error))
@@ -1181,8 +1304,34 @@ struct BusMatchmaker
    * type.
    */
   RulePool rules_by_type[DBUS_NUM_MESSAGE_TYPES];
+
+  /* Maps rule text to a RuleCacheEntry holding that text parsed into a
+   * rule with no owner, so that text seen before (from any connection)
+   * needn't be tokenized again. rule_cache_lru lists the same entries,
+   * least recently used first, so that the cache stays bounded.
+   */
+  DBusHashTable *rule_cache;
+  DBusList *rule_cache_lru;
 };
 
+typedef struct
+{
+  char *text;          /* the hash key, owned by the hash table */
+  BusMatchRule *rule;  /* template for match_rule_new_from_template() */
+  DBusList *link;      /* our link in rule_cache_lru */
+} RuleCacheEntry;
+
+static void
+rule_cache_entry_free (RuleCacheEntry *entry)
+{
+  /* The hash table frees the "existing" value, NULL, for new entries */
+  if (entry != NULL)
+    {
+      bus_match_rule_unref (entry->rule);
+      dbus_free (entry);
+    }
+}
+
 #ifdef DBUS_ENABLE_STATS
 dbus_bool_t
 bus_match_rule_dump (BusMatchmaker *matchmaker,
@@ -1209,7 +1358,7 @@ bus_match_rule_dump (BusMatchmaker *matchmaker,
 
               if (rule->matches_go_to == conn_filter)
                 {
-                  char *s = match_rule_to_string (rule);
+                  char *s = bus_match_rule_to_string (rule);
 
                   if (s == NULL)
                     return FALSE;
@@ -1232,7 +1381,7 @@ bus_match_rule_dump (BusMatchmaker *matchmaker,
 
           if (rule->matches_go_to == conn_filter)
             {
-              char *s = match_rule_to_string (rule);
+              char *s = bus_match_rule_to_string (rule);
 
               if (s == NULL)
                 return FALSE;
@@ -1283,12 +1432,18 @@ bus_matchmaker_new (void)
   BusMatchmaker *matchmaker;
   int i;
 
-  matchmaker = dbus_new0 (BusMatchmaker, 1);
+  matchmaker = _dbus_new0_tagged (DBUS_MEM_TAG_MATCH_RULE, BusMatchmaker, 1);
   if (matchmaker == NULL)
     return NULL;
 
   matchmaker->refcount = 1;
 
+  matchmaker->rule_cache = _dbus_hash_table_new (DBUS_HASH_STRING,
+      dbus_free, (DBusFreeFunction) rule_cache_entry_free);
+
+  if (matchmaker->rule_cache == NULL)
+    goto nomem;
+
   for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
     {
       RulePool *p = matchmaker->rules_by_type + i;
@@ -1303,6 +1458,9 @@ bus_matchmaker_new (void)
   return matchmaker;
 
  nomem:
+  if (matchmaker->rule_cache != NULL)
+    _dbus_hash_table_unref (matchmaker->rule_cache);
+
   for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
     {
       RulePool *p = matchmaker->rules_by_type + i;
@@ -1348,7 +1506,7 @@ bus_matchmaker_get_rules (BusMatchmaker *matchmaker,
         {
           char *dupped_interface;
 
-          list = dbus_new0 (DBusList *, 1);
+          list = _dbus_new0_tagged (DBUS_MEM_TAG_MATCH_RULE, DBusList *, 1);
           if (list == NULL)
             return NULL;
 
@@ -1428,10 +1586,122 @@ bus_matchmaker_unref (BusMatchmaker *matchmaker)
           rule_list_free (&p->rules_without_iface);
         }
 
+      /* The entries themselves belong to the hash table */
+      _dbus_list_clear (&matchmaker->rule_cache_lru);
+      _dbus_hash_table_unref (matchmaker->rule_cache);
+
       dbus_free (matchmaker);
     }
 }
 
+static BusMatchRule *
+rule_cache_lookup (BusMatchmaker *matchmaker,
+                   const char    *text)
+{
+  RuleCacheEntry *entry;
+
+  entry = _dbus_hash_table_lookup_string (matchmaker->rule_cache, text);
+
+  if (entry == NULL)
+    return NULL;
+
+  /* Move it to the most-recently-used end */
+  _dbus_list_unlink (&matchmaker->rule_cache_lru, entry->link);
+  _dbus_list_append_link (&matchmaker->rule_cache_lru, entry->link);
+
+  return entry->rule;
+}
+
+/* Failing to cache a rule is harmless, so this doesn't report OOM */
+static void
+rule_cache_insert (BusMatchmaker *matchmaker,
+                   const char    *text,
+                   BusMatchRule  *template)
+{
+  RuleCacheEntry *entry;
+
+  if (_dbus_hash_table_get_n_entries (matchmaker->rule_cache) >=
+      BUS_MATCH_RULE_CACHE_SIZE)
+    {
+      DBusList *oldest;
+
+      oldest = _dbus_list_pop_first_link (&matchmaker->rule_cache_lru);
+      entry = oldest->data;
+      _dbus_list_free_link (oldest);
+      _dbus_hash_table_remove_string (matchmaker->rule_cache, entry->text);
+    }
+
+  entry = _dbus_new0_tagged (DBUS_MEM_TAG_MATCH_RULE, RuleCacheEntry, 1);
+  if (entry == NULL)
+    return;
+
+  entry->text = _dbus_strdup (text);
+  entry->link = _dbus_list_alloc_link (entry);
+  entry->rule = bus_match_rule_ref (template);
+
+  if (entry->text == NULL || entry->link == NULL ||
+      !_dbus_hash_table_insert_string (matchmaker->rule_cache, entry->text,
+                                       entry))
+    {
+      if (entry->link != NULL)
+        _dbus_list_free_link (entry->link);
+
+      dbus_free (entry->text);
+      rule_cache_entry_free (entry);
+      return;
+    }
+
+  _dbus_list_append_link (&matchmaker->rule_cache_lru, entry->link);
+}
+
+/*
+ * Rules are looked up in the matchmaker's cache before being parsed,
+ * since most clients add the same handful of rules.
+ */
+BusMatchRule*
+bus_match_rule_parse (DBusConnection   *matches_go_to,
+                      const DBusString *rule_text,
+                      DBusError        *error)
+{
+  BusMatchmaker *matchmaker;
+  BusMatchRule *template;
+  BusMatchRule *rule;
+  const char *text;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  /* The unit tests parse rules with no connection, hence no bus */
+  if (matches_go_to == NULL)
+    return match_rule_parse_uncached (NULL, rule_text, error);
+
+  matchmaker = bus_connection_get_matchmaker (matches_go_to);
+  text = _dbus_string_get_const_data (rule_text);
+
+  template = rule_cache_lookup (matchmaker, text);
+
+  if (template != NULL)
+    {
+      bus_match_rule_ref (template);
+    }
+  else
+    {
+      template = match_rule_parse_uncached (NULL, rule_text, error);
+
+      if (template == NULL)
+        return NULL;
+
+      rule_cache_insert (matchmaker, text, template);
+    }
+
+  rule = match_rule_new_from_template (matches_go_to, template);
+  bus_match_rule_unref (template);
+
+  if (rule == NULL)
+    BUS_SET_OOM (error);
+
+  return rule;
+}
+
 /* The rule can't be modified after it's added. */
 dbus_bool_t
 bus_matchmaker_add_rule (BusMatchmaker   *matchmaker,
@@ -1466,7 +1736,7 @@ bus_matchmaker_add_rule (BusMatchmaker   *matchmaker,
 
 #ifdef DBUS_ENABLE_VERBOSE_MODE
   {
-    char *s = match_rule_to_string (rule);
+    char *s = bus_match_rule_to_string (rule);
 
     _dbus_verbose ("Added match rule %s to connection %p\n",
                    s ? s : "nomem", rule->matches_go_to);
@@ -1487,6 +1757,14 @@ match_rule_equal (BusMatchRule *a,
   if (a->matches_go_to != b->matches_go_to)
     return FALSE;
 
+  if ((a->flags & BUS_MATCH_SAMPLE) &&
+      a->sample_interval != b->sample_interval)
+    return FALSE;
+
+  /* Rules parsed from the same text share a template */
+  if (a->template != NULL && a->template == b->template)
+    return TRUE;
+
   if ((a->flags & BUS_MATCH_MESSAGE_TYPE) &&
       a->message_type != b->message_type)
     return FALSE;
@@ -1559,7 +1837,7 @@ bus_matchmaker_remove_rule_link (DBusList       **rules,
 
 #ifdef DBUS_ENABLE_VERBOSE_MODE
   {
-    char *s = match_rule_to_string (rule);
+    char *s = bus_match_rule_to_string (rule);
 
     _dbus_verbose ("Removed match rule %s for connection %p\n",
                    s ? s : "nomem", rule->matches_go_to);
@@ -1596,7 +1874,7 @@ bus_matchmaker_remove_rule (BusMatchmaker   *matchmaker,
 
 #ifdef DBUS_ENABLE_VERBOSE_MODE
   {
-    char *s = match_rule_to_string (rule);
+    char *s = bus_match_rule_to_string (rule);
 
     _dbus_verbose ("Removed match rule %s for connection %p\n",
                    s ? s : "nomem", rule->matches_go_to);
@@ -1660,6 +1938,51 @@ bus_matchmaker_remove_rule_by_value (BusMatchmaker   *matchmaker,
   return TRUE;
 }
 
+/* Find the most recently added rule which is equal to the given rule by
+ * value, ignoring the first n_skip rules in skip; NULL if there is none.
+ * The returned rule is still owned by the matchmaker.
+ */
+BusMatchRule *
+bus_matchmaker_lookup_rule_by_value (BusMatchmaker   *matchmaker,
+                                     BusMatchRule    *value,
+                                     BusMatchRule   **skip,
+                                     int              n_skip)
+{
+  DBusList **rules;
+  DBusList *link;
+
+  rules = bus_matchmaker_get_rules (matchmaker, value->message_type,
+      value->interface, FALSE);
+
+  if (rules == NULL)
+    return NULL;
+
+  /* backwards, for the same reason as bus_matchmaker_remove_rule_by_value() */
+  link = _dbus_list_get_last_link (rules);
+  while (link != NULL)
+    {
+      BusMatchRule *rule = link->data;
+
+      if (match_rule_equal (rule, value))
+        {
+          int i;
+
+          for (i = 0; i < n_skip; i++)
+            {
+              if (skip[i] == rule)
+                break;
+            }
+
+          if (i == n_skip)
+            return rule;
+        }
+
+      link = _dbus_list_get_prev_link (rules, link);
+    }
+
+  return NULL;
+}
+
 static void
 rule_list_remove_by_connection (DBusList       **rules,
                                 DBusConnection  *connection)
@@ -2073,7 +2396,7 @@ get_recipients_from_list (DBusList       **rules,
 
 #ifdef DBUS_ENABLE_VERBOSE_MODE
       {
-        char *s = match_rule_to_string (rule);
+        char *s = bus_match_rule_to_string (rule);
 
         _dbus_verbose ("Checking whether message matches rule %s for connection %p\n",
                        s ? s : "nomem", rule->matches_go_to);
@@ -2087,6 +2410,20 @@ get_recipients_from_list (DBusList       **rules,
         {
           _dbus_verbose ("Rule matched\n");
 
+          if (rule->flags & BUS_MATCH_SAMPLE)
+            {
+              dbus_uint32_t count = rule->sample_count;
+
+              rule->sample_count = (count + 1) % rule->sample_interval;
+
+              if (count != 0)
+                {
+                  _dbus_verbose ("Message not sampled by this rule\n");
+                  link = _dbus_list_get_next_link (rules, link);
+                  continue;
+                }
+            }
+
           /* Append to the list if we haven't already */
           if (bus_connection_mark_stamp (rule->matches_go_to))
             {
@@ -2169,6 +2506,7 @@ bus_matchmaker_get_recipients (BusMatchmaker   *matchmaker,
 
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
 #include "test.h"
+#include <stdio.h>
 #include <stdlib.h>
 
 static BusMatchRule*
@@ -2458,6 +2796,35 @@ test_parsing (void *data)
   rule = check_parse (FALSE, "arg30='foo',arg30='bar'");
   _dbus_assert (rule == NULL);
   
+  /* Sampling, which only monitors may use */
+  rule = check_parse (TRUE, "type='signal',sample='3'");
+  if (rule != NULL)
+    {
+      _dbus_assert (rule->flags == (BUS_MATCH_MESSAGE_TYPE | BUS_MATCH_SAMPLE));
+      _dbus_assert (bus_match_rule_get_sample_interval (rule) == 3);
+
+      bus_match_rule_unref (rule);
+    }
+
+  /* Sampling every message is the same as not sampling */
+  rule = check_parse (TRUE, "sample='1'");
+  if (rule != NULL)
+    {
+      _dbus_assert (rule->flags == 0);
+      _dbus_assert (bus_match_rule_get_sample_interval (rule) == 1);
+
+      bus_match_rule_unref (rule);
+    }
+
+  rule = check_parse (FALSE, "sample='0'");
+  _dbus_assert (rule == NULL);
+  rule = check_parse (FALSE, "sample='often'");
+  _dbus_assert (rule == NULL);
+  rule = check_parse (FALSE, "sample='5x'");
+  _dbus_assert (rule == NULL);
+  rule = check_parse (FALSE, "sample='2',sample='3'");
+  _dbus_assert (rule == NULL);
+
   /* Reject broken keys */
   rule = check_parse (FALSE, "blah='signal'");
   _dbus_assert (rule == NULL);
@@ -2546,10 +2913,10 @@ test_equality (void)
           exit (1);
         }
 
-      /* Check match_rule_to_string */
-      first_str = match_rule_to_string (first);
+      /* Check bus_match_rule_to_string */
+      first_str = bus_match_rule_to_string (first);
       _dbus_assert (first_str != NULL);
-      second_str = match_rule_to_string (second);
+      second_str = bus_match_rule_to_string (second);
       _dbus_assert (second_str != NULL);
       _dbus_assert (strcmp (first_str, second_str) == 0);
       first_reparsed = check_parse (TRUE, first_str);
@@ -2717,6 +3084,62 @@ check_matching (DBusMessage *message,
     }
 }
 
+static void
+test_rule_cache (void)
+{
+  BusMatchmaker *matchmaker;
+  BusMatchRule *template;
+  BusMatchRule *first;
+  BusMatchRule *second;
+  BusMatchRule *uncached;
+  char text[64];
+  int i;
+
+  matchmaker = bus_matchmaker_new ();
+  _dbus_assert (matchmaker != NULL);
+
+  /* Overfill the cache: the oldest entries must be evicted */
+  for (i = 0; i < BUS_MATCH_RULE_CACHE_SIZE + 10; i++)
+    {
+      snprintf (text, sizeof (text), "type='signal',member='Member%d'", i);
+      template = check_parse (TRUE, text);
+      _dbus_assert (template != NULL);
+      rule_cache_insert (matchmaker, text, template);
+      bus_match_rule_unref (template);
+    }
+
+  _dbus_assert (_dbus_hash_table_get_n_entries (matchmaker->rule_cache) ==
+                BUS_MATCH_RULE_CACHE_SIZE);
+  _dbus_assert (rule_cache_lookup (matchmaker,
+                                   "type='signal',member='Member0'") == NULL);
+
+  template = rule_cache_lookup (matchmaker, text);
+  _dbus_assert (template != NULL);
+
+  /* Rules made from the same template are equal to each other and to
+   * the same text parsed from scratch */
+  first = match_rule_new_from_template (NULL, template);
+  second = match_rule_new_from_template (NULL, template);
+  _dbus_assert (first != NULL && second != NULL);
+  _dbus_assert (match_rule_equal (first, second));
+
+  uncached = check_parse (TRUE, text);
+  _dbus_assert (uncached != NULL);
+  _dbus_assert (match_rule_equal (first, uncached));
+  _dbus_assert (match_rule_equal (uncached, second));
+  _dbus_assert (strcmp (first->member, uncached->member) == 0);
+  bus_match_rule_unref (uncached);
+
+  /* Instances keep their template alive after it leaves the cache */
+  bus_match_rule_ref (template);
+  bus_matchmaker_unref (matchmaker);
+  bus_match_rule_unref (template);
+  _dbus_assert (strcmp (second->member, first->member) == 0);
+
+  bus_match_rule_unref (first);
+  bus_match_rule_unref (second);
+}
+
 static void
 test_matching (void)
 {
@@ -2962,6 +3385,7 @@ bus_signals_test (const DBusString *test_data_dir)
     _dbus_assert_not_reached ("Parsing match rules test failed");
 
   test_equality ();
+  test_rule_cache ();
   test_matching ();
   test_path_matching ();
   test_matching_path_namespace ();
@@ -39,7 +39,8 @@ typedef enum
   BUS_MATCH_PATH                    = 1 << 5,
   BUS_MATCH_ARGS                    = 1 << 6,
   BUS_MATCH_PATH_NAMESPACE          = 1 << 7,
-  BUS_MATCH_CLIENT_IS_EAVESDROPPING = 1 << 8
+  BUS_MATCH_CLIENT_IS_EAVESDROPPING = 1 << 8,
+  BUS_MATCH_SAMPLE                  = 1 << 9
 } BusMatchFlags;
 
 BusMatchRule* bus_match_rule_new   (DBusConnection *matches_go_to);
@@ -75,9 +76,16 @@ void bus_match_rule_set_client_is_eavesdropping (BusMatchRule     *rule,
 
 dbus_bool_t bus_match_rule_get_client_is_eavesdropping (BusMatchRule *rule);
 
+/* A rule with a sample interval of N only delivers every Nth message
+ * it matches; this is only meaningful for monitors. */
+void         bus_match_rule_set_sample_interval (BusMatchRule *rule,
+                                                 dbus_uint32_t interval);
+dbus_uint32_t bus_match_rule_get_sample_interval (BusMatchRule *rule);
+
 BusMatchRule* bus_match_rule_parse (DBusConnection   *matches_go_to,
                                     const DBusString *rule_text,
                                     DBusError        *error);
+char*         bus_match_rule_to_string (BusMatchRule *rule);
 
 #ifdef DBUS_ENABLE_STATS
 dbus_bool_t bus_match_rule_dump (BusMatchmaker *matchmaker,
@@ -96,6 +104,10 @@ dbus_bool_t bus_matchmaker_remove_rule_by_value (BusMatchmaker   *matchmaker,
                                                  DBusError       *error);
 void        bus_matchmaker_remove_rule          (BusMatchmaker   *matchmaker,
                                                  BusMatchRule    *rule);
+BusMatchRule *bus_matchmaker_lookup_rule_by_value (BusMatchmaker  *matchmaker,
+                                                   BusMatchRule   *value,
+                                                   BusMatchRule  **skip,
+                                                   int             n_skip);
 void        bus_matchmaker_disconnected         (BusMatchmaker   *matchmaker,
                                                  DBusConnection  *connection);
 dbus_bool_t bus_matchmaker_get_recipients       (BusMatchmaker   *matchmaker,
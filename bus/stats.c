@@ -36,6 +36,51 @@
 
 #ifdef DBUS_ENABLE_STATS
 
+/* For each subsystem Foo, adds FooMemoryBytes, PeakFooMemoryBytes
+ * and FooAllocations */
+static dbus_bool_t
+add_memory_tag_stats (DBusMessageIter *arr_iter)
+{
+  DBusString key;
+  int tag;
+
+  if (!_dbus_string_init (&key))
+    return FALSE;
+
+  for (tag = 0; tag < _DBUS_N_MEM_TAGS; tag++)
+    {
+      const char *name = _dbus_mem_tag_to_string (tag);
+      dbus_uint32_t live_bytes, peak_bytes, n_allocations;
+
+      _dbus_mem_tag_get_stats (tag, &live_bytes, &peak_bytes, &n_allocations);
+
+      _dbus_string_set_length (&key, 0);
+      if (!_dbus_string_append_printf (&key, "%sMemoryBytes", name) ||
+          !_dbus_asv_add_uint32 (arr_iter, _dbus_string_get_const_data (&key),
+                                 live_bytes))
+        goto oom;
+
+      _dbus_string_set_length (&key, 0);
+      if (!_dbus_string_append_printf (&key, "Peak%sMemoryBytes", name) ||
+          !_dbus_asv_add_uint32 (arr_iter, _dbus_string_get_const_data (&key),
+                                 peak_bytes))
+        goto oom;
+
+      _dbus_string_set_length (&key, 0);
+      if (!_dbus_string_append_printf (&key, "%sAllocations", name) ||
+          !_dbus_asv_add_uint32 (arr_iter, _dbus_string_get_const_data (&key),
+                                 n_allocations))
+        goto oom;
+    }
+
+  _dbus_string_free (&key);
+  return TRUE;
+
+oom:
+  _dbus_string_free (&key);
+  return FALSE;
+}
+
 dbus_bool_t
 bus_stats_handle_get_stats (DBusConnection *connection,
                             BusTransaction *transaction,
@@ -98,6 +143,14 @@ bus_stats_handle_get_stats (DBusConnection *connection,
       goto oom;
     }
 
+  /* Memory, by subsystem */
+
+  if (!add_memory_tag_stats (&arr_iter))
+    {
+      _dbus_asv_abandon (&iter, &arr_iter);
+      goto oom;
+    }
+
   /* end */
 
   if (!_dbus_asv_close (&iter, &arr_iter))
@@ -199,7 +252,9 @@ bus_stats_handle_get_connection_stats (DBusConnection *caller_connection,
       !_dbus_asv_add_uint32 (&arr_iter, "OutgoingBytes", out_bytes) ||
       !_dbus_asv_add_uint32 (&arr_iter, "OutgoingFDs", out_fds) ||
       !_dbus_asv_add_uint32 (&arr_iter, "PeakOutgoingBytes", out_peak_bytes) ||
-      !_dbus_asv_add_uint32 (&arr_iter, "PeakOutgoingFDs", out_peak_fds))
+      !_dbus_asv_add_uint32 (&arr_iter, "PeakOutgoingFDs", out_peak_fds) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "MemoryFootprint",
+        bus_connection_get_memory_footprint (stats_connection)))
     {
       _dbus_asv_abandon (&iter, &arr_iter);
       goto oom;
@@ -130,6 +130,15 @@ main (int argc, char **argv)
       test_post_hook ();
     }
 
+  if (only == NULL || strcmp (only, "user-cache") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running user cache test\n", argv[0]);
+      if (!bus_user_cache_test (&test_data_dir))
+        die ("user cache");
+      test_post_hook ();
+    }
+
   if (only == NULL || strcmp (only, "config-parser") == 0)
     {
       test_pre_hook ();
@@ -148,6 +157,15 @@ main (int argc, char **argv)
       test_post_hook ();
     }
 
+  if (only == NULL || strcmp (only, "transactions") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running transaction test\n", argv[0]);
+      if (!bus_transaction_test (&test_data_dir))
+        die ("transactions");
+      test_post_hook ();
+    }
+
   if (only == NULL || strcmp (only, "dispatch-sha1") == 0)
     {
       test_pre_hook ();
@@ -166,6 +184,26 @@ main (int argc, char **argv)
       test_post_hook ();
     }
 
+#ifdef DBUS_UNIX
+  if (only == NULL || strcmp (only, "io-workers") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running I/O worker threads test\n", argv[0]);
+      if (!bus_dispatch_io_workers_test (&test_data_dir))
+        die ("io workers");
+      test_post_hook ();
+    }
+
+  if (only == NULL || strcmp (only, "handoff") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running hand-off test\n", argv[0]);
+      if (!bus_handoff_test (&test_data_dir))
+        die ("handoff");
+      test_post_hook ();
+    }
+#endif
+
   if (only == NULL || strcmp (only, "activation-service-reload") == 0)
     {
       test_pre_hook ();
@@ -175,6 +213,17 @@ main (int argc, char **argv)
       test_post_hook ();
     }
 
+#ifdef DBUS_BUS_ENABLE_INOTIFY
+  if (only == NULL || strcmp (only, "dir-watch") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running directory watch test\n", argv[0]);
+      if (!bus_dir_watch_test (&test_data_dir))
+        die ("directory watch");
+      test_post_hook ();
+    }
+#endif
+
 #ifdef HAVE_UNIX_FD_PASSING
   if (only == NULL || strcmp (only, "unix-fds-passing") == 0)
     {
@@ -36,7 +36,10 @@ dbus_bool_t bus_config_parser_test    (const DBusString             *test_data_d
 dbus_bool_t bus_config_parser_trivial_test (const DBusString        *test_data_dir);
 dbus_bool_t bus_signals_test          (const DBusString             *test_data_dir);
 dbus_bool_t bus_expire_list_test      (const DBusString             *test_data_dir);
+dbus_bool_t bus_user_cache_test       (const DBusString             *test_data_dir);
 dbus_bool_t bus_activation_service_reload_test (const DBusString    *test_data_dir);
+dbus_bool_t bus_dir_watch_test        (const DBusString             *test_data_dir);
+dbus_bool_t bus_transaction_test      (const DBusString             *test_data_dir);
 dbus_bool_t bus_setup_debug_client    (DBusConnection               *connection);
 void        bus_test_clients_foreach  (BusConnectionForeachFunction  function,
                                        void                         *data);
@@ -48,6 +51,11 @@ void        bus_test_run_everything   (BusContext                   *context);
 BusContext* bus_context_new_test      (const DBusString             *test_data_dir,
                                        const char                   *filename);
 
+#ifdef DBUS_UNIX
+dbus_bool_t bus_dispatch_io_workers_test (const DBusString          *test_data_dir);
+dbus_bool_t bus_handoff_test          (const DBusString             *test_data_dir);
+#endif
+
 #ifdef HAVE_UNIX_FD_PASSING
 dbus_bool_t bus_unix_fds_passing_test (const DBusString             *test_data_dir);
 #endif
@@ -0,0 +1,549 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* usercache.c  Cache of uid to group list lookups
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "usercache.h"
+#include "test.h"
+
+#include <dbus/dbus-hash.h>
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-list.h>
+#include <dbus/dbus-sysdeps.h>
+
+#include <string.h>
+
+#ifdef DBUS_UNIX
+#include <pthread.h>
+#include <signal.h>
+#include <dbus/dbus-sysdeps-unix.h>
+#include <dbus/dbus-threads-internal.h>
+#endif
+
+/* Looking up a user's groups goes through NSS, which may be backed by
+ * LDAP or SSSD and take a long time to answer. The daemon is single
+ * threaded, so every such lookup stalls all bus traffic.
+ *
+ * We keep the answer for each uid for ttl seconds. Once an entry has
+ * expired, the stale answer keeps being used while a worker thread
+ * looks it up again in the background. A reload forgets everything,
+ * so that a change to the user database is never hidden behind an
+ * answer from before the reload.
+ *
+ * This only warms the cache off the main loop; it does not make
+ * lookups asynchronous. The first lookup of a uid still blocks,
+ * because the allow-unix-user callback that needs it must answer
+ * during authentication and has no way to say "ask me later".
+ */
+
+typedef struct
+{
+  unsigned long uid;
+  dbus_gid_t *group_ids;
+  int n_group_ids;
+  long expires;                      /**< monotonic time in seconds */
+  unsigned int found : 1;            /**< FALSE if the uid does not exist */
+  unsigned int refresh_pending : 1;  /**< queued for the worker */
+} BusUserCacheEntry;
+
+struct BusUserCache
+{
+  int ttl;
+  DBusHashTable *entries;   /**< uid -> BusUserCacheEntry */
+#ifdef DBUS_UNIX
+  DBusCMutex *lock;         /**< protects everything below and the entries */
+  DBusCondVar *queue_cond;  /**< signalled when queue or shutdown change */
+  DBusList *queue;          /**< uids waiting to be looked up again */
+  unsigned int generation;  /**< bumped by each flush */
+  pthread_t worker;
+  unsigned int have_worker : 1;
+  unsigned int shutdown : 1;
+#endif
+};
+
+#ifdef DBUS_UNIX
+#define LOCK(cache)   _dbus_cmutex_lock ((cache)->lock)
+#define UNLOCK(cache) _dbus_cmutex_unlock ((cache)->lock)
+#else
+#define LOCK(cache)
+#define UNLOCK(cache)
+#endif
+
+static void
+free_entry (void *data)
+{
+  BusUserCacheEntry *entry = data;
+
+  if (entry == NULL)
+    return;
+
+  dbus_free (entry->group_ids);
+  dbus_free (entry);
+}
+
+static long
+now_seconds (void)
+{
+  long tv_sec, tv_usec;
+
+  _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+
+  return tv_sec;
+}
+
+/* Returns FALSE on OOM. Otherwise *found says whether the uid exists,
+ * and if it does the caller owns *group_ids.
+ */
+static dbus_bool_t
+resolve_groups (unsigned long   uid,
+                dbus_bool_t    *found,
+                dbus_gid_t    **group_ids,
+                int            *n_group_ids)
+{
+#ifdef DBUS_UNIX
+  DBusUserInfo info;
+  DBusError error = DBUS_ERROR_INIT;
+
+  *found = FALSE;
+  *group_ids = NULL;
+  *n_group_ids = 0;
+
+  if (!_dbus_user_info_fill_uid (&info, uid, &error))
+    {
+      dbus_bool_t oom;
+
+      oom = dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY);
+      dbus_error_free (&error);
+      _dbus_user_info_free (&info);
+      return !oom;
+    }
+
+  *found = TRUE;
+  *group_ids = info.group_ids;
+  *n_group_ids = info.n_group_ids;
+  info.group_ids = NULL;
+  _dbus_user_info_free (&info);
+  return TRUE;
+#else
+  *found = _dbus_unix_groups_from_uid (uid, group_ids, n_group_ids);
+  return TRUE;
+#endif
+}
+
+static void
+entry_store (BusUserCacheEntry *entry,
+             int                ttl,
+             dbus_bool_t        found,
+             dbus_gid_t        *group_ids,
+             int                n_group_ids)
+{
+  dbus_free (entry->group_ids);
+  entry->found = found != FALSE;
+  entry->group_ids = group_ids;
+  entry->n_group_ids = n_group_ids;
+  entry->expires = now_seconds () + ttl;
+}
+
+/* Returns FALSE if the uid does not exist or on OOM, like
+ * _dbus_unix_groups_from_uid().
+ */
+static dbus_bool_t
+entry_copy_groups (BusUserCacheEntry  *entry,
+                   unsigned long     **group_ids,
+                   int                *n_group_ids)
+{
+  if (!entry->found)
+    return FALSE;
+
+  if (entry->n_group_ids > 0)
+    {
+      *group_ids = dbus_new (unsigned long, entry->n_group_ids);
+      if (*group_ids == NULL)
+        return FALSE;
+
+      memcpy (*group_ids, entry->group_ids,
+              entry->n_group_ids * sizeof (unsigned long));
+    }
+
+  *n_group_ids = entry->n_group_ids;
+  return TRUE;
+}
+
+#ifdef DBUS_UNIX
+static void *
+refresh_thread_main (void *data)
+{
+  BusUserCache *cache = data;
+
+  LOCK (cache);
+
+  while (TRUE)
+    {
+      BusUserCacheEntry *entry;
+      unsigned long uid;
+      unsigned int generation;
+      dbus_bool_t ok, found;
+      dbus_gid_t *group_ids;
+      int n_group_ids;
+
+      while (cache->queue == NULL && !cache->shutdown)
+        _dbus_condvar_wait (cache->queue_cond, cache->lock);
+
+      if (cache->shutdown)
+        break;
+
+      uid = (unsigned long) _dbus_list_pop_first (&cache->queue);
+      generation = cache->generation;
+
+      UNLOCK (cache);
+      ok = resolve_groups (uid, &found, &group_ids, &n_group_ids);
+      LOCK (cache);
+
+      /* the cache may have been flushed while we were looking */
+      if (generation == cache->generation)
+        entry = _dbus_hash_table_lookup_uintptr (cache->entries, uid);
+      else
+        entry = NULL;
+
+      if (entry != NULL)
+        {
+          entry->refresh_pending = FALSE;
+
+          /* on OOM keep the old answer; the next lookup retries */
+          if (ok)
+            {
+              entry_store (entry, cache->ttl, found, group_ids, n_group_ids);
+              group_ids = NULL;
+            }
+        }
+
+      dbus_free (group_ids);
+    }
+
+  UNLOCK (cache);
+  return NULL;
+}
+
+static dbus_bool_t
+start_worker (BusUserCache *cache)
+{
+  sigset_t all, old;
+  int result;
+
+  if (cache->have_worker)
+    return TRUE;
+
+  /* signals are for the main loop; don't let the worker take them */
+  sigfillset (&all);
+  pthread_sigmask (SIG_SETMASK, &all, &old);
+  result = pthread_create (&cache->worker, NULL, refresh_thread_main, cache);
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+
+  if (result != 0)
+    {
+      _dbus_verbose ("Could not start user cache worker: %s\n",
+                     _dbus_strerror (result));
+      return FALSE;
+    }
+
+  cache->have_worker = TRUE;
+  return TRUE;
+}
+
+/* Called with the lock held. Returns FALSE if the entry could not
+ * be queued, in which case the caller looks it up itself.
+ */
+static dbus_bool_t
+queue_refresh (BusUserCache      *cache,
+               BusUserCacheEntry *entry)
+{
+  if (entry->refresh_pending)
+    return TRUE;
+
+  if (!start_worker (cache))
+    return FALSE;
+
+  if (!_dbus_list_append (&cache->queue, (void *) entry->uid))
+    return FALSE;
+
+  entry->refresh_pending = TRUE;
+  _dbus_condvar_wake_one (cache->queue_cond);
+  return TRUE;
+}
+#else
+static dbus_bool_t
+queue_refresh (BusUserCache      *cache,
+               BusUserCacheEntry *entry)
+{
+  return FALSE;
+}
+#endif
+
+BusUserCache*
+bus_user_cache_new (int ttl_seconds)
+{
+  BusUserCache *cache;
+
+  _dbus_assert (ttl_seconds >= 0);
+
+  cache = dbus_new0 (BusUserCache, 1);
+  if (cache == NULL)
+    return NULL;
+
+  cache->ttl = ttl_seconds;
+  cache->entries = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+                                         NULL, free_entry);
+  if (cache->entries == NULL)
+    goto failed;
+
+#ifdef DBUS_UNIX
+  _dbus_cmutex_new_at_location (&cache->lock);
+  if (cache->lock == NULL)
+    goto failed;
+
+  cache->queue_cond = _dbus_condvar_new ();
+  if (cache->queue_cond == NULL)
+    goto failed;
+#endif
+
+  return cache;
+
+ failed:
+  bus_user_cache_free (cache);
+  return NULL;
+}
+
+void
+bus_user_cache_free (BusUserCache *cache)
+{
+#ifdef DBUS_UNIX
+  if (cache->have_worker)
+    {
+      /* the worker may be stuck in NSS; waiting for it is no worse
+       * than what the daemon did before it had a worker
+       */
+      LOCK (cache);
+      cache->shutdown = TRUE;
+      _dbus_condvar_wake_one (cache->queue_cond);
+      UNLOCK (cache);
+
+      pthread_join (cache->worker, NULL);
+    }
+
+  _dbus_list_clear (&cache->queue);
+
+  if (cache->queue_cond)
+    _dbus_condvar_free (cache->queue_cond);
+
+  _dbus_cmutex_free_at_location (&cache->lock);
+#endif
+
+  if (cache->entries)
+    _dbus_hash_table_unref (cache->entries);
+
+  dbus_free (cache);
+}
+
+/**
+ * Forgets everything we know, so that changes to the user database
+ * are picked up on reload. Stale answers are only served for entries
+ * whose ttl ran out, never after a flush. A lookup that is in progress
+ * in the worker is discarded when it completes.
+ */
+void
+bus_user_cache_flush (BusUserCache *cache)
+{
+  LOCK (cache);
+
+  _dbus_hash_table_remove_all (cache->entries);
+
+#ifdef DBUS_UNIX
+  _dbus_list_clear (&cache->queue);
+  cache->generation += 1;
+#endif
+
+  UNLOCK (cache);
+}
+
+/**
+ * Gets the groups of the given uid, from the cache if possible.
+ * Semantics are the same as _dbus_unix_groups_from_uid(): on success
+ * the caller owns the returned array, and #FALSE means either that
+ * the uid does not exist or that we ran out of memory.
+ */
+dbus_bool_t
+bus_user_cache_get_groups (BusUserCache   *cache,
+                           unsigned long   uid,
+                           unsigned long **group_ids,
+                           int            *n_group_ids)
+{
+  BusUserCacheEntry *entry;
+  dbus_bool_t found, retval;
+  dbus_gid_t *resolved;
+  int n_resolved;
+
+  *group_ids = NULL;
+  *n_group_ids = 0;
+
+  LOCK (cache);
+
+  entry = _dbus_hash_table_lookup_uintptr (cache->entries, uid);
+
+  /* serve a stale answer while the worker gets a fresh one */
+  if (entry != NULL &&
+      (entry->expires > now_seconds () || queue_refresh (cache, entry)))
+    {
+      retval = entry_copy_groups (entry, group_ids, n_group_ids);
+      UNLOCK (cache);
+      return retval;
+    }
+
+  UNLOCK (cache);
+
+  _dbus_verbose ("No cached groups for UID %lu, looking them up\n", uid);
+
+  if (!resolve_groups (uid, &found, &resolved, &n_resolved))
+    return FALSE;
+
+  LOCK (cache);
+
+  entry = _dbus_hash_table_lookup_uintptr (cache->entries, uid);
+  if (entry == NULL)
+    {
+      entry = dbus_new0 (BusUserCacheEntry, 1);
+
+      if (entry != NULL)
+        {
+          entry->uid = uid;
+
+          if (!_dbus_hash_table_insert_uintptr (cache->entries, uid, entry))
+            {
+              dbus_free (entry);
+              entry = NULL;
+            }
+        }
+    }
+
+  if (entry != NULL)
+    {
+      entry_store (entry, cache->ttl, found, resolved, n_resolved);
+      resolved = NULL;
+      retval = entry_copy_groups (entry, group_ids, n_group_ids);
+    }
+  else
+    {
+      /* couldn't cache it, but the answer is still good */
+      retval = found;
+      *group_ids = resolved;
+      *n_group_ids = n_resolved;
+      resolved = NULL;
+    }
+
+  UNLOCK (cache);
+
+  dbus_free (resolved);
+  return retval;
+}
+
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+
+static dbus_bool_t
+check_groups (BusUserCache  *cache,
+              unsigned long  uid,
+              unsigned long *expected,
+              int            n_expected)
+{
+  unsigned long *group_ids;
+  int n_group_ids;
+  dbus_bool_t ok;
+
+  if (!bus_user_cache_get_groups (cache, uid, &group_ids, &n_group_ids))
+    return FALSE;
+
+  ok = (n_group_ids == n_expected &&
+        (n_expected == 0 ||
+         memcmp (group_ids, expected,
+                 n_expected * sizeof (unsigned long)) == 0));
+
+  dbus_free (group_ids);
+  return ok;
+}
+
+dbus_bool_t
+bus_user_cache_test (const DBusString *test_data_dir)
+{
+  BusUserCache *cache;
+  unsigned long uid;
+  unsigned long *expected;
+  int n_expected;
+  int i;
+
+  uid = _dbus_getuid ();
+
+  if (!_dbus_unix_groups_from_uid (uid, &expected, &n_expected))
+    {
+      /* nothing we can compare against */
+      _dbus_verbose ("No groups for UID %lu, skipping test\n", uid);
+      return TRUE;
+    }
+
+  cache = bus_user_cache_new (3600);
+  if (cache == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  /* a miss, then a hit */
+  for (i = 0; i < 2; i++)
+    if (!check_groups (cache, uid, expected, n_expected))
+      _dbus_assert_not_reached ("cached groups differ from the user database");
+
+  bus_user_cache_flush (cache);
+
+  /* nothing from before the flush may be served */
+  if (_dbus_hash_table_get_n_entries (cache->entries) != 0)
+    _dbus_assert_not_reached ("flush kept an entry");
+
+  if (!check_groups (cache, uid, expected, n_expected))
+    _dbus_assert_not_reached ("groups differ after flush");
+
+  bus_user_cache_free (cache);
+
+  /* with a ttl of 0 every hit is stale and refreshed in the
+   * background; flushing under the worker must be harmless
+   */
+  cache = bus_user_cache_new (0);
+  if (cache == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  for (i = 0; i < 20; i++)
+    {
+      if (!check_groups (cache, uid, expected, n_expected))
+        _dbus_assert_not_reached ("stale groups differ from the user database");
+
+      if (i % 5 == 4)
+        bus_user_cache_flush (cache);
+    }
+
+  bus_user_cache_free (cache);
+  dbus_free (expected);
+
+  return TRUE;
+}
+
+#endif /* DBUS_ENABLE_EMBEDDED_TESTS */
@@ -0,0 +1,36 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* usercache.h  Cache of uid to group list lookups
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef BUS_USER_CACHE_H
+#define BUS_USER_CACHE_H
+
+#include <dbus/dbus.h>
+#include "bus.h"
+
+BusUserCache* bus_user_cache_new        (int             ttl_seconds);
+void          bus_user_cache_free       (BusUserCache   *cache);
+void          bus_user_cache_flush      (BusUserCache   *cache);
+dbus_bool_t   bus_user_cache_get_groups (BusUserCache   *cache,
+                                         unsigned long   uid,
+                                         unsigned long **group_ids,
+                                         int            *n_group_ids);
+
+#endif /* BUS_USER_CACHE_H */
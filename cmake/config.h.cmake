@@ -28,6 +28,9 @@
 
 #cmakedefine DBUS_ENABLE_STATS
 
+/* Which directory watch backend the bus uses */
+#cmakedefine DBUS_BUS_ENABLE_INOTIFY 1
+
 #define TEST_LISTEN       "@TEST_LISTEN@"
 
 // test binaries
@@ -225,6 +228,7 @@
 #cmakedefine   HAVE_PIPE2
 
 #cmakedefine HAVE_ACCEPT4 1
+#cmakedefine HAVE_DECL_SYS_PIDFD_OPEN 1
 #cmakedefine HAVE_DIRFD 1
 #cmakedefine HAVE_INOTIFY_INIT1 1
 #cmakedefine HAVE_UNIX_FD_PASSING 1
@@ -467,6 +467,29 @@ _dbus_auth_script_run (const DBusString *filename)
         {
           auth_set_unix_credentials (auth, 4312, DBUS_PID_UNSET);
         }
+      else if (_dbus_string_starts_with_c_str (&line,
+                                               "UNIX_FD_POSSIBLE"))
+        {
+          _dbus_auth_set_unix_fd_possible (auth, TRUE);
+        }
+      else if (_dbus_string_starts_with_c_str (&line,
+                                               "PIPELINE_NEGOTIATE"))
+        {
+          if (!_dbus_auth_client_pipeline (auth, FALSE))
+            {
+              _dbus_warn ("no memory to pipeline the handshake\n");
+              goto out;
+            }
+        }
+      else if (_dbus_string_starts_with_c_str (&line,
+                                               "PIPELINE"))
+        {
+          if (!_dbus_auth_client_pipeline (auth, TRUE))
+            {
+              _dbus_warn ("no memory to pipeline the handshake\n");
+              goto out;
+            }
+        }
       else if (_dbus_string_starts_with_c_str (&line,
                                                "ALLOWED_MECHS"))
         {
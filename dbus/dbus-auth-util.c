@@ -153,9 +153,49 @@ process_test_dirs (const char *test_data_dir)
   return retval;
 }
 
+/* Both sides of a conversation come from the same slab, so the storage
+ * of a server that went away is what the next client gets, and it must
+ * not carry anything over */
+static void
+check_auth_storage_shared (void)
+{
+  DBusString guid;
+  DBusAuth *keeper;
+  DBusAuth *server;
+  DBusAuth *client;
+
+  _dbus_string_init_const (&guid, "0123456789abcdef0123456789abcdef");
+
+  /* keeps the slab from being released when the server goes away */
+  keeper = _dbus_auth_client_new ();
+  if (keeper == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  server = _dbus_auth_server_new (&guid);
+  if (server == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  _dbus_auth_unref (server);
+
+  client = _dbus_auth_client_new ();
+  if (client == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  /* without mem pools every element is a separate malloc() */
+  if (!_dbus_disable_mem_pools ())
+    _dbus_assert ((void *) client == (void *) server);
+
+  _dbus_assert (_dbus_auth_get_guid_from_server (client) == NULL);
+  _dbus_assert (_dbus_auth_do_work (client) == DBUS_AUTH_STATE_HAVE_BYTES_TO_SEND);
+
+  _dbus_auth_unref (client);
+  _dbus_auth_unref (keeper);
+}
+
 dbus_bool_t
 _dbus_auth_test (const char *test_data_dir)
 {
+  check_auth_storage_shared ();
   
   if (test_data_dir == NULL)
     return TRUE;
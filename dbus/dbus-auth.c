@@ -30,6 +30,7 @@
 #include "dbus-sha.h"
 #include "dbus-protocol.h"
 #include "dbus-credentials.h"
+#include "dbus-mempool.h"
 
 /**
  * @defgroup DBusAuth Authentication
@@ -191,6 +192,7 @@ struct DBusAuth
 
   unsigned int unix_fd_possible : 1;  /**< This side could do unix fd passing */
   unsigned int unix_fd_negotiated : 1; /**< Unix fd was successfully negotiated */
+  unsigned int negotiate_unix_fd_unanswered : 1; /**< Client still expects an ERROR for a NEGOTIATE_UNIX_FD sent ahead of a rejected AUTH */
 };
 
 /**
@@ -220,6 +222,19 @@ typedef struct
   
 } DBusAuthServer;
 
+/**
+ * Storage for either side of a conversation, so that both can come
+ * from the same slab.
+ */
+typedef union
+{
+  DBusAuthClient client; /**< Client side */
+  DBusAuthServer server; /**< Server side */
+} DBusAuthStorage;
+
+static DBusSlab auth_slab =
+  _DBUS_SLAB_INIT (sizeof (DBusAuthStorage), DBUS_MEM_TAG_TRANSPORT);
+
 static void        goto_state                (DBusAuth                       *auth,
                                               const DBusAuthStateData        *new_state);
 static dbus_bool_t send_auth                 (DBusAuth *auth,
@@ -275,6 +290,15 @@ static dbus_bool_t handle_client_state_waiting_for_reject (DBusAuth         *aut
 static dbus_bool_t handle_client_state_waiting_for_agree_unix_fd (DBusAuth         *auth,
                                                            DBusAuthCommand   command,
                                                            const DBusString *args);
+static dbus_bool_t handle_client_state_waiting_for_ok_negotiate_sent (DBusAuth         *auth,
+                                                           DBusAuthCommand   command,
+                                                           const DBusString *args);
+static dbus_bool_t handle_client_state_waiting_for_ok_pipelined (DBusAuth         *auth,
+                                                           DBusAuthCommand   command,
+                                                           const DBusString *args);
+static dbus_bool_t handle_client_state_waiting_for_agree_unix_fd_pipelined (DBusAuth         *auth,
+                                                           DBusAuthCommand   command,
+                                                           const DBusString *args);
 
 static const DBusAuthStateData client_state_need_send_auth = {
   "NeedSendAuth", NULL
@@ -292,6 +316,18 @@ static const DBusAuthStateData client_state_waiting_for_agree_unix_fd = {
   "WaitingForAgreeUnixFD", handle_client_state_waiting_for_agree_unix_fd
 };
 
+/* NEGOTIATE_UNIX_FD has already been sent in this one, and BEGIN as well
+ * in the two after it: see _dbus_auth_client_pipeline() */
+static const DBusAuthStateData client_state_waiting_for_ok_negotiate_sent = {
+  "WaitingForOKNegotiateSent", handle_client_state_waiting_for_ok_negotiate_sent
+};
+static const DBusAuthStateData client_state_waiting_for_ok_pipelined = {
+  "WaitingForOKPipelined", handle_client_state_waiting_for_ok_pipelined
+};
+static const DBusAuthStateData client_state_waiting_for_agree_unix_fd_pipelined = {
+  "WaitingForAgreeUnixFDPipelined", handle_client_state_waiting_for_agree_unix_fd_pipelined
+};
+
 /**
  * Common terminal states.  Terminal states have handler == NULL.
  */
@@ -339,7 +375,9 @@ _dbus_auth_new (int size)
 {
   DBusAuth *auth;
   
-  auth = dbus_malloc0 (size);
+  _dbus_assert (size <= (int) sizeof (DBusAuthStorage));
+
+  auth = _dbus_slab_alloc (&auth_slab);
   if (auth == NULL)
     return NULL;
   
@@ -356,19 +394,19 @@ _dbus_auth_new (int size)
    * overlong buffers in _dbus_auth_do_work().
    */
   
-  if (!_dbus_string_init (&auth->incoming))
+  if (!_dbus_string_init_tagged (&auth->incoming, 0, DBUS_MEM_TAG_TRANSPORT))
     goto enomem_0;
 
-  if (!_dbus_string_init (&auth->outgoing))
+  if (!_dbus_string_init_tagged (&auth->outgoing, 0, DBUS_MEM_TAG_TRANSPORT))
     goto enomem_1;
     
-  if (!_dbus_string_init (&auth->identity))
+  if (!_dbus_string_init_tagged (&auth->identity, 0, DBUS_MEM_TAG_TRANSPORT))
     goto enomem_2;
 
-  if (!_dbus_string_init (&auth->context))
+  if (!_dbus_string_init_tagged (&auth->context, 0, DBUS_MEM_TAG_TRANSPORT))
     goto enomem_3;
 
-  if (!_dbus_string_init (&auth->challenge))
+  if (!_dbus_string_init_tagged (&auth->challenge, 0, DBUS_MEM_TAG_TRANSPORT))
     goto enomem_4;
 
   /* default context if none is specified */
@@ -410,7 +448,7 @@ _dbus_auth_new (int size)
  enomem_1:
   _dbus_string_free (&auth->incoming);
  enomem_0:
-  dbus_free (auth);
+  _dbus_slab_dealloc (&auth_slab, auth);
   return NULL;
 }
 
@@ -1566,10 +1604,13 @@ send_begin (DBusAuth         *auth)
   return TRUE;
 }
 
+/* Stores the GUID given by the server in its OK command. A malformed
+ * GUID moves to the need-disconnect state; returns #FALSE if no memory.
+ */
 static dbus_bool_t
-process_ok(DBusAuth *auth,
-          const DBusString *args_from_ok) {
-
+record_guid_from_ok (DBusAuth         *auth,
+                     const DBusString *args_from_ok)
+{
   int end_of_hex;
   
   /* "args_from_ok" should be the GUID, whitespace already pulled off the front */
@@ -1602,11 +1643,39 @@ process_ok(DBusAuth *auth,
   _dbus_verbose ("Got GUID '%s' from the server\n",
                  _dbus_string_get_const_data (& DBUS_AUTH_CLIENT (auth)->guid_from_server));
 
+  return TRUE;
+}
+
+static dbus_bool_t
+process_ok(DBusAuth *auth,
+          const DBusString *args_from_ok) {
+
+  if (!record_guid_from_ok (auth, args_from_ok))
+    return FALSE;
+
+  if (auth->state == &common_state_need_disconnect)
+    return TRUE;
+
   if (auth->unix_fd_possible)
-    return send_negotiate_unix_fd(auth);
+    {
+      if (!send_negotiate_unix_fd (auth))
+        {
+          _dbus_string_set_length (& DBUS_AUTH_CLIENT (auth)->guid_from_server, 0);
+          return FALSE;
+        }
+
+      return TRUE;
+    }
+
+  _dbus_verbose ("Not negotiating unix fd passing, since not possible\n");
 
-  _dbus_verbose("Not negotiating unix fd passing, since not possible\n");
-  return send_begin (auth);
+  if (!send_begin (auth))
+    {
+      _dbus_string_set_length (& DBUS_AUTH_CLIENT (auth)->guid_from_server, 0);
+      return FALSE;
+    }
+
+  return TRUE;
 }
 
 static dbus_bool_t
@@ -2120,6 +2189,118 @@ handle_client_state_waiting_for_agree_unix_fd(DBusAuth         *auth,
     }
 }
 
+static dbus_bool_t
+handle_client_state_waiting_for_ok_negotiate_sent (DBusAuth         *auth,
+                                                   DBusAuthCommand   command,
+                                                   const DBusString *args)
+{
+  switch (command)
+    {
+    case DBUS_AUTH_COMMAND_OK:
+      if (!record_guid_from_ok (auth, args))
+        return FALSE;
+
+      if (auth->state == &common_state_need_disconnect)
+        return TRUE;
+
+      /* The AGREE_UNIX_FD or ERROR for the NEGOTIATE_UNIX_FD is next */
+      goto_state (auth, &client_state_waiting_for_agree_unix_fd);
+      return TRUE;
+
+    case DBUS_AUTH_COMMAND_REJECTED:
+    case DBUS_AUTH_COMMAND_DATA:
+    case DBUS_AUTH_COMMAND_ERROR:
+    case DBUS_AUTH_COMMAND_AUTH:
+    case DBUS_AUTH_COMMAND_CANCEL:
+    case DBUS_AUTH_COMMAND_BEGIN:
+    case DBUS_AUTH_COMMAND_UNKNOWN:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    default:
+      /* The server did not accept the AUTH straight away, so it will
+       * answer the NEGOTIATE_UNIX_FD behind it with an ERROR once it
+       * gets to it; carry on as if that had never been sent. */
+      auth->negotiate_unix_fd_unanswered = TRUE;
+      return handle_client_state_waiting_for_data (auth, command, args);
+    }
+}
+
+static dbus_bool_t
+handle_client_state_waiting_for_ok_pipelined (DBusAuth         *auth,
+                                              DBusAuthCommand   command,
+                                              const DBusString *args)
+{
+  switch (command)
+    {
+    case DBUS_AUTH_COMMAND_OK:
+      if (!record_guid_from_ok (auth, args))
+        return FALSE;
+
+      if (auth->state == &common_state_need_disconnect)
+        return TRUE;
+
+      /* NEGOTIATE_UNIX_FD was sent along with AUTH if this is set */
+      if (auth->unix_fd_possible)
+        goto_state (auth, &client_state_waiting_for_agree_unix_fd_pipelined);
+      else
+        goto_state (auth, &common_state_authenticated);
+
+      return TRUE;
+
+    case DBUS_AUTH_COMMAND_REJECTED:
+    case DBUS_AUTH_COMMAND_DATA:
+    case DBUS_AUTH_COMMAND_ERROR:
+    case DBUS_AUTH_COMMAND_AUTH:
+    case DBUS_AUTH_COMMAND_CANCEL:
+    case DBUS_AUTH_COMMAND_BEGIN:
+    case DBUS_AUTH_COMMAND_UNKNOWN:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    default:
+      /* The server has already been sent BEGIN and maybe some messages,
+       * so there is no way to fall back to another mechanism. */
+      _dbus_verbose ("%s: server did not accept pipelined EXTERNAL authentication\n",
+                     DBUS_AUTH_NAME (auth));
+      goto_state (auth, &common_state_need_disconnect);
+      return TRUE;
+    }
+}
+
+static dbus_bool_t
+handle_client_state_waiting_for_agree_unix_fd_pipelined (DBusAuth         *auth,
+                                                         DBusAuthCommand   command,
+                                                         const DBusString *args)
+{
+  switch (command)
+    {
+    case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+      _dbus_assert(auth->unix_fd_possible);
+      auth->unix_fd_negotiated = TRUE;
+      _dbus_verbose("Successfully negotiated UNIX FD passing\n");
+      goto_state (auth, &common_state_authenticated);
+      return TRUE;
+
+    case DBUS_AUTH_COMMAND_ERROR:
+      _dbus_assert(auth->unix_fd_possible);
+      auth->unix_fd_negotiated = FALSE;
+      _dbus_verbose("Failed to negotiate UNIX FD passing\n");
+      goto_state (auth, &common_state_authenticated);
+      return TRUE;
+
+    case DBUS_AUTH_COMMAND_OK:
+    case DBUS_AUTH_COMMAND_DATA:
+    case DBUS_AUTH_COMMAND_REJECTED:
+    case DBUS_AUTH_COMMAND_AUTH:
+    case DBUS_AUTH_COMMAND_CANCEL:
+    case DBUS_AUTH_COMMAND_BEGIN:
+    case DBUS_AUTH_COMMAND_UNKNOWN:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    default:
+      goto_state (auth, &common_state_need_disconnect);
+      return TRUE;
+    }
+}
+
 /**
  * Mapping from command name to enum
  */
@@ -2231,6 +2412,17 @@ process_command (DBusAuth *auth)
    */
   
   command = lookup_command_from_name (&line);
+
+  /* See handle_client_state_waiting_for_ok_negotiate_sent() */
+  if (auth->negotiate_unix_fd_unanswered &&
+      command == DBUS_AUTH_COMMAND_ERROR)
+    {
+      _dbus_verbose ("%s: dropping the reply to the early NEGOTIATE_UNIX_FD\n",
+                     DBUS_AUTH_NAME (auth));
+      auth->negotiate_unix_fd_unanswered = FALSE;
+      goto next_command;
+    }
+
   if (!(* auth->state->handler) (auth, command, &args))
     goto out;
 
@@ -2411,10 +2603,91 @@ _dbus_auth_unref (DBusAuth *auth)
       _dbus_credentials_unref (auth->authorized_identity);
       _dbus_credentials_unref (auth->desired_identity);
       
-      dbus_free (auth);
+      _dbus_slab_dealloc (&auth_slab, auth);
     }
 }
 
+/**
+ * Client side only: sends NEGOTIATE_UNIX_FD (if fd passing is possible)
+ * straight after the initial AUTH EXTERNAL, without waiting for the
+ * server to accept it. If the server rejects EXTERNAL, the ERROR it
+ * sends back for the early NEGOTIATE_UNIX_FD is dropped and the client
+ * falls back to the next mechanism as usual.
+ *
+ * With through_begin, BEGIN is sent as well, and messages may then be
+ * sent right behind it (see _dbus_auth_is_pipelining()), so that the
+ * whole handshake and the first method call take a single round trip.
+ * That must only be used with a server that is known to accept
+ * EXTERNAL: a server that rejects it disconnects as soon as it reads
+ * the BEGIN, so there is nothing left to fall back on.
+ *
+ * Does nothing if the conversation has already moved past its first
+ * AUTH EXTERNAL.
+ *
+ * @param auth the auth conversation
+ * @param through_begin #TRUE to send BEGIN without waiting for OK
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_auth_client_pipeline (DBusAuth    *auth,
+                            dbus_bool_t  through_begin)
+{
+  const char *lines;
+
+  _dbus_assert (DBUS_AUTH_IS_CLIENT (auth));
+
+  if (auth->state != &client_state_waiting_for_data ||
+      auth->already_got_mechanisms ||
+      _dbus_string_get_length (&auth->incoming) > 0 ||
+      strcmp (auth->mech->mechanism, "EXTERNAL") != 0)
+    return TRUE;
+
+  if (auth->allowed_mechs != NULL &&
+      !_dbus_string_array_contains ((const char **) auth->allowed_mechs,
+                                    "EXTERNAL"))
+    return TRUE;
+
+  if (!through_begin)
+    {
+      if (!auth->unix_fd_possible)
+        return TRUE;
+
+      if (!_dbus_string_append (&auth->outgoing, "NEGOTIATE_UNIX_FD\r\n"))
+        return FALSE;
+
+      goto_state (auth, &client_state_waiting_for_ok_negotiate_sent);
+      return TRUE;
+    }
+
+  if (auth->unix_fd_possible)
+    lines = "NEGOTIATE_UNIX_FD\r\nBEGIN\r\n";
+  else
+    lines = "BEGIN\r\n";
+
+  if (!_dbus_string_append (&auth->outgoing, lines))
+    return FALSE;
+
+  goto_state (auth, &client_state_waiting_for_ok_pipelined);
+  return TRUE;
+}
+
+/**
+ * Returns #TRUE if the client has pipelined its handshake with
+ * _dbus_auth_client_pipeline(), the server has not answered yet, and
+ * everything up to and including BEGIN has been written out. Messages
+ * without Unix fds may be sent at this point.
+ *
+ * @param auth the auth conversation
+ * @returns #TRUE if messages may follow the pipelined BEGIN
+ */
+dbus_bool_t
+_dbus_auth_is_pipelining (DBusAuth *auth)
+{
+  return (auth->state == &client_state_waiting_for_ok_pipelined ||
+          auth->state == &client_state_waiting_for_agree_unix_fd_pipelined) &&
+    _dbus_string_get_length (&auth->outgoing) == 0;
+}
+
 /**
  * Sets an array of authentication mechanism names
  * that we are willing to use.
@@ -2834,6 +3107,78 @@ _dbus_auth_get_unix_fd_negotiated(DBusAuth *auth)
   return auth->unix_fd_negotiated;
 }
 
+/**
+ * Puts a server-side conversation that has not started yet straight
+ * into the authenticated state. This is for a connection whose peer
+ * already authenticated with a previous instance of the same server
+ * and was handed over together with what that instance had learned
+ * about it, so the peer must not be asked again.
+ *
+ * @param auth the auth conversation
+ * @param identity the identity the peer was authorized as
+ * @param unix_fd_negotiated whether unix fd passing was agreed on
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_auth_set_authenticated (DBusAuth        *auth,
+                              DBusCredentials *identity,
+                              dbus_bool_t      unix_fd_negotiated)
+{
+  _dbus_assert (DBUS_AUTH_IS_SERVER (auth));
+  _dbus_assert (auth->state == &server_state_waiting_for_auth);
+
+  _dbus_credentials_clear (auth->credentials);
+  _dbus_credentials_clear (auth->authorized_identity);
+
+  if (!_dbus_credentials_add_credentials (auth->credentials, identity) ||
+      !_dbus_credentials_add_credentials (auth->authorized_identity, identity))
+    {
+      _dbus_credentials_clear (auth->credentials);
+      _dbus_credentials_clear (auth->authorized_identity);
+      return FALSE;
+    }
+
+  auth->unix_fd_negotiated = unix_fd_negotiated && auth->unix_fd_possible;
+  goto_state (auth, &common_state_authenticated);
+
+  return TRUE;
+}
+
+/**
+ * Releases slack in the conversation's buffers. Once a connection
+ * is authenticated they are rarely used again, but keep whatever
+ * they grew to during the handshake.
+ *
+ * @param auth the auth conversation
+ */
+void
+_dbus_auth_trim (DBusAuth *auth)
+{
+  /* failure just means we keep the larger buffers */
+  _dbus_string_compact (&auth->incoming, 0);
+  _dbus_string_compact (&auth->outgoing, 0);
+  _dbus_string_compact (&auth->identity, 0);
+  _dbus_string_compact (&auth->context, 0);
+  _dbus_string_compact (&auth->challenge, 0);
+}
+
+/**
+ * Gets the memory used by the conversation and its buffers.
+ *
+ * @param auth the auth conversation
+ * @returns size in bytes
+ */
+int
+_dbus_auth_get_allocated_size (DBusAuth *auth)
+{
+  return sizeof (DBusAuthStorage) +
+    _dbus_string_get_allocated_size (&auth->incoming) +
+    _dbus_string_get_allocated_size (&auth->outgoing) +
+    _dbus_string_get_allocated_size (&auth->identity) +
+    _dbus_string_get_allocated_size (&auth->context) +
+    _dbus_string_get_allocated_size (&auth->challenge);
+}
+
 /** @} */
 
 /* tests in dbus-auth-util.c */
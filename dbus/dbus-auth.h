@@ -80,6 +80,11 @@ dbus_bool_t   _dbus_auth_decode_data         (DBusAuth               *auth,
                                               const DBusString       *encoded,
                                               DBusString             *plaintext);
 DBUS_PRIVATE_EXPORT
+dbus_bool_t   _dbus_auth_client_pipeline     (DBusAuth               *auth,
+                                              dbus_bool_t             through_begin);
+DBUS_PRIVATE_EXPORT
+dbus_bool_t   _dbus_auth_is_pipelining       (DBusAuth               *auth);
+DBUS_PRIVATE_EXPORT
 dbus_bool_t   _dbus_auth_set_credentials     (DBusAuth               *auth,
                                               DBusCredentials        *credentials);
 DBUS_PRIVATE_EXPORT
@@ -91,6 +96,12 @@ const char*   _dbus_auth_get_guid_from_server(DBusAuth               *auth);
 
 void          _dbus_auth_set_unix_fd_possible(DBusAuth               *auth, dbus_bool_t b);
 dbus_bool_t   _dbus_auth_get_unix_fd_negotiated(DBusAuth             *auth);
+dbus_bool_t   _dbus_auth_set_authenticated   (DBusAuth               *auth,
+                                              DBusCredentials        *identity,
+                                              dbus_bool_t             unix_fd_negotiated);
+
+void          _dbus_auth_trim                (DBusAuth               *auth);
+int           _dbus_auth_get_allocated_size  (DBusAuth               *auth);
 
 DBUS_END_DECLS
 
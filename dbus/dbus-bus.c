@@ -80,6 +80,7 @@ typedef struct
   char *unique_name; /**< Unique name of this connection */
 
   unsigned int is_well_known : 1; /**< Is one of the well-known connections in our global array */
+  unsigned int direct_channel_filter_added : 1; /**< Listening for the bus's direct channel signals */
 } BusData;
 
 /** The slot we have reserved to store BusData.
@@ -1599,4 +1600,277 @@ dbus_bus_remove_match (DBusConnection *connection,
   dbus_message_unref (msg);
 }
 
+/* The bus tells both ends about a channel with signals from itself;
+ * nobody else can send messages with its name as the sender */
+static DBusHandlerResult
+direct_channel_signal_filter (DBusConnection *connection,
+                              DBusMessage    *message,
+                              void           *user_data)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  const char *peer;
+  int fd;
+
+  if (!dbus_message_has_sender (message, DBUS_SERVICE_DBUS) ||
+      !dbus_message_has_path (message, DBUS_PATH_DBUS))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if (dbus_message_is_signal (message, DBUS_INTERFACE_DBUS,
+                              "DirectChannelOpened"))
+    {
+      if (!dbus_message_get_args (message, &error,
+                                  DBUS_TYPE_STRING, &peer,
+                                  DBUS_TYPE_UNIX_FD, &fd,
+                                  DBUS_TYPE_INVALID))
+        goto failed;
+
+      if (!_dbus_connection_add_direct_channel (connection, peer, fd, &error))
+        goto failed;
+    }
+  else if (dbus_message_is_signal (message, DBUS_INTERFACE_DBUS,
+                                   "DirectChannelClosed"))
+    {
+      if (!dbus_message_get_args (message, &error,
+                                  DBUS_TYPE_STRING, &peer,
+                                  DBUS_TYPE_INVALID))
+        goto failed;
+
+      _dbus_connection_close_direct_channel (connection, peer);
+    }
+
+  /* the application may want to know too */
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+ failed:
+  _dbus_verbose ("Ignoring %s from the bus: %s\n",
+                 dbus_message_get_member (message), error.message);
+  if (dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
+    {
+      dbus_error_free (&error);
+      return DBUS_HANDLER_RESULT_NEED_MEMORY;
+    }
+
+  dbus_error_free (&error);
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+static dbus_bool_t
+ensure_direct_channel_filter (DBusConnection *connection,
+                              DBusError      *error)
+{
+  BusData *bd;
+  dbus_bool_t retval = FALSE;
+
+  if (!_DBUS_LOCK (bus_datas))
+    {
+      _DBUS_SET_OOM (error);
+      /* do not "goto out", that would try to unlock */
+      return FALSE;
+    }
+
+  bd = ensure_bus_data (connection);
+  if (bd == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      goto out;
+    }
+
+  if (!bd->direct_channel_filter_added)
+    {
+      if (!dbus_connection_add_filter (connection,
+                                       direct_channel_signal_filter,
+                                       NULL, NULL))
+        {
+          _DBUS_SET_OOM (error);
+          goto out;
+        }
+
+      bd->direct_channel_filter_added = TRUE;
+    }
+
+  retval = TRUE;
+
+ out:
+  _DBUS_UNLOCK (bus_datas);
+  return retval;
+}
+
+/**
+ * Tells the bus that other clients may ask for a direct channel to
+ * this connection with dbus_bus_request_direct_channel(). When one
+ * does, and the bus's security policy allows the two to talk to each
+ * other, the bus hands this connection its end of the channel with a
+ * DirectChannelOpened signal, which libdbus handles before any filter
+ * the application added; the channel is used from then on, without
+ * the application having to do anything.
+ *
+ * Direct channels are passed as file descriptors, so the connection
+ * must be able to receive them; see dbus_connection_can_send_type().
+ *
+ * @param connection the connection
+ * @param error location to store any errors
+ * @returns #TRUE on success
+ */
+dbus_bool_t
+dbus_bus_accept_direct_channels (DBusConnection *connection,
+                                 DBusError      *error)
+{
+  DBusMessage *message, *reply;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_error_is_set (error, FALSE);
+
+  if (!ensure_direct_channel_filter (connection, error))
+    return FALSE;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "AcceptDirectChannels");
+  if (message == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  reply = dbus_connection_send_with_reply_and_block (connection, message, -1,
+                                                     error);
+  dbus_message_unref (message);
+
+  if (reply == NULL)
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      return FALSE;
+    }
+
+  if (dbus_set_error_from_message (error, reply))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      dbus_message_unref (reply);
+      return FALSE;
+    }
+
+  dbus_message_unref (reply);
+  return TRUE;
+}
+
+/**
+ * Asks the bus for a direct channel to the owner of a name, for pairs
+ * of clients that send each other enough messages for the trip
+ * through the bus to matter. The owner must have called
+ * dbus_bus_accept_direct_channels(), and the bus's security policy
+ * must allow each of the two to send method calls to the other.
+ *
+ * Once the channel is there, messages addressed to the peer's unique
+ * name (which this function returns) go through it instead of through
+ * the bus, and messages from the peer that come through it are
+ * dispatched like any others, with the peer's unique name as the
+ * sender. Replies go back the way the call came, and a reply that
+ * comes through the channel to a call that did not go through it is
+ * dropped. Monitors and match rules do not see what goes through the
+ * channel.
+ *
+ * Channels are only ever used by clients that ask for them, and they
+ * do not keep messages in order with those that go through the bus.
+ * Nothing already on its way through the bus is waited for when the
+ * channel opens, so a message sent through the channel may overtake
+ * one sent earlier; the same goes at any time for messages addressed
+ * to the peer's well-known names and for broadcast signals, which
+ * still go through the bus. Clients that care about the order should
+ * wait for the replies to what they sent the peer before asking for
+ * the channel, and should address the peer by its unique name only.
+ *
+ * What comes in through the channel is dispatched along with the
+ * connection itself, by dbus_connection_dispatch(). With
+ * dbus_connection_read_write_dispatch(), or a main loop set up with
+ * dbus_connection_set_watch_functions(), the channel is read from
+ * without anything else being needed.
+ *
+ * The bus closes the channel, telling both ends with a
+ * DirectChannelClosed signal, when either end disconnects from the
+ * bus or the policy stops allowing them to talk to each other.
+ * Asking again for a channel to the same peer replaces the old one.
+ *
+ * @param connection the connection
+ * @param name the name to open a channel to
+ * @param error location to store any errors
+ * @returns the unique name of the peer, to be freed with dbus_free(),
+ *  or #NULL if error is set
+ */
+char*
+dbus_bus_request_direct_channel (DBusConnection *connection,
+                                 const char     *name,
+                                 DBusError      *error)
+{
+  DBusMessage *message, *reply;
+  const char *peer;
+  char *retval;
+  int fd;
+
+  _dbus_return_val_if_fail (connection != NULL, NULL);
+  _dbus_return_val_if_fail (name != NULL, NULL);
+  _dbus_return_val_if_error_is_set (error, NULL);
+
+  /* so that a DirectChannelClosed is not missed */
+  if (!ensure_direct_channel_filter (connection, error))
+    return NULL;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "RequestDirectChannel");
+  if (message == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      return NULL;
+    }
+
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &name,
+                                 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (message);
+      _DBUS_SET_OOM (error);
+      return NULL;
+    }
+
+  reply = dbus_connection_send_with_reply_and_block (connection, message, -1,
+                                                     error);
+  dbus_message_unref (message);
+
+  if (reply == NULL)
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      return NULL;
+    }
+
+  if (dbus_set_error_from_message (error, reply) ||
+      !dbus_message_get_args (reply, error,
+                              DBUS_TYPE_STRING, &peer,
+                              DBUS_TYPE_UNIX_FD, &fd,
+                              DBUS_TYPE_INVALID))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      dbus_message_unref (reply);
+      return NULL;
+    }
+
+  /* the channel owns fd from here on, whatever happens */
+  if (!_dbus_connection_add_direct_channel (connection, peer, fd, error))
+    {
+      dbus_message_unref (reply);
+      return NULL;
+    }
+
+  retval = _dbus_strdup (peer);
+  if (retval == NULL)
+    {
+      _dbus_connection_close_direct_channel (connection, peer);
+      _DBUS_SET_OOM (error);
+    }
+
+  dbus_message_unref (reply);
+  return retval;
+}
+
 /** @} */
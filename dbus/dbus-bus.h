@@ -88,6 +88,14 @@ void            dbus_bus_remove_match     (DBusConnection *connection,
                                            const char     *rule,
                                            DBusError      *error);
 
+DBUS_EXPORT
+dbus_bool_t     dbus_bus_accept_direct_channels (DBusConnection *connection,
+                                                 DBusError      *error);
+DBUS_EXPORT
+char*           dbus_bus_request_direct_channel (DBusConnection *connection,
+                                                 const char     *name,
+                                                 DBusError      *error);
+
 /** @} */
 
 DBUS_END_DECLS
@@ -54,6 +54,7 @@ DBUS_PRIVATE_EXPORT
 DBusConnection *  _dbus_connection_ref_unlocked                (DBusConnection     *connection);
 DBUS_PRIVATE_EXPORT
 void              _dbus_connection_unref_unlocked              (DBusConnection     *connection);
+const char*       _dbus_connection_get_received_sender_unlocked (DBusConnection     *connection);
 void              _dbus_connection_queue_received_message_link (DBusConnection     *connection,
                                                                 DBusList           *link);
 dbus_bool_t       _dbus_connection_has_messages_to_send_unlocked (DBusConnection     *connection);
@@ -110,13 +111,40 @@ void              _dbus_connection_test_get_locks                 (DBusConnectio
 DBUS_PRIVATE_EXPORT
 int               _dbus_connection_get_pending_fds_count          (DBusConnection *connection);
 DBUS_PRIVATE_EXPORT
+int               _dbus_connection_count_pending_fds              (DBusConnection *connection);
+DBUS_PRIVATE_EXPORT
 void              _dbus_connection_set_pending_fds_function       (DBusConnection *connection,
                                                                    DBusPendingFdsChangeFunction callback,
                                                                    void *data);
+DBUS_PRIVATE_EXPORT
+void              _dbus_connection_set_outgoing_size_function     (DBusConnection *connection,
+                                                                   long            size_guard_value,
+                                                                   DBusCounterNotifyFunction callback,
+                                                                   void           *data);
 
 DBUS_PRIVATE_EXPORT
 dbus_bool_t       _dbus_connection_get_linux_security_label       (DBusConnection  *connection,
                                                                    char           **label_p);
+DBUS_PRIVATE_EXPORT
+DBusConnection*   _dbus_connection_new_for_resumed_socket         (DBusSocket        fd,
+                                                                   const DBusString *server_guid,
+                                                                   DBusCredentials  *identity,
+                                                                   dbus_bool_t       unix_fd_negotiated);
+DBUS_PRIVATE_EXPORT
+DBusCredentials*  _dbus_connection_copy_identity                  (DBusConnection   *connection);
+DBUS_PRIVATE_EXPORT
+dbus_bool_t       _dbus_connection_get_unparsed_incoming          (DBusConnection   *connection,
+                                                                   DBusString       *bytes,
+                                                                   const int       **fds,
+                                                                   unsigned int     *n_fds);
+DBUS_PRIVATE_EXPORT
+dbus_bool_t       _dbus_connection_inject_incoming                (DBusConnection   *connection,
+                                                                   const DBusString *bytes,
+                                                                   const int        *fds,
+                                                                   unsigned int      n_fds);
+DBUS_PRIVATE_EXPORT
+dbus_bool_t       _dbus_connection_flush_outgoing                 (DBusConnection   *connection,
+                                                                   int               timeout_milliseconds);
 
 /* if DBUS_ENABLE_STATS */
 DBUS_PRIVATE_EXPORT
@@ -132,6 +160,30 @@ void _dbus_connection_get_stats (DBusConnection *connection,
                                  dbus_uint32_t  *out_peak_bytes,
                                  dbus_uint32_t  *out_peak_fds);
 
+/* if DBUS_ENABLE_STATS */
+DBUS_PRIVATE_EXPORT
+dbus_uint32_t _dbus_connection_get_footprint (DBusConnection *connection);
+
+DBUS_PRIVATE_EXPORT
+void _dbus_connection_trim_memory (DBusConnection *connection);
+
+DBUS_PRIVATE_EXPORT
+void _dbus_connection_set_writes_deferred (DBusConnection *connection,
+                                           dbus_bool_t     deferred);
+
+DBUS_PRIVATE_EXPORT
+dbus_bool_t _dbus_connection_handle_watch_if_current (DBusConnection *connection,
+                                                      DBusWatch      *watch,
+                                                      unsigned int    condition,
+                                                      void           *watch_data);
+
+
+dbus_bool_t _dbus_connection_add_direct_channel   (DBusConnection *connection,
+                                                   const char     *peer,
+                                                   int             fd,
+                                                   DBusError      *error);
+void        _dbus_connection_close_direct_channel (DBusConnection *connection,
+                                                   const char     *peer);
 
 /* if DBUS_ENABLE_EMBEDDED_TESTS */
 const char* _dbus_connection_get_address (DBusConnection *connection);
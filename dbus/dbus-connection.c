@@ -27,6 +27,7 @@
 #include "dbus-list.h"
 #include "dbus-timeout.h"
 #include "dbus-transport.h"
+#include "dbus-transport-socket.h"
 #include "dbus-watch.h"
 #include "dbus-connection-internal.h"
 #include "dbus-pending-call-internal.h"
@@ -44,6 +45,8 @@
 #include "dbus-threads-internal.h"
 #include "dbus-bus.h"
 #include "dbus-marshal-basic.h"
+#include "dbus-mempool.h"
+#include "dbus-credentials.h"
 
 #ifdef DBUS_DISABLE_CHECKS
 #define TOOK_LOCK_CHECK(connection)
@@ -244,6 +247,10 @@ struct DBusPreallocatedSend
   DBusList *counter_link;     /**< Preallocated link in the resource counter */
 };
 
+/* The bus daemon preallocates one of these for every message it routes */
+static DBusSlab preallocated_send_slab =
+  _DBUS_SLAB_INIT (sizeof (DBusPreallocatedSend), DBUS_MEM_TAG_CONNECTION);
+
 #if HAVE_DECL_MSG_NOSIGNAL
 static dbus_bool_t _dbus_modify_sigpipe = FALSE;
 #else
@@ -325,6 +332,13 @@ struct DBusConnection
   unsigned int disconnected_message_processed : 1; /**< We did our default handling of the disconnected message,
                                                     * such as closing the connection.
                                                     */
+
+  unsigned int writes_deferred : 1; /**< Sending only queues messages; the write watch writes them */
+
+  unsigned int direct_channels_need_dispatch : 1; /**< A direct channel has something to dispatch */
+
+  DBusList *direct_channels; /**< #DBusDirectChannel to other clients of the same bus */
+  char *received_sender; /**< Sender put on everything received, if this is a direct channel */
   
 #ifndef DBUS_DISABLE_CHECKS
   unsigned int have_connection_lock : 1; /**< Used to check locking */
@@ -338,6 +352,9 @@ struct DBusConnection
 static DBusDispatchStatus _dbus_connection_get_dispatch_status_unlocked      (DBusConnection     *connection);
 static void               _dbus_connection_update_dispatch_status_and_unlock (DBusConnection     *connection,
                                                                               DBusDispatchStatus  new_status);
+static dbus_bool_t        connection_handle_watch_and_unlock                 (DBusConnection     *connection,
+                                                                              DBusWatch          *watch,
+                                                                              unsigned int        condition);
 static void               _dbus_connection_last_unref                        (DBusConnection     *connection);
 static void               _dbus_connection_acquire_dispatch                  (DBusConnection     *connection);
 static void               _dbus_connection_release_dispatch                  (DBusConnection     *connection);
@@ -347,6 +364,52 @@ static dbus_bool_t        _dbus_connection_get_is_connected_unlocked         (DB
 static dbus_bool_t        _dbus_connection_peek_for_reply_unlocked           (DBusConnection     *connection,
                                                                               dbus_uint32_t       client_serial);
 
+typedef struct DBusDirectChannel DBusDirectChannel;
+
+/**
+ * A direct connection to another client of the same bus, set up by
+ * the bus at the request of one of the two; see
+ * dbus_bus_request_direct_channel(). Messages for the peer's unique
+ * name go through it instead of through the bus, and what arrives on
+ * it is queued on the bus connection as if the bus had routed it.
+ * Nothing is drained from the bus when the channel is added, so the
+ * two routes are not kept in order with each other.
+ *
+ * The channel belongs to the filter on its connection, so it lives as
+ * long as anyone could still call that filter. owner is cleared under
+ * the direct connection's lock when the bus connection lets go of the
+ * channel; everything else that changes is protected by the owner's
+ * lock. The owner's lock may be held while taking the direct
+ * connection's, never the other way round.
+ */
+struct DBusDirectChannel
+{
+  DBusConnection *owner;      /**< The bus connection, not a reference */
+  DBusConnection *connection; /**< The direct connection; the owner's list holds a reference */
+  char *peer;                 /**< Unique name of the other end */
+  DBusHashTable *calls_in;    /**< Serials of calls from the peer that are owed a reply */
+  DBusHashTable *calls_out;   /**< Serials of our calls whose reply can come back through the filter */
+  unsigned int closed : 1;       /**< The bus told us to stop using it */
+  unsigned int disconnected : 1; /**< Its Disconnected message was dispatched */
+};
+
+static DBusDirectChannel* connection_find_direct_channel_unlocked            (DBusConnection     *connection,
+                                                                              DBusMessage        *message);
+static void               connection_send_on_direct_channel_unlocked         (DBusConnection     *connection,
+                                                                              DBusDirectChannel  *channel,
+                                                                              DBusPreallocatedSend *preallocated,
+                                                                              DBusMessage        *message,
+                                                                              dbus_uint32_t      *client_serial);
+static dbus_bool_t        connection_expect_direct_reply_unlocked            (DBusConnection     *connection,
+                                                                              DBusDirectChannel  *channel,
+                                                                              DBusMessage        *message);
+static void               connection_dispatch_direct_channels_unlocked       (DBusConnection     *connection);
+static void               connection_iterate_with_direct_channels_unlocked   (DBusConnection     *connection,
+                                                                              int                 timeout_milliseconds);
+static dbus_bool_t        connection_copy_direct_connections_unlocked        (DBusConnection     *connection,
+                                                                              DBusList          **directs);
+static void               direct_channels_drop_all                           (DBusList          **channels);
+
 static DBusMessageFilter *
 _dbus_message_filter_ref (DBusMessageFilter *filter)
 {
@@ -468,6 +531,22 @@ _dbus_connection_test_get_locks (DBusConnection *connection,
 }
 #endif
 
+/**
+ * Gets the name to put on every received message as its sender, in
+ * place of whatever the message says; for connections where only one
+ * peer can be at the other end. Connection lock should be held.
+ *
+ * @param connection the connection
+ * @returns the sender, or #NULL to leave messages as they are
+ */
+const char*
+_dbus_connection_get_received_sender_unlocked (DBusConnection *connection)
+{
+  HAVE_LOCK_CHECK (connection);
+
+  return connection->received_sender;
+}
+
 /**
  * Adds a message-containing list link to the incoming message queue,
  * taking ownership of the link and the message's current refcount.
@@ -1236,6 +1315,9 @@ _dbus_connection_do_iteration_unlocked (DBusConnection *connection,
   _dbus_verbose ("end\n");
 }
 
+static DBusSlab connection_slab =
+  _DBUS_SLAB_INIT (sizeof (DBusConnection), DBUS_MEM_TAG_CONNECTION);
+
 /**
  * Creates a new connection for the given transport.  A transport
  * represents a message stream that uses some concrete mechanism, such
@@ -1281,7 +1363,7 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
   if (pending_replies == NULL)
     goto error;
   
-  connection = dbus_new0 (DBusConnection, 1);
+  connection = _dbus_slab_alloc (&connection_slab);
   if (connection == NULL)
     goto error;
 
@@ -1388,7 +1470,7 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
       _dbus_cmutex_free_at_location (&connection->io_path_mutex);
       _dbus_cmutex_free_at_location (&connection->dispatch_mutex);
       _dbus_rmutex_free_at_location (&connection->slot_mutex);
-      dbus_free (connection);
+      _dbus_slab_dealloc (&connection_slab, connection);
     }
   if (pending_replies)
     _dbus_hash_table_unref (pending_replies);
@@ -1488,8 +1570,6 @@ _dbus_connection_handle_watch (DBusWatch                   *watch,
                                void                        *data)
 {
   DBusConnection *connection;
-  dbus_bool_t retval;
-  DBusDispatchStatus status;
 
   connection = data;
 
@@ -1497,6 +1577,53 @@ _dbus_connection_handle_watch (DBusWatch                   *watch,
   
   CONNECTION_LOCK (connection);
 
+  return connection_handle_watch_and_unlock (connection, watch, condition);
+}
+
+/**
+ * Handles a watch like dbus_watch_handle(), for a main loop that runs
+ * in a different thread from the one that added the watch. Because the
+ * watch may be removed and freed by another thread at any time, it is
+ * only used if, with the connection locked, it is still one of the
+ * connection's watches and the watch functions are still the ones
+ * that were given watch_data.
+ *
+ * @param connection the connection that owns the watch
+ * @param watch the watch, which is not dereferenced unless current
+ * @param condition the watch condition
+ * @param watch_data the data passed to dbus_connection_set_watch_functions()
+ * @returns #FALSE if we need more memory
+ */
+dbus_bool_t
+_dbus_connection_handle_watch_if_current (DBusConnection *connection,
+                                          DBusWatch      *watch,
+                                          unsigned int    condition,
+                                          void           *watch_data)
+{
+  CONNECTION_LOCK (connection);
+
+  if (connection->watches == NULL ||
+      _dbus_watch_list_get_data (connection->watches) != watch_data ||
+      !_dbus_watch_list_contains (connection->watches, watch) ||
+      !_dbus_watch_get_enabled (watch))
+    {
+      CONNECTION_UNLOCK (connection);
+      return TRUE;
+    }
+
+  return connection_handle_watch_and_unlock (connection, watch, condition);
+}
+
+static dbus_bool_t
+connection_handle_watch_and_unlock (DBusConnection *connection,
+                                    DBusWatch      *watch,
+                                    unsigned int    condition)
+{
+  dbus_bool_t retval;
+  DBusDispatchStatus status;
+
+  HAVE_LOCK_CHECK (connection);
+
   if (!_dbus_connection_acquire_io_path (connection, 1))
     {
       /* another thread is handling the message */
@@ -1963,7 +2090,7 @@ _dbus_connection_preallocate_send_unlocked (DBusConnection *connection)
   
   _dbus_assert (connection != NULL);
   
-  preallocated = dbus_new (DBusPreallocatedSend, 1);
+  preallocated = _dbus_slab_alloc (&preallocated_send_slab);
   if (preallocated == NULL)
     return NULL;
 
@@ -1984,7 +2111,7 @@ _dbus_connection_preallocate_send_unlocked (DBusConnection *connection)
  failed_1:
   _dbus_list_free_link (preallocated->queue_link);
  failed_0:
-  dbus_free (preallocated);
+  _dbus_slab_dealloc (&preallocated_send_slab, preallocated);
   
   return NULL;
 }
@@ -1998,6 +2125,22 @@ _dbus_connection_send_preallocated_unlocked_no_update (DBusConnection       *con
 {
   dbus_uint32_t serial;
 
+  if (connection->direct_channels != NULL)
+    {
+      DBusDirectChannel *channel;
+
+      channel = connection_find_direct_channel_unlocked (connection, message);
+      if (channel != NULL &&
+          connection_expect_direct_reply_unlocked (connection, channel,
+                                                   message))
+        {
+          connection_send_on_direct_channel_unlocked (connection, channel,
+                                                      preallocated, message,
+                                                      client_serial);
+          return;
+        }
+    }
+
   preallocated->queue_link->data = message;
   _dbus_list_prepend_link (&connection->outgoing_messages,
                            preallocated->queue_link);
@@ -2007,7 +2150,7 @@ _dbus_connection_send_preallocated_unlocked_no_update (DBusConnection       *con
   _dbus_message_add_counter_link (message,
                                   preallocated->counter_link);
 
-  dbus_free (preallocated);
+  _dbus_slab_dealloc (&preallocated_send_slab, preallocated);
   preallocated = NULL;
   
   dbus_message_ref (message);
@@ -2051,6 +2194,13 @@ _dbus_connection_send_preallocated_unlocked_no_update (DBusConnection       *con
   
   dbus_message_lock (message);
 
+  if (connection->writes_deferred)
+    {
+      /* Whoever services our watches does the writing */
+      _dbus_transport_outgoing_queued (connection->transport);
+      return;
+    }
+
   /* Now we need to run an iteration to hopefully just write the messages
    * out immediately, and otherwise get them queued up
    */
@@ -2560,6 +2710,25 @@ _dbus_connection_get_pending_fds_count (DBusConnection *connection)
   return _dbus_transport_get_pending_fds_count (connection->transport);
 }
 
+/**
+ * Like _dbus_connection_get_pending_fds_count(), but takes the
+ * connection lock, for a caller in a different thread from the one
+ * reading the connection.
+ *
+ * @param connection the connection
+ */
+int
+_dbus_connection_count_pending_fds (DBusConnection *connection)
+{
+  int count;
+
+  CONNECTION_LOCK (connection);
+  count = _dbus_transport_get_pending_fds_count (connection->transport);
+  CONNECTION_UNLOCK (connection);
+
+  return count;
+}
+
 /**
  * Register a function to be called whenever the number of pending file
  * descriptors in the loader change.
@@ -2576,6 +2745,29 @@ _dbus_connection_set_pending_fds_function (DBusConnection *connection,
                                             callback, data);
 }
 
+/**
+ * Register a function to be called whenever the total size of the
+ * messages in the outgoing queue crosses the given value, in either
+ * direction. The function may be called with the connection lock held,
+ * so it must not call back into the connection.
+ *
+ * @param connection the connection
+ * @param size_guard_value the size in bytes
+ * @param callback the callback, or #NULL to unset it
+ * @param data data for the callback
+ */
+void
+_dbus_connection_set_outgoing_size_function (DBusConnection *connection,
+                                             long            size_guard_value,
+                                             DBusCounterNotifyFunction callback,
+                                             void           *data)
+{
+  /* the unix fd count is not of interest, so make sure it never fires */
+  _dbus_counter_set_notify (connection->outgoing_counter,
+                            size_guard_value, _DBUS_INT32_MAX,
+                            callback, data);
+}
+
 /** @} */
 
 /**
@@ -2607,6 +2799,14 @@ _dbus_connection_set_pending_fds_function (DBusConnection *connection,
  * unless you have good reason; connections are expensive enough
  * that it's wasteful to create lots of connections to the same
  * server.
+ *
+ * If the address is a unix: address with a guid, as the addresses of
+ * message buses are, the client authenticates with EXTERNAL and sends
+ * BEGIN and its first messages without waiting for the server to
+ * accept it. If the server rejects EXTERNAL, the connection is then
+ * closed instead of trying other mechanisms. Setting the environment
+ * variable DBUS_PIPELINE_AUTH to 0 makes the client wait for each
+ * reply instead, as it does for other addresses.
  * 
  * @param address the address.
  * @param error address where an error can be returned.
@@ -2722,6 +2922,8 @@ _dbus_connection_last_unref (DBusConnection *connection)
   _dbus_assert (connection->server_guid == NULL);
   
   /* ---- We're going to call various application callbacks here, hope it doesn't break anything... */
+  direct_channels_drop_all (&connection->direct_channels);
+
   _dbus_object_tree_free_all_unlocked (connection->objects);
   
   dbus_connection_set_dispatch_status_function (connection, NULL, NULL, NULL);
@@ -2774,6 +2976,8 @@ _dbus_connection_last_unref (DBusConnection *connection)
 
   _dbus_transport_unref (connection->transport);
 
+  dbus_free (connection->received_sender);
+
   if (connection->disconnect_message_link)
     {
       DBusMessage *message = connection->disconnect_message_link->data;
@@ -2791,7 +2995,7 @@ _dbus_connection_last_unref (DBusConnection *connection)
 
   _dbus_rmutex_free_at_location (&connection->mutex);
   
-  dbus_free (connection);
+  _dbus_slab_dealloc (&connection_slab, connection);
 }
 
 /**
@@ -3198,7 +3402,7 @@ dbus_connection_free_preallocated_send (DBusConnection       *connection,
   _dbus_list_free_link (preallocated->queue_link);
   _dbus_counter_unref (preallocated->counter_link->data);
   _dbus_list_free_link (preallocated->counter_link);
-  dbus_free (preallocated);
+  _dbus_slab_dealloc (&preallocated_send_slab, preallocated);
 }
 
 /**
@@ -3436,6 +3640,34 @@ dbus_connection_send_with_reply (DBusConnection     *connection,
       return TRUE;
     }
 
+  if (connection->direct_channels != NULL)
+    {
+      DBusDirectChannel *channel;
+
+      channel = connection_find_direct_channel_unlocked (connection, message);
+      if (channel != NULL)
+        {
+          DBusConnection *direct = channel->connection;
+          dbus_bool_t retval;
+
+          /* The reply comes back through the channel, so that is where
+           * the pending call has to wait for it; only the serial is
+           * ours, like for everything else we send */
+          if (dbus_message_get_serial (message) == 0)
+            dbus_message_set_serial (message,
+                                     _dbus_connection_get_next_client_serial (connection));
+
+          dbus_connection_ref (direct);
+          CONNECTION_UNLOCK (connection);
+
+          retval = dbus_connection_send_with_reply (direct, message,
+                                                    pending_return,
+                                                    timeout_milliseconds);
+          dbus_connection_unref (direct);
+          return retval;
+        }
+    }
+
   pending = _dbus_pending_call_new_unlocked (connection,
                                              timeout_milliseconds,
                                              reply_handler_timeout);
@@ -3700,7 +3932,14 @@ _dbus_connection_read_write_dispatch (DBusConnection *connection,
   else
     {
       CONNECTION_LOCK (connection);
-      if (_dbus_connection_get_is_connected_unlocked (connection))
+      if (_dbus_connection_get_is_connected_unlocked (connection) &&
+          connection->direct_channels != NULL)
+        {
+          _dbus_verbose ("doing iteration with direct channels\n");
+          connection_iterate_with_direct_channels_unlocked (connection,
+                                                            timeout_milliseconds);
+        }
+      else if (_dbus_connection_get_is_connected_unlocked (connection))
         {
           _dbus_verbose ("doing iteration\n");
           _dbus_connection_do_iteration_unlocked (connection,
@@ -4252,7 +4491,8 @@ _dbus_connection_get_dispatch_status_unlocked (DBusConnection *connection)
 {
   HAVE_LOCK_CHECK (connection);
   
-  if (connection->n_incoming > 0)
+  if (connection->n_incoming > 0 ||
+      connection->direct_channels_need_dispatch)
     return DBUS_DISPATCH_DATA_REMAINS;
   else if (!_dbus_transport_queue_messages (connection->transport))
     return DBUS_DISPATCH_NEED_MEMORY;
@@ -4302,6 +4542,7 @@ _dbus_connection_update_dispatch_status_and_unlock (DBusConnection    *connectio
   dbus_bool_t changed;
   DBusDispatchStatusFunction function;
   void *data;
+  DBusList *dropped_channels = NULL;
 
   HAVE_LOCK_CHECK (connection);
 
@@ -4318,6 +4559,11 @@ _dbus_connection_update_dispatch_status_and_unlock (DBusConnection    *connectio
       !connection->disconnected_message_processed)
     {
       connection->disconnected_message_processed = TRUE;
+
+      /* without the bus there is nobody to tell us the channels
+       * are still allowed */
+      dropped_channels = connection->direct_channels;
+      connection->direct_channels = NULL;
       
       /* this does an unref, but we have a ref
        * so we should not run the finalizer here
@@ -4337,6 +4583,8 @@ _dbus_connection_update_dispatch_status_and_unlock (DBusConnection    *connectio
   
   /* We drop the lock */
   CONNECTION_UNLOCK (connection);
+
+  direct_channels_drop_all (&dropped_channels);
   
   if (changed && function)
     {
@@ -4603,6 +4851,10 @@ dbus_connection_dispatch (DBusConnection *connection)
   _dbus_connection_acquire_dispatch (connection);
   HAVE_LOCK_CHECK (connection);
 
+  /* What came in through direct channels joins our own queue */
+  if (connection->direct_channels_need_dispatch)
+    connection_dispatch_direct_channels_unlocked (connection);
+
   message_link = _dbus_connection_pop_message_link_unlocked (connection);
   if (message_link == NULL)
     {
@@ -4957,11 +5209,45 @@ dbus_connection_set_watch_functions (DBusConnection              *connection,
                                      DBusFreeFunction             free_data_function)
 {
   dbus_bool_t retval;
+  DBusList *directs = NULL;
+  DBusConnection *direct;
 
   _dbus_return_val_if_fail (connection != NULL, FALSE);
   
   CONNECTION_LOCK (connection);
 
+  /* Direct channels share our main loop. They have to be moved over
+   * first, while the old data is still there to remove their
+   * watches with */
+  if (connection->direct_channels != NULL)
+    {
+      if (!connection_copy_direct_connections_unlocked (connection, &directs))
+        {
+          CONNECTION_UNLOCK (connection);
+          return FALSE;
+        }
+
+      CONNECTION_UNLOCK (connection);
+
+      retval = TRUE;
+      while ((direct = _dbus_list_pop_first (&directs)) != NULL)
+        {
+          if (retval &&
+              !dbus_connection_set_watch_functions (direct, add_function,
+                                                    remove_function,
+                                                    toggled_function,
+                                                    data, NULL))
+            retval = FALSE;
+
+          dbus_connection_unref (direct);
+        }
+
+      if (!retval)
+        return FALSE;
+
+      CONNECTION_LOCK (connection);
+    }
+
   retval = _dbus_watch_list_set_functions (connection->watches,
                                            add_function, remove_function,
                                            toggled_function,
@@ -5020,11 +5306,43 @@ dbus_connection_set_timeout_functions   (DBusConnection            *connection,
 					 DBusFreeFunction           free_data_function)
 {
   dbus_bool_t retval;
+  DBusList *directs = NULL;
+  DBusConnection *direct;
 
   _dbus_return_val_if_fail (connection != NULL, FALSE);
   
   CONNECTION_LOCK (connection);
 
+  /* see dbus_connection_set_watch_functions() */
+  if (connection->direct_channels != NULL)
+    {
+      if (!connection_copy_direct_connections_unlocked (connection, &directs))
+        {
+          CONNECTION_UNLOCK (connection);
+          return FALSE;
+        }
+
+      CONNECTION_UNLOCK (connection);
+
+      retval = TRUE;
+      while ((direct = _dbus_list_pop_first (&directs)) != NULL)
+        {
+          if (retval &&
+              !dbus_connection_set_timeout_functions (direct, add_function,
+                                                      remove_function,
+                                                      toggled_function,
+                                                      data, NULL))
+            retval = FALSE;
+
+          dbus_connection_unref (direct);
+        }
+
+      if (!retval)
+        return FALSE;
+
+      CONNECTION_LOCK (connection);
+    }
+
   retval = _dbus_timeout_list_set_functions (connection->timeouts,
                                              add_function, remove_function,
                                              toggled_function,
@@ -5379,150 +5697,1062 @@ _dbus_connection_get_linux_security_label (DBusConnection  *connection,
   return result;
 }
 
-/**
- * Gets the Windows user SID of the connection if known.  Returns
- * #TRUE if the ID is filled in.  Always returns #FALSE on non-Windows
- * platforms for now, though in theory someone could hook UNIX to
- * Active Directory or something.  Always returns #FALSE prior to
- * authenticating the connection.
- *
- * The user is only read by servers from clients; clients can't usually
- * get the user of servers, because servers do not authenticate to
- * clients. The returned user is the user the connection authenticated
- * as.
- *
- * The message bus is a server and the apps connecting to the bus
- * are clients.
- *
- * The returned user string has to be freed with dbus_free().
- *
- * The return value indicates whether the user SID is available;
- * if it's available but we don't have the memory to copy it,
- * then the return value is #TRUE and #NULL is given as the SID.
- * 
- * @todo We would like to be able to say "You can ask the bus to tell
- * you the user of another connection though if you like; this is done
- * with dbus_bus_get_windows_user()." But this has to be implemented
- * in bus/driver.c and dbus/dbus-bus.c, and is pointless anyway
- * since on Windows we only use the session bus for now.
- *
- * @param connection the connection
- * @param windows_sid_p return location for an allocated copy of the user ID, or #NULL if no memory
- * @returns #TRUE if user is available (returned value may be #NULL anyway if no memory)
- */
-dbus_bool_t
-dbus_connection_get_windows_user (DBusConnection             *connection,
-                                  char                      **windows_sid_p)
+static void
+direct_channel_free (void *data)
 {
-  dbus_bool_t result;
-
-  _dbus_return_val_if_fail (connection != NULL, FALSE);
-  _dbus_return_val_if_fail (windows_sid_p != NULL, FALSE);
+  DBusDirectChannel *channel = data;
 
-  CONNECTION_LOCK (connection);
-
-  if (!_dbus_transport_try_to_authenticate (connection->transport))
-    result = FALSE;
-  else
-    result = _dbus_transport_get_windows_user (connection->transport,
-                                               windows_sid_p);
+  if (channel->calls_in != NULL)
+    _dbus_hash_table_unref (channel->calls_in);
 
-#ifdef DBUS_UNIX
-  _dbus_assert (!result);
-#endif
-  
-  CONNECTION_UNLOCK (connection);
+  if (channel->calls_out != NULL)
+    _dbus_hash_table_unref (channel->calls_out);
 
-  return result;
+  dbus_free (channel->peer);
+  dbus_free (channel);
 }
 
-/**
- * Sets a predicate function used to determine whether a given user ID
- * is allowed to connect. When an incoming connection has
- * authenticated with a particular user ID, this function is called;
- * if it returns #TRUE, the connection is allowed to proceed,
- * otherwise the connection is disconnected.
- *
- * If the function is set to #NULL (as it is by default), then
- * only the same user owning the server process will be allowed to
- * connect.
- *
- * On UNIX, the function will be set and its free_data_function will
- * be invoked when the connection is freed or a new function is set.
- * However, the function will never be called, because there is no
- * way right now to authenticate as a Windows user on UNIX.
- * 
- * @param connection the connection
- * @param function the predicate
- * @param data data to pass to the predicate
- * @param free_data_function function to free the data
- */
-void
-dbus_connection_set_windows_user_function (DBusConnection              *connection,
-                                           DBusAllowWindowsUserFunction function,
-                                           void                        *data,
-                                           DBusFreeFunction             free_data_function)
+/* Returns a reference to the owner, or NULL once it let go */
+static DBusConnection *
+direct_channel_ref_owner (DBusDirectChannel *channel)
 {
-  void *old_data = NULL;
-  DBusFreeFunction old_free_function = NULL;
+  DBusConnection *owner;
 
-  _dbus_return_if_fail (connection != NULL);
-  
-  CONNECTION_LOCK (connection);
-  _dbus_transport_set_windows_user_function (connection->transport,
-                                             function, data, free_data_function,
-                                             &old_data, &old_free_function);
-  CONNECTION_UNLOCK (connection);
+  CONNECTION_LOCK (channel->connection);
+  owner = channel->owner;
+  if (owner != NULL)
+    dbus_connection_ref (owner);
+  CONNECTION_UNLOCK (channel->connection);
 
-  if (old_free_function != NULL)
-    (* old_free_function) (old_data);
+  return owner;
 }
 
-/**
- * This function must be called on the server side of a connection when the
- * connection is first seen in the #DBusNewConnectionFunction. If set to
- * #TRUE (the default is #FALSE), then the connection can proceed even if
- * the client does not authenticate as some user identity, i.e. clients
- * can connect anonymously.
- * 
- * This setting interacts with the available authorization mechanisms
- * (see dbus_server_set_auth_mechanisms()). Namely, an auth mechanism
- * such as ANONYMOUS that supports anonymous auth must be included in
- * the list of available mechanisms for anonymous login to work.
- *
- * This setting also changes the default rule for connections
- * authorized as a user; normally, if a connection authorizes as
- * a user identity, it is permitted if the user identity is
- * root or the user identity matches the user identity of the server
- * process. If anonymous connections are allowed, however,
- * then any user identity is allowed.
- *
- * You can override the rules for connections authorized as a
- * user identity with dbus_connection_set_unix_user_function()
- * and dbus_connection_set_windows_user_function().
- * 
- * @param connection the connection
- * @param value whether to allow authentication as an anonymous user
- */
-void
-dbus_connection_set_allow_anonymous (DBusConnection             *connection,
-                                     dbus_bool_t                 value)
+static DBusHandlerResult
+direct_channel_filter (DBusConnection *connection,
+                       DBusMessage    *message,
+                       void           *user_data)
 {
-  _dbus_return_if_fail (connection != NULL);
-  
-  CONNECTION_LOCK (connection);
-  _dbus_transport_set_allow_anonymous (connection->transport, value);
-  CONNECTION_UNLOCK (connection);
-}
+  DBusDirectChannel *channel = user_data;
+  DBusConnection *owner;
+  DBusDispatchStatus status;
+  DBusList *link;
 
-/**
- *
- * Normally #DBusConnection automatically handles all messages to the
- * org.freedesktop.DBus.Peer interface. However, the message bus wants
- * to be able to route methods on that interface through the bus and
- * to other applications. If routing peer messages is enabled, then
- * messages with the org.freedesktop.DBus.Peer interface that also
- * have a bus destination name set will not be automatically
+  owner = direct_channel_ref_owner (channel);
+  if (owner == NULL)
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if (dbus_message_is_signal (message, DBUS_INTERFACE_LOCAL, "Disconnected"))
+    {
+      /* the owner drops the channel when it dispatches it next, which
+       * it is in the middle of doing */
+      CONNECTION_LOCK (owner);
+      channel->disconnected = TRUE;
+      CONNECTION_UNLOCK (owner);
+      dbus_connection_unref (owner);
+      return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    }
+
+  /* the transport already put the peer's name on it as the sender */
+  link = _dbus_list_alloc_link (message);
+  if (link == NULL)
+    goto oom;
+
+  CONNECTION_LOCK (owner);
+
+  switch (dbus_message_get_type (message))
+    {
+    case DBUS_MESSAGE_TYPE_METHOD_CALL:
+      if (!dbus_message_get_no_reply (message) &&
+          !_dbus_hash_table_insert_int (channel->calls_in,
+                                        dbus_message_get_serial (message),
+                                        _DBUS_INT_TO_POINTER (1)))
+        {
+          CONNECTION_UNLOCK (owner);
+          goto oom;
+        }
+      break;
+
+    case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+    case DBUS_MESSAGE_TYPE_ERROR:
+      /* The bus would not pass on a reply nobody asked for, so nor do
+       * we. Replies to calls with a pending call never get here; they
+       * complete on the direct connection. */
+      if (!_dbus_hash_table_remove_int (channel->calls_out,
+                                        dbus_message_get_reply_serial (message)))
+        {
+          _dbus_verbose ("Dropping unexpected reply to %u from %s\n",
+                         dbus_message_get_reply_serial (message),
+                         channel->peer);
+          CONNECTION_UNLOCK (owner);
+          _dbus_list_free_link (link);
+          dbus_connection_unref (owner);
+          return DBUS_HANDLER_RESULT_HANDLED;
+        }
+      break;
+
+    default:
+      break;
+    }
+
+  dbus_message_ref (message);
+  _dbus_connection_queue_received_message_link (owner, link);
+
+  status = _dbus_connection_get_dispatch_status_unlocked (owner);
+  _dbus_connection_update_dispatch_status_and_unlock (owner, status);
+
+  dbus_connection_unref (owner);
+  return DBUS_HANDLER_RESULT_HANDLED;
+
+ oom:
+  if (link != NULL)
+    _dbus_list_free_link (link);
+  dbus_connection_unref (owner);
+  return DBUS_HANDLER_RESULT_NEED_MEMORY;
+}
+
+/* The direct connection is dispatched by its owner, so all the
+ * application needs to hear about is that the owner has something
+ * to dispatch */
+static void
+direct_channel_dispatch_status (DBusConnection     *connection,
+                                DBusDispatchStatus  new_status,
+                                void               *data)
+{
+  DBusDirectChannel *channel = data;
+  DBusConnection *owner;
+  DBusDispatchStatus status;
+
+  if (new_status == DBUS_DISPATCH_COMPLETE)
+    return;
+
+  owner = direct_channel_ref_owner (channel);
+  if (owner == NULL)
+    return;
+
+  CONNECTION_LOCK (owner);
+  owner->direct_channels_need_dispatch = TRUE;
+  _dbus_connection_wakeup_mainloop (owner);
+  status = _dbus_connection_get_dispatch_status_unlocked (owner);
+  _dbus_connection_update_dispatch_status_and_unlock (owner, status);
+
+  dbus_connection_unref (owner);
+}
+
+/* Called without the owner's lock, once the channel has been taken
+ * off its list */
+static void
+direct_channel_drop (DBusDirectChannel *channel)
+{
+  DBusConnection *direct = channel->connection;
+
+  _dbus_verbose ("Dropping direct channel %p to %s\n", direct, channel->peer);
+
+  CONNECTION_LOCK (direct);
+  channel->owner = NULL;
+  CONNECTION_UNLOCK (direct);
+
+  dbus_connection_set_dispatch_status_function (direct, NULL, NULL, NULL);
+  dbus_connection_close (direct);
+
+  /* calls still waiting for a reply through the channel get their
+   * errors now */
+  while (dbus_connection_dispatch (direct) == DBUS_DISPATCH_DATA_REMAINS)
+    ;
+
+  dbus_connection_set_watch_functions (direct, NULL, NULL, NULL, NULL, NULL);
+  dbus_connection_set_timeout_functions (direct, NULL, NULL, NULL, NULL, NULL);
+
+  /* frees the channel */
+  dbus_connection_remove_filter (direct, direct_channel_filter, channel);
+  dbus_connection_unref (direct);
+}
+
+static void
+direct_channels_drop_all (DBusList **channels)
+{
+  DBusDirectChannel *channel;
+
+  while ((channel = _dbus_list_pop_first (channels)) != NULL)
+    direct_channel_drop (channel);
+}
+
+/* Adds a reference to each direct connection to a list, so that they
+ * can be used without our lock */
+static dbus_bool_t
+connection_copy_direct_connections_unlocked (DBusConnection  *connection,
+                                             DBusList       **directs)
+{
+  DBusList *link;
+
+  HAVE_LOCK_CHECK (connection);
+
+  for (link = _dbus_list_get_first_link (&connection->direct_channels);
+       link != NULL;
+       link = _dbus_list_get_next_link (&connection->direct_channels, link))
+    {
+      DBusDirectChannel *channel = link->data;
+
+      if (!_dbus_list_append (directs, channel->connection))
+        {
+          _dbus_list_foreach (directs, (DBusForeachFunction) dbus_connection_unref,
+                              NULL);
+          _dbus_list_clear (directs);
+          return FALSE;
+        }
+
+      dbus_connection_ref (channel->connection);
+    }
+
+  return TRUE;
+}
+
+/**
+ * Finds the direct channel a message should go through instead of
+ * the bus, if any. Calls and signals go through the channel to their
+ * destination; replies only if the call they answer came through it,
+ * since the peer is waiting for them there.
+ */
+static DBusDirectChannel *
+connection_find_direct_channel_unlocked (DBusConnection *connection,
+                                         DBusMessage    *message)
+{
+  const char *destination;
+  DBusList *link;
+
+  HAVE_LOCK_CHECK (connection);
+
+  destination = dbus_message_get_destination (message);
+  if (destination == NULL)
+    return NULL;
+
+  for (link = _dbus_list_get_first_link (&connection->direct_channels);
+       link != NULL;
+       link = _dbus_list_get_next_link (&connection->direct_channels, link))
+    {
+      DBusDirectChannel *channel = link->data;
+      dbus_bool_t connected;
+
+      if (channel->closed || channel->disconnected ||
+          strcmp (channel->peer, destination) != 0)
+        continue;
+
+      /* The peer may have hung up without us having dispatched the
+       * news yet; the bus is still there to take the message */
+      CONNECTION_LOCK (channel->connection);
+      connected = _dbus_connection_get_is_connected_unlocked (channel->connection);
+      CONNECTION_UNLOCK (channel->connection);
+
+      if (!connected)
+        continue;
+
+      switch (dbus_message_get_type (message))
+        {
+        case DBUS_MESSAGE_TYPE_METHOD_CALL:
+        case DBUS_MESSAGE_TYPE_SIGNAL:
+          return channel;
+
+        case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+        case DBUS_MESSAGE_TYPE_ERROR:
+          if (_dbus_hash_table_remove_int (channel->calls_in,
+                                           dbus_message_get_reply_serial (message)))
+            return channel;
+          return NULL;
+
+        default:
+          return NULL;
+        }
+    }
+
+  return NULL;
+}
+
+/* Remembers a call going through a direct channel without a pending
+ * call, so that its reply gets past direct_channel_filter(). Gives
+ * the call its serial now if it has none. Returns FALSE if there is
+ * no memory to remember it, in which case the bus has to take it. */
+static dbus_bool_t
+connection_expect_direct_reply_unlocked (DBusConnection    *connection,
+                                         DBusDirectChannel *channel,
+                                         DBusMessage       *message)
+{
+  HAVE_LOCK_CHECK (connection);
+
+  if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_CALL ||
+      dbus_message_get_no_reply (message))
+    return TRUE;
+
+  if (dbus_message_get_serial (message) == 0)
+    dbus_message_set_serial (message,
+                             _dbus_connection_get_next_client_serial (connection));
+
+  return _dbus_hash_table_insert_int (channel->calls_out,
+                                      dbus_message_get_serial (message),
+                                      _DBUS_INT_TO_POINTER (1));
+}
+
+/* Sends a message through a direct channel with the serial it would
+ * have had on the bus, so that nothing above this can tell which way
+ * it went */
+static void
+connection_send_on_direct_channel_unlocked (DBusConnection       *connection,
+                                            DBusDirectChannel    *channel,
+                                            DBusPreallocatedSend *preallocated,
+                                            DBusMessage          *message,
+                                            dbus_uint32_t        *client_serial)
+{
+  DBusConnection *direct = channel->connection;
+  DBusCounter *counter;
+
+  HAVE_LOCK_CHECK (connection);
+
+  if (dbus_message_get_serial (message) == 0)
+    dbus_message_set_serial (message,
+                             _dbus_connection_get_next_client_serial (connection));
+
+  CONNECTION_LOCK (direct);
+
+  /* The preallocation is good for any connection once it counts
+   * against the right outgoing counter */
+  counter = preallocated->counter_link->data;
+  preallocated->counter_link->data = direct->outgoing_counter;
+  _dbus_counter_ref (direct->outgoing_counter);
+  _dbus_counter_unref (counter);
+  preallocated->connection = direct;
+
+  _dbus_connection_send_preallocated_unlocked_no_update (direct, preallocated,
+                                                         message, client_serial);
+  CONNECTION_UNLOCK (direct);
+}
+
+/* Dispatches the direct connections, which moves what came in
+ * through them to our queue, and lets go of the ones that are gone.
+ * Called with the lock and the dispatcher held; drops the lock in
+ * between. */
+static void
+connection_dispatch_direct_channels_unlocked (DBusConnection *connection)
+{
+  DBusList *directs = NULL;
+  DBusList *dropped = NULL;
+  DBusList *link, *next;
+  DBusConnection *direct;
+  dbus_bool_t need_memory = FALSE;
+
+  HAVE_LOCK_CHECK (connection);
+
+  connection->direct_channels_need_dispatch = FALSE;
+
+  if (!connection_copy_direct_connections_unlocked (connection, &directs))
+    {
+      connection->direct_channels_need_dispatch = TRUE;
+      return;
+    }
+
+  CONNECTION_UNLOCK (connection);
+
+  for (link = _dbus_list_get_first_link (&directs);
+       link != NULL;
+       link = _dbus_list_get_next_link (&directs, link))
+    {
+      DBusDispatchStatus status;
+
+      direct = link->data;
+      while ((status = dbus_connection_dispatch (direct)) ==
+             DBUS_DISPATCH_DATA_REMAINS)
+        ;
+
+      if (status == DBUS_DISPATCH_NEED_MEMORY)
+        need_memory = TRUE;
+    }
+
+  CONNECTION_LOCK (connection);
+
+  link = _dbus_list_get_first_link (&connection->direct_channels);
+  while (link != NULL)
+    {
+      DBusDirectChannel *channel = link->data;
+
+      next = _dbus_list_get_next_link (&connection->direct_channels, link);
+
+      if (channel->disconnected)
+        {
+          _dbus_list_unlink (&connection->direct_channels, link);
+          _dbus_list_append_link (&dropped, link);
+        }
+
+      link = next;
+    }
+
+  if (need_memory)
+    connection->direct_channels_need_dispatch = TRUE;
+
+  CONNECTION_UNLOCK (connection);
+
+  direct_channels_drop_all (&dropped);
+  while ((direct = _dbus_list_pop_first (&directs)) != NULL)
+    dbus_connection_unref (direct);
+
+  CONNECTION_LOCK (connection);
+}
+
+/* Like an iteration with DBUS_ITERATION_BLOCK, but the direct
+ * channels have sockets of their own, which have to wake us up too */
+static void
+connection_iterate_with_direct_channels_unlocked (DBusConnection *connection,
+                                                  int             timeout_milliseconds)
+{
+  DBusList *directs = NULL;
+  DBusPollFD *fds;
+  DBusConnection **polled;
+  DBusConnection *direct;
+  DBusSocket sock;
+  int n_fds, i;
+
+  HAVE_LOCK_CHECK (connection);
+
+  n_fds = _dbus_list_get_length (&connection->direct_channels) + 1;
+  fds = dbus_new0 (DBusPollFD, n_fds);
+  polled = dbus_new0 (DBusConnection *, n_fds);
+
+  if (fds == NULL || polled == NULL ||
+      !_dbus_transport_get_socket_fd (connection->transport, &sock) ||
+      !connection_copy_direct_connections_unlocked (connection, &directs))
+    {
+      dbus_free (fds);
+      dbus_free (polled);
+      _dbus_connection_do_iteration_unlocked (connection, NULL,
+                                              DBUS_ITERATION_DO_READING |
+                                              DBUS_ITERATION_DO_WRITING |
+                                              DBUS_ITERATION_BLOCK,
+                                              timeout_milliseconds);
+      return;
+    }
+
+  fds[0].fd = _dbus_socket_get_pollable (sock);
+  fds[0].events = _DBUS_POLLIN;
+  if (connection->n_outgoing > 0)
+    fds[0].events |= _DBUS_POLLOUT;
+
+  n_fds = 1;
+  while ((direct = _dbus_list_pop_first (&directs)) != NULL)
+    {
+      CONNECTION_LOCK (direct);
+      if (_dbus_transport_get_socket_fd (direct->transport, &sock))
+        {
+          fds[n_fds].fd = _dbus_socket_get_pollable (sock);
+          fds[n_fds].events = _DBUS_POLLIN;
+          if (direct->n_outgoing > 0)
+            fds[n_fds].events |= _DBUS_POLLOUT;
+          polled[n_fds] = direct;
+          n_fds++;
+          CONNECTION_UNLOCK (direct);
+        }
+      else
+        {
+          CONNECTION_UNLOCK (direct);
+          dbus_connection_unref (direct);
+        }
+    }
+
+  CONNECTION_UNLOCK (connection);
+
+  _dbus_poll (fds, n_fds, timeout_milliseconds);
+
+  for (i = 1; i < n_fds; i++)
+    {
+      if (fds[i].revents != 0)
+        {
+          dbus_connection_read_write (polled[i], 0);
+
+          if (dbus_connection_get_dispatch_status (polled[i]) !=
+              DBUS_DISPATCH_COMPLETE)
+            {
+              CONNECTION_LOCK (connection);
+              connection->direct_channels_need_dispatch = TRUE;
+              CONNECTION_UNLOCK (connection);
+            }
+        }
+
+      dbus_connection_unref (polled[i]);
+    }
+
+  CONNECTION_LOCK (connection);
+
+  if (fds[0].revents != 0 &&
+      _dbus_connection_get_is_connected_unlocked (connection))
+    _dbus_connection_do_iteration_unlocked (connection, NULL,
+                                            DBUS_ITERATION_DO_READING |
+                                            DBUS_ITERATION_DO_WRITING |
+                                            DBUS_ITERATION_BLOCK,
+                                            0);
+
+  dbus_free (fds);
+  dbus_free (polled);
+}
+
+/**
+ * Starts sending messages for a peer's unique name through a socket
+ * the bus handed us, and treating what arrives on it as if the bus
+ * had routed it from the peer. A channel that was there for the same
+ * peer is closed.
+ *
+ * @param connection the bus connection
+ * @param peer unique name of the other end
+ * @param fd our end of the channel, owned by the channel (closed on
+ *  failure)
+ * @param error return location for an error
+ * @returns #FALSE if error is set
+ */
+dbus_bool_t
+_dbus_connection_add_direct_channel (DBusConnection *connection,
+                                     const char     *peer,
+                                     int             fd,
+                                     DBusError      *error)
+{
+#ifdef HAVE_UNIX_FD_PASSING
+  DBusDirectChannel *channel;
+  DBusConnection *direct, *replaced = NULL;
+  DBusTransport *transport;
+  DBusCredentials *identity;
+  DBusSocket sock = { fd };
+  DBusGUID uuid;
+  DBusString guid;
+  DBusAddWatchFunction add_watch;
+  DBusRemoveWatchFunction remove_watch;
+  DBusWatchToggledFunction toggle_watch;
+  DBusAddTimeoutFunction add_timeout;
+  DBusRemoveTimeoutFunction remove_timeout;
+  DBusTimeoutToggledFunction toggle_timeout;
+  void *watch_data, *timeout_data;
+  DBusList *link;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  /* The transport wants a server guid, though there is no auth
+   * conversation to use it in */
+  if (!_dbus_generate_uuid (&uuid, error))
+    {
+      _dbus_close_socket (sock, NULL);
+      return FALSE;
+    }
+
+  channel = dbus_new0 (DBusDirectChannel, 1);
+  identity = _dbus_credentials_new ();
+  if (channel == NULL || identity == NULL ||
+      !_dbus_string_init (&guid))
+    {
+      if (identity != NULL)
+        _dbus_credentials_unref (identity);
+      dbus_free (channel);
+      _dbus_close_socket (sock, NULL);
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  channel->peer = _dbus_strdup (peer);
+  channel->calls_in = _dbus_hash_table_new (DBUS_HASH_INT, NULL, NULL);
+  channel->calls_out = _dbus_hash_table_new (DBUS_HASH_INT, NULL, NULL);
+  if (channel->peer == NULL || channel->calls_in == NULL ||
+      channel->calls_out == NULL ||
+      !_dbus_uuid_encode (&uuid, &guid))
+    {
+      _dbus_string_free (&guid);
+      _dbus_credentials_unref (identity);
+      direct_channel_free (channel);
+      _dbus_close_socket (sock, NULL);
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  /* The bus checked who the peer is; there is nothing to authenticate
+   * it as on a socket the bus created, so it is anonymous from the
+   * start */
+  transport = _dbus_transport_new_for_socket (sock, &guid, NULL);
+  _dbus_string_free (&guid);
+
+  if (transport == NULL)
+    {
+      _dbus_credentials_unref (identity);
+      direct_channel_free (channel);
+      _dbus_close_socket (sock, NULL);
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  _dbus_transport_set_allow_anonymous (transport, TRUE);
+
+  if (_dbus_transport_resume_authenticated (transport, identity, TRUE))
+    direct = _dbus_connection_new_for_transport (transport);
+  else
+    direct = NULL;
+
+  _dbus_transport_unref (transport);
+  _dbus_credentials_unref (identity);
+
+  if (direct == NULL)
+    {
+      direct_channel_free (channel);
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  /* Peer messages for the peer's name are answered by the
+   * application, like when they come through the bus */
+  dbus_connection_set_route_peer_messages (direct, TRUE);
+
+  /* Nobody but the peer can send on the channel, so the sender is
+   * known without asking the bus; replies to our calls are stamped
+   * with it too. Nothing has been read yet, so there is no need to
+   * lock. */
+  direct->received_sender = _dbus_strdup (peer);
+  if (direct->received_sender == NULL)
+    {
+      dbus_connection_close (direct);
+      dbus_connection_unref (direct);
+      direct_channel_free (channel);
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  channel->connection = direct;
+  channel->owner = connection;
+
+  if (!dbus_connection_add_filter (direct, direct_channel_filter, channel,
+                                   direct_channel_free))
+    {
+      dbus_connection_close (direct);
+      dbus_connection_unref (direct);
+      direct_channel_free (channel);
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  dbus_connection_set_dispatch_status_function (direct,
+                                                direct_channel_dispatch_status,
+                                                channel, NULL);
+
+  CONNECTION_LOCK (connection);
+  _dbus_watch_list_get_functions (connection->watches, &add_watch,
+                                  &remove_watch, &toggle_watch, &watch_data);
+  _dbus_timeout_list_get_functions (connection->timeouts, &add_timeout,
+                                    &remove_timeout, &toggle_timeout,
+                                    &timeout_data);
+  CONNECTION_UNLOCK (connection);
+
+  if (!dbus_connection_set_watch_functions (direct, add_watch, remove_watch,
+                                            toggle_watch, watch_data, NULL) ||
+      !dbus_connection_set_timeout_functions (direct, add_timeout,
+                                              remove_timeout, toggle_timeout,
+                                              timeout_data, NULL))
+    {
+      direct_channel_drop (channel);
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  CONNECTION_LOCK (connection);
+
+  if (!_dbus_connection_get_is_connected_unlocked (connection))
+    {
+      CONNECTION_UNLOCK (connection);
+      direct_channel_drop (channel);
+      dbus_set_error (error, DBUS_ERROR_DISCONNECTED,
+                      "Connection to the bus was closed");
+      return FALSE;
+    }
+
+  if (!_dbus_list_append (&connection->direct_channels, channel))
+    {
+      CONNECTION_UNLOCK (connection);
+      direct_channel_drop (channel);
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  for (link = _dbus_list_get_first_link (&connection->direct_channels);
+       link != NULL;
+       link = _dbus_list_get_next_link (&connection->direct_channels, link))
+    {
+      DBusDirectChannel *other = link->data;
+
+      if (other != channel && !other->closed &&
+          strcmp (other->peer, peer) == 0)
+        {
+          other->closed = TRUE;
+          replaced = other->connection;
+          dbus_connection_ref (replaced);
+          break;
+        }
+    }
+
+  CONNECTION_UNLOCK (connection);
+
+  _dbus_verbose ("Direct channel %p to %s added to %p\n", direct, peer,
+                 connection);
+
+  /* it is dropped once its Disconnected message has been dispatched */
+  if (replaced != NULL)
+    {
+      dbus_connection_close (replaced);
+      dbus_connection_unref (replaced);
+    }
+
+  return TRUE;
+#else
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "Direct channels are not supported on this platform");
+  return FALSE;
+#endif
+}
+
+/**
+ * Stops using the direct channel to a peer, because the bus said so.
+ * Messages for the peer go through the bus again; whatever was
+ * already sent through the channel is lost.
+ *
+ * @param connection the bus connection
+ * @param peer unique name of the other end
+ */
+void
+_dbus_connection_close_direct_channel (DBusConnection *connection,
+                                       const char     *peer)
+{
+  DBusConnection *direct = NULL;
+  DBusList *link;
+
+  CONNECTION_LOCK (connection);
+
+  for (link = _dbus_list_get_first_link (&connection->direct_channels);
+       link != NULL;
+       link = _dbus_list_get_next_link (&connection->direct_channels, link))
+    {
+      DBusDirectChannel *channel = link->data;
+
+      if (!channel->closed && strcmp (channel->peer, peer) == 0)
+        {
+          channel->closed = TRUE;
+          direct = channel->connection;
+          dbus_connection_ref (direct);
+          break;
+        }
+    }
+
+  CONNECTION_UNLOCK (connection);
+
+  if (direct != NULL)
+    {
+      _dbus_verbose ("Closing direct channel %p to %s\n", direct, peer);
+      dbus_connection_close (direct);
+      dbus_connection_unref (direct);
+    }
+}
+
+/**
+ * Creates the server side of a connection whose peer already
+ * authenticated with a previous instance of the same server, which
+ * handed over the socket together with the peer's identity. The new
+ * connection is authenticated without asking the peer anything.
+ *
+ * @param fd the socket, owned by the connection (closed on failure)
+ * @param server_guid the guid of the server the peer connected to
+ * @param identity the identity the peer was authorized as
+ * @param unix_fd_negotiated whether unix fd passing was agreed on
+ * @returns the new connection, or #NULL if no memory
+ */
+DBusConnection*
+_dbus_connection_new_for_resumed_socket (DBusSocket        fd,
+                                         const DBusString *server_guid,
+                                         DBusCredentials  *identity,
+                                         dbus_bool_t       unix_fd_negotiated)
+{
+  DBusTransport *transport;
+  DBusConnection *connection;
+
+  transport = _dbus_transport_new_for_socket (fd, server_guid, NULL);
+  if (transport == NULL)
+    {
+      _dbus_close_socket (fd, NULL);
+      return NULL;
+    }
+
+  /* from here on the fd is closed with the transport */
+  if (!_dbus_transport_resume_authenticated (transport, identity,
+                                             unix_fd_negotiated))
+    {
+      _dbus_transport_unref (transport);
+      return NULL;
+    }
+
+  connection = _dbus_connection_new_for_transport (transport);
+  _dbus_transport_unref (transport);
+
+  return connection;
+}
+
+/**
+ * Copies the identity the peer of an authenticated connection was
+ * authorized as.
+ *
+ * @param connection the connection
+ * @returns the credentials, or #NULL if not authenticated or no memory
+ */
+DBusCredentials*
+_dbus_connection_copy_identity (DBusConnection *connection)
+{
+  DBusCredentials *identity;
+
+  CONNECTION_LOCK (connection);
+  identity = _dbus_transport_copy_identity (connection->transport);
+  CONNECTION_UNLOCK (connection);
+
+  return identity;
+}
+
+/**
+ * Copies what has been read from the connection but not turned into
+ * a message yet. Only works once every complete message has been
+ * moved to the incoming queue, see dbus_connection_get_dispatch_status().
+ *
+ * @param connection the connection
+ * @param bytes string to append the bytes to
+ * @param fds return location for the fds received with them, still
+ *  owned by the connection
+ * @param n_fds return location for the number of fds
+ * @returns #FALSE if no memory or if there are complete messages left
+ */
+dbus_bool_t
+_dbus_connection_get_unparsed_incoming (DBusConnection  *connection,
+                                        DBusString      *bytes,
+                                        const int      **fds,
+                                        unsigned int    *n_fds)
+{
+  dbus_bool_t result;
+
+  CONNECTION_LOCK (connection);
+  result = _dbus_transport_get_unparsed_incoming (connection->transport,
+                                                  bytes, fds, n_fds);
+  CONNECTION_UNLOCK (connection);
+
+  return result;
+}
+
+/**
+ * Puts bytes and fds taken with _dbus_connection_get_unparsed_incoming()
+ * from another connection on the same socket into this one, to be
+ * parsed as if they had just been read.
+ *
+ * @param connection the connection
+ * @param bytes the bytes
+ * @param fds the fds, owned by the connection on success
+ * @param n_fds the number of fds
+ * @returns #FALSE if no memory or more fds than a message may carry
+ */
+dbus_bool_t
+_dbus_connection_inject_incoming (DBusConnection   *connection,
+                                  const DBusString *bytes,
+                                  const int        *fds,
+                                  unsigned int      n_fds)
+{
+  dbus_bool_t result;
+
+  CONNECTION_LOCK (connection);
+  result = _dbus_transport_inject_incoming (connection->transport,
+                                            bytes, fds, n_fds);
+  CONNECTION_UNLOCK (connection);
+
+  return result;
+}
+
+/**
+ * Writes out the outgoing queue like dbus_connection_flush(), but
+ * without reading anything, and gives up after the given time.
+ *
+ * @param connection the connection
+ * @param timeout_milliseconds how long to keep trying
+ * @returns #TRUE if nothing is left to send
+ */
+dbus_bool_t
+_dbus_connection_flush_outgoing (DBusConnection *connection,
+                                 int             timeout_milliseconds)
+{
+  long start_tv_sec, start_tv_usec;
+  long tv_sec, tv_usec;
+  int elapsed;
+  dbus_bool_t flushed;
+
+  _dbus_get_monotonic_time (&start_tv_sec, &start_tv_usec);
+
+  CONNECTION_LOCK (connection);
+
+  while (connection->n_outgoing > 0 &&
+         _dbus_connection_get_is_connected_unlocked (connection))
+    {
+      _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+      elapsed = (tv_sec - start_tv_sec) * 1000 +
+        (tv_usec - start_tv_usec) / 1000;
+
+      if (elapsed >= timeout_milliseconds)
+        break;
+
+      _dbus_connection_do_iteration_unlocked (connection,
+                                              NULL,
+                                              DBUS_ITERATION_DO_WRITING |
+                                              DBUS_ITERATION_BLOCK,
+                                              timeout_milliseconds - elapsed);
+    }
+
+  /* nobody is left to read what a dead peer didn't */
+  flushed = connection->n_outgoing == 0 ||
+    !_dbus_connection_get_is_connected_unlocked (connection);
+
+  CONNECTION_UNLOCK (connection);
+
+  return flushed;
+}
+
+/**
+ * Gets the Windows user SID of the connection if known.  Returns
+ * #TRUE if the ID is filled in.  Always returns #FALSE on non-Windows
+ * platforms for now, though in theory someone could hook UNIX to
+ * Active Directory or something.  Always returns #FALSE prior to
+ * authenticating the connection.
+ *
+ * The user is only read by servers from clients; clients can't usually
+ * get the user of servers, because servers do not authenticate to
+ * clients. The returned user is the user the connection authenticated
+ * as.
+ *
+ * The message bus is a server and the apps connecting to the bus
+ * are clients.
+ *
+ * The returned user string has to be freed with dbus_free().
+ *
+ * The return value indicates whether the user SID is available;
+ * if it's available but we don't have the memory to copy it,
+ * then the return value is #TRUE and #NULL is given as the SID.
+ * 
+ * @todo We would like to be able to say "You can ask the bus to tell
+ * you the user of another connection though if you like; this is done
+ * with dbus_bus_get_windows_user()." But this has to be implemented
+ * in bus/driver.c and dbus/dbus-bus.c, and is pointless anyway
+ * since on Windows we only use the session bus for now.
+ *
+ * @param connection the connection
+ * @param windows_sid_p return location for an allocated copy of the user ID, or #NULL if no memory
+ * @returns #TRUE if user is available (returned value may be #NULL anyway if no memory)
+ */
+dbus_bool_t
+dbus_connection_get_windows_user (DBusConnection             *connection,
+                                  char                      **windows_sid_p)
+{
+  dbus_bool_t result;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (windows_sid_p != NULL, FALSE);
+
+  CONNECTION_LOCK (connection);
+
+  if (!_dbus_transport_try_to_authenticate (connection->transport))
+    result = FALSE;
+  else
+    result = _dbus_transport_get_windows_user (connection->transport,
+                                               windows_sid_p);
+
+#ifdef DBUS_UNIX
+  _dbus_assert (!result);
+#endif
+  
+  CONNECTION_UNLOCK (connection);
+
+  return result;
+}
+
+/**
+ * Sets a predicate function used to determine whether a given user ID
+ * is allowed to connect. When an incoming connection has
+ * authenticated with a particular user ID, this function is called;
+ * if it returns #TRUE, the connection is allowed to proceed,
+ * otherwise the connection is disconnected.
+ *
+ * If the function is set to #NULL (as it is by default), then
+ * only the same user owning the server process will be allowed to
+ * connect.
+ *
+ * On UNIX, the function will be set and its free_data_function will
+ * be invoked when the connection is freed or a new function is set.
+ * However, the function will never be called, because there is no
+ * way right now to authenticate as a Windows user on UNIX.
+ * 
+ * @param connection the connection
+ * @param function the predicate
+ * @param data data to pass to the predicate
+ * @param free_data_function function to free the data
+ */
+void
+dbus_connection_set_windows_user_function (DBusConnection              *connection,
+                                           DBusAllowWindowsUserFunction function,
+                                           void                        *data,
+                                           DBusFreeFunction             free_data_function)
+{
+  void *old_data = NULL;
+  DBusFreeFunction old_free_function = NULL;
+
+  _dbus_return_if_fail (connection != NULL);
+  
+  CONNECTION_LOCK (connection);
+  _dbus_transport_set_windows_user_function (connection->transport,
+                                             function, data, free_data_function,
+                                             &old_data, &old_free_function);
+  CONNECTION_UNLOCK (connection);
+
+  if (old_free_function != NULL)
+    (* old_free_function) (old_data);
+}
+
+/**
+ * This function must be called on the server side of a connection when the
+ * connection is first seen in the #DBusNewConnectionFunction. If set to
+ * #TRUE (the default is #FALSE), then the connection can proceed even if
+ * the client does not authenticate as some user identity, i.e. clients
+ * can connect anonymously.
+ * 
+ * This setting interacts with the available authorization mechanisms
+ * (see dbus_server_set_auth_mechanisms()). Namely, an auth mechanism
+ * such as ANONYMOUS that supports anonymous auth must be included in
+ * the list of available mechanisms for anonymous login to work.
+ *
+ * This setting also changes the default rule for connections
+ * authorized as a user; normally, if a connection authorizes as
+ * a user identity, it is permitted if the user identity is
+ * root or the user identity matches the user identity of the server
+ * process. If anonymous connections are allowed, however,
+ * then any user identity is allowed.
+ *
+ * You can override the rules for connections authorized as a
+ * user identity with dbus_connection_set_unix_user_function()
+ * and dbus_connection_set_windows_user_function().
+ * 
+ * @param connection the connection
+ * @param value whether to allow authentication as an anonymous user
+ */
+void
+dbus_connection_set_allow_anonymous (DBusConnection             *connection,
+                                     dbus_bool_t                 value)
+{
+  _dbus_return_if_fail (connection != NULL);
+  
+  CONNECTION_LOCK (connection);
+  _dbus_transport_set_allow_anonymous (connection->transport, value);
+  CONNECTION_UNLOCK (connection);
+}
+
+/**
+ *
+ * Normally #DBusConnection automatically handles all messages to the
+ * org.freedesktop.DBus.Peer interface. However, the message bus wants
+ * to be able to route methods on that interface through the bus and
+ * to other applications. If routing peer messages is enabled, then
+ * messages with the org.freedesktop.DBus.Peer interface that also
+ * have a bus destination name set will not be automatically
  * handled by the #DBusConnection and instead will be dispatched
  * normally to the application.
  *
@@ -6340,8 +7570,69 @@ _dbus_connection_get_stats (DBusConnection *connection,
 
   CONNECTION_UNLOCK (connection);
 }
+
+/**
+ * Gets an estimate of the memory a connection is holding on to: the
+ * connection and its transport's buffers, plus incoming and outgoing
+ * messages that have not been released yet.
+ *
+ * @param connection the connection
+ * @returns size in bytes
+ */
+dbus_uint32_t
+_dbus_connection_get_footprint (DBusConnection *connection)
+{
+  dbus_uint32_t queued_in, total;
+
+  CONNECTION_LOCK (connection);
+
+  _dbus_transport_get_stats (connection->transport,
+                             &queued_in, NULL, NULL, NULL);
+
+  total = sizeof (DBusConnection) +
+    _dbus_transport_get_allocated_size (connection->transport) +
+    queued_in +
+    _dbus_counter_get_size_value (connection->outgoing_counter);
+
+  CONNECTION_UNLOCK (connection);
+
+  return total;
+}
 #endif /* DBUS_ENABLE_STATS */
 
+/**
+ * Gives back memory that the connection's buffers grew into and no
+ * longer need. Meant for connections that have been idle for a
+ * while; on a busy connection the buffers would just grow again.
+ *
+ * @param connection the connection
+ */
+void
+_dbus_connection_trim_memory (DBusConnection *connection)
+{
+  CONNECTION_LOCK (connection);
+  _dbus_transport_trim (connection->transport);
+  CONNECTION_UNLOCK (connection);
+}
+
+/**
+ * Sets whether sending a message writes it to the transport straight
+ * away, which is the default, or only queues it and enables the write
+ * watch. The latter is for connections whose watches are serviced by
+ * another thread, so that the sending thread never does the I/O.
+ *
+ * @param connection the connection
+ * @param deferred #TRUE to leave writing to the write watch
+ */
+void
+_dbus_connection_set_writes_deferred (DBusConnection *connection,
+                                      dbus_bool_t     deferred)
+{
+  CONNECTION_LOCK (connection);
+  connection->writes_deferred = (deferred != FALSE);
+  CONNECTION_UNLOCK (connection);
+}
+
 /**
  * Gets the approximate number of uni fds of all messages in the
  * outgoing message queue.
@@ -24,6 +24,7 @@
 #include <string.h>
 #include "dbus-credentials.h"
 #include "dbus-internals.h"
+#include "dbus-mempool.h"
 
 /**
  * @defgroup DBusCredentials Credentials provable through authentication
@@ -62,6 +63,9 @@ struct DBusCredentials {
  * @{
  */
 
+static DBusSlab credentials_slab =
+  _DBUS_SLAB_INIT (sizeof (DBusCredentials), DBUS_MEM_TAG_CONNECTION);
+
 /**
  * Creates a new credentials object.
  *
@@ -72,7 +76,7 @@ _dbus_credentials_new (void)
 {
   DBusCredentials *creds;
 
-  creds = dbus_new (DBusCredentials, 1);
+  creds = _dbus_slab_alloc (&credentials_slab);
   if (creds == NULL)
     return NULL;
   
@@ -137,7 +141,7 @@ _dbus_credentials_unref (DBusCredentials    *credentials)
       dbus_free (credentials->windows_sid);
       dbus_free (credentials->linux_security_label);
       dbus_free (credentials->adt_audit_data);
-      dbus_free (credentials);
+      _dbus_slab_dealloc (&credentials_slab, credentials);
     }
 }
 
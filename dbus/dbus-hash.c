@@ -5,8 +5,8 @@
  * Copyright (c) 1991-1993 The Regents of the University of California.
  * Copyright (c) 1994 Sun Microsystems, Inc.
  * 
- * Hash table implementation based on generic/tclHash.c from the Tcl
- * source code. The original Tcl license applies to portions of the
+ * Hash table implementation originally based on generic/tclHash.c
+ * from the Tcl source code. The original Tcl license applies to portions of the
  * code from tclHash.c; the Tcl license follows this standad D-Bus 
  * license information.
  *
@@ -77,7 +77,10 @@
 #include <config.h>
 #include "dbus-hash.h"
 #include "dbus-internals.h"
-#include "dbus-mempool.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /**
  * @defgroup DBusHashTable Hash table
@@ -94,40 +97,45 @@
  *
  * The guts of DBusHashTable.
  *
+ * The table uses open addressing. Entries live in a single flat array
+ * of key/value pairs, and a parallel array holds one control byte per
+ * slot. A control byte is either one of the negative markers below,
+ * or (for an occupied slot) the low 7 bits of the entry's hash, so
+ * most mismatching keys are rejected without touching the entry.
+ * Slots are probed a group at a time: with SSE2 a group is 16 control
+ * bytes compared in one instruction, otherwise it is 8 bytes compared
+ * as a single 64-bit word.
+ *
+ * Removing an entry never moves other entries, which is what keeps
+ * removal during iteration safe.
+ *
  * @{
  */
 
-/**
- * When there are this many entries per bucket, on average, rebuild
- * the hash table to make it larger.
- */
-#define REBUILD_MULTIPLIER  3
+/** Control byte of a slot that has never been used */
+#define CTRL_EMPTY    ((signed char) -128)
+/** Control byte of a slot whose entry was removed (a tombstone) */
+#define CTRL_DELETED  ((signed char) -2)
+/** Control byte padding out a group past the end of a small table */
+#define CTRL_SENTINEL ((signed char) -1)
 
-/**
- * Takes a preliminary integer hash value and produces an index into a
- * hash tables bucket list.  The idea is to make it so that
- * preliminary values that are arbitrarily similar will end up in
- * different buckets.  The hash function was taken from a
- * random-number generator. (This is used to hash integers.)
- *
- * The down_shift drops off the high bits of the hash index, and
- * decreases as we increase the number of hash buckets (to keep more
- * range in the hash index). The mask also strips high bits and strips
- * fewer high bits as the number of hash buckets increases.
- * I don't understand two things: why is the initial downshift 28
- * to keep 4 bits when the initial mask is 011 to keep 2 bits,
- * and why do we have both a mask and a downshift?
- * 
- */
-#define RANDOM_INDEX(table, i) \
-    (((((intptr_t) (i))*1103515245) >> (table)->down_shift) & (table)->mask)
+#ifdef __SSE2__
+/** Number of control bytes examined at once */
+#define GROUP_WIDTH 16
+#else
+#define GROUP_WIDTH 8
+#endif
+
+/** Smallest number of slots allocated for a non-empty table */
+#define MIN_CAPACITY 4
 
 /**
- * Initial number of buckets in hash table (hash table statically
- * allocates its buckets for this size and below).
- * The initial mask has to be synced to this.
+ * Number of used slots (entries plus tombstones) a table of the
+ * given capacity may hold before it is rebuilt. Keeping 1/8 of the
+ * slots empty bounds the probe length and guarantees every lookup
+ * finds an empty slot to stop at.
  */
-#define DBUS_SMALL_HASH_TABLE 4
+#define MAX_LOAD(capacity) ((capacity) * 7 / 8)
 
 /**
  * Typedef for DBusHashEntry
@@ -137,28 +145,15 @@ typedef struct DBusHashEntry DBusHashEntry;
 /**
  * @brief Internal representation of a hash entry.
  * 
- * A single entry (key-value pair) in the hash table.
+ * A single slot (key-value pair) in the hash table.
  * Internal to hash table implementation.
  */
 struct DBusHashEntry
 {
-  DBusHashEntry *next;    /**< Pointer to next entry in this
-                           * hash bucket, or #NULL for end of
-                           * chain.
-                           */
   void *key;              /**< Hash key */
   void *value;            /**< Hash value */
 };
 
-/**
- * Function used to find and optionally create a hash entry.
- */
-typedef DBusHashEntry* (* DBusFindEntryFunction) (DBusHashTable        *table,
-                                                  void                 *key,
-                                                  dbus_bool_t           create_if_not_found,
-                                                  DBusHashEntry      ***bucket,
-                                                  DBusPreallocatedHash *preallocated);
-
 /**
  * @brief Internals of DBusHashTable.
  * 
@@ -167,43 +162,32 @@ typedef DBusHashEntry* (* DBusFindEntryFunction) (DBusHashTable        *table,
  */
 struct DBusHashTable {
   int refcount;                       /**< Reference count */
-  
-  DBusHashEntry **buckets;            /**< Pointer to bucket array.  Each
-                                       * element points to first entry in
-                                       * bucket's hash chain, or #NULL.
+
+  signed char *ctrl;                  /**< Control bytes, one per slot plus
+                                       * sentinels to fill the last group;
+                                       * #NULL until the first insertion.
+                                       */
+  DBusHashEntry *entries;             /**< Slots, allocated in the same
+                                       * block as @c ctrl.
+                                       */
+  int capacity;                       /**< Number of slots, a power of two
+                                       * or zero.
+                                       */
+  int n_entries;                      /**< Total number of entries present
+                                       * in table.
+                                       */
+  int n_deleted;                      /**< Number of tombstones */
+  int n_reserved;                     /**< Number of slots promised to
+                                       * outstanding DBusPreallocatedHash
+                                       */
+  int min_capacity;                   /**< Never shrink below this many
+                                       * slots, see
+                                       * _dbus_hash_table_set_size_hint()
                                        */
-  DBusHashEntry *static_buckets[DBUS_SMALL_HASH_TABLE];
-                                       /**< Bucket array used for small tables
-                                        * (to avoid mallocs and frees).
-                                        */
-  int n_buckets;                       /**< Total number of buckets allocated
-                                        * at **buckets.
-                                        */
-  int n_entries;                       /**< Total number of entries present
-                                        * in table.
-                                        */
-  int hi_rebuild_size;                 /**< Enlarge table when n_entries gets
-                                        * to be this large.
-                                        */
-  int lo_rebuild_size;                 /**< Shrink table when n_entries gets
-                                        * below this.
-                                        */
-  int down_shift;                      /**< Shift count used in hashing
-                                        * function.  Designed to use high-
-                                        * order bits of randomized keys.
-                                        */
-  int mask;                            /**< Mask value used in hashing
-                                        * function.
-                                        */
   DBusHashType key_type;               /**< Type of keys used in this table */
 
-
-  DBusFindEntryFunction find_function; /**< Function for finding entries */
-
   DBusFreeFunction free_key_function;   /**< Function to free keys */
   DBusFreeFunction free_value_function; /**< Function to free values */
-
-  DBusMemPool *entry_pool;              /**< Memory pool for hash entries */
 };
 
 /** 
@@ -212,38 +196,30 @@ struct DBusHashTable {
 typedef struct
 {
   DBusHashTable *table;     /**< Pointer to table containing entry. */
-  DBusHashEntry **bucket;   /**< Pointer to bucket that points to
-                             * first entry in this entry's chain:
-                             * used for deleting the entry.
-                             */
-  DBusHashEntry *entry;      /**< Current hash entry */
-  DBusHashEntry *next_entry; /**< Next entry to be iterated onto in current bucket */
-  int next_bucket;           /**< index of next bucket */
-  int n_entries_on_init;     /**< used to detect table resize since initialization */
+  DBusHashEntry *entry;     /**< Current hash entry */
+  int next_slot;            /**< index of next slot to examine */
+  int n_entries_on_init;    /**< used to detect table resize since initialization */
 } DBusRealHashIter;
 
 _DBUS_STATIC_ASSERT (sizeof (DBusRealHashIter) == sizeof (DBusHashIter));
 
-static DBusHashEntry* find_direct_function      (DBusHashTable          *table,
-                                                 void                   *key,
-                                                 dbus_bool_t             create_if_not_found,
-                                                 DBusHashEntry        ***bucket,
-                                                 DBusPreallocatedHash   *preallocated);
-static DBusHashEntry* find_string_function      (DBusHashTable          *table,
-                                                 void                   *key,
-                                                 dbus_bool_t             create_if_not_found,
-                                                 DBusHashEntry        ***bucket,
-                                                 DBusPreallocatedHash   *preallocated);
+/** Bit mask of the slots in a group matching some condition */
+#ifdef __SSE2__
+typedef unsigned int GroupMask;
+#else
+typedef dbus_uint64_t GroupMask;
+
+/** The low bit of each byte of a group word */
+#define GROUP_LSBS DBUS_UINT64_CONSTANT (0x0101010101010101)
+/** The high bit of each byte of a group word */
+#define GROUP_MSBS DBUS_UINT64_CONSTANT (0x8080808080808080)
+#endif
+
 static unsigned int   string_hash               (const char             *str);
-static void           rebuild_table             (DBusHashTable          *table);
-static DBusHashEntry* alloc_entry               (DBusHashTable          *table);
-static void           remove_entry              (DBusHashTable          *table,
-                                                 DBusHashEntry         **bucket,
-                                                 DBusHashEntry          *entry);
-static void           free_entry                (DBusHashTable          *table,
-                                                 DBusHashEntry          *entry);
 static void           free_entry_data           (DBusHashTable          *table,
                                                  DBusHashEntry          *entry);
+static dbus_bool_t    resize_table              (DBusHashTable          *table,
+                                                 int                     new_capacity);
 
 
 /** @} */
@@ -287,43 +263,29 @@ _dbus_hash_table_new (DBusHashType     type,
                       DBusFreeFunction value_free_function)
 {
   DBusHashTable *table;
-  DBusMemPool *entry_pool;
   
-  table = dbus_new0 (DBusHashTable, 1);
+  table = _dbus_new0_tagged (DBUS_MEM_TAG_HASH, DBusHashTable, 1);
   if (table == NULL)
     return NULL;
 
-  entry_pool = _dbus_mem_pool_new (sizeof (DBusHashEntry), TRUE);
-  if (entry_pool == NULL)
-    {
-      dbus_free (table);
-      return NULL;
-    }
-  
+  /* No slots are allocated until the first insertion, so tables that
+   * stay empty (there are a lot of those) cost one small block.
+   */
   table->refcount = 1;
-  table->entry_pool = entry_pool;
-  
-  _dbus_assert (DBUS_SMALL_HASH_TABLE == _DBUS_N_ELEMENTS (table->static_buckets));
-  
-  table->buckets = table->static_buckets;  
-  table->n_buckets = DBUS_SMALL_HASH_TABLE;
+  table->ctrl = NULL;
+  table->entries = NULL;
+  table->capacity = 0;
   table->n_entries = 0;
-  table->hi_rebuild_size = DBUS_SMALL_HASH_TABLE * REBUILD_MULTIPLIER;
-  table->lo_rebuild_size = 0;
-  table->down_shift = 28;
-  table->mask = 3;
+  table->n_deleted = 0;
+  table->n_reserved = 0;
+  table->min_capacity = 0;
   table->key_type = type;
 
-  _dbus_assert (table->mask < table->n_buckets);
-  
   switch (table->key_type)
     {
     case DBUS_HASH_INT:
     case DBUS_HASH_UINTPTR:
-      table->find_function = find_direct_function;
-      break;
     case DBUS_HASH_STRING:
-      table->find_function = find_string_function;
       break;
     default:
       _dbus_assert_not_reached ("Unknown hash table type");
@@ -364,47 +326,17 @@ _dbus_hash_table_unref (DBusHashTable *table)
 
   if (table->refcount == 0)
     {
-#if 0
-      DBusHashEntry *entry;
-      DBusHashEntry *next;
       int i;
 
       /* Free the entries in the table. */
-      for (i = 0; i < table->n_buckets; i++)
+      for (i = 0; i < table->capacity; i++)
         {
-          entry = table->buckets[i];
-          while (entry != NULL)
-            {
-              next = entry->next;
-
-              free_entry (table, entry);
-              
-              entry = next;
-            }
+          if (table->ctrl[i] >= 0)
+            free_entry_data (table, &table->entries[i]);
         }
-#else
-      DBusHashEntry *entry;
-      int i;
-
-      /* Free the entries in the table. */
-      for (i = 0; i < table->n_buckets; i++)
-        {
-          entry = table->buckets[i];
-          while (entry != NULL)
-            {
-              free_entry_data (table, entry);
-              
-              entry = entry->next;
-            }
-        }
-      /* We can do this very quickly with memory pools ;-) */
-      _dbus_mem_pool_free (table->entry_pool);
-#endif
-      
-      /* Free the bucket array, if it was dynamically allocated. */
-      if (table->buckets != table->static_buckets)
-        dbus_free (table->buckets);
 
+      /* The entries share the control bytes' block */
+      dbus_free (table->ctrl);
       dbus_free (table);
     }
 }
@@ -425,16 +357,6 @@ _dbus_hash_table_remove_all (DBusHashTable *table)
     }
 }
 
-static DBusHashEntry*
-alloc_entry (DBusHashTable *table)
-{
-  DBusHashEntry *entry;
-
-  entry = _dbus_mem_pool_alloc (table->entry_pool);
-  
-  return entry;
-}
-
 static void
 free_entry_data (DBusHashTable  *table,
 		 DBusHashEntry  *entry)
@@ -445,41 +367,428 @@ free_entry_data (DBusHashTable  *table,
     (* table->free_value_function) (entry->value);
 }
 
-static void
-free_entry (DBusHashTable  *table,
-            DBusHashEntry  *entry)
+/* Finds the lowest set bit of a non-zero group mask */
+static inline int
+lowest_bit (GroupMask mask)
+{
+  _dbus_assert (mask != 0);
+
+#if defined(__GNUC__) && defined(__SSE2__)
+  return __builtin_ctz (mask);
+#elif defined(__GNUC__)
+  return __builtin_ctzll (mask);
+#else
+  {
+    int n = 0;
+
+    while ((mask & 1) == 0)
+      {
+        mask >>= 1;
+        n++;
+      }
+
+    return n;
+  }
+#endif
+}
+
+/* Converts a bit found by lowest_bit() to an offset within the group */
+#ifdef __SSE2__
+#define BIT_TO_SLOT(bit) (bit)
+#else
+#define BIT_TO_SLOT(bit) ((bit) >> 3)
+#endif
+
+#ifdef __SSE2__
+
+static inline GroupMask
+group_match (const signed char *ctrl,
+             signed char        h2)
 {
-  free_entry_data (table, entry);
-  _dbus_mem_pool_dealloc (table->entry_pool, entry);
+  __m128i group = _mm_loadu_si128 ((const __m128i *) ctrl);
+
+  return _mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_set1_epi8 (h2), group));
 }
 
-static void
-remove_entry (DBusHashTable  *table,
-              DBusHashEntry **bucket,
-              DBusHashEntry  *entry)
+static inline GroupMask
+group_match_empty (const signed char *ctrl)
 {
-  _dbus_assert (table != NULL);
-  _dbus_assert (bucket != NULL);
-  _dbus_assert (*bucket != NULL);  
-  _dbus_assert (entry != NULL);
-  
-  if (*bucket == entry)
-    *bucket = entry->next;
+  __m128i group = _mm_loadu_si128 ((const __m128i *) ctrl);
+
+  return _mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_set1_epi8 (CTRL_EMPTY),
+                                            group));
+}
+
+static inline GroupMask
+group_match_empty_or_deleted (const signed char *ctrl)
+{
+  __m128i group = _mm_loadu_si128 ((const __m128i *) ctrl);
+
+  /* EMPTY and DELETED are the only control bytes below SENTINEL */
+  return _mm_movemask_epi8 (_mm_cmpgt_epi8 (_mm_set1_epi8 (CTRL_SENTINEL),
+                                            group));
+}
+
+#else /* !__SSE2__ */
+
+/* Loads a group as a little-endian word, so that the lowest set bit
+ * of a mask always belongs to the first matching slot.
+ */
+static inline dbus_uint64_t
+group_load (const signed char *ctrl)
+{
+  dbus_uint64_t word = 0;
+  int i;
+
+  for (i = GROUP_WIDTH - 1; i >= 0; i--)
+    word = (word << 8) | (unsigned char) ctrl[i];
+
+  return word;
+}
+
+/* May report a false positive on a byte next to a true match;
+ * callers compare the control byte again before using the slot.
+ */
+static inline GroupMask
+group_match (const signed char *ctrl,
+             signed char        h2)
+{
+  dbus_uint64_t x = group_load (ctrl) ^ (GROUP_LSBS * (unsigned char) h2);
+
+  return (x - GROUP_LSBS) & ~x & GROUP_MSBS;
+}
+
+static inline GroupMask
+group_match_empty (const signed char *ctrl)
+{
+  dbus_uint64_t word = group_load (ctrl);
+
+  /* EMPTY is the only control byte with bit 7 set and bit 1 clear */
+  return word & ~(word << 6) & GROUP_MSBS;
+}
+
+static inline GroupMask
+group_match_empty_or_deleted (const signed char *ctrl)
+{
+  dbus_uint64_t word = group_load (ctrl);
+
+  /* EMPTY and DELETED are the only ones with bit 7 set and bit 0 clear */
+  return word & ~(word << 7) & GROUP_MSBS;
+}
+
+#endif /* !__SSE2__ */
+
+/* Spreads the key's hash over all 32 bits; the top bits pick the
+ * first group to probe and the low 7 bits are kept in the control
+ * byte.
+ */
+static unsigned int
+hash_key (DBusHashTable *table,
+          const void    *key)
+{
+  dbus_uint64_t h;
+
+  if (table->key_type == DBUS_HASH_STRING)
+    h = string_hash (key);
+  else
+    h = (uintptr_t) key;
+
+  return (unsigned int) ((h * DBUS_UINT64_CONSTANT (0x9E3779B97F4A7C15)) >> 32);
+}
+
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((signed char) ((hash) & 0x7f))
+
+static int
+n_groups (DBusHashTable *table)
+{
+  if (table->capacity < GROUP_WIDTH)
+    return 1;
+  else
+    return table->capacity / GROUP_WIDTH;
+}
+
+/* Number of control bytes, including the sentinels of a small table */
+static int
+n_ctrl_bytes (int capacity)
+{
+  return MAX (capacity, GROUP_WIDTH);
+}
+
+static dbus_bool_t
+keys_equal (DBusHashTable *table,
+            const void    *a,
+            const void    *b)
+{
+  if (table->key_type == DBUS_HASH_STRING)
+    return strcmp (a, b) == 0;
   else
+    return a == b;
+}
+
+/* Returns the slot holding key, or -1 */
+static int
+find_slot (DBusHashTable *table,
+           const void    *key,
+           unsigned int   hash)
+{
+  signed char h2;
+  int mask;
+  int group;
+  int i;
+
+  if (table->n_entries == 0)
+    return -1;
+
+  h2 = H2 (hash);
+  mask = n_groups (table) - 1;
+  group = H1 (hash) & mask;
+
+  /* Triangular probing visits every group of a power-of-two table */
+  for (i = 0; i <= mask; i++)
     {
-      DBusHashEntry *prev;
-      prev = *bucket;
+      const signed char *ctrl = table->ctrl + group * GROUP_WIDTH;
+      GroupMask match;
 
-      while (prev->next != entry)
-        prev = prev->next;      
-      
-      _dbus_assert (prev != NULL);
+      match = group_match (ctrl, h2);
+      while (match != 0)
+        {
+          int slot = group * GROUP_WIDTH + BIT_TO_SLOT (lowest_bit (match));
+
+          if (table->ctrl[slot] == h2 &&
+              keys_equal (table, key, table->entries[slot].key))
+            return slot;
+
+          match &= match - 1;
+        }
+
+      /* Nothing was ever displaced past a group that still has an
+       * empty slot, so the key is not in the table.
+       */
+      if (group_match_empty (ctrl) != 0)
+        return -1;
 
-      prev->next = entry->next;
+      group = (group + i + 1) & mask;
     }
-  
+
+  return -1;
+}
+
+/* Returns the first free slot in key's probe sequence; the table
+ * must have room.
+ */
+static int
+find_insert_slot (DBusHashTable *table,
+                  unsigned int   hash)
+{
+  int mask;
+  int group;
+  int i;
+
+  mask = n_groups (table) - 1;
+  group = H1 (hash) & mask;
+
+  for (i = 0; i <= mask; i++)
+    {
+      GroupMask match;
+
+      match = group_match_empty_or_deleted (table->ctrl + group * GROUP_WIDTH);
+      if (match != 0)
+        return group * GROUP_WIDTH + BIT_TO_SLOT (lowest_bit (match));
+
+      group = (group + i + 1) & mask;
+    }
+
+  _dbus_assert_not_reached ("hash table has no free slot");
+  return -1;
+}
+
+/* Smallest capacity that holds n_entries under the load limit, or -1 */
+static int
+capacity_for (DBusHashTable *table,
+              int            n_entries)
+{
+  int capacity;
+
+  capacity = MAX (MIN_CAPACITY, table->min_capacity);
+
+  while (MAX_LOAD (capacity) < n_entries)
+    {
+      /* overflow paranoia */
+      if (capacity > _DBUS_INT_MAX / 2 / (int) sizeof (DBusHashEntry))
+        return -1;
+
+      capacity *= 2;
+    }
+
+  return capacity;
+}
+
+/* Rehashes every entry into a fresh block of new_capacity slots.
+ * This also drops all tombstones. On failure the table is unchanged.
+ */
+static dbus_bool_t
+resize_table (DBusHashTable *table,
+              int            new_capacity)
+{
+  signed char *old_ctrl;
+  DBusHashEntry *old_entries;
+  int old_capacity;
+  size_t ctrl_size;
+  char *block;
+  int i;
+
+  _dbus_assert (new_capacity >= MIN_CAPACITY);
+  _dbus_assert ((new_capacity & (new_capacity - 1)) == 0);
+  _dbus_assert (MAX_LOAD (new_capacity) >= table->n_entries + table->n_reserved);
+
+  /* Keep the entries pointer-aligned behind the control bytes */
+  ctrl_size = _DBUS_ALIGN_VALUE (n_ctrl_bytes (new_capacity),
+                                 sizeof (DBusHashEntry));
+
+  block = _dbus_malloc_tagged (DBUS_MEM_TAG_HASH,
+                               ctrl_size +
+                               sizeof (DBusHashEntry) * new_capacity);
+  if (block == NULL)
+    return FALSE;
+
+  old_ctrl = table->ctrl;
+  old_entries = table->entries;
+  old_capacity = table->capacity;
+
+  table->ctrl = (signed char *) block;
+  table->entries = (DBusHashEntry *) (block + ctrl_size);
+  table->capacity = new_capacity;
+  table->n_deleted = 0;
+
+  memset (table->ctrl, CTRL_EMPTY, new_capacity);
+  memset (table->ctrl + new_capacity, CTRL_SENTINEL,
+          n_ctrl_bytes (new_capacity) - new_capacity);
+
+  for (i = 0; i < old_capacity; i++)
+    {
+      unsigned int hash;
+      int slot;
+
+      if (old_ctrl[i] < 0)
+        continue;
+
+      hash = hash_key (table, old_entries[i].key);
+      slot = find_insert_slot (table, hash);
+
+      table->ctrl[slot] = H2 (hash);
+      table->entries[slot] = old_entries[i];
+    }
+
+  dbus_free (old_ctrl);
+
+  return TRUE;
+}
+
+/* Makes sure n_more further entries can be added without resizing.
+ * Resizing is only ever done here, when adding - because you can
+ * iterate over a table and remove entries safely.
+ */
+static dbus_bool_t
+reserve_slots (DBusHashTable *table,
+               int            n_more)
+{
+  int needed;
+  int new_capacity;
+
+  needed = table->n_entries + table->n_reserved + n_more;
+
+  if (table->capacity > 0 &&
+      needed + table->n_deleted <= MAX_LOAD (table->capacity))
+    {
+      /* There is room; opportunistically give back memory if most of
+       * the table has been emptied out since it last grew. Failing to
+       * do so is harmless.
+       */
+      if (table->capacity > MAX (MIN_CAPACITY, table->min_capacity) &&
+          needed * 16 < table->capacity)
+        {
+          new_capacity = capacity_for (table, needed);
+          if (new_capacity < table->capacity)
+            resize_table (table, new_capacity);
+        }
+
+      return TRUE;
+    }
+
+  /* Otherwise rebuild, which grows the table or - if it is mostly
+   * tombstones - just cleans it at the same size.
+   */
+  new_capacity = capacity_for (table, needed);
+  if (new_capacity < 0)
+    return FALSE;
+
+  return resize_table (table, new_capacity);
+}
+
+static void
+remove_slot (DBusHashTable *table,
+             int            slot)
+{
+  int group;
+
+  _dbus_assert (table->ctrl[slot] >= 0);
+
+  free_entry_data (table, &table->entries[slot]);
+
+  /* If the group still has an empty slot, no probe sequence goes past
+   * it, so the slot can become empty again rather than a tombstone.
+   */
+  group = slot - slot % GROUP_WIDTH;
+  if (group_match_empty (table->ctrl + group) != 0)
+    table->ctrl[slot] = CTRL_EMPTY;
+  else
+    {
+      table->ctrl[slot] = CTRL_DELETED;
+      table->n_deleted += 1;
+    }
+
   table->n_entries -= 1;
-  free_entry (table, entry);
+}
+
+/* Finds key, adding it with a NULL value if it is not there yet. If
+ * reserved is TRUE, the caller holds a slot reservation, which is
+ * consumed either way and guarantees success. Returns -1 if no memory.
+ */
+static int
+find_or_add_slot (DBusHashTable *table,
+                  void          *key,
+                  dbus_bool_t    reserved)
+{
+  unsigned int hash;
+  int slot;
+
+  hash = hash_key (table, key);
+  slot = find_slot (table, key, hash);
+
+  if (reserved)
+    {
+      _dbus_assert (table->n_reserved > 0);
+      table->n_reserved -= 1;
+    }
+
+  if (slot >= 0)
+    return slot;
+
+  if (!reserved && !reserve_slots (table, 1))
+    return -1;
+
+  slot = find_insert_slot (table, hash);
+
+  if (table->ctrl[slot] == CTRL_DELETED)
+    table->n_deleted -= 1;
+
+  table->ctrl[slot] = H2 (hash);
+  table->entries[slot].key = key;
+  table->entries[slot].value = NULL;
+  table->n_entries += 1;
+
+  return slot;
 }
 
 /**
@@ -524,10 +833,8 @@ _dbus_hash_iter_init (DBusHashTable *table,
   real = (DBusRealHashIter*) iter;
 
   real->table = table;
-  real->bucket = NULL;
   real->entry = NULL;
-  real->next_entry = NULL;
-  real->next_bucket = 0;
+  real->next_slot = 0;
   real->n_entries_on_init = table->n_entries;
 }
 
@@ -543,41 +850,35 @@ dbus_bool_t
 _dbus_hash_iter_next (DBusHashIter  *iter)
 {
   DBusRealHashIter *real;
+  DBusHashTable *table;
   
   _DBUS_STATIC_ASSERT (sizeof (DBusHashIter) == sizeof (DBusRealHashIter));
   
   real = (DBusRealHashIter*) iter;
+  table = real->table;
 
   /* if this assertion failed someone probably added hash entries
    * during iteration, which is bad.
    */
-  _dbus_assert (real->n_entries_on_init >= real->table->n_entries);
-  
-  /* Remember that real->entry may have been deleted */
-  
-  while (real->next_entry == NULL)
+  _dbus_assert (real->n_entries_on_init >= table->n_entries);
+
+  while (real->next_slot < table->capacity)
     {
-      if (real->next_bucket >= real->table->n_buckets)
+      int slot = real->next_slot;
+
+      real->next_slot += 1;
+
+      if (table->ctrl[slot] >= 0)
         {
-          /* invalidate iter and return false */
-          real->entry = NULL;
-          real->table = NULL;
-          real->bucket = NULL;
-          return FALSE;
+          real->entry = &table->entries[slot];
+          return TRUE;
         }
-
-      real->bucket = &(real->table->buckets[real->next_bucket]);
-      real->next_entry = *(real->bucket);
-      real->next_bucket += 1;
     }
 
-  _dbus_assert (real->next_entry != NULL);
-  _dbus_assert (real->bucket != NULL);
-  
-  real->entry = real->next_entry;
-  real->next_entry = real->entry->next;
-  
-  return TRUE;
+  /* invalidate iter and return false */
+  real->entry = NULL;
+  real->table = NULL;
+  return FALSE;
 }
 
 /**
@@ -597,9 +898,8 @@ _dbus_hash_iter_remove_entry (DBusHashIter *iter)
 
   _dbus_assert (real->table != NULL);
   _dbus_assert (real->entry != NULL);
-  _dbus_assert (real->bucket != NULL);
   
-  remove_entry (real->table, real->bucket, real->entry);
+  remove_slot (real->table, real->entry - real->table->entries);
 
   real->entry = NULL; /* make it crash if you try to use this entry */
 }
@@ -743,87 +1043,28 @@ _dbus_hash_iter_lookup (DBusHashTable *table,
                         DBusHashIter  *iter)
 {
   DBusRealHashIter *real;
-  DBusHashEntry *entry;
-  DBusHashEntry **bucket;
+  int slot;
   
   _DBUS_STATIC_ASSERT (sizeof (DBusHashIter) == sizeof (DBusRealHashIter));
   
   real = (DBusRealHashIter*) iter;
 
-  entry = (* table->find_function) (table, key, create_if_not_found, &bucket, NULL);
+  if (create_if_not_found)
+    slot = find_or_add_slot (table, key, FALSE);
+  else
+    slot = find_slot (table, key, hash_key (table, key));
 
-  if (entry == NULL)
+  if (slot < 0)
     return FALSE;
   
   real->table = table;
-  real->bucket = bucket;
-  real->entry = entry;
-  real->next_entry = entry->next;
-  real->next_bucket = (bucket - table->buckets) + 1;
+  real->entry = &table->entries[slot];
+  real->next_slot = slot + 1;
   real->n_entries_on_init = table->n_entries; 
 
-  _dbus_assert (&(table->buckets[real->next_bucket-1]) == real->bucket);
-  
   return TRUE;
 }
 
-static void
-add_allocated_entry (DBusHashTable   *table,
-                     DBusHashEntry   *entry,
-                     unsigned int     idx,
-                     void            *key,
-                     DBusHashEntry ***bucket)
-{
-  DBusHashEntry **b;  
-  
-  entry->key = key;
-  
-  b = &(table->buckets[idx]);
-  entry->next = *b;
-  *b = entry;
-
-  if (bucket)
-    *bucket = b;
-  
-  table->n_entries += 1;
-
-  /* note we ONLY rebuild when ADDING - because you can iterate over a
-   * table and remove entries safely.
-   */
-  if (table->n_entries >= table->hi_rebuild_size ||
-      table->n_entries < table->lo_rebuild_size)
-    rebuild_table (table);
-}
-
-static DBusHashEntry*
-add_entry (DBusHashTable        *table, 
-           unsigned int          idx,
-           void                 *key,
-           DBusHashEntry      ***bucket,
-           DBusPreallocatedHash *preallocated)
-{
-  DBusHashEntry  *entry;
-
-  if (preallocated == NULL)
-    {
-      entry = alloc_entry (table);
-      if (entry == NULL)
-        {
-          if (bucket)
-            *bucket = NULL;
-          return NULL;
-        }
-    }
-  else
-    {
-      entry = (DBusHashEntry*) preallocated;
-    }
-
-  add_allocated_entry (table, entry, idx, key, bucket);
-
-  return entry;
-}
-
 /* This is g_str_hash from GLib which was
  * extensively discussed/tested/profiled
  */
@@ -840,200 +1081,56 @@ string_hash (const char *str)
   return h;
 }
 
-/** Key comparison function */
-typedef int (* KeyCompareFunc) (const void *key_a, const void *key_b);
-
-static DBusHashEntry*
-find_generic_function (DBusHashTable        *table,
-                       void                 *key,
-                       unsigned int          idx,
-                       KeyCompareFunc        compare_func,
-                       dbus_bool_t           create_if_not_found,
-                       DBusHashEntry      ***bucket,
-                       DBusPreallocatedHash *preallocated)
+static void *
+lookup_value (DBusHashTable *table,
+              const void    *key)
 {
-  DBusHashEntry *entry;
+  int slot;
 
-  if (bucket)
-    *bucket = NULL;
+  slot = find_slot (table, key, hash_key (table, key));
 
-  /* Search all of the entries in this bucket. */
-  entry = table->buckets[idx];
-  while (entry != NULL)
-    {
-      if ((compare_func == NULL && key == entry->key) ||
-          (compare_func != NULL && (* compare_func) (key, entry->key) == 0))
-        {
-          if (bucket)
-            *bucket = &(table->buckets[idx]);
-
-          if (preallocated)
-            _dbus_hash_table_free_preallocated_entry (table, preallocated);
-          
-          return entry;
-        }
-      
-      entry = entry->next;
-    }
-
-  if (create_if_not_found)
-    entry = add_entry (table, idx, key, bucket, preallocated);
-  else if (preallocated)
-    _dbus_hash_table_free_preallocated_entry (table, preallocated);
-  
-  return entry;
-}
-
-static DBusHashEntry*
-find_string_function (DBusHashTable        *table,
-                      void                 *key,
-                      dbus_bool_t           create_if_not_found,
-                      DBusHashEntry      ***bucket,
-                      DBusPreallocatedHash *preallocated)
-{
-  unsigned int idx;
-  
-  idx = string_hash (key) & table->mask;
-
-  return find_generic_function (table, key, idx,
-                                (KeyCompareFunc) strcmp, create_if_not_found, bucket,
-                                preallocated);
-}
-
-static DBusHashEntry*
-find_direct_function (DBusHashTable        *table,
-                      void                 *key,
-                      dbus_bool_t           create_if_not_found,
-                      DBusHashEntry      ***bucket,
-                      DBusPreallocatedHash *preallocated)
-{
-  unsigned int idx;
-  
-  idx = RANDOM_INDEX (table, key) & table->mask;
-
-
-  return find_generic_function (table, key, idx,
-                                NULL, create_if_not_found, bucket,
-                                preallocated);
+  if (slot >= 0)
+    return table->entries[slot].value;
+  else
+    return NULL;
 }
 
-static void
-rebuild_table (DBusHashTable *table)
+static dbus_bool_t
+remove_key (DBusHashTable *table,
+            const void    *key)
 {
-  int old_size;
-  int new_buckets;
-  DBusHashEntry **old_buckets;
-  DBusHashEntry **old_chain;
-  DBusHashEntry *entry;
-  dbus_bool_t growing;
-  
-  /*
-   * Allocate and initialize the new bucket array, and set up
-   * hashing constants for new array size.
-   */
-
-  growing = table->n_entries >= table->hi_rebuild_size;
-  
-  old_size = table->n_buckets;
-  old_buckets = table->buckets;
-
-  if (growing)
-    {
-      /* overflow paranoia */
-      if (table->n_buckets < _DBUS_INT_MAX / 4 &&
-          table->down_shift >= 0)
-        new_buckets = table->n_buckets * 4;
-      else
-        return; /* can't grow anymore */
-    }
-  else
-    {
-      new_buckets = table->n_buckets / 4;
-      if (new_buckets < DBUS_SMALL_HASH_TABLE)
-        return; /* don't bother shrinking this far */
-    }
+  int slot;
 
-  table->buckets = dbus_new0 (DBusHashEntry*, new_buckets);
-  if (table->buckets == NULL)
-    {
-      /* out of memory, yay - just don't reallocate, the table will
-       * still work, albeit more slowly.
-       */
-      table->buckets = old_buckets;
-      return;
-    }
+  slot = find_slot (table, key, hash_key (table, key));
 
-  table->n_buckets = new_buckets;
-  
-  if (growing)
+  if (slot >= 0)
     {
-      table->lo_rebuild_size = table->hi_rebuild_size;
-      table->hi_rebuild_size *= 4;
-      
-      table->down_shift -= 2;               /* keep 2 more high bits */
-      table->mask = (table->mask << 2) + 3; /* keep 2 more high bits */
+      remove_slot (table, slot);
+      return TRUE;
     }
   else
-    {
-      table->hi_rebuild_size = table->lo_rebuild_size;
-      table->lo_rebuild_size /= 4;
+    return FALSE;
+}
 
-      table->down_shift += 2;         /* keep 2 fewer high bits */
-      table->mask = table->mask >> 2; /* keep 2 fewer high bits */
-    }
+/* Stores key and value in the slot returned by find_or_add_slot(),
+ * freeing whatever an existing entry held before.
+ */
+static void
+set_slot (DBusHashTable *table,
+          int            slot,
+          void          *key,
+          void          *value)
+{
+  DBusHashEntry *entry = &table->entries[slot];
 
-#if 0
-  printf ("%s table to lo = %d hi = %d downshift = %d mask = 0x%x\n",
-          growing ? "GROW" : "SHRINK",
-          table->lo_rebuild_size,
-          table->hi_rebuild_size,
-          table->down_shift,
-          table->mask);
-#endif
-  
-  _dbus_assert (table->lo_rebuild_size >= 0);
-  _dbus_assert (table->hi_rebuild_size > table->lo_rebuild_size);
-  _dbus_assert (table->mask != 0);
-  /* the mask is essentially the max index */
-  _dbus_assert (table->mask < table->n_buckets);
+  if (table->free_key_function && entry->key != key)
+    (* table->free_key_function) (entry->key);
   
-  /*
-   * Rehash all of the existing entries into the new bucket array.
-   */
-
-  for (old_chain = old_buckets; old_size > 0; old_size--, old_chain++)
-    {
-      for (entry = *old_chain; entry != NULL; entry = *old_chain)
-        {
-          unsigned int idx;
-          DBusHashEntry **bucket;
-          
-          *old_chain = entry->next;
-          switch (table->key_type)
-            {
-            case DBUS_HASH_STRING:
-              idx = string_hash (entry->key) & table->mask;
-              break;
-            case DBUS_HASH_INT:
-            case DBUS_HASH_UINTPTR:
-              idx = RANDOM_INDEX (table, entry->key);
-              break;
-            default:
-              idx = 0;
-              _dbus_assert_not_reached ("Unknown hash table type");
-              break;
-            }
-          
-          bucket = &(table->buckets[idx]);
-          entry->next = *bucket;
-          *bucket = entry;
-        }
-    }
+  if (table->free_value_function && entry->value != value)
+    (* table->free_value_function) (entry->value);
   
-  /* Free the old bucket array, if it was dynamically allocated. */
-
-  if (old_buckets != table->static_buckets)
-    dbus_free (old_buckets);
+  entry->key = key;
+  entry->value = value;
 }
 
 /**
@@ -1049,16 +1146,9 @@ void*
 _dbus_hash_table_lookup_string (DBusHashTable *table,
                                 const char    *key)
 {
-  DBusHashEntry *entry;
-
   _dbus_assert (table->key_type == DBUS_HASH_STRING);
   
-  entry = (* table->find_function) (table, (char*) key, FALSE, NULL, NULL);
-
-  if (entry)
-    return entry->value;
-  else
-    return NULL;
+  return lookup_value (table, key);
 }
 
 /**
@@ -1074,16 +1164,9 @@ void*
 _dbus_hash_table_lookup_int (DBusHashTable *table,
                              int            key)
 {
-  DBusHashEntry *entry;
-
   _dbus_assert (table->key_type == DBUS_HASH_INT);
   
-  entry = (* table->find_function) (table, _DBUS_INT_TO_POINTER (key), FALSE, NULL, NULL);
-
-  if (entry)
-    return entry->value;
-  else
-    return NULL;
+  return lookup_value (table, _DBUS_INT_TO_POINTER (key));
 }
 
 /**
@@ -1099,16 +1182,9 @@ void*
 _dbus_hash_table_lookup_uintptr (DBusHashTable *table,
                                  uintptr_t      key)
 {
-  DBusHashEntry *entry;
-
   _dbus_assert (table->key_type == DBUS_HASH_UINTPTR);
   
-  entry = (* table->find_function) (table, (void*) key, FALSE, NULL, NULL);
-
-  if (entry)
-    return entry->value;
-  else
-    return NULL;
+  return lookup_value (table, (void*) key);
 }
 
 /**
@@ -1123,20 +1199,9 @@ dbus_bool_t
 _dbus_hash_table_remove_string (DBusHashTable *table,
                                 const char    *key)
 {
-  DBusHashEntry *entry;
-  DBusHashEntry **bucket;
-  
   _dbus_assert (table->key_type == DBUS_HASH_STRING);
   
-  entry = (* table->find_function) (table, (char*) key, FALSE, &bucket, NULL);
-
-  if (entry)
-    {
-      remove_entry (table, bucket, entry);
-      return TRUE;
-    }
-  else
-    return FALSE;
+  return remove_key (table, key);
 }
 
 /**
@@ -1151,20 +1216,9 @@ dbus_bool_t
 _dbus_hash_table_remove_int (DBusHashTable *table,
                              int            key)
 {
-  DBusHashEntry *entry;
-  DBusHashEntry **bucket;
-  
   _dbus_assert (table->key_type == DBUS_HASH_INT);
   
-  entry = (* table->find_function) (table, _DBUS_INT_TO_POINTER (key), FALSE, &bucket, NULL);
-  
-  if (entry)
-    {
-      remove_entry (table, bucket, entry);
-      return TRUE;
-    }
-  else
-    return FALSE;
+  return remove_key (table, _DBUS_INT_TO_POINTER (key));
 }
 
 /**
@@ -1179,20 +1233,9 @@ dbus_bool_t
 _dbus_hash_table_remove_uintptr (DBusHashTable *table,
                                  uintptr_t      key)
 {
-  DBusHashEntry *entry;
-  DBusHashEntry **bucket;
-  
   _dbus_assert (table->key_type == DBUS_HASH_UINTPTR);
   
-  entry = (* table->find_function) (table, (void*) key, FALSE, &bucket, NULL);
-  
-  if (entry)
-    {
-      remove_entry (table, bucket, entry);
-      return TRUE;
-    }
-  else
-    return FALSE;
+  return remove_key (table, (void*) key);
 }
 
 /**
@@ -1215,16 +1258,15 @@ _dbus_hash_table_insert_string (DBusHashTable *table,
                                 char          *key,
                                 void          *value)
 {
-  DBusPreallocatedHash *preallocated;
+  int slot;
 
   _dbus_assert (table->key_type == DBUS_HASH_STRING);
 
-  preallocated = _dbus_hash_table_preallocate_entry (table);
-  if (preallocated == NULL)
-    return FALSE;
+  slot = find_or_add_slot (table, key, FALSE);
+  if (slot < 0)
+    return FALSE; /* no memory */
 
-  _dbus_hash_table_insert_string_preallocated (table, preallocated,
-                                               key, value);
+  set_slot (table, slot, key, value);
   
   return TRUE;
 }
@@ -1249,23 +1291,15 @@ _dbus_hash_table_insert_int (DBusHashTable *table,
                              int            key,
                              void          *value)
 {
-  DBusHashEntry *entry;
+  int slot;
 
   _dbus_assert (table->key_type == DBUS_HASH_INT);
   
-  entry = (* table->find_function) (table, _DBUS_INT_TO_POINTER (key), TRUE, NULL, NULL);
-
-  if (entry == NULL)
+  slot = find_or_add_slot (table, _DBUS_INT_TO_POINTER (key), FALSE);
+  if (slot < 0)
     return FALSE; /* no memory */
 
-  if (table->free_key_function && entry->key != _DBUS_INT_TO_POINTER (key))
-    (* table->free_key_function) (entry->key);
-  
-  if (table->free_value_function && entry->value != value)
-    (* table->free_value_function) (entry->value);
-  
-  entry->key = _DBUS_INT_TO_POINTER (key);
-  entry->value = value;
+  set_slot (table, slot, _DBUS_INT_TO_POINTER (key), value);
 
   return TRUE;
 }
@@ -1290,23 +1324,15 @@ _dbus_hash_table_insert_uintptr (DBusHashTable *table,
                                  uintptr_t      key,
                                  void          *value)
 {
-  DBusHashEntry *entry;
+  int slot;
 
   _dbus_assert (table->key_type == DBUS_HASH_UINTPTR);
   
-  entry = (* table->find_function) (table, (void*) key, TRUE, NULL, NULL);
-
-  if (entry == NULL)
+  slot = find_or_add_slot (table, (void*) key, FALSE);
+  if (slot < 0)
     return FALSE; /* no memory */
 
-  if (table->free_key_function && entry->key != (void*) key)
-    (* table->free_key_function) (entry->key);
-  
-  if (table->free_value_function && entry->value != value)
-    (* table->free_value_function) (entry->value);
-  
-  entry->key = (void*) key;
-  entry->value = value;
+  set_slot (table, slot, (void*) key, value);
 
   return TRUE;
 }
@@ -1315,17 +1341,25 @@ _dbus_hash_table_insert_uintptr (DBusHashTable *table,
  * Preallocate an opaque data blob that allows us to insert into the
  * hash table at a later time without allocating any memory.
  *
+ * Since entries are stored inline in the table, this reserves a
+ * slot, growing the table now if necessary; the table does not grow
+ * again until the reservation is used or freed.
+ *
  * @param table the hash table
  * @returns the preallocated data, or #NULL if no memory
  */
 DBusPreallocatedHash*
 _dbus_hash_table_preallocate_entry (DBusHashTable *table)
 {
-  DBusHashEntry *entry;
-  
-  entry = alloc_entry (table);
+  if (!reserve_slots (table, 1))
+    return NULL;
+
+  table->n_reserved += 1;
 
-  return (DBusPreallocatedHash*) entry;
+  /* The reservation is only a count, but callers need a non-NULL
+   * handle to hand back to us.
+   */
+  return (DBusPreallocatedHash*) table;
 }
 
 /**
@@ -1339,14 +1373,10 @@ void
 _dbus_hash_table_free_preallocated_entry (DBusHashTable        *table,
                                           DBusPreallocatedHash *preallocated)
 {
-  DBusHashEntry *entry;
+  _dbus_assert (preallocated == (DBusPreallocatedHash*) table);
+  _dbus_assert (table->n_reserved > 0);
 
-  _dbus_assert (preallocated != NULL);
-  
-  entry = (DBusHashEntry*) preallocated;
-  
-  /* Don't use free_entry(), since this entry has no key/data */
-  _dbus_mem_pool_dealloc (table->entry_pool, entry);
+  table->n_reserved -= 1;
 }
 
 /**
@@ -1368,23 +1398,16 @@ _dbus_hash_table_insert_string_preallocated (DBusHashTable        *table,
                                              char                 *key,
                                              void                 *value)
 {
-  DBusHashEntry *entry;
+  int slot;
 
   _dbus_assert (table->key_type == DBUS_HASH_STRING);
-  _dbus_assert (preallocated != NULL);
+  _dbus_assert (preallocated == (DBusPreallocatedHash*) table);
   
-  entry = (* table->find_function) (table, key, TRUE, NULL, preallocated);
+  slot = find_or_add_slot (table, key, TRUE);
 
-  _dbus_assert (entry != NULL);
+  _dbus_assert (slot >= 0);
   
-  if (table->free_key_function && entry->key != key)
-    (* table->free_key_function) (entry->key);
-
-  if (table->free_value_function && entry->value != value)
-    (* table->free_value_function) (entry->value);
-      
-  entry->key = key;
-  entry->value = value;
+  set_slot (table, slot, key, value);
 }
 
 /**
@@ -1399,6 +1422,50 @@ _dbus_hash_table_get_n_entries (DBusHashTable *table)
   return table->n_entries;
 }
 
+/**
+ * Tells the table how many entries it is expected to hold, so that it
+ * can allocate room for them in one go instead of growing step by
+ * step. The table will also not shrink below this size when entries
+ * are removed. A hint of 0 removes that floor. Inserting more entries
+ * than hinted still works.
+ *
+ * @param table the hash table.
+ * @param n_entries the expected number of entries.
+ * @returns #FALSE if not enough memory; the table is still usable.
+ */
+dbus_bool_t
+_dbus_hash_table_set_size_hint (DBusHashTable *table,
+                                int            n_entries)
+{
+  int new_capacity;
+
+  _dbus_assert (n_entries >= 0);
+
+  table->min_capacity = 0;
+
+  if (n_entries == 0)
+    return TRUE;
+
+  new_capacity = capacity_for (table,
+                               MAX (n_entries,
+                                    table->n_entries + table->n_reserved));
+  if (new_capacity < 0)
+    return FALSE;
+
+  table->min_capacity = new_capacity;
+
+  if (new_capacity <= table->capacity)
+    return TRUE;
+
+  if (!resize_table (table, new_capacity))
+    {
+      table->min_capacity = 0;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 /** @} */
 
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
@@ -1817,6 +1884,115 @@ _dbus_hash_test (void)
   _dbus_hash_table_unref (table1);
   _dbus_hash_table_unref (table2);
 
+  /* Preallocated entries reserve a slot, so inserting with them must
+   * not allocate, whether the key is new or already present.
+   */
+  table1 = _dbus_hash_table_new (DBUS_HASH_STRING,
+                                 dbus_free, dbus_free);
+  if (table1 == NULL)
+    goto out;
+
+  i = 0;
+  while (i < 100)
+    {
+      DBusPreallocatedHash *preallocated;
+      DBusPreallocatedHash *unused;
+      char *key;
+      char *value;
+
+      preallocated = _dbus_hash_table_preallocate_entry (table1);
+      if (preallocated == NULL)
+        goto out;
+
+      unused = _dbus_hash_table_preallocate_entry (table1);
+      if (unused == NULL)
+        {
+          _dbus_hash_table_free_preallocated_entry (table1, preallocated);
+          goto out;
+        }
+
+      key = _dbus_strdup (keys[i % 50]);
+      value = _dbus_strdup (keys[i]);
+      if (key == NULL || value == NULL)
+        {
+          dbus_free (key);
+          dbus_free (value);
+          _dbus_hash_table_free_preallocated_entry (table1, preallocated);
+          _dbus_hash_table_free_preallocated_entry (table1, unused);
+          goto out;
+        }
+
+      _dbus_hash_table_insert_string_preallocated (table1, preallocated,
+                                                   key, value);
+      _dbus_hash_table_free_preallocated_entry (table1, unused);
+
+      _dbus_assert (strcmp (_dbus_hash_table_lookup_string (table1, keys[i % 50]),
+                            keys[i]) == 0);
+      _dbus_assert (count_entries (table1) == MIN (i + 1, 50));
+
+      ++i;
+    }
+
+  _dbus_hash_table_unref (table1);
+
+  /* A size hint makes room up front and keeps the table from
+   * shrinking below it; lots of churn through the same slots must
+   * not lose entries to tombstones.
+   */
+  table2 = _dbus_hash_table_new (DBUS_HASH_INT, NULL, NULL);
+  if (table2 == NULL)
+    goto out;
+
+  if (!_dbus_hash_table_set_size_hint (table2, 1000))
+    goto out;
+
+  i = 0;
+  while (i < 1000)
+    {
+      if (!_dbus_hash_table_insert_int (table2, i, _DBUS_INT_TO_POINTER (i + 1)))
+        goto out;
+      ++i;
+    }
+
+  i = 0;
+  while (i < 20000)
+    {
+      /* keys 0..999 stay put while a window of 100 moves past them */
+      if (!_dbus_hash_table_insert_int (table2, 1000 + i,
+                                        _DBUS_INT_TO_POINTER (i + 1)))
+        goto out;
+
+      if (i >= 100 && !_dbus_hash_table_remove_int (table2, 1000 + i - 100))
+        _dbus_assert_not_reached ("churned entry should have existed");
+
+      _dbus_assert (_dbus_hash_table_get_n_entries (table2) ==
+                    1000 + MIN (i + 1, 100));
+
+      ++i;
+    }
+
+  i = 0;
+  while (i < 1000)
+    {
+      _dbus_assert (_dbus_hash_table_lookup_int (table2, i) ==
+                    _DBUS_INT_TO_POINTER (i + 1));
+      if (!_dbus_hash_table_remove_int (table2, i))
+        _dbus_assert_not_reached ("hash entry should have existed");
+      ++i;
+    }
+
+  _dbus_hash_table_remove_all (table2);
+  _dbus_assert (count_entries (table2) == 0);
+
+  /* Removing the hint lets the next insertion give the space back */
+  if (!_dbus_hash_table_set_size_hint (table2, 0))
+    goto out;
+  if (!_dbus_hash_table_insert_int (table2, 42, NULL))
+    goto out;
+  _dbus_assert (count_entries (table2) == 1);
+
+  _dbus_hash_table_unref (table2);
+
   ret = TRUE;
 
  out:
@@ -694,6 +694,39 @@ _dbus_uuid_encode (const DBusGUID *uuid,
   return _dbus_string_hex_encode (&binary, 0, encoded, _dbus_string_get_length (encoded));
 }
 
+/**
+ * Decodes a UUID from the hex form produced by _dbus_uuid_encode().
+ *
+ * @param encoded the hex uuid
+ * @param uuid the uuid to fill in
+ * @returns #FALSE if no memory or not a valid hex uuid
+ */
+dbus_bool_t
+_dbus_uuid_decode (const DBusString *encoded,
+                   DBusGUID         *uuid)
+{
+  DBusString decoded;
+  int end;
+  dbus_bool_t valid;
+
+  if (_dbus_string_get_length (encoded) != DBUS_UUID_LENGTH_HEX)
+    return FALSE;
+
+  if (!_dbus_string_init (&decoded))
+    return FALSE;
+
+  valid = _dbus_string_hex_decode (encoded, 0, &end, &decoded, 0) &&
+    end == DBUS_UUID_LENGTH_HEX &&
+    _dbus_string_get_length (&decoded) == DBUS_UUID_LENGTH_BYTES;
+
+  if (valid)
+    _dbus_string_copy_to_buffer (&decoded, uuid->as_bytes,
+                                 DBUS_UUID_LENGTH_BYTES);
+
+  _dbus_string_free (&decoded);
+  return valid;
+}
+
 static dbus_bool_t
 _dbus_read_uuid_file_without_creating (const DBusString *filename,
                                        DBusGUID         *uuid,
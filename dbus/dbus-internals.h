@@ -28,6 +28,7 @@
 #define DBUS_INTERNALS_H
 
 #include <dbus/dbus-memory.h>
+#include <dbus/dbus-memory-internal.h>
 #include <dbus/dbus-types.h>
 #include <dbus/dbus-errors.h>
 #include <dbus/dbus-sysdeps.h>
@@ -337,22 +338,23 @@ extern int _dbus_current_generation;
  * which would be quite a mega-patch. */
 typedef enum
 {
-  /* index 0-4 */
-  _DBUS_LOCK_list,
+  /* index 0-3 */
   _DBUS_LOCK_connection_slots,
   _DBUS_LOCK_pending_call_slots,
   _DBUS_LOCK_server_slots,
   _DBUS_LOCK_message_slots,
-  /* index 5-9 */
+  /* index 4-8 */
   _DBUS_LOCK_bus,
   _DBUS_LOCK_bus_datas,
   _DBUS_LOCK_shutdown_funcs,
   _DBUS_LOCK_system_users,
   _DBUS_LOCK_message_cache,
-  /* index 10-12 */
+  /* index 9-13 */
   _DBUS_LOCK_shared_connections,
   _DBUS_LOCK_machine_uuid,
   _DBUS_LOCK_sysdeps,
+  _DBUS_LOCK_slabs,
+  _DBUS_LOCK_message_counters,
 
   _DBUS_N_GLOBAL_LOCKS
 } DBusGlobalLock;
@@ -395,6 +397,9 @@ dbus_bool_t _dbus_generate_uuid  (DBusGUID         *uuid,
 DBUS_PRIVATE_EXPORT
 dbus_bool_t _dbus_uuid_encode    (const DBusGUID   *uuid,
                                   DBusString       *encoded);
+DBUS_PRIVATE_EXPORT
+dbus_bool_t _dbus_uuid_decode    (const DBusString *encoded,
+                                  DBusGUID         *uuid);
 dbus_bool_t _dbus_read_uuid_file (const DBusString *filename,
                                   DBusGUID         *uuid,
                                   dbus_bool_t       create_if_not_found,
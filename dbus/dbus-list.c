@@ -35,8 +35,8 @@
  * Types and functions related to DBusList.
  */
 
-/* Protected by _DBUS_LOCK (list) */
-static DBusMemPool *list_pool;
+static DBusSlab list_slab = _DBUS_SLAB_INIT (sizeof (DBusList),
+                                             DBUS_MEM_TAG_LIST);
 
 /**
  * @defgroup DBusListInternals Linked list implementation details
@@ -48,45 +48,19 @@ static DBusMemPool *list_pool;
  * @{
  */
 
-/* the mem pool is probably a speed hit, with the thread
- * lock, though it does still save memory - unknown.
+/* Links are allocated and freed for nearly every queue operation, so
+ * they come from a slab: with its per-thread caches, this usually
+ * takes no lock.
  */
 static DBusList*
 alloc_link (void *data)
 {
   DBusList *link;
 
-  if (!_DBUS_LOCK (list))
-    return FALSE;
-
-  if (list_pool == NULL)
-    {      
-      list_pool = _dbus_mem_pool_new (sizeof (DBusList), TRUE);
-
-      if (list_pool == NULL)
-        {
-          _DBUS_UNLOCK (list);
-          return NULL;
-        }
-
-      link = _dbus_mem_pool_alloc (list_pool);
-      if (link == NULL)
-        {
-          _dbus_mem_pool_free (list_pool);
-          list_pool = NULL;
-          _DBUS_UNLOCK (list);
-          return NULL;
-        }
-    }
-  else
-    {
-      link = _dbus_mem_pool_alloc (list_pool);
-    }
+  link = _dbus_slab_alloc (&list_slab);
 
   if (link)
     link->data = data;
-  
-  _DBUS_UNLOCK (list);
 
   return link;
 }
@@ -94,17 +68,7 @@ alloc_link (void *data)
 static void
 free_link (DBusList *link)
 {  
-  if (!_DBUS_LOCK (list))
-    _dbus_assert_not_reached ("we should have initialized global locks "
-        "before we allocated a linked-list link");
-
-  if (_dbus_mem_pool_dealloc (list_pool, link))
-    {
-      _dbus_mem_pool_free (list_pool);
-      list_pool = NULL;
-    }
-  
-  _DBUS_UNLOCK (list);
+  _dbus_slab_dealloc (&list_slab, link);
 }
 
 static void
@@ -156,16 +120,7 @@ _dbus_list_get_stats     (dbus_uint32_t *in_use_p,
                           dbus_uint32_t *in_free_list_p,
                           dbus_uint32_t *allocated_p)
 {
-  if (!_DBUS_LOCK (list))
-    {
-      *in_use_p = 0;
-      *in_free_list_p = 0;
-      *allocated_p = 0;
-      return;
-    }
-
-  _dbus_mem_pool_get_stats (list_pool, in_use_p, in_free_list_p, allocated_p);
-  _DBUS_UNLOCK (list);
+  _dbus_slab_get_stats (&list_slab, in_use_p, in_free_list_p, allocated_p);
 }
 #endif
 
@@ -459,7 +459,7 @@ _dbus_header_reinit (DBusHeader *header)
 dbus_bool_t
 _dbus_header_init (DBusHeader *header)
 {
-  if (!_dbus_string_init_preallocated (&header->data, 32))
+  if (!_dbus_string_init_tagged (&header->data, 32, DBUS_MEM_TAG_MESSAGE))
     return FALSE;
 
   _dbus_header_reinit (header);
@@ -492,8 +492,9 @@ _dbus_header_copy (const DBusHeader *header,
 {
   *dest = *header;
 
-  if (!_dbus_string_init_preallocated (&dest->data,
-                                       _dbus_string_get_length (&header->data)))
+  if (!_dbus_string_init_tagged (&dest->data,
+                                 _dbus_string_get_length (&header->data),
+                                 DBUS_MEM_TAG_MESSAGE))
     return FALSE;
 
   if (!_dbus_string_copy (&header->data, 0, &dest->data, 0))
@@ -61,16 +61,16 @@ _dbus_validate_signature_with_reason (const DBusString *type_str,
   DBusValidity result;
 
   int element_count;
-  DBusList *element_count_stack;
+  /* One counter per open struct or dict entry, plus the top level; the
+   * depth checks below bound it, so we never need to allocate (this
+   * is used by the argument checks, which must not fail on OOM).
+   */
+  int element_count_stack[2 * DBUS_MAXIMUM_TYPE_RECURSION_DEPTH + 1];
+  int n_element_counts;
 
   result = DBUS_VALID;
-  element_count_stack = NULL;
-
-  if (!_dbus_list_append (&element_count_stack, _DBUS_INT_TO_POINTER (0)))
-    {
-      result = DBUS_VALIDITY_UNKNOWN_OOM_ERROR;
-      goto out;
-    }
+  element_count_stack[0] = 0;
+  n_element_counts = 1;
 
   _dbus_assert (type_str != NULL);
   _dbus_assert (type_pos < _DBUS_INT32_MAX - len);
@@ -129,12 +129,9 @@ _dbus_validate_signature_with_reason (const DBusString *type_str,
               goto out;
             }
           
-          if (!_dbus_list_append (&element_count_stack, 
-                             _DBUS_INT_TO_POINTER (0)))
-            {
-              result = DBUS_VALIDITY_UNKNOWN_OOM_ERROR;
-              goto out;
-            }
+          _dbus_assert (n_element_counts <
+                        _DBUS_N_ELEMENTS (element_count_stack));
+          element_count_stack[n_element_counts++] = 0;
 
           break;
 
@@ -151,7 +148,7 @@ _dbus_validate_signature_with_reason (const DBusString *type_str,
               goto out;
             }
 
-          _dbus_list_pop_last (&element_count_stack);
+          n_element_counts -= 1;
 
           struct_depth -= 1;
           break;
@@ -171,12 +168,9 @@ _dbus_validate_signature_with_reason (const DBusString *type_str,
               goto out;
             }
 
-          if (!_dbus_list_append (&element_count_stack, 
-                             _DBUS_INT_TO_POINTER (0)))
-            {
-              result = DBUS_VALIDITY_UNKNOWN_OOM_ERROR;
-              goto out;
-            }
+          _dbus_assert (n_element_counts <
+                        _DBUS_N_ELEMENTS (element_count_stack));
+          element_count_stack[n_element_counts++] = 0;
 
           break;
 
@@ -189,8 +183,7 @@ _dbus_validate_signature_with_reason (const DBusString *type_str,
             
           dict_entry_depth -= 1;
 
-          element_count = 
-            _DBUS_POINTER_TO_INT (_dbus_list_pop_last (&element_count_stack));
+          element_count = element_count_stack[--n_element_counts];
 
           if (element_count != 2)
             {
@@ -216,17 +209,7 @@ _dbus_validate_signature_with_reason (const DBusString *type_str,
           *p != DBUS_DICT_ENTRY_BEGIN_CHAR && 
 	  *p != DBUS_STRUCT_BEGIN_CHAR) 
         {
-          element_count = 
-            _DBUS_POINTER_TO_INT (_dbus_list_pop_last (&element_count_stack));
-
-          ++element_count;
-
-          if (!_dbus_list_append (&element_count_stack, 
-                             _DBUS_INT_TO_POINTER (element_count)))
-            {
-              result = DBUS_VALIDITY_UNKNOWN_OOM_ERROR;
-              goto out;
-            }
+          element_count_stack[n_element_counts - 1] += 1;
         }
       
       if (array_depth > 0)
@@ -287,7 +270,6 @@ _dbus_validate_signature_with_reason (const DBusString *type_str,
   result = DBUS_VALID;
 
 out:
-  _dbus_list_clear (&element_count_stack);
   return result;
 }
 
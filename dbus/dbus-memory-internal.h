@@ -0,0 +1,82 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-memory-internal.h  Per-subsystem allocation accounting
+ *
+ * Licensed under the Academic Free License version 2.1
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#ifndef DBUS_MEMORY_INTERNAL_H
+#define DBUS_MEMORY_INTERNAL_H
+
+#include <dbus/dbus-macros.h>
+#include <dbus/dbus-memory.h>
+#include <dbus/dbus-types.h>
+
+DBUS_BEGIN_DECLS
+
+/**
+ * Subsystem that an allocation is charged to. With DBUS_ENABLE_STATS,
+ * live and peak bytes and the number of allocations are counted for
+ * each of these; untagged dbus_malloc() is charged to
+ * #DBUS_MEM_TAG_OTHER.
+ */
+typedef enum
+{
+  DBUS_MEM_TAG_OTHER,       /**< Anything not listed below */
+  DBUS_MEM_TAG_MESSAGE,     /**< Messages, their headers and bodies */
+  DBUS_MEM_TAG_STRING,      /**< Other #DBusString data */
+  DBUS_MEM_TAG_HASH,        /**< Hash tables and their entries */
+  DBUS_MEM_TAG_LIST,        /**< #DBusList links */
+  DBUS_MEM_TAG_MATCH_RULE,  /**< The bus daemon's match rules */
+  DBUS_MEM_TAG_POLICY,      /**< The bus daemon's policy rules */
+  DBUS_MEM_TAG_CONNECTION,  /**< Connections, watches, timeouts, counters */
+  DBUS_MEM_TAG_TRANSPORT,   /**< Transports and authentication */
+  _DBUS_N_MEM_TAGS
+} DBusMemTag;
+
+#ifdef DBUS_ENABLE_STATS
+DBUS_PRIVATE_EXPORT
+void* _dbus_malloc_tagged  (DBusMemTag  tag,
+                            size_t      bytes);
+DBUS_PRIVATE_EXPORT
+void* _dbus_malloc0_tagged (DBusMemTag  tag,
+                            size_t      bytes);
+DBUS_PRIVATE_EXPORT
+void* _dbus_realloc_tagged (DBusMemTag  tag,
+                            void       *memory,
+                            size_t      bytes);
+
+DBUS_PRIVATE_EXPORT
+const char *_dbus_mem_tag_to_string (DBusMemTag     tag);
+DBUS_PRIVATE_EXPORT
+void        _dbus_mem_tag_get_stats (DBusMemTag     tag,
+                                     dbus_uint32_t *live_bytes_p,
+                                     dbus_uint32_t *peak_bytes_p,
+                                     dbus_uint32_t *n_allocations_p);
+#else
+#define _dbus_malloc_tagged(tag, bytes)          dbus_malloc (bytes)
+#define _dbus_malloc0_tagged(tag, bytes)         dbus_malloc0 (bytes)
+#define _dbus_realloc_tagged(tag, memory, bytes) dbus_realloc ((memory), (bytes))
+#endif
+
+#define _dbus_new_tagged(tag, type, count) \
+  ((type*) _dbus_malloc_tagged ((tag), sizeof (type) * (count)))
+#define _dbus_new0_tagged(tag, type, count) \
+  ((type*) _dbus_malloc0_tagged ((tag), sizeof (type) * (count)))
+
+DBUS_END_DECLS
+
+#endif /* DBUS_MEMORY_INTERNAL_H */
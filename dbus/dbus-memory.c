@@ -436,29 +436,13 @@ set_guards (void       *real_block,
 
 #endif
 
-/** @} */ /* End of internals docs */
+/* The allocators proper. With DBUS_ENABLE_STATS, the public functions
+ * below wrap these to keep per-subsystem counts. */
 
+static void free_block (void *memory);
 
-/**
- * @addtogroup DBusMemory
- *
- * @{
- */
-
-/**
- * Allocates the given number of bytes, as with standard
- * malloc(). Guaranteed to return #NULL if bytes is zero
- * on all platforms. Returns #NULL if the allocation fails.
- * The memory must be released with dbus_free().
- *
- * dbus_malloc() memory is NOT safe to free with regular free() from
- * the C library. Free it with dbus_free() only.
- *
- * @param bytes number of bytes to allocate
- * @return allocated memory, or #NULL if the allocation fails.
- */
-void*
-dbus_malloc (size_t bytes)
+static void*
+malloc_block (size_t bytes)
 {
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
   _dbus_initialize_malloc_debug ();
@@ -515,20 +499,8 @@ dbus_malloc (size_t bytes)
     }
 }
 
-/**
- * Allocates the given number of bytes, as with standard malloc(), but
- * all bytes are initialized to zero as with calloc(). Guaranteed to
- * return #NULL if bytes is zero on all platforms. Returns #NULL if the
- * allocation fails.  The memory must be released with dbus_free().
- *
- * dbus_malloc0() memory is NOT safe to free with regular free() from
- * the C library. Free it with dbus_free() only.
- *
- * @param bytes number of bytes to allocate
- * @return allocated memory, or #NULL if the allocation fails.
- */
-void*
-dbus_malloc0 (size_t bytes)
+static void*
+malloc0_block (size_t bytes)
 {
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
   _dbus_initialize_malloc_debug ();
@@ -587,19 +559,9 @@ dbus_malloc0 (size_t bytes)
     }
 }
 
-/**
- * Resizes a block of memory previously allocated by dbus_malloc() or
- * dbus_malloc0(). Guaranteed to free the memory and return #NULL if bytes
- * is zero on all platforms. Returns #NULL if the resize fails.
- * If the resize fails, the memory is not freed.
- *
- * @param memory block to be resized
- * @param bytes new size of the memory block
- * @return allocated memory, or #NULL if the resize fails.
- */
-void*
-dbus_realloc (void  *memory,
-              size_t bytes)
+static void*
+realloc_block (void  *memory,
+               size_t bytes)
 {
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
   _dbus_initialize_malloc_debug ();
@@ -614,7 +576,7 @@ dbus_realloc (void  *memory,
   
   if (bytes == 0) /* guarantee this is safe */
     {
-      dbus_free (memory);
+      free_block (memory);
       return NULL;
     }
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
@@ -691,14 +653,8 @@ dbus_realloc (void  *memory,
     }
 }
 
-/**
- * Frees a block of memory previously allocated by dbus_malloc() or
- * dbus_malloc0(). If passed #NULL, does nothing.
- * 
- * @param memory block to be freed
- */
-void
-dbus_free (void  *memory)
+static void
+free_block (void  *memory)
 {
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
   if (guards)
@@ -739,6 +695,334 @@ dbus_free (void  *memory)
     }
 }
 
+#ifdef DBUS_ENABLE_STATS
+/* With DBUS_ENABLE_STATS every block starts with a header recording
+ * its size and tag, so that dbus_free() can uncharge it. The header is
+ * as large as the strictest alignment malloc() guarantees. Everything
+ * that is not the live byte count is only updated on a best-effort
+ * basis: it costs one atomic add per allocation, not three. */
+
+typedef union
+{
+  struct
+  {
+    dbus_uint32_t bytes;
+    dbus_uint32_t tag;
+  } info;
+  double align_double;
+  void *align_pointer;
+  long align_long;
+  char pad[16];
+} TagHeader;
+
+#define TAG_HEADER_SIZE (sizeof (TagHeader))
+
+typedef struct
+{
+  DBusAtomic live_bytes;      /**< Bytes currently allocated */
+  dbus_uint32_t peak_bytes;   /**< Highest live_bytes seen */
+  dbus_uint32_t n_allocations; /**< Number of allocations ever made */
+} TagStats;
+
+static TagStats tag_stats[_DBUS_N_MEM_TAGS];
+
+static void
+charge (DBusMemTag    tag,
+        dbus_uint32_t bytes)
+{
+  TagStats *stats = &tag_stats[tag];
+  dbus_uint32_t live;
+
+  live = (dbus_uint32_t) _dbus_atomic_add (&stats->live_bytes, bytes) + bytes;
+
+  stats->n_allocations += 1;
+
+  if (live > stats->peak_bytes)
+    stats->peak_bytes = live;
+}
+
+static void
+uncharge (DBusMemTag    tag,
+          dbus_uint32_t bytes)
+{
+  _dbus_atomic_add (&tag_stats[tag].live_bytes, - (dbus_int32_t) bytes);
+}
+
+static void*
+set_tag (void         *block,
+         DBusMemTag    tag,
+         size_t        bytes)
+{
+  TagHeader *header = block;
+
+  if (header == NULL)
+    return NULL;
+
+  header->info.bytes = bytes;
+  header->info.tag = tag;
+  charge (tag, bytes);
+
+  return ((unsigned char *) block) + TAG_HEADER_SIZE;
+}
+
+static TagHeader *
+get_tag_header (void *memory)
+{
+  _dbus_assert (memory != NULL);
+
+  return (TagHeader *) (((unsigned char *) memory) - TAG_HEADER_SIZE);
+}
+
+/**
+ * Like dbus_malloc(), but charges the block to the given subsystem.
+ *
+ * @param tag the subsystem
+ * @param bytes number of bytes to allocate
+ * @return allocated memory, or #NULL if the allocation fails.
+ */
+void*
+_dbus_malloc_tagged (DBusMemTag tag,
+                     size_t     bytes)
+{
+  _dbus_assert (tag < _DBUS_N_MEM_TAGS);
+
+  if (bytes == 0)
+    return malloc_block (0);
+
+  return set_tag (malloc_block (bytes + TAG_HEADER_SIZE), tag, bytes);
+}
+
+/**
+ * Like dbus_malloc0(), but charges the block to the given subsystem.
+ *
+ * @param tag the subsystem
+ * @param bytes number of bytes to allocate
+ * @return allocated memory, or #NULL if the allocation fails.
+ */
+void*
+_dbus_malloc0_tagged (DBusMemTag tag,
+                      size_t     bytes)
+{
+  _dbus_assert (tag < _DBUS_N_MEM_TAGS);
+
+  if (bytes == 0)
+    return malloc0_block (0);
+
+  return set_tag (malloc0_block (bytes + TAG_HEADER_SIZE), tag, bytes);
+}
+
+/**
+ * Like dbus_realloc(), but charges the resized block to the given
+ * subsystem, whatever it was charged to before.
+ *
+ * @param tag the subsystem
+ * @param memory block to be resized
+ * @param bytes new size of the memory block
+ * @return allocated memory, or #NULL if the resize fails.
+ */
+void*
+_dbus_realloc_tagged (DBusMemTag  tag,
+                      void       *memory,
+                      size_t      bytes)
+{
+  TagHeader *header;
+  TagHeader old;
+  void *block;
+
+  _dbus_assert (tag < _DBUS_N_MEM_TAGS);
+
+  if (memory == NULL)
+    return _dbus_malloc_tagged (tag, bytes);
+
+  header = get_tag_header (memory);
+  old = *header;
+
+  if (bytes == 0)
+    {
+      uncharge (old.info.tag, old.info.bytes);
+      return realloc_block (header, 0);
+    }
+
+  block = realloc_block (header, bytes + TAG_HEADER_SIZE);
+
+  if (block == NULL)
+    return NULL;
+
+  uncharge (old.info.tag, old.info.bytes);
+  return set_tag (block, tag, bytes);
+}
+
+/**
+ * Gets the name of a subsystem, as used in the bus daemon's
+ * statistics.
+ *
+ * @param tag the subsystem
+ * @returns its name
+ */
+const char *
+_dbus_mem_tag_to_string (DBusMemTag tag)
+{
+  switch (tag)
+    {
+    case DBUS_MEM_TAG_OTHER:
+      return "Other";
+    case DBUS_MEM_TAG_MESSAGE:
+      return "Message";
+    case DBUS_MEM_TAG_STRING:
+      return "String";
+    case DBUS_MEM_TAG_HASH:
+      return "Hash";
+    case DBUS_MEM_TAG_LIST:
+      return "List";
+    case DBUS_MEM_TAG_MATCH_RULE:
+      return "MatchRule";
+    case DBUS_MEM_TAG_POLICY:
+      return "Policy";
+    case DBUS_MEM_TAG_CONNECTION:
+      return "Connection";
+    case DBUS_MEM_TAG_TRANSPORT:
+      return "Transport";
+    case _DBUS_N_MEM_TAGS:
+    default:
+      break;
+    }
+
+  _dbus_assert_not_reached ("Invalid memory tag");
+  return "invalid!";
+}
+
+/**
+ * Gets the allocation counters of a subsystem. The live byte count is
+ * exact; the other two may miss updates that raced with another
+ * thread.
+ *
+ * @param tag the subsystem
+ * @param live_bytes_p return location for bytes currently allocated
+ * @param peak_bytes_p return location for the most bytes ever allocated
+ * @param n_allocations_p return location for the number of allocations
+ *   and reallocations so far, from which a rate can be worked out
+ */
+void
+_dbus_mem_tag_get_stats (DBusMemTag     tag,
+                         dbus_uint32_t *live_bytes_p,
+                         dbus_uint32_t *peak_bytes_p,
+                         dbus_uint32_t *n_allocations_p)
+{
+  _dbus_assert (tag < _DBUS_N_MEM_TAGS);
+
+  if (live_bytes_p != NULL)
+    *live_bytes_p = (dbus_uint32_t) _dbus_atomic_get (&tag_stats[tag].live_bytes);
+
+  if (peak_bytes_p != NULL)
+    *peak_bytes_p = tag_stats[tag].peak_bytes;
+
+  if (n_allocations_p != NULL)
+    *n_allocations_p = tag_stats[tag].n_allocations;
+}
+#endif /* DBUS_ENABLE_STATS */
+
+/** @} */ /* End of internals docs */
+
+
+/**
+ * @addtogroup DBusMemory
+ *
+ * @{
+ */
+
+/**
+ * Allocates the given number of bytes, as with standard
+ * malloc(). Guaranteed to return #NULL if bytes is zero
+ * on all platforms. Returns #NULL if the allocation fails.
+ * The memory must be released with dbus_free().
+ *
+ * dbus_malloc() memory is NOT safe to free with regular free() from
+ * the C library. Free it with dbus_free() only.
+ *
+ * @param bytes number of bytes to allocate
+ * @return allocated memory, or #NULL if the allocation fails.
+ */
+void*
+dbus_malloc (size_t bytes)
+{
+#ifdef DBUS_ENABLE_STATS
+  return _dbus_malloc_tagged (DBUS_MEM_TAG_OTHER, bytes);
+#else
+  return malloc_block (bytes);
+#endif
+}
+
+/**
+ * Allocates the given number of bytes, as with standard malloc(), but
+ * all bytes are initialized to zero as with calloc(). Guaranteed to
+ * return #NULL if bytes is zero on all platforms. Returns #NULL if the
+ * allocation fails.  The memory must be released with dbus_free().
+ *
+ * dbus_malloc0() memory is NOT safe to free with regular free() from
+ * the C library. Free it with dbus_free() only.
+ *
+ * @param bytes number of bytes to allocate
+ * @return allocated memory, or #NULL if the allocation fails.
+ */
+void*
+dbus_malloc0 (size_t bytes)
+{
+#ifdef DBUS_ENABLE_STATS
+  return _dbus_malloc0_tagged (DBUS_MEM_TAG_OTHER, bytes);
+#else
+  return malloc0_block (bytes);
+#endif
+}
+
+/**
+ * Resizes a block of memory previously allocated by dbus_malloc() or
+ * dbus_malloc0(). Guaranteed to free the memory and return #NULL if bytes
+ * is zero on all platforms. Returns #NULL if the resize fails.
+ * If the resize fails, the memory is not freed.
+ *
+ * @param memory block to be resized
+ * @param bytes new size of the memory block
+ * @return allocated memory, or #NULL if the resize fails.
+ */
+void*
+dbus_realloc (void  *memory,
+              size_t bytes)
+{
+#ifdef DBUS_ENABLE_STATS
+  DBusMemTag tag = DBUS_MEM_TAG_OTHER;
+
+  /* keep the block's existing tag */
+  if (memory != NULL)
+    tag = get_tag_header (memory)->info.tag;
+
+  return _dbus_realloc_tagged (tag, memory, bytes);
+#else
+  return realloc_block (memory, bytes);
+#endif
+}
+
+/**
+ * Frees a block of memory previously allocated by dbus_malloc() or
+ * dbus_malloc0(). If passed #NULL, does nothing.
+ * 
+ * @param memory block to be freed
+ */
+void
+dbus_free (void  *memory)
+{
+#ifdef DBUS_ENABLE_STATS
+  if (memory != NULL)
+    {
+      TagHeader *header = get_tag_header (memory);
+
+      uncharge (header->info.tag, header->info.bytes);
+      free_block (header);
+    }
+#else
+  free_block (memory);
+#endif
+}
+
 /**
  * Frees a #NULL-terminated array of strings.
  * If passed #NULL, does nothing.
@@ -922,6 +1206,91 @@ dbus_shutdown (void)
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
 #include "dbus-test.h"
 
+#ifdef DBUS_ENABLE_STATS
+#include "dbus-hash.h"
+#include "dbus-mempool.h"
+#include "dbus-message-internal.h"
+
+/* Live bytes charged to a tag, after giving back what libdbus keeps
+ * cached for reuse, so that freed objects really have been freed */
+static dbus_uint32_t
+tag_live_bytes (DBusMemTag tag)
+{
+  dbus_uint32_t live_bytes;
+
+  _dbus_message_trim_cache ();
+  _dbus_slabs_trim ();
+  _dbus_mem_tag_get_stats (tag, &live_bytes, NULL, NULL);
+
+  return live_bytes;
+}
+
+/* Each subsystem's objects are charged to its tag while they exist,
+ * and the charge goes away with them */
+static void
+check_subsystem_tags (void)
+{
+  DBusString str;
+  DBusHashTable *table;
+  DBusList *list = NULL;
+  DBusMessage *message;
+  dbus_uint32_t before;
+  int i;
+
+  before = tag_live_bytes (DBUS_MEM_TAG_STRING);
+
+  if (!_dbus_string_init (&str) ||
+      !_dbus_string_lengthen (&str, 1000))
+    _dbus_assert_not_reached ("no memory");
+
+  _dbus_assert (tag_live_bytes (DBUS_MEM_TAG_STRING) >= before + 1000);
+  _dbus_string_free (&str);
+  _dbus_assert (tag_live_bytes (DBUS_MEM_TAG_STRING) == before);
+
+  before = tag_live_bytes (DBUS_MEM_TAG_HASH);
+
+  table = _dbus_hash_table_new (DBUS_HASH_INT, NULL, NULL);
+  if (table == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  for (i = 0; i < 100; i++)
+    {
+      if (!_dbus_hash_table_insert_int (table, i, table))
+        _dbus_assert_not_reached ("no memory");
+    }
+
+  _dbus_assert (tag_live_bytes (DBUS_MEM_TAG_HASH) >=
+                before + 100 * sizeof (void *));
+  _dbus_hash_table_unref (table);
+  _dbus_assert (tag_live_bytes (DBUS_MEM_TAG_HASH) == before);
+
+  before = tag_live_bytes (DBUS_MEM_TAG_LIST);
+
+  for (i = 0; i < 100; i++)
+    {
+      if (!_dbus_list_append (&list, &str))
+        _dbus_assert_not_reached ("no memory");
+    }
+
+  _dbus_assert (tag_live_bytes (DBUS_MEM_TAG_LIST) >=
+                before + 100 * sizeof (DBusList));
+  _dbus_list_clear (&list);
+  _dbus_assert (tag_live_bytes (DBUS_MEM_TAG_LIST) == before);
+
+  before = tag_live_bytes (DBUS_MEM_TAG_MESSAGE);
+
+  message = dbus_message_new_method_call ("com.example.Tags", "/",
+                                          "com.example.Tags", "Check");
+  if (message == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  _dbus_assert (tag_live_bytes (DBUS_MEM_TAG_MESSAGE) >
+                before + sizeof (void *));
+  dbus_message_unref (message);
+  _dbus_assert (tag_live_bytes (DBUS_MEM_TAG_MESSAGE) == before);
+}
+#endif /* DBUS_ENABLE_STATS */
+
 /**
  * @ingroup DBusMemoryInternals
  * Unit test for DBusMemory
@@ -953,6 +1322,42 @@ _dbus_memory_test (void)
     }
   dbus_free (p);
   guards = old_guards;
+
+#ifdef DBUS_ENABLE_STATS
+    {
+      dbus_uint32_t before, during, after, n_before, n_after, peak;
+
+      _dbus_mem_tag_get_stats (DBUS_MEM_TAG_POLICY, &before, NULL, &n_before);
+
+      p = _dbus_malloc_tagged (DBUS_MEM_TAG_POLICY, 100);
+      if (p == NULL)
+        _dbus_assert_not_reached ("no memory");
+
+      p = _dbus_realloc_tagged (DBUS_MEM_TAG_POLICY, p, 300);
+      if (p == NULL)
+        _dbus_assert_not_reached ("no memory");
+
+      _dbus_mem_tag_get_stats (DBUS_MEM_TAG_POLICY, &during, &peak, &n_after);
+      _dbus_assert (during == before + 300);
+      _dbus_assert (peak >= during);
+      _dbus_assert (n_after == n_before + 2);
+
+      p = dbus_realloc (p, 50);
+      if (p == NULL)
+        _dbus_assert_not_reached ("no memory");
+
+      _dbus_mem_tag_get_stats (DBUS_MEM_TAG_POLICY, &during, NULL, NULL);
+      _dbus_assert (during == before + 50);
+
+      dbus_free (p);
+
+      _dbus_mem_tag_get_stats (DBUS_MEM_TAG_POLICY, &after, NULL, NULL);
+      _dbus_assert (after == before);
+    }
+
+  check_subsystem_tags ();
+#endif
+
   return TRUE;
 }
 
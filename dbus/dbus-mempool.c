@@ -24,6 +24,7 @@
 #include <config.h>
 #include "dbus-mempool.h"
 #include "dbus-internals.h"
+#include "dbus-threads-internal.h"
 #include "dbus-valgrind-internal.h"
 
 /**
@@ -100,6 +101,7 @@ struct DBusMemPool
   int element_size;                /**< size of a single object in the pool */
   int block_size;                  /**< size of most recently allocated block */
   unsigned int zero_elements : 1;  /**< whether to zero-init allocated elements */
+  unsigned int tag : 4;            /**< #DBusMemTag blocks are charged to */
 
   DBusFreedElement *free_elements; /**< a free list of elements to recycle */
   DBusMemBlock *blocks;            /**< blocks of memory from malloc() */
@@ -137,6 +139,24 @@ struct DBusMemPool
 DBusMemPool*
 _dbus_mem_pool_new (int element_size,
                     dbus_bool_t zero_elements)
+{
+  return _dbus_mem_pool_new_tagged (element_size, zero_elements,
+                                    DBUS_MEM_TAG_OTHER);
+}
+
+/**
+ * Like _dbus_mem_pool_new(), but the pool's blocks are charged to
+ * the given subsystem.
+ *
+ * @param element_size size of an element allocated from the pool.
+ * @param zero_elements whether to zero-initialize elements
+ * @param tag the subsystem
+ * @returns the new pool or #NULL
+ */
+DBusMemPool*
+_dbus_mem_pool_new_tagged (int         element_size,
+                           dbus_bool_t zero_elements,
+                           DBusMemTag  tag)
 {
   DBusMemPool *pool;
 
@@ -160,6 +180,7 @@ _dbus_mem_pool_new (int element_size,
   pool->element_size = _DBUS_ALIGN_VALUE (element_size, sizeof (void *));
 
   pool->zero_elements = zero_elements != FALSE;
+  pool->tag = tag;
 
   pool->allocated_elements = 0;
   
@@ -203,6 +224,91 @@ _dbus_mem_pool_free (DBusMemPool *pool)
   dbus_free (pool);
 }
 
+/* Takes an element off the free list or out of the current block,
+ * without consulting the simulated allocation failures.
+ */
+static void *
+alloc_element (DBusMemPool *pool)
+{
+  if (pool->free_elements)
+    {
+      DBusFreedElement *element = pool->free_elements;
+
+      pool->free_elements = pool->free_elements->next;
+
+      VALGRIND_MEMPOOL_ALLOC (pool, element, pool->element_size);
+
+      if (pool->zero_elements)
+        memset (element, '\0', pool->element_size);
+
+      pool->allocated_elements += 1;
+
+      return element;
+    }
+  else
+    {
+      void *element;
+  
+      if (pool->blocks == NULL ||
+          pool->blocks->used_so_far == pool->block_size)
+        {
+          /* Need a new block */
+          DBusMemBlock *block;
+          int alloc_size;
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+          int saved_counter;
+#endif
+      
+          if (pool->block_size <= _DBUS_INT_MAX / 4) /* avoid overflow */
+            {
+              /* use a larger block size for our next block */
+              pool->block_size *= 2;
+              _dbus_assert ((pool->block_size %
+                             pool->element_size) == 0);
+            }
+
+          alloc_size = sizeof (DBusMemBlock) - ELEMENT_PADDING + pool->block_size;
+
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+          /* We save/restore the counter, so that memory pools won't
+           * cause a given function to have different number of
+           * allocations on different invocations. i.e.  when testing
+           * we want consistent alloc patterns. So we skip our
+           * malloc here for purposes of failed alloc simulation.
+           */
+          saved_counter = _dbus_get_fail_alloc_counter ();
+          _dbus_set_fail_alloc_counter (_DBUS_INT_MAX);
+#endif
+      
+          if (pool->zero_elements)
+            block = _dbus_malloc0_tagged (pool->tag, alloc_size);
+          else
+            block = _dbus_malloc_tagged (pool->tag, alloc_size);
+
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+          _dbus_set_fail_alloc_counter (saved_counter);
+          _dbus_assert (saved_counter == _dbus_get_fail_alloc_counter ());
+#endif
+      
+          if (block == NULL)
+            return NULL;
+
+          block->used_so_far = 0;
+          block->next = pool->blocks;
+          pool->blocks = block;          
+        }
+  
+      element = &pool->blocks->elements[pool->blocks->used_so_far];
+      
+      pool->blocks->used_so_far += pool->element_size;
+
+      pool->allocated_elements += 1;
+
+      VALGRIND_MEMPOOL_ALLOC (pool, element, pool->element_size);
+      return element;
+    }
+}
+
 /**
  * Allocates an object from the memory pool.
  * The object must be freed with _dbus_mem_pool_dealloc().
@@ -230,9 +336,9 @@ _dbus_mem_pool_alloc (DBusMemPool *pool)
         pool->element_size;
       
       if (pool->zero_elements)
-        block = dbus_malloc0 (alloc_size);
+        block = _dbus_malloc0_tagged (pool->tag, alloc_size);
       else
-        block = dbus_malloc (alloc_size);
+        block = _dbus_malloc_tagged (pool->tag, alloc_size);
 
       if (block != NULL)
         {
@@ -255,83 +361,8 @@ _dbus_mem_pool_alloc (DBusMemPool *pool)
           _dbus_verbose (" FAILING mempool alloc\n");
           return NULL;
         }
-      else if (pool->free_elements)
-        {
-          DBusFreedElement *element = pool->free_elements;
-
-          pool->free_elements = pool->free_elements->next;
-
-          VALGRIND_MEMPOOL_ALLOC (pool, element, pool->element_size);
-
-          if (pool->zero_elements)
-            memset (element, '\0', pool->element_size);
-
-          pool->allocated_elements += 1;
-
-          return element;
-        }
       else
-        {
-          void *element;
-      
-          if (pool->blocks == NULL ||
-              pool->blocks->used_so_far == pool->block_size)
-            {
-              /* Need a new block */
-              DBusMemBlock *block;
-              int alloc_size;
-#ifdef DBUS_ENABLE_EMBEDDED_TESTS
-              int saved_counter;
-#endif
-          
-              if (pool->block_size <= _DBUS_INT_MAX / 4) /* avoid overflow */
-                {
-                  /* use a larger block size for our next block */
-                  pool->block_size *= 2;
-                  _dbus_assert ((pool->block_size %
-                                 pool->element_size) == 0);
-                }
-
-              alloc_size = sizeof (DBusMemBlock) - ELEMENT_PADDING + pool->block_size;
-
-#ifdef DBUS_ENABLE_EMBEDDED_TESTS
-              /* We save/restore the counter, so that memory pools won't
-               * cause a given function to have different number of
-               * allocations on different invocations. i.e.  when testing
-               * we want consistent alloc patterns. So we skip our
-               * malloc here for purposes of failed alloc simulation.
-               */
-              saved_counter = _dbus_get_fail_alloc_counter ();
-              _dbus_set_fail_alloc_counter (_DBUS_INT_MAX);
-#endif
-          
-              if (pool->zero_elements)
-                block = dbus_malloc0 (alloc_size);
-              else
-                block = dbus_malloc (alloc_size);
-
-#ifdef DBUS_ENABLE_EMBEDDED_TESTS
-              _dbus_set_fail_alloc_counter (saved_counter);
-              _dbus_assert (saved_counter == _dbus_get_fail_alloc_counter ());
-#endif
-          
-              if (block == NULL)
-                return NULL;
-
-              block->used_so_far = 0;
-              block->next = pool->blocks;
-              pool->blocks = block;          
-            }
-      
-          element = &pool->blocks->elements[pool->blocks->used_so_far];
-          
-          pool->blocks->used_so_far += pool->element_size;
-
-          pool->allocated_elements += 1;
-
-          VALGRIND_MEMPOOL_ALLOC (pool, element, pool->element_size);
-          return element;
-        }
+        return alloc_element (pool);
     }
 }
 
@@ -405,6 +436,577 @@ _dbus_mem_pool_dealloc (DBusMemPool *pool,
     }
 }
 
+/* Whether an element on the free list lies within the part of a block
+ * that has been handed out */
+static dbus_bool_t
+block_contains (DBusMemBlock     *block,
+                DBusFreedElement *element)
+{
+  unsigned char *p = (unsigned char *) element;
+
+  return p >= block->elements && p < block->elements + block->used_so_far;
+}
+
+/**
+ * Frees every block of the pool whose elements are all on the free
+ * list, so that a pool that was once large does not keep its peak
+ * size forever. Elements still allocated are not moved, so a block
+ * with even one of them in use stays.
+ *
+ * This walks the whole free list once per block, so it is meant to
+ * be called rarely, for instance when a process has been idle for a
+ * while, not after every free.
+ *
+ * @param pool the memory pool
+ * @returns the number of bytes given back
+ */
+size_t
+_dbus_mem_pool_trim (DBusMemPool *pool)
+{
+  DBusMemBlock **block_p;
+  size_t released = 0;
+
+  /* each element already has its own block, freed along with it */
+  if (_dbus_disable_mem_pools ())
+    return 0;
+
+  block_p = &pool->blocks;
+
+  while (*block_p != NULL)
+    {
+      DBusMemBlock *block = *block_p;
+      DBusFreedElement **freed_p;
+      DBusFreedElement *freed;
+      long n_free = 0;
+
+      for (freed = pool->free_elements; freed != NULL; freed = freed->next)
+        {
+          if (block_contains (block, freed))
+            n_free += 1;
+        }
+
+      if (block->used_so_far == 0 ||
+          n_free * pool->element_size != block->used_so_far)
+        {
+          block_p = &block->next;
+          continue;
+        }
+
+      freed_p = &pool->free_elements;
+      while (*freed_p != NULL)
+        {
+          if (block_contains (block, *freed_p))
+            *freed_p = (*freed_p)->next;
+          else
+            freed_p = &(*freed_p)->next;
+        }
+
+      /* Only the newest block can have room left in it; the ones
+       * behind it were all filled before it was allocated, so their
+       * size is how much of them was used.
+       */
+      if (block == pool->blocks)
+        {
+          released += pool->block_size;
+
+          if (block->next != NULL)
+            pool->block_size = block->next->used_so_far;
+          else
+            pool->block_size = pool->element_size * 8;
+        }
+      else
+        {
+          released += block->used_so_far;
+        }
+
+      *block_p = block->next;
+      dbus_free (block);
+    }
+
+  return released;
+}
+
+/**
+ * Most elements a thread keeps cached for one slab.
+ */
+#define MAGAZINE_MAX_ELEMENTS 64
+
+/**
+ * A thread caches roughly this many bytes per slab, so slabs of large
+ * objects get smaller magazines.
+ */
+#define MAGAZINE_BYTES 2048
+
+/**
+ * Number of slabs that can have per-thread caches. Any further slabs
+ * always go through the lock.
+ */
+#define MAX_CACHED_SLABS 32
+
+/**
+ * A thread's private stack of free elements for one slab.
+ */
+typedef struct
+{
+  int n_elements;                          /**< Elements on the stack */
+  int capacity;                            /**< Most elements kept */
+  void *elements[MAGAZINE_MAX_ELEMENTS];   /**< The free elements */
+} DBusSlabMagazine;
+
+typedef struct DBusSlabThreadCache DBusSlabThreadCache;
+
+/**
+ * A thread's magazines, indexed by #DBusSlab::cache_index - 1.
+ */
+struct DBusSlabThreadCache
+{
+  DBusSlabMagazine *magazines[MAX_CACHED_SLABS]; /**< Created on demand */
+  DBusSlabThreadCache *prev; /**< Previous in thread_caches */
+  DBusSlabThreadCache *next; /**< Next in thread_caches */
+};
+
+/* Protected by _DBUS_LOCK (slabs) */
+static DBusSlab *cached_slabs[MAX_CACHED_SLABS];
+static int n_cached_slabs = 0;
+
+/* Every thread's cache, so that dbus_shutdown() can give back the
+ * elements of threads that are still running. Protected by
+ * _DBUS_LOCK (slabs); the magazines themselves are not.
+ */
+static DBusSlabThreadCache *thread_caches = NULL;
+
+/* Set with _DBUS_LOCK (slabs) held, but read without it: it is only
+ * created on first use and destroyed by dbus_shutdown(), and no other
+ * thread may be using libdbus at either time.
+ */
+static DBusThreadLocal *slab_thread_cache = NULL;
+
+/* Returns elements from a magazine to the shared pool until only keep
+ * are left. Called with _DBUS_LOCK (slabs) held.
+ */
+static void
+magazine_drain_unlocked (DBusSlab         *slab,
+                         DBusSlabMagazine *magazine,
+                         int               keep)
+{
+  while (magazine->n_elements > keep)
+    {
+      magazine->n_elements -= 1;
+
+      if (_dbus_mem_pool_dealloc (slab->pool,
+                                  magazine->elements[magazine->n_elements]))
+        {
+          _dbus_assert (magazine->n_elements == 0);
+          _dbus_mem_pool_free (slab->pool);
+          slab->pool = NULL;
+        }
+    }
+}
+
+/* Takes up to half a magazine's worth of elements from the shared pool,
+ * so that the next few allocations need no lock.
+ */
+static dbus_bool_t
+magazine_refill (DBusSlab         *slab,
+                 DBusSlabMagazine *magazine)
+{
+  _dbus_assert (magazine->n_elements == 0);
+
+  if (!_DBUS_LOCK (slabs))
+    return FALSE;
+
+  if (slab->pool == NULL)
+    {
+      slab->pool = _dbus_mem_pool_new_tagged (slab->element_size, TRUE,
+                                              slab->tag);
+
+      if (slab->pool == NULL)
+        {
+          _DBUS_UNLOCK (slabs);
+          return FALSE;
+        }
+    }
+
+  while (magazine->n_elements < (magazine->capacity + 1) / 2)
+    {
+      void *element = alloc_element (slab->pool);
+
+      if (element == NULL)
+        break;
+
+      magazine->elements[magazine->n_elements] = element;
+      magazine->n_elements += 1;
+    }
+
+  if (slab->pool->allocated_elements == 0)
+    {
+      _dbus_mem_pool_free (slab->pool);
+      slab->pool = NULL;
+    }
+
+  _DBUS_UNLOCK (slabs);
+
+  return magazine->n_elements > 0;
+}
+
+/* Gives back every element in the cache, unlinks it from
+ * thread_caches and frees it. Called with _DBUS_LOCK (slabs) held.
+ */
+static void
+slab_thread_cache_free_unlocked (DBusSlabThreadCache *cache)
+{
+  int i;
+
+  for (i = 0; i < MAX_CACHED_SLABS; i++)
+    {
+      if (cache->magazines[i] == NULL)
+        continue;
+
+      magazine_drain_unlocked (cached_slabs[i], cache->magazines[i], 0);
+      dbus_free (cache->magazines[i]);
+    }
+
+  if (cache->prev != NULL)
+    cache->prev->next = cache->next;
+  else
+    thread_caches = cache->next;
+
+  if (cache->next != NULL)
+    cache->next->prev = cache->prev;
+
+  dbus_free (cache);
+}
+
+/* Called when a thread exits. On Windows it is also called by
+ * _dbus_thread_local_free(), for every thread that still has a value,
+ * after slab_thread_cache_shutdown() has freed all the caches; only
+ * free the ones that are still listed.
+ */
+static void
+slab_thread_cache_free (void *data)
+{
+  DBusSlabThreadCache *cache;
+
+  if (!_DBUS_LOCK (slabs))
+    _dbus_assert_not_reached ("we should have initialized global locks "
+        "before we cached slab elements");
+
+  for (cache = thread_caches; cache != NULL; cache = cache->next)
+    {
+      if (cache == data)
+        {
+          slab_thread_cache_free_unlocked (cache);
+          break;
+        }
+    }
+
+  _DBUS_UNLOCK (slabs);
+}
+
+static void
+slab_thread_cache_shutdown (void *data)
+{
+  if (slab_thread_cache == NULL)
+    return;
+
+  if (!_DBUS_LOCK (slabs))
+    _dbus_assert_not_reached ("we should have initialized global locks "
+        "before we cached slab elements");
+
+  /* Threads that are still running won't touch libdbus again, and
+   * their caches are about to become unreachable, so give back what
+   * they hold as well as our own. Without this their elements would
+   * keep the slabs' pools alive forever.
+   */
+  while (thread_caches != NULL)
+    slab_thread_cache_free_unlocked (thread_caches);
+
+  _DBUS_UNLOCK (slabs);
+
+  _dbus_thread_local_set (slab_thread_cache, NULL);
+  _dbus_thread_local_free (slab_thread_cache);
+  slab_thread_cache = NULL;
+}
+
+/* Slow path of get_magazine(): gives the slab a cache index and the
+ * calling thread a magazine for it. Returns #NULL if the slab can't be
+ * cached or there is no memory, in which case the caller falls back to
+ * taking the lock; that is never an error.
+ */
+static DBusSlabMagazine *
+create_magazine (DBusSlab *slab)
+{
+  DBusSlabThreadCache *cache;
+  DBusSlabMagazine *magazine = NULL;
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+  int saved_counter;
+
+  /* As for new pool blocks, the cache's own allocations are not part of
+   * the caller's allocation pattern, so don't let them fail.
+   */
+  saved_counter = _dbus_get_fail_alloc_counter ();
+  _dbus_set_fail_alloc_counter (_DBUS_INT_MAX);
+#endif
+
+  if (!_DBUS_LOCK (slabs))
+    goto out;
+
+  if (slab->cache_index == 0)
+    {
+      if (n_cached_slabs < MAX_CACHED_SLABS)
+        {
+          cached_slabs[n_cached_slabs] = slab;
+          n_cached_slabs += 1;
+          slab->cache_index = n_cached_slabs;
+        }
+      else
+        {
+          slab->cache_index = -1;
+        }
+    }
+
+  if (slab->cache_index < 0)
+    {
+      _DBUS_UNLOCK (slabs);
+      goto out;
+    }
+
+  if (slab_thread_cache == NULL)
+    {
+      slab_thread_cache = _dbus_thread_local_new (slab_thread_cache_free);
+
+      if (slab_thread_cache != NULL &&
+          !_dbus_register_shutdown_func (slab_thread_cache_shutdown, NULL))
+        {
+          _dbus_thread_local_free (slab_thread_cache);
+          slab_thread_cache = NULL;
+        }
+    }
+
+  _DBUS_UNLOCK (slabs);
+
+  if (slab_thread_cache == NULL)
+    goto out;
+
+  cache = _dbus_thread_local_get (slab_thread_cache);
+  if (cache == NULL)
+    {
+      cache = dbus_new0 (DBusSlabThreadCache, 1);
+      if (cache == NULL)
+        goto out;
+
+      if (!_dbus_thread_local_set (slab_thread_cache, cache))
+        {
+          dbus_free (cache);
+          goto out;
+        }
+
+      if (!_DBUS_LOCK (slabs))
+        _dbus_assert_not_reached ("we should have initialized global "
+            "locks before we cached slab elements");
+
+      cache->next = thread_caches;
+      if (thread_caches != NULL)
+        thread_caches->prev = cache;
+      thread_caches = cache;
+
+      _DBUS_UNLOCK (slabs);
+    }
+
+  magazine = dbus_new0 (DBusSlabMagazine, 1);
+  if (magazine == NULL)
+    goto out;
+
+  magazine->capacity = MAGAZINE_BYTES / slab->element_size;
+  magazine->capacity = MAX (magazine->capacity, 2);
+  magazine->capacity = MIN (magazine->capacity, MAGAZINE_MAX_ELEMENTS);
+  cache->magazines[slab->cache_index - 1] = magazine;
+
+ out:
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+  _dbus_set_fail_alloc_counter (saved_counter);
+#endif
+
+  return magazine;
+}
+
+/* Returns the calling thread's magazine for the slab, or #NULL if the
+ * shared pool has to be used directly. Takes no lock once the thread
+ * has a magazine.
+ */
+static DBusSlabMagazine *
+get_magazine (DBusSlab *slab)
+{
+  /* Keep every element individually visible to valgrind */
+  if (_dbus_disable_mem_pools ())
+    return NULL;
+
+  if (slab->cache_index < 0)
+    return NULL;
+
+  if (slab->cache_index > 0 && slab_thread_cache != NULL)
+    {
+      DBusSlabThreadCache *cache;
+
+      cache = _dbus_thread_local_get (slab_thread_cache);
+
+      if (cache != NULL && cache->magazines[slab->cache_index - 1] != NULL)
+        return cache->magazines[slab->cache_index - 1];
+    }
+
+  return create_magazine (slab);
+}
+
+/**
+ * Allocates a zero-filled element from a shared slab. Objects that
+ * every connection has one or two of (the connection itself, its
+ * transport, loader, watches, timeouts and so on) come from slabs, so
+ * that they are packed together instead of being scattered across
+ * the heap among variable-sized strings.
+ *
+ * Each thread keeps a small magazine of free elements per slab and
+ * only takes the slabs lock to refill or drain it half at a time, so
+ * most allocations and frees take no lock at all.
+ *
+ * @param slab the slab
+ * @returns the new element or #NULL if no memory
+ */
+void *
+_dbus_slab_alloc (DBusSlab *slab)
+{
+  DBusSlabMagazine *magazine;
+  void *element;
+
+  magazine = get_magazine (slab);
+  if (magazine != NULL)
+    {
+      if (_dbus_decrement_fail_alloc_counter ())
+        {
+          _dbus_verbose (" FAILING slab alloc\n");
+          return NULL;
+        }
+
+      if (magazine->n_elements == 0 && !magazine_refill (slab, magazine))
+        return NULL;
+
+      magazine->n_elements -= 1;
+      element = magazine->elements[magazine->n_elements];
+      memset (element, '\0', slab->element_size);
+
+      return element;
+    }
+
+  if (!_DBUS_LOCK (slabs))
+    return NULL;
+
+  if (slab->pool == NULL)
+    {
+      slab->pool = _dbus_mem_pool_new_tagged (slab->element_size, TRUE,
+                                              slab->tag);
+
+      if (slab->pool == NULL)
+        {
+          _DBUS_UNLOCK (slabs);
+          return NULL;
+        }
+    }
+
+  element = _dbus_mem_pool_alloc (slab->pool);
+
+  if (element == NULL && slab->pool->allocated_elements == 0)
+    {
+      _dbus_mem_pool_free (slab->pool);
+      slab->pool = NULL;
+    }
+
+  _DBUS_UNLOCK (slabs);
+
+  return element;
+}
+
+/**
+ * Returns an element to the slab it came from. When the last element
+ * is returned the slab's memory is released.
+ *
+ * @param slab the slab
+ * @param element an element from _dbus_slab_alloc() on the same slab
+ */
+void
+_dbus_slab_dealloc (DBusSlab *slab,
+                    void     *element)
+{
+  DBusSlabMagazine *magazine;
+
+  magazine = get_magazine (slab);
+  if (magazine != NULL)
+    {
+      if (magazine->n_elements == magazine->capacity)
+        {
+          if (!_DBUS_LOCK (slabs))
+            _dbus_assert_not_reached ("we should have initialized global "
+                "locks before we allocated from a slab");
+
+          magazine_drain_unlocked (slab, magazine, magazine->capacity / 2);
+          _DBUS_UNLOCK (slabs);
+        }
+
+      magazine->elements[magazine->n_elements] = element;
+      magazine->n_elements += 1;
+      return;
+    }
+
+  if (!_DBUS_LOCK (slabs))
+    _dbus_assert_not_reached ("we should have initialized global locks "
+        "before we allocated from a slab");
+
+  _dbus_assert (slab->pool != NULL);
+
+  if (_dbus_mem_pool_dealloc (slab->pool, element))
+    {
+      _dbus_mem_pool_free (slab->pool);
+      slab->pool = NULL;
+    }
+
+  _DBUS_UNLOCK (slabs);
+}
+
+/**
+ * Gives back the calling thread's cached elements of every slab and
+ * then frees the slabs' wholly unused blocks, as for
+ * _dbus_mem_pool_trim(). Other threads' caches are theirs to use
+ * without the lock, so they are left alone.
+ *
+ * @returns the number of bytes given back
+ */
+size_t
+_dbus_slabs_trim (void)
+{
+  DBusSlabThreadCache *cache = NULL;
+  size_t released = 0;
+  int i;
+
+  if (!_DBUS_LOCK (slabs))
+    return 0;
+
+  if (slab_thread_cache != NULL)
+    cache = _dbus_thread_local_get (slab_thread_cache);
+
+  for (i = 0; i < n_cached_slabs; i++)
+    {
+      DBusSlab *slab = cached_slabs[i];
+
+      if (cache != NULL && cache->magazines[i] != NULL)
+        magazine_drain_unlocked (slab, cache->magazines[i], 0);
+
+      if (slab->pool != NULL)
+        released += _dbus_mem_pool_trim (slab->pool);
+    }
+
+  _DBUS_UNLOCK (slabs);
+
+  return released;
+}
+
 #ifdef DBUS_ENABLE_STATS
 void
 _dbus_mem_pool_get_stats (DBusMemPool   *pool,
@@ -445,6 +1047,34 @@ _dbus_mem_pool_get_stats (DBusMemPool   *pool,
   if (allocated_p != NULL)
     *allocated_p = allocated;
 }
+
+/**
+ * Gets statistics for a slab, as for _dbus_mem_pool_get_stats().
+ * Elements sitting in threads' caches count as in use.
+ *
+ * @param slab the slab
+ * @param in_use_p used to return bytes handed out
+ * @param in_free_list_p used to return bytes in the free list
+ * @param allocated_p used to return bytes allocated by the pool
+ */
+void
+_dbus_slab_get_stats (DBusSlab      *slab,
+                      dbus_uint32_t *in_use_p,
+                      dbus_uint32_t *in_free_list_p,
+                      dbus_uint32_t *allocated_p)
+{
+  if (!_DBUS_LOCK (slabs))
+    {
+      *in_use_p = 0;
+      *in_free_list_p = 0;
+      *allocated_p = 0;
+      return;
+    }
+
+  _dbus_mem_pool_get_stats (slab->pool, in_use_p, in_free_list_p,
+                            allocated_p);
+  _DBUS_UNLOCK (slabs);
+}
 #endif /* DBUS_ENABLE_STATS */
 
 /** @} */
@@ -453,6 +1083,9 @@ _dbus_mem_pool_get_stats (DBusMemPool   *pool,
 #include "dbus-test.h"
 #include <stdio.h>
 #include <time.h>
+#ifdef DBUS_UNIX
+#include <pthread.h>
+#endif
 
 static void
 time_for_size (int size)
@@ -623,6 +1256,195 @@ time_for_size (int size)
 #endif
 }
 
+#ifdef DBUS_UNIX
+typedef struct
+{
+  DBusSlab *slab;
+  DBusCMutex *lock;
+  DBusCondVar *cond;
+  dbus_bool_t parked;
+  dbus_bool_t released;
+} ParkedThread;
+
+/* Leaves some of the slab's elements in this thread's cache, then
+ * waits to be released without touching libdbus again
+ */
+static void *
+park_with_cached_elements (void *data)
+{
+  ParkedThread *parked = data;
+  void *element;
+
+  element = _dbus_slab_alloc (parked->slab);
+  if (element == NULL)
+    _dbus_assert_not_reached ("no memory for slab element");
+
+  _dbus_slab_dealloc (parked->slab, element);
+
+  _dbus_cmutex_lock (parked->lock);
+  parked->parked = TRUE;
+  _dbus_condvar_wake_one (parked->cond);
+
+  while (!parked->released)
+    _dbus_condvar_wait (parked->cond, parked->lock);
+
+  _dbus_cmutex_unlock (parked->lock);
+  return NULL;
+}
+
+/* dbus_shutdown() has to give back the elements cached by threads
+ * other than its caller, or they keep the slab's pool alive
+ */
+static void
+check_shutdown_drains_other_threads (DBusSlab *slab)
+{
+  ParkedThread parked = { slab, NULL, NULL, FALSE, FALSE };
+  pthread_t thread;
+
+  _dbus_assert (slab->pool == NULL);
+
+  _dbus_cmutex_new_at_location (&parked.lock);
+  parked.cond = _dbus_condvar_new ();
+  if (parked.lock == NULL || parked.cond == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  if (pthread_create (&thread, NULL, park_with_cached_elements, &parked) != 0)
+    _dbus_assert_not_reached ("could not start thread");
+
+  _dbus_cmutex_lock (parked.lock);
+  while (!parked.parked)
+    _dbus_condvar_wait (parked.cond, parked.lock);
+  _dbus_cmutex_unlock (parked.lock);
+
+  _dbus_assert (slab->pool != NULL);
+  slab_thread_cache_shutdown (NULL);
+  _dbus_assert (slab->pool == NULL);
+
+  _dbus_cmutex_lock (parked.lock);
+  parked.released = TRUE;
+  _dbus_condvar_wake_one (parked.cond);
+  _dbus_cmutex_unlock (parked.lock);
+
+  pthread_join (thread, NULL);
+
+  _dbus_condvar_free (parked.cond);
+  _dbus_cmutex_free_at_location (&parked.lock);
+}
+#endif
+
+static int
+count_blocks (DBusMemPool *pool)
+{
+  DBusMemBlock *block;
+  int n_blocks = 0;
+
+  for (block = pool->blocks; block != NULL; block = block->next)
+    n_blocks += 1;
+
+  return n_blocks;
+}
+
+static void
+check_pool_trim (void)
+{
+  DBusMemPool *pool;
+  long *elements[200];
+  int i;
+
+  pool = _dbus_mem_pool_new (sizeof (long), FALSE);
+  if (pool == NULL)
+    _dbus_assert_not_reached ("no memory for pool");
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (elements); i++)
+    {
+      elements[i] = _dbus_mem_pool_alloc (pool);
+      if (elements[i] == NULL)
+        _dbus_assert_not_reached ("no memory for pool element");
+
+      *elements[i] = i;
+    }
+
+  /* Nothing is free yet */
+  _dbus_assert (_dbus_mem_pool_trim (pool) == 0);
+
+  /* Keep one element from the newest block and one from the oldest,
+   * so the blocks in between are the ones to go
+   */
+  for (i = 1; i < _DBUS_N_ELEMENTS (elements) - 1; i++)
+    _dbus_assert (!_dbus_mem_pool_dealloc (pool, elements[i]));
+
+  if (!_dbus_disable_mem_pools ())
+    {
+      int n_blocks = count_blocks (pool);
+
+      _dbus_assert (n_blocks > 2);
+      _dbus_assert (_dbus_mem_pool_trim (pool) > 0);
+      _dbus_assert (count_blocks (pool) == 2);
+      _dbus_assert (_dbus_mem_pool_trim (pool) == 0);
+    }
+
+  _dbus_assert (*elements[0] == 0);
+  _dbus_assert (*elements[_DBUS_N_ELEMENTS (elements) - 1] ==
+                _DBUS_N_ELEMENTS (elements) - 1);
+
+  /* The pool still works, and grows again from what is left */
+  for (i = 1; i < _DBUS_N_ELEMENTS (elements) - 1; i++)
+    {
+      elements[i] = _dbus_mem_pool_alloc (pool);
+      if (elements[i] == NULL)
+        _dbus_assert_not_reached ("no memory for pool element");
+
+      *elements[i] = i;
+    }
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (elements); i++)
+    _dbus_assert (*elements[i] == i);
+
+  /* Once the newest block is given back, the one before it is the
+   * one new elements come from; it is full, so the next allocation
+   * must start a new block rather than run off its end
+   */
+  _dbus_assert (!_dbus_mem_pool_dealloc (pool,
+      elements[_DBUS_N_ELEMENTS (elements) - 1]));
+
+  for (i = 1; i < _DBUS_N_ELEMENTS (elements) - 1; i++)
+    _dbus_assert (!_dbus_mem_pool_dealloc (pool, elements[i]));
+
+  if (!_dbus_disable_mem_pools ())
+    {
+      _dbus_assert (_dbus_mem_pool_trim (pool) > 0);
+      _dbus_assert (count_blocks (pool) == 1);
+    }
+
+  for (i = 1; i < _DBUS_N_ELEMENTS (elements); i++)
+    {
+      elements[i] = _dbus_mem_pool_alloc (pool);
+      if (elements[i] == NULL)
+        _dbus_assert_not_reached ("no memory for pool element");
+
+      *elements[i] = i;
+    }
+
+  if (!_dbus_disable_mem_pools ())
+    _dbus_assert (count_blocks (pool) > 1);
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (elements); i++)
+    _dbus_assert (*elements[i] == i);
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (elements) - 1; i++)
+    _dbus_assert (!_dbus_mem_pool_dealloc (pool, elements[i]));
+
+  _dbus_assert (_dbus_mem_pool_dealloc (pool,
+      elements[_DBUS_N_ELEMENTS (elements) - 1]));
+
+  /* With nothing in use, nothing needs to be kept */
+  _dbus_mem_pool_trim (pool);
+  _dbus_assert (pool->blocks == NULL);
+  _dbus_assert (pool->free_elements == NULL);
+
+  _dbus_mem_pool_free (pool);
+}
+
 /**
  * @ingroup DBusMemPoolInternals
  * Unit test for DBusMemPool
@@ -633,6 +1455,8 @@ _dbus_mem_pool_test (void)
 {
   int i;
   int element_sizes[] = { 4, 8, 16, 50, 124 };
+  static DBusSlab slab = _DBUS_SLAB_INIT (24, DBUS_MEM_TAG_OTHER);
+  unsigned char *elements[100];
   
   i = 0;
   while (i < _DBUS_N_ELEMENTS (element_sizes))
@@ -640,6 +1464,63 @@ _dbus_mem_pool_test (void)
       time_for_size (element_sizes[i]);
       ++i;
     }
+
+  /* slab elements are zeroed even when recycled, and the pool goes
+   * away with the last element
+   */
+  for (i = 0; i < _DBUS_N_ELEMENTS (elements); i++)
+    {
+      elements[i] = _dbus_slab_alloc (&slab);
+      if (elements[i] == NULL)
+        _dbus_assert_not_reached ("no memory for slab element");
+
+      _dbus_assert (elements[i][0] == 0 && elements[i][23] == 0);
+      memset (elements[i], 0xff, 24);
+    }
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (elements); i += 2)
+    _dbus_slab_dealloc (&slab, elements[i]);
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (elements); i += 2)
+    {
+      elements[i] = _dbus_slab_alloc (&slab);
+      if (elements[i] == NULL)
+        _dbus_assert_not_reached ("no memory for slab element");
+
+      _dbus_assert (elements[i][0] == 0 && elements[i][23] == 0);
+    }
+
+  /* Trimming gives back every block but the one still in use */
+  for (i = 1; i < _DBUS_N_ELEMENTS (elements); i++)
+    _dbus_slab_dealloc (&slab, elements[i]);
+
+  if (slab.cache_index > 0)
+    {
+      _dbus_assert (count_blocks (slab.pool) > 1);
+      _dbus_assert (_dbus_slabs_trim () > 0);
+      _dbus_assert (count_blocks (slab.pool) == 1);
+      _dbus_assert (elements[0][0] == 0 && elements[0][23] == 0);
+    }
+
+  _dbus_slab_dealloc (&slab, elements[0]);
+
+  /* The last few went into this thread's cache, which keeps the pool
+   * alive until the thread exits or dbus_shutdown() is called
+   */
+  if (slab.cache_index > 0)
+    {
+      _dbus_assert (slab.pool != NULL);
+      slab_thread_cache_shutdown (NULL);
+    }
+
+  _dbus_assert (slab.pool == NULL);
+
+#ifdef DBUS_UNIX
+  if (slab.cache_index > 0)
+    check_shutdown_drains_other_threads (&slab);
+#endif
+
+  check_pool_trim ();
   
   return TRUE;
 }
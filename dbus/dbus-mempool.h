@@ -36,18 +36,56 @@ DBUS_PRIVATE_EXPORT
 DBusMemPool* _dbus_mem_pool_new     (int          element_size,
                                      dbus_bool_t  zero_elements);
 DBUS_PRIVATE_EXPORT
+DBusMemPool* _dbus_mem_pool_new_tagged (int          element_size,
+                                        dbus_bool_t  zero_elements,
+                                        DBusMemTag   tag);
+DBUS_PRIVATE_EXPORT
 void         _dbus_mem_pool_free    (DBusMemPool *pool);
 DBUS_PRIVATE_EXPORT
 void*        _dbus_mem_pool_alloc   (DBusMemPool *pool);
 DBUS_PRIVATE_EXPORT
 dbus_bool_t  _dbus_mem_pool_dealloc (DBusMemPool *pool,
                                      void        *element);
+DBUS_PRIVATE_EXPORT
+size_t       _dbus_mem_pool_trim    (DBusMemPool *pool);
+
+/**
+ * A #DBusMemPool of fixed-size elements shared by all threads. The
+ * pool is created on first use and freed again when its last element
+ * is returned. Each thread caches a few free elements in front of it.
+ * Declare one per type with _DBUS_SLAB_INIT().
+ */
+typedef struct DBusSlab DBusSlab;
+
+struct DBusSlab
+{
+  int element_size;   /**< Size of each element */
+  DBusMemTag tag;     /**< Subsystem the slab's memory is charged to */
+  DBusMemPool *pool;  /**< Protected by _DBUS_LOCK (slabs) */
+  int cache_index;    /**< Which of each thread's magazines is ours, counting
+                       *   from 1; 0 until first use, -1 if none. Set once,
+                       *   with _DBUS_LOCK (slabs) held */
+};
+
+/** Static initializer for a #DBusSlab of elements of the given size,
+ * charged to the given #DBusMemTag */
+#define _DBUS_SLAB_INIT(size, tag) { (size), (tag), NULL, 0 }
+
+void*        _dbus_slab_alloc       (DBusSlab    *slab);
+void         _dbus_slab_dealloc     (DBusSlab    *slab,
+                                     void        *element);
+DBUS_PRIVATE_EXPORT
+size_t       _dbus_slabs_trim       (void);
 
 /* if DBUS_ENABLE_STATS */
 void         _dbus_mem_pool_get_stats (DBusMemPool   *pool,
                                        dbus_uint32_t *in_use_p,
                                        dbus_uint32_t *in_free_list_p,
                                        dbus_uint32_t *allocated_p);
+void         _dbus_slab_get_stats     (DBusSlab      *slab,
+                                       dbus_uint32_t *in_use_p,
+                                       dbus_uint32_t *in_free_list_p,
+                                       dbus_uint32_t *allocated_p);
 
 DBUS_END_DECLS
 
@@ -55,6 +55,13 @@ void _dbus_message_get_unix_fds      (DBusMessage *message,
                                       const int **fds,
                                       unsigned *n_fds);
 
+DBUS_PRIVATE_EXPORT
+DBusMessage *_dbus_message_copy_truncated        (DBusMessage  *message,
+                                                 int           max_body_bytes);
+
+DBUS_PRIVATE_EXPORT
+void        _dbus_message_trim_cache            (void);
+
 void        _dbus_message_lock                  (DBusMessage  *message);
 void        _dbus_message_unlock                (DBusMessage  *message);
 dbus_bool_t _dbus_message_add_counter           (DBusMessage  *message,
@@ -104,11 +111,17 @@ void               _dbus_message_loader_set_max_message_size  (DBusMessageLoader
                                                                long                size);
 DBUS_PRIVATE_EXPORT
 long               _dbus_message_loader_get_max_message_size  (DBusMessageLoader  *loader);
+void               _dbus_message_loader_trim                  (DBusMessageLoader  *loader);
+int                _dbus_message_loader_get_allocated_size    (DBusMessageLoader  *loader);
 
 void               _dbus_message_loader_set_max_message_unix_fds(DBusMessageLoader  *loader,
                                                                  long                n);
 long               _dbus_message_loader_get_max_message_unix_fds(DBusMessageLoader  *loader);
 int                _dbus_message_loader_get_pending_fds_count (DBusMessageLoader  *loader);
+dbus_bool_t        _dbus_message_loader_get_unparsed          (DBusMessageLoader  *loader,
+                                                               const DBusString  **data,
+                                                               const int         **fds,
+                                                               unsigned int       *n_fds);
 void               _dbus_message_loader_set_pending_fds_function (DBusMessageLoader *loader,
                                                                   void (* callback) (void *),
                                                                   void *data);
@@ -33,6 +33,7 @@
 #include "dbus-object-tree.h"
 #include "dbus-memory.h"
 #include "dbus-list.h"
+#include "dbus-mempool.h"
 #include "dbus-threads-internal.h"
 #ifdef HAVE_UNIX_FD_PASSING
 #include "dbus-sysdeps.h"
@@ -280,6 +281,18 @@ void
 _dbus_message_add_counter_link (DBusMessage  *message,
                                 DBusList     *link)
 {
+  long size_delta;
+#ifdef HAVE_UNIX_FD_PASSING
+  long unix_fd_delta;
+#endif
+
+  /* The same message can be queued on several connections, each
+   * serviced by a different thread, so the list is locked.
+   */
+  if (!_DBUS_LOCK (message_counters))
+    _dbus_assert_not_reached ("we would have initialized global locks "
+        "before creating any connection");
+
   /* right now we don't recompute the delta when message
    * size changes, and that's OK for current purposes
    * I think, but could be important to change later.
@@ -304,10 +317,17 @@ _dbus_message_add_counter_link (DBusMessage  *message,
 
   _dbus_list_append_link (&message->counters, link);
 
-  _dbus_counter_adjust_size (link->data, message->size_counter_delta);
+  size_delta = message->size_counter_delta;
+#ifdef HAVE_UNIX_FD_PASSING
+  unix_fd_delta = message->unix_fd_counter_delta;
+#endif
+
+  _DBUS_UNLOCK (message_counters);
+
+  _dbus_counter_adjust_size (link->data, size_delta);
 
 #ifdef HAVE_UNIX_FD_PASSING
-  _dbus_counter_adjust_unix_fd (link->data, message->unix_fd_counter_delta);
+  _dbus_counter_adjust_unix_fd (link->data, unix_fd_delta);
 #endif
 }
 
@@ -353,17 +373,34 @@ _dbus_message_remove_counter (DBusMessage  *message,
                               DBusCounter  *counter)
 {
   DBusList *link;
+  long size_delta;
+#ifdef HAVE_UNIX_FD_PASSING
+  long unix_fd_delta;
+#endif
+
+  if (!_DBUS_LOCK (message_counters))
+    _dbus_assert_not_reached ("we would have initialized global locks "
+        "before adding the counter");
 
   link = _dbus_list_find_last (&message->counters,
                                counter);
   _dbus_assert (link != NULL);
 
-  _dbus_list_remove_link (&message->counters, link);
+  _dbus_list_unlink (&message->counters, link);
 
-  _dbus_counter_adjust_size (counter, - message->size_counter_delta);
+  size_delta = message->size_counter_delta;
+#ifdef HAVE_UNIX_FD_PASSING
+  unix_fd_delta = message->unix_fd_counter_delta;
+#endif
+
+  _DBUS_UNLOCK (message_counters);
+
+  _dbus_list_free_link (link);
+
+  _dbus_counter_adjust_size (counter, - size_delta);
 
 #ifdef HAVE_UNIX_FD_PASSING
-  _dbus_counter_adjust_unix_fd (counter, - message->unix_fd_counter_delta);
+  _dbus_counter_adjust_unix_fd (counter, - unix_fd_delta);
 #endif
 
   _dbus_counter_notify (counter);
@@ -536,6 +573,39 @@ dbus_message_cache_shutdown (void *data)
   _DBUS_UNLOCK (message_cache);
 }
 
+/**
+ * Empties the message cache, for use when the process has been idle
+ * for a while and the cached messages are unlikely to be reused soon.
+ * The cache refills as messages are freed again.
+ */
+void
+_dbus_message_trim_cache (void)
+{
+  int i;
+
+  if (!_DBUS_LOCK (message_cache))
+    {
+      /* nothing can have been cached without the lock */
+      return;
+    }
+
+  if (message_cache_shutdown_registered)
+    {
+      for (i = 0; i < MAX_MESSAGE_CACHE_SIZE; i++)
+        {
+          if (message_cache[i])
+            {
+              dbus_message_finalize (message_cache[i]);
+              message_cache[i] = NULL;
+            }
+        }
+
+      message_cache_count = 0;
+    }
+
+  _DBUS_UNLOCK (message_cache);
+}
+
 /**
  * Tries to get a message from the message cache.  The retrieved
  * message will have junk in it, so it still needs to be cleared out
@@ -1215,7 +1285,7 @@ dbus_message_new_empty_header (void)
   else
     {
       from_cache = FALSE;
-      message = dbus_new0 (DBusMessage, 1);
+      message = _dbus_new0_tagged (DBUS_MEM_TAG_MESSAGE, DBusMessage, 1);
       if (message == NULL)
         return NULL;
 #ifndef DBUS_DISABLE_CHECKS
@@ -1262,7 +1332,7 @@ dbus_message_new_empty_header (void)
           return NULL;
         }
 
-      if (!_dbus_string_init_preallocated (&message->body, 32))
+      if (!_dbus_string_init_tagged (&message->body, 32, DBUS_MEM_TAG_MESSAGE))
         {
           _dbus_header_free (&message->header);
           dbus_free (message);
@@ -1590,7 +1660,7 @@ dbus_message_copy (const DBusMessage *message)
 
   _dbus_return_val_if_fail (message != NULL, NULL);
 
-  retval = dbus_new0 (DBusMessage, 1);
+  retval = _dbus_new0_tagged (DBUS_MEM_TAG_MESSAGE, DBusMessage, 1);
   if (retval == NULL)
     return NULL;
 
@@ -1607,8 +1677,9 @@ dbus_message_copy (const DBusMessage *message)
       return NULL;
     }
 
-  if (!_dbus_string_init_preallocated (&retval->body,
-                                       _dbus_string_get_length (&message->body)))
+  if (!_dbus_string_init_tagged (&retval->body,
+                                 _dbus_string_get_length (&message->body),
+                                 DBUS_MEM_TAG_MESSAGE))
     {
       _dbus_header_free (&retval->header);
       dbus_free (retval);
@@ -3877,6 +3948,91 @@ dbus_message_contains_unix_fds(DBusMessage *message)
  * @{
  */
 
+/**
+ * Returns a copy of a message whose body is at most max_body_bytes
+ * long, for recipients that only want to see the start of large
+ * messages (such as monitors). Only complete top-level arguments are
+ * kept, and the signature is shortened to match, so the result is
+ * still a valid message; with max_body_bytes of 0 only the header
+ * remains. If the body already fits, the original message is
+ * returned with an extra reference instead of being copied.
+ *
+ * @param message the message
+ * @param max_body_bytes maximum length of the body to keep
+ * @returns a new reference to the original or truncated message, or #NULL if no memory
+ */
+DBusMessage *
+_dbus_message_copy_truncated (DBusMessage *message,
+                              int          max_body_bytes)
+{
+  const DBusString *type_str;
+  int type_pos;
+  DBusTypeReader reader;
+  DBusMessage *copy;
+  DBusString signature;
+  int body_len;
+  int sig_len;
+
+  _dbus_assert (max_body_bytes >= 0);
+
+  if (_dbus_string_get_length (&message->body) <= max_body_bytes)
+    return dbus_message_ref (message);
+
+  /* Find how many leading arguments end within the limit */
+  body_len = 0;
+  sig_len = 0;
+  get_const_signature (&message->header, &type_str, &type_pos);
+  _dbus_type_reader_init (&reader,
+                          _dbus_header_get_byte_order (&message->header),
+                          type_str, type_pos,
+                          &message->body, 0);
+
+  while (_dbus_type_reader_get_current_type (&reader) != DBUS_TYPE_INVALID)
+    {
+      _dbus_type_reader_next (&reader);
+
+      if (reader.value_pos > max_body_bytes)
+        break;
+
+      body_len = reader.value_pos;
+      sig_len = reader.type_pos - type_pos;
+    }
+
+  copy = dbus_message_copy (message);
+  if (copy == NULL)
+    return NULL;
+
+  if (!_dbus_string_init (&signature))
+    goto failed;
+
+  if (!_dbus_string_copy_len (type_str, type_pos, sig_len, &signature, 0) ||
+      !set_or_delete_string_field (copy, DBUS_HEADER_FIELD_SIGNATURE,
+                                   DBUS_TYPE_SIGNATURE,
+                                   sig_len > 0 ?
+                                   _dbus_string_get_const_data (&signature) :
+                                   NULL))
+    {
+      _dbus_string_free (&signature);
+      goto failed;
+    }
+
+  _dbus_string_free (&signature);
+
+  _dbus_string_set_length (&copy->body, body_len);
+  _dbus_string_compact (&copy->body, 0);
+
+  /* dbus_message_copy() resets the serial, but this is still the
+   * same message */
+  dbus_message_set_serial (copy, dbus_message_get_serial (message));
+  dbus_message_lock (copy);
+
+  return copy;
+
+ failed:
+  dbus_message_unref (copy);
+  return NULL;
+}
+
 /**
  * The initial buffer size of the message loader.
  *
@@ -3889,6 +4045,9 @@ dbus_message_contains_unix_fds(DBusMessage *message)
  */
 #define INITIAL_LOADER_DATA_LEN 32
 
+static DBusSlab loader_slab =
+  _DBUS_SLAB_INIT (sizeof (DBusMessageLoader), DBUS_MEM_TAG_MESSAGE);
+
 /**
  * Creates a new message loader. Returns #NULL if memory can't
  * be allocated.
@@ -3900,7 +4059,7 @@ _dbus_message_loader_new (void)
 {
   DBusMessageLoader *loader;
 
-  loader = dbus_new0 (DBusMessageLoader, 1);
+  loader = _dbus_slab_alloc (&loader_slab);
   if (loader == NULL)
     return NULL;
   
@@ -3918,9 +4077,9 @@ _dbus_message_loader_new (void)
   try-and-reallocate loop is not possible. */
   loader->max_message_unix_fds = DBUS_DEFAULT_MESSAGE_UNIX_FDS;
 
-  if (!_dbus_string_init (&loader->data))
+  if (!_dbus_string_init_tagged (&loader->data, 0, DBUS_MEM_TAG_MESSAGE))
     {
-      dbus_free (loader);
+      _dbus_slab_dealloc (&loader_slab, loader);
       return NULL;
     }
 
@@ -3972,7 +4131,7 @@ _dbus_message_loader_unref (DBusMessageLoader *loader)
                           NULL);
       _dbus_list_clear (&loader->messages);
       _dbus_string_free (&loader->data);
-      dbus_free (loader);
+      _dbus_slab_dealloc (&loader_slab, loader);
     }
 }
 
@@ -4510,6 +4669,38 @@ _dbus_message_loader_get_max_message_size (DBusMessageLoader  *loader)
   return loader->max_message_size;
 }
 
+/**
+ * Gives back memory that the loader's buffer grew into but does not
+ * currently need. While messages are arriving up to 2k of slack is
+ * kept to avoid reallocating on every read; an idle connection has
+ * no use for it.
+ *
+ * @param loader the loader
+ */
+void
+_dbus_message_loader_trim (DBusMessageLoader *loader)
+{
+  if (loader->buffer_outstanding)
+    return;
+
+  /* failure just means we keep the old, larger buffer */
+  _dbus_string_compact (&loader->data, 0);
+}
+
+/**
+ * Gets the memory used by the loader itself and its buffer, not
+ * counting any messages it has already loaded.
+ *
+ * @param loader the loader
+ * @returns size in bytes
+ */
+int
+_dbus_message_loader_get_allocated_size (DBusMessageLoader *loader)
+{
+  return sizeof (DBusMessageLoader) +
+    _dbus_string_get_allocated_size (&loader->data);
+}
+
 /**
  * Sets the maximum unix fds per message we allow.
  *
@@ -4556,6 +4747,44 @@ _dbus_message_loader_get_pending_fds_count (DBusMessageLoader *loader)
 #endif
 }
 
+/**
+ * Gets the bytes and file descriptors the loader has received but
+ * not yet turned into a message, i.e. the start of a message that
+ * is still arriving. Nothing is returned while complete messages are
+ * waiting to be popped, since the bytes would not be the whole
+ * story.
+ *
+ * @param loader the loader
+ * @param data return location for the buffered bytes, owned by the loader
+ * @param fds return location for the pending fds, owned by the loader
+ * @param n_fds return location for the number of pending fds
+ * @returns #FALSE if there are complete messages or the loader is corrupted
+ */
+dbus_bool_t
+_dbus_message_loader_get_unparsed (DBusMessageLoader  *loader,
+                                   const DBusString  **data,
+                                   const int         **fds,
+                                   unsigned int       *n_fds)
+{
+  _dbus_assert (!loader->buffer_outstanding);
+
+  if (loader->messages != NULL || loader->corrupted)
+    return FALSE;
+
+  *data = &loader->data;
+
+#ifdef HAVE_UNIX_FD_PASSING
+  _dbus_assert (!loader->unix_fds_outstanding);
+  *fds = loader->unix_fds;
+  *n_fds = loader->n_unix_fds;
+#else
+  *fds = NULL;
+  *n_fds = 0;
+#endif
+
+  return TRUE;
+}
+
 /**
  * Register a function to be called whenever the number of pending file
  * descriptors in the loader change.
@@ -24,6 +24,7 @@
 #include <config.h>
 #include <dbus/dbus-resources.h>
 #include <dbus/dbus-internals.h>
+#include "dbus-mempool.h"
 
 /**
  * @defgroup DBusResources Resource limits related code
@@ -79,6 +80,9 @@ struct DBusCounter
  * @{
  */
 
+static DBusSlab counter_slab =
+  _DBUS_SLAB_INIT (sizeof (DBusCounter), DBUS_MEM_TAG_CONNECTION);
+
 /**
  * Creates a new DBusCounter. DBusCounter is used
  * to count usage of some resource such as memory.
@@ -90,7 +94,7 @@ _dbus_counter_new (void)
 {
   DBusCounter *counter;
 
-  counter = dbus_new0 (DBusCounter, 1);
+  counter = _dbus_slab_alloc (&counter_slab);
   if (counter == NULL)
     return NULL;
 
@@ -99,7 +103,7 @@ _dbus_counter_new (void)
   _dbus_rmutex_new_at_location (&counter->mutex);
   if (counter->mutex == NULL)
   {
-    dbus_free (counter);
+    _dbus_slab_dealloc (&counter_slab, counter);
     counter = NULL;
   }
 
@@ -149,7 +153,7 @@ _dbus_counter_unref (DBusCounter *counter)
   if (last_ref)
     {
       _dbus_rmutex_free_at_location (&counter->mutex);
-      dbus_free (counter);
+      _dbus_slab_dealloc (&counter_slab, counter);
     }
 }
 
@@ -273,7 +277,13 @@ _dbus_counter_adjust_unix_fd (DBusCounter *counter,
 long
 _dbus_counter_get_size_value (DBusCounter *counter)
 {
-  return counter->size_value;
+  long value;
+
+  _dbus_rmutex_lock (counter->mutex);
+  value = counter->size_value;
+  _dbus_rmutex_unlock (counter->mutex);
+
+  return value;
 }
 
 /**
@@ -285,7 +295,13 @@ _dbus_counter_get_size_value (DBusCounter *counter)
 long
 _dbus_counter_get_unix_fd_value (DBusCounter *counter)
 {
-  return counter->unix_fd_value;
+  long value;
+
+  _dbus_rmutex_lock (counter->mutex);
+  value = counter->unix_fd_value;
+  _dbus_rmutex_unlock (counter->mutex);
+
+  return value;
 }
 
 /**
@@ -103,6 +103,9 @@ void        _dbus_server_remove_watch   (DBusServer             *server,
 DBUS_PRIVATE_EXPORT
 void        _dbus_server_toggle_all_watches (DBusServer         *server,
                                              dbus_bool_t         enabled);
+DBUS_PRIVATE_EXPORT
+dbus_bool_t _dbus_server_set_guid       (DBusServer             *server,
+                                         const DBusString       *guid_hex);
 dbus_bool_t _dbus_server_add_timeout    (DBusServer             *server,
                                          DBusTimeout            *timeout);
 void        _dbus_server_remove_timeout (DBusServer             *server,
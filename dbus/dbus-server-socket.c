@@ -43,6 +43,12 @@
  */
 typedef struct DBusServerSocket DBusServerSocket;
 
+/**
+ * Most clients accepted from the listening socket in one watch
+ * callback, before returning to the main loop.
+ */
+#define MAX_ACCEPTS_PER_WAKEUP 64
+
 /**
  * Implementation details of DBusServerSocket. All members
  * are private.
@@ -96,12 +102,6 @@ handle_new_client_fd_and_unlock (DBusServer *server,
 
   HAVE_LOCK_CHECK (server);
 
-  if (!_dbus_set_socket_nonblocking (client_fd, NULL))
-    {
-      SERVER_UNLOCK (server);
-      return TRUE;
-    }
-
   transport = _dbus_transport_new_for_socket (client_fd, &server->guid_hex, NULL);
   if (transport == NULL)
     {
@@ -183,36 +183,85 @@ socket_handle_watch (DBusWatch    *watch,
 
   if (flags & DBUS_WATCH_READABLE)
     {
-      DBusSocket client_fd;
       DBusSocket listen_fd;
-      int saved_errno;
+      int n_accepted;
+      int max_accepts;
 
       listen_fd = _dbus_watch_get_socket (watch);
 
+      /* When many clients connect at once, taking one per wakeup means
+       * a full main loop iteration per client and lets the backlog
+       * overflow. Drain it in batches instead; the cap keeps a storm
+       * from starving the connections we already have.
+       *
+       * Accepting a nonce-tcp client blocks until it has sent its
+       * nonce, so a batch of those could stall the main loop for as
+       * long as the slowest client likes: take one at a time.
+       */
       if (socket_server->noncefile)
-          client_fd = _dbus_accept_with_noncefile (listen_fd, socket_server->noncefile);
-      else 
-          client_fd = _dbus_accept (listen_fd);
+        max_accepts = 1;
+      else
+        max_accepts = MAX_ACCEPTS_PER_WAKEUP;
 
-      saved_errno = _dbus_save_socket_errno ();
+      _dbus_server_ref_unlocked (server);
 
-      if (!_dbus_socket_is_valid (client_fd))
+      for (n_accepted = 0; n_accepted < max_accepts; n_accepted++)
         {
-          /* EINTR handled for us */
-
-          if (_dbus_get_is_errno_eagain_or_ewouldblock (saved_errno))
-            _dbus_verbose ("No client available to accept after all\n");
+          DBusSocket client_fd;
+          int saved_errno;
+
+          if (socket_server->noncefile)
+            {
+              client_fd = _dbus_accept_with_noncefile (listen_fd, socket_server->noncefile);
+
+              if (_dbus_socket_is_valid (client_fd) &&
+                  !_dbus_set_socket_nonblocking (client_fd, NULL))
+                {
+                  _dbus_close_socket (client_fd, NULL);
+                  continue;
+                }
+            }
           else
-            _dbus_verbose ("Failed to accept a client connection: %s\n",
-                           _dbus_strerror (saved_errno));
+            client_fd = _dbus_accept_nonblocking (listen_fd);
+
+          saved_errno = _dbus_save_socket_errno ();
+
+          if (!_dbus_socket_is_valid (client_fd))
+            {
+              /* EINTR handled for us */
+
+              if (_dbus_get_is_errno_eagain_or_ewouldblock (saved_errno))
+                _dbus_verbose ("No more clients to accept, took %d\n",
+                               n_accepted);
+              else
+                _dbus_verbose ("Failed to accept a client connection: %s\n",
+                               _dbus_strerror (saved_errno));
+
+              break;
+            }
 
-          SERVER_UNLOCK (server);
-        }
-      else
-        {
           if (!handle_new_client_fd_and_unlock (server, client_fd))
             _dbus_verbose ("Rejected client connection due to lack of memory\n");
+
+          SERVER_LOCK (server);
+
+          /* the new connection callback may have shut us down */
+          if (server->disconnected)
+            break;
+
+          /* ... or stopped listening, e.g. because the bus has reached
+           * its limit on incomplete connections; leave the rest of the
+           * backlog queued until the watch is enabled again */
+          if (!_dbus_watch_get_enabled (watch))
+            break;
         }
+
+      SERVER_UNLOCK (server);
+      dbus_server_unref (server);
+    }
+  else
+    {
+      SERVER_UNLOCK (server);
     }
 
   if (flags & DBUS_WATCH_ERROR)
@@ -576,6 +625,33 @@ _dbus_server_listen_socket (DBusAddressEntry *entry,
     }
 }
 
+/**
+ * Gets the listening sockets of a server created by this file, so
+ * that they can be handed to another process. Servers that need
+ * more than the sockets to accept a client, like nonce-tcp, are
+ * refused.
+ *
+ * @param server a server
+ * @param fds_p return location for the sockets, owned by the server
+ * @param n_fds_p return location for the number of sockets
+ * @returns #FALSE if this is not a plain socket server
+ */
+dbus_bool_t
+_dbus_server_socket_get_fds (DBusServer        *server,
+                             const DBusSocket **fds_p,
+                             int               *n_fds_p)
+{
+  DBusServerSocket *socket_server = (DBusServerSocket*) server;
+
+  if (server->vtable != &socket_vtable ||
+      socket_server->noncefile != NULL)
+    return FALSE;
+
+  *fds_p = socket_server->fds;
+  *n_fds_p = socket_server->n_fds;
+  return TRUE;
+}
+
 /**
  * This is a bad hack since it's really unix domain socket
  * specific. Also, the function weirdly adopts ownership
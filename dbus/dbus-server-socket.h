@@ -50,6 +50,9 @@ DBusServerListenResult _dbus_server_listen_socket (DBusAddressEntry  *entry,
 
 void _dbus_server_socket_own_filename (DBusServer *server,
                                        char       *filename);
+dbus_bool_t _dbus_server_socket_get_fds (DBusServer        *server,
+                                         const DBusSocket **fds_p,
+                                         int               *n_fds_p);
 
 DBUS_END_DECLS
 
@@ -226,6 +226,61 @@ _dbus_server_finalize_base (DBusServer *server)
 }
 
 
+/**
+ * Gives the server the guid of another server, for a listening
+ * socket handed over from a previous instance of the same program,
+ * so that addresses clients were given with the old guid stay valid.
+ *
+ * @param server the server
+ * @param guid_hex the guid in hex
+ * @returns #FALSE if no memory or the guid is not valid
+ */
+dbus_bool_t
+_dbus_server_set_guid (DBusServer       *server,
+                       const DBusString *guid_hex)
+{
+  DBusString address;
+  DBusGUID guid;
+  char *new_address;
+  int len;
+
+  if (!_dbus_uuid_decode (guid_hex, &guid))
+    return FALSE;
+
+  SERVER_LOCK (server);
+
+  /* the address always ends in the guid that _dbus_server_init_base()
+   * appended */
+  len = strlen (server->address) - DBUS_UUID_LENGTH_HEX;
+  _dbus_assert (len > 0);
+  _dbus_assert (strcmp (server->address + len,
+                        _dbus_string_get_const_data (&server->guid_hex)) == 0);
+  _dbus_assert (_dbus_string_get_length (&server->guid_hex) ==
+                DBUS_UUID_LENGTH_HEX);
+
+  _dbus_string_init_const_len (&address, server->address,
+                               len - strlen (",guid="));
+  new_address = copy_address_with_guid_appended (&address, guid_hex);
+
+  if (new_address == NULL ||
+      !_dbus_string_replace_len (guid_hex, 0, DBUS_UUID_LENGTH_HEX,
+                                 &server->guid_hex, 0, DBUS_UUID_LENGTH_HEX))
+    {
+      dbus_free (new_address);
+      SERVER_UNLOCK (server);
+      return FALSE;
+    }
+
+  dbus_free (server->address);
+  server->address = new_address;
+  server->guid = guid;
+
+  _dbus_verbose ("Server now has address %s\n", server->address);
+
+  SERVER_UNLOCK (server);
+  return TRUE;
+}
+
 /** Function to be called in protected_change_watch() with refcount held */
 typedef dbus_bool_t (* DBusWatchAddFunction)     (DBusWatchList *list,
                                                   DBusWatch     *watch);
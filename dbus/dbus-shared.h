@@ -124,6 +124,10 @@ typedef enum
 #define DBUS_START_REPLY_SUCCESS         1 /**< Service was auto started */
 #define DBUS_START_REPLY_ALREADY_RUNNING 2 /**< Service was already running */
 
+/* Monitor flags */
+#define DBUS_MONITOR_FLAG_DROP_OLDEST    0x1 /**< If the monitor falls behind, discard the oldest captured messages rather than the newest */
+#define DBUS_MONITOR_FLAG_HEADERS_ONLY   0x2 /**< Capture message headers only, with the body removed */
+
 /** @} */
 
 #ifdef __cplusplus
@@ -374,6 +374,17 @@ _dbus_babysitter_set_watch_functions (DBusBabysitter            *sitter,
                                          free_data_function);
 }
 
+dbus_bool_t
+_dbus_spawn_set_orphan_watch_functions (DBusAddWatchFunction      add_function,
+                                        DBusRemoveWatchFunction   remove_function,
+                                        DBusWatchToggledFunction  toggled_function,
+                                        void                     *data,
+                                        DBusFreeFunction          free_data_function)
+{
+  /* The babysitter thread reaps children itself */
+  return TRUE;
+}
+
 static dbus_bool_t
 handle_watch (DBusWatch       *watch,
               unsigned int     condition,
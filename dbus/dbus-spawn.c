@@ -29,6 +29,8 @@
 #include "dbus-internals.h"
 #include "dbus-test.h"
 #include "dbus-protocol.h"
+#include "dbus-list.h"
+#include "dbus-mainloop.h"
 
 #include <unistd.h>
 #include <fcntl.h>
@@ -45,6 +47,12 @@
 #include <systemd/sd-journal.h>
 #endif
 
+#if defined(__linux__) && defined(HAVE_DECL_SYS_PIDFD_OPEN) && HAVE_DECL_SYS_PIDFD_OPEN
+#include <sys/syscall.h>
+/* Track the child with a pidfd instead of forking a babysitter */
+#define DBUS_SPAWN_WITH_PIDFD 1
+#endif
+
 extern char **environ;
 
 /**
@@ -222,6 +230,18 @@ read_pid (int        fd,
  * On SIGCHLD, the babysitter sends CHILD_EXITED + the exit status.
  * The main process doesn't explicitly send anything, but when it exits,
  * the babysitter gets POLLHUP or POLLERR.
+ *
+ * On Linux with pidfd_open() there is no babysitter: the main process
+ * forks the child that does the exec() directly, and watches a pidfd
+ * for it instead of babysitter_pipe. The pidfd becomes readable when
+ * the child exits, at which point the main process reaps it itself.
+ * child_err_report_pipe works exactly as above. If the DBusBabysitter
+ * goes away while the child is still running, there is no babysitter
+ * whose death would reparent it to init, so the child is put on a list
+ * of orphans that we reap ourselves. If the owner of the main loop has
+ * called _dbus_spawn_set_orphan_watch_functions(), the pidfd stays
+ * watched and the orphan is reaped as soon as it exits; otherwise, or
+ * if we run out of memory, it is reaped the next time we get a chance.
  */
 
 /* Messages from children to parents */
@@ -254,6 +274,10 @@ struct DBusBabysitter
   DBusWatch *error_watch; /**< Error pipe watch */
   DBusWatch *sitter_watch; /**< Sitter pipe watch */
 
+  int child_pidfd; /**< pidfd for the child if there is no babysitter */
+  DBusWatch *child_watch; /**< pidfd watch */
+  DBusList *orphan_link; /**< preallocated link and DBusOrphan for the list of orphans */
+
   DBusBabysitterFinishedFunc finished_cb;
   void *finished_data;
 
@@ -277,6 +301,7 @@ _dbus_babysitter_new (void)
 
   sitter->socket_to_babysitter.fd = -1;
   sitter->error_pipe_from_child = -1;
+  sitter->child_pidfd = -1;
   
   sitter->sitter_pid = -1;
   sitter->grandchild_pid = -1;
@@ -311,6 +336,115 @@ _dbus_babysitter_ref (DBusBabysitter *sitter)
 
 static void close_socket_to_babysitter  (DBusBabysitter *sitter);
 static void close_error_pipe_from_child (DBusBabysitter *sitter);
+static void close_child_pidfd           (DBusBabysitter *sitter);
+
+/**
+ * A child that outlived its DBusBabysitter and that we still have to
+ * reap, because there was no babysitter process to do it.
+ */
+typedef struct
+{
+  pid_t pid;        /**< the child */
+  int pidfd;        /**< pidfd for the child, or -1 if not watched */
+  DBusWatch *watch; /**< watch for pidfd in orphan_watches, or #NULL */
+} DBusOrphan;
+
+/* List of DBusOrphan. Like the rest of this file, this is only used in
+ * single-threaded situations.
+ */
+static DBusList *orphans = NULL;
+
+/* Watches for the pidfds of orphans, if someone is running a main loop
+ * for them; see _dbus_spawn_set_orphan_watch_functions() */
+static DBusWatchList *orphan_watches = NULL;
+
+static void
+free_orphan (DBusOrphan *orphan)
+{
+  if (orphan->watch != NULL)
+    {
+      _dbus_watch_list_remove_watch (orphan_watches, orphan->watch);
+      _dbus_watch_invalidate (orphan->watch);
+      _dbus_watch_unref (orphan->watch);
+    }
+
+  if (orphan->pidfd >= 0)
+    _dbus_close (orphan->pidfd, NULL);
+
+  dbus_free (orphan);
+}
+
+static void
+reap_orphans (void)
+{
+  DBusList *link;
+
+  link = _dbus_list_get_first_link (&orphans);
+
+  while (link != NULL)
+    {
+      DBusList *next = _dbus_list_get_next_link (&orphans, link);
+      DBusOrphan *orphan = link->data;
+      pid_t ret;
+      int status;
+
+      do
+        {
+          ret = waitpid (orphan->pid, &status, WNOHANG);
+        }
+      while (ret < 0 && errno == EINTR);
+
+      /* ret < 0 means someone else reaped it, which is fine too */
+      if (ret != 0)
+        {
+          _dbus_verbose ("Reaped orphaned child %ld\n", (long) orphan->pid);
+          _dbus_list_remove_link (&orphans, link);
+          free_orphan (orphan);
+        }
+
+      link = next;
+    }
+}
+
+static dbus_bool_t
+handle_orphan_watch (DBusWatch    *watch,
+                     unsigned int  condition,
+                     void         *data)
+{
+  /* This may free the watch, which the main loop copes with */
+  reap_orphans ();
+  return TRUE;
+}
+
+/* Moves the pidfd watch of a child that is about to be orphaned from
+ * the sitter to orphan_watches, so that it stays on the main loop. If
+ * that is not possible, the watch is left where it was, to be closed
+ * along with the sitter. */
+static void
+adopt_child_pidfd (DBusBabysitter *sitter,
+                   DBusOrphan     *orphan)
+{
+  DBusWatch *watch = sitter->child_watch;
+
+  if (watch == NULL || orphan_watches == NULL)
+    return;
+
+  _dbus_watch_list_remove_watch (sitter->watches, watch);
+  _dbus_watch_set_handler (watch, handle_orphan_watch, NULL, NULL);
+
+  if (!_dbus_watch_list_add_watch (orphan_watches, watch))
+    {
+      _dbus_watch_invalidate (watch);
+      _dbus_watch_unref (watch);
+      sitter->child_watch = NULL;
+      return;
+    }
+
+  orphan->watch = watch;
+  orphan->pidfd = sitter->child_pidfd;
+  sitter->child_watch = NULL;
+  sitter->child_pidfd = -1;
+}
 
 /**
  * Decrement the reference count on the babysitter object.
@@ -340,6 +474,31 @@ _dbus_babysitter_unref (DBusBabysitter *sitter)
 
       close_error_pipe_from_child (sitter);
 
+      if (sitter->orphan_link != NULL)
+        {
+          DBusOrphan *orphan = sitter->orphan_link->data;
+
+          if (sitter->grandchild_pid > 0 && !sitter->have_child_status)
+            {
+              /* Nobody else is going to reap the child for us */
+              orphan->pid = sitter->grandchild_pid;
+              orphan->pidfd = -1;
+              adopt_child_pidfd (sitter, orphan);
+              _dbus_list_append_link (&orphans, sitter->orphan_link);
+            }
+          else
+            {
+              dbus_free (orphan);
+              _dbus_list_free_link (sitter->orphan_link);
+            }
+
+          sitter->orphan_link = NULL;
+        }
+
+      close_child_pidfd (sitter);
+
+      reap_orphans ();
+
       if (sitter->sitter_pid > 0)
         {
           int status;
@@ -566,6 +725,25 @@ close_error_pipe_from_child (DBusBabysitter *sitter)
     }
 }
 
+static void
+close_child_pidfd (DBusBabysitter *sitter)
+{
+  if (sitter->child_watch != NULL)
+    {
+      _dbus_assert (sitter->watches != NULL);
+      _dbus_watch_list_remove_watch (sitter->watches,  sitter->child_watch);
+      _dbus_watch_invalidate (sitter->child_watch);
+      _dbus_watch_unref (sitter->child_watch);
+      sitter->child_watch = NULL;
+    }
+
+  if (sitter->child_pidfd >= 0)
+    {
+      _dbus_close (sitter->child_pidfd, NULL);
+      sitter->child_pidfd = -1;
+    }
+}
+
 static void
 handle_babysitter_socket (DBusBabysitter *sitter,
                           int             revents)
@@ -602,12 +780,54 @@ handle_error_pipe (DBusBabysitter *sitter,
     }
 }
 
+static void
+handle_child_pidfd (DBusBabysitter *sitter,
+                    int             revents)
+{
+  pid_t ret;
+  int status;
+
+  if (!(revents & (_DBUS_POLLIN | _DBUS_POLLERR | _DBUS_POLLHUP)))
+    return;
+
+  do
+    {
+      ret = waitpid (sitter->grandchild_pid, &status, WNOHANG);
+    }
+  while (ret < 0 && errno == EINTR);
+
+  if (ret == 0)
+    {
+      _dbus_verbose ("pidfd readable but child not exited yet\n");
+      return;
+    }
+
+  if (ret < 0)
+    {
+      _dbus_warn ("unexpected waitpid() failure for child %ld: %s\n",
+                  (long) sitter->grandchild_pid, _dbus_strerror (errno));
+    }
+  else
+    {
+      /* As with CHILD_EXITED, don't reset errnum here: an exec failure
+       * reported on the error pipe takes precedence. */
+      sitter->have_child_status = TRUE;
+      sitter->status = status;
+      _dbus_verbose ("reaped child %ld exited = %d signaled = %d exitstatus = %d termsig = %d\n",
+                     (long) ret,
+                     WIFEXITED (sitter->status), WIFSIGNALED (sitter->status),
+                     WEXITSTATUS (sitter->status), WTERMSIG (sitter->status));
+    }
+
+  close_child_pidfd (sitter);
+}
+
 /* returns whether there were any poll events handled */
 static dbus_bool_t
 babysitter_iteration (DBusBabysitter *sitter,
                       dbus_bool_t     block)
 {
-  DBusPollFD fds[2];
+  DBusPollFD fds[3];
   int i;
   dbus_bool_t descriptors_ready;
 
@@ -631,6 +851,14 @@ babysitter_iteration (DBusBabysitter *sitter,
       ++i;
     }
 
+  if (sitter->child_pidfd >= 0)
+    {
+      fds[i].fd = sitter->child_pidfd;
+      fds[i].events = _DBUS_POLLIN;
+      fds[i].revents = 0;
+      ++i;
+    }
+
   if (i > 0)
     {
       int ret;
@@ -661,6 +889,8 @@ babysitter_iteration (DBusBabysitter *sitter,
                 handle_error_pipe (sitter, fds[i].revents);
               else if (fds[i].fd == sitter->socket_to_babysitter.fd)
                 handle_babysitter_socket (sitter, fds[i].revents);
+              else if (fds[i].fd == sitter->child_pidfd)
+                handle_child_pidfd (sitter, fds[i].revents);
             }
         }
     }
@@ -670,9 +900,9 @@ babysitter_iteration (DBusBabysitter *sitter,
 
 /**
  * Macro returns #TRUE if the babysitter still has live sockets open to the
- * babysitter child or the grandchild.
+ * babysitter child or the grandchild, or a pidfd for an unreaped child.
  */
-#define LIVE_CHILDREN(sitter) ((sitter)->socket_to_babysitter.fd >= 0 || (sitter)->error_pipe_from_child >= 0)
+#define LIVE_CHILDREN(sitter) ((sitter)->socket_to_babysitter.fd >= 0 || (sitter)->error_pipe_from_child >= 0 || (sitter)->child_pidfd >= 0)
 
 /**
  * Blocks until the babysitter process gives us the PID of the spawned grandchild,
@@ -694,6 +924,11 @@ _dbus_babysitter_kill_child (DBusBabysitter *sitter)
   if (sitter->grandchild_pid == -1)
     return; /* child is already dead, or we're so hosed we'll never recover */
 
+  /* Without a babysitter we reap the child ourselves, after which
+   * its pid might already have been reused */
+  if (sitter->sitter_pid == -1 && sitter->child_pidfd < 0)
+    return;
+
   kill (sitter->grandchild_pid, SIGKILL);
 }
 
@@ -711,8 +946,9 @@ _dbus_babysitter_get_child_exited (DBusBabysitter *sitter)
          babysitter_iteration (sitter, FALSE))
     ;
 
-  /* We will have exited the babysitter when the child has exited */
-  return sitter->socket_to_babysitter.fd < 0;
+  /* We will have exited the babysitter (or reaped the child, if
+   * there is no babysitter) when the child has exited */
+  return sitter->socket_to_babysitter.fd < 0 && sitter->child_pidfd < 0;
 }
 
 /**
@@ -848,6 +1084,8 @@ handle_watch (DBusWatch       *watch,
     handle_error_pipe (sitter, revents);
   else if (fd == sitter->socket_to_babysitter.fd)
     handle_babysitter_socket (sitter, revents);
+  else if (fd == sitter->child_pidfd)
+    handle_child_pidfd (sitter, revents);
 
   while (LIVE_CHILDREN (sitter) &&
          babysitter_iteration (sitter, FALSE))
@@ -857,6 +1095,7 @@ handle_watch (DBusWatch       *watch,
    * didn't always remove the watches. Check that we don't regress. */
   _dbus_assert (sitter->socket_to_babysitter.fd != -1 || sitter->sitter_watch == NULL);
   _dbus_assert (sitter->error_pipe_from_child != -1 || sitter->error_watch == NULL);
+  _dbus_assert (sitter->child_pidfd != -1 || sitter->child_watch == NULL);
 
   if (_dbus_babysitter_get_child_exited (sitter) &&
       sitter->finished_cb != NULL)
@@ -1187,6 +1426,269 @@ babysit (pid_t grandchild_pid,
   exit (1);
 }
 
+#ifdef DBUS_SPAWN_WITH_PIDFD
+static dbus_bool_t orphans_shutdown_registered = FALSE;
+
+static void
+free_orphans (void *data)
+{
+  DBusOrphan *orphan;
+
+  while ((orphan = _dbus_list_pop_first (&orphans)) != NULL)
+    free_orphan (orphan);
+
+  if (orphan_watches != NULL)
+    {
+      _dbus_watch_list_free (orphan_watches);
+      orphan_watches = NULL;
+    }
+
+  orphans_shutdown_registered = FALSE;
+}
+
+static dbus_bool_t
+register_free_orphans (void)
+{
+  if (!orphans_shutdown_registered)
+    {
+      if (!_dbus_register_shutdown_func (free_orphans, NULL))
+        return FALSE;
+
+      orphans_shutdown_registered = TRUE;
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+pidfd_available (void)
+{
+  static int available = -1;
+
+  if (available < 0)
+    {
+      int fd;
+
+      fd = syscall (SYS_pidfd_open, getpid (), 0);
+
+      if (fd >= 0)
+        {
+          _dbus_close (fd, NULL);
+          available = TRUE;
+        }
+      else if (errno == ENOSYS || errno == EPERM)
+        {
+          /* old kernel, or forbidden by a seccomp filter */
+          available = FALSE;
+        }
+      else
+        {
+          /* probably out of file descriptors; try again next time */
+          return FALSE;
+        }
+    }
+
+  return available;
+}
+
+static void
+kill_and_reap (pid_t pid)
+{
+  pid_t ret;
+  int status;
+
+  kill (pid, SIGKILL);
+
+  do
+    {
+      ret = waitpid (pid, &status, 0);
+    }
+  while (ret < 0 && errno == EINTR);
+}
+
+/* Fork the child that does the exec() directly and set up sitter
+ * to watch it through a pidfd. On failure, the caller cleans up
+ * the pipe and sitter. */
+static dbus_bool_t
+spawn_with_pidfd (DBusBabysitter           *sitter,
+                  int                       child_err_report_pipe[2],
+                  char                    **argv,
+                  char                    **env,
+                  DBusSpawnChildSetupFunc   child_setup,
+                  void                     *user_data,
+                  DBusError                *error)
+{
+  pid_t pid;
+  int pidfd;
+#ifdef HAVE_SYSTEMD
+  int fd_out = -1;
+  int fd_err = -1;
+#endif
+
+  DBusOrphan *orphan;
+
+  reap_orphans ();
+
+  orphan = dbus_new0 (DBusOrphan, 1);
+  if (orphan == NULL)
+    {
+      dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+      return FALSE;
+    }
+
+  sitter->orphan_link = _dbus_list_alloc_link (orphan);
+  if (sitter->orphan_link == NULL)
+    {
+      dbus_free (orphan);
+      dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+      return FALSE;
+    }
+
+  if (!register_free_orphans ())
+    {
+      dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+      return FALSE;
+    }
+
+#ifdef HAVE_SYSTEMD
+  fd_out = sd_journal_stream_fd (sitter->log_name, LOG_INFO, FALSE);
+  fd_err = sd_journal_stream_fd (sitter->log_name, LOG_WARNING, FALSE);
+#endif
+
+  pid = fork ();
+
+  if (pid < 0)
+    {
+      dbus_set_error (error,
+                      DBUS_ERROR_SPAWN_FORK_FAILED,
+                      "Failed to fork (%s)",
+                      _dbus_strerror (errno));
+#ifdef HAVE_SYSTEMD
+      close_and_invalidate (&fd_out);
+      close_and_invalidate (&fd_err);
+#endif
+      return FALSE;
+    }
+  else if (pid == 0)
+    {
+      close_and_invalidate (&child_err_report_pipe[READ_END]);
+#ifdef HAVE_SYSTEMD
+      /* log to systemd journal if possible */
+      if (fd_out >= 0)
+        dup2 (fd_out, STDOUT_FILENO);
+      if (fd_err >= 0)
+        dup2 (fd_err, STDERR_FILENO);
+      close_and_invalidate (&fd_out);
+      close_and_invalidate (&fd_err);
+#endif
+      do_exec (child_err_report_pipe[WRITE_END],
+               argv,
+               env,
+               child_setup, user_data);
+      _dbus_assert_not_reached ("Got to code after exec() - should have exited on error");
+    }
+
+#ifdef HAVE_SYSTEMD
+  close_and_invalidate (&fd_out);
+  close_and_invalidate (&fd_err);
+#endif
+
+  /* Unlike with the babysitter, we can only create the watch now that
+   * the child exists. If that fails, take the child down again rather
+   * than leaving it running untracked. */
+  pidfd = syscall (SYS_pidfd_open, pid, 0);
+
+  if (pidfd < 0)
+    {
+      dbus_set_error (error, DBUS_ERROR_SPAWN_FAILED,
+                      "Failed to watch child process (%s)",
+                      _dbus_strerror (errno));
+      kill_and_reap (pid);
+      return FALSE;
+    }
+
+  sitter->child_watch = _dbus_watch_new (pidfd, DBUS_WATCH_READABLE,
+                                         TRUE, handle_watch, sitter, NULL);
+
+  if (sitter->child_watch == NULL ||
+      !_dbus_watch_list_add_watch (sitter->watches, sitter->child_watch))
+    {
+      if (sitter->child_watch != NULL)
+        {
+          _dbus_watch_invalidate (sitter->child_watch);
+          _dbus_watch_unref (sitter->child_watch);
+          sitter->child_watch = NULL;
+        }
+
+      _dbus_close (pidfd, NULL);
+      kill_and_reap (pid);
+      dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+      return FALSE;
+    }
+
+  close_and_invalidate (&child_err_report_pipe[WRITE_END]);
+
+  sitter->error_pipe_from_child = child_err_report_pipe[READ_END];
+  child_err_report_pipe[READ_END] = -1;
+
+  sitter->child_pidfd = pidfd;
+  sitter->grandchild_pid = pid;
+
+  return TRUE;
+}
+#endif /* DBUS_SPAWN_WITH_PIDFD */
+
+/**
+ * Sets the functions used to watch children that outlive their
+ * DBusBabysitter, so that they can be reaped as soon as they exit.
+ * Without this, such children are only reaped the next time a
+ * process is spawned or a DBusBabysitter is released, and stay
+ * zombies until then. This only matters where children are tracked
+ * through a pidfd; otherwise the babysitter process takes care of it
+ * and this does nothing.
+ *
+ * Like the rest of this file, this is only for single-threaded use.
+ * Call it again with #NULL functions before the main loop goes away.
+ *
+ * @param add_function function to begin monitoring a new watch
+ * @param remove_function function to stop monitoring a watch
+ * @param toggled_function function to notify when a watch is enabled/disabled
+ * @param data data to pass to the functions
+ * @param free_data_function function to free the data
+ * @returns #FALSE on failure (no memory)
+ */
+dbus_bool_t
+_dbus_spawn_set_orphan_watch_functions (DBusAddWatchFunction      add_function,
+                                        DBusRemoveWatchFunction   remove_function,
+                                        DBusWatchToggledFunction  toggled_function,
+                                        void                     *data,
+                                        DBusFreeFunction          free_data_function)
+{
+#ifdef DBUS_SPAWN_WITH_PIDFD
+  if (orphan_watches == NULL)
+    {
+      if (add_function == NULL)
+        return TRUE;
+
+      if (!register_free_orphans ())
+        return FALSE;
+
+      orphan_watches = _dbus_watch_list_new ();
+      if (orphan_watches == NULL)
+        return FALSE;
+    }
+
+  return _dbus_watch_list_set_functions (orphan_watches,
+                                         add_function,
+                                         remove_function,
+                                         toggled_function,
+                                         data,
+                                         free_data_function);
+#else
+  return TRUE;
+#endif
+}
+
 /**
  * Spawns a new process. The child_setup
  * function is passed the given user_data and is run in the child
@@ -1196,6 +1698,8 @@ babysit (pid_t grandchild_pid,
  * child process, advising the parent if the child exits.
  * If the spawn fails, no babysitter is created.
  * If sitter_p is #NULL, no babysitter is kept.
+ * Where pidfd_open() is available, the child is tracked through a
+ * pidfd and no separate babysitter process is forked.
  *
  * @param sitter_p return location for babysitter or #NULL
  * @param log_name the name under which to log messages about this process being spawned
@@ -1258,9 +1762,6 @@ _dbus_spawn_async_with_babysitter (DBusBabysitter          **sitter_p,
   if (!make_pipe (child_err_report_pipe, error))
     goto cleanup_and_fail;
 
-  if (!_dbus_socketpair (&babysitter_pipe[0], &babysitter_pipe[1], TRUE, error))
-    goto cleanup_and_fail;
-
   /* Setting up the babysitter is only useful in the parent,
    * but we don't want to run out of memory and fail
    * after we've already forked, since then we'd leak
@@ -1286,7 +1787,21 @@ _dbus_spawn_async_with_babysitter (DBusBabysitter          **sitter_p,
       dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
       goto cleanup_and_fail;
     }
-      
+
+#ifdef DBUS_SPAWN_WITH_PIDFD
+  if (pidfd_available ())
+    {
+      if (!spawn_with_pidfd (sitter, child_err_report_pipe, argv, env,
+                             child_setup, user_data, error))
+        goto cleanup_and_fail;
+
+      goto spawned;
+    }
+#endif
+
+  if (!_dbus_socketpair (&babysitter_pipe[0], &babysitter_pipe[1], TRUE, error))
+    goto cleanup_and_fail;
+
   sitter->sitter_watch = _dbus_watch_new (babysitter_pipe[0].fd,
                                           DBUS_WATCH_READABLE,
                                           TRUE, handle_watch, sitter, NULL);
@@ -1402,18 +1917,21 @@ _dbus_spawn_async_with_babysitter (DBusBabysitter          **sitter_p,
       child_err_report_pipe[READ_END] = -1;
 
       sitter->sitter_pid = pid;
+    }
 
-      if (sitter_p != NULL)
-        *sitter_p = sitter;
-      else
-        _dbus_babysitter_unref (sitter);
+#ifdef DBUS_SPAWN_WITH_PIDFD
+ spawned:
+#endif
+  if (sitter_p != NULL)
+    *sitter_p = sitter;
+  else
+    _dbus_babysitter_unref (sitter);
 
-      dbus_free_string_array (env);
+  dbus_free_string_array (env);
 
-      _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-      
-      return TRUE;
-    }
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  return TRUE;
 
  cleanup_and_fail:
 
@@ -1675,6 +2193,112 @@ check_spawn_and_kill (void *data)
   return TRUE;
 }
 
+#ifdef DBUS_SPAWN_WITH_PIDFD
+static dbus_bool_t
+add_orphan_watch (DBusWatch *watch,
+                  void      *data)
+{
+  return _dbus_loop_add_watch (data, watch);
+}
+
+static void
+remove_orphan_watch (DBusWatch *watch,
+                     void      *data)
+{
+  _dbus_loop_remove_watch (data, watch);
+}
+
+static void
+toggle_orphan_watch (DBusWatch *watch,
+                     void      *data)
+{
+  _dbus_loop_toggle_watch (data, watch);
+}
+
+static dbus_bool_t
+check_spawn_orphan_reaped (void *data)
+{
+  char *argv[4] = { NULL, NULL, NULL, NULL };
+  DBusBabysitter *sitter = NULL;
+  DBusError error = DBUS_ERROR_INIT;
+  DBusString argv0;
+  DBusLoop *loop;
+  dbus_bool_t ret = FALSE;
+  pid_t pid;
+  int i;
+
+  /*** Test that a child which outlives its babysitter is reaped by
+   * the main loop as soon as it exits, without another spawn */
+
+  if (!pidfd_available ())
+    return TRUE;
+
+  loop = _dbus_loop_new ();
+
+  if (loop == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  if (!_dbus_spawn_set_orphan_watch_functions (add_orphan_watch,
+                                               remove_orphan_watch,
+                                               toggle_orphan_watch,
+                                               loop, NULL))
+    _dbus_assert_not_reached ("no memory");
+
+  argv[0] = get_test_exec ("test-sleep-forever", &argv0);
+
+  if (argv[0] == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  if (!_dbus_spawn_async_with_babysitter (&sitter, "spawn_orphan_reaped",
+                                          argv, NULL, NULL, NULL, &error))
+    {
+      _dbus_warn ("Failed to spawn child: %s: %s\n",
+                  error.name, error.message);
+      dbus_error_free (&error);
+      goto out;
+    }
+
+  pid = sitter->grandchild_pid;
+  _dbus_assert (pid > 0);
+
+  /* The child outlives its babysitter, like a service that stays
+   * running after activation */
+  _dbus_babysitter_unref (sitter);
+  sitter = NULL;
+
+  if (orphans == NULL)
+    {
+      _dbus_warn ("Orphaned child was not tracked\n");
+      goto out;
+    }
+
+  kill (pid, SIGKILL);
+
+  for (i = 0; i < 1000 && orphans != NULL; i++)
+    _dbus_loop_iterate (loop, TRUE);
+
+  if (orphans != NULL)
+    {
+      _dbus_warn ("Exited orphan was not reaped from the main loop\n");
+      goto out;
+    }
+
+  if (waitpid (pid, NULL, WNOHANG) != -1 || errno != ECHILD)
+    {
+      _dbus_warn ("Exited orphan %ld is still a zombie\n", (long) pid);
+      goto out;
+    }
+
+  ret = TRUE;
+
+out:
+  _dbus_string_free (&argv0);
+  _dbus_spawn_set_orphan_watch_functions (NULL, NULL, NULL, NULL, NULL);
+  _dbus_loop_unref (loop);
+  return ret;
+}
+#endif
+
 dbus_bool_t
 _dbus_spawn_test (const char *test_data_dir)
 {
@@ -1697,6 +2321,11 @@ _dbus_spawn_test (const char *test_data_dir)
                                 check_spawn_and_kill,
                                 NULL))
     return FALSE;
+
+#ifdef DBUS_SPAWN_WITH_PIDFD
+  if (!check_spawn_orphan_reaped (NULL))
+    return FALSE;
+#endif
   
   return TRUE;
 }
@@ -62,6 +62,11 @@ dbus_bool_t _dbus_babysitter_set_watch_functions  (DBusBabysitter            *si
                                                    DBusWatchToggledFunction   toggled_function,
                                                    void                      *data,
                                                    DBusFreeFunction           free_data_function);
+dbus_bool_t _dbus_spawn_set_orphan_watch_functions (DBusAddWatchFunction     add_function,
+                                                    DBusRemoveWatchFunction  remove_function,
+                                                    DBusWatchToggledFunction toggled_function,
+                                                    void                    *data,
+                                                    DBusFreeFunction         free_data_function);
 
 DBUS_END_DECLS
 
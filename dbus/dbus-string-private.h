@@ -49,6 +49,7 @@ typedef struct
   unsigned int   locked : 1;     /**< DBusString has been locked and can't be changed */
   unsigned int   invalid : 1;    /**< DBusString is invalid (e.g. already freed) */
   unsigned int   align_offset : 3; /**< str - align_offset is the actual malloc block */
+  unsigned int   tag : 4;        /**< #DBusMemTag the string data is charged to */
 } DBusRealString;
 
 _DBUS_STATIC_ASSERT (sizeof (DBusRealString) == sizeof (DBusString));
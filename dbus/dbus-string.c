@@ -120,17 +120,18 @@ undo_alignment (DBusRealString *real)
 }
 
 /**
- * Initializes a string that can be up to the given allocation size
- * before it has to realloc. The string starts life with zero length.
- * The string must eventually be freed with _dbus_string_free().
+ * Like _dbus_string_init_preallocated(), but the string's data is
+ * charged to the given subsystem rather than #DBUS_MEM_TAG_STRING.
  * 
  * @param str memory to hold the string
  * @param allocate_size amount to preallocate
+ * @param tag the subsystem
  * @returns #TRUE on success, #FALSE if no memory
  */
 dbus_bool_t
-_dbus_string_init_preallocated (DBusString *str,
-                                int         allocate_size)
+_dbus_string_init_tagged (DBusString *str,
+                          int         allocate_size,
+                          DBusMemTag  tag)
 {
   DBusRealString *real;
 
@@ -146,7 +147,8 @@ _dbus_string_init_preallocated (DBusString *str,
    * an existing string, e.g. in _dbus_string_steal_data()
    */
   
-  real->str = dbus_malloc (_DBUS_STRING_ALLOCATION_PADDING + allocate_size);
+  real->str = _dbus_malloc_tagged (tag,
+                                   _DBUS_STRING_ALLOCATION_PADDING + allocate_size);
   if (real->str == NULL)
     return FALSE;  
   
@@ -158,12 +160,29 @@ _dbus_string_init_preallocated (DBusString *str,
   real->locked = FALSE;
   real->invalid = FALSE;
   real->align_offset = 0;
+  real->tag = tag;
   
   fixup_alignment (real);
   
   return TRUE;
 }
 
+/**
+ * Initializes a string that can be up to the given allocation size
+ * before it has to realloc. The string starts life with zero length.
+ * The string must eventually be freed with _dbus_string_free().
+ * 
+ * @param str memory to hold the string
+ * @param allocate_size amount to preallocate
+ * @returns #TRUE on success, #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_string_init_preallocated (DBusString *str,
+                                int         allocate_size)
+{
+  return _dbus_string_init_tagged (str, allocate_size, DBUS_MEM_TAG_STRING);
+}
+
 /**
  * Initializes a string. The string starts life with zero length.  The
  * string must eventually be freed with _dbus_string_free().
@@ -227,6 +246,7 @@ _dbus_string_init_const_len (DBusString *str,
   real->locked = TRUE;
   real->invalid = FALSE;
   real->align_offset = 0;
+  real->tag = DBUS_MEM_TAG_STRING;
 
   /* We don't require const strings to be 8-byte aligned as the
    * memory is coming from elsewhere.
@@ -291,7 +311,8 @@ compact (DBusRealString *real,
 
   new_allocated = real->len + _DBUS_STRING_ALLOCATION_PADDING;
 
-  new_str = dbus_realloc (real->str - real->align_offset, new_allocated);
+  new_str = _dbus_realloc_tagged (real->tag, real->str - real->align_offset,
+                                  new_allocated);
   if (_DBUS_UNLIKELY (new_str == NULL))
     return FALSE;
 
@@ -363,7 +384,8 @@ reallocate_for_length (DBusRealString *real,
                        new_length + _DBUS_STRING_ALLOCATION_PADDING);
 
   _dbus_assert (new_allocated >= real->allocated); /* code relies on this */
-  new_str = dbus_realloc (real->str - real->align_offset, new_allocated);
+  new_str = _dbus_realloc_tagged (real->tag, real->str - real->align_offset,
+                                  new_allocated);
   if (_DBUS_UNLIKELY (new_str == NULL))
     return FALSE;
 
@@ -649,7 +671,7 @@ _dbus_string_steal_data (DBusString        *str,
   *data_return = (char*) real->str;
 
   /* reset the string */
-  if (!_dbus_string_init (str))
+  if (!_dbus_string_init_tagged (str, 0, real->tag))
     {
       /* hrm, put it back then */
       real->str = (unsigned char*) *data_return;
@@ -744,6 +766,20 @@ _dbus_string_get_length (const DBusString  *str)
 }
 #endif /* !_dbus_string_get_length */
 
+/**
+ * Gets how much memory the string has allocated, which may be rather
+ * more than its length; see _dbus_string_compact().
+ *
+ * @returns the allocated size in bytes.
+ */
+int
+_dbus_string_get_allocated_size (const DBusString  *str)
+{
+  DBUS_CONST_STRING_PREAMBLE (str);
+
+  return real->allocated;
+}
+
 /**
  * Makes a string longer by the given number of bytes.  Checks whether
  * adding additional_length to the current length would overflow an
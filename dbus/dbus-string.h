@@ -28,6 +28,7 @@
 #include <dbus/dbus-macros.h>
 #include <dbus/dbus-types.h>
 #include <dbus/dbus-memory.h>
+#include <dbus/dbus-memory-internal.h>
 
 #include <stdarg.h>
 
@@ -52,6 +53,7 @@ struct DBusString
   unsigned int dummy_bit2 : 1; /**< placeholder */
   unsigned int dummy_bit3 : 1; /**< placeholder */
   unsigned int dummy_bits : 3; /**< placeholder */
+  unsigned int dummy_bits4 : 4; /**< placeholder */
 };
 
 #ifdef DBUS_DISABLE_ASSERT
@@ -78,6 +80,9 @@ void          _dbus_string_init_const_len        (DBusString        *str,
                                                   int                len);
 dbus_bool_t   _dbus_string_init_preallocated     (DBusString        *str,
                                                   int                allocate_size);
+dbus_bool_t   _dbus_string_init_tagged           (DBusString        *str,
+                                                  int                allocate_size,
+                                                  DBusMemTag         tag);
 
 DBUS_PRIVATE_EXPORT
 dbus_bool_t _dbus_string_init_from_string        (DBusString        *str,
@@ -150,6 +155,7 @@ void          _dbus_string_copy_to_buffer_with_nul (const DBusString  *str,
 DBUS_PRIVATE_EXPORT
 int           _dbus_string_get_length            (const DBusString  *str);
 #endif /* !_dbus_string_get_length */
+int           _dbus_string_get_allocated_size    (const DBusString  *str);
 
 /**
  * Get the string's length as an unsigned integer, for comparison with
@@ -57,6 +57,10 @@ struct DBusCondVar {
   pthread_cond_t cond; /**< the condition */
 };
 
+struct DBusThreadLocal {
+  pthread_key_t key; /**< the key */
+};
+
 #define DBUS_MUTEX(m)         ((DBusMutex*) m)
 #define DBUS_MUTEX_PTHREAD(m) ((DBusMutexPThread*) m)
 
@@ -264,6 +268,59 @@ _dbus_platform_condvar_wake_one (DBusCondVar *cond)
   PTHREAD_CHECK ("pthread_cond_signal", pthread_cond_signal (&cond->cond));
 }
 
+DBusThreadLocal *
+_dbus_platform_thread_local_new (DBusFreeFunction destructor)
+{
+  DBusThreadLocal *local;
+  int result;
+
+  local = dbus_new (DBusThreadLocal, 1);
+  if (local == NULL)
+    return NULL;
+
+  result = pthread_key_create (&local->key, destructor);
+
+  if (result == EAGAIN || result == ENOMEM)
+    {
+      dbus_free (local);
+      return NULL;
+    }
+  else
+    {
+      PTHREAD_CHECK ("pthread_key_create", result);
+    }
+
+  return local;
+}
+
+void
+_dbus_platform_thread_local_free (DBusThreadLocal *local)
+{
+  PTHREAD_CHECK ("pthread_key_delete", pthread_key_delete (local->key));
+  dbus_free (local);
+}
+
+void *
+_dbus_platform_thread_local_get (DBusThreadLocal *local)
+{
+  return pthread_getspecific (local->key);
+}
+
+dbus_bool_t
+_dbus_platform_thread_local_set (DBusThreadLocal *local,
+                                 void            *value)
+{
+  int result;
+
+  result = pthread_setspecific (local->key, value);
+
+  if (result == ENOMEM)
+    return FALSE;
+
+  PTHREAD_CHECK ("pthread_setspecific", result);
+  return TRUE;
+}
+
 static void
 check_monotonic_clock (void)
 {
@@ -271,6 +271,73 @@ _dbus_platform_condvar_wake_one (DBusCondVar *cond)
   LeaveCriticalSection (&cond->lock);
 }
 
+#ifndef DBUS_WINCE
+struct DBusThreadLocal {
+  DWORD index;                  /**< the fiber-local storage index */
+};
+#endif
+
+DBusThreadLocal *
+_dbus_platform_thread_local_new (DBusFreeFunction destructor)
+{
+#ifdef DBUS_WINCE
+  /* No fiber-local storage, hence no way to run the destructor */
+  return NULL;
+#else
+  DBusThreadLocal *local;
+
+  local = dbus_new (DBusThreadLocal, 1);
+  if (local == NULL)
+    return NULL;
+
+  /* Unlike TLS, FLS calls us back when a thread exits */
+  local->index = FlsAlloc ((PFLS_CALLBACK_FUNCTION) destructor);
+  if (local->index == FLS_OUT_OF_INDEXES)
+    {
+      dbus_free (local);
+      return NULL;
+    }
+
+  return local;
+#endif
+}
+
+void
+_dbus_platform_thread_local_free (DBusThreadLocal *local)
+{
+#ifndef DBUS_WINCE
+  /* FlsFree() calls the destructor for every thread that still has a
+   * value, not just this one. Clearing our own value spares this
+   * thread; the destructor has to cope with the other threads' values,
+   * which the caller may already have freed.
+   */
+  FlsSetValue (local->index, NULL);
+  FlsFree (local->index);
+  dbus_free (local);
+#endif
+}
+
+void *
+_dbus_platform_thread_local_get (DBusThreadLocal *local)
+{
+#ifdef DBUS_WINCE
+  return NULL;
+#else
+  return FlsGetValue (local->index);
+#endif
+}
+
+dbus_bool_t
+_dbus_platform_thread_local_set (DBusThreadLocal *local,
+                                 void            *value)
+{
+#ifdef DBUS_WINCE
+  return FALSE;
+#else
+  return FlsSetValue (local->index, value);
+#endif
+}
+
 dbus_bool_t
 _dbus_threads_init_platform_specific (void)
 {
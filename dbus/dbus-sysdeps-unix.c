@@ -2132,23 +2132,15 @@ _dbus_send_credentials_socket  (DBusSocket       server_fd,
     return FALSE;
 }
 
-/**
- * Accepts a connection on a listening socket.
- * Handles EINTR for you.
- *
- * This will enable FD_CLOEXEC for the returned socket.
- *
- * @param listen_fd the listen file descriptor
- * @returns the connection fd of the client, or -1 on error
- */
-DBusSocket
-_dbus_accept  (DBusSocket listen_fd)
+static DBusSocket
+accept_socket (DBusSocket  listen_fd,
+               dbus_bool_t nonblocking)
 {
   DBusSocket client_fd;
   struct sockaddr addr;
   socklen_t addrlen;
 #ifdef HAVE_ACCEPT4
-  dbus_bool_t cloexec_done;
+  dbus_bool_t flags_done;
 #endif
 
   addrlen = sizeof (addr);
@@ -2158,11 +2150,13 @@ _dbus_accept  (DBusSocket listen_fd)
 #ifdef HAVE_ACCEPT4
   /*
    * At compile-time, we assume that if accept4() is available in
-   * libc headers, SOCK_CLOEXEC is too. At runtime, it is still
-   * not necessarily true that either is supported by the running kernel.
+   * libc headers, SOCK_CLOEXEC and SOCK_NONBLOCK are too. At runtime,
+   * it is still not necessarily true that either is supported by the
+   * running kernel.
    */
-  client_fd.fd = accept4 (listen_fd.fd, &addr, &addrlen, SOCK_CLOEXEC);
-  cloexec_done = client_fd.fd >= 0;
+  client_fd.fd = accept4 (listen_fd.fd, &addr, &addrlen,
+                          SOCK_CLOEXEC | (nonblocking ? SOCK_NONBLOCK : 0));
+  flags_done = client_fd.fd >= 0;
 
   if (client_fd.fd < 0 && (errno == ENOSYS || errno == EINVAL))
 #endif
@@ -2174,20 +2168,60 @@ _dbus_accept  (DBusSocket listen_fd)
     {
       if (errno == EINTR)
         goto retry;
+
+      return client_fd;
     }
 
   _dbus_verbose ("client fd %d accepted\n", client_fd.fd);
 
 #ifdef HAVE_ACCEPT4
-  if (!cloexec_done)
+  if (!flags_done)
 #endif
     {
-      _dbus_fd_set_close_on_exec(client_fd.fd);
+      _dbus_fd_set_close_on_exec (client_fd.fd);
+
+      if (nonblocking && !_dbus_set_fd_nonblocking (client_fd.fd, NULL))
+        {
+          int saved_errno = errno;
+
+          _dbus_close (client_fd.fd, NULL);
+          client_fd.fd = -1;
+          errno = saved_errno;
+        }
     }
 
   return client_fd;
 }
 
+/**
+ * Accepts a connection on a listening socket.
+ * Handles EINTR for you.
+ *
+ * This will enable FD_CLOEXEC for the returned socket.
+ *
+ * @param listen_fd the listen file descriptor
+ * @returns the connection fd of the client, or -1 on error
+ */
+DBusSocket
+_dbus_accept  (DBusSocket listen_fd)
+{
+  return accept_socket (listen_fd, FALSE);
+}
+
+/**
+ * Like _dbus_accept(), but the returned socket is also nonblocking.
+ * Where accept4() is available this needs no further system calls,
+ * which matters when many clients connect at once.
+ *
+ * @param listen_fd the listen file descriptor
+ * @returns the connection fd of the client, or -1 on error
+ */
+DBusSocket
+_dbus_accept_nonblocking (DBusSocket listen_fd)
+{
+  return accept_socket (listen_fd, TRUE);
+}
+
 /**
  * Checks to make sure the given directory is
  * private to the user
@@ -2714,6 +2748,31 @@ _dbus_atomic_dec (DBusAtomic *atomic)
 #endif
 }
 
+/**
+ * Atomically add to an integer
+ *
+ * @param atomic pointer to the integer to add to
+ * @param delta amount to add, which may be negative
+ * @returns the value before adding
+ */
+dbus_int32_t
+_dbus_atomic_add (DBusAtomic   *atomic,
+                  dbus_int32_t  delta)
+{
+#if DBUS_USE_SYNC
+  return __sync_fetch_and_add (&atomic->value, delta);
+#else
+  dbus_int32_t res;
+
+  pthread_mutex_lock (&atomic_mutex);
+  res = atomic->value;
+  atomic->value += delta;
+  pthread_mutex_unlock (&atomic_mutex);
+
+  return res;
+#endif
+}
+
 /**
  * Atomically get the value of an integer. It may change at any time
  * thereafter, so this is mostly only useful for assertions.
@@ -729,6 +729,7 @@ _dbus_stat (const DBusString *filename,
   statbuf->atime = sb.st_atime;
   statbuf->mtime = sb.st_mtime;
   statbuf->ctime = sb.st_ctime;
+  statbuf->inode = sb.st_ino;
 
   return TRUE;
 }
@@ -454,6 +454,9 @@ _dbus_stat(const DBusString *filename,
     (((dbus_int64_t) wfad.ftCreationTime.dwHighDateTime << 32) +
      wfad.ftCreationTime.dwLowDateTime) / 10000000 - DBUS_INT64_CONSTANT (116444736000000000);
 
+  /* GetFileAttributesEx() doesn't tell us the file index */
+  statbuf->inode = 0;
+
   return TRUE;
 }
 
@@ -1866,6 +1866,29 @@ _dbus_accept  (DBusSocket listen_fd)
   return client_fd;
 }
 
+/**
+ * Like _dbus_accept(), but the returned socket is also nonblocking.
+ *
+ * @param listen_fd the listen file descriptor
+ * @returns the connection fd of the client, or -1 on error
+ */
+DBusSocket
+_dbus_accept_nonblocking (DBusSocket listen_fd)
+{
+  DBusSocket client_fd;
+
+  client_fd = _dbus_accept (listen_fd);
+
+  if (_dbus_socket_is_valid (client_fd) &&
+      !_dbus_set_socket_nonblocking (client_fd, NULL))
+    {
+      _dbus_close_socket (client_fd, NULL);
+      _dbus_socket_invalidate (&client_fd);
+    }
+
+  return client_fd;
+}
+
 
 
 
@@ -3238,6 +3261,20 @@ _dbus_atomic_dec (DBusAtomic *atomic)
   return InterlockedDecrement (&atomic->value) + 1;
 }
 
+/**
+ * Atomically add to an integer
+ *
+ * @param atomic pointer to the integer to add to
+ * @param delta amount to add, which may be negative
+ * @returns the value before adding
+ */
+dbus_int32_t
+_dbus_atomic_add (DBusAtomic   *atomic,
+                  dbus_int32_t  delta)
+{
+  return InterlockedExchangeAdd (&atomic->value, delta);
+}
+
 /**
  * Atomically get the value of an integer. It may change at any time
  * thereafter, so this is mostly only useful for assertions.
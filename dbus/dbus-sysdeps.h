@@ -232,6 +232,7 @@ int _dbus_listen_tcp_socket   (const char     *host,
                                DBusSocket    **fds_p,
                                DBusError      *error);
 DBusSocket _dbus_accept       (DBusSocket      listen_fd);
+DBusSocket _dbus_accept_nonblocking (DBusSocket listen_fd);
 
 dbus_bool_t _dbus_read_credentials_socket (DBusSocket        client_fd,
                                            DBusCredentials  *credentials,
@@ -297,6 +298,8 @@ struct DBusAtomic
 
 dbus_int32_t _dbus_atomic_inc (DBusAtomic *atomic);
 dbus_int32_t _dbus_atomic_dec (DBusAtomic *atomic);
+dbus_int32_t _dbus_atomic_add (DBusAtomic   *atomic,
+                               dbus_int32_t  delta);
 dbus_int32_t _dbus_atomic_get (DBusAtomic *atomic);
 
 #ifdef DBUS_WIN
@@ -505,6 +508,7 @@ typedef struct
   unsigned long atime; /**< Access time */
   unsigned long mtime; /**< Modify time */
   unsigned long ctime; /**< Creation time */
+  unsigned long inode; /**< Inode number, or 0 if not applicable */
 } DBusStat;
 
 dbus_bool_t _dbus_stat             (const DBusString *filename,
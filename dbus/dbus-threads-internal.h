@@ -24,6 +24,7 @@
 #define DBUS_THREADS_INTERNAL_H
 
 #include <dbus/dbus-macros.h>
+#include <dbus/dbus-memory.h>
 #include <dbus/dbus-types.h>
 #include <dbus/dbus-threads.h>
 
@@ -44,6 +45,13 @@ typedef struct DBusRMutex DBusRMutex;
  */
 typedef struct DBusCMutex DBusCMutex;
 
+/**
+ * A key under which each thread can store its own pointer. A
+ * destructor given at creation is called on a thread's non-#NULL
+ * value when that thread exits.
+ */
+typedef struct DBusThreadLocal DBusThreadLocal;
+
 /** @} */
 
 DBUS_BEGIN_DECLS
@@ -71,6 +79,12 @@ void         _dbus_condvar_wake_one          (DBusCondVar       *cond);
 void         _dbus_condvar_new_at_location   (DBusCondVar      **location_p);
 void         _dbus_condvar_free_at_location  (DBusCondVar      **location_p);
 
+DBusThreadLocal *_dbus_thread_local_new      (DBusFreeFunction   destructor);
+void         _dbus_thread_local_free         (DBusThreadLocal   *local);
+void        *_dbus_thread_local_get          (DBusThreadLocal   *local);
+dbus_bool_t  _dbus_thread_local_set          (DBusThreadLocal   *local,
+                                              void              *value);
+
 /* Private to threading implementations and dbus-threads.c */
 
 DBusRMutex  *_dbus_platform_rmutex_new       (void);
@@ -92,6 +106,12 @@ dbus_bool_t  _dbus_platform_condvar_wait_timeout (DBusCondVar   *cond,
                                               int                timeout_milliseconds);
 void         _dbus_platform_condvar_wake_one (DBusCondVar       *cond);
 
+DBusThreadLocal *_dbus_platform_thread_local_new (DBusFreeFunction destructor);
+void         _dbus_platform_thread_local_free (DBusThreadLocal  *local);
+void        *_dbus_platform_thread_local_get (DBusThreadLocal   *local);
+dbus_bool_t  _dbus_platform_thread_local_set (DBusThreadLocal   *local,
+                                              void              *value);
+
 DBUS_END_DECLS
 
 #endif /* DBUS_THREADS_INTERNAL_H */
@@ -187,6 +187,68 @@ _dbus_condvar_new (void)
 }
 
 
+/**
+ * Creates a new thread-local key. Each thread sees #NULL under the key
+ * until it sets a value of its own. When a thread exits, destructor
+ * (if not #NULL) is called on its value. Returns #NULL if there is not
+ * enough memory or the platform has run out of keys.
+ *
+ * @param destructor function to free a thread's value when it exits
+ * @returns new key or #NULL
+ */
+DBusThreadLocal *
+_dbus_thread_local_new (DBusFreeFunction destructor)
+{
+  if (!dbus_threads_init_default ())
+    return NULL;
+
+  return _dbus_platform_thread_local_new (destructor);
+}
+
+/**
+ * Frees a thread-local key. The caller must deal with any values
+ * still stored under it. With pthreads the destructor is not called
+ * on them, but on Windows it is called, for every thread's value, so
+ * it must recognise and skip values the caller has already freed.
+ *
+ * @param local the key, or #NULL
+ */
+void
+_dbus_thread_local_free (DBusThreadLocal *local)
+{
+  if (local == NULL)
+    return;
+
+  _dbus_platform_thread_local_free (local);
+}
+
+/**
+ * Gets the calling thread's value for a thread-local key. This never
+ * takes a lock.
+ *
+ * @param local the key
+ * @returns the value, or #NULL if the thread has not set one
+ */
+void *
+_dbus_thread_local_get (DBusThreadLocal *local)
+{
+  return _dbus_platform_thread_local_get (local);
+}
+
+/**
+ * Sets the calling thread's value for a thread-local key.
+ *
+ * @param local the key
+ * @param value the new value
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+_dbus_thread_local_set (DBusThreadLocal *local,
+                        void            *value)
+{
+  return _dbus_platform_thread_local_set (local, value);
+}
+
 /**
  * This does the same thing as _dbus_condvar_new.  It however
  * gives another level of indirection by allocating a pointer
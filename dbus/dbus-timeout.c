@@ -25,6 +25,7 @@
 #include "dbus-internals.h"
 #include "dbus-timeout.h"
 #include "dbus-list.h"
+#include "dbus-mempool.h"
 
 /**
  * @defgroup DBusTimeoutInternals DBusTimeout implementation details
@@ -51,6 +52,9 @@ struct DBusTimeout
   unsigned int enabled : 1;                    /**< True if timeout is active. */
 };
 
+static DBusSlab timeout_slab =
+  _DBUS_SLAB_INIT (sizeof (DBusTimeout), DBUS_MEM_TAG_CONNECTION);
+
 /**
  * Creates a new DBusTimeout, enabled by default.
  * @param interval the timeout interval in milliseconds.
@@ -67,7 +71,7 @@ _dbus_timeout_new (int                 interval,
 {
   DBusTimeout *timeout;
 
-  timeout = dbus_new0 (DBusTimeout, 1);
+  timeout = _dbus_slab_alloc (&timeout_slab);
   if (timeout == NULL)
     return NULL;
   
@@ -117,7 +121,7 @@ _dbus_timeout_unref (DBusTimeout *timeout)
       if (timeout->free_handler_data_function)
 	(* timeout->free_handler_data_function) (timeout->handler_data);
       
-      dbus_free (timeout);
+      _dbus_slab_dealloc (&timeout_slab, timeout);
     }
 }
 
@@ -184,6 +188,9 @@ struct DBusTimeoutList
   DBusFreeFunction timeout_free_data_function;       /**< Free function for timeout callback data */
 };
 
+static DBusSlab timeout_list_slab =
+  _DBUS_SLAB_INIT (sizeof (DBusTimeoutList), DBUS_MEM_TAG_CONNECTION);
+
 /**
  * Creates a new timeout list. Returns #NULL if insufficient
  * memory exists.
@@ -195,7 +202,7 @@ _dbus_timeout_list_new (void)
 {
   DBusTimeoutList *timeout_list;
 
-  timeout_list = dbus_new0 (DBusTimeoutList, 1);
+  timeout_list = _dbus_slab_alloc (&timeout_list_slab);
   if (timeout_list == NULL)
     return NULL;
 
@@ -219,7 +226,7 @@ _dbus_timeout_list_free (DBusTimeoutList *timeout_list)
 		      NULL);
   _dbus_list_clear (&timeout_list->timeouts);
 
-  dbus_free (timeout_list);
+  _dbus_slab_dealloc (&timeout_list_slab, timeout_list);
 }
 
 /**
@@ -298,6 +305,30 @@ _dbus_timeout_list_set_functions (DBusTimeoutList           *timeout_list,
   return TRUE;
 }
 
+/**
+ * Gets the functions and data set with
+ * _dbus_timeout_list_set_functions(), so that the timeouts of another
+ * connection can be serviced by the same main loop.
+ *
+ * @param timeout_list the timeout list
+ * @param add_function return location for the add function
+ * @param remove_function return location for the remove function
+ * @param toggled_function return location for the toggled function
+ * @param data return location for the data
+ */
+void
+_dbus_timeout_list_get_functions (DBusTimeoutList            *timeout_list,
+                                  DBusAddTimeoutFunction     *add_function,
+                                  DBusRemoveTimeoutFunction  *remove_function,
+                                  DBusTimeoutToggledFunction *toggled_function,
+                                  void                      **data)
+{
+  *add_function = timeout_list->add_timeout_function;
+  *remove_function = timeout_list->remove_timeout_function;
+  *toggled_function = timeout_list->timeout_toggled_function;
+  *data = timeout_list->timeout_data;
+}
+
 /**
  * Adds a new timeout to the timeout list, invoking the
  * application DBusAddTimeoutFunction if appropriate.
@@ -63,6 +63,11 @@ dbus_bool_t      _dbus_timeout_list_set_functions  (DBusTimeoutList           *t
                                                     DBusTimeoutToggledFunction toggled_function,
 						    void                      *data,
 						    DBusFreeFunction           free_data_function);
+void             _dbus_timeout_list_get_functions  (DBusTimeoutList            *timeout_list,
+                                                    DBusAddTimeoutFunction     *add_function,
+                                                    DBusRemoveTimeoutFunction  *remove_function,
+                                                    DBusTimeoutToggledFunction *toggled_function,
+                                                    void                      **data);
 dbus_bool_t      _dbus_timeout_list_add_timeout    (DBusTimeoutList           *timeout_list,
 						    DBusTimeout               *timeout);
 void             _dbus_timeout_list_remove_timeout (DBusTimeoutList           *timeout_list,
@@ -66,6 +66,11 @@ struct DBusTransportVTable
   void        (* live_messages_changed) (DBusTransport *transport);
   /**< Outstanding messages counter changed */
 
+  void        (* outgoing_queued)       (DBusTransport *transport);
+  /**< Messages were queued for sending without an iteration to
+   * write them; make sure the write watch will pick them up.
+   */
+
   dbus_bool_t (* get_socket_fd) (DBusTransport *transport,
                                  DBusSocket    *fd_p);
   /**< Get socket file descriptor */
@@ -117,6 +122,7 @@ struct DBusTransport
   unsigned int is_server : 1;                 /**< #TRUE if on the server side */
   unsigned int unused_bytes_recovered : 1;    /**< #TRUE if we've recovered unused bytes from auth */
   unsigned int allow_anonymous : 1;           /**< #TRUE if an anonymous client can connect */
+  unsigned int pipeline_auth : 1;             /**< #TRUE if the client sends BEGIN without waiting for OK; see _dbus_transport_open() */
 };
 
 dbus_bool_t _dbus_transport_init_base     (DBusTransport             *transport,
@@ -29,6 +29,7 @@
 #include "dbus-transport-protected.h"
 #include "dbus-watch.h"
 #include "dbus-credentials.h"
+#include "dbus-mempool.h"
 
 /**
  * @defgroup DBusTransportSocket DBusTransport implementations for sockets
@@ -68,6 +69,9 @@ struct DBusTransportSocket
                                          */
 };
 
+static DBusSlab socket_transport_slab =
+  _DBUS_SLAB_INIT (sizeof (DBusTransportSocket), DBUS_MEM_TAG_TRANSPORT);
+
 static void
 free_watches (DBusTransport *transport)
 {
@@ -115,7 +119,23 @@ socket_finalize (DBusTransport *transport)
   _dbus_assert (socket_transport->read_watch == NULL);
   _dbus_assert (socket_transport->write_watch == NULL);
   
-  dbus_free (transport);
+  _dbus_slab_dealloc (&socket_transport_slab, socket_transport);
+}
+
+/* Whether the next outgoing message may already be written behind a
+ * pipelined BEGIN, before the server has accepted the handshake. Unix
+ * fds have to wait until the server has agreed to them. */
+static dbus_bool_t
+can_write_message_early (DBusTransport *transport)
+{
+  DBusMessage *message;
+
+  if (!_dbus_auth_is_pipelining (transport->auth) ||
+      !_dbus_connection_has_messages_to_send_unlocked (transport->connection))
+    return FALSE;
+
+  message = _dbus_connection_get_message_to_send (transport->connection);
+  return !dbus_message_contains_unix_fds (message);
 }
 
 static void
@@ -155,7 +175,7 @@ check_write_watch (DBusTransport *transport)
               auth_state == DBUS_AUTH_STATE_WAITING_FOR_MEMORY)
             needed = TRUE;
           else
-            needed = FALSE;
+            needed = can_write_message_early (transport);
         }
     }
 
@@ -350,6 +370,12 @@ exchange_credentials (DBusTransport *transport,
 
   if (do_writing && transport->send_credentials_pending)
     {
+      /* Queue the rest of the handshake behind the first AUTH before
+       * anything goes out, so that it leaves in as few writes as possible */
+      if (!_dbus_auth_client_pipeline (transport->auth,
+                                       transport->pipeline_auth))
+        return FALSE;
+
       if (_dbus_send_credentials_socket (socket_transport->fd,
                                          &error))
         {
@@ -501,8 +527,10 @@ do_writing (DBusTransport *transport)
   DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
   dbus_bool_t oom;
   
-  /* No messages without authentication! */
-  if (!_dbus_transport_try_to_authenticate (transport))
+  /* No messages without authentication, unless they can follow a
+   * pipelined handshake */
+  if (!_dbus_transport_try_to_authenticate (transport) &&
+      !can_write_message_early (transport))
     {
       _dbus_verbose ("Not authenticated, not writing anything\n");
       return TRUE;
@@ -540,6 +568,13 @@ do_writing (DBusTransport *transport)
                          total, socket_transport->max_bytes_written_per_iteration);
           goto out;
         }
+
+      if (!transport->authenticated &&
+          !can_write_message_early (transport))
+        {
+          _dbus_verbose ("Waiting for the server to accept the handshake\n");
+          goto out;
+        }
       
       message = _dbus_connection_get_message_to_send (transport->connection);
       _dbus_assert (message != NULL);
@@ -1139,7 +1174,9 @@ socket_do_iteration (DBusTransport *transport,
 	poll_fd.events |= _DBUS_POLLIN;
 
       if (transport->send_credentials_pending ||
-          auth_state == DBUS_AUTH_STATE_HAVE_BYTES_TO_SEND)
+          auth_state == DBUS_AUTH_STATE_HAVE_BYTES_TO_SEND ||
+          ((flags & DBUS_ITERATION_DO_WRITING) &&
+           can_write_message_early (transport)))
 	poll_fd.events |= _DBUS_POLLOUT;
     }
 
@@ -1239,6 +1276,12 @@ socket_live_messages_changed (DBusTransport *transport)
 }
 
 
+static void
+socket_outgoing_queued (DBusTransport *transport)
+{
+  check_write_watch (transport);
+}
+
 static dbus_bool_t
 socket_get_socket_fd (DBusTransport *transport,
                       DBusSocket    *fd_p)
@@ -1257,6 +1300,7 @@ static const DBusTransportVTable socket_vtable = {
   socket_connection_set,
   socket_do_iteration,
   socket_live_messages_changed,
+  socket_outgoing_queued,
   socket_get_socket_fd
 };
 
@@ -1278,14 +1322,16 @@ _dbus_transport_new_for_socket (DBusSocket        fd,
 {
   DBusTransportSocket *socket_transport;
   
-  socket_transport = dbus_new0 (DBusTransportSocket, 1);
+  socket_transport = _dbus_slab_alloc (&socket_transport_slab);
   if (socket_transport == NULL)
     return NULL;
 
-  if (!_dbus_string_init (&socket_transport->encoded_outgoing))
+  if (!_dbus_string_init_tagged (&socket_transport->encoded_outgoing, 0,
+                                 DBUS_MEM_TAG_TRANSPORT))
     goto failed_0;
 
-  if (!_dbus_string_init (&socket_transport->encoded_incoming))
+  if (!_dbus_string_init_tagged (&socket_transport->encoded_incoming, 0,
+                                 DBUS_MEM_TAG_TRANSPORT))
     goto failed_1;
   
   socket_transport->write_watch = _dbus_watch_new (_dbus_socket_get_pollable (fd),
@@ -1331,7 +1377,7 @@ _dbus_transport_new_for_socket (DBusSocket        fd,
  failed_1:
   _dbus_string_free (&socket_transport->encoded_outgoing);
  failed_0:
-  dbus_free (socket_transport);
+  _dbus_slab_dealloc (&socket_transport_slab, socket_transport);
   return NULL;
 }
 
@@ -170,6 +170,7 @@ _dbus_transport_init_base (DBusTransport             *transport,
   transport->is_server = (server_guid != NULL);
   transport->send_credentials_pending = !transport->is_server;
   transport->receive_credentials_pending = transport->is_server;
+  transport->pipeline_auth = FALSE;
   transport->address = address_copy;
   
   transport->unix_user_function = NULL;
@@ -445,6 +446,20 @@ _dbus_transport_open (DBusAddressEntry *entry,
        */
       if(expected_guid)
         transport->expected_guid = expected_guid;
+
+      /* Sending BEGIN and the first messages before the server has
+       * accepted EXTERNAL saves a round trip, but leaves no way to fall
+       * back to another mechanism if it does not. A Unix socket server
+       * whose GUID we were given is one we have been told about, such
+       * as a message bus, and it is expected to accept EXTERNAL, so do
+       * it for those unless DBUS_PIPELINE_AUTH=0 says otherwise */
+      if (transport->expected_guid != NULL &&
+          strcmp (dbus_address_entry_get_method (entry), "unix") == 0)
+        {
+          const char *s = _dbus_getenv ("DBUS_PIPELINE_AUTH");
+
+          transport->pipeline_auth = (s == NULL || strcmp (s, "0") != 0);
+        }
     }
 
   return transport;
@@ -1005,6 +1020,25 @@ _dbus_transport_do_iteration (DBusTransport  *transport,
   _dbus_verbose ("end\n");
 }
 
+/**
+ * Tells the transport that messages were added to the outgoing
+ * queue without running an iteration, so that it arranges for
+ * its write watch to send them.
+ *
+ * @param transport the transport.
+ */
+void
+_dbus_transport_outgoing_queued (DBusTransport *transport)
+{
+  if (transport->disconnected ||
+      transport->vtable->outgoing_queued == NULL)
+    return;
+
+  _dbus_transport_ref (transport);
+  (* transport->vtable->outgoing_queued) (transport);
+  _dbus_transport_unref (transport);
+}
+
 static dbus_bool_t
 recover_unused_bytes (DBusTransport *transport)
 {
@@ -1150,6 +1184,7 @@ _dbus_transport_queue_messages (DBusTransport *transport)
     {
       DBusMessage *message;
       DBusList *link;
+      const char *sender;
 
       link = _dbus_message_loader_pop_message_link (transport->loader);
       _dbus_assert (link != NULL);
@@ -1158,7 +1193,10 @@ _dbus_transport_queue_messages (DBusTransport *transport)
       
       _dbus_verbose ("queueing received message %p\n", message);
 
-      if (!_dbus_message_add_counter (message, transport->live_messages))
+      sender = _dbus_connection_get_received_sender_unlocked (transport->connection);
+
+      if ((sender != NULL && !dbus_message_set_sender (message, sender)) ||
+          !_dbus_message_add_counter (message, transport->live_messages))
         {
           _dbus_message_loader_putback_message_link (transport->loader,
                                                      link);
@@ -1566,7 +1604,174 @@ _dbus_transport_set_pending_fds_function (DBusTransport *transport,
                                                  callback, data);
 }
 
+/**
+ * Takes a server-side transport whose peer already authenticated
+ * with a previous instance of this server straight to the
+ * authenticated state, without exchanging the credentials byte or
+ * running the auth conversation again. The usual check of the
+ * identity against the unix user function still happens on the
+ * next _dbus_transport_try_to_authenticate().
+ *
+ * @param transport the transport
+ * @param identity the identity the peer was authorized as
+ * @param unix_fd_negotiated whether unix fd passing was agreed on
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_transport_resume_authenticated (DBusTransport   *transport,
+                                      DBusCredentials *identity,
+                                      dbus_bool_t      unix_fd_negotiated)
+{
+  _dbus_assert (transport->is_server);
+  _dbus_assert (!transport->authenticated);
+
+  if (!_dbus_credentials_add_credentials (transport->credentials, identity))
+    return FALSE;
+
+  if (!_dbus_auth_set_authenticated (transport->auth, identity,
+                                     unix_fd_negotiated))
+    return FALSE;
+
+  transport->receive_credentials_pending = FALSE;
+  transport->send_credentials_pending = FALSE;
+  /* there was no conversation, so nothing was read past its end */
+  transport->unused_bytes_recovered = TRUE;
+
+  return TRUE;
+}
+
+/**
+ * Copies the identity the peer authenticated as.
+ *
+ * @param transport the transport
+ * @returns the credentials, or #NULL if not authenticated or no memory
+ */
+DBusCredentials*
+_dbus_transport_copy_identity (DBusTransport *transport)
+{
+  if (!transport->authenticated)
+    return NULL;
+
+  return _dbus_credentials_copy (_dbus_auth_get_identity (transport->auth));
+}
+
+/**
+ * Copies the part of a message that has been read but not parsed
+ * yet, and gets the file descriptors that came with it.
+ *
+ * @param transport the transport
+ * @param bytes string to append the bytes to
+ * @param fds return location for the fds, still owned by the transport
+ * @param n_fds return location for the number of fds
+ * @returns #FALSE if no memory, if complete messages are still
+ *  waiting to be queued, or if the auth mechanism encodes the data
+ */
+dbus_bool_t
+_dbus_transport_get_unparsed_incoming (DBusTransport  *transport,
+                                       DBusString     *bytes,
+                                       const int     **fds,
+                                       unsigned int   *n_fds)
+{
+  const DBusString *data;
+
+  if (_dbus_auth_needs_decoding (transport->auth))
+    return FALSE;
+
+  if (!_dbus_message_loader_get_unparsed (transport->loader, &data,
+                                          fds, n_fds))
+    return FALSE;
+
+  return _dbus_string_copy (data, 0, bytes, _dbus_string_get_length (bytes));
+}
+
+/**
+ * Puts bytes and file descriptors into the transport as if they had
+ * just been read from the socket. This is the other half of
+ * _dbus_transport_get_unparsed_incoming().
+ *
+ * @param transport the transport
+ * @param bytes the bytes
+ * @param fds the fds, owned by the transport on success
+ * @param n_fds the number of fds
+ * @returns #FALSE if no memory or too many fds
+ */
+dbus_bool_t
+_dbus_transport_inject_incoming (DBusTransport    *transport,
+                                 const DBusString *bytes,
+                                 const int        *fds,
+                                 unsigned int      n_fds)
+{
+  DBusString *buffer;
+  dbus_bool_t ok;
+#ifdef HAVE_UNIX_FD_PASSING
+  int *loader_fds = NULL;
+  unsigned int max_n_fds;
+
+  if (n_fds > 0)
+    {
+      if (!_dbus_message_loader_get_unix_fds (transport->loader,
+                                              &loader_fds, &max_n_fds))
+        return FALSE;
+
+      if (n_fds > max_n_fds)
+        {
+          _dbus_message_loader_return_unix_fds (transport->loader,
+                                                loader_fds, 0);
+          return FALSE;
+        }
+    }
+#else
+  if (n_fds > 0)
+    return FALSE;
+#endif
+
+  _dbus_message_loader_get_buffer (transport->loader, &buffer);
+  ok = _dbus_string_copy (bytes, 0, buffer, _dbus_string_get_length (buffer));
+  _dbus_message_loader_return_buffer (transport->loader, buffer);
+
+#ifdef HAVE_UNIX_FD_PASSING
+  /* only take the fds once nothing else can fail */
+  if (n_fds > 0)
+    {
+      if (ok)
+        memcpy (loader_fds, fds, n_fds * sizeof (int));
+
+      _dbus_message_loader_return_unix_fds (transport->loader,
+                                            loader_fds, ok ? n_fds : 0);
+    }
+#endif
+
+  return ok;
+}
+
+/**
+ * Gives back slack in the transport's buffers. Only worth doing for
+ * a connection that has gone quiet.
+ *
+ * @param transport the transport
+ */
+void
+_dbus_transport_trim (DBusTransport *transport)
+{
+  _dbus_message_loader_trim (transport->loader);
+  _dbus_auth_trim (transport->auth);
+}
+
 #ifdef DBUS_ENABLE_STATS
+/**
+ * Gets the memory held by the transport's loader and auth
+ * conversation, not counting queued messages.
+ *
+ * @param transport the transport
+ * @returns size in bytes
+ */
+int
+_dbus_transport_get_allocated_size (DBusTransport *transport)
+{
+  return _dbus_message_loader_get_allocated_size (transport->loader) +
+    _dbus_auth_get_allocated_size (transport->auth);
+}
+
 void
 _dbus_transport_get_stats (DBusTransport  *transport,
                            dbus_uint32_t  *queue_bytes,
@@ -53,6 +53,7 @@ dbus_bool_t        _dbus_transport_set_connection         (DBusTransport
 void               _dbus_transport_do_iteration           (DBusTransport              *transport,
                                                            unsigned int                flags,
                                                            int                         timeout_milliseconds);
+void               _dbus_transport_outgoing_queued        (DBusTransport              *transport);
 DBusDispatchStatus _dbus_transport_get_dispatch_status    (DBusTransport              *transport);
 dbus_bool_t        _dbus_transport_queue_messages         (DBusTransport              *transport);
 
@@ -105,7 +106,23 @@ void               _dbus_transport_set_pending_fds_function (DBusTransport *tran
                                                              void (* callback) (void *),
                                                              void *data);
 
+dbus_bool_t        _dbus_transport_resume_authenticated   (DBusTransport              *transport,
+                                                           DBusCredentials            *identity,
+                                                           dbus_bool_t                 unix_fd_negotiated);
+DBusCredentials*   _dbus_transport_copy_identity          (DBusTransport              *transport);
+dbus_bool_t        _dbus_transport_get_unparsed_incoming  (DBusTransport              *transport,
+                                                           DBusString                 *bytes,
+                                                           const int                 **fds,
+                                                           unsigned int               *n_fds);
+dbus_bool_t        _dbus_transport_inject_incoming        (DBusTransport              *transport,
+                                                           const DBusString           *bytes,
+                                                           const int                  *fds,
+                                                           unsigned int                n_fds);
+
+void               _dbus_transport_trim                   (DBusTransport              *transport);
+
 /* if DBUS_ENABLE_STATS */
+int  _dbus_transport_get_allocated_size (DBusTransport *transport);
 void _dbus_transport_get_stats (DBusTransport  *transport,
                                 dbus_uint32_t  *queue_bytes,
                                 dbus_uint32_t  *queue_fds,
@@ -25,6 +25,7 @@
 #include "dbus-internals.h"
 #include "dbus-watch.h"
 #include "dbus-list.h"
+#include "dbus-mempool.h"
 
 /**
  * @defgroup DBusWatchInternals DBusWatch implementation details
@@ -72,6 +73,9 @@ _dbus_watch_set_oom_last_time (DBusWatch   *watch,
   watch->oom_last_time = oom;
 }
 
+static DBusSlab watch_slab =
+  _DBUS_SLAB_INIT (sizeof (DBusWatch), DBUS_MEM_TAG_CONNECTION);
+
 /**
  * Creates a new DBusWatch. Used to add a file descriptor to be polled
  * by a main loop.
@@ -98,7 +102,7 @@ _dbus_watch_new (DBusPollable      fd,
   
   _dbus_assert ((flags & VALID_WATCH_FLAGS) == flags);
   
-  watch = dbus_new0 (DBusWatch, 1);
+  watch = _dbus_slab_alloc (&watch_slab);
   if (watch == NULL)
     return NULL;
   
@@ -151,7 +155,7 @@ _dbus_watch_unref (DBusWatch *watch)
       if (watch->free_handler_data_function)
 	(* watch->free_handler_data_function) (watch->handler_data);
       
-      dbus_free (watch);
+      _dbus_slab_dealloc (&watch_slab, watch);
     }
 }
 
@@ -222,6 +226,9 @@ struct DBusWatchList
   DBusFreeFunction watch_free_data_function;  /**< Free function for watch callback data */
 };
 
+static DBusSlab watch_list_slab =
+  _DBUS_SLAB_INIT (sizeof (DBusWatchList), DBUS_MEM_TAG_CONNECTION);
+
 /**
  * Creates a new watch list. Returns #NULL if insufficient
  * memory exists.
@@ -233,7 +240,7 @@ _dbus_watch_list_new (void)
 {
   DBusWatchList *watch_list;
 
-  watch_list = dbus_new0 (DBusWatchList, 1);
+  watch_list = _dbus_slab_alloc (&watch_list_slab);
   if (watch_list == NULL)
     return NULL;
 
@@ -256,7 +263,7 @@ _dbus_watch_list_free (DBusWatchList *watch_list)
                       NULL);
   _dbus_list_clear (&watch_list->watches);
 
-  dbus_free (watch_list);
+  _dbus_slab_dealloc (&watch_list_slab, watch_list);
 }
 
 #ifdef DBUS_ENABLE_VERBOSE_MODE
@@ -370,6 +377,30 @@ _dbus_watch_list_set_functions (DBusWatchList           *watch_list,
   return TRUE;
 }
 
+/**
+ * Gets the functions and data set with
+ * _dbus_watch_list_set_functions(), so that the watches of another
+ * connection can be serviced by the same main loop.
+ *
+ * @param watch_list the watch list
+ * @param add_function return location for the add function
+ * @param remove_function return location for the remove function
+ * @param toggled_function return location for the toggled function
+ * @param data return location for the data
+ */
+void
+_dbus_watch_list_get_functions (DBusWatchList            *watch_list,
+                                DBusAddWatchFunction     *add_function,
+                                DBusRemoveWatchFunction  *remove_function,
+                                DBusWatchToggledFunction *toggled_function,
+                                void                    **data)
+{
+  *add_function = watch_list->add_watch_function;
+  *remove_function = watch_list->remove_watch_function;
+  *toggled_function = watch_list->watch_toggled_function;
+  *data = watch_list->watch_data;
+}
+
 /**
  * Adds a new watch to the watch list, invoking the
  * application DBusAddWatchFunction if appropriate.
@@ -430,6 +461,44 @@ _dbus_watch_list_remove_watch  (DBusWatchList *watch_list,
   _dbus_watch_unref (watch);
 }
 
+/**
+ * Checks whether a watch is currently in the watch list. The
+ * watch is only compared, never dereferenced, so it may already
+ * have been removed and freed.
+ *
+ * @param watch_list the watch list.
+ * @param watch the watch to look for.
+ * @returns #TRUE if the watch is in the list
+ */
+dbus_bool_t
+_dbus_watch_list_contains (DBusWatchList *watch_list,
+                           DBusWatch     *watch)
+{
+  DBusList *link;
+
+  for (link = _dbus_list_get_first_link (&watch_list->watches);
+       link != NULL;
+       link = _dbus_list_get_next_link (&watch_list->watches, link))
+    {
+      if (link->data == watch)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/**
+ * Gets the data that is passed to the watch list's callbacks.
+ *
+ * @param watch_list the watch list.
+ * @returns the data given to _dbus_watch_list_set_functions()
+ */
+void *
+_dbus_watch_list_get_data (DBusWatchList *watch_list)
+{
+  return watch_list->watch_data;
+}
+
 /**
  * Sets a watch to the given enabled state, invoking the
  * application's DBusWatchToggledFunction if appropriate.
@@ -76,12 +76,20 @@ dbus_bool_t    _dbus_watch_list_set_functions (DBusWatchList           *watch_li
                                                DBusWatchToggledFunction toggled_function,
                                                void                    *data,
                                                DBusFreeFunction         free_data_function);
+void           _dbus_watch_list_get_functions (DBusWatchList            *watch_list,
+                                               DBusAddWatchFunction     *add_function,
+                                               DBusRemoveWatchFunction  *remove_function,
+                                               DBusWatchToggledFunction *toggled_function,
+                                               void                    **data);
 DBUS_PRIVATE_EXPORT
 dbus_bool_t    _dbus_watch_list_add_watch     (DBusWatchList           *watch_list,
                                                DBusWatch               *watch);
 DBUS_PRIVATE_EXPORT
 void           _dbus_watch_list_remove_watch  (DBusWatchList           *watch_list,
                                                DBusWatch               *watch);
+dbus_bool_t    _dbus_watch_list_contains      (DBusWatchList           *watch_list,
+                                               DBusWatch               *watch);
+void          *_dbus_watch_list_get_data      (DBusWatchList           *watch_list);
 void           _dbus_watch_list_toggle_watch  (DBusWatchList           *watch_list,
                                                DBusWatch               *watch,
                                                dbus_bool_t              enabled);
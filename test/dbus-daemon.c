@@ -40,8 +40,12 @@
 #include <string.h>
 
 #ifdef DBUS_UNIX
+# include <signal.h>
 # include <unistd.h>
+# include <sys/socket.h>
 # include <sys/types.h>
+# include <sys/un.h>
+# include <sys/wait.h>
 #endif
 
 /* Platforms where we know that credentials-passing passes both the
@@ -84,9 +88,17 @@ typedef struct {
     DBusConnection *right_conn;
     gboolean right_conn_echo;
     gboolean wait_forever_called;
+    DBusMessage *held_call;
+    guint signals_received;
 
     gchar *tmp_runtime_dir;
     gchar *saved_runtime_dir;
+
+    /* standing in for systemd's $NOTIFY_SOCKET */
+    gchar *tmp_notify_dir;
+    gchar *notify_path;
+    int notify_fd;
+    GPid new_daemon_pid;
 } Fixture;
 
 static DBusHandlerResult
@@ -641,6 +653,202 @@ test_canonical_path_uae (Fixture *f,
   dbus_message_unref (m);
 }
 
+#ifdef DBUS_UNIX
+static DBusHandlerResult
+hold_filter (DBusConnection *connection,
+    DBusMessage *message,
+    void *user_data)
+{
+  Fixture *f = user_data;
+
+  /* keep the call unanswered until we choose to reply */
+  if (dbus_message_is_method_call (message, "com.example", "WaitForever"))
+    {
+      g_assert (f->held_call == NULL);
+      f->held_call = dbus_message_ref (message);
+      return DBUS_HANDLER_RESULT_HANDLED;
+    }
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+static DBusHandlerResult
+count_signal_filter (DBusConnection *connection,
+    DBusMessage *message,
+    void *user_data)
+{
+  Fixture *f = user_data;
+
+  if (dbus_message_is_signal (message, "com.example.Handoff", "Ping"))
+    f->signals_received++;
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+static void
+setup_handoff (Fixture *f,
+    gconstpointer context)
+{
+  struct sockaddr_un addr;
+
+  f->notify_fd = -1;
+  f->tmp_notify_dir = g_dir_make_tmp ("dbus-daemon-test.XXXXXX", &f->ge);
+  g_assert_no_error (f->ge);
+  f->notify_path = g_build_filename (f->tmp_notify_dir, "notify", NULL);
+  g_assert_cmpuint (strlen (f->notify_path), <, sizeof (addr.sun_path));
+
+  f->notify_fd = socket (AF_UNIX, SOCK_DGRAM, 0);
+  g_assert_cmpint (f->notify_fd, >=, 0);
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, f->notify_path);
+  g_assert_cmpint (bind (f->notify_fd, (struct sockaddr *) &addr,
+        sizeof (addr)), ==, 0);
+
+  /* inherited by the dbus-daemon, and by the instance replacing it */
+  g_setenv ("NOTIFY_SOCKET", f->notify_path, TRUE);
+  setup (f, context);
+  g_unsetenv ("NOTIFY_SOCKET");
+}
+
+static void
+test_handoff (Fixture *f,
+    gconstpointer context)
+{
+  const char *rule = "type='signal',interface='com.example.Handoff'";
+  const char *name = "com.example.Handoff";
+  const char *owner;
+  DBusMessage *m;
+  DBusMessage *owner_reply;
+  DBusMessage *reply = NULL;
+  DBusPendingCall *pc;
+  char buf[64];
+  gssize len;
+  pid_t pid;
+  int status;
+
+  if (f->skip)
+    return;
+
+  if (!dbus_connection_add_filter (f->right_conn, hold_filter, f, NULL) ||
+      !dbus_connection_add_filter (f->left_conn, count_signal_filter, f,
+        NULL))
+    g_error ("OOM");
+
+  /* State that has to survive the restart: a name owner, a match rule
+   * and a reply that the dbus-daemon is expecting */
+  g_assert_cmpint (dbus_bus_request_name (f->right_conn, name,
+        DBUS_NAME_FLAG_DO_NOT_QUEUE, &f->e), ==,
+      DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER);
+  test_assert_no_error (&f->e);
+
+  dbus_bus_add_match (f->left_conn, rule, &f->e);
+  test_assert_no_error (&f->e);
+
+  m = dbus_message_new_method_call (name, "/", "com.example", "WaitForever");
+
+  if (m == NULL)
+    g_error ("OOM");
+
+  if (!dbus_connection_send_with_reply (f->left_conn, m, &pc,
+                                        DBUS_TIMEOUT_INFINITE) ||
+      pc == NULL)
+    g_error ("OOM");
+
+  if (dbus_pending_call_get_completed (pc))
+    test_pending_call_store_reply (pc, &reply);
+  else if (!dbus_pending_call_set_notify (pc, test_pending_call_store_reply,
+        &reply, NULL))
+    g_error ("OOM");
+
+  dbus_pending_call_unref (pc);
+  dbus_message_unref (m);
+
+  while (f->held_call == NULL)
+    test_main_context_iterate (f->ctx, TRUE);
+
+  g_assert_cmpint (kill (f->daemon_pid, SIGUSR2), ==, 0);
+
+  /* Keep reading while we wait, so that the old instance can write out
+   * what it has queued for us before it hands over */
+  while ((pid = waitpid (f->daemon_pid, &status, WNOHANG)) == 0)
+    {
+      test_main_context_iterate (f->ctx, FALSE);
+      g_usleep (G_USEC_PER_SEC / 100);
+    }
+
+  g_assert_cmpint (pid, ==, f->daemon_pid);
+  g_assert (WIFEXITED (status));
+  g_assert_cmpint (WEXITSTATUS (status), ==, 0);
+  g_spawn_close_pid (f->daemon_pid);
+  f->daemon_pid = 0;
+
+  /* The old instance told the service manager who took over before
+   * exiting */
+  len = recv (f->notify_fd, buf, sizeof (buf) - 1, MSG_DONTWAIT);
+  g_assert_cmpint (len, >, 0);
+  buf[len] = '\0';
+  g_test_message ("notification: %s", buf);
+  g_assert (g_str_has_prefix (buf, "MAINPID="));
+  f->new_daemon_pid = g_ascii_strtoull (buf + strlen ("MAINPID="), NULL, 10);
+  g_assert_cmpint (f->new_daemon_pid, >, 0);
+  g_assert_cmpint (f->new_daemon_pid, !=, pid);
+  g_assert_cmpint (kill (f->new_daemon_pid, 0), ==, 0);
+
+  /* The name still belongs to the same unique name */
+  m = dbus_message_new_method_call (DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+      DBUS_INTERFACE_DBUS, "GetNameOwner");
+
+  if (m == NULL ||
+      !dbus_message_append_args (m,
+        DBUS_TYPE_STRING, &name,
+        DBUS_TYPE_INVALID))
+    g_error ("OOM");
+
+  owner_reply = dbus_connection_send_with_reply_and_block (f->left_conn, m,
+      -1, &f->e);
+  test_assert_no_error (&f->e);
+  dbus_message_unref (m);
+
+  dbus_message_get_args (owner_reply, &f->e,
+      DBUS_TYPE_STRING, &owner,
+      DBUS_TYPE_INVALID);
+  test_assert_no_error (&f->e);
+  g_assert_cmpstr (owner, ==, dbus_bus_get_unique_name (f->right_conn));
+  dbus_message_unref (owner_reply);
+
+  /* The match rule still routes broadcasts to us */
+  m = dbus_message_new_signal ("/", "com.example.Handoff", "Ping");
+
+  if (m == NULL || !dbus_connection_send (f->right_conn, m, NULL))
+    g_error ("OOM");
+
+  dbus_message_unref (m);
+
+  while (f->signals_received == 0)
+    test_main_context_iterate (f->ctx, TRUE);
+
+  /* The new instance still lets the reply through, and to the caller */
+  m = dbus_message_new_method_return (f->held_call);
+
+  if (m == NULL || !dbus_connection_send (f->right_conn, m, NULL))
+    g_error ("OOM");
+
+  dbus_message_unref (m);
+  dbus_message_unref (f->held_call);
+  f->held_call = NULL;
+
+  while (reply == NULL)
+    test_main_context_iterate (f->ctx, TRUE);
+
+  g_assert_cmpstr (
+      dbus_message_type_to_string (dbus_message_get_type (reply)), ==,
+      dbus_message_type_to_string (DBUS_MESSAGE_TYPE_METHOD_RETURN));
+  dbus_message_unref (reply);
+}
+#endif
+
 static void
 teardown (Fixture *f,
     gconstpointer context G_GNUC_UNUSED)
@@ -698,6 +906,34 @@ teardown (Fixture *f,
   test_main_context_unref (f->ctx);
 }
 
+#ifdef DBUS_UNIX
+static void
+teardown_handoff (Fixture *f,
+    gconstpointer context)
+{
+  if (f->held_call != NULL)
+    dbus_message_unref (f->held_call);
+
+  teardown (f, context);
+
+  /* the replacement is not our child, so all we can do is kill it */
+  if (f->new_daemon_pid > 0)
+    kill (f->new_daemon_pid, SIGTERM);
+
+  if (f->notify_fd >= 0)
+    close (f->notify_fd);
+
+  if (f->notify_path != NULL)
+    {
+      g_assert (g_remove (f->notify_path) == 0 || errno == ENOENT);
+      g_assert_cmpint (g_rmdir (f->tmp_notify_dir), ==, 0);
+    }
+
+  g_free (f->notify_path);
+  g_free (f->tmp_notify_dir);
+}
+#endif
+
 static Config limited_config = {
     "34393", 10000, "valid-config-files/incoming-limit.conf",
     SPECIFY_ADDRESS
@@ -738,6 +974,8 @@ main (int argc,
    * and that blocks on a round-trip to the dbus-daemon */
   g_test_add ("/unix-runtime-is-default", Fixture, &listen_unix_runtime_config,
       setup, test_echo, teardown);
+  g_test_add ("/handoff", Fixture, NULL,
+      setup_handoff, test_handoff, teardown_handoff);
 #endif
 
   return g_test_run ();
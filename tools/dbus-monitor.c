@@ -23,6 +23,8 @@
 
 #include "dbus/dbus-internals.h"        /* just for the macros */
 
+#include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -36,6 +38,8 @@
 
 #include <time.h>
 
+#include "dbus/dbus-sysdeps.h"          /* for the monotonic clock */
+
 #include "dbus-print-message.h"
 #include "tool-common.h"
 
@@ -48,6 +52,24 @@
 /* http://www.tcpdump.org/linktypes.html */
 #define LINKTYPE_DBUS 231
 
+/* https://github.com/pcapng/pcapng */
+#define PCAPNG_SECTION_HEADER_BLOCK       0x0A0D0D0AU
+#define PCAPNG_INTERFACE_DESCRIPTION_BLOCK 1
+#define PCAPNG_ENHANCED_PACKET_BLOCK      6
+#define PCAPNG_BYTE_ORDER_MAGIC           0x1A2B3C4DU
+#define PCAPNG_OPTION_IF_TSRESOL          9
+
+/* D-Bus spec says so */
+#define MAX_CAPTURE_LENGTH (1 << 27)
+
+/* Output written to a file is buffered this much unless --buffer-size
+ * says otherwise; output to stdout is not buffered by default, so
+ * that whatever reads it sees each message as it comes */
+#define DEFAULT_FILE_BUFFER_SIZE (1024 * 1024)
+
+/* Buffered output is written out at least this often */
+#define FLUSH_INTERVAL_SECONDS 1
+
 static DBusHandlerResult
 monitor_filter_func (DBusConnection     *connection,
                      DBusMessage        *message,
@@ -196,17 +218,307 @@ profile_filter_func (DBusConnection     *connection,
 typedef enum {
     BINARY_MODE_NOT,
     BINARY_MODE_RAW,
-    BINARY_MODE_PCAP
+    BINARY_MODE_PCAP,
+    BINARY_MODE_PCAPNG
 } BinaryMode;
 
+typedef struct
+{
+  BinaryMode mode;
+  const char *filename;         /* NULL for stdout */
+  FILE *file;                   /* NULL for stdout */
+  int fd;
+  unsigned int n_files;         /* files opened so far */
+  char *buffer;
+  size_t buffer_size;           /* 0 to write each message out at once */
+  size_t buffered;
+  unsigned long rotate_size;    /* bytes per file, 0 for no limit */
+  long rotate_interval;         /* seconds per file, 0 for no limit */
+  unsigned long file_size;      /* bytes in this file, buffered or not */
+  unsigned long file_messages;
+  long file_opened;
+  long last_flush;
+} Output;
+
+static Output output = { BINARY_MODE_NOT, NULL, NULL, STDOUT_FILENO };
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void
+interrupt_handler (int signum)
+{
+  interrupted = 1;
+}
+
+static long
+monotonic_seconds (void)
+{
+  long sec;
+
+  _dbus_get_monotonic_time (&sec, NULL);
+  return sec;
+}
+
+static void
+get_real_time_ns (long *tv_sec,
+                  long *tv_nsec)
+{
+#if defined(DBUS_UNIX) && defined(CLOCK_REALTIME)
+  struct timespec ts;
+
+  clock_gettime (CLOCK_REALTIME, &ts);
+  *tv_sec = ts.tv_sec;
+  *tv_nsec = ts.tv_nsec;
+#else
+  long tv_usec;
+
+  _dbus_get_real_time (tv_sec, &tv_usec);
+  *tv_nsec = tv_usec * 1000;
+#endif
+}
+
+static void
+output_flush (void)
+{
+  if (output.buffered > 0 &&
+      !tool_write_all (output.fd, output.buffer, output.buffered))
+    {
+      perror ("dbus-monitor: write");
+      exit (1);
+    }
+
+  output.buffered = 0;
+  output.last_flush = monotonic_seconds ();
+}
+
+static void
+output_write (const void *data,
+              size_t      len)
+{
+  output.file_size += len;
+
+  if (output.buffered + len > output.buffer_size)
+    output_flush ();
+
+  if (len >= output.buffer_size)
+    {
+      if (!tool_write_all (output.fd, data, len))
+        {
+          perror ("dbus-monitor: write");
+          exit (1);
+        }
+
+      return;
+    }
+
+  memcpy (output.buffer + output.buffered, data, len);
+  output.buffered += len;
+}
+
+/* pcapng wants every block padded to a multiple of 4 bytes */
+static void
+output_write_padding (size_t len)
+{
+  static const char zeroes[4] = { 0 };
+
+  if (len % 4 != 0)
+    output_write (zeroes, 4 - len % 4);
+}
+
+static void
+output_write_file_header (void)
+{
+  switch (output.mode)
+    {
+      case BINARY_MODE_NOT:
+      case BINARY_MODE_RAW:
+        break;
+
+      case BINARY_MODE_PCAP:
+          {
+            /* We're not using libpcap because the file format is simple
+             * enough not to need it.
+             * http://wiki.wireshark.org/Development/LibpcapFileFormat */
+            struct {
+                dbus_uint32_t magic;
+                dbus_uint16_t major_version;
+                dbus_uint16_t minor_version;
+                dbus_int32_t timezone;
+                dbus_uint32_t precision;
+                dbus_uint32_t max_length;
+                dbus_uint32_t link_type;
+            } header = {
+                0xA1B2C3D4U,  /* magic number */
+                2, 4,         /* v2.4 */
+                0,            /* capture in GMT */
+                0,            /* no opinion on timestamp precision */
+                MAX_CAPTURE_LENGTH,
+                LINKTYPE_DBUS
+            };
+
+            /* Assert that there is no padding */
+            _DBUS_STATIC_ASSERT (sizeof (header) == 24);
+
+            output_write (&header, sizeof (header));
+          }
+        break;
+
+      case BINARY_MODE_PCAPNG:
+          {
+            /* Written in our own byte order, which the byte-order magic
+             * tells readers about. One section per file, with a single
+             * interface whose timestamps are in nanoseconds. */
+            struct {
+                dbus_uint32_t block_type;
+                dbus_uint32_t block_length;
+                dbus_uint32_t byte_order_magic;
+                dbus_uint16_t major_version;
+                dbus_uint16_t minor_version;
+                dbus_uint32_t section_length[2];
+                dbus_uint32_t block_length_again;
+            } section = {
+                PCAPNG_SECTION_HEADER_BLOCK,
+                28,
+                PCAPNG_BYTE_ORDER_MAGIC,
+                1, 0,
+                { 0xFFFFFFFFU, 0xFFFFFFFFU },   /* length not known */
+                28
+            };
+            struct {
+                dbus_uint32_t block_type;
+                dbus_uint32_t block_length;
+                dbus_uint16_t link_type;
+                dbus_uint16_t reserved;
+                dbus_uint32_t snap_length;
+                dbus_uint16_t tsresol_code;
+                dbus_uint16_t tsresol_length;
+                unsigned char tsresol[4];       /* 1 byte, padded */
+                dbus_uint32_t end_of_options;
+                dbus_uint32_t block_length_again;
+            } interface = {
+                PCAPNG_INTERFACE_DESCRIPTION_BLOCK,
+                32,
+                LINKTYPE_DBUS,
+                0,
+                MAX_CAPTURE_LENGTH,
+                PCAPNG_OPTION_IF_TSRESOL, 1,
+                { 9, 0, 0, 0 },                 /* 10^-9 seconds */
+                0,
+                32
+            };
+
+            _DBUS_STATIC_ASSERT (sizeof (section) == 28);
+            _DBUS_STATIC_ASSERT (sizeof (interface) == 32);
+
+            output_write (&section, sizeof (section));
+            output_write (&interface, sizeof (interface));
+          }
+        break;
+    }
+}
+
+static void
+output_open (void)
+{
+  output.file_size = 0;
+  output.file_messages = 0;
+  output.file_opened = monotonic_seconds ();
+  output.last_flush = output.file_opened;
+
+  if (output.filename != NULL)
+    {
+      char *name;
+      size_t len = strlen (output.filename) + 16;
+
+      name = malloc (len);
+
+      if (name == NULL)
+        tool_oom ("naming output file");
+
+      /* with rotation, the files are numbered in order */
+      if (output.rotate_size > 0 || output.rotate_interval > 0)
+        snprintf (name, len, "%s.%06u", output.filename, output.n_files);
+      else
+        snprintf (name, len, "%s", output.filename);
+
+      output.file = fopen (name, "wb");
+
+      if (output.file == NULL)
+        {
+          fprintf (stderr, "dbus-monitor: unable to open %s: %s\n", name,
+                   strerror (errno));
+          exit (1);
+        }
+
+      output.fd = fileno (output.file);
+      free (name);
+    }
+
+  output.n_files++;
+  output_write_file_header ();
+}
+
+static void
+output_close (void)
+{
+  output_flush ();
+
+  if (output.file != NULL)
+    {
+      if (fclose (output.file) != 0)
+        {
+          perror ("dbus-monitor: close");
+          exit (1);
+        }
+
+      output.file = NULL;
+    }
+}
+
+/* Moves on to a new file if this one is full, but never leaves one
+ * without any messages in it */
+static void
+output_maybe_rotate (size_t next_record)
+{
+  if (output.filename == NULL || output.file_messages == 0)
+    return;
+
+  if ((output.rotate_size > 0 &&
+       output.file_size + next_record > output.rotate_size) ||
+      (output.rotate_interval > 0 &&
+       monotonic_seconds () - output.file_opened >= output.rotate_interval))
+    {
+      output_close ();
+      output_open ();
+    }
+}
+
+/* Called whenever the main loop wakes up, whether or not there was a
+ * message */
+static void
+output_tick (void)
+{
+  if (interrupted)
+    {
+      output_close ();
+      exit (0);
+    }
+
+  if (output.buffered > 0 &&
+      monotonic_seconds () - output.last_flush >= FLUSH_INTERVAL_SECONDS)
+    output_flush ();
+
+  output_maybe_rotate (0);
+}
+
 static DBusHandlerResult
 binary_filter_func (DBusConnection *connection,
                     DBusMessage    *message,
                     void           *user_data)
 {
-  BinaryMode mode = _DBUS_POINTER_TO_INT (user_data);
   char *blob;
   int len;
+  dbus_uint32_t block_length = 0;
 
   /* It would be nice if we could do a zero-copy "peek" one day, but libdbus
    * is so copy-happy that this isn't really a big deal.
@@ -214,7 +526,7 @@ binary_filter_func (DBusConnection *connection,
   if (!dbus_message_marshal (message, &blob, &len))
     tool_oom ("retrieving message");
 
-  switch (mode)
+  switch (output.mode)
     {
       case BINARY_MODE_PCAP:
           {
@@ -228,44 +540,121 @@ binary_filter_func (DBusConnection *connection,
             /* If this gets padded then we'd need to write it out in pieces */
             _DBUS_STATIC_ASSERT (sizeof (header) == 16);
 
+            output_maybe_rotate (sizeof (header) + len);
+
             _dbus_get_real_time (&tv_sec, &tv_usec);
             header[0] = tv_sec;
             header[1] = tv_usec;
 
-            if (!tool_write_all (STDOUT_FILENO, header, sizeof (header)))
-              {
-                perror ("dbus-monitor: write");
-                exit (1);
-              }
+            output_write (header, sizeof (header));
+          }
+        break;
+
+      case BINARY_MODE_PCAPNG:
+          {
+            long tv_sec, tv_nsec;
+            dbus_uint64_t timestamp;
+            /* block type, block length, interface, timestamp (high and
+             * low halves), bytes captured, original length; the message
+             * and padding follow, then the block length again */
+            dbus_uint32_t header[7];
+
+            _DBUS_STATIC_ASSERT (sizeof (header) == 28);
+
+            block_length = sizeof (header) + ((len + 3) & ~3) + 4;
+            output_maybe_rotate (block_length);
+
+            get_real_time_ns (&tv_sec, &tv_nsec);
+            timestamp = ((dbus_uint64_t) tv_sec) * 1000000000 + tv_nsec;
+
+            header[0] = PCAPNG_ENHANCED_PACKET_BLOCK;
+            header[1] = block_length;
+            header[2] = 0;
+            header[3] = (dbus_uint32_t) (timestamp >> 32);
+            header[4] = (dbus_uint32_t) timestamp;
+            header[5] = len;
+            header[6] = len;
+
+            output_write (header, sizeof (header));
           }
         break;
 
       case BINARY_MODE_RAW:
       default:
         /* nothing special, just the raw message stream */
+        output_maybe_rotate (len);
         break;
     }
 
-  if (!tool_write_all (STDOUT_FILENO, blob, len))
+  output_write (blob, len);
+
+  if (output.mode == BINARY_MODE_PCAPNG)
     {
-      perror ("dbus-monitor: write");
-      exit (1);
+      output_write_padding (len);
+      output_write (&block_length, sizeof (block_length));
     }
 
+  output.file_messages++;
+
   dbus_free (blob);
 
   if (dbus_message_is_signal (message,
                               DBUS_INTERFACE_LOCAL,
                               "Disconnected"))
-    exit (0);
+    {
+      output_close ();
+      exit (0);
+    }
 
   return DBUS_HANDLER_RESULT_HANDLED;
 }
 
+/* A non-negative decimal number, optionally followed by k, M or G */
+static dbus_bool_t
+parse_size (const char *arg,
+            long       *value)
+{
+  char *end;
+  long n;
+
+  errno = 0;
+  n = strtol (arg, &end, 10);
+
+  if (errno != 0 || end == arg || n < 0)
+    return FALSE;
+
+  switch (*end)
+    {
+      case 'k':
+        n *= 1024;
+        end++;
+        break;
+
+      case 'M':
+        n *= 1024 * 1024;
+        end++;
+        break;
+
+      case 'G':
+        n *= 1024 * 1024 * 1024;
+        end++;
+        break;
+
+      default:
+        break;
+    }
+
+  if (*end != '\0')
+    return FALSE;
+
+  *value = n;
+  return TRUE;
+}
+
 static void
 usage (char *name, int ecode)
 {
-  fprintf (stderr, "Usage: %s [--system | --session | --address ADDRESS] [--monitor | --profile | --pcap | --binary ] [watch expressions]\n", name);
+  fprintf (stderr, "Usage: %s [--system | --session | --address ADDRESS] [--monitor | --profile | --pcap | --pcapng | --binary ] [--output FILE] [--buffer-size BYTES] [--rotate-size BYTES] [--rotate-interval SECONDS] [watch expressions]\n", name);
   exit (ecode);
 }
 
@@ -354,6 +743,7 @@ main (int argc, char *argv[])
   char *address = NULL;
   dbus_bool_t seen_bus_type = FALSE;
   BinaryMode binary_mode = BINARY_MODE_NOT;
+  long buffer_size = -1;
   int i = 0, j = 0, numFilters = 0;
   char **filters = NULL;
 
@@ -416,6 +806,52 @@ main (int argc, char *argv[])
           filter_func = binary_filter_func;
           binary_mode = BINARY_MODE_PCAP;
         }
+      else if (!strcmp (arg, "--pcapng"))
+        {
+          filter_func = binary_filter_func;
+          binary_mode = BINARY_MODE_PCAPNG;
+        }
+      else if (!strcmp (arg, "--output"))
+        {
+          if (i+1 < argc)
+            {
+              output.filename = argv[i+1];
+              i++;
+            }
+          else
+            usage (argv[0], 1);
+        }
+      else if (!strcmp (arg, "--buffer-size"))
+        {
+          if (i+1 < argc && parse_size (argv[i+1], &buffer_size))
+            i++;
+          else
+            usage (argv[0], 1);
+        }
+      else if (!strcmp (arg, "--rotate-size"))
+        {
+          long size;
+
+          if (i+1 < argc && parse_size (argv[i+1], &size) && size > 0)
+            {
+              output.rotate_size = size;
+              i++;
+            }
+          else
+            usage (argv[0], 1);
+        }
+      else if (!strcmp (arg, "--rotate-interval"))
+        {
+          long seconds;
+
+          if (i+1 < argc && parse_size (argv[i+1], &seconds) && seconds > 0)
+            {
+              output.rotate_interval = seconds;
+              i++;
+            }
+          else
+            usage (argv[0], 1);
+        }
       else if (!strcmp (arg, "--"))
         continue;
       else if (arg[0] == '-')
@@ -439,6 +875,22 @@ main (int argc, char *argv[])
       }
     }
 
+  if (binary_mode == BINARY_MODE_NOT &&
+      (output.filename != NULL || buffer_size >= 0 ||
+       output.rotate_size > 0 || output.rotate_interval > 0))
+    {
+      fprintf (stderr, "dbus-monitor: --output, --buffer-size and rotation "
+               "need --pcap, --pcapng or --binary\n");
+      usage (argv[0], 1);
+    }
+
+  if (output.filename == NULL &&
+      (output.rotate_size > 0 || output.rotate_interval > 0))
+    {
+      fprintf (stderr, "dbus-monitor: rotation needs --output\n");
+      usage (argv[0], 1);
+    }
+
   dbus_error_init (&error);
   
   if (address != NULL)
@@ -488,8 +940,7 @@ main (int argc, char *argv[])
    * a monitor */
   dbus_connection_set_route_peer_messages (connection, TRUE);
 
-  if (!dbus_connection_add_filter (connection, filter_func,
-                                   _DBUS_INT_TO_POINTER (binary_mode), NULL))
+  if (!dbus_connection_add_filter (connection, filter_func, NULL, NULL))
     {
       fprintf (stderr, "Couldn't add filter!\n");
       exit (1);
@@ -543,48 +994,42 @@ main (int argc, char *argv[])
         }
     }
 
-  switch (binary_mode)
+  if (binary_mode == BINARY_MODE_NOT)
     {
-      case BINARY_MODE_NOT:
-      case BINARY_MODE_RAW:
-        break;
+      while (dbus_connection_read_write_dispatch(connection, -1))
+        ;
+      exit (0);
+    }
 
-      case BINARY_MODE_PCAP:
-          {
-            /* We're not using libpcap because the file format is simple
-             * enough not to need it.
-             * http://wiki.wireshark.org/Development/LibpcapFileFormat */
-            struct {
-                dbus_uint32_t magic;
-                dbus_uint16_t major_version;
-                dbus_uint16_t minor_version;
-                dbus_int32_t timezone;
-                dbus_uint32_t precision;
-                dbus_uint32_t max_length;
-                dbus_uint32_t link_type;
-            } header = {
-                0xA1B2C3D4U,  /* magic number */
-                2, 4,         /* v2.4 */
-                0,            /* capture in GMT */
-                0,            /* no opinion on timestamp precision */
-                (1 << 27),    /* D-Bus spec says so */
-                LINKTYPE_DBUS
-            };
+  output.mode = binary_mode;
 
-            /* Assert that there is no padding */
-            _DBUS_STATIC_ASSERT (sizeof (header) == 24);
+  if (buffer_size < 0)
+    buffer_size = (output.filename != NULL ? DEFAULT_FILE_BUFFER_SIZE : 0);
 
-            if (!tool_write_all (STDOUT_FILENO, &header, sizeof (header)))
-              {
-                perror ("dbus-monitor: write");
-                exit (1);
-              }
-          }
-        break;
+  output.buffer_size = buffer_size;
+
+  if (output.buffer_size > 0)
+    {
+      output.buffer = malloc (output.buffer_size);
+
+      if (output.buffer == NULL)
+        tool_oom ("allocating output buffer");
+
+      /* let whatever is buffered be written out first */
+      signal (SIGINT, interrupt_handler);
+      signal (SIGTERM, interrupt_handler);
     }
 
-  while (dbus_connection_read_write_dispatch(connection, -1))
-    ;
+  output_open ();
+
+  /* Wake up now and then, to write out what has been buffered for a
+   * while and to rotate on time even if nothing is happening */
+  while (dbus_connection_read_write_dispatch (connection,
+      (output.buffer_size > 0 || output.rotate_interval > 0) ?
+      FLUSH_INTERVAL_SECONDS * 1000 : -1))
+    output_tick ();
+
+  output_close ();
   exit (0);
  lose:
   fprintf (stderr, "Error: %s\n", error.message);
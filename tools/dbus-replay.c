@@ -0,0 +1,910 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-replay.c - replay a capture from dbus-monitor against a bus
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dbus/dbus.h>
+#include "dbus/dbus-internals.h"
+#include "dbus/dbus-hash.h"
+#include "dbus/dbus-sysdeps.h"
+
+#include "test-tool.h"
+#include "tool-common.h"
+
+/* http://www.tcpdump.org/linktypes.html */
+#define LINKTYPE_DBUS 231
+
+/* https://github.com/pcapng/pcapng */
+#define PCAPNG_SECTION_HEADER_BLOCK       0x0A0D0D0AU
+#define PCAPNG_INTERFACE_DESCRIPTION_BLOCK 1
+#define PCAPNG_ENHANCED_PACKET_BLOCK      6
+#define PCAPNG_BYTE_ORDER_MAGIC           0x1A2B3C4DU
+#define PCAPNG_OPTION_END                 0
+#define PCAPNG_OPTION_IF_TSRESOL          9
+
+#define MAX_INTERFACES 64
+
+/* Connections are serviced at least this often while sending as fast
+ * as possible */
+#define MESSAGES_PER_PUMP 64
+
+/* How long a reply waits for the call it answers to arrive */
+#define CALL_TIMEOUT_NS 1000000000
+
+static void
+usage (int ecode)
+{
+  fprintf (stderr,
+           "Usage: dbus-test-tool replay [OPTIONS] FILE...\n"
+           "\n"
+           "Replay messages captured with dbus-monitor --pcap or --pcapng,\n"
+           "with one connection standing in for each client that sent\n"
+           "them. Messages from the bus itself are not replayed.\n"
+           "\n"
+           "Options:\n"
+           "\n"
+           "    --session     use the session bus (default)\n"
+           "    --system      use the system bus\n"
+           "    --address=ADDRESS   use the bus at ADDRESS\n"
+           "\n"
+           "    --rate=R      replay R times as fast as captured (default 1);\n"
+           "                  0 sends everything as fast as possible\n"
+           "\n"
+           );
+  exit (ecode);
+}
+
+/* ---------------------------------------------------------------- */
+/* Reading captures */
+
+typedef enum
+{
+  CAPTURE_PCAP,
+  CAPTURE_PCAPNG
+} CaptureFormat;
+
+typedef struct
+{
+  const char *filename;
+  FILE *file;
+  CaptureFormat format;
+  dbus_bool_t swapped;          /* written in the other byte order */
+  /* pcap */
+  dbus_uint32_t ns_per_unit;
+  /* pcapng, per interface in this section */
+  int n_interfaces;
+  dbus_bool_t is_dbus[MAX_INTERFACES];
+  unsigned char tsresol[MAX_INTERFACES];
+  unsigned char *data;
+  size_t allocated;
+} CaptureReader;
+
+static void
+capture_fail (CaptureReader *reader,
+              const char    *what)
+{
+  fprintf (stderr, "dbus-test-tool replay: %s: %s\n", reader->filename,
+           what);
+  exit (1);
+}
+
+static dbus_uint32_t
+capture_u32 (CaptureReader       *reader,
+             const unsigned char *p)
+{
+  dbus_uint32_t v;
+
+  memcpy (&v, p, 4);
+
+  if (reader->swapped)
+    v = ((v & 0xFFU) << 24) | ((v & 0xFF00U) << 8) |
+        ((v >> 8) & 0xFF00U) | (v >> 24);
+
+  return v;
+}
+
+static dbus_uint16_t
+capture_u16 (CaptureReader       *reader,
+             const unsigned char *p)
+{
+  dbus_uint16_t v;
+
+  memcpy (&v, p, 2);
+
+  if (reader->swapped)
+    v = (dbus_uint16_t) ((v << 8) | (v >> 8));
+
+  return v;
+}
+
+/* Returns FALSE at the end of the file, but not in the middle of what
+ * should be there */
+static dbus_bool_t
+capture_read (CaptureReader *reader,
+              void          *buf,
+              size_t         len,
+              dbus_bool_t    eof_ok)
+{
+  size_t n = fread (buf, 1, len, reader->file);
+
+  if (n == len)
+    return TRUE;
+
+  if (ferror (reader->file))
+    capture_fail (reader, strerror (errno));
+
+  if (n == 0 && eof_ok)
+    return FALSE;
+
+  capture_fail (reader, "truncated");
+  return FALSE;
+}
+
+static unsigned char *
+capture_ensure (CaptureReader *reader,
+                size_t         len)
+{
+  if (len > reader->allocated)
+    {
+      unsigned char *data = realloc (reader->data, len);
+
+      if (data == NULL)
+        tool_oom ("reading capture");
+
+      reader->data = data;
+      reader->allocated = len;
+    }
+
+  return reader->data;
+}
+
+static void
+capture_open (CaptureReader *reader,
+              const char    *filename)
+{
+  unsigned char magic[4];
+  dbus_uint32_t m;
+
+  memset (reader, 0, sizeof (*reader));
+  reader->filename = filename;
+  reader->file = fopen (filename, "rb");
+
+  if (reader->file == NULL)
+    capture_fail (reader, strerror (errno));
+
+  /* captures are read in large chunks, like they are written */
+  setvbuf (reader->file, NULL, _IOFBF, 1024 * 1024);
+
+  capture_read (reader, magic, sizeof (magic), FALSE);
+  memcpy (&m, magic, 4);
+
+  if (m == PCAPNG_SECTION_HEADER_BLOCK)
+    {
+      /* the section header block is read with the blocks */
+      reader->format = CAPTURE_PCAPNG;
+      rewind (reader->file);
+      return;
+    }
+
+  reader->format = CAPTURE_PCAP;
+
+  switch (m)
+    {
+      case 0xA1B2C3D4U:
+        reader->ns_per_unit = 1000;
+        break;
+
+      case 0xD4C3B2A1U:
+        reader->ns_per_unit = 1000;
+        reader->swapped = TRUE;
+        break;
+
+      case 0xA1B23C4DU:
+        reader->ns_per_unit = 1;
+        break;
+
+      case 0x4D3CB2A1U:
+        reader->ns_per_unit = 1;
+        reader->swapped = TRUE;
+        break;
+
+      default:
+        capture_fail (reader, "not a pcap or pcapng capture");
+    }
+
+    {
+      unsigned char header[20];
+
+      capture_read (reader, header, sizeof (header), FALSE);
+
+      if (capture_u32 (reader, header + 16) != LINKTYPE_DBUS)
+        capture_fail (reader, "not a capture of D-Bus messages");
+    }
+}
+
+static dbus_uint64_t
+pcapng_timestamp_ns (dbus_uint64_t ts,
+                     unsigned char tsresol)
+{
+  unsigned int exponent = tsresol & 0x7F;
+
+  if (tsresol & 0x80)
+    {
+      /* units of 2^-exponent seconds */
+      dbus_uint64_t mask;
+
+      if (exponent >= 64)
+        return 0;
+
+      mask = (((dbus_uint64_t) 1) << exponent) - 1;
+      return (ts >> exponent) * 1000000000 +
+             ((ts & mask) * 1000000000 >> exponent);
+    }
+
+  while (exponent < 9)
+    {
+      ts *= 10;
+      exponent++;
+    }
+
+  while (exponent > 9)
+    {
+      ts /= 10;
+      exponent--;
+    }
+
+  return ts;
+}
+
+static void
+pcapng_read_interface (CaptureReader       *reader,
+                       const unsigned char *body,
+                       size_t               len)
+{
+  size_t pos = 8;
+  int i = reader->n_interfaces;
+
+  if (len < 8)
+    capture_fail (reader, "interface description block too short");
+
+  if (i >= MAX_INTERFACES)
+    capture_fail (reader, "too many interfaces");
+
+  reader->is_dbus[i] = (capture_u16 (reader, body) == LINKTYPE_DBUS);
+  reader->tsresol[i] = 6;     /* microseconds unless it says otherwise */
+  reader->n_interfaces++;
+
+  while (pos + 4 <= len)
+    {
+      dbus_uint16_t code = capture_u16 (reader, body + pos);
+      dbus_uint16_t opt_len = capture_u16 (reader, body + pos + 2);
+
+      if (code == PCAPNG_OPTION_END)
+        break;
+
+      if (pos + 4 + opt_len > len)
+        capture_fail (reader, "bad interface option");
+
+      if (code == PCAPNG_OPTION_IF_TSRESOL && opt_len == 1)
+        reader->tsresol[i] = body[pos + 4];
+
+      pos += 4 + ((opt_len + 3) & ~3);
+    }
+}
+
+/* Gets the next D-Bus message, or returns FALSE at the end of the file */
+static dbus_bool_t
+capture_next (CaptureReader        *reader,
+              dbus_uint64_t        *timestamp_ns,
+              const unsigned char **data,
+              size_t               *len)
+{
+  unsigned char header[16];
+
+  if (reader->format == CAPTURE_PCAP)
+    {
+      dbus_uint32_t captured, original;
+
+      if (!capture_read (reader, header, sizeof (header), TRUE))
+        return FALSE;
+
+      captured = capture_u32 (reader, header + 8);
+      original = capture_u32 (reader, header + 12);
+
+      if (captured != original)
+        capture_fail (reader, "message was truncated when captured");
+
+      *timestamp_ns =
+        ((dbus_uint64_t) capture_u32 (reader, header)) * 1000000000 +
+        ((dbus_uint64_t) capture_u32 (reader, header + 4)) *
+        reader->ns_per_unit;
+      *data = capture_ensure (reader, captured);
+      *len = captured;
+      capture_read (reader, reader->data, captured, FALSE);
+      return TRUE;
+    }
+
+  while (TRUE)
+    {
+      dbus_uint32_t type, block_length;
+      unsigned char *body;
+      size_t body_length;
+
+      if (!capture_read (reader, header, 8, TRUE))
+        return FALSE;
+
+      memcpy (&type, header, 4);
+
+      if (type == PCAPNG_SECTION_HEADER_BLOCK)
+        {
+          dbus_uint32_t magic;
+
+          /* each section says which byte order it is in */
+          capture_read (reader, header + 8, 4, FALSE);
+          memcpy (&magic, header + 8, 4);
+
+          if (magic == PCAPNG_BYTE_ORDER_MAGIC)
+            reader->swapped = FALSE;
+          else if (magic == 0x4D3C2B1AU)
+            reader->swapped = TRUE;
+          else
+            capture_fail (reader, "bad byte-order magic");
+
+          reader->n_interfaces = 0;
+          block_length = capture_u32 (reader, header + 4);
+
+          if (block_length < 28 || block_length % 4 != 0)
+            capture_fail (reader, "bad section header block");
+
+          capture_ensure (reader, block_length);
+          capture_read (reader, reader->data, block_length - 12, FALSE);
+          continue;
+        }
+
+      type = capture_u32 (reader, header);
+      block_length = capture_u32 (reader, header + 4);
+
+      if (block_length < 12 || block_length % 4 != 0)
+        capture_fail (reader, "bad block length");
+
+      body_length = block_length - 12;
+      body = capture_ensure (reader, body_length + 4);
+      capture_read (reader, body, body_length + 4, FALSE);
+
+      if (type == PCAPNG_INTERFACE_DESCRIPTION_BLOCK)
+        {
+          pcapng_read_interface (reader, body, body_length);
+        }
+      else if (type == PCAPNG_ENHANCED_PACKET_BLOCK)
+        {
+          dbus_uint32_t interface, captured, original;
+          dbus_uint64_t ts;
+
+          if (body_length < 20)
+            capture_fail (reader, "enhanced packet block too short");
+
+          interface = capture_u32 (reader, body);
+          captured = capture_u32 (reader, body + 12);
+          original = capture_u32 (reader, body + 16);
+
+          if (interface >= (dbus_uint32_t) reader->n_interfaces)
+            capture_fail (reader, "packet on an undescribed interface");
+
+          if (!reader->is_dbus[interface])
+            continue;
+
+          if (captured != original || 20 + (size_t) captured > body_length)
+            capture_fail (reader, "message was truncated when captured");
+
+          ts = ((dbus_uint64_t) capture_u32 (reader, body + 4)) << 32 |
+               capture_u32 (reader, body + 8);
+          *timestamp_ns = pcapng_timestamp_ns (ts, reader->tsresol[interface]);
+          *data = body + 20;
+          *len = captured;
+          return TRUE;
+        }
+
+      /* anything else is of no interest */
+    }
+}
+
+static void
+capture_close (CaptureReader *reader)
+{
+  fclose (reader->file);
+  free (reader->data);
+}
+
+/* ---------------------------------------------------------------- */
+/* Replaying */
+
+typedef struct Replay Replay;
+
+typedef struct
+{
+  Replay *replay;
+  char *captured_name;          /* its unique name in the capture */
+  DBusConnection *connection;
+  const char *name;             /* its unique name now */
+  /* serials in the capture of the calls it made that are owed a
+   * reply, to the serials they were sent with */
+  DBusHashTable *serials;
+  /* "SENDER SERIAL" of calls that reached it and are owed a reply */
+  DBusHashTable *calls_received;
+} Client;
+
+struct Replay
+{
+  DBusBusType type;
+  const char *address;
+  DBusHashTable *clients;       /* captured name -> Client */
+  unsigned long replayed;
+  unsigned long skipped;
+  unsigned long received;
+  unsigned long errors_from_bus;
+};
+
+static void replay_pump (Replay *replay);
+
+static dbus_uint64_t
+monotonic_ns (void)
+{
+  long sec, usec;
+
+  _dbus_get_monotonic_time (&sec, &usec);
+  return ((dbus_uint64_t) sec) * 1000000000 + ((dbus_uint64_t) usec) * 1000;
+}
+
+static char *
+call_key (const char    *sender,
+          dbus_uint32_t  serial)
+{
+  size_t len = strlen (sender) + 12;
+  char *key = malloc (len);
+
+  if (key == NULL)
+    tool_oom ("remembering a call");
+
+  snprintf (key, len, "%s %u", sender, serial);
+  return key;
+}
+
+static DBusHandlerResult
+client_filter (DBusConnection *connection,
+               DBusMessage    *message,
+               void           *user_data)
+{
+  Client *client = user_data;
+  Replay *replay = client->replay;
+
+  replay->received++;
+
+  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_METHOD_CALL &&
+      !dbus_message_get_no_reply (message) &&
+      dbus_message_get_sender (message) != NULL &&
+      !_dbus_hash_table_insert_string (client->calls_received,
+                                       call_key (dbus_message_get_sender (message),
+                                                 dbus_message_get_serial (message)),
+                                       client))
+    tool_oom ("remembering a call");
+
+  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR &&
+      dbus_message_has_sender (message, DBUS_SERVICE_DBUS))
+    {
+      replay->errors_from_bus++;
+      VERBOSE (stderr, "error from bus: %s\n",
+               dbus_message_get_error_name (message));
+    }
+
+  if (dbus_message_is_signal (message, DBUS_INTERFACE_LOCAL, "Disconnected"))
+    {
+      fprintf (stderr, "dbus-test-tool replay: disconnected from bus\n");
+      exit (1);
+    }
+
+  /* The replies are in the capture; nothing must be answered here */
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static void
+client_free (void *data)
+{
+  Client *client = data;
+
+  /* the hash table calls this for new entries too */
+  if (client == NULL)
+    return;
+
+  dbus_connection_flush (client->connection);
+  dbus_connection_close (client->connection);
+  dbus_connection_unref (client->connection);
+  _dbus_hash_table_unref (client->serials);
+  _dbus_hash_table_unref (client->calls_received);
+  free (client->captured_name);
+  free (client);
+}
+
+static Client *
+replay_get_client (Replay     *replay,
+                   const char *captured_name)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  Client *client;
+
+  client = _dbus_hash_table_lookup_string (replay->clients, captured_name);
+
+  if (client != NULL)
+    return client;
+
+  client = calloc (1, sizeof (Client));
+
+  if (client == NULL)
+    tool_oom ("adding a client");
+
+  client->captured_name = strdup (captured_name);
+  client->replay = replay;
+  client->serials = _dbus_hash_table_new (DBUS_HASH_INT, NULL, NULL);
+  client->calls_received = _dbus_hash_table_new (DBUS_HASH_STRING, free,
+                                                 NULL);
+
+  if (client->captured_name == NULL || client->serials == NULL ||
+      client->calls_received == NULL)
+    tool_oom ("adding a client");
+
+  if (replay->address != NULL)
+    {
+      client->connection = dbus_connection_open_private (replay->address,
+                                                         &error);
+
+      if (client->connection != NULL &&
+          !dbus_bus_register (client->connection, &error))
+        {
+          dbus_connection_close (client->connection);
+          dbus_connection_unref (client->connection);
+          client->connection = NULL;
+        }
+    }
+  else
+    {
+      client->connection = dbus_bus_get_private (replay->type, &error);
+    }
+
+  if (client->connection == NULL)
+    {
+      fprintf (stderr, "Failed to connect to bus: %s: %s\n",
+               error.name, error.message);
+      exit (1);
+    }
+
+  dbus_connection_set_exit_on_disconnect (client->connection, FALSE);
+  /* answering Peer methods is not up to libdbus either */
+  dbus_connection_set_route_peer_messages (client->connection, TRUE);
+
+  if (!dbus_connection_add_filter (client->connection, client_filter, client,
+                                   NULL))
+    tool_oom ("adding a client");
+
+  client->name = dbus_bus_get_unique_name (client->connection);
+
+  if (!_dbus_hash_table_insert_string (replay->clients, client->captured_name,
+                                       client))
+    tool_oom ("adding a client");
+
+  VERBOSE (stderr, "%s is now %s\n", captured_name, client->name);
+  return client;
+}
+
+/* Sends what is queued and reads what has arrived on every connection,
+ * without waiting */
+static void
+replay_pump (Replay *replay)
+{
+  DBusHashIter iter;
+
+  _dbus_hash_iter_init (replay->clients, &iter);
+
+  while (_dbus_hash_iter_next (&iter))
+    {
+      Client *client = _dbus_hash_iter_get_value (&iter);
+
+      dbus_connection_read_write (client->connection, 0);
+
+      while (dbus_connection_dispatch (client->connection) ==
+             DBUS_DISPATCH_DATA_REMAINS)
+        ;
+    }
+}
+
+/* A reply can only be sent once the call has been delivered, or the
+ * bus rejects it; the bus reads each connection on its own, so being
+ * sent first is not enough */
+static dbus_bool_t
+client_wait_for_call (Client        *client,
+                      const char    *sender,
+                      dbus_uint32_t  serial)
+{
+  char *key = call_key (sender, serial);
+  dbus_uint64_t deadline = 0;
+  dbus_bool_t arrived;
+
+  while (!(arrived = _dbus_hash_table_remove_string (client->calls_received,
+                                                     key)))
+    {
+      dbus_uint64_t now = monotonic_ns ();
+
+      if (deadline == 0)
+        deadline = now + CALL_TIMEOUT_NS;
+      else if (now > deadline)
+        break;
+
+      replay_pump (client->replay);
+      dbus_connection_read_write (client->connection, 1);
+    }
+
+  free (key);
+  return arrived;
+}
+
+static dbus_bool_t
+is_unique_name (const char *name)
+{
+  return name != NULL && name[0] == ':';
+}
+
+static void
+replay_message (Replay              *replay,
+                const unsigned char *data,
+                size_t               len)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  DBusMessage *captured, *message;
+  const char *sender, *destination;
+  Client *client, *peer = NULL;
+  dbus_uint32_t serial;
+  int type;
+
+  captured = dbus_message_demarshal ((const char *) data, len, &error);
+
+  if (captured == NULL)
+    {
+      VERBOSE (stderr, "skipping message: %s\n", error.message);
+      dbus_error_free (&error);
+      replay->skipped++;
+      return;
+    }
+
+  sender = dbus_message_get_sender (captured);
+  destination = dbus_message_get_destination (captured);
+  type = dbus_message_get_type (captured);
+
+  /* The bus says what it has to say for itself; Hello was sent when
+   * the client connected; nobody is made a monitor; and file
+   * descriptors are not captured */
+  if (!is_unique_name (sender) ||
+      dbus_message_is_method_call (captured, DBUS_INTERFACE_DBUS, "Hello") ||
+      dbus_message_has_interface (captured, DBUS_INTERFACE_MONITORING) ||
+      dbus_message_contains_unix_fds (captured))
+    {
+      dbus_message_unref (captured);
+      replay->skipped++;
+      return;
+    }
+
+  client = replay_get_client (replay, sender);
+
+  if (is_unique_name (destination))
+    peer = replay_get_client (replay, destination);
+
+  message = dbus_message_copy (captured);
+
+  if (message == NULL)
+    tool_oom ("copying message");
+
+  if ((peer != NULL && !dbus_message_set_destination (message, peer->name)) ||
+      !dbus_message_set_sender (message, NULL))
+    tool_oom ("copying message");
+
+  if (type == DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+      type == DBUS_MESSAGE_TYPE_ERROR)
+    {
+      void *sent;
+      int reply_serial = (int) dbus_message_get_reply_serial (captured);
+
+      /* the call must have been replayed to be answered */
+      if (peer == NULL ||
+          (sent = _dbus_hash_table_lookup_int (peer->serials,
+                                               reply_serial)) == NULL)
+        {
+          dbus_message_unref (message);
+          dbus_message_unref (captured);
+          replay->skipped++;
+          return;
+        }
+
+      _dbus_hash_table_remove_int (peer->serials, reply_serial);
+
+      if (!client_wait_for_call (client, peer->name,
+                                 (dbus_uint32_t) _DBUS_POINTER_TO_INT (sent)))
+        {
+          VERBOSE (stderr, "call %u from %s never arrived\n",
+                   (dbus_uint32_t) _DBUS_POINTER_TO_INT (sent), peer->name);
+          dbus_message_unref (message);
+          dbus_message_unref (captured);
+          replay->skipped++;
+          return;
+        }
+
+      if (!dbus_message_set_reply_serial (message,
+                                          (dbus_uint32_t) _DBUS_POINTER_TO_INT (sent)))
+        tool_oom ("copying message");
+    }
+
+  if (!dbus_connection_send (client->connection, message, &serial))
+    tool_oom ("sending message");
+
+  if (type == DBUS_MESSAGE_TYPE_METHOD_CALL &&
+      !dbus_message_get_no_reply (captured) &&
+      !_dbus_hash_table_insert_int (client->serials,
+                                    (int) dbus_message_get_serial (captured),
+                                    _DBUS_INT_TO_POINTER ((int) serial)))
+    tool_oom ("remembering serial");
+
+  replay->replayed++;
+  dbus_message_unref (message);
+  dbus_message_unref (captured);
+}
+
+int
+dbus_test_tool_replay (int argc, char **argv)
+{
+  Replay replay;
+  CaptureReader reader;
+  double rate = 1.0;
+  int first_file = 0;
+  int i;
+  dbus_bool_t started = FALSE;
+  dbus_uint64_t first_captured = 0, started_at = 0, elapsed;
+  unsigned long since_pump = 0;
+
+  memset (&replay, 0, sizeof (replay));
+  replay.type = DBUS_BUS_SESSION;
+
+  /* argv[1] is the tool name, so start from 2 */
+
+  for (i = 2; i < argc; i++)
+    {
+      const char *arg = argv[i];
+
+      if (strcmp (arg, "--system") == 0)
+        {
+          replay.type = DBUS_BUS_SYSTEM;
+        }
+      else if (strcmp (arg, "--session") == 0)
+        {
+          replay.type = DBUS_BUS_SESSION;
+        }
+      else if (strstr (arg, "--address=") == arg)
+        {
+          replay.address = arg + strlen ("--address=");
+        }
+      else if (strstr (arg, "--rate=") == arg)
+        {
+          char *end;
+
+          rate = strtod (arg + strlen ("--rate="), &end);
+
+          if (*end != '\0' || rate < 0)
+            usage (2);
+        }
+      else if (strcmp (arg, "--help") == 0)
+        {
+          usage (0);
+        }
+      else if (arg[0] == '-')
+        {
+          usage (2);
+        }
+      else
+        {
+          first_file = i;
+          break;
+        }
+    }
+
+  if (first_file == 0)
+    usage (2);
+
+  replay.clients = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
+                                         client_free);
+
+  if (replay.clients == NULL)
+    tool_oom ("starting");
+
+  for (i = first_file; i < argc; i++)
+    {
+      dbus_uint64_t captured_at;
+      const unsigned char *data;
+      size_t len;
+
+      capture_open (&reader, argv[i]);
+
+      while (capture_next (&reader, &captured_at, &data, &len))
+        {
+          if (!started)
+            {
+              first_captured = captured_at;
+              started_at = monotonic_ns ();
+              started = TRUE;
+            }
+
+          /* Keep to the captured timing, scaled; messages that are
+           * late are sent at once, and the rest catches up */
+          if (rate > 0 && captured_at > first_captured)
+            {
+              dbus_uint64_t due = started_at +
+                (dbus_uint64_t) ((captured_at - first_captured) / rate);
+
+              while (TRUE)
+                {
+                  dbus_uint64_t now;
+
+                  replay_pump (&replay);
+                  since_pump = 0;
+                  now = monotonic_ns ();
+
+                  if (now + 1000000 > due)
+                    break;
+
+                  _dbus_sleep_milliseconds ((due - now) / 1000000 > 10 ?
+                                            10 : (due - now) / 1000000);
+                }
+            }
+          else if (++since_pump >= MESSAGES_PER_PUMP)
+            {
+              replay_pump (&replay);
+              since_pump = 0;
+            }
+
+          replay_message (&replay, data, len);
+        }
+
+      capture_close (&reader);
+    }
+
+  replay_pump (&replay);
+  elapsed = started ? monotonic_ns () - started_at : 0;
+
+  fprintf (stderr,
+           "Replayed %lu messages from %d clients in %lu.%03lu s "
+           "(%lu skipped, %lu received, %lu errors from the bus)\n",
+           replay.replayed, _dbus_hash_table_get_n_entries (replay.clients),
+           (unsigned long) (elapsed / 1000000000),
+           (unsigned long) (elapsed / 1000000 % 1000),
+           replay.skipped, replay.received, replay.errors_from_bus);
+
+  /* closing the connections sends what is still queued */
+  _dbus_hash_table_unref (replay.clients);
+  dbus_shutdown ();
+  return 0;
+}
@@ -52,7 +52,8 @@ static const char *appname;
 static void
 usage (int ecode)
 {
-  fprintf (stderr, "Usage: %s [--help] [--system | --session | --bus=ADDRESS | --peer=ADDRESS] [--dest=NAME] [--type=TYPE] [--print-reply[=literal]] [--reply-timeout=MSEC] <destination object path> <message name> [contents ...]\n", appname);
+  fprintf (stderr, "Usage: %s [--help] [--system | --session | --bus=ADDRESS | --peer=ADDRESS] [--dest=NAME] [--type=TYPE] [--print-reply[=literal]] [--reply-timeout=MSEC] <destination object path> <message name> [contents ...]\n"
+           "       %s [--system | --session | --bus=ADDRESS | --peer=ADDRESS] [--dest=NAME] [--type=TYPE] [--print-reply[=literal]] [--reply-timeout=MSEC] --batch [--batch-window=N] < messages\n", appname, appname);
   exit (ecode);
 }
 
@@ -224,180 +225,124 @@ type_from_name (const char *arg)
   return type;
 }
 
-int
-main (int argc, char *argv[])
+/* Options that describe one message; in batch mode the ones given on
+ * the command line are defaults that each line of input can add to.
+ */
+typedef struct
 {
-  DBusConnection *connection;
-  DBusError error;
-  DBusMessage *message;
+  const char *dest;
+  const char *type_str;
   dbus_bool_t print_reply;
   dbus_bool_t print_reply_literal;
   int reply_timeout;
-  DBusMessageIter iter;
-  int i;
-  DBusBusType type = DBUS_BUS_SESSION;
-  const char *dest = NULL;
-  const char *name = NULL;
-  const char *path = NULL;
-  int message_type = DBUS_MESSAGE_TYPE_SIGNAL;
-  const char *type_str = NULL;
-  const char *address = NULL;
-  int is_bus = FALSE;
-  int session_or_system = FALSE;
+} SendOptions;
 
-  appname = argv[0];
-  
-  if (argc < 3)
-    usage (1);
+/* A method call whose reply has not been printed yet */
+typedef struct
+{
+  DBusPendingCall *pending;
+  dbus_bool_t print_reply_literal;
+} QueuedReply;
 
-  print_reply = FALSE;
-  print_reply_literal = FALSE;
-  reply_timeout = -1;
-  
-  for (i = 1; i < argc && name == NULL; i++)
-    {
-      char *arg = argv[i];
+#define DEFAULT_BATCH_WINDOW 32
 
-      if (strcmp (arg, "--system") == 0)
+static dbus_bool_t
+parse_message_option (const char *arg, SendOptions *opts)
+{
+  if (strncmp (arg, "--print-reply", 13) == 0)
+    {
+      opts->print_reply = TRUE;
+      if (strcmp (arg + 13, "=literal") == 0)
+        opts->print_reply_literal = TRUE;
+      else if (*(arg + 13) != '\0')
         {
-	  type = DBUS_BUS_SYSTEM;
-          session_or_system = TRUE;
+          fprintf (stderr, "invalid value (%s) of \"--print-reply\"\n", arg + 13);
+          usage (1);
         }
-      else if (strcmp (arg, "--session") == 0)
+    }
+  else if (strstr (arg, "--reply-timeout=") == arg)
+    {
+      if (*(strchr (arg, '=') + 1) == '\0')
         {
-	  type = DBUS_BUS_SESSION;
-          session_or_system = TRUE;
+          fprintf (stderr, "\"--reply-timeout=\" requires an MSEC\n");
+          usage (1);
         }
-      else if ((strstr (arg, "--bus=") == arg) || (strstr (arg, "--peer=") == arg) || (strstr (arg, "--address=") == arg))
+      opts->reply_timeout = strtol (strchr (arg, '=') + 1,
+                                    NULL, 10);
+      if (opts->reply_timeout <= 0)
         {
-          if (arg[2] == 'b') /* bus */
-            {
-              is_bus = TRUE;
-            }
-          else if (arg[2] == 'p') /* peer */
-            {
-              is_bus = FALSE;
-            }
-          else /* address; keeping backwards compatibility */
-            {
-              is_bus = FALSE;
-            }
-
-          address = strchr (arg, '=') + 1;
-
-          if (address[0] == '\0')
-            {
-              fprintf (stderr, "\"--peer=\" and \"--bus=\" require an ADDRESS\n");
-              usage (1);
-            }
+          fprintf (stderr, "invalid value (%s) of \"--reply-timeout\"\n",
+                   strchr (arg, '=') + 1);
+          usage (1);
         }
-      else if (strncmp (arg, "--print-reply", 13) == 0)
-	{
-	  print_reply = TRUE;
-	  message_type = DBUS_MESSAGE_TYPE_METHOD_CALL;
-	  if (strcmp (arg + 13, "=literal") == 0)
-	    print_reply_literal = TRUE;
-	  else if (*(arg + 13) != '\0')
-	    {
-	      fprintf (stderr, "invalid value (%s) of \"--print-reply\"\n", arg + 13);
-	      usage (1);
-	    }
-	}
-      else if (strstr (arg, "--reply-timeout=") == arg)
-	{
-	  if (*(strchr (arg, '=') + 1) == '\0')
-	    {
-	      fprintf (stderr, "\"--reply-timeout=\" requires an MSEC\n");
-	      usage (1);
-	    }
-	  reply_timeout = strtol (strchr (arg, '=') + 1,
-				  NULL, 10);
-	  if (reply_timeout <= 0)
-	    {
-	      fprintf (stderr, "invalid value (%s) of \"--reply-timeout\"\n",
-	               strchr (arg, '=') + 1);
-	      usage (1);
-	    }
-	}
-      else if (strstr (arg, "--dest=") == arg)
-	{
-	  if (*(strchr (arg, '=') + 1) == '\0')
-	    {
-	      fprintf (stderr, "\"--dest=\" requires an NAME\n");
-	      usage (1);
-	    }
-	  dest = strchr (arg, '=') + 1;
-	}
-      else if (strstr (arg, "--type=") == arg)
-	type_str = strchr (arg, '=') + 1;
-      else if (!strcmp(arg, "--help"))
-	usage (0);
-      else if (arg[0] == '-')
-	usage (1);
-      else if (path == NULL)
-        path = arg;
-      else /* name == NULL guaranteed by the 'while' loop */
-        name = arg;
     }
-
-  if (name == NULL)
-    usage (1);
-
-  if (session_or_system &&
-      (address != NULL))
+  else if (strstr (arg, "--dest=") == arg)
     {
-      fprintf (stderr, "\"--peer\" and \"--bus\" may not be used with \"--system\" or \"--session\"\n");
-      usage (1);
+      if (*(strchr (arg, '=') + 1) == '\0')
+        {
+          fprintf (stderr, "\"--dest=\" requires an NAME\n");
+          usage (1);
+        }
+      opts->dest = strchr (arg, '=') + 1;
     }
+  else if (strstr (arg, "--type=") == arg)
+    opts->type_str = strchr (arg, '=') + 1;
+  else
+    return FALSE;
+
+  return TRUE;
+}
+
+/* Checks the options and returns the type of message they ask for;
+ * --print-reply implies a method call unless --type says otherwise.
+ */
+static int
+check_message_options (const SendOptions *opts)
+{
+  int message_type;
+  DBusError error;
 
-  if (type_str != NULL)
+  if (opts->type_str != NULL)
     {
-      message_type = dbus_message_type_from_string (type_str);
+      message_type = dbus_message_type_from_string (opts->type_str);
       if (!(message_type == DBUS_MESSAGE_TYPE_METHOD_CALL ||
             message_type == DBUS_MESSAGE_TYPE_SIGNAL))
         {
           fprintf (stderr, "Message type \"%s\" is not supported\n",
-                   type_str);
+                   opts->type_str);
           exit (1);
         }
     }
-  
+  else if (opts->print_reply)
+    message_type = DBUS_MESSAGE_TYPE_METHOD_CALL;
+  else
+    message_type = DBUS_MESSAGE_TYPE_SIGNAL;
+
   dbus_error_init (&error);
 
-  if (dest && !dbus_validate_bus_name (dest, &error))
+  if (opts->dest && !dbus_validate_bus_name (opts->dest, &error))
     {
-      fprintf (stderr, "invalid value (%s) of \"--dest\"\n", dest);
+      fprintf (stderr, "invalid value (%s) of \"--dest\"\n", opts->dest);
       usage (1);
     }
 
-  if (address != NULL)
-    {
-      connection = dbus_connection_open (address, &error);
-    }
-  else
-    {
-      connection = dbus_bus_get (type, &error);
-    }
+  return message_type;
+}
 
-  if (connection == NULL)
-    {
-      fprintf (stderr, "Failed to open connection to \"%s\" message bus: %s\n",
-               (address != NULL) ? address :
-                 ((type == DBUS_BUS_SYSTEM) ? "system" : "session"),
-               error.message);
-      dbus_error_free (&error);
-      exit (1);
-    }
-  else if ((address != NULL) && is_bus)
-    {
-      if (!dbus_bus_register (connection, &error))
-        {
-          fprintf (stderr, "Failed to register on connection to \"%s\" message bus: %s\n",
-                   address, error.message);
-          dbus_error_free (&error);
-          exit (1);
-        }
-    }
+/* Builds the message described by path, name and the contents in
+ * argv[i..argc-1]. name and the contents are modified in place.
+ */
+static DBusMessage *
+build_message (const SendOptions *opts,
+               int                message_type,
+               const char        *path,
+               char              *name,
+               int                argc,
+               char              *argv[],
+               int                i)
+{
+  DBusMessage *message;
+  DBusMessageIter iter;
 
   if (message_type == DBUS_MESSAGE_TYPE_METHOD_CALL)
     {
@@ -445,7 +390,7 @@ main (int argc, char *argv[])
       exit (1);
     }
 
-  if (dest && !dbus_message_set_destination (message, dest))
+  if (opts->dest && !dbus_message_set_destination (message, opts->dest))
     {
       fprintf (stderr, "Not enough memory\n");
       exit (1);
@@ -469,7 +414,7 @@ main (int argc, char *argv[])
 
       if (c == NULL)
 	{
-	  fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", argv[0], arg);
+	  fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", appname, arg);
 	  exit (1);
 	}
 
@@ -490,7 +435,7 @@ main (int argc, char *argv[])
 	  c = strchr (arg, ':');
 	  if (c == NULL)
 	    {
-	      fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", argv[0], arg);
+	      fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", appname, arg);
 	      exit (1);
 	    }
 	  *(c++) = 0;
@@ -508,7 +453,7 @@ main (int argc, char *argv[])
 	  c = strchr (c, ':');
 	  if (c == NULL)
 	    {
-	      fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", argv[0], arg);
+	      fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", appname, arg);
 	      exit (1);
 	    }
 	  *(c++) = 0;
@@ -556,13 +501,476 @@ main (int argc, char *argv[])
 	}
     }
 
-  if (print_reply)
+  return message;
+}
+
+/* Reads one line of any length, without its newline; returns NULL at
+ * end of input.
+ */
+static char *
+read_line (FILE *f)
+{
+  char *line = NULL;
+  size_t allocated = 0;
+  size_t len = 0;
+
+  for (;;)
+    {
+      if (allocated - len < 2)
+        {
+          char *grown;
+
+          allocated = allocated ? allocated * 2 : 256;
+          grown = realloc (line, allocated);
+          if (grown == NULL)
+            {
+              fprintf (stderr, "Not enough memory\n");
+              exit (1);
+            }
+          line = grown;
+        }
+
+      if (fgets (line + len, allocated - len, f) == NULL)
+        break;
+
+      len += strlen (line + len);
+
+      if (len > 0 && line[len - 1] == '\n')
+        {
+          line[--len] = '\0';
+          return line;
+        }
+    }
+
+  if (len == 0)
+    {
+      free (line);
+      return NULL;
+    }
+
+  return line;
+}
+
+/* Splits a line into words in place, the way a shell would split a
+ * simple command line: words are separated by blanks, and single quotes,
+ * double quotes and backslashes can be used to put blanks in a word.
+ * Returns a NULL-terminated array pointing into line, or NULL on
+ * unbalanced quotes.
+ */
+static char **
+split_line (char *line, int *n_words)
+{
+  char **words;
+  char *in = line;
+  char *out = line;
+  int n = 0;
+
+  /* A line of n characters holds at most n/2 + 1 words */
+  words = malloc ((strlen (line) / 2 + 2) * sizeof (char *));
+  if (words == NULL)
+    {
+      fprintf (stderr, "Not enough memory\n");
+      exit (1);
+    }
+
+  for (;;)
+    {
+      while (*in == ' ' || *in == '\t' || *in == '\r')
+        in++;
+
+      if (*in == '\0')
+        break;
+
+      words[n++] = out;
+
+      while (*in != '\0' && *in != ' ' && *in != '\t' && *in != '\r')
+        {
+          if (*in == '\'')
+            {
+              in++;
+              while (*in != '\0' && *in != '\'')
+                *out++ = *in++;
+              if (*in++ == '\0')
+                goto unbalanced;
+            }
+          else if (*in == '"')
+            {
+              in++;
+              while (*in != '\0' && *in != '"')
+                {
+                  if (*in == '\\' && (in[1] == '"' || in[1] == '\\'))
+                    in++;
+                  *out++ = *in++;
+                }
+              if (*in++ == '\0')
+                goto unbalanced;
+            }
+          else if (*in == '\\' && in[1] != '\0')
+            {
+              in++;
+              *out++ = *in++;
+            }
+          else
+            {
+              *out++ = *in++;
+            }
+        }
+
+      /* Unquoting only ever shrinks a word, so the terminator lands at
+       * or before the blank that ended it */
+      if (*in != '\0')
+        in++;
+      *out++ = '\0';
+    }
+
+  words[n] = NULL;
+  *n_words = n;
+  return words;
+
+unbalanced:
+  free (words);
+  return NULL;
+}
+
+/* Waits for the oldest queued reply and prints it; returns FALSE if it
+ * was an error.
+ */
+static dbus_bool_t
+print_queued_reply (QueuedReply *queued)
+{
+  DBusMessage *reply;
+  DBusError error;
+  dbus_bool_t ok = TRUE;
+
+  dbus_pending_call_block (queued->pending);
+  reply = dbus_pending_call_steal_reply (queued->pending);
+  dbus_pending_call_unref (queued->pending);
+  queued->pending = NULL;
+
+  dbus_error_init (&error);
+
+  if (dbus_set_error_from_message (&error, reply))
+    {
+      fprintf (stderr, "Error %s: %s\n",
+               error.name,
+               error.message);
+      dbus_error_free (&error);
+      ok = FALSE;
+    }
+  else
+    {
+      long sec, usec;
+
+      _dbus_get_real_time (&sec, &usec);
+      print_message (reply, queued->print_reply_literal, sec, usec);
+    }
+
+  dbus_message_unref (reply);
+  return ok;
+}
+
+/* Sends one message per line of standard input on a single connection.
+ * Up to window method calls can be waiting for their replies at once;
+ * replies are printed in the order the calls were read. Returns the
+ * exit status.
+ */
+static int
+send_batch (DBusConnection   *connection,
+            const SendOptions *defaults,
+            int                window)
+{
+  QueuedReply *queue;
+  int head = 0;
+  int n_queued = 0;
+  int line_number = 0;
+  int status = 0;
+  char *line;
+
+  queue = calloc (window, sizeof (QueuedReply));
+  if (queue == NULL)
+    {
+      fprintf (stderr, "Not enough memory\n");
+      exit (1);
+    }
+
+  while ((line = read_line (stdin)) != NULL)
+    {
+      SendOptions opts = *defaults;
+      DBusMessage *message;
+      const char *path = NULL;
+      char *name = NULL;
+      char **words;
+      int n_words;
+      int message_type;
+      int i;
+
+      line_number++;
+
+      words = split_line (line, &n_words);
+      if (words == NULL)
+        {
+          fprintf (stderr, "%s: line %d: unbalanced quotes\n",
+                   appname, line_number);
+          exit (1);
+        }
+
+      /* Blank lines and comments */
+      if (n_words == 0 || words[0][0] == '#')
+        {
+          free (words);
+          free (line);
+          continue;
+        }
+
+      for (i = 0; i < n_words && name == NULL; i++)
+        {
+          char *arg = words[i];
+
+          if (parse_message_option (arg, &opts))
+            continue;
+          else if (arg[0] == '-')
+            {
+              fprintf (stderr, "%s: line %d: option \"%s\" is not allowed in batch input\n",
+                       appname, line_number, arg);
+              exit (1);
+            }
+          else if (path == NULL)
+            path = arg;
+          else
+            name = arg;
+        }
+
+      if (name == NULL)
+        {
+          fprintf (stderr, "%s: line %d: expected <destination object path> <message name> [contents ...]\n",
+                   appname, line_number);
+          exit (1);
+        }
+
+      message_type = check_message_options (&opts);
+      message = build_message (&opts, message_type, path, name,
+                               n_words, words, i);
+
+      /* Signals never get a reply, so there is nothing to wait for */
+      if (opts.print_reply && message_type == DBUS_MESSAGE_TYPE_METHOD_CALL)
+        {
+          QueuedReply *queued;
+
+          /* Make room by printing the oldest reply */
+          if (n_queued == window)
+            {
+              if (!print_queued_reply (&queue[head]))
+                status = 1;
+              head = (head + 1) % window;
+              n_queued--;
+            }
+
+          queued = &queue[(head + n_queued) % window];
+
+          if (!dbus_connection_send_with_reply (connection, message,
+                                                &queued->pending,
+                                                opts.reply_timeout))
+            {
+              fprintf (stderr, "Not enough memory\n");
+              exit (1);
+            }
+
+          if (queued->pending == NULL)
+            {
+              fprintf (stderr, "Error %s: %s\n", DBUS_ERROR_DISCONNECTED,
+                       "Connection was disconnected before a reply was received");
+              exit (1);
+            }
+
+          queued->print_reply_literal = opts.print_reply_literal;
+          n_queued++;
+        }
+      else if (!dbus_connection_send (connection, message, NULL))
+        {
+          fprintf (stderr, "Not enough memory\n");
+          exit (1);
+        }
+
+      dbus_message_unref (message);
+      free (words);
+      free (line);
+
+      /* Get the message on its way without waiting for the next line,
+       * and deal with whatever has come back so far. Replies to calls
+       * that are still queued are kept by their pending call; anything
+       * else, such as replies that nobody asked to print, is dropped.
+       */
+      dbus_connection_read_write (connection, 0);
+      while (dbus_connection_dispatch (connection) == DBUS_DISPATCH_DATA_REMAINS)
+        ;
+    }
+
+  while (n_queued > 0)
+    {
+      if (!print_queued_reply (&queue[head]))
+        status = 1;
+      head = (head + 1) % window;
+      n_queued--;
+    }
+
+  dbus_connection_flush (connection);
+  free (queue);
+  return status;
+}
+
+int
+main (int argc, char *argv[])
+{
+  DBusConnection *connection;
+  DBusError error;
+  DBusMessage *message;
+  SendOptions opts;
+  int i;
+  DBusBusType type = DBUS_BUS_SESSION;
+  char *name = NULL;
+  const char *path = NULL;
+  int message_type;
+  const char *address = NULL;
+  int is_bus = FALSE;
+  int session_or_system = FALSE;
+  dbus_bool_t batch = FALSE;
+  int batch_window = DEFAULT_BATCH_WINDOW;
+
+  appname = argv[0];
+  
+  if (argc < 2)
+    usage (1);
+
+  memset (&opts, 0, sizeof (opts));
+  opts.reply_timeout = -1;
+  
+  for (i = 1; i < argc && name == NULL; i++)
+    {
+      char *arg = argv[i];
+
+      if (strcmp (arg, "--system") == 0)
+        {
+	  type = DBUS_BUS_SYSTEM;
+          session_or_system = TRUE;
+        }
+      else if (strcmp (arg, "--session") == 0)
+        {
+	  type = DBUS_BUS_SESSION;
+          session_or_system = TRUE;
+        }
+      else if ((strstr (arg, "--bus=") == arg) || (strstr (arg, "--peer=") == arg) || (strstr (arg, "--address=") == arg))
+        {
+          if (arg[2] == 'b') /* bus */
+            {
+              is_bus = TRUE;
+            }
+          else if (arg[2] == 'p') /* peer */
+            {
+              is_bus = FALSE;
+            }
+          else /* address; keeping backwards compatibility */
+            {
+              is_bus = FALSE;
+            }
+
+          address = strchr (arg, '=') + 1;
+
+          if (address[0] == '\0')
+            {
+              fprintf (stderr, "\"--peer=\" and \"--bus=\" require an ADDRESS\n");
+              usage (1);
+            }
+        }
+      else if (parse_message_option (arg, &opts))
+        ;
+      else if (strcmp (arg, "--batch") == 0)
+        batch = TRUE;
+      else if (strstr (arg, "--batch-window=") == arg)
+        {
+          batch_window = strtol (strchr (arg, '=') + 1, NULL, 10);
+          if (batch_window <= 0)
+            {
+              fprintf (stderr, "invalid value (%s) of \"--batch-window\"\n",
+                       strchr (arg, '=') + 1);
+              usage (1);
+            }
+        }
+      else if (!strcmp(arg, "--help"))
+	usage (0);
+      else if (arg[0] == '-')
+	usage (1);
+      else if (batch)
+        {
+          fprintf (stderr, "\"--batch\" reads messages from standard input and takes no object path or message name\n");
+          usage (1);
+        }
+      else if (path == NULL)
+        path = arg;
+      else /* name == NULL guaranteed by the 'while' loop */
+        name = arg;
+    }
+
+  if (name == NULL && !batch)
+    usage (1);
+
+  if (session_or_system &&
+      (address != NULL))
+    {
+      fprintf (stderr, "\"--peer\" and \"--bus\" may not be used with \"--system\" or \"--session\"\n");
+      usage (1);
+    }
+
+  message_type = check_message_options (&opts);
+  
+  dbus_error_init (&error);
+
+  if (address != NULL)
+    {
+      connection = dbus_connection_open (address, &error);
+    }
+  else
+    {
+      connection = dbus_bus_get (type, &error);
+    }
+
+  if (connection == NULL)
+    {
+      fprintf (stderr, "Failed to open connection to \"%s\" message bus: %s\n",
+               (address != NULL) ? address :
+                 ((type == DBUS_BUS_SYSTEM) ? "system" : "session"),
+               error.message);
+      dbus_error_free (&error);
+      exit (1);
+    }
+  else if ((address != NULL) && is_bus)
+    {
+      if (!dbus_bus_register (connection, &error))
+        {
+          fprintf (stderr, "Failed to register on connection to \"%s\" message bus: %s\n",
+                   address, error.message);
+          dbus_error_free (&error);
+          exit (1);
+        }
+    }
+
+  if (batch)
+    {
+      int status;
+
+      status = send_batch (connection, &opts, batch_window);
+      dbus_connection_unref (connection);
+      exit (status);
+    }
+
+  message = build_message (&opts, message_type, path, name, argc, argv, i);
+
+  if (opts.print_reply)
     {
       DBusMessage *reply;
 
       dbus_error_init (&error);
       reply = dbus_connection_send_with_reply_and_block (connection,
-                                                         message, reply_timeout,
+                                                         message, opts.reply_timeout,
                                                          &error);
       if (dbus_error_is_set (&error))
         {
@@ -577,7 +985,7 @@ main (int argc, char *argv[])
           long sec, usec;
 
           _dbus_get_real_time (&sec, &usec);
-          print_message (reply, print_reply_literal, sec, usec);
+          print_message (reply, opts.print_reply_literal, sec, usec);
           dbus_message_unref (reply);
         }
     }